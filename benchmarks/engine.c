@@ -0,0 +1,324 @@
+/*
+ * Benchmark driver for the storage engine, using sophia.h directly.
+ *
+ * Runs point, range, transaction and recovery workloads against a fresh
+ * environment and prints the results as JSON, with client latency
+ * percentiles and the engine latency histograms for each workload.
+ *
+ * Build and run:
+ *
+ *   cc -O2 -Isrc benchmarks/engine.c src/sophia.c -lpthread -o sophia-bench
+ *   ./sophia-bench [rows [sync_ops]] > engine.json
+*/
+
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <ftw.h>
+
+#include "sophia.h"
+
+#define BENCH_DIR "sophia-bench"
+
+enum {
+	KEY_U64,
+	KEY_STRING
+};
+
+typedef struct {
+	void   *env;
+	void   *db;
+	int     key_type;
+	double *samples;
+	int     count;
+} bench;
+
+static int results = 0;
+static char value[100];
+
+static double
+now(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+static int
+unlink_cb(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+	(void)st;
+	(void)flag;
+	(void)ftw;
+	return remove(path);
+}
+
+static void
+cleanup(void)
+{
+	nftw(BENCH_DIR, unlink_cb, 64, FTW_DEPTH | FTW_PHYS);
+}
+
+static void
+check(void *env, int rc, const char *what)
+{
+	if (rc == 0)
+		return;
+	char *error = sp_getstring(env, "sophia.error", NULL);
+	fprintf(stderr, "%s: %s\n", what, error ? error : "unknown error");
+	exit(1);
+}
+
+static void
+bench_open(bench *b, int key_type, int sync)
+{
+	b->key_type = key_type;
+	b->env = sp_env();
+	sp_setstring(b->env, "sophia.path", BENCH_DIR, 0);
+	sp_setint(b->env, "log.sync", sync);
+	sp_setstring(b->env, "db", "main", 0);
+	sp_setstring(b->env, "db.main.scheme", "key", 0);
+	sp_setstring(b->env, "db.main.scheme.key",
+	             key_type == KEY_U64 ? "u64,key(0)" : "string,key(0)", 0);
+	sp_setstring(b->env, "db.main.scheme", "value", 0);
+	sp_setstring(b->env, "db.main.scheme.value", "string", 0);
+	check(b->env, sp_open(b->env), "open");
+	b->db = sp_getobject(b->env, "db.main");
+}
+
+static void
+bench_close(bench *b)
+{
+	sp_destroy(b->env);
+	b->env = NULL;
+	b->db = NULL;
+}
+
+static void
+setkey(bench *b, void *o, uint64_t key)
+{
+	if (b->key_type == KEY_U64) {
+		sp_setint(o, "key", key);
+	} else {
+		char sz[32];
+		int len = snprintf(sz, sizeof(sz), "%016llu",
+		                   (unsigned long long)key);
+		sp_setstring(o, "key", sz, len);
+	}
+}
+
+static int
+cmpdouble(const void *a, const void *b)
+{
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+static double
+percentile(double *samples, int count, double q)
+{
+	int pos = (int)(q * count);
+	if (pos >= count)
+		pos = count - 1;
+	return samples[pos] * 1e6;
+}
+
+static void
+report_hist(void *env, const char *name, const char *key)
+{
+	char *sz = sp_getstring(env, key, NULL);
+	printf(",\n      \"%s\": \"%s\"", name, sz ? sz : "");
+	free(sz);
+}
+
+static void
+report(bench *b, const char *name, int ops, double elapsed)
+{
+	printf("%s\n    {\"name\": \"%s\", \"schema\": \"%s\", \"ops\": %d, "
+	       "\"seconds\": %f, \"ops_per_sec\": %f",
+	       results++ ? "," : "", name,
+	       b->key_type == KEY_U64 ? "u64" : "string",
+	       ops, elapsed, ops / elapsed);
+	if (b->count > 0) {
+		qsort(b->samples, b->count, sizeof(double), cmpdouble);
+		printf(",\n     \"latency_us\": {\"p50\": %.2f, \"p90\": %.2f, "
+		       "\"p99\": %.2f, \"p999\": %.2f, \"max\": %.2f}",
+		       percentile(b->samples, b->count, 0.5),
+		       percentile(b->samples, b->count, 0.9),
+		       percentile(b->samples, b->count, 0.99),
+		       percentile(b->samples, b->count, 0.999),
+		       b->samples[b->count - 1] * 1e6);
+	}
+	/* engine histograms: count p50 p90 p99 p999 max */
+	printf(",\n     \"stats\": {\"_format\": \"count p50 p90 p99 p999 max\"");
+	report_hist(b->env, "get", "db.main.stat.get_hist");
+	report_hist(b->env, "get_memory", "db.main.stat.get_memory_hist");
+	report_hist(b->env, "get_disk", "db.main.stat.get_disk_hist");
+	report_hist(b->env, "set", "db.main.stat.set_hist");
+	report_hist(b->env, "cursor", "db.main.stat.cursor_hist");
+	report_hist(b->env, "pread", "db.main.stat.pread_hist");
+	report_hist(b->env, "log_write", "log.write_hist");
+	report_hist(b->env, "log_sync", "log.sync_hist");
+	report_hist(b->env, "commit", "transaction.commit_hist");
+	printf("}}");
+	b->count = 0;
+}
+
+static void
+shuffle(uint64_t *keys, int count)
+{
+	int i;
+	for (i = count - 1; i > 0; i--) {
+		int j = rand() % (i + 1);
+		uint64_t tmp = keys[i];
+		keys[i] = keys[j];
+		keys[j] = tmp;
+	}
+}
+
+static void
+run_set(bench *b, const char *name, uint64_t *keys, int count)
+{
+	double start = now();
+	int i;
+	for (i = 0; i < count; i++) {
+		double t = now();
+		void *o = sp_document(b->db);
+		setkey(b, o, keys[i]);
+		sp_setstring(o, "value", value, sizeof(value));
+		check(b->env, sp_set(b->db, o), "set");
+		b->samples[b->count++] = now() - t;
+	}
+	report(b, name, count, now() - start);
+}
+
+static void
+run_get(bench *b, const char *name, uint64_t *keys, int count)
+{
+	double start = now();
+	int i;
+	for (i = 0; i < count; i++) {
+		double t = now();
+		void *o = sp_document(b->db);
+		setkey(b, o, keys[i]);
+		o = sp_get(b->db, o);
+		if (o)
+			sp_destroy(o);
+		b->samples[b->count++] = now() - t;
+	}
+	report(b, name, count, now() - start);
+}
+
+static void
+run_range(bench *b, int rows)
+{
+	int scans = rows / 100 > 0 ? rows / 100 : 1;
+	double start = now();
+	int i;
+	for (i = 0; i < scans; i++) {
+		double t = now();
+		void *c = sp_cursor(b->env);
+		void *o = sp_document(b->db);
+		setkey(b, o, rand() % rows);
+		int n = 0;
+		while (n < 100 && (o = sp_get(c, o)))
+			n++;
+		if (o)
+			sp_destroy(o);
+		sp_destroy(c);
+		b->samples[b->count++] = now() - t;
+	}
+	report(b, "range", scans, now() - start);
+}
+
+static void
+run_commit(bench *b, const char *name, int count)
+{
+	double start = now();
+	int i, j;
+	for (i = 0; i < count; i++) {
+		double t = now();
+		void *tx = sp_begin(b->env);
+		for (j = 0; j < 10; j++) {
+			void *o = sp_document(b->db);
+			setkey(b, o, (uint64_t)i * 10 + j);
+			sp_setstring(o, "value", value, sizeof(value));
+			check(b->env, sp_set(tx, o), "set");
+		}
+		check(b->env, sp_commit(tx) == -1, "commit");
+		b->samples[b->count++] = now() - t;
+	}
+	report(b, name, count, now() - start);
+}
+
+int
+main(int argc, char *argv[])
+{
+	int rows = argc > 1 ? atoi(argv[1]) : 100000;
+	int sync_ops = argc > 2 ? atoi(argv[2]) : 500;
+	if (rows < 100)
+		rows = 100;
+	memset(value, 'v', sizeof(value));
+	srand(0);
+
+	uint64_t *seq = malloc(sizeof(uint64_t) * rows);
+	uint64_t *shuffled = malloc(sizeof(uint64_t) * rows);
+	bench b;
+	memset(&b, 0, sizeof(b));
+	b.samples = malloc(sizeof(double) * rows);
+	if (seq == NULL || shuffled == NULL || b.samples == NULL)
+		return 1;
+	int i;
+	for (i = 0; i < rows; i++)
+		seq[i] = i;
+	memcpy(shuffled, seq, sizeof(uint64_t) * rows);
+	shuffle(shuffled, rows);
+
+	printf("{\"rows\": %d, \"results\": [", rows);
+	int key_type;
+	for (key_type = KEY_U64; key_type <= KEY_STRING; key_type++) {
+		cleanup();
+		bench_open(&b, key_type, 0);
+		run_set(&b, "set_seq", seq, rows);
+		run_get(&b, "get_seq", seq, rows);
+		bench_close(&b);
+
+		cleanup();
+		bench_open(&b, key_type, 0);
+		run_set(&b, "set_random", shuffled, rows);
+		run_get(&b, "get_random", shuffled, rows);
+		run_range(&b, rows);
+		bench_close(&b);
+
+		/* recovery replays every row from the log */
+		double start = now();
+		bench_open(&b, key_type, 0);
+		report(&b, "reopen", 1, now() - start);
+		bench_close(&b);
+	}
+
+	cleanup();
+	bench_open(&b, KEY_U64, 0);
+	run_commit(&b, "commit", rows / 10);
+	bench_close(&b);
+
+	cleanup();
+	bench_open(&b, KEY_U64, 1);
+	run_commit(&b, "commit_sync", sync_ops < rows ? sync_ops : rows);
+	bench_close(&b);
+	cleanup();
+	printf("\n]}\n");
+
+	free(b.samples);
+	free(shuffled);
+	free(seq);
+	return 0;
+}
@@ -0,0 +1,81 @@
+"""
+Compare the in-memory index implementations selected by ``Database.memtable``.
+
+Rows are written with the log and background scheduler disabled, so every set
+and get is served by the in-memory index of a single node. The ``btree``
+memtable compares a 64-bit key prefix before falling back to the full
+comparator, which helps most with integer keys and with string keys that do
+not share a long common prefix.
+
+Usage:
+
+    python benchmarks/memtable.py [--rows N]
+"""
+import argparse
+import os
+import random
+import shutil
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+from sophy import *
+
+
+BENCH_DIR = 'sophia-bench'
+
+
+def cleanup():
+    if os.path.exists(BENCH_DIR):
+        shutil.rmtree(BENCH_DIR)
+
+
+def open_env(memtable, index):
+    env = Sophia(BENCH_DIR)
+    env.log_enable = 0
+    env.scheduler_threads = 0
+    db = env.add_database('main', Schema(index('key'), BytesIndex('value')))
+    db.memtable = memtable
+    assert env.open()
+    return env, db
+
+
+def bench(memtable, index, keys):
+    cleanup()
+    env, db = open_env(memtable, index)
+    value = b'v' * 32
+    put = db.set
+    start = time.time()
+    for key in keys:
+        put(key, value)
+    set_s = len(keys) / (time.time() - start)
+
+    get = db.get
+    start = time.time()
+    for key in keys:
+        get(key)
+    get_s = len(keys) / (time.time() - start)
+    env.close()
+    cleanup()
+    return set_s, get_s
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--rows', type=int, default=500000)
+    options = parser.parse_args()
+
+    rnd = random.Random(0)
+    u64_keys = [rnd.getrandbits(63) for _ in range(options.rows)]
+    str_keys = ['%016x' % key for key in u64_keys]
+    for name, index, keys in (('u64', U64Index, u64_keys),
+                              ('string', StringIndex, str_keys)):
+        for memtable in ('rbtree', 'btree'):
+            set_s, get_s = bench(memtable, index, keys)
+            print('%-8s memtable=%-8s set %10.0f ops/s  get %10.0f ops/s' %
+                  (name, memtable, set_s, get_s))
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,314 @@
+"""
+Benchmark suite for sophy and the storage engine.
+
+Each workload runs against a fresh environment and reports throughput, client
+latency percentiles (measured around every Python call) and a snapshot of the
+engine statistics from ``Sophia.stats()``. Results are written as JSON, so
+runs of two versions can be compared with any JSON tooling.
+
+Workloads:
+
+* ``set_seq``, ``set_random``, ``get_seq``, ``get_random``: point operations
+  on U64 and String key schemas.
+* ``multikey_set``, ``multikey_get``: composite (U64, String) keys.
+* ``serialized_set``, ``serialized_get``: msgpack-serialized values.
+* ``range``: ``get_range`` scans of 100 keys.
+* ``commit``, ``commit_sync``: 10-statement transactions with ``log.sync``
+  off and on.
+* ``upsert``: counter increments using the ``add`` upsert operator.
+* ``mixed``: 80% reads, 20% writes while checkpoint compaction is running.
+* ``reopen``: time to close and recover the environment.
+
+Usage:
+
+    python benchmarks/suite.py [--rows N] [--only name,...] [--output F]
+
+``benchmarks/engine.c`` covers the same point and range workloads through
+``sophia.h`` directly, without the Python wrapper.
+"""
+import argparse
+import json
+import os
+import random
+import shutil
+import sys
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+from sophy import *
+
+
+BENCH_DIR = 'sophia-bench'
+
+
+def cleanup():
+    if os.path.exists(BENCH_DIR):
+        shutil.rmtree(BENCH_DIR)
+
+
+def open_env(schema, sync=0, configure=None):
+    env = Sophia(BENCH_DIR)
+    env.log_sync = sync
+    db = env.add_database('main', schema)
+    if configure is not None:
+        configure(env, db)
+    assert env.open()
+    return env, db
+
+
+def percentiles(samples):
+    samples = sorted(samples)
+    if not samples:
+        return {}
+    def at(q):
+        return samples[min(len(samples) - 1, int(q * len(samples)))]
+    return {
+        'p50': at(0.5) * 1e6,
+        'p90': at(0.9) * 1e6,
+        'p99': at(0.99) * 1e6,
+        'p999': at(0.999) * 1e6,
+        'max': samples[-1] * 1e6}
+
+
+def timed(fn, args):
+    clock = time.perf_counter
+    samples = []
+    append = samples.append
+    start = clock()
+    for arg in args:
+        t = clock()
+        fn(arg)
+        append(clock() - t)
+    return clock() - start, samples
+
+
+def result(name, env, ops, elapsed, samples=None, **extra):
+    data = {
+        'name': name,
+        'ops': ops,
+        'seconds': elapsed,
+        'ops_per_sec': ops / elapsed if elapsed else 0,
+        'latency_us': percentiles(samples or []),
+        'stats': env.stats()}
+    data.update(extra)
+    return data
+
+
+def u64_schema():
+    return Schema(U64Index('key'), BytesIndex('value'))
+
+
+def string_schema():
+    return Schema(StringIndex('key'), BytesIndex('value'))
+
+
+def key_sets(rows):
+    rnd = random.Random(0)
+    seq = list(range(rows))
+    shuffled = seq[:]
+    rnd.shuffle(shuffled)
+    return {
+        'u64': (u64_schema, seq, shuffled),
+        'string': (string_schema,
+                   ['%016d' % k for k in seq],
+                   ['%016d' % k for k in shuffled])}
+
+
+def bench_point(options):
+    results = []
+    value = b'v' * options.value_size
+    for kind, (schema, seq, shuffled) in sorted(key_sets(options.rows).items()):
+        for order, keys in (('seq', seq), ('random', shuffled)):
+            cleanup()
+            env, db = open_env(schema())
+            put = db.set
+            elapsed, samples = timed(lambda k: put(k, value), keys)
+            results.append(result('set_%s' % order, env, len(keys), elapsed,
+                                  samples, schema=kind))
+            get = db.get
+            elapsed, samples = timed(get, keys)
+            results.append(result('get_%s' % order, env, len(keys), elapsed,
+                                  samples, schema=kind))
+            env.close()
+    return results
+
+
+def bench_multikey(options):
+    cleanup()
+    schema = Schema([U64Index('a'), StringIndex('b')], [BytesIndex('value')])
+    env, db = open_env(schema)
+    rnd = random.Random(0)
+    keys = [(rnd.randrange(1000), 'k%08d' % i) for i in range(options.rows)]
+    value = b'v' * options.value_size
+    put = db.set
+    elapsed, samples = timed(lambda k: put(k, value), keys)
+    results = [result('multikey_set', env, len(keys), elapsed, samples)]
+    elapsed, samples = timed(db.get, keys)
+    results.append(result('multikey_get', env, len(keys), elapsed, samples))
+    env.close()
+    return results
+
+
+def bench_serialized(options):
+    cleanup()
+    env, db = open_env(Schema(U64Index('key'), MsgPackIndex('value')))
+    keys = list(range(options.rows))
+    random.Random(0).shuffle(keys)
+    value = {'name': 'x' * 16, 'tags': ['a', 'b', 'c'], 'count': 1}
+    put = db.set
+    elapsed, samples = timed(lambda k: put(k, value), keys)
+    results = [result('serialized_set', env, len(keys), elapsed, samples)]
+    elapsed, samples = timed(db.get, keys)
+    results.append(result('serialized_get', env, len(keys), elapsed, samples))
+    env.close()
+    return results
+
+
+def bench_range(options):
+    cleanup()
+    env, db = open_env(u64_schema())
+    value = b'v' * options.value_size
+    with env.transaction() as txn:
+        tdb = txn[db]
+        for i in range(options.rows):
+            tdb[i] = value
+    rnd = random.Random(0)
+    scans = max(1, options.rows // 100)
+    starts = [rnd.randrange(max(1, options.rows - 100)) for _ in range(scans)]
+    get_range = db.get_range
+    elapsed, samples = timed(lambda k: list(get_range(k, k + 99)), starts)
+    data = result('range', env, scans, elapsed, samples,
+                  keys_per_sec=scans * 100 / elapsed)
+    env.close()
+    return [data]
+
+
+def bench_commit(options):
+    results = []
+    value = b'v' * options.value_size
+    for name, sync, count in (('commit', 0, options.rows // 10),
+                              ('commit_sync', 1, options.sync_ops)):
+        cleanup()
+        env, db = open_env(u64_schema(), sync=sync)
+        def commit(i):
+            with env.transaction() as txn:
+                tdb = txn[db]
+                for j in range(10):
+                    tdb[i * 10 + j] = value
+        elapsed, samples = timed(commit, range(count))
+        results.append(result(name, env, count, elapsed, samples))
+        env.close()
+    return results
+
+
+def bench_upsert(options):
+    cleanup()
+    def configure(env, db):
+        db.upsert_operator = 'add'
+    env, db = open_env(Schema(U64Index('key'), U64Index('value')),
+                       configure=configure)
+    rnd = random.Random(0)
+    keys = [rnd.randrange(1000) for _ in range(options.rows)]
+    upsert = db.upsert
+    elapsed, samples = timed(lambda k: upsert(k, 1), keys)
+    data = result('upsert', env, len(keys), elapsed, samples)
+    env.close()
+    return [data]
+
+
+def bench_mixed(options):
+    cleanup()
+    def configure(env, db):
+        env.scheduler_threads = 2
+        db.compaction_cache = 64 * 1024 * 1024
+    env, db = open_env(u64_schema(), configure=configure)
+    value = b'v' * options.value_size
+    with env.transaction() as txn:
+        tdb = txn[db]
+        for i in range(options.rows):
+            tdb[i] = value
+
+    # Start a checkpoint so reads and writes compete with node compaction.
+    db.compaction_checkpoint = 0
+    rnd = random.Random(0)
+    ops = [(rnd.random() < 0.2, rnd.randrange(options.rows))
+           for _ in range(options.rows)]
+    get, put = db.get, db.set
+    def op(arg):
+        if arg[0]:
+            put(arg[1], value)
+        else:
+            get(arg[1])
+    elapsed, samples = timed(op, ops)
+    data = result('mixed', env, len(ops), elapsed, samples)
+    env.close()
+    return [data]
+
+
+def bench_reopen(options):
+    cleanup()
+    env, db = open_env(u64_schema())
+    value = b'v' * options.value_size
+    for i in range(options.rows):
+        db[i] = value
+    env.close()
+
+    # All rows are still in the write-ahead log, so opening replays it.
+    start = time.perf_counter()
+    env, db = open_env(u64_schema())
+    elapsed = time.perf_counter() - start
+    data = result('reopen', env, 1, elapsed,
+                  recover_log_us=env.metric_recover_log_us,
+                  recover_log_records=env.metric_recover_log_records)
+    env.close()
+    return [data]
+
+
+WORKLOADS = (
+    ('point', bench_point),
+    ('multikey', bench_multikey),
+    ('serialized', bench_serialized),
+    ('range', bench_range),
+    ('commit', bench_commit),
+    ('upsert', bench_upsert),
+    ('mixed', bench_mixed),
+    ('reopen', bench_reopen),
+)
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--rows', type=int, default=100000)
+    parser.add_argument('--sync-ops', type=int, default=500)
+    parser.add_argument('--value-size', type=int, default=100)
+    parser.add_argument('--only', default='',
+                        help='comma-separated workloads: %s' %
+                        ','.join(name for name, _ in WORKLOADS))
+    parser.add_argument('--output', default='-')
+    options = parser.parse_args()
+    only = set(filter(None, options.only.split(',')))
+
+    results = []
+    try:
+        for name, fn in WORKLOADS:
+            if not only or name in only:
+                results.extend(fn(options))
+    finally:
+        cleanup()
+
+    report = {
+        'rows': options.rows,
+        'value_size': options.value_size,
+        'python': sys.version.split()[0],
+        'results': results}
+    if options.output == '-':
+        json.dump(report, sys.stdout, indent=2, sort_keys=True)
+        sys.stdout.write('\n')
+    else:
+        with open(options.output, 'w') as fh:
+            json.dump(report, fh, indent=2, sort_keys=True)
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,133 @@
+"""
+Measure how sophy scales across Python threads.
+
+Engine calls (get, set, delete, cursor steps and commit) run without holding
+the GIL, so Python code in other threads keeps running meanwhile. The engine
+runs one call at a time per environment, so node file reads do not overlap;
+with ``log.group_commit_max_batch`` set, writer threads waiting on a
+``log.sync`` fsync share it instead of queueing behind one another.
+
+Usage:
+
+    python benchmarks/threads.py [--rows N] [--ops N] [--threads 1,2,4,8]
+"""
+import argparse
+import os
+import random
+import shutil
+import sys
+import threading
+import time
+
+sys.path.insert(0, os.path.dirname(os.path.dirname(os.path.abspath(__file__))))
+
+from sophy import *
+
+
+BENCH_DIR = 'sophia-bench'
+
+
+def cleanup():
+    if os.path.exists(BENCH_DIR):
+        shutil.rmtree(BENCH_DIR)
+
+
+def open_env(sync, mmap, group_commit=0):
+    env = Sophia(BENCH_DIR)
+    env.log_sync = sync
+    env.log_group_commit_max_batch = group_commit
+    db = env.add_database('main', Schema(U64Index('key'),
+                                         BytesIndex('value')))
+    db.mmap = mmap
+    assert env.open()
+    return env, db
+
+
+def run_threads(nthreads, fn, ops):
+    per_thread = ops // nthreads
+    threads = [threading.Thread(target=fn, args=(i, per_thread))
+               for i in range(nthreads)]
+    start = time.time()
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    return (per_thread * nthreads) / (time.time() - start)
+
+
+def bench_get(db, rows):
+    def reader(tid, n):
+        rnd = random.Random(tid)
+        get = db.get
+        for _ in range(n):
+            get(rnd.randrange(rows))
+    return reader
+
+
+def bench_set(db, rows):
+    value = b'x' * 100
+    def writer(tid, n):
+        rnd = random.Random(tid)
+        put = db.set
+        for _ in range(n):
+            put(rnd.randrange(rows), value)
+    return writer
+
+
+def report(name, results):
+    base = results[0][1]
+    for nthreads, ops_s in results:
+        print('%-24s threads=%-3d %10.0f ops/s  x%.2f' %
+              (name, nthreads, ops_s, ops_s / base))
+
+
+def main():
+    parser = argparse.ArgumentParser()
+    parser.add_argument('--rows', type=int, default=200000)
+    parser.add_argument('--ops', type=int, default=200000)
+    parser.add_argument('--sync-ops', type=int, default=2000)
+    parser.add_argument('--threads', default='1,2,4,8')
+    options = parser.parse_args()
+    thread_counts = [int(t) for t in options.threads.split(',')]
+
+    cleanup()
+    env, db = open_env(sync=0, mmap=0)
+    value = b'v' * 100
+    with env.transaction() as txn:
+        tdb = txn[db]
+        for i in range(options.rows):
+            tdb[i] = value
+
+    # Flush the in-memory index to node files and reopen, so that reads are
+    # served from disk via pread(2) rather than from memory.
+    db.compaction_checkpoint = 0
+    deadline = time.time() + 60
+    while db.index_memory_used and time.time() < deadline:
+        time.sleep(0.1)
+    env.close()
+    env, db = open_env(sync=0, mmap=0)
+    results = [(n, run_threads(n, bench_get(db, options.rows), options.ops))
+               for n in thread_counts]
+    report('get (pread)', results)
+    env.close()
+
+    # Every autocommit set waits for the log fsync.
+    env, db = open_env(sync=1, mmap=0)
+    results = [(n, run_threads(n, bench_set(db, options.rows),
+                               options.sync_ops))
+               for n in thread_counts]
+    report('set (log.sync=1)', results)
+    env.close()
+
+    # Concurrent autocommit sets share log fsyncs.
+    env, db = open_env(sync=1, mmap=0, group_commit=64)
+    results = [(n, run_threads(n, bench_set(db, options.rows),
+                               options.sync_ops))
+               for n in thread_counts]
+    report('set (group commit)', results)
+    env.close()
+    cleanup()
+
+
+if __name__ == '__main__':
+    main()
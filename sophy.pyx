@@ -1,18 +1,34 @@
 # cython: language_level=3
 cimport cython
+from cpython.buffer cimport PyBuffer_FillInfo
 from cpython.bytes cimport PyBytes_AsStringAndSize
 from cpython.bytes cimport PyBytes_Check
+from cpython.bytes cimport PyBytes_FromStringAndSize
+from cpython.pythread cimport PyThread_get_thread_ident
+from cpython.ref cimport Py_INCREF
+from cpython.tuple cimport PyTuple_New
+from cpython.tuple cimport PyTuple_SET_ITEM
 from cpython.unicode cimport PyUnicode_AsUTF8String
 from cpython.unicode cimport PyUnicode_Check
+from cpython.unicode cimport PyUnicode_DecodeUTF8
 from cpython.version cimport PY_MAJOR_VERSION
 from libc.stdint cimport int64_t
 from libc.stdint cimport uint8_t
 from libc.stdint cimport uint16_t
 from libc.stdint cimport uint32_t
 from libc.stdint cimport uint64_t
+from libc.stdlib cimport calloc
+from libc.stdlib cimport free
+from libc.stdlib cimport malloc
+from libc.stdlib cimport realloc
+from libc.string cimport memcmp
+from libc.string cimport memcpy
+from posix.unistd cimport usleep
 
 import json
+import threading
 import uuid
+from functools import partial
 from pickle import dumps as pdumps
 from pickle import loads as ploads
 try:
@@ -22,6 +38,11 @@ try:
     munpackb = lambda b: msgpack_unpackb(b, raw=False)
 except ImportError:
     mpackb = munpackb = None
+try:
+    import asyncio
+    from concurrent.futures import ThreadPoolExecutor
+except ImportError:
+    asyncio = None
 
 
 cdef extern from "src/sophia.h" nogil:
@@ -32,18 +53,27 @@ cdef extern from "src/sophia.h" nogil:
     cdef void *sp_getobject(void*, const char*)
     cdef void *sp_getstring(void*, const char*, int*)
     cdef int64_t sp_getint(void*, const char*)
+    cdef int sp_setfield(void*, int, const void*, int)
+    cdef int sp_setfieldint(void*, int, int64_t)
+    cdef void *sp_getfield(void*, int, int*)
+    cdef int64_t sp_getfieldint(void*, int)
     cdef int sp_open(void *)
     cdef int sp_destroy(void *)
     cdef int sp_set(void*, void*)
     cdef int sp_upsert(void*, void*)
     cdef int sp_delete(void*, void*)
     cdef void *sp_get(void*, void*)
+    cdef int sp_getv(void*, void**, int)
     cdef void *sp_cursor(void*)
     cdef void *sp_begin(void *)
     cdef int sp_prepare(void *)
     cdef int sp_commit(void *)
 
 
+cdef extern from "Python.h":
+    const char *PyUnicode_AsUTF8AndSize(object, Py_ssize_t *) except NULL
+
+
 class SophiaError(Exception): pass
 
 
@@ -96,6 +126,32 @@ cdef inline _getustring(void *obj, const char *key):
         return decode(buf[:nlen - 1])
 
 
+cdef tuple HIST_FIELDS = ('count', 'p50', 'p90', 'p99', 'p999', 'max')
+
+
+cdef dict _parse_hist(value):
+    # Histograms are reported as "count p50 p90 p99 p999 max", with the
+    # percentiles and max in microseconds.
+    if not value:
+        return dict.fromkeys(HIST_FIELDS, 0)
+    return dict(zip(HIST_FIELDS, [int(v) for v in value.split()]))
+
+
+cdef dict _merge_stats(list stats):
+    # Counts are summed across the shards. Latency percentiles can not be
+    # merged from the summaries of the shards, the largest one is kept.
+    cdef dict accum = {}
+    for key, value in stats[0].items():
+        values = [item[key] for item in stats]
+        if isinstance(value, dict):
+            accum[key] = _merge_stats(values)
+        elif key in HIST_FIELDS and key != 'count':
+            accum[key] = max(values)
+        else:
+            accum[key] = sum(values)
+    return accum
+
+
 cdef inline _check(void *env, int rc):
     if rc == -1:
         error = _getustring(env, 'sophia.error')
@@ -110,6 +166,12 @@ cdef inline check_open(Sophia env):
         raise SophiaError('Sophia environment is closed.')
 
 
+cdef inline bint is_current(Sophia env, int generation):
+    # Whether an engine object created in the given generation is still
+    # alive, i.e. the environment was not closed since.
+    return env.is_open and env.generation == generation
+
+
 cdef class Configuration(object):
     cdef:
         dict settings
@@ -192,18 +254,38 @@ def __operation__(name):
         self.config.set_option(name, 0)
     return _method
 
-def __dbconfig__(name, is_string=False, is_readonly=False):
+def __dbconfig__(name, is_string=False, is_readonly=False, combine=None):
+    # Settings of a sharded database are applied to every shard, and read
+    # from the first one. Read-only values are combined across the shards
+    # with combine(), or can only be read from a shard when it is not given.
     def _getter(self):
-        return self.env.config.get_option('.'.join(('db', self.name, name)),
-                                          is_string)
+        if not isinstance(self, ShardedDatabase):
+            return self.env.config.get_option(
+                '.'.join(('db', self.name, name)), is_string)
+        values = [self.env.config.get_option('.'.join(('db', db.name, name)),
+                                             is_string)
+                  for db in (self.shards if is_readonly else self.shards[:1])]
+        if not is_readonly:
+            return values[0]
+        elif not combine:
+            raise SophiaError('%s is not available for a sharded database, '
+                              'read it from its shards.' % name)
+        return combine(values)
     if is_readonly:
         return property(_getter)
     def _setter(self, value):
-        self.env.config.set_option('.'.join(('db', self.name, name)), value)
+        dbs = self.shards if isinstance(self, ShardedDatabase) else (self,)
+        for db in dbs:
+            self.env.config.set_option('.'.join(('db', db.name, name)),
+                                       value)
     return property(_getter, _setter)
 
-def __dbconfig_ro__(name, is_string=False):
-    return __dbconfig__(name, is_string, True)
+def __dbconfig_ro__(name, is_string=False, combine=None):
+    return __dbconfig__(name, is_string, True, combine)
+
+def __dbcounter__(name):
+    # Read-only counter or size, summed across the shards.
+    return __dbconfig_ro__(name, combine=sum)
 
 def __dbconfig_s__(name, is_readonly=False):
     return __dbconfig__(name, True, is_readonly)
@@ -211,16 +293,22 @@ def __dbconfig_s__(name, is_readonly=False):
 
 cdef class Sophia(object):
     cdef:
-        bint is_open
+        readonly bint is_open
         bytes bpath
         readonly Configuration config
         dict database_lookup
         list databases
         readonly unicode path
         void *env
+        int inflight
+        int generation
+        long owner
 
     def __cinit__(self):
         self.env = <void *>0
+        self.inflight = 0
+        self.generation = 0
+        self.owner = 0
 
     def __init__(self, path):
         self.config = Configuration(self)
@@ -230,14 +318,17 @@ cdef class Sophia(object):
         self.path = decode(path)
         self.bpath = encode(path)
 
-    def add_database(self, name, Schema schema):
+    def add_database(self, name, Schema schema, shards=0):
         cdef Database db
 
         if self.is_open:
             raise SophiaError('cannot add database to open environment.')
 
         name = encode(name)  # Always store name internally as bytestring.
-        db = Database(self, name, schema)
+        if shards:
+            db = ShardedDatabase(self, name, schema, shards)
+        else:
+            db = Database(self, name, schema)
         self.databases.append(db)
         self.database_lookup[name] = db
         return db
@@ -262,6 +353,14 @@ cdef class Sophia(object):
             bytes iname
             int i
 
+        if isinstance(db, ShardedDatabase):
+            # Each shard is declared as a database of its own.
+            for shard in (<ShardedDatabase>db).shards:
+                self.configure_database(shard)
+            self.configure_database((<ShardedDatabase>db).meta)
+            db.schema.compile()
+            return
+
         self.set_string(b'db', bname)
 
         for i, index in enumerate(db.schema.key):
@@ -278,6 +377,7 @@ cdef class Sophia(object):
                             encode(index.data_type))
 
         db.db = sp_getobject(self.env, b'db.' + bname)
+        db.schema.compile()
 
     def open(self):
         if self.is_open:
@@ -293,20 +393,78 @@ cdef class Sophia(object):
 
         self.config.configure()
 
-        cdef int rc = sp_open(self.env)
+        # Recovery may read node files and replay the write-ahead log, so do
+        # not hold the GIL while it runs.
+        cdef:
+            void *env = self.env
+            int rc
+        with nogil:
+            rc = sp_open(env)
         _check(self.env, rc)
 
+        # Engine objects do not survive a close(), objects created while the
+        # environment was open before are recognized by their generation.
+        self.generation += 1
         self.is_open = True
+
+        for db in self.databases:
+            if isinstance(db, ShardedDatabase):
+                try:
+                    (<ShardedDatabase>db).check_shards()
+                except:
+                    self.close()
+                    raise
         return self.is_open
 
     def close(self):
         if not self.is_open or not self.env:
             return False
+        cdef void *env = self.env
         self.is_open = False
-        sp_destroy(self.env)
+
+        # Other threads may still be inside engine calls made without the
+        # GIL. New calls are refused once the environment is marked closed,
+        # so wait for the running ones before it is destroyed.
+        while self.inflight or self._reserved():
+            with nogil:
+                usleep(1000)
         self.env = <void *>0
+        with nogil:
+            sp_destroy(env)
+        return True
+
+    cdef int _enter(self) except -1:
+        # Every engine call made without the GIL is counted, see close().
+        # The counter is only changed while the GIL is held.
+        while self._reserved():
+            with nogil:
+                usleep(50)
+        if not self.is_open:
+            raise SophiaError('Sophia environment is closed.')
+        self.inflight += 1
+        return 0
+
+    cdef inline void _leave(self):
+        self.inflight -= 1
+
+    cdef bint _reserve(self):
+        # The engine runs one call at a time per environment. Claim it for
+        # the calling thread (the event loop of AsyncSophia) when no call is
+        # running, so the calls it makes until _release() cannot wait behind
+        # a node file read or log sync: other threads wait in _enter().
+        if self.inflight or self.owner:
+            return False
+        self.owner = <long>PyThread_get_thread_ident()
         return True
 
+    cdef inline void _release(self):
+        self.owner = 0
+
+    cdef inline bint _reserved(self):
+        # Whether the engine is claimed by another thread.
+        return (self.owner != 0 and
+                self.owner != <long>PyThread_get_thread_ident())
+
     def __dealloc__(self):
         if self.is_open and self.env:
             sp_destroy(self.env)
@@ -317,20 +475,39 @@ cdef class Sophia(object):
     cpdef Transaction transaction(self):
         return Transaction(self)
 
+    cpdef Snapshot snapshot(self):
+        return Snapshot(self).acquire()
+
     version = __config_ro__('sophia.version', is_string=True)
     version_storage = __config_ro__('sophia.version_storage', is_string=True)
     build = __config_ro__('sophia.build', is_string=True)
     status = __config_ro__('sophia.status', is_string=True)
     errors = __config_ro__('sophia.errors')
     error = __config_ro__('sophia.error', is_string=True)
+    io_uring = __config__('sophia.io_uring')
 
     backup_path = __config__('backup.path', is_string=True)
     backup_run = __operation__('backup.run')
     backup_active = __config_ro__('backup.active')
     backup_last = __config_ro__('backup.last')
     backup_last_complete = __config_ro__('backup.last_complete')
+    backup_incremental = __config__('backup.incremental')
+    backup_databases = __config_ro__('backup.databases')
+    backup_files_copied = __config_ro__('backup.files_copied')
+    backup_files_linked = __config_ro__('backup.files_linked')
+    backup_bytes_copied = __config_ro__('backup.bytes_copied')
+    backup_bytes_linked = __config_ro__('backup.bytes_linked')
 
     scheduler_threads = __config__('scheduler.threads')
+    scheduler_recover_threads = __config__('scheduler.recover_threads')
+    scheduler_compression_threads = __config__(
+        'scheduler.compression_threads')
+    scheduler_compaction_rate_mb = __config__('scheduler.compaction_rate_mb')
+    scheduler_compaction_latency_us = __config__(
+        'scheduler.compaction_latency_us')
+    scheduler_compaction_rate = __config_ro__('scheduler.compaction_rate')
+    scheduler_compaction_wait_us = __config_ro__(
+        'scheduler.compaction_wait_us')
     def scheduler_trace(self, thread_id):
         return self.config.get_option('scheduler.%s.trace' % thread_id)
 
@@ -351,28 +528,63 @@ cdef class Sophia(object):
     metric_dsn = __config_ro__('metric.dsn')
     metric_bsn = __config_ro__('metric.bsn')
     metric_lfsn = __config_ro__('metric.lfsn')
+    metric_recover_repository_us = __config_ro__(
+        'metric.recover_repository_us')
+    metric_recover_databases_us = __config_ro__('metric.recover_databases_us')
+    metric_recover_log_us = __config_ro__('metric.recover_log_us')
+    metric_recover_log_records = __config_ro__('metric.recover_log_records')
+
+    memory_page_cache_limit = __config__('memory.page_cache_limit')
+    memory_page_cache_used = __config_ro__('memory.page_cache_used')
+    memory_allocator = __config__('memory.allocator', is_string=True)
+    memory_allocator_footprint = __config_ro__('memory.allocator_footprint')
+    memory_allocator_used = __config_ro__('memory.allocator_used')
+    memory_allocator_slabs = __config_ro__('memory.allocator_slabs')
 
     log_enable = __config__('log.enable')
     log_path = __config__('log.path', is_string=True)
     log_sync = __config__('log.sync')
     log_rotate_wm = __config__('log.rotate_wm')
     log_rotate_sync = __config__('log.rotate_sync')
+    log_group_commit_max_batch = __config__('log.group_commit_max_batch')
+    log_group_commit_max_wait_us = __config__('log.group_commit_max_wait_us')
     log_rotate = __operation__('log.rotate')
     log_gc = __operation__('log.gc')
     log_files = __config_ro__('log.files')
+    log_write_hist = __config_ro__('log.write_hist', is_string=True)
+    log_sync_hist = __config_ro__('log.sync_hist', is_string=True)
+    transaction_commit_hist = __config_ro__('transaction.commit_hist',
+                                            is_string=True)
+
+    def stats(self):
+        check_open(self)
+        cdef Database db
+        return {
+            'commit': {
+                'count': self.transaction_commit,
+                'rollback': self.transaction_rollback,
+                'conflict': self.transaction_conflict,
+                'latency': _parse_hist(self.transaction_commit_hist)},
+            'log': {
+                'files': self.log_files,
+                'write': _parse_hist(self.log_write_hist),
+                'sync': _parse_hist(self.log_sync_hist)},
+            'databases': dict((decode(db.name), db.stats())
+                              for db in self.databases)}
 
 
 cdef class Transaction(object):
     cdef:
         Sophia env
         void *txn
+        int generation
 
     def __cinit__(self, Sophia env):
         self.env = env
         self.txn = <void *>0
 
     def __dealloc__(self):
-        if self.env.is_open and self.txn:
+        if self.txn and is_current(self.env, self.generation):
             sp_destroy(self.txn)
 
     cdef _reset(self, bint begin):
@@ -380,21 +592,35 @@ cdef class Transaction(object):
         if begin:
             self.begin()
 
+    cdef _discard_stale(self):
+        # The engine transaction was released when the environment closed.
+        if self.txn and not is_current(self.env, self.generation):
+            self.txn = <void *>0
+
     def begin(self):
         check_open(self.env)
+        self._discard_stale()
         if self.txn:
             raise SophiaError('This transaction has already been started.')
 
         self.txn = sp_begin(self.env.env)
+        self.generation = self.env.generation
         return self
 
     def commit(self, begin=True):
         check_open(self.env)
+        self._discard_stale()
         if not self.txn:
             raise SophiaError('Transaction is not currently open. Cannot '
                               'commit.')
 
-        cdef int rc = sp_commit(self.txn)
+        cdef:
+            void *txn = self.txn
+            int rc
+        self.env._enter()
+        with nogil:
+            rc = sp_commit(txn)
+        self.env._leave()
         if rc == 1:
             self.txn = <void *>0
             raise SophiaError('transaction was rolled back by another '
@@ -407,6 +633,7 @@ cdef class Transaction(object):
 
     def rollback(self, begin=True):
         check_open(self.env)
+        self._discard_stale()
         if not self.txn:
             raise SophiaError('Transaction is not currently open. Cannot '
                               'rollback.')
@@ -431,12 +658,75 @@ cdef class Transaction(object):
         if not isinstance(database, Database):
             raise SophiaError('Transaction __getitem__ value must be a '
                               'Database instance.')
-        return DatabaseTransaction(database, self)
+        return self.get_database(database)
 
     cdef Database get_database(self, Database database):
+        if isinstance(database, ShardedDatabase):
+            return (<ShardedDatabase>database).bind_transaction(self)
         return DatabaseTransaction(database, self)
 
 
+cdef class Snapshot(object):
+    # A consistent read-only view of every database. Reads are not tracked
+    # for conflicts, the view only holds back garbage collection of older
+    # versions until it is released.
+    cdef:
+        Sophia env
+        void *snapshot
+        int generation
+
+    def __cinit__(self, Sophia env):
+        self.env = env
+        self.snapshot = <void *>0
+
+    def __dealloc__(self):
+        if self.snapshot and is_current(self.env, self.generation):
+            sp_destroy(self.snapshot)
+
+    def acquire(self):
+        check_open(self.env)
+        if self.snapshot and not is_current(self.env, self.generation):
+            # Released when the environment closed.
+            self.snapshot = <void *>0
+        if self.snapshot:
+            raise SophiaError('This snapshot has already been acquired.')
+        self.snapshot = sp_getobject(self.env.env, b'snapshot')
+        if not self.snapshot:
+            _check(self.env.env, -1)
+        self.generation = self.env.generation
+        return self
+
+    def release(self):
+        if not self.snapshot:
+            raise SophiaError('Snapshot is not currently acquired.')
+        if is_current(self.env, self.generation):
+            sp_destroy(self.snapshot)
+        self.snapshot = <void *>0
+
+    @property
+    def lsn(self):
+        if not self.snapshot:
+            return None
+        return sp_getint(self.snapshot, b'lsn')
+
+    def __enter__(self):
+        if not self.snapshot:
+            self.acquire()
+        return self
+
+    def __exit__(self, exc_type, exc_val, exc_tb):
+        if self.snapshot:
+            self.release()
+
+    def __getitem__(self, database):
+        if not isinstance(database, Database):
+            raise SophiaError('Snapshot __getitem__ value must be a '
+                              'Database instance.')
+        if isinstance(database, ShardedDatabase):
+            return (<ShardedDatabase>database).bind_snapshot(self)
+        return DatabaseSnapshot(database, self)
+
+
 SCHEMA_STRING = 'string'
 SCHEMA_U64 = 'u64'
 SCHEMA_U32 = 'u32'
@@ -448,6 +738,77 @@ SCHEMA_U16_REV = 'u16_rev'
 SCHEMA_U8_REV = 'u8_rev'
 
 
+cdef class DocumentRef(object):
+    # Owns a result document returned by sp_get(), so that buffers pointing
+    # into it stay valid for as long as they are referenced.
+    cdef:
+        void *handle
+        Sophia env
+        int generation
+
+    def __dealloc__(self):
+        if self.handle and is_current(self.env, self.generation):
+            sp_destroy(self.handle)
+
+
+@cython.freelist(64)
+cdef class Buffer(object):
+    # Read-only, zero-copy view of a field stored in an engine document. The
+    # owner keeps the underlying document alive.
+    cdef:
+        char *buf
+        Py_ssize_t size
+        int exports
+        object owner
+        Sophia env
+        int generation
+
+    def __getbuffer__(self, Py_buffer *view, int flags):
+        if self.buf == NULL or not is_current(self.env, self.generation):
+            raise ValueError('buffer is no longer valid.')
+        PyBuffer_FillInfo(view, self, self.buf, self.size, 1, flags)
+        self.exports += 1
+
+    def __releasebuffer__(self, Py_buffer *view):
+        self.exports -= 1
+
+    def __len__(self):
+        return self.size
+
+    def __bytes__(self):
+        return bytes(memoryview(self))
+
+    def tobytes(self):
+        return bytes(memoryview(self))
+
+    cdef invalidate(self):
+        if self.exports:
+            raise BufferError('cursor row is still referenced by an '
+                              'exported buffer.')
+        self.buf = NULL
+        self.size = 0
+
+
+cdef Buffer _getbuffer(void *obj, const char *key, owner, Sophia env):
+    cdef:
+        Buffer b
+        char *buf
+        int nlen
+
+    buf = <char *>sp_getstring(obj, key, &nlen)
+    if not buf:
+        return None
+    b = Buffer.__new__(Buffer)
+    b.buf = buf
+    b.size = nlen - 1
+    b.owner = owner
+    b.env = env
+    b.generation = env.generation
+    if isinstance(owner, Cursor):
+        (<Cursor>owner).views.append(b)
+    return b
+
+
 cdef class BaseIndex(object):
     cdef:
         bytes bname
@@ -463,6 +824,14 @@ cdef class BaseIndex(object):
     cdef set_key(self, void *obj, value): pass
     cdef get_key(self, void *obj): pass
 
+    cdef get_buffer(self, void *obj, owner, Sophia env):
+        return self.get_key(obj)
+
+    cdef from_raw(self, const char *buf, int size):
+        # Decode a string field copied out of a document (without the
+        # trailing NUL), used by the batched cursor reads.
+        return buf[:size]
+
 
 cdef class SerializedIndex(BaseIndex):
     cdef object _serialize, _deserialize
@@ -499,6 +868,14 @@ cdef class SerializedIndex(BaseIndex):
         if buf:
             return self._deserialize(buf[:buflen - 1])
 
+    cdef get_buffer(self, void *obj, owner, Sophia env):
+        cdef Buffer b = _getbuffer(obj, <const char *>self.bname, owner, env)
+        if b is not None:
+            return self._deserialize(b)
+
+    cdef from_raw(self, const char *buf, int size):
+        return self._deserialize(buf[:size])
+
 
 cdef class BytesIndex(BaseIndex):
     by_reference = True
@@ -517,6 +894,9 @@ cdef class BytesIndex(BaseIndex):
     cdef get_key(self, void *obj):
         return _getstring(obj, <const char *>self.bname)
 
+    cdef get_buffer(self, void *obj, owner, Sophia env):
+        return _getbuffer(obj, <const char *>self.bname, owner, env)
+
 
 cdef class StringIndex(BytesIndex):
     by_reference = True
@@ -525,6 +905,12 @@ cdef class StringIndex(BytesIndex):
     cdef get_key(self, void *obj):
         return _getustring(obj, <const char *>self.bname)
 
+    cdef get_buffer(self, void *obj, owner, Sophia env):
+        return _getustring(obj, <const char *>self.bname)
+
+    cdef from_raw(self, const char *buf, int size):
+        return decode(buf[:size])
+
 
 cdef class U64Index(BaseIndex):
     data_type = SCHEMA_U64
@@ -581,7 +967,7 @@ cdef class U8RevIndex(U8Index):
 cdef class JsonIndex(SerializedIndex):
     def __init__(self, name):
         jdumps = lambda v: json.dumps(v, separators=(',', ':')).encode('utf-8')
-        jloads = lambda v: json.loads(v.decode('utf-8'))
+        jloads = lambda v: json.loads(str(v, 'utf-8'))
         super(JsonIndex, self).__init__(name, jdumps, jloads)
 
 cdef class MsgPackIndex(SerializedIndex):
@@ -597,7 +983,7 @@ cdef class PickleIndex(SerializedIndex):
 cdef class UUIDIndex(SerializedIndex):
     def __init__(self, name):
         uuid_encode = lambda u: u.bytes
-        uuid_decode = lambda b: uuid.UUID(bytes=b)
+        uuid_decode = lambda b: uuid.UUID(bytes=bytes(b))
         super(UUIDIndex, self).__init__(name, uuid_encode, uuid_decode)
 
 
@@ -626,6 +1012,152 @@ cdef normalize_value(Schema schema, i):
     return i
 
 
+# Field kinds used by the batched cursor reads and Database.count(), which
+# work with the raw document fields without holding the GIL.
+cdef enum:
+    FIELD_STRING = 0
+    FIELD_UNSIGNED = 1
+    FIELD_UNSIGNED_REV = 2
+
+
+cdef struct field_spec:
+    int pos
+    int kind
+    int64_t ival
+    const char *sval
+    int ssize
+
+
+cdef struct field_slot:
+    int64_t value  # Integer value, or offset of a string in the arena.
+    int size  # Size of a string including the trailing NUL, -1 for integers.
+
+
+cdef int field_kind(BaseIndex index):
+    if isinstance(index, (U64RevIndex, U32RevIndex, U16RevIndex, U8RevIndex)):
+        return FIELD_UNSIGNED_REV
+    elif isinstance(index, U64Index):
+        return FIELD_UNSIGNED
+    return FIELD_STRING
+
+
+# Field codecs of a compiled Schema. Fields of the common index types are
+# encoded and decoded inline by position, any other index goes through its
+# set_key()/get_key() methods.
+cdef enum:
+    CODEC_OBJECT = 0
+    CODEC_BYTES = 1
+    CODEC_STRING = 2
+    CODEC_U64 = 3
+    CODEC_U32 = 4
+    CODEC_U16 = 5
+    CODEC_U8 = 6
+
+
+cdef struct codec_field:
+    int pos  # Position of the field in the engine scheme.
+    int kind
+    int width  # Stored size of an integer field, 0 for strings.
+
+
+cdef int codec_kind(BaseIndex index):
+    # Only the exact index types are specialised, so subclasses overriding
+    # the encoding keep working.
+    t = type(index)
+    if t is U64Index or t is U64RevIndex:
+        return CODEC_U64
+    elif t is U32Index or t is U32RevIndex:
+        return CODEC_U32
+    elif t is U16Index or t is U16RevIndex:
+        return CODEC_U16
+    elif t is U8Index or t is U8RevIndex:
+        return CODEC_U8
+    elif t is StringIndex:
+        return CODEC_STRING
+    elif t is BytesIndex:
+        return CODEC_BYTES
+    return CODEC_OBJECT
+
+
+cdef int codec_width(BaseIndex index):
+    if isinstance(index, U8Index):
+        return 1
+    elif isinstance(index, U16Index):
+        return 2
+    elif isinstance(index, U32Index):
+        return 4
+    elif isinstance(index, U64Index):
+        return 8
+    return 0
+
+
+cdef inline uint32_t fnv_hash(uint32_t h, const unsigned char *p,
+                              Py_ssize_t size) nogil:
+    cdef Py_ssize_t i
+    for i in range(size):
+        h = (h ^ p[i]) * 16777619
+    return h
+
+
+cdef int compare_key(void *handle, field_spec *spec, int nfields) nogil:
+    # Compare the key of a document against the key held in spec, using the
+    # same rules as the engine comparators for each field type.
+    cdef:
+        const char *buf
+        int i, rc, size
+        uint64_t a, b
+
+    for i in range(nfields):
+        if spec[i].kind == FIELD_STRING:
+            buf = <const char *>sp_getfield(handle, spec[i].pos, &size)
+            rc = memcmp(buf, spec[i].sval,
+                        size if size < spec[i].ssize else spec[i].ssize)
+            if rc == 0 and size != spec[i].ssize:
+                rc = -1 if size < spec[i].ssize else 1
+        else:
+            a = <uint64_t>sp_getfieldint(handle, spec[i].pos)
+            b = <uint64_t>spec[i].ival
+            rc = 0 if a == b else (-1 if a < b else 1)
+            if spec[i].kind == FIELD_UNSIGNED_REV:
+                rc = -rc
+        if rc != 0:
+            return rc
+    return 0
+
+
+cdef int compare_documents(void *a, void *b, field_spec *spec,
+                           int nfields) nogil:
+    # Compare the keys of two documents of databases sharing a scheme, spec
+    # is filled with the key of b.
+    cdef int i
+
+    for i in range(nfields):
+        if spec[i].kind == FIELD_STRING:
+            spec[i].sval = <const char *>sp_getfield(b, spec[i].pos,
+                                                     &spec[i].ssize)
+        else:
+            spec[i].ival = sp_getfieldint(b, spec[i].pos)
+    return compare_key(a, spec, nfields)
+
+
+cdef int merge_pick(void **heads, int n, field_spec *spec, int nfields,
+                    bint descending) nogil:
+    # Index of the head which comes first in cursor order, -1 once every
+    # head is exhausted.
+    cdef int i, rc, best = -1
+
+    for i in range(n):
+        if heads[i] == NULL:
+            continue
+        if best < 0:
+            best = i
+            continue
+        rc = compare_documents(heads[i], heads[best], spec, nfields)
+        if (rc > 0) if descending else (rc < 0):
+            best = i
+    return best
+
+
 @cython.freelist(256)
 cdef class Document(object):
     cdef:
@@ -653,6 +1185,15 @@ cdef class Schema(object):
         list value
         readonly int key_length
         readonly int value_length
+        # Compiled codec, one entry per field in scheme order (key fields
+        # first, then value fields).
+        codec_field *codec
+        list indexes
+        int nfields
+        bint by_reference
+
+    def __cinit__(self):
+        self.codec = NULL
 
     def __init__(self, key_parts=None, value_parts=None):
         cdef:
@@ -671,58 +1212,242 @@ cdef class Schema(object):
             for index in value_parts:
                 self.add_value(index)
 
+    def __dealloc__(self):
+        free(self.codec)
+
     def add_key(self, BaseIndex index):
         self.key.append(index)
         self.key_length = len(self.key)
         self.multi_key = self.key_length > 1
+        self.invalidate()
 
     def add_value(self, BaseIndex index):
         self.value.append(index)
         self.value_length = len(self.value)
         self.multi_value = self.value_length > 1
+        self.invalidate()
 
-    cdef set_key(self, Document doc, tuple parts):
+    cdef invalidate(self):
+        free(self.codec)
+        self.codec = NULL
+
+    cdef compile(self):
+        # Called when the environment is opened, resolves each index to its
+        # field position and codec once, instead of looking the field up by
+        # name for every document.
         cdef:
             BaseIndex index
+            codec_field *codec
             int i
 
-        if len(parts) != self.key_length:
-            raise ValueError('key must be a %s-tuple' % self.key_length)
+        indexes = self.key + self.value
+        codec = <codec_field *>malloc(sizeof(codec_field) *
+                                      max(len(indexes), 1))
+        if not codec:
+            raise MemoryError()
+        free(self.codec)
+        self.codec = codec
+        self.indexes = indexes
+        self.nfields = len(indexes)
+        self.by_reference = False
+        for i, index in enumerate(indexes):
+            codec[i].pos = i
+            codec[i].kind = codec_kind(index)
+            codec[i].width = codec_width(index)
+            if index.by_reference:
+                self.by_reference = True
 
-        for i, index in enumerate(self.key):
-            ref = index.set_key(doc.handle, parts[i])
+    cdef int encode_field(self, Document doc, int i, value) except -1:
+        cdef:
+            BaseIndex index
+            codec_field *f = &self.codec[i]
+            const char *buf
+            char *bbuf
+            Py_ssize_t buflen
+
+        if f.kind == CODEC_U64:
+            sp_setfieldint(doc.handle, f.pos, <uint64_t>value)
+        elif f.kind == CODEC_U32:
+            sp_setfieldint(doc.handle, f.pos, <uint32_t>value)
+        elif f.kind == CODEC_U16:
+            sp_setfieldint(doc.handle, f.pos, <uint16_t>value)
+        elif f.kind == CODEC_U8:
+            sp_setfieldint(doc.handle, f.pos, <uint8_t>value)
+        elif f.kind == CODEC_STRING and PyUnicode_Check(value):
+            # The UTF-8 form is cached by the str object, which is kept alive
+            # by the tuple held in doc.refs.
+            buf = PyUnicode_AsUTF8AndSize(value, &buflen)
+            sp_setfield(doc.handle, f.pos, buf, buflen + 1)
+        elif f.kind == CODEC_STRING or f.kind == CODEC_BYTES:
+            if not PyBytes_Check(value):
+                value = encode(value)
+                doc.refs.append(value)
+            PyBytes_AsStringAndSize(value, &bbuf, &buflen)
+            sp_setfield(doc.handle, f.pos, bbuf, buflen + 1)
+        else:
+            index = self.indexes[i]
+            ref = index.set_key(doc.handle, value)
             if index.by_reference:
                 doc.refs.append(ref)
+        return 0
 
-    cdef tuple get_key(self, Document doc):
+    cdef decode_field(self, void *handle, int i):
         cdef:
             BaseIndex index
-            list accum = []
+            codec_field *f = &self.codec[i]
+            char *buf
+            int size
+
+        if f.kind >= CODEC_U64:
+            return sp_getfieldint(handle, f.pos)
+        elif f.kind == CODEC_OBJECT:
+            index = self.indexes[i]
+            return index.get_key(handle)
+        buf = <char *>sp_getfield(handle, f.pos, &size)
+        if not buf:
+            return None
+        return self.decode_raw(i, buf, size - 1)
+
+    cdef decode_raw(self, int i, const char *buf, int size):
+        # Decode a string field copied out of a document (without the
+        # trailing NUL).
+        cdef BaseIndex index
+
+        if self.codec[i].kind == CODEC_STRING:
+            return PyUnicode_DecodeUTF8(<char *>buf, size, NULL)
+        elif self.codec[i].kind == CODEC_BYTES:
+            return PyBytes_FromStringAndSize(<char *>buf, size)
+        index = self.indexes[i]
+        return index.from_raw(buf, size)
+
+    cdef tuple decode_fields(self, void *handle, int start, int end):
+        cdef:
+            tuple accum = PyTuple_New(end - start)
+            int i
 
-        for index in self.key:
-            accum.append(index.get_key(doc.handle))
-        return tuple(accum)
+        for i in range(start, end):
+            value = self.decode_field(handle, i)
+            Py_INCREF(value)
+            PyTuple_SET_ITEM(accum, i - start, value)
+        return accum
 
-    cdef set_value(self, Document doc, tuple parts):
+    cdef set_key(self, Document doc, tuple parts):
+        cdef int i
+
+        if len(parts) != self.key_length:
+            raise ValueError('key must be a %s-tuple' % self.key_length)
+        if self.codec == NULL:
+            self.compile()
+
+        for i in range(self.key_length):
+            self.encode_field(doc, i, parts[i])
+        if self.by_reference:
+            doc.refs.append(parts)
+
+    cdef int shard_key(self, tuple parts, int nshards) except -1:
+        # Hash of the key as stored by the engine (integers in their field
+        # width, strings as their encoded bytes). Python's hash() is
+        # randomised for str and bytes, so it cannot place data on disk.
         cdef:
             BaseIndex index
-            int i
+            codec_field *f
+            const char *buf
+            char *bbuf
+            Py_ssize_t buflen
+            uint64_t ival
+            unsigned char ibuf[8]
+            uint32_t h = 2166136261
+            int i, j
+
+        if len(parts) != self.key_length:
+            raise ValueError('key must be a %s-tuple' % self.key_length)
+        if self.codec == NULL:
+            self.compile()
+
+        for i in range(self.key_length):
+            f = &self.codec[i]
+            value = parts[i]
+            if f.width:
+                ival = <uint64_t>value
+                for j in range(f.width):
+                    ibuf[j] = (ival >> (8 * j)) & 0xff
+                h = fnv_hash(h, ibuf, f.width)
+            elif f.kind == CODEC_STRING and PyUnicode_Check(value):
+                buf = PyUnicode_AsUTF8AndSize(value, &buflen)
+                h = fnv_hash(h, <const unsigned char *>buf, buflen)
+            else:
+                index = self.indexes[i]
+                if isinstance(index, SerializedIndex):
+                    value = (<SerializedIndex>index)._serialize(value)
+                if not PyBytes_Check(value):
+                    value = encode(value)
+                PyBytes_AsStringAndSize(value, &bbuf, &buflen)
+                h = fnv_hash(h, <const unsigned char *>bbuf, buflen)
+            # Field separator, so ('ab', 'c') and ('a', 'bc') differ.
+            h = (h ^ 0xff) * 16777619
+
+        # Final mix, so that the low bits depend on every input byte.
+        h ^= h >> 16
+        h *= 0x85ebca6b
+        h ^= h >> 13
+        h *= 0xc2b2ae35
+        h ^= h >> 16
+        return h % <uint32_t>nshards
+
+    cdef tuple get_key(self, Document doc):
+        if self.codec == NULL:
+            self.compile()
+        return self.decode_fields(doc.handle, 0, self.key_length)
+
+    cdef set_value(self, Document doc, tuple parts):
+        cdef int i
 
         if len(parts) != self.value_length:
             raise ValueError('value must be a %s-tuple' % self.value_length)
+        if self.codec == NULL:
+            self.compile()
 
-        for i, index in enumerate(self.value):
-            ref = index.set_key(doc.handle, parts[i])
-            if index.by_reference:
-                doc.refs.append(ref)
+        for i in range(self.value_length):
+            self.encode_field(doc, self.key_length + i, parts[i])
+        if self.by_reference:
+            doc.refs.append(parts)
 
     cdef tuple get_value(self, Document doc):
+        if self.codec == NULL:
+            self.compile()
+        return self.decode_fields(doc.handle, self.key_length, self.nfields)
+
+    cdef load_key(self, void *handle):
+        # Key of a result document, unwrapped for single-field keys.
+        if self.codec == NULL:
+            self.compile()
+        if self.multi_key:
+            return self.decode_fields(handle, 0, self.key_length)
+        return self.decode_field(handle, 0)
+
+    cdef load_value(self, void *handle):
+        if self.codec == NULL:
+            self.compile()
+        if self.multi_value:
+            return self.decode_fields(handle, self.key_length, self.nfields)
+        return self.decode_field(handle, self.key_length)
+
+    cdef tuple get_key_buffer(self, Document doc, owner, Sophia env):
+        cdef:
+            BaseIndex index
+            list accum = []
+
+        for index in self.key:
+            accum.append(index.get_buffer(doc.handle, owner, env))
+        return tuple(accum)
+
+    cdef tuple get_value_buffer(self, Document doc, owner, Sophia env):
         cdef:
             BaseIndex index
             list accum = []
 
         for index in self.value:
-            accum.append(index.get_key(doc.handle))
+            accum.append(index.get_buffer(doc.handle, owner, env))
         return tuple(accum)
 
     @classmethod
@@ -753,14 +1478,25 @@ cdef class Database(object):
     cdef void *_get_target(self) except NULL:
         return self.db
 
+    cdef void *_get_cursor_target(self) except NULL:
+        return self.env.env
+
     cdef _set(self, tuple key, tuple value):
         cdef:
             void *handle = sp_document(self.db)
+            void *target
             Document doc = create_document(handle)
 
+        # Fields are encoded into the document while we hold the GIL, the
+        # referenced buffers are kept alive by doc.refs until the engine call
+        # has returned.
         self.schema.set_key(doc, key)
         self.schema.set_value(doc, value)
-        sp_set(self._get_target(), doc.handle)
+        target = self._get_target()
+        self.env._enter()
+        with nogil:
+            sp_set(target, handle)
+        self.env._leave()
         doc.release_refs()
 
     def set(self, key, value):
@@ -769,26 +1505,118 @@ cdef class Database(object):
         value = (value,) if not isinstance(value, tuple) else value
         return self._set(key, value)
 
-    cdef tuple _get(self, tuple key):
+    cdef _upsert(self, tuple key, tuple value):
+        cdef:
+            int rc
+            void *handle = sp_document(self.db)
+            void *target
+            Document doc = create_document(handle)
+
+        self.schema.set_key(doc, key)
+        self.schema.set_value(doc, value)
+        target = self._get_target()
+        self.env._enter()
+        with nogil:
+            rc = sp_upsert(target, handle)
+        self.env._leave()
+        doc.release_refs()
+        _check(self.env.env, rc)
+
+    def upsert(self, key, value):
+        check_open(self.env)
+        key = (key,) if not isinstance(key, tuple) else key
+        value = (value,) if not isinstance(value, tuple) else value
+        return self._upsert(key, value)
+
+    cdef tuple _get(self, tuple key, bint buffers=False):
         cdef:
             void *handle = sp_document(self.db)
             void *result
+            void *target
             Document doc = create_document(handle)
+            DocumentRef ref
 
         self.schema.set_key(doc, key)
-        result = sp_get(self._get_target(), doc.handle)
+        target = self._get_target()
+        self.env._enter()
+        with nogil:
+            result = sp_get(target, handle)
+        self.env._leave()
         doc.release_refs()
         if not result:
             return
 
         doc.handle = result
+        if buffers:
+            # The result document is released once the last buffer pointing
+            # into it has been garbage collected.
+            ref = DocumentRef.__new__(DocumentRef)
+            ref.handle = result
+            ref.env = self.env
+            ref.generation = self.env.generation
+            return self.schema.get_value_buffer(doc, ref, self.env)
+
         data = self.schema.get_value(doc)
         sp_destroy(result)
         return data
 
-    def get(self, key, default=None):
+    cdef tuple _get_cached(self, tuple key):
+        cdef:
+            void *handle = sp_document(self.db)
+            void *result
+            void *target
+            Document doc = create_document(handle)
+
+        # The lookup does not read node files. If the key may only be found
+        # on disk, the engine hands the key document back with "cache_miss"
+        # set, and passing it to sp_get() again performs the full lookup.
+        self.schema.set_key(doc, key)
+        sp_setint(handle, b'cache_only', 1)
+        target = self._get_target()
+        self.env._enter()
+        with nogil:
+            result = sp_get(target, handle)
+        self.env._leave()
+        if not result:
+            doc.release_refs()
+            return (True, None)
+
+        doc.handle = result
+        if sp_getint(result, b'cache_miss') == 1:
+            # The key fields still point into the buffers held by doc.refs,
+            # they are read again by the full lookup.
+            return (False, doc)
+        doc.release_refs()
+        data = self.schema.load_value(result)
+        sp_destroy(result)
+        return (True, data)
+
+    def _get_documents(self, list docs):
+        cdef:
+            Document doc
+            int i, n = len(docs)
+            void **handles
+            void *target
+
+        target = self._get_target()
+        self.env._enter()
+        handles = <void **>malloc(max(n, 1) * sizeof(void *))
+        if handles == NULL:
+            self.env._leave()
+            raise MemoryError()
+        for i in range(n):
+            doc = docs[i]
+            handles[i] = doc.handle
+            doc.handle = <void *>0
+        with nogil:
+            sp_getv(target, handles, n)
+        self.env._leave()
+        return self._get_results(handles, n)
+
+    def get(self, key, default=None, buffers=False):
         check_open(self.env)
-        data = self._get((key,) if not isinstance(key, tuple) else key)
+        data = self._get((key,) if not isinstance(key, tuple) else key,
+                         buffers)
         if data is None:
             return default
 
@@ -798,10 +1626,15 @@ cdef class Database(object):
         cdef:
             void *handle = sp_document(self.db)
             void *result
+            void *target
             Document doc = create_document(handle)
 
         self.schema.set_key(doc, key)
-        result = sp_get(self._get_target(), doc.handle)
+        target = self._get_target()
+        self.env._enter()
+        with nogil:
+            result = sp_get(target, handle)
+        self.env._leave()
         doc.release_refs()
         if result:
             sp_destroy(result)
@@ -812,9 +1645,14 @@ cdef class Database(object):
         cdef:
             int ret
             void *handle = sp_document(self.db)
+            void *target
             Document doc = create_document(handle)
         self.schema.set_key(doc, key)
-        ret = sp_delete(self._get_target(), doc.handle)
+        target = self._get_target()
+        self.env._enter()
+        with nogil:
+            ret = sp_delete(target, handle)
+        self.env._leave()
         doc.release_refs()
         return ret
 
@@ -827,6 +1665,132 @@ cdef class Database(object):
         for key in keys:
             self._delete((key,) if not isinstance(key, tuple) else key)
 
+    cdef _delete_range(self, tuple start, tuple stop, bint inclusive=False):
+        cdef:
+            int rc
+            bint covered = True
+            void *handle = sp_document(self.db)
+            void *stop_handle = sp_document(self.db)
+            void *target
+            Document doc = create_document(handle)
+            Document stop_doc = create_document(stop_handle)
+
+        # The stop document is handed over to the start document, and both
+        # are consumed by sp_delete().
+        self.schema.set_key(doc, start)
+        self.schema.set_key(stop_doc, stop)
+        if inclusive:
+            # The stop key is included by ending the range at the key which
+            # follows it, so that a single range delete covers it.
+            covered = self._key_successor(stop_doc)
+            if not covered:
+                self.schema.set_key(stop_doc, stop)
+        sp_setstring(handle, b'range_stop', stop_handle, 0)
+        target = self._get_target()
+        self.env._enter()
+        with nogil:
+            rc = sp_delete(target, handle)
+        self.env._leave()
+        doc.release_refs()
+        stop_doc.release_refs()
+        _check(self.env.env, rc)
+        if not covered:
+            # No key sorts after stop, it is deleted on its own.
+            self._delete(stop)
+
+    cdef bint _key_successor(self, Document doc) except -1:
+        # Replace the key of doc with the smallest key which follows it in
+        # the engine order. False if no key follows it.
+        cdef:
+            BaseIndex index
+            bytes succ
+            const char *buf
+            int i, kind, size
+            uint64_t value, top
+
+        for i in range(self.schema.key_length - 1, -1, -1):
+            index = self.schema.key[i]
+            kind = field_kind(index)
+            if kind == FIELD_STRING:
+                # String fields are stored with a terminating zero byte, the
+                # next string has one more zero byte.
+                buf = <const char *>sp_getfield(doc.handle, i, &size)
+                succ = PyBytes_FromStringAndSize(buf, size) + b'\x00'
+                doc.refs.append(succ)
+                sp_setfield(doc.handle, i, <const char *>succ, size + 1)
+                return True
+            top = (<uint64_t>-1) >> (64 - 8 * codec_width(index))
+            value = <uint64_t>sp_getfieldint(doc.handle, i)
+            if kind == FIELD_UNSIGNED:
+                if value < top:
+                    sp_setfieldint(doc.handle, i, <int64_t>(value + 1))
+                    return True
+                sp_setfieldint(doc.handle, i, 0)
+            else:
+                if value > 0:
+                    sp_setfieldint(doc.handle, i, <int64_t>(value - 1))
+                    return True
+                sp_setfieldint(doc.handle, i, <int64_t>top)
+        return False
+
+    cdef int _compare_keys(self, tuple a, tuple b) except? -2:
+        # Compare two keys in the engine order, which is reversed for the
+        # reverse-ordered index types.
+        cdef:
+            BaseIndex index
+            Document doc = create_document(sp_document(self.db))
+            Document other = create_document(sp_document(self.db))
+            field_spec *spec
+            int i, nfields = self.schema.key_length
+
+        spec = <field_spec *>malloc(sizeof(field_spec) * nfields)
+        try:
+            if not spec:
+                raise MemoryError()
+            self.schema.set_key(doc, a)
+            self.schema.set_key(other, b)
+            for i, index in enumerate(self.schema.key):
+                spec[i].pos = i
+                spec[i].kind = field_kind(index)
+            return compare_documents(doc.handle, other.handle, spec, nfields)
+        finally:
+            free(spec)
+            sp_destroy(doc.handle)
+            sp_destroy(other.handle)
+
+    def delete_range(self, start, stop):
+        check_open(self.env)
+        self._delete_range((start,) if not isinstance(start, tuple) else start,
+                           (stop,) if not isinstance(stop, tuple) else stop)
+
+    cdef _delete_slice(self, start, stop):
+        # Slices are inclusive of the stop key, as with get_range(). Open
+        # bounds are resolved to the first and last keys currently stored,
+        # by a cursor read before the range is deleted. A key written by
+        # another thread in between, beyond the resolved bound, is not
+        # deleted.
+        if start is None:
+            for start in self.cursor(values=False):
+                break
+            else:
+                return
+        if stop is None:
+            for stop in self.cursor(order='<=', values=False):
+                break
+            else:
+                return
+        start = (start,) if not isinstance(start, tuple) else start
+        stop = (stop,) if not isinstance(stop, tuple) else stop
+        if self.schema.multi_key:
+            start = normalize_tuple(self.schema, start)
+            stop = normalize_tuple(self.schema, stop)
+        else:
+            start = (normalize_value(self.schema, start[0]),)
+            stop = (normalize_value(self.schema, stop[0]),)
+        if self._compare_keys(start, stop) > 0:
+            start, stop = stop, start
+        self._delete_range(start, stop, True)
+
     def __getitem__(self, key):
         check_open(self.env)
         if isinstance(key, slice):
@@ -846,7 +1810,13 @@ cdef class Database(object):
         self.set(key, value)
 
     def __delitem__(self, key):
-        self.delete(key)
+        if isinstance(key, slice):
+            if key.step is not None:
+                raise ValueError('slice step is not supported.')
+            check_open(self.env)
+            self._delete_slice(key.start, key.stop)
+        else:
+            self.delete(key)
 
     def __contains__(self, key):
         return self.exists(key)
@@ -869,18 +1839,181 @@ cdef class Database(object):
 
     multi_set = update
 
+    cdef list _multi_get(self, list keys):
+        cdef:
+            Document doc = create_document(<void *>0)
+            int i = 0, n = len(keys)
+            void **handles = <void **>malloc(max(n, 1) * sizeof(void *))
+            void *target
+
+        if handles == NULL:
+            raise MemoryError()
+
+        # A single Document holds the key buffers for the whole batch, and is
+        # then re-pointed at each result to decode its value.
+        try:
+            for key in keys:
+                handles[i] = sp_document(self.db)
+                doc.handle = handles[i]
+                i += 1
+                self.schema.set_key(doc, (key,) if not isinstance(key, tuple)
+                                    else key)
+            target = self._get_target()
+            self.env._enter()
+        except:
+            # Documents are released along with a closed environment.
+            while i > 0 and self.env.is_open:
+                i -= 1
+                sp_destroy(handles[i])
+            free(handles)
+            raise
+
+        with nogil:
+            sp_getv(target, handles, n)
+        self.env._leave()
+        doc.release_refs()
+        return self._get_results(handles, n)
+
+    cdef list _get_results(self, void **handles, int n):
+        cdef:
+            int i
+            list accum = []
+
+        # Decodes and releases the result documents of sp_getv(), then frees
+        # the handle array.
+        try:
+            for i in range(n):
+                if not handles[i]:
+                    accum.append(None)
+                    continue
+                data = self.schema.load_value(handles[i])
+                sp_destroy(handles[i])
+                handles[i] = NULL
+                accum.append(data)
+        finally:
+            for i in range(n):
+                if handles[i]:
+                    sp_destroy(handles[i])
+            free(handles)
+        return accum
+
     def multi_get(self, keys):
-        return [self.get(key) for key in keys]
+        check_open(self.env)
+        return self._multi_get(list(keys))
 
     def multi_get_dict(self, keys):
         cdef dict accum = {}
-        for key in keys:
-            try:
-                accum[key] = self[key]
-            except KeyError:
-                pass
+        keys = list(keys)
+        check_open(self.env)
+        for key, value in zip(keys, self._multi_get(keys)):
+            if value is not None:
+                accum[key] = value
         return accum
 
+    def bulk_load(self, data, sort=False):
+        cdef:
+            void *loader
+            long n
+
+        check_open(self.env)
+        if isinstance(data, dict):
+            data = data.items()
+        if sort:
+            data = self._sort_rows(data)
+
+        # The loader writes node files directly, bypassing the write-ahead
+        # log and the in-memory index. It is only available on an empty
+        # database and requires keys to be in ascending order.
+        loader = self._load_begin()
+        try:
+            n = self._load_rows(loader, data)
+        except:
+            if self.env.is_open:
+                sp_destroy(loader)
+            raise
+        self._load_commit(loader)
+        return n
+
+    cdef list _sort_rows(self, data):
+        # Sort rows by key in the engine order. String fields compare by their
+        # encoded bytes, so serialized keys sort the way they are stored, and
+        # the reverse-ordered index types sort descending.
+        cdef:
+            BaseIndex index
+            Document doc = create_document(<void *>0)
+            const char *buf
+            int i, kind, size
+            list rows = list(data)
+            list keys = []
+            list parts
+            tuple key
+
+        for item in rows:
+            key = item[0] if isinstance(item[0], tuple) else (item[0],)
+            doc.handle = sp_document(self.db)
+            parts = []
+            try:
+                self.schema.set_key(doc, key)
+                for i, index in enumerate(self.schema.key):
+                    kind = field_kind(index)
+                    if kind == FIELD_STRING:
+                        buf = <const char *>sp_getfield(doc.handle, i, &size)
+                        parts.append(buf[:size])
+                    elif kind == FIELD_UNSIGNED_REV:
+                        parts.append(
+                            -int(<uint64_t>sp_getfieldint(doc.handle, i)))
+                    else:
+                        parts.append(<uint64_t>sp_getfieldint(doc.handle, i))
+            finally:
+                sp_destroy(doc.handle)
+                doc.release_refs()
+            keys.append(tuple(parts))
+        return [rows[n] for n in sorted(range(len(rows)),
+                                         key=keys.__getitem__)]
+
+    cdef void *_load_begin(self) except NULL:
+        cdef void *loader = sp_begin(self.db)
+        if not loader:
+            _check(self.env.env, -1)
+        return loader
+
+    cdef long _load_rows(self, void *loader, data) except -1:
+        # The loader is left to the caller when a row is rejected.
+        cdef:
+            Document doc = create_document(<void *>0)
+            void *handle
+            int rc
+            long n = 0
+
+        for key, value in data:
+            handle = sp_document(self.db)
+            doc.handle = handle
+            try:
+                self.schema.set_key(doc, (key,) if not isinstance(key, tuple)
+                                    else key)
+                self.schema.set_value(doc, (value,)
+                                      if not isinstance(value, tuple)
+                                      else value)
+            except:
+                sp_destroy(handle)
+                raise
+            self.env._enter()
+            with nogil:
+                rc = sp_set(loader, handle)
+            self.env._leave()
+            doc.release_refs()
+            _check(self.env.env, rc)
+            n += 1
+        return n
+
+    cdef _load_commit(self, void *loader):
+        cdef int rc
+        self.env._enter()
+        with nogil:
+            rc = sp_commit(loader)
+        self.env._leave()
+        _check(self.env.env, rc)
+
     def get_range(self, start=None, stop=None, reverse=False):
         cdef Cursor cursor
         first = start is None
@@ -932,17 +2065,86 @@ cdef class Database(object):
         return iter(self.cursor())
 
     def __len__(self):
+        return self.count()
+
+    def count(self, start=None, stop=None):
         cdef:
-            int i = 0
-            Cursor curs = self.cursor(keys=False, values=False)
-        for _ in curs: i += 1
-        return i
+            Schema schema = self.schema
+            BaseIndex index
+            Document doc, bound
+            field_spec *spec = NULL
+            void *cursor
+            void *handle
+            int i, nfields = 0
+            int64_t n = 0
+
+        check_open(self.env)
+        handle = sp_document(self.db)
+        doc = create_document(handle)
+        if start is not None:
+            try:
+                schema.set_key(doc, (start,) if not isinstance(start, tuple)
+                               else start)
+            except:
+                sp_destroy(handle)
+                raise
+        sp_setstring(handle, b'order', b'>=', 0)
+
+        # The stop key is set on a document of its own, so its fields can be
+        # compared in the engine's own encoding.
+        bound = create_document(sp_document(self.db) if stop is not None
+                                else <void *>0)
+        try:
+            if stop is not None:
+                schema.set_key(bound, (stop,) if not isinstance(stop, tuple)
+                               else stop)
+                nfields = schema.key_length
+                spec = <field_spec *>malloc(sizeof(field_spec) * nfields)
+                if not spec:
+                    raise MemoryError()
+                for i, index in enumerate(schema.key):
+                    spec[i].pos = i
+                    spec[i].kind = field_kind(index)
+                    if spec[i].kind == FIELD_STRING:
+                        spec[i].sval = <const char *>sp_getfield(
+                            bound.handle, i, &spec[i].ssize)
+                    else:
+                        spec[i].ival = sp_getfieldint(bound.handle, i)
+        except:
+            sp_destroy(handle)
+            if bound.handle:
+                sp_destroy(bound.handle)
+            raise
+
+        try:
+            self.env._enter()
+        except:
+            free(spec)
+            raise
+        cursor = sp_cursor(self._get_cursor_target())
+        with nogil:
+            while True:
+                handle = sp_get(cursor, handle)
+                if not handle:
+                    break
+                if spec and compare_key(handle, spec, nfields) > 0:
+                    sp_destroy(handle)
+                    break
+                n += 1
+            sp_destroy(cursor)
+        self.env._leave()
+        if bound.handle:
+            sp_destroy(bound.handle)
+        free(spec)
+        return n
 
     cpdef Cursor cursor(self, order='>=', key=None, prefix=None, keys=True,
-                        values=True):
+                        values=True, buffers=False, readahead_pages=0,
+                        chunk_size=0):
         check_open(self.env)
         return Cursor(db=self, order=order, key=key, prefix=prefix, keys=keys,
-                      values=values)
+                      values=values, buffers=buffers,
+                      readahead_pages=readahead_pages, chunk_size=chunk_size)
 
     database_name = __dbconfig_ro__('name', is_string=True)
     database_id = __dbconfig_ro__('id')
@@ -952,53 +2154,122 @@ cdef class Database(object):
     direct_io = __dbconfig__('direct_io')
     sync = __dbconfig__('sync')
     expire = __dbconfig__('expire')
-    compression = __dbconfig_s__('compression')  # lz4, zstd, none
-
-    limit_key = __dbconfig_ro__('limit.key')
+    compression = __dbconfig_s__('compression')  # lz4, lz4_dict, zstd, none
+    compression_dict_size = __dbconfig__('compression_dict_size')
+    compression_dict = __dbconfig_ro__('compression_dict')
+    memtable = __dbconfig_s__('memtable')  # rbtree, btree
+    upsert_operator = __dbconfig_s__('upsert_operator')
+    upsert_limit = __dbconfig__('upsert_limit')
+    value_log_threshold = __dbconfig__('value_log_threshold')
+
+    limit_key = __dbconfig_ro__('limit.key', combine=max)
     limit_field = __dbconfig__('limit.field')
 
-    index_memory_used = __dbconfig_ro__('index.memory_used')
-    index_size = __dbconfig_ro__('index.size')
-    index_size_uncompressed = __dbconfig_ro__('index.size_uncompressed')
-    index_count = __dbconfig_ro__('index.count')
-    index_count_dup = __dbconfig_ro__('index.count_dup')
-    index_read_disk = __dbconfig_ro__('index.read_disk')
-    index_read_cache = __dbconfig_ro__('index.read_cache')
-    index_node_count = __dbconfig_ro__('index.node_count')
-    index_page_count = __dbconfig_ro__('index.page_count')
+    index_memory_used = __dbcounter__('index.memory_used')
+    index_size = __dbcounter__('index.size')
+    index_size_uncompressed = __dbcounter__('index.size_uncompressed')
+    index_count = __dbcounter__('index.count')
+    index_count_dup = __dbcounter__('index.count_dup')
+    index_read_disk = __dbcounter__('index.read_disk')
+    index_read_cache = __dbcounter__('index.read_cache')
+    index_bloom_skip = __dbcounter__('index.bloom_skip')
+    index_bloom_false_positive = __dbcounter__('index.bloom_false_positive')
+    index_node_count = __dbcounter__('index.node_count')
+    index_page_count = __dbcounter__('index.page_count')
+    index_value_log_files = __dbcounter__('index.value_log_files')
+    index_value_log_size = __dbcounter__('index.value_log_size')
+    index_value_log_live = __dbcounter__('index.value_log_live')
+    index_range_deletes = __dbcounter__('index.range_deletes')
 
     compaction_cache = __dbconfig__('compaction.cache')
     compaction_checkpoint = __dbconfig__('compaction.checkpoint')
     compaction_node_size = __dbconfig__('compaction.node_size')
     compaction_page_size = __dbconfig__('compaction.page_size')
     compaction_page_checksum = __dbconfig__('compaction.page_checksum')
+    compaction_page_prefix = __dbconfig__('compaction.page_prefix')
+    compaction_bloom_bits_per_key = __dbconfig__(
+        'compaction.bloom_bits_per_key')
     compaction_expire_period = __dbconfig__('compaction.expire_period')
+    compaction_expire_wm = __dbconfig__('compaction.expire_wm')
     compaction_gc_wm = __dbconfig__('compaction.gc_wm')
     compaction_gc_period = __dbconfig__('compaction.gc_period')
 
-    stat_documents_used = __dbconfig_ro__('stat.documents_used')
-    stat_documents = __dbconfig_ro__('stat.documents')
+    stat_documents_used = __dbcounter__('stat.documents_used')
+    stat_documents = __dbcounter__('stat.documents')
     stat_field = __dbconfig_ro__('stat.field', is_string=True)
-    stat_set = __dbconfig_ro__('stat.set')
+    stat_set = __dbcounter__('stat.set')
     stat_set_latency = __dbconfig_ro__('stat.set_latency', is_string=True)
-    stat_delete = __dbconfig_ro__('stat.delete')
+    stat_delete = __dbcounter__('stat.delete')
     stat_delete_latency = __dbconfig_ro__('stat.delete_latency', True)
-    stat_get = __dbconfig_ro__('stat.get')
+    stat_upsert = __dbcounter__('stat.upsert')
+    stat_upsert_latency = __dbconfig_ro__('stat.upsert_latency', True)
+    stat_get = __dbcounter__('stat.get')
     stat_get_latency = __dbconfig_ro__('stat.get_latency', is_string=True)
     stat_get_read_disk = __dbconfig_ro__('stat.get_read_disk', is_string=True)
     stat_get_read_cache = __dbconfig_ro__('stat.get_read_cache', True)
-    stat_pread = __dbconfig_ro__('stat.pread')
+    stat_pread = __dbcounter__('stat.pread')
     stat_pread_latency = __dbconfig_ro__('stat.pread_latency', is_string=True)
-    stat_cursor = __dbconfig_ro__('stat.cursor')
+    stat_cursor = __dbcounter__('stat.cursor')
     stat_cursor_latency = __dbconfig_ro__('stat.cursor_latency', True)
     stat_cursor_read_disk = __dbconfig_ro__('stat.cursor_read_disk', True)
     stat_cursor_read_cache = __dbconfig_ro__('stat.cursor_read_cache', True)
     stat_cursor_ops = __dbconfig_ro__('stat.cursor_ops', True)
+    stat_get_hist = __dbconfig_ro__('stat.get_hist', True)
+    stat_get_memory_hist = __dbconfig_ro__('stat.get_memory_hist', True)
+    stat_get_disk_hist = __dbconfig_ro__('stat.get_disk_hist', True)
+    stat_get_upsert_hist = __dbconfig_ro__('stat.get_upsert_hist', True)
+    stat_set_hist = __dbconfig_ro__('stat.set_hist', True)
+    stat_delete_hist = __dbconfig_ro__('stat.delete_hist', True)
+    stat_upsert_hist = __dbconfig_ro__('stat.upsert_hist', True)
+    stat_cursor_hist = __dbconfig_ro__('stat.cursor_hist', True)
+    stat_pread_hist = __dbconfig_ro__('stat.pread_hist', True)
+    stat_decompress_hist = __dbconfig_ro__('stat.decompress_hist', True)
+
+    def train_compression(self):
+        check_open(self.env)
+        # Not stored with the settings, training is not replayed on open.
+        key = '.'.join(('db', self.name, 'compression_train'))
+        self.env.config._set(encode(key), 0)
 
-    scheduler_checkpoint = __dbconfig_ro__('scheduler.checkpoint')
-    scheduler_gc = __dbconfig_ro__('scheduler.gc')
-    scheduler_expire = __dbconfig_ro__('scheduler.expire')
-    scheduler_backup = __dbconfig_ro__('scheduler.backup')
+    def stats(self):
+        check_open(self.env)
+        return {
+            'documents': self.stat_documents,
+            'documents_used': self.stat_documents_used,
+            'get': {
+                'count': self.stat_get,
+                'latency': _parse_hist(self.stat_get_hist),
+                'memory': _parse_hist(self.stat_get_memory_hist),
+                'disk': _parse_hist(self.stat_get_disk_hist),
+                'upsert': _parse_hist(self.stat_get_upsert_hist)},
+            'set': {
+                'count': self.stat_set,
+                'latency': _parse_hist(self.stat_set_hist)},
+            'delete': {
+                'count': self.stat_delete,
+                'latency': _parse_hist(self.stat_delete_hist)},
+            'upsert': {
+                'count': self.stat_upsert,
+                'latency': _parse_hist(self.stat_upsert_hist)},
+            'cursor': {
+                'count': self.stat_cursor,
+                'latency': _parse_hist(self.stat_cursor_hist)},
+            'pread': {
+                'count': self.stat_pread,
+                'latency': _parse_hist(self.stat_pread_hist)},
+            'decompress': {
+                'latency': _parse_hist(self.stat_decompress_hist)}}
+
+    scheduler_checkpoint = __dbconfig_ro__('scheduler.checkpoint', combine=max)
+    scheduler_gc = __dbconfig_ro__('scheduler.gc', combine=max)
+    scheduler_expire = __dbconfig_ro__('scheduler.expire', combine=max)
+    scheduler_expire_drop = __dbcounter__('scheduler.expire_drop')
+    scheduler_expire_rewrite = __dbcounter__('scheduler.expire_rewrite')
+    scheduler_backup = __dbconfig_ro__('scheduler.backup', combine=max)
+    scheduler_weight = __dbconfig__('scheduler.weight')
+    scheduler_workers = __dbconfig__('scheduler.workers')
+    scheduler_active = __dbcounter__('scheduler.active')
+    scheduler_backlog = __dbconfig_ro__('scheduler.backlog', combine=max)
 
 
 cdef class DatabaseTransaction(Database):
@@ -1016,6 +2287,269 @@ cdef class DatabaseTransaction(Database):
         return self.transaction.txn
 
 
+cdef class DatabaseSnapshot(Database):
+    cdef:
+        Snapshot snapshot
+
+    def __init__(self, Database db, Snapshot snapshot):
+        super(DatabaseSnapshot, self).__init__(db.env, db.name, db.schema)
+        self.snapshot = snapshot
+        self.db = db.db
+
+    cdef void *_get_target(self) except NULL:
+        if not self.snapshot.snapshot:
+            raise SophiaError('Snapshot is not active.')
+        return self.snapshot.snapshot
+
+    cdef void *_get_cursor_target(self) except NULL:
+        # Cursors opened from a snapshot read at its lsn.
+        return self._get_target()
+
+    cdef _set(self, tuple key, tuple value):
+        raise SophiaError('Snapshot is read-only.')
+
+    cdef _upsert(self, tuple key, tuple value):
+        raise SophiaError('Snapshot is read-only.')
+
+    cdef _delete(self, tuple key):
+        raise SophiaError('Snapshot is read-only.')
+
+    cdef _delete_range(self, tuple start, tuple stop, bint inclusive=False):
+        raise SophiaError('Snapshot is read-only.')
+
+    def update(self, dict _data=None, **kwargs):
+        raise SophiaError('Snapshot is read-only.')
+
+    multi_set = update
+
+    def bulk_load(self, data, sort=False):
+        raise SophiaError('Snapshot is read-only.')
+
+
+cdef class ShardedDatabase(Database):
+    # A database split into hidden shards by a hash of the key. Each shard is
+    # an engine database of its own, with its own index lock, in-memory index
+    # and compaction, so the scheduler can work on the shards in parallel.
+    cdef:
+        readonly list shards
+        list base
+        Database meta
+        int nshards
+        bint read_only
+
+    def __init__(self, Sophia env, name, schema, shards):
+        super(ShardedDatabase, self).__init__(env, name, schema)
+        if shards < 1:
+            raise ValueError('shards must be positive.')
+        self.nshards = shards
+        self.shards = [Database(env, self.bname + encode('_shard%d' % i),
+                                schema) for i in range(shards)]
+        self.base = self.shards
+        # The number of shards is recorded in a database of its own, the
+        # shards only hold rows of the schema.
+        self.meta = Database(env, self.bname + b'_shards',
+                             Schema([StringIndex('key')], [U64Index('value')]))
+
+    cdef check_shards(self):
+        # The shard of a key depends on the number of shards, so it is
+        # recorded on the first open and must not change afterwards.
+        nshards = self.meta.get('shards')
+        if nshards is None:
+            self.meta.set('shards', self.nshards)
+        elif nshards != self.nshards:
+            raise SophiaError('database %s has %d shards, cannot be opened '
+                              'with %d.' % (decode(self.name), nshards,
+                                            self.nshards))
+
+    cdef ShardedDatabase _bind(self, list shards, bint read_only):
+        cdef ShardedDatabase view = ShardedDatabase.__new__(ShardedDatabase)
+        view.env = self.env
+        view.name = self.name
+        view.bname = self.bname
+        view.schema = self.schema
+        view.shards = shards
+        view.base = self.base
+        view.nshards = self.nshards
+        view.read_only = read_only
+        return view
+
+    cdef ShardedDatabase bind_transaction(self, Transaction transaction):
+        # Writes to every shard go through the one engine transaction, so
+        # they commit or roll back together.
+        return self._bind([DatabaseTransaction(db, transaction)
+                           for db in self.base], False)
+
+    cdef ShardedDatabase bind_snapshot(self, Snapshot snapshot):
+        return self._bind([DatabaseSnapshot(db, snapshot)
+                           for db in self.base], True)
+
+    cdef Database route(self, tuple key):
+        return self.shards[self.schema.shard_key(key, self.nshards)]
+
+    cdef void *_get_target(self) except NULL:
+        raise SophiaError('sharded database has no single target.')
+
+    cdef void *_get_cursor_target(self) except NULL:
+        return (<Database>self.shards[0])._get_cursor_target()
+
+    cdef _set(self, tuple key, tuple value):
+        return self.route(key)._set(key, value)
+
+    cdef _upsert(self, tuple key, tuple value):
+        return self.route(key)._upsert(key, value)
+
+    cdef tuple _get(self, tuple key, bint buffers=False):
+        return self.route(key)._get(key, buffers)
+
+    cdef tuple _get_cached(self, tuple key):
+        cdef Database db = self.route(key)
+        done, data = db._get_cached(key)
+        if done:
+            return (done, data)
+        # The pending document is tagged with its shard for
+        # _get_documents().
+        return (False, (db, data))
+
+    def _get_documents(self, list docs):
+        cdef:
+            Database db
+            dict groups = {}
+            list accum = [None] * len(docs)
+            int i
+
+        for i, (db, doc) in enumerate(docs):
+            groups.setdefault(db, []).append((i, doc))
+        for db, items in groups.items():
+            results = db._get_documents([doc for _, doc in items])
+            for (i, _), value in zip(items, results):
+                accum[i] = value
+        return accum
+
+    cdef _exists(self, tuple key):
+        return self.route(key)._exists(key)
+
+    cdef _delete(self, tuple key):
+        return self.route(key)._delete(key)
+
+    cdef _delete_range(self, tuple start, tuple stop, bint inclusive=False):
+        # Written as one range tombstone per shard.
+        cdef Database db
+        for db in self.shards:
+            db._delete_range(start, stop, inclusive)
+
+    cdef int _compare_keys(self, tuple a, tuple b) except? -2:
+        return (<Database>self.shards[0])._compare_keys(a, b)
+
+    cdef list _multi_get(self, list keys):
+        cdef:
+            Database db
+            list groups = [None] * self.nshards
+            list accum = [None] * len(keys)
+            int i, shard
+
+        # Keys are batched per shard, each batch is read with one sp_getv().
+        for i, key in enumerate(keys):
+            shard = self.schema.shard_key(
+                (key,) if not isinstance(key, tuple) else key, self.nshards)
+            if groups[shard] is None:
+                groups[shard] = ([], [])
+            groups[shard][0].append(i)
+            groups[shard][1].append(key)
+        for shard in range(self.nshards):
+            if groups[shard] is None:
+                continue
+            db = self.shards[shard]
+            for i, value in zip(groups[shard][0],
+                                db._multi_get(groups[shard][1])):
+                accum[i] = value
+        return accum
+
+    def update(self, dict _data=None, **kwargs):
+        if self.read_only:
+            raise SophiaError('Snapshot is read-only.')
+        return super(ShardedDatabase, self).update(_data, **kwargs)
+
+    multi_set = update
+
+    def bulk_load(self, data, sort=False):
+        cdef:
+            Database db
+            list rows = [[] for _ in range(self.nshards)]
+            void **loaders
+            void *loader
+            long n = 0
+            int i
+
+        if self.read_only:
+            raise SophiaError('Snapshot is read-only.')
+        check_open(self.env)
+        if isinstance(data, dict):
+            data = data.items()
+        if sort:
+            data = (<Database>self.shards[0])._sort_rows(data)
+
+        # Rows of one shard keep the order of the input, so every shard is
+        # loaded in ascending key order.
+        for key, value in data:
+            rows[self.schema.shard_key(
+                (key,) if not isinstance(key, tuple) else key,
+                self.nshards)].append((key, value))
+
+        # Every row is handed to the loader of its shard before any of the
+        # shards is committed, so a rejected row leaves every shard empty.
+        loaders = <void **>calloc(self.nshards, sizeof(void *))
+        if loaders == NULL:
+            raise MemoryError()
+        try:
+            for i, db in enumerate(self.shards):
+                if rows[i]:
+                    loaders[i] = db._load_begin()
+            for i, db in enumerate(self.shards):
+                if rows[i]:
+                    n += db._load_rows(loaders[i], rows[i])
+
+            # A commit fails on I/O errors, the shards committed before it
+            # keep their rows. A read view opened during the load makes the
+            # first shard refuse its commit, as the environment shares one
+            # transaction manager.
+            for i, db in enumerate(self.shards):
+                if loaders[i]:
+                    loader = loaders[i]
+                    loaders[i] = NULL
+                    db._load_commit(loader)
+        finally:
+            for i in range(self.nshards):
+                if loaders[i] and self.env.is_open:
+                    sp_destroy(loaders[i])
+            free(loaders)
+        return n
+
+    def count(self, start=None, stop=None):
+        return sum([db.count(start, stop) for db in self.shards])
+
+    cpdef Cursor cursor(self, order='>=', key=None, prefix=None, keys=True,
+                        values=True, buffers=False, readahead_pages=0,
+                        chunk_size=0):
+        check_open(self.env)
+        if buffers:
+            raise ValueError('buffers are not supported by sharded '
+                             'databases.')
+        return ShardedCursor(self, order=order, key=key, prefix=prefix,
+                             keys=keys, values=values,
+                             readahead_pages=readahead_pages,
+                             chunk_size=chunk_size)
+
+    def train_compression(self):
+        for db in self.shards:
+            db.train_compression()
+
+    def stats(self):
+        cdef list shards = [db.stats() for db in self.shards]
+        cdef dict stats = _merge_stats(shards)
+        stats['shards'] = shards
+        return stats
+
+
 @cython.freelist(32)
 cdef class Cursor(object):
     cdef:
@@ -1023,13 +2557,27 @@ cdef class Cursor(object):
         Document current_item
         readonly bint keys
         readonly bint values
+        readonly bint buffers
+        readonly int readahead_pages
+        readonly int chunk_size
         readonly bytes order
         readonly bytes prefix
         readonly key
+        list views
+        list chunk
+        Py_ssize_t chunk_pos
         void *cursor
+        int generation
 
     def __cinit__(self, Database db, order='>=', key=None, prefix=None,
-                  keys=True, values=True):
+                  keys=True, values=True, buffers=False, readahead_pages=0,
+                  chunk_size=0):
+        if readahead_pages < 0:
+            raise ValueError('readahead_pages must not be negative.')
+        if chunk_size < 0:
+            raise ValueError('chunk_size must not be negative.')
+        if chunk_size and buffers:
+            raise ValueError('chunk_size cannot be used with buffers.')
         self.db = db
         self.order = encode(order)
         if key:
@@ -1037,23 +2585,41 @@ cdef class Cursor(object):
         self.prefix = encode(prefix) if prefix else None
         self.keys = keys
         self.values = values
+        self.buffers = buffers
+        self.readahead_pages = readahead_pages
+        self.chunk_size = chunk_size
+        self.views = []
+        self.chunk = None
+        self.chunk_pos = 0
         self.current_item = None
         self.cursor = <void *>0
 
     def __dealloc__(self):
-        if not self.db.env.is_open:
-            return
-
-        if self.cursor:
+        if self.cursor and is_current(self.db.env, self.generation):
             sp_destroy(self.cursor)
 
     def __iter__(self):
         check_open(self.db.env)
         if self.cursor:
-            sp_destroy(self.cursor)
+            # Buffers handed out for the current row point into the
+            # document released along with the cursor.
+            self._invalidate()
+            if is_current(self.db.env, self.generation):
+                sp_destroy(self.cursor)
             self.cursor = <void *>0
 
-        self.cursor = sp_cursor(self.db.env.env)
+        self.chunk = None
+        self.chunk_pos = 0
+        self.cursor = sp_cursor(self.db._get_cursor_target())
+        self.generation = self.db.env.generation
+        if self.readahead_pages:
+            # Hint the kernel to read the following node file pages while
+            # the current one is consumed.
+            _check(self.db.env.env, sp_setint(self.cursor, b'readahead',
+                                              self.readahead_pages))
+        if not self.values:
+            # Values kept in the value log are not read at all.
+            _check(self.db.env.env, sp_setint(self.cursor, b'keys_only', 1))
         cdef void *handle = sp_document(self.db.db)
         self.current_item = create_document(handle)
         if self.key:
@@ -1065,8 +2631,28 @@ cdef class Cursor(object):
                          (sizeof(char) * len(self.prefix)))
         return self
 
+    cdef _invalidate(self):
+        cdef Buffer b
+        for b in self.views:
+            b.invalidate()
+        self.views = []
+
     def __next__(self):
-        cdef void *handle = sp_get(self.cursor, self.current_item.handle)
+        if self.chunk_size:
+            return self._next_chunk()
+
+        cdef:
+            void *cursor = self.cursor
+            void *handle = self.current_item.handle
+
+        # The engine releases the current document when the cursor advances,
+        # so buffers handed out for it must not outlive this call.
+        if self.views:
+            self._invalidate()
+        self.db.env._enter()
+        with nogil:
+            handle = sp_get(cursor, handle)
+        self.db.env._leave()
         if not handle:
             sp_destroy(self.cursor)
             self.cursor = <void *>0
@@ -1074,18 +2660,584 @@ cdef class Cursor(object):
         else:
             self.current_item.handle = handle
 
+        cdef Schema schema = self.db.schema
+
+        if self.buffers:
+            return self._next_buffers(schema)
+
+        if self.keys and self.values:
+            return (schema.load_key(handle), schema.load_value(handle))
+        elif self.keys:
+            return schema.load_key(handle)
+        elif self.values:
+            return schema.load_value(handle)
+
+    cdef _next_buffers(self, Schema schema):
         cdef:
-            Schema schema = self.db.schema
+            Sophia env = self.db.env
             tuple key, value
 
+        if self.keys:
+            key = schema.get_key_buffer(self.current_item, self, env)
+        if self.values:
+            value = schema.get_value_buffer(self.current_item, self, env)
         if self.keys and self.values:
-            key = schema.get_key(self.current_item)
-            value = schema.get_value(self.current_item)
             return (key if schema.multi_key else key[0],
                     value if schema.multi_value else value[0])
         elif self.keys:
-            key = schema.get_key(self.current_item)
             return key if schema.multi_key else key[0]
         elif self.values:
-            value = schema.get_value(self.current_item)
             return value if schema.multi_value else value[0]
+
+    cdef _next_chunk(self):
+        if self.chunk is None or self.chunk_pos >= len(self.chunk):
+            self.chunk = self._fetch(self.chunk_size)
+            self.chunk_pos = 0
+            if not self.chunk:
+                raise StopIteration
+        row = self.chunk[self.chunk_pos]
+        self.chunk_pos += 1
+        return row
+
+    def fetchmany(self, n):
+        """
+        Return a list of up to ``n`` rows, empty once the cursor is
+        exhausted. The rows are read by a single call into the engine and
+        decoded afterwards.
+        """
+        cdef list rows = []
+
+        if self.buffers:
+            raise ValueError('fetchmany() cannot be used with buffers.')
+        if self.current_item is None:
+            self.__iter__()
+
+        # Rows already read by a chunked iteration are returned first.
+        if self.chunk is not None and self.chunk_pos < len(self.chunk):
+            rows = self.chunk[self.chunk_pos:self.chunk_pos + n]
+            self.chunk_pos += len(rows)
+        if len(rows) < n:
+            rows.extend(self._fetch(n - len(rows)))
+        return rows
+
+    cdef list _fetch(self, int n):
+        cdef:
+            Schema schema = self.db.schema
+            BaseIndex index
+            list indexes = []
+            list accum = []
+            list row
+            field_spec *spec
+            field_slot *slots
+            field_slot *slot
+            char *arena = NULL
+            char *tmp
+            const char *buf
+            size_t arena_size = 0, arena_used = 0, needed
+            void *cursor = self.cursor
+            void *handle
+            int i, first, nfields, nkeys, nrows = 0, r, size
+            bint done = False, oom = False
+
+        if not cursor or n <= 0:
+            return accum
+        check_open(self.db.env)
+
+        if self.keys:
+            indexes.extend(schema.key)
+        if self.values:
+            indexes.extend(schema.value)
+        nfields = len(indexes)
+        nkeys = schema.key_length if self.keys else 0
+        first = 0 if self.keys else schema.key_length
+
+        spec = <field_spec *>malloc(sizeof(field_spec) * (nfields + 1))
+        slots = <field_slot *>malloc(sizeof(field_slot) * (nfields * n + 1))
+        if not spec or not slots:
+            free(spec)
+            free(slots)
+            raise MemoryError()
+        for i, index in enumerate(indexes):
+            spec[i].pos = first + i
+            spec[i].kind = field_kind(index)
+
+        # Integer fields are stored in the slots directly, strings are copied
+        # into a single arena, since the engine releases each document when
+        # the cursor advances.
+        handle = self.current_item.handle
+        self.db.env._enter()
+        with nogil:
+            while nrows < n:
+                handle = sp_get(cursor, handle)
+                if not handle:
+                    done = True
+                    break
+                slot = slots + nrows * nfields
+                for i in range(nfields):
+                    if spec[i].kind != FIELD_STRING:
+                        slot[i].value = sp_getfieldint(handle, spec[i].pos)
+                        slot[i].size = -1
+                        continue
+                    buf = <const char *>sp_getfield(handle, spec[i].pos,
+                                                    &size)
+                    if not buf:
+                        size = 0
+                    if arena_used + size > arena_size:
+                        needed = arena_size * 2 if arena_size else 4096
+                        while needed < arena_used + size:
+                            needed *= 2
+                        tmp = <char *>realloc(arena, needed)
+                        if not tmp:
+                            oom = True
+                            break
+                        arena = tmp
+                        arena_size = needed
+                    if size:
+                        memcpy(arena + arena_used, buf, size)
+                    slot[i].value = arena_used
+                    slot[i].size = size
+                    arena_used += size
+                if oom:
+                    break
+                nrows += 1
+        self.db.env._leave()
+
+        if done:
+            sp_destroy(self.cursor)
+            self.cursor = <void *>0
+        else:
+            self.current_item.handle = handle
+
+        try:
+            if oom:
+                raise MemoryError()
+            for r in range(nrows):
+                slot = slots + r * nfields
+                row = []
+                for i in range(nfields):
+                    if slot[i].size < 0:
+                        row.append(slot[i].value)
+                    elif slot[i].size == 0:
+                        row.append(None)
+                    else:
+                        row.append(schema.decode_raw(first + i,
+                                                     arena + slot[i].value,
+                                                     slot[i].size - 1))
+                accum.append(self._make_row(schema, row, nkeys))
+        finally:
+            free(spec)
+            free(slots)
+            free(arena)
+        return accum
+
+    cdef _make_row(self, Schema schema, list row, int nkeys):
+        if self.keys and self.values:
+            return (tuple(row[:nkeys]) if schema.multi_key else row[0],
+                    tuple(row[nkeys:]) if schema.multi_value else row[nkeys])
+        elif self.keys:
+            return tuple(row) if schema.multi_key else row[0]
+        elif self.values:
+            return tuple(row) if schema.multi_value else row[0]
+
+cdef class ShardedCursor(Cursor):
+    # Ordered iteration over a sharded database, a merge of the rows of every
+    # shard. The shards are read through one engine cursor, so they are all
+    # seen at the same snapshot.
+    cdef:
+        void **heads
+        field_spec *spec
+        int nshards
+        int nfields
+        bint descending
+        bint started
+
+    def __cinit__(self, *args, **kwargs):
+        self.heads = NULL
+        self.spec = NULL
+
+    def __dealloc__(self):
+        self._release()
+
+    cdef _release(self):
+        cdef int i
+        if self.heads != NULL and is_current(self.db.env, self.generation):
+            for i in range(self.nshards):
+                if self.heads[i] != NULL:
+                    sp_destroy(self.heads[i])
+        free(self.heads)
+        free(self.spec)
+        self.heads = NULL
+        self.spec = NULL
+
+    cdef _close(self):
+        self._release()
+        if self.cursor and is_current(self.db.env, self.generation):
+            sp_destroy(self.cursor)
+        self.cursor = <void *>0
+
+    def __iter__(self):
+        cdef:
+            ShardedDatabase db = <ShardedDatabase>self.db
+            Database shard
+            Schema schema = db.schema
+            BaseIndex index
+            Document doc
+            void *cursor
+            void *handle
+            int i
+
+        check_open(db.env)
+        self._close()
+        self.started = True
+        self.nshards = db.nshards
+        self.nfields = schema.key_length
+        self.descending = self.order in (b'<', b'<=')
+        self.heads = <void **>calloc(self.nshards, sizeof(void *))
+        self.spec = <field_spec *>malloc(sizeof(field_spec) * self.nfields)
+        if not self.heads or not self.spec:
+            self._release()
+            raise MemoryError()
+        for i, index in enumerate(schema.key):
+            self.spec[i].pos = i
+            self.spec[i].kind = field_kind(index)
+
+        self.cursor = cursor = sp_cursor(db._get_cursor_target())
+        self.generation = db.env.generation
+        if self.readahead_pages:
+            _check(db.env.env, sp_setint(cursor, b'readahead',
+                                         self.readahead_pages))
+        if not self.values:
+            _check(db.env.env, sp_setint(cursor, b'keys_only', 1))
+
+        # Position every shard on its first row.
+        for i, shard in enumerate(db.shards):
+            doc = create_document(sp_document(shard.db))
+            if self.key:
+                try:
+                    schema.set_key(doc, self.key)
+                except:
+                    sp_destroy(doc.handle)
+                    raise
+            sp_setstring(doc.handle, b'order', <char *>self.order, 0)
+            if self.prefix:
+                sp_setstring(doc.handle, b'prefix', <char *>self.prefix,
+                             (sizeof(char) * len(self.prefix)))
+            handle = doc.handle
+            self.db.env._enter()
+            with nogil:
+                handle = sp_get(cursor, handle)
+            self.db.env._leave()
+            self.heads[i] = handle
+        return self
+
+    def __next__(self):
+        cdef:
+            Schema schema = self.db.schema
+            void *cursor = self.cursor
+            void **heads = self.heads
+            field_spec *spec = self.spec
+            void *handle
+            int best, nshards = self.nshards, nfields = self.nfields
+            bint descending = self.descending
+
+        if heads == NULL:
+            raise StopIteration
+        self.db.env._enter()
+        with nogil:
+            best = merge_pick(heads, nshards, spec, nfields, descending)
+        self.db.env._leave()
+        if best < 0:
+            self._close()
+            raise StopIteration
+
+        handle = heads[best]
+        if self.keys and self.values:
+            row = (schema.load_key(handle), schema.load_value(handle))
+        elif self.keys:
+            row = schema.load_key(handle)
+        else:
+            row = schema.load_value(handle)
+
+        # The row is decoded before the shard advances, since the engine
+        # releases the document it is handed.
+        self.db.env._enter()
+        with nogil:
+            handle = sp_get(cursor, handle)
+        self.db.env._leave()
+        heads[best] = handle
+        return row
+
+    def fetchmany(self, n):
+        cdef list rows = []
+
+        if not self.started:
+            self.__iter__()
+        while len(rows) < n:
+            try:
+                rows.append(next(self))
+            except StopIteration:
+                break
+        return rows
+
+
+class AsyncSophia(object):
+    """
+    asyncio interface to an environment. Engine calls that may wait for a
+    node file read or a log fsync run on a pool of worker threads, which do
+    not hold the GIL while inside the engine. Lookups served by the in-memory
+    index, and writes while the log is not synced, complete on the event loop
+    thread without a thread hop, unless another thread is inside the engine.
+    """
+    def __init__(self, env, workers=4, loop=None):
+        if asyncio is None:
+            raise SophiaError('asyncio is not available.')
+        self.env = env
+        self.workers = workers
+        self.inline_writes = False
+        self._loop = loop
+        self._executor = None
+        self._databases = {}
+
+    @property
+    def loop(self):
+        if self._loop is None:
+            try:
+                self._loop = asyncio.get_running_loop()
+            except (AttributeError, RuntimeError):
+                # Called outside of a coroutine, or Python < 3.7.
+                self._loop = asyncio.get_event_loop()
+        return self._loop
+
+    def _run(self, fn, *args):
+        if self._executor is None:
+            self._executor = ThreadPoolExecutor(self.workers)
+        return self.loop.run_in_executor(self._executor, fn, *args)
+
+    def _call(self, inline, fn, *args):
+        cdef Sophia env = self.env
+        if not inline or not env._reserve():
+            return self._run(fn, *args)
+        fut = self.loop.create_future()
+        try:
+            fut.set_result(fn(*args))
+        except Exception as exc:
+            fut.set_exception(exc)
+        finally:
+            env._release()
+        return fut
+
+    def _done(self, result=None):
+        fut = self.loop.create_future()
+        fut.set_result(result)
+        return fut
+
+    def _opened(self, fut=None):
+        # Settings can only be read while the environment is open.
+        if fut is None or fut.exception() is None:
+            self.inline_writes = not (self.env.log_enable and
+                                      self.env.log_sync)
+
+    def open(self):
+        if self.env.is_open:
+            self._opened()
+            return self._done(False)
+        fut = self._run(self.env.open)
+        fut.add_done_callback(self._opened)
+        return fut
+
+    def close(self):
+        fut = self._call(not self.env.is_open, self.env.close)
+        if self._executor is not None:
+            executor, self._executor = self._executor, None
+            fut.add_done_callback(lambda f: executor.shutdown(wait=False))
+        return fut
+
+    def database(self, name):
+        db = self.env[name]
+        if db.name not in self._databases:
+            self._databases[db.name] = AsyncDatabase(self, db)
+        return self._databases[db.name]
+
+    __getitem__ = database
+
+    def transaction(self):
+        return AsyncTransaction(self)
+
+
+class AsyncDatabase(object):
+    """
+    Database handle returned by :py:class:`AsyncSophia`. Every method returns
+    an awaitable future.
+    """
+    def __init__(self, env, db):
+        self.env = env
+        self.db = db
+        self._lock = threading.Lock()
+        self._pending = []
+        self._scheduled = False
+
+    def _queue(self, doc, waiter, default):
+        # Lookups which need a node file read are queued, and all the ones
+        # waiting when a worker picks them up are issued with one sp_getv().
+        with self._lock:
+            self._pending.append((doc, waiter, default))
+            if self._scheduled:
+                return
+            self._scheduled = True
+        self.env._run(self._drain).add_done_callback(self._complete)
+
+    def _drain(self):
+        with self._lock:
+            batch, self._pending = self._pending, []
+            self._scheduled = False
+        try:
+            return batch, self.db._get_documents([item[0] for item in batch])
+        except Exception as exc:
+            return batch, exc
+
+    def _complete(self, fut):
+        batch, results = fut.result()
+        for i, (_, waiter, default) in enumerate(batch):
+            if waiter.cancelled():
+                continue
+            if isinstance(results, Exception):
+                waiter.set_exception(results)
+            else:
+                waiter.set_result(default if results[i] is None
+                                  else results[i])
+
+    def _lookup(self, key, default):
+        cdef Database db = self.db
+        check_open(db.env)
+        if not db.env._reserve():
+            # Another thread is inside the engine.
+            return self.env._run(db.get, key, default)
+        try:
+            done, data = db._get_cached((key,) if not isinstance(key, tuple)
+                                        else key)
+        finally:
+            db.env._release()
+        if done:
+            return self.env._done(default if data is None else data)
+        waiter = self.env.loop.create_future()
+        self._queue(data, waiter, default)
+        return waiter
+
+    def get(self, key, default=None):
+        return self._lookup(key, default)
+
+    def multi_get(self, keys):
+        values = []
+        waiters = []
+        for key in keys:
+            fut = self._lookup(key, None)
+            if fut.done():
+                values.append(fut.result())
+            else:
+                waiters.append((len(values), fut))
+                values.append(None)
+        if not waiters:
+            return self.env._done(values)
+
+        result = self.env.loop.create_future()
+        def fill(gathered):
+            if gathered.exception() is not None:
+                result.set_exception(gathered.exception())
+                return
+            for (i, _), value in zip(waiters, gathered.result()):
+                values[i] = value
+            result.set_result(values)
+        asyncio.gather(*[fut for _, fut in waiters]).add_done_callback(fill)
+        return result
+
+    def set(self, key, value):
+        return self.env._call(self.env.inline_writes, self.db.set, key, value)
+
+    def upsert(self, key, value):
+        return self.env._call(self.env.inline_writes, self.db.upsert, key,
+                              value)
+
+    def delete(self, key):
+        return self.env._call(self.env.inline_writes, self.db.delete, key)
+
+    def cursor(self, chunk_size=256, **kwargs):
+        return AsyncCursor(self.env, self.db.cursor(**kwargs), chunk_size)
+
+
+class AsyncTransaction(object):
+    """
+    Transaction handle returned by :py:meth:`AsyncSophia.transaction`. The
+    engine does not allow a transaction to be used by two threads at once,
+    so each operation should be awaited before the next one is issued.
+    """
+    def __init__(self, env):
+        self.env = env
+        self.txn = env.env.transaction()
+
+    def begin(self):
+        self.txn.begin()
+        return self
+
+    def __getitem__(self, db):
+        if isinstance(db, AsyncDatabase):
+            db = db.db
+        return AsyncDatabase(self.env, self.txn[db])
+
+    def commit(self):
+        return self.env._call(self.env.inline_writes, self.txn.commit, False)
+
+    def rollback(self):
+        return self.env._call(True, self.txn.rollback, False)
+
+    def __aenter__(self):
+        return self.env._done(self.begin())
+
+    def __aexit__(self, exc_type, exc_val, exc_tb):
+        if exc_type:
+            return self.rollback()
+        return self.commit()
+
+
+class AsyncCursor(object):
+    """
+    Asynchronous iterator over a :py:class:`Cursor`. Rows are read by a
+    worker thread ``chunk_size`` at a time with :py:meth:`Cursor.fetchmany`.
+    """
+    def __init__(self, env, cursor, chunk_size=256):
+        if chunk_size <= 0:
+            raise ValueError('chunk_size must be positive.')
+        self.env = env
+        self.cursor = cursor
+        self.chunk_size = chunk_size
+        self._rows = []
+        self._pos = 0
+        self._exhausted = False
+
+    def __aiter__(self):
+        return self
+
+    def _fetched(self, waiter, fut):
+        if waiter.cancelled():
+            return
+        if fut.exception() is not None:
+            waiter.set_exception(fut.exception())
+            return
+        rows = fut.result()
+        if not rows:
+            self._exhausted = True
+            waiter.set_exception(StopAsyncIteration())
+            return
+        self._rows, self._pos = rows, 1
+        waiter.set_result(rows[0])
+
+    def __anext__(self):
+        if self._pos < len(self._rows):
+            self._pos += 1
+            return self.env._done(self._rows[self._pos - 1])
+        waiter = self.env.loop.create_future()
+        if self._exhausted:
+            waiter.set_exception(StopAsyncIteration())
+            return waiter
+        self.env._run(self.cursor.fetchmany, self.chunk_size) \
+            .add_done_callback(partial(self._fetched, waiter))
+        return waiter
@@ -60,6 +60,13 @@
 #ifdef __linux__
 #include <sys/syscall.h>
 #endif
+/* io_uring */
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup)
+#include <linux/io_uring.h>
+#define SS_URING 1
+#endif
+#endif
 /* crc */
 #if defined (__x86_64__) || defined (__i386__)
 #include <cpuid.h>
@@ -211,6 +218,11 @@ ss_spinlock(ssspinlock *l) {
 	}
 }
 
+static inline int
+ss_spintrylock(ssspinlock *l) {
+	return __sync_lock_test_and_set(l, 1) == 0;
+}
+
 static inline void
 ss_spinunlock(ssspinlock *l) {
 	__sync_lock_release(l);
@@ -458,6 +470,16 @@ ss_mmapinit(ssmmap *m) {
 
 typedef struct ssvfsif ssvfsif;
 typedef struct ssvfs ssvfs;
+typedef struct ssvfsio ssvfsio;
+
+#define SS_ADVISE_DONTNEED 0
+#define SS_ADVISE_WILLNEED 1
+
+struct ssvfsio {
+	int      fd;
+	uint64_t offset;
+	uint64_t size;
+};
 
 struct ssvfsif {
 	int     (*init)(ssvfs*, va_list);
@@ -466,6 +488,7 @@ struct ssvfsif {
 	int     (*exists)(ssvfs*, char*);
 	int     (*unlink)(ssvfs*, char*);
 	int     (*rename)(ssvfs*, char*, char*);
+	int     (*link)(ssvfs*, char*, char*);
 	int     (*mkdir)(ssvfs*, char*, int);
 	int     (*rmdir)(ssvfs*, char*);
 	int     (*open)(ssvfs*, char*, int, int);
@@ -475,8 +498,11 @@ struct ssvfsif {
 	int     (*advise)(ssvfs*, int, int, uint64_t, uint64_t);
 	int     (*truncate)(ssvfs*, int, uint64_t);
 	int64_t (*pread)(ssvfs*, int, uint64_t, void*, int);
+	int64_t (*pwrite)(ssvfs*, int, uint64_t, void*, int);
 	int64_t (*write)(ssvfs*, int, void*, int);
 	int64_t (*writev)(ssvfs*, int, ssiov*);
+	int64_t (*writev_sync)(ssvfs*, int, ssiov*);
+	int     (*advisev)(ssvfs*, int, ssvfsio*, int);
 	int64_t (*seek)(ssvfs*, int, uint64_t);
 	int     (*ioprio_low)(ssvfs*);
 	int     (*mmap)(ssvfs*, ssmmap*, int, uint64_t, int);
@@ -511,6 +537,7 @@ ss_vfsfree(ssvfs *f)
 #define ss_vfsexists(fs, path)                   (fs)->i->exists(fs, path)
 #define ss_vfsunlink(fs, path)                   (fs)->i->unlink(fs, path)
 #define ss_vfsrename(fs, src, dest)              (fs)->i->rename(fs, src, dest)
+#define ss_vfslink(fs, src, dest)                (fs)->i->link(fs, src, dest)
 #define ss_vfsmkdir(fs, path, mode)              (fs)->i->mkdir(fs, path, mode)
 #define ss_vfsrmdir(fs, path)                    (fs)->i->rmdir(fs, path)
 #define ss_vfsopen(fs, path, flags, mode)        (fs)->i->open(fs, path, flags, mode)
@@ -523,6 +550,8 @@ ss_vfsfree(ssvfs *f)
 #define ss_vfspwrite(fs, fd, off, buf, size)     (fs)->i->pwrite(fs, fd, off, buf, size)
 #define ss_vfswrite(fs, fd, buf, size)           (fs)->i->write(fs, fd, buf, size)
 #define ss_vfswritev(fs, fd, iov)                (fs)->i->writev(fs, fd, iov)
+#define ss_vfswritev_sync(fs, fd, iov)           (fs)->i->writev_sync(fs, fd, iov)
+#define ss_vfsadvisev(fs, hint, io, count)       (fs)->i->advisev(fs, hint, io, count)
 #define ss_vfsseek(fs, fd, off)                  (fs)->i->seek(fs, fd, off)
 #define ss_vfsioprio_low(fs)                     (fs)->i->ioprio_low(fs)
 #define ss_vfsmmap(fs, m, fd, size, ro)          (fs)->i->mmap(fs, m, fd, size, ro)
@@ -560,6 +589,21 @@ extern ssvfsif ss_stdvfs;
 
 extern ssvfsif ss_testvfs;
 
+#endif
+#line 1 "sophia/std/ss_uringvfs.h"
+#ifndef SS_URINGVFS_H_
+#define SS_URINGVFS_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+extern ssvfsif ss_uringvfs;
+
 #endif
 #line 1 "sophia/std/ss_file.h"
 #ifndef SS_FILE_H_
@@ -694,6 +738,16 @@ ss_filepread(ssfile *f, uint64_t off, void *buf, int size)
 	return rc;
 }
 
+static inline int
+ss_filepwrite(ssfile *f, uint64_t off, void *buf, int size)
+{
+	int64_t rc = ss_vfspwrite(f->vfs, f->fd, off, buf, size);
+	if (ssunlikely(rc == -1))
+		return -1;
+	assert(rc == size);
+	return rc;
+}
+
 static inline int
 ss_filewrite(ssfile *f, void *buf, int size)
 {
@@ -715,6 +769,16 @@ ss_filewritev(ssfile *f, ssiov *iov)
 	return rc;
 }
 
+static inline int
+ss_filewritev_sync(ssfile *f, ssiov *iov)
+{
+	int64_t rc = ss_vfswritev_sync(f->vfs, f->fd, iov);
+	if (ssunlikely(rc == -1))
+		return -1;
+	f->size += rc;
+	return rc;
+}
+
 static inline int
 ss_fileseek(ssfile *f, uint64_t off)
 {
@@ -849,6 +913,31 @@ extern ssaif ss_ooma;
 
 extern ssaif ss_stda;
 
+#endif
+#line 1 "sophia/std/ss_slaba.h"
+#ifndef SS_SLABA_H_
+#define SS_SLABA_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct ssslabastat ssslabastat;
+
+struct ssslabastat {
+	uint64_t footprint;
+	uint64_t used;
+	uint64_t slabs;
+};
+
+extern ssaif ss_slaba;
+
+void ss_slabastat(ssa*, ssslabastat*);
+
 #endif
 #line 1 "sophia/std/ss_trace.h"
 #ifndef SS_TRACE_H_
@@ -1431,6 +1520,11 @@ ss_condsignal(sscond *c) {
 	pthread_cond_signal(&c->c);
 }
 
+static inline void
+ss_condbroadcast(sscond *c) {
+	pthread_cond_broadcast(&c->c);
+}
+
 static inline void
 ss_condwait(sscond *c, ssmutex *m) {
 	pthread_cond_wait(&c->c, &m->m);
@@ -1470,6 +1564,68 @@ int ss_thread_setname(ssthread*, char*);
 int ss_threadpool_init(ssthreadpool*);
 int ss_threadpool_shutdown(ssthreadpool*, ssa*);
 int ss_threadpool_new(ssthreadpool*, ssa*, int, ssthreadf, void*);
+int ss_threadpool_add(ssthreadpool*, ssa*, ssthreadf, void*);
+
+#endif
+#line 1 "sophia/std/ss_job.h"
+#ifndef SS_JOB_H_
+#define SS_JOB_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct ssjob ssjob;
+typedef struct ssjobgroup ssjobgroup;
+typedef struct ssjobq ssjobq;
+
+typedef int (*ssjobf)(ssjob*);
+
+struct ssjobgroup {
+	int pending;
+	int rc;
+};
+
+struct ssjob {
+	ssjobf      function;
+	void       *arg;
+	ssjobgroup *group;
+	sslist      link;
+};
+
+struct ssjobq {
+	ssmutex      lock;
+	sscond       cond;
+	sslist       list;
+	int          shutdown;
+	ssthreadpool tp;
+};
+
+static inline void
+ss_jobgroupinit(ssjobgroup *g)
+{
+	g->pending = 0;
+	g->rc = 0;
+}
+
+static inline void
+ss_jobinit(ssjob *j, ssjobf function, void *arg, ssjobgroup *g)
+{
+	j->function = function;
+	j->arg      = arg;
+	j->group    = g;
+	ss_listinit(&j->link);
+}
+
+int  ss_jobqinit(ssjobq*);
+int  ss_jobqstart(ssjobq*, ssa*, int);
+int  ss_jobqshutdown(ssjobq*, ssa*);
+void ss_jobqpush(ssjobq*, ssjob*);
+int  ss_jobqwait(ssjobq*, ssjobgroup*);
 
 #endif
 #line 1 "sophia/std/ss_rb.h"
@@ -1568,11 +1724,10 @@ void ss_rbremove(ssrb*, ssrbnode*);
 */
 
 static inline unsigned int
-ss_fnv(char *key, int len)
+ss_fnvnext(unsigned h, char *key, int len)
 {
 	unsigned char *p = (unsigned char*)key;
 	unsigned char *end = p + len;
-	unsigned h = 2166136261;
 	while (p < end) {
 		h = (h * 16777619) ^ *p;
 		p++;
@@ -1580,6 +1735,12 @@ ss_fnv(char *key, int len)
 	return h;
 }
 
+static inline unsigned int
+ss_fnv(char *key, int len)
+{
+	return ss_fnvnext(2166136261, key, len);
+}
+
 #endif
 #line 1 "sophia/std/ss_ht.h"
 #ifndef SS_HT_H_
@@ -1979,6 +2140,126 @@ extern ssfilterif ss_lz4filter;
 
 extern ssfilterif ss_zstdfilter;
 
+#endif
+#line 1 "sophia/std/ss_dict.h"
+#ifndef SS_DICT_H_
+#define SS_DICT_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+/* Compression dictionaries of a database. Every
+ * retrained dictionary gets the next id and is kept,
+ * since pages compressed with older versions stay on
+ * disk until they are rewritten. Entries are only ever
+ * appended, readers do not lock. */
+
+#define SS_DICTMAX     16
+#define SS_DICTSIZEMAX (64 * 1024)
+
+typedef struct ssdict ssdict;
+typedef struct ssdictset ssdictset;
+
+struct ssdict {
+	uint32_t  id;
+	uint32_t  serial;
+	int       size;
+	char     *data;
+};
+
+struct ssdictset {
+	ssdict   dict[SS_DICTMAX];
+	int      count;
+	ssmutex  lock;
+};
+
+static uint32_t ss_dictserial = 0;
+
+static inline void
+ss_dictsetinit(ssdictset *s)
+{
+	memset(s->dict, 0, sizeof(s->dict));
+	s->count = 0;
+	ss_mutexinit(&s->lock);
+}
+
+static inline void
+ss_dictsetfree(ssdictset *s, ssa *a)
+{
+	int i = 0;
+	while (i < s->count) {
+		ss_free(a, s->dict[i].data);
+		i++;
+	}
+	s->count = 0;
+	ss_mutexfree(&s->lock);
+}
+
+static inline ssdict*
+ss_dictsetlast(ssdictset *s)
+{
+	int count = s->count;
+	__sync_synchronize();
+	if (count == 0)
+		return NULL;
+	return &s->dict[count - 1];
+}
+
+static inline ssdict*
+ss_dictsetfind(ssdictset *s, uint32_t id)
+{
+	int count = s->count;
+	__sync_synchronize();
+	int i = count - 1;
+	while (i >= 0) {
+		if (s->dict[i].id == id)
+			return &s->dict[i];
+		i--;
+	}
+	return NULL;
+}
+
+static inline int
+ss_dictsetadd(ssdictset *s, ssa *a, uint32_t id, char *data, int size)
+{
+	if (ssunlikely(s->count == SS_DICTMAX))
+		return -1;
+	char *copy = ss_malloc(a, size);
+	if (ssunlikely(copy == NULL))
+		return -1;
+	memcpy(copy, data, size);
+	ssdict *d = &s->dict[s->count];
+	d->id     = id;
+	d->serial = __sync_add_and_fetch(&ss_dictserial, 1);
+	d->size   = size;
+	d->data   = copy;
+	__sync_synchronize();
+	s->count++;
+	return 0;
+}
+
+int ss_dicttrain(ssa*, ssbuf*, char*, uint32_t*, int, int);
+
+#endif
+#line 1 "sophia/std/ss_lz4dictfilter.h"
+#ifndef SS_LZ4DICTFILTER_H_
+#define SS_LZ4DICTFILTER_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+extern ssfilterif ss_lz4dictfilter;
+
 #endif
 #line 1 "sophia/std/ss_filterof.h"
 #ifndef SS_FILTEROF_H_
@@ -2001,6 +2282,8 @@ ss_filterof(char *name)
 		return &ss_lz4filter;
 	if (strcmp(name, "zstd") == 0)
 		return &ss_zstdfilter;
+	if (strcmp(name, "lz4_dict") == 0)
+		return &ss_lz4dictfilter;
 	return NULL;
 }
 
@@ -2029,7 +2312,7 @@ struct ssiterif {
 
 struct ssiter {
 	ssiterif *vif;
-	char priv[150];
+	char priv[256];
 };
 
 #define ss_iterinit(iterator_if, i) \
@@ -2145,6 +2428,128 @@ ss_bufiterref_next(ssiter *i) {
 	ss_bufiter_next(i);
 }
 
+#endif
+#line 1 "sophia/std/ss_hist.h"
+#ifndef SS_HIST_H_
+#define SS_HIST_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+/* Log-linear histogram: exact values below SS_HISTSUB,
+ * then SS_HISTSUB buckets per power of two (12.5%
+ * precision). Updates are lock-free, each thread
+ * counts into its own shard. */
+
+#define SS_HISTSUB     8
+#define SS_HISTBUCKETS (SS_HISTSUB * 38)
+#define SS_HISTSHARDS  4
+
+typedef struct sshistshard sshistshard;
+typedef struct sshist sshist;
+
+struct sshistshard {
+	uint64_t max;
+	uint64_t bucket[SS_HISTBUCKETS];
+};
+
+struct sshist {
+	sshistshard shard[SS_HISTSHARDS];
+	char        sz[128];
+};
+
+static int ss_histseq = 0;
+static __thread int ss_histthread = -1;
+
+static inline void
+ss_histinit(sshist *h) {
+	memset(h, 0, sizeof(*h));
+}
+
+static inline int
+ss_histbucket(uint64_t v)
+{
+	if (v < SS_HISTSUB)
+		return v;
+	int k = 63 - __builtin_clzll(v);
+	int pos = SS_HISTSUB + (k - 3) * SS_HISTSUB +
+	          ((v >> (k - 3)) & (SS_HISTSUB - 1));
+	if (ssunlikely(pos >= SS_HISTBUCKETS))
+		pos = SS_HISTBUCKETS - 1;
+	return pos;
+}
+
+static inline uint64_t
+ss_histvalue(int pos)
+{
+	/* upper bound of a bucket */
+	if (pos < SS_HISTSUB)
+		return pos;
+	int k = (pos - SS_HISTSUB) / SS_HISTSUB + 3;
+	uint64_t sub = (pos - SS_HISTSUB) % SS_HISTSUB;
+	return ((SS_HISTSUB + sub + 1) << (k - 3)) - 1;
+}
+
+static inline void
+ss_histadd(sshist *h, uint64_t v)
+{
+	if (ssunlikely(ss_histthread == -1))
+		ss_histthread = __sync_fetch_and_add(&ss_histseq, 1) & 0x7fffffff;
+	sshistshard *s = &h->shard[ss_histthread % SS_HISTSHARDS];
+	__sync_fetch_and_add(&s->bucket[ss_histbucket(v)], 1);
+	uint64_t max = s->max;
+	while (v > max) {
+		uint64_t prev = __sync_val_compare_and_swap(&s->max, max, v);
+		if (prev == max)
+			break;
+		max = prev;
+	}
+}
+
+static inline void
+ss_histprepare(sshist *h)
+{
+	/* count p50 p90 p99 p999 max */
+	static const double q[] = { 0.5, 0.9, 0.99, 0.999 };
+	uint64_t p[4] = { 0, 0, 0, 0 };
+	uint64_t bucket[SS_HISTBUCKETS];
+	uint64_t count = 0;
+	uint64_t max = 0;
+	int i, j;
+	memset(bucket, 0, sizeof(bucket));
+	for (i = 0; i < SS_HISTSHARDS; i++) {
+		sshistshard *s = &h->shard[i];
+		for (j = 0; j < SS_HISTBUCKETS; j++) {
+			bucket[j] += s->bucket[j];
+			count += s->bucket[j];
+		}
+		if (s->max > max)
+			max = s->max;
+	}
+	if (count > 0) {
+		uint64_t sum = 0;
+		int n = 0;
+		for (j = 0; j < SS_HISTBUCKETS && n < 4; j++) {
+			sum += bucket[j];
+			while (n < 4 && sum >= (uint64_t)(q[n] * count + 0.999999)) {
+				p[n] = ss_histvalue(j);
+				if (p[n] > max)
+					p[n] = max;
+				n++;
+			}
+		}
+	}
+	snprintf(h->sz, sizeof(h->sz),
+	         "%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+	         " %" PRIu64 " %" PRIu64,
+	         count, p[0], p[1], p[2], p[3], max);
+}
+
 #endif
 #line 1 "sophia/std/ss_avg.h"
 #ifndef SS_AVG_H_
@@ -8008,7 +8413,7 @@ ssfilterif ss_lz4filter =
 	.next     = ss_lz4filter_next,
 	.complete = ss_lz4filter_complete
 };
-#line 1 "sophia/std/ss_nonefilter.c"
+#line 1 "sophia/std/ss_lz4dictfilter.c"
 
 /*
  * sophia database
@@ -8018,50 +8423,462 @@ ssfilterif ss_lz4filter =
  * BSD License
 */
 
+/* lz4 block compression against a trained dictionary.
+ *
+ * Frame: u32 dictionary id (0 for none), followed by
+ * one block per input chunk: u32 compressed size,
+ * u32 original size, data. Every block is compressed
+ * against the dictionary on its own.
+ *
+ * A stream with the dictionary already loaded is kept
+ * per thread, so a page costs a copy of the stream
+ * state instead of rehashing the dictionary. */
+
+typedef struct sslz4dictctx sslz4dictctx;
+typedef struct sslz4dictfilter sslz4dictfilter;
+
+struct sslz4dictctx {
+	uint32_t     serial;
+	LZ4_stream_t dict;
+	LZ4_stream_t work;
+};
+
+struct sslz4dictfilter {
+	ssdictset *set;
+	ssdict    *dict;
+} sspacked;
+
+static pthread_key_t  ss_lz4dictkey;
+static pthread_once_t ss_lz4dictonce = PTHREAD_ONCE_INIT;
+static __thread sslz4dictctx *ss_lz4dictctx = NULL;
+
+static void
+ss_lz4dictkey_init(void)
+{
+	pthread_key_create(&ss_lz4dictkey, free);
+}
 
+static inline sslz4dictctx*
+ss_lz4dict_ctx(ssdict *dict)
+{
+	sslz4dictctx *ctx = ss_lz4dictctx;
+	if (ssunlikely(ctx == NULL)) {
+		pthread_once(&ss_lz4dictonce, ss_lz4dictkey_init);
+		ctx = malloc(sizeof(sslz4dictctx));
+		if (ssunlikely(ctx == NULL))
+			return NULL;
+		ctx->serial = 0;
+		pthread_setspecific(ss_lz4dictkey, ctx);
+		ss_lz4dictctx = ctx;
+	}
+	if (ctx->serial != dict->serial) {
+		LZ4_resetStream(&ctx->dict);
+		LZ4_loadDict(&ctx->dict, dict->data, dict->size);
+		ctx->serial = dict->serial;
+	}
+	return ctx;
+}
 
 static int
-ss_nonefilter_init(ssfilter *f ssunused, va_list args ssunused)
+ss_lz4dictfilter_init(ssfilter *f, va_list args)
 {
+	sslz4dictfilter *z = (sslz4dictfilter*)f->priv;
+	z->set  = va_arg(args, ssdictset*);
+	z->dict = NULL;
+	if (f->op == SS_FINPUT && z->set)
+		z->dict = ss_dictsetlast(z->set);
 	return 0;
 }
 
 static int
-ss_nonefilter_free(ssfilter *f ssunused)
+ss_lz4dictfilter_free(ssfilter *f ssunused)
 {
 	return 0;
 }
 
 static int
-ss_nonefilter_reset(ssfilter *f ssunused)
+ss_lz4dictfilter_reset(ssfilter *f ssunused)
 {
 	return 0;
 }
 
 static int
-ss_nonefilter_start(ssfilter *f ssunused, ssbuf *dest ssunused)
+ss_lz4dictfilter_start(ssfilter *f, ssbuf *dest)
+{
+	sslz4dictfilter *z = (sslz4dictfilter*)f->priv;
+	if (f->op == SS_FOUTPUT)
+		return 0;
+	uint32_t id = 0;
+	if (z->dict)
+		id = z->dict->id;
+	return ss_bufadd(dest, f->a, &id, sizeof(id));
+}
+
+static inline int
+ss_lz4dictfilter_compress(ssfilter *f, ssbuf *dest, char *buf, int size)
+{
+	sslz4dictfilter *z = (sslz4dictfilter*)f->priv;
+	int bound = LZ4_compressBound(size);
+	int rc = ss_bufensure(dest, f->a, sizeof(uint32_t) * 2 + bound);
+	if (ssunlikely(rc == -1))
+		return -1;
+	char *out = dest->p + sizeof(uint32_t) * 2;
+	int n;
+	if (z->dict) {
+		sslz4dictctx *ctx = ss_lz4dict_ctx(z->dict);
+		if (ssunlikely(ctx == NULL))
+			return -1;
+		memcpy(&ctx->work, &ctx->dict, sizeof(ctx->work));
+		n = LZ4_compress_limitedOutput_continue(&ctx->work, buf, out,
+		                                        size, bound);
+	} else {
+		n = LZ4_compress_limitedOutput(buf, out, size, bound);
+	}
+	if (ssunlikely(n <= 0))
+		return -1;
+	uint32_t header[2] = { n, size };
+	memcpy(dest->p, header, sizeof(header));
+	ss_bufadvance(dest, sizeof(header) + n);
+	return 0;
+}
+
+static inline int
+ss_lz4dictfilter_decompress(ssfilter *f, ssbuf *dest, char *buf, int size)
 {
+	sslz4dictfilter *z = (sslz4dictfilter*)f->priv;
+	if (ssunlikely(size < (int)sizeof(uint32_t)))
+		return -1;
+	uint32_t id;
+	memcpy(&id, buf, sizeof(id));
+	ssdict *dict = NULL;
+	if (id != 0) {
+		if (ssunlikely(z->set == NULL))
+			return -1;
+		dict = ss_dictsetfind(z->set, id);
+		if (ssunlikely(dict == NULL))
+			return -1;
+	}
+	/* destination buffer is allocated to the original size */
+	char *p = buf + sizeof(id);
+	char *end = buf + size;
+	while (p < end) {
+		uint32_t header[2];
+		if (ssunlikely(end - p < (int)sizeof(header)))
+			return -1;
+		memcpy(header, p, sizeof(header));
+		p += sizeof(header);
+		if (ssunlikely(header[0] > (uint32_t)(end - p) ||
+		               header[1] > (uint32_t)ss_bufunused(dest)))
+			return -1;
+		int n;
+		if (dict) {
+			n = LZ4_decompress_safe_usingDict(p, dest->p, header[0], header[1],
+			                                  dict->data, dict->size);
+		} else {
+			n = LZ4_decompress_safe(p, dest->p, header[0], header[1]);
+		}
+		if (ssunlikely(n != (int)header[1]))
+			return -1;
+		ss_bufadvance(dest, n);
+		p += header[0];
+	}
 	return 0;
 }
 
 static int
-ss_nonefilter_next(ssfilter *f ssunused,
-                   ssbuf *dest ssunused,
-                   char *buf ssunused, int size ssunused)
+ss_lz4dictfilter_next(ssfilter *f, ssbuf *dest, char *buf, int size)
 {
+	if (ssunlikely(size == 0))
+		return 0;
+	switch (f->op) {
+	case SS_FINPUT:
+		return ss_lz4dictfilter_compress(f, dest, buf, size);
+	case SS_FOUTPUT:
+		return ss_lz4dictfilter_decompress(f, dest, buf, size);
+	}
 	return 0;
 }
 
 static int
-ss_nonefilter_complete(ssfilter *f ssunused, ssbuf *dest ssunused)
+ss_lz4dictfilter_complete(ssfilter *f ssunused, ssbuf *dest ssunused)
 {
 	return 0;
 }
 
-ssfilterif ss_nonefilter =
+ssfilterif ss_lz4dictfilter =
 {
-	.name     = "none",
-	.init     = ss_nonefilter_init,
+	.name     = "lz4_dict",
+	.init     = ss_lz4dictfilter_init,
+	.free     = ss_lz4dictfilter_free,
+	.reset    = ss_lz4dictfilter_reset,
+	.start    = ss_lz4dictfilter_start,
+	.next     = ss_lz4dictfilter_next,
+	.complete = ss_lz4dictfilter_complete
+};
+#line 1 "sophia/std/ss_dict.c"
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+/* Dictionary training.
+ *
+ * Samples are cut into short segments, and every segment
+ * is scored by how many other samples share its 8-byte
+ * substrings. The best segments are picked greedily: once
+ * a segment is taken its substrings stop counting, so the
+ * dictionary does not fill up with copies of the same
+ * content. The best segments go last, where lz4 reaches
+ * them with the shortest offsets. */
+
+#define SS_DICTGRAM    8
+#define SS_DICTSEGMENT 64
+#define SS_DICTHASH    16
+
+typedef struct ssdictseg ssdictseg;
+
+struct ssdictseg {
+	uint64_t score;
+	uint32_t offset;
+	uint32_t size;
+};
+
+static inline uint32_t
+ss_dicthash(char *p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return (v * 0x9E3779B97F4A7C15ULL) >> (64 - SS_DICTHASH);
+}
+
+static inline uint64_t
+ss_dictscore(uint32_t *freq, char *p, int size)
+{
+	uint64_t score = 0;
+	int i = 0;
+	while (i <= size - SS_DICTGRAM) {
+		uint32_t f = freq[ss_dicthash(p + i)];
+		if (f > 1)
+			score += f;
+		i++;
+	}
+	return score;
+}
+
+static inline void
+ss_dictheap_up(ssdictseg *heap, int pos)
+{
+	while (pos > 0) {
+		int parent = (pos - 1) / 2;
+		if (heap[parent].score >= heap[pos].score)
+			break;
+		ssdictseg tmp = heap[parent];
+		heap[parent] = heap[pos];
+		heap[pos] = tmp;
+		pos = parent;
+	}
+}
+
+static inline void
+ss_dictheap_down(ssdictseg *heap, int count, int pos)
+{
+	for (;;) {
+		int max = pos;
+		int l = pos * 2 + 1;
+		int r = l + 1;
+		if (l < count && heap[l].score > heap[max].score)
+			max = l;
+		if (r < count && heap[r].score > heap[max].score)
+			max = r;
+		if (max == pos)
+			break;
+		ssdictseg tmp = heap[max];
+		heap[max] = heap[pos];
+		heap[pos] = tmp;
+		pos = max;
+	}
+}
+
+int ss_dicttrain(ssa *a, ssbuf *dict, char *samples, uint32_t *sizes,
+                 int count, int dict_size)
+{
+	uint64_t total = 0;
+	int i;
+	for (i = 0; i < count; i++)
+		total += sizes[i];
+	if (total <= (uint64_t)dict_size) {
+		if (ssunlikely(ss_bufadd(dict, a, samples, total) == -1))
+			return -1;
+		return 0;
+	}
+
+	/* count in how many samples every substring occurs */
+	int hash_size = 1 << SS_DICTHASH;
+	uint32_t *freq = ss_malloc(a, sizeof(uint32_t) * hash_size);
+	int32_t *seen = ss_malloc(a, sizeof(int32_t) * hash_size);
+	int segments_max = total / SS_DICTSEGMENT + count;
+	ssdictseg *heap = ss_malloc(a, sizeof(ssdictseg) * segments_max);
+	ssdictseg *selected = ss_malloc(a, sizeof(ssdictseg) * segments_max);
+	int rc = -1;
+	if (ssunlikely(freq == NULL || seen == NULL || heap == NULL ||
+	               selected == NULL))
+		goto done;
+	memset(freq, 0, sizeof(uint32_t) * hash_size);
+	memset(seen, 0xff, sizeof(int32_t) * hash_size);
+	uint64_t offset = 0;
+	for (i = 0; i < count; i++) {
+		char *p = samples + offset;
+		int j = 0;
+		while (j <= (int)sizes[i] - SS_DICTGRAM) {
+			uint32_t h = ss_dicthash(p + j);
+			if (seen[h] != i) {
+				seen[h] = i;
+				freq[h]++;
+			}
+			j++;
+		}
+		offset += sizes[i];
+	}
+
+	/* score segments */
+	int heap_count = 0;
+	offset = 0;
+	for (i = 0; i < count; i++) {
+		uint32_t pos = 0;
+		while (pos < sizes[i]) {
+			uint32_t size = sizes[i] - pos;
+			if (size > SS_DICTSEGMENT)
+				size = SS_DICTSEGMENT;
+			if (size >= SS_DICTGRAM) {
+				ssdictseg *s = &heap[heap_count];
+				s->offset = offset + pos;
+				s->size   = size;
+				s->score  = ss_dictscore(freq, samples + s->offset, size);
+				if (s->score > 0) {
+					heap_count++;
+					ss_dictheap_up(heap, heap_count - 1);
+				}
+			}
+			pos += size;
+		}
+		offset += sizes[i];
+	}
+
+	/* lazy greedy selection */
+	int selected_count = 0;
+	int selected_size = 0;
+	while (heap_count > 0 && selected_size < dict_size) {
+		ssdictseg top = heap[0];
+		heap[0] = heap[--heap_count];
+		ss_dictheap_down(heap, heap_count, 0);
+		top.score = ss_dictscore(freq, samples + top.offset, top.size);
+		if (top.score == 0)
+			continue;
+		if (heap_count > 0 && top.score < heap[0].score) {
+			heap[heap_count++] = top;
+			ss_dictheap_up(heap, heap_count - 1);
+			continue;
+		}
+		selected[selected_count++] = top;
+		selected_size += top.size;
+		int j = 0;
+		while (j <= (int)top.size - SS_DICTGRAM) {
+			freq[ss_dicthash(samples + top.offset + j)] = 0;
+			j++;
+		}
+	}
+
+	/* nothing repeats, keep the most recent samples */
+	if (selected_count == 0) {
+		rc = ss_bufadd(dict, a, samples + total - dict_size, dict_size);
+		goto done;
+	}
+
+	int size = selected_size;
+	if (size > dict_size)
+		size = dict_size;
+	if (ssunlikely(ss_bufensure(dict, a, size) == -1))
+		goto done;
+	int pos = size;
+	for (i = 0; i < selected_count && pos > 0; i++) {
+		ssdictseg *s = &selected[i];
+		int n = s->size;
+		if (n > pos)
+			n = pos;
+		pos -= n;
+		memcpy(dict->p + pos, samples + s->offset + s->size - n, n);
+	}
+	ss_bufadvance(dict, size);
+	rc = 0;
+done:
+	if (freq)
+		ss_free(a, freq);
+	if (seen)
+		ss_free(a, seen);
+	if (heap)
+		ss_free(a, heap);
+	if (selected)
+		ss_free(a, selected);
+	return rc;
+}
+#line 1 "sophia/std/ss_nonefilter.c"
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+
+
+static int
+ss_nonefilter_init(ssfilter *f ssunused, va_list args ssunused)
+{
+	return 0;
+}
+
+static int
+ss_nonefilter_free(ssfilter *f ssunused)
+{
+	return 0;
+}
+
+static int
+ss_nonefilter_reset(ssfilter *f ssunused)
+{
+	return 0;
+}
+
+static int
+ss_nonefilter_start(ssfilter *f ssunused, ssbuf *dest ssunused)
+{
+	return 0;
+}
+
+static int
+ss_nonefilter_next(ssfilter *f ssunused,
+                   ssbuf *dest ssunused,
+                   char *buf ssunused, int size ssunused)
+{
+	return 0;
+}
+
+static int
+ss_nonefilter_complete(ssfilter *f ssunused, ssbuf *dest ssunused)
+{
+	return 0;
+}
+
+ssfilterif ss_nonefilter =
+{
+	.name     = "none",
+	.init     = ss_nonefilter_init,
 	.free     = ss_nonefilter_free,
 	.reset    = ss_nonefilter_reset,
 	.start    = ss_nonefilter_start,
@@ -8471,6 +9288,332 @@ void ss_rbremove(ssrb *t, ssrbnode *n)
 	if (n)
 		n->color = SS_RBBLACK;
 }
+#line 1 "sophia/std/ss_slaba.c"
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+
+
+/*
+ * Size-classed slab allocator.
+ *
+ * Small chunks are carved out of fixed size slabs, one size class
+ * per slab. Slabs are grouped into shards, each guarded by its own
+ * lock: a thread always allocates from the same shard, while a chunk
+ * is always returned to the shard which owns its slab. A slab is
+ * given back to the parent allocator as soon as its last chunk is
+ * freed, unless it is the last slab of its class.
+ *
+ * Every chunk is prefixed by a word which either points to the
+ * owning slab, or holds the chunk size with the lowest bit set for
+ * chunks which are too large for any class.
+*/
+
+#define SS_SLABA_SHARDS  8
+#define SS_SLABA_SLAB    65536
+#define SS_SLABA_CLASSES 24
+#define SS_SLABA_MAX     2048
+#define SS_SLABA_HEADER  ((sizeof(ssslab) + 15) & ~15)
+
+typedef struct ssslab ssslab;
+typedef struct ssslabclass ssslabclass;
+typedef struct ssslabshard ssslabshard;
+typedef struct ssslaba ssslaba;
+
+struct ssslab {
+	ssslabshard *shard;
+	ssslabclass *class;
+	void        *free;
+	uint32_t     used;
+	uint32_t     top;
+	int          partial;
+	sslist       link;
+	sslist       linkall;
+};
+
+struct ssslabclass {
+	uint32_t size;
+	uint32_t count;
+	uint32_t slabs;
+	sslist   partial;
+};
+
+struct ssslabshard {
+	ssspinlock  lock;
+	ssslabclass class[SS_SLABA_CLASSES];
+	sslist      slabs;
+	uint64_t    footprint;
+	uint64_t    used;
+	uint64_t    count;
+};
+
+struct ssslaba {
+	ssa        *parent;
+	uint8_t     map[SS_SLABA_MAX / 16];
+	ssslabshard shard[SS_SLABA_SHARDS];
+};
+
+static const uint32_t ss_slabasizes[SS_SLABA_CLASSES] =
+{
+	16,   32,   48,   64,   80,   96,   112,  128,
+	160,  192,  224,  256,  320,  384,  448,  512,
+	640,  768,  896,  1024, 1280, 1536, 1792, 2048
+};
+
+static int ss_slabaseq = 0;
+static __thread int ss_slabathread = -1;
+
+static inline ssslaba*
+ss_slabaof(ssa *a) {
+	return *(ssslaba**)a->priv;
+}
+
+static inline ssslabshard*
+ss_slabashard(ssslaba *s)
+{
+	if (ssunlikely(ss_slabathread == -1))
+		ss_slabathread = __sync_fetch_and_add(&ss_slabaseq, 1) & 0x7fffffff;
+	return &s->shard[ss_slabathread % SS_SLABA_SHARDS];
+}
+
+static inline int
+ss_slabaopen(ssa *a, va_list args)
+{
+	ssa *parent = va_arg(args, ssa*);
+	ssslaba *s = ss_malloc(parent, sizeof(ssslaba));
+	if (ssunlikely(s == NULL))
+		return -1;
+	s->parent = parent;
+	int i, j = 0;
+	for (i = 0; i < SS_SLABA_MAX / 16; i++) {
+		while (ss_slabasizes[j] < (uint32_t)(i + 1) * 16)
+			j++;
+		s->map[i] = j;
+	}
+	for (i = 0; i < SS_SLABA_SHARDS; i++) {
+		ssslabshard *shard = &s->shard[i];
+		ss_spinlockinit(&shard->lock);
+		ss_listinit(&shard->slabs);
+		shard->footprint = 0;
+		shard->used = 0;
+		shard->count = 0;
+		for (j = 0; j < SS_SLABA_CLASSES; j++) {
+			ssslabclass *c = &shard->class[j];
+			c->size  = ss_slabasizes[j];
+			c->count = (SS_SLABA_SLAB - SS_SLABA_HEADER) / c->size;
+			c->slabs = 0;
+			ss_listinit(&c->partial);
+		}
+	}
+	*(ssslaba**)a->priv = s;
+	return 0;
+}
+
+static inline int
+ss_slabaclose(ssa *a)
+{
+	ssslaba *s = ss_slabaof(a);
+	int i;
+	for (i = 0; i < SS_SLABA_SHARDS; i++) {
+		ssslabshard *shard = &s->shard[i];
+		sslist *j, *n;
+		ss_listforeach_safe(&shard->slabs, j, n) {
+			ssslab *slab = sscast(j, ssslab, linkall);
+			ss_free(s->parent, slab);
+		}
+		ss_spinlockfree(&shard->lock);
+	}
+	ss_free(s->parent, s);
+	return 0;
+}
+
+static inline ssslab*
+ss_slabnew(ssslaba *s, ssslabshard *shard, ssslabclass *c)
+{
+	ssslab *slab = ss_malloc(s->parent, SS_SLABA_SLAB);
+	if (ssunlikely(slab == NULL))
+		return NULL;
+	slab->shard   = shard;
+	slab->class   = c;
+	slab->free    = NULL;
+	slab->used    = 0;
+	slab->top     = SS_SLABA_HEADER;
+	slab->partial = 1;
+	ss_listinit(&slab->link);
+	ss_listappend(&c->partial, &slab->link);
+	ss_listappend(&shard->slabs, &slab->linkall);
+	c->slabs++;
+	shard->count++;
+	shard->footprint += SS_SLABA_SLAB;
+	return slab;
+}
+
+static inline void*
+ss_slabamalloc_large(ssslaba *s, uint32_t total)
+{
+	uint64_t *chunk = ss_malloc(s->parent, total);
+	if (ssunlikely(chunk == NULL))
+		return NULL;
+	*chunk = ((uint64_t)total << 1) | 1;
+	ssslabshard *shard = ss_slabashard(s);
+	ss_spinlock(&shard->lock);
+	shard->footprint += total;
+	shard->used += total;
+	ss_spinunlock(&shard->lock);
+	return chunk + 1;
+}
+
+static inline void
+ss_slabafree_large(ssslaba *s, uint64_t *chunk)
+{
+	uint32_t total = *chunk >> 1;
+	ssslabshard *shard = ss_slabashard(s);
+	ss_spinlock(&shard->lock);
+	shard->footprint -= total;
+	shard->used -= total;
+	ss_spinunlock(&shard->lock);
+	ss_free(s->parent, chunk);
+}
+
+sshot static inline void*
+ss_slabamalloc(ssa *a, int size)
+{
+	ssslaba *s = ss_slabaof(a);
+	uint32_t total = size + sizeof(uint64_t);
+	if (ssunlikely(total > SS_SLABA_MAX))
+		return ss_slabamalloc_large(s, total);
+	ssslabshard *shard = ss_slabashard(s);
+	ssslabclass *c = &shard->class[s->map[(total - 1) >> 4]];
+	ss_spinlock(&shard->lock);
+	ssslab *slab;
+	if (sslikely(! ss_listempty(&c->partial))) {
+		slab = sscast(c->partial.next, ssslab, link);
+	} else {
+		slab = ss_slabnew(s, shard, c);
+		if (ssunlikely(slab == NULL)) {
+			ss_spinunlock(&shard->lock);
+			return NULL;
+		}
+	}
+	uint64_t *chunk;
+	if (slab->free) {
+		chunk = slab->free;
+		slab->free = *(void**)chunk;
+	} else {
+		chunk = (uint64_t*)((char*)slab + slab->top);
+		slab->top += c->size;
+	}
+	slab->used++;
+	if (ssunlikely(slab->used == c->count)) {
+		ss_listunlink(&slab->link);
+		slab->partial = 0;
+	}
+	shard->used += c->size;
+	ss_spinunlock(&shard->lock);
+	*chunk = (uint64_t)(uintptr_t)slab;
+	return chunk + 1;
+}
+
+sshot static inline void
+ss_slabafree(ssa *a, void *ptr)
+{
+	assert(ptr != NULL);
+	ssslaba *s = ss_slabaof(a);
+	uint64_t *chunk = (uint64_t*)ptr - 1;
+	if (ssunlikely(*chunk & 1)) {
+		ss_slabafree_large(s, chunk);
+		return;
+	}
+	ssslab *slab = (ssslab*)(uintptr_t)*chunk;
+	ssslabshard *shard = slab->shard;
+	ssslabclass *c = slab->class;
+	ss_spinlock(&shard->lock);
+	*(void**)chunk = slab->free;
+	slab->free = chunk;
+	slab->used--;
+	shard->used -= c->size;
+	if (ssunlikely(! slab->partial)) {
+		ss_listappend(&c->partial, &slab->link);
+		slab->partial = 1;
+	}
+	if (ssunlikely(slab->used == 0 && c->slabs > 1)) {
+		ss_listunlink(&slab->link);
+		ss_listunlink(&slab->linkall);
+		c->slabs--;
+		shard->count--;
+		shard->footprint -= SS_SLABA_SLAB;
+		ss_spinunlock(&shard->lock);
+		ss_free(s->parent, slab);
+		return;
+	}
+	ss_spinunlock(&shard->lock);
+}
+
+static inline void*
+ss_slabarealloc(ssa *a, void *ptr, int size)
+{
+	if (ssunlikely(ptr == NULL))
+		return ss_slabamalloc(a, size);
+	ssslaba *s = ss_slabaof(a);
+	uint64_t *chunk = (uint64_t*)ptr - 1;
+	uint32_t total = size + sizeof(uint64_t);
+	uint32_t capacity;
+	if (*chunk & 1) {
+		capacity = *chunk >> 1;
+		if (total > SS_SLABA_MAX) {
+			chunk = ss_realloc(s->parent, chunk, total);
+			if (ssunlikely(chunk == NULL))
+				return NULL;
+			*chunk = ((uint64_t)total << 1) | 1;
+			ssslabshard *shard = ss_slabashard(s);
+			ss_spinlock(&shard->lock);
+			shard->footprint += total - capacity;
+			shard->used += total - capacity;
+			ss_spinunlock(&shard->lock);
+			return chunk + 1;
+		}
+	} else {
+		capacity = ((ssslab*)(uintptr_t)*chunk)->class->size;
+	}
+	if (total <= capacity)
+		return ptr;
+	void *p = ss_slabamalloc(a, size);
+	if (ssunlikely(p == NULL))
+		return NULL;
+	memcpy(p, ptr, capacity - sizeof(uint64_t));
+	ss_slabafree(a, ptr);
+	return p;
+}
+
+void ss_slabastat(ssa *a, ssslabastat *stat)
+{
+	ssslaba *s = ss_slabaof(a);
+	memset(stat, 0, sizeof(*stat));
+	int i;
+	for (i = 0; i < SS_SLABA_SHARDS; i++) {
+		ssslabshard *shard = &s->shard[i];
+		ss_spinlock(&shard->lock);
+		stat->footprint += shard->footprint;
+		stat->used      += shard->used;
+		stat->slabs     += shard->count;
+		ss_spinunlock(&shard->lock);
+	}
+}
+
+ssaif ss_slaba =
+{
+	.open    = ss_slabaopen,
+	.close   = ss_slabaclose,
+	.malloc  = ss_slabamalloc,
+	.realloc = ss_slabarealloc,
+	.free    = ss_slabafree
+};
 #line 1 "sophia/std/ss_stda.c"
 
 /*
@@ -8569,6 +9712,12 @@ ss_stdvfs_rename(ssvfs *f ssunused, char *src, char *dest)
 	return rename(src, dest);
 }
 
+static int
+ss_stdvfs_link(ssvfs *f ssunused, char *src, char *dest)
+{
+	return link(src, dest);
+}
+
 static int
 ss_stdvfs_mkdir(ssvfs *f ssunused, char *path, int mode)
 {
@@ -8624,17 +9773,20 @@ ss_stdvfs_sync_file_range(ssvfs *f ssunused, int fd, uint64_t off, uint64_t size
 static int
 ss_stdvfs_advise(ssvfs *f ssunused, int fd, int hint, uint64_t off, uint64_t len)
 {
-	(void)hint;
 #if  defined(__APPLE__) || \
      defined(__FreeBSD__) || \
     (defined(__FreeBSD_kernel__) && defined(__GLIBC__)) || \
      defined(__DragonFly__)
+	(void)hint;
 	(void)fd;
 	(void)off;
 	(void)len;
 	return 0;
 #else
-	return posix_fadvise(fd, off, len, POSIX_FADV_DONTNEED);
+	int advice = POSIX_FADV_DONTNEED;
+	if (hint == SS_ADVISE_WILLNEED)
+		advice = POSIX_FADV_WILLNEED;
+	return posix_fadvise(fd, off, len, advice);
 #endif
 }
 
@@ -8661,6 +9813,23 @@ ss_stdvfs_pread(ssvfs *f ssunused, int fd, uint64_t off, void *buf, int size)
 	return n;
 }
 
+static int64_t
+ss_stdvfs_pwrite(ssvfs *f ssunused, int fd, uint64_t off, void *buf, int size)
+{
+	int n = 0;
+	do {
+		int r;
+		do {
+			r = pwrite(fd, (char*)buf + n, size - n, off + n);
+		} while (r == -1 && errno == EINTR);
+		if (r <= 0)
+			return -1;
+		n += r;
+	} while (n != size);
+
+	return n;
+}
+
 static int64_t
 ss_stdvfs_write(ssvfs *f ssunused, int fd, void *buf, int size)
 {
@@ -8708,6 +9877,17 @@ ss_stdvfs_writev(ssvfs *f ssunused, int fd, ssiov *iov)
 	return size;
 }
 
+static int64_t
+ss_stdvfs_writev_sync(ssvfs *f, int fd, ssiov *iov)
+{
+	int64_t size = ss_stdvfs_writev(f, fd, iov);
+	if (ssunlikely(size == -1))
+		return -1;
+	if (ssunlikely(ss_stdvfs_sync(f, fd) == -1))
+		return -1;
+	return size;
+}
+
 static int64_t
 ss_stdvfs_seek(ssvfs *f ssunused, int fd, uint64_t off)
 {
@@ -8809,6 +9989,7 @@ ssvfsif ss_stdvfs =
 	.exists          = ss_stdvfs_exists,
 	.unlink          = ss_stdvfs_unlink,
 	.rename          = ss_stdvfs_rename,
+	.link            = ss_stdvfs_link,
 	.mkdir           = ss_stdvfs_mkdir,
 	.rmdir           = ss_stdvfs_rmdir,
 	.open            = ss_stdvfs_open,
@@ -8818,8 +9999,11 @@ ssvfsif ss_stdvfs =
 	.advise          = ss_stdvfs_advise,
 	.truncate        = ss_stdvfs_truncate,
 	.pread           = ss_stdvfs_pread,
+	.pwrite          = ss_stdvfs_pwrite,
 	.write           = ss_stdvfs_write,
 	.writev          = ss_stdvfs_writev,
+	.writev_sync     = ss_stdvfs_writev_sync,
+	.advisev         = NULL,
 	.seek            = ss_stdvfs_seek,
 	.ioprio_low      = ss_stdvfs_ioprio_low,
 	.mmap            = ss_stdvfs_mmap,
@@ -8905,6 +10089,14 @@ ss_testvfs_rename(ssvfs *f, char *src, char *dest)
 	return ss_stdvfs.rename(f, src, dest);
 }
 
+static int
+ss_testvfs_link(ssvfs *f, char *src, char *dest)
+{
+	if (ss_testvfs_call(f))
+		return -1;
+	return ss_stdvfs.link(f, src, dest);
+}
+
 static int
 ss_testvfs_mkdir(ssvfs *f, char *path, int mode)
 {
@@ -8978,11 +10170,19 @@ ss_testvfs_pread(ssvfs *f, int fd, uint64_t off, void *buf, int size)
 }
 
 static int64_t
-ss_testvfs_write(ssvfs *f, int fd, void *buf, int size)
+ss_testvfs_pwrite(ssvfs *f, int fd, uint64_t off, void *buf, int size)
 {
 	if (ss_testvfs_call(f))
 		return -1;
-	return ss_stdvfs.write(f, fd, buf, size);
+	return ss_stdvfs.pwrite(f, fd, off, buf, size);
+}
+
+static int64_t
+ss_testvfs_write(ssvfs *f, int fd, void *buf, int size)
+{
+	if (ss_testvfs_call(f))
+		return -1;
+	return ss_stdvfs.write(f, fd, buf, size);
 }
 
 static int64_t
@@ -8993,6 +10193,14 @@ ss_testvfs_writev(ssvfs *f, int fd, ssiov *iov)
 	return ss_stdvfs.writev(f, fd, iov);
 }
 
+static int64_t
+ss_testvfs_writev_sync(ssvfs *f, int fd, ssiov *iov)
+{
+	if (ss_testvfs_call(f))
+		return -1;
+	return ss_stdvfs.writev_sync(f, fd, iov);
+}
+
 static int64_t
 ss_testvfs_seek(ssvfs *f, int fd, uint64_t off)
 {
@@ -9049,6 +10257,7 @@ ssvfsif ss_testvfs =
 	.exists          = ss_testvfs_exists,
 	.unlink          = ss_testvfs_unlink,
 	.rename          = ss_testvfs_rename,
+	.link            = ss_testvfs_link,
 	.mkdir           = ss_testvfs_mkdir,
 	.rmdir           = ss_testvfs_rmdir,
 	.open            = ss_testvfs_open,
@@ -9058,8 +10267,11 @@ ssvfsif ss_testvfs =
 	.advise          = ss_testvfs_advise,
 	.truncate        = ss_testvfs_truncate,
 	.pread           = ss_testvfs_pread,
+	.pwrite          = ss_testvfs_pwrite,
 	.write           = ss_testvfs_write,
 	.writev          = ss_testvfs_writev,
+	.writev_sync     = ss_testvfs_writev_sync,
+	.advisev         = NULL,
 	.seek            = ss_testvfs_seek,
 	.ioprio_low      = ss_testvfs_ioprio_low,
 	.mmap            = ss_testvfs_mmap,
@@ -9067,7 +10279,7 @@ ssvfsif ss_testvfs =
 	.mremap          = ss_testvfs_mremap,
 	.munmap          = ss_testvfs_munmap
 };
-#line 1 "sophia/std/ss_thread.c"
+#line 1 "sophia/std/ss_uringvfs.c"
 
 /*
  * sophia database
@@ -9079,4757 +10291,7974 @@ ssvfsif ss_testvfs =
 
 
 
-int ss_threadpool_init(ssthreadpool *p)
+#ifdef SS_URING
+
+/* a few rings are shared by all threads, an operation
+ * which finds every ring busy is done synchronously */
+#define SS_URINGVFS_RINGS   4
+#define SS_URINGVFS_ENTRIES 32
+
+typedef struct ssuring ssuring;
+typedef struct ssuringvfs ssuringvfs;
+
+struct ssuring {
+	ssspinlock           lock;
+	int                  fd;
+	int                  error;
+	unsigned             entries;
+	unsigned            *sq_tail;
+	unsigned             sq_mask;
+	unsigned            *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned            *cq_head;
+	unsigned            *cq_tail;
+	unsigned             cq_mask;
+	struct io_uring_cqe *cqes;
+	void                *sq_map;
+	size_t               sq_map_size;
+	void                *cq_map;
+	size_t               cq_map_size;
+	size_t               sqes_size;
+};
+
+struct ssuringvfs {
+	ssuring  ring[SS_URINGVFS_RINGS];
+	uint32_t next;
+};
+
+#define ss_uringvfs_of(f) (*(ssuringvfs**)(f)->priv)
+
+static void
+ss_uring_close(ssuring *u)
 {
-	ss_listinit(&p->list);
-	p->n = 0;
-	return 0;
+	if (u->sqes)
+		munmap(u->sqes, u->sqes_size);
+	if (u->cq_map)
+		munmap(u->cq_map, u->cq_map_size);
+	if (u->sq_map)
+		munmap(u->sq_map, u->sq_map_size);
+	if (u->fd != -1)
+		close(u->fd);
+	u->fd = -1;
 }
 
-int ss_threadpool_shutdown(ssthreadpool *p, ssa *a)
+static void*
+ss_uring_map(int fd, size_t size, off_t offset)
 {
-	int rcret = 0;
-	int rc;
-	sslist *i, *n;
-	ss_listforeach_safe(&p->list, i, n) {
-		ssthread *t = sscast(i, ssthread, link);
-		rc = pthread_join(t->id, NULL);
-		if (ssunlikely(rc != 0))
-			rcret = -1;
-		ss_free(a, t);
-	}
-	return rcret;
+	void *p = mmap(NULL, size, PROT_READ|PROT_WRITE,
+	               MAP_SHARED|MAP_POPULATE, fd, offset);
+	if (ssunlikely(p == MAP_FAILED))
+		return NULL;
+	return p;
 }
 
-int ss_threadpool_new(ssthreadpool *p, ssa *a, int n, ssthreadf f, void *arg)
+static int
+ss_uring_open(ssuring *u, unsigned entries)
 {
-	int i;
-	for (i = 0; i < n; i++) {
-		ssthread *t = ss_malloc(a, sizeof(*t));
-		if (ssunlikely(t == NULL))
-			goto error;
-		ss_listinit(&t->link);
-		ss_listappend(&p->list, &t->link);
-		p->n++;
-		t->f = f;
-		t->arg = arg;
-		int rc;
-		rc = pthread_create(&t->id, NULL, f, t);
-		if (ssunlikely(rc != 0))
-			goto error;
+	memset(u, 0, sizeof(*u));
+	ss_spinlockinit(&u->lock);
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+	u->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (ssunlikely(u->fd == -1))
+		return -1;
+	/* log appends are written at the current file
+	 * position, which needs linux 5.6 */
+	if (ssunlikely(! (p.features & IORING_FEAT_RW_CUR_POS))) {
+		errno = ENOSYS;
+		goto error;
 	}
+	u->entries     = p.sq_entries;
+	u->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	u->sq_map      = ss_uring_map(u->fd, u->sq_map_size, IORING_OFF_SQ_RING);
+	if (ssunlikely(u->sq_map == NULL))
+		goto error;
+	u->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	u->cq_map      = ss_uring_map(u->fd, u->cq_map_size, IORING_OFF_CQ_RING);
+	if (ssunlikely(u->cq_map == NULL))
+		goto error;
+	u->sqes_size   = p.sq_entries * sizeof(struct io_uring_sqe);
+	u->sqes        = ss_uring_map(u->fd, u->sqes_size, IORING_OFF_SQES);
+	if (ssunlikely(u->sqes == NULL))
+		goto error;
+	char *sq = u->sq_map;
+	char *cq = u->cq_map;
+	u->sq_tail  = (unsigned*)(sq + p.sq_off.tail);
+	u->sq_mask  = *(unsigned*)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned*)(sq + p.sq_off.array);
+	u->cq_head  = (unsigned*)(cq + p.cq_off.head);
+	u->cq_tail  = (unsigned*)(cq + p.cq_off.tail);
+	u->cq_mask  = *(unsigned*)(cq + p.cq_off.ring_mask);
+	u->cqes     = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
 	return 0;
 error:
-	ss_threadpool_shutdown(p, a);
+	ss_uring_close(u);
 	return -1;
 }
 
-int ss_thread_setname(ssthread *t, char *name)
+static inline ssuring*
+ss_uring_pop(ssvfs *f)
 {
-	#if defined(__APPLE__)
-		(void)t;
-		return pthread_setname_np(name);
-	#elif defined(__NetBSD__)
-		return pthread_setname_np(t->id, "%s", (void*)name);
-	#elif defined(__FreeBSD__)
-		return pthread_set_name_np(t->id, name);
-	#else
-		return pthread_setname_np(t->id, name);
-	#endif
+	ssuringvfs *o = ss_uringvfs_of(f);
+	uint32_t start = __sync_fetch_and_add(&o->next, 1);
+	int i = 0;
+	while (i < SS_URINGVFS_RINGS) {
+		ssuring *u = &o->ring[(start + i) % SS_URINGVFS_RINGS];
+		if (ss_spintrylock(&u->lock)) {
+			if (sslikely(! u->error))
+				return u;
+			ss_spinunlock(&u->lock);
+		}
+		i++;
+	}
+	return NULL;
 }
-#line 1 "sophia/std/ss_time.c"
 
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
+static inline void
+ss_uring_push(ssuring *u)
+{
+	ss_spinunlock(&u->lock);
+}
 
+static inline struct io_uring_sqe*
+ss_uring_sqe(ssuring *u, int n)
+{
+	/* a ring is always drained before it is released,
+	 * so entries are prepared right after the tail */
+	unsigned pos = (*u->sq_tail + n) & u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[pos];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = n;
+	u->sq_array[pos] = pos;
+	return sqe;
+}
 
+static int
+ss_uring_run(ssuring *u, int count, int *res)
+{
+	/* submit prepared entries in one call and wait
+	 * for all of them to complete */
+	__atomic_store_n(u->sq_tail, *u->sq_tail + count, __ATOMIC_RELEASE);
+	int submit = count;
+	int done = 0;
+	while (done < count) {
+		int rc = syscall(__NR_io_uring_enter, u->fd, submit, 1,
+		                 IORING_ENTER_GETEVENTS, NULL, 0);
+		if (ssunlikely(rc == -1)) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			u->error = 1;
+			return -1;
+		}
+		submit -= rc;
+		unsigned head = *u->cq_head;
+		unsigned tail = __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE);
+		while (head != tail) {
+			struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+			res[cqe->user_data] = cqe->res;
+			head++;
+			done++;
+		}
+		__atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
 
-void ss_sleep(uint64_t ns)
+static inline int
+ss_uring_result(int res)
 {
-	struct timespec ts;
-	ts.tv_sec  = 0;
-	ts.tv_nsec = ns;
-	nanosleep(&ts, NULL);
+	if (ssunlikely(res < 0)) {
+		errno = -res;
+		return -1;
+	}
+	return 0;
 }
 
-uint64_t ss_utime(void)
+static inline int
+ss_uringvfs_init(ssvfs *f, va_list args ssunused)
 {
-#if defined(__APPLE__)
-	struct timeval t;
-	gettimeofday(&t, NULL);
-	return t.tv_sec * 1000000ULL + t.tv_usec;
-#else
-	struct timespec t;
-	clock_gettime(CLOCK_MONOTONIC, &t);
-	return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
-#endif
+	ssuringvfs *o = malloc(sizeof(ssuringvfs));
+	if (ssunlikely(o == NULL))
+		return -1;
+	memset(o, 0, sizeof(*o));
+	int i = 0;
+	while (i < SS_URINGVFS_RINGS) {
+		int rc = ss_uring_open(&o->ring[i], SS_URINGVFS_ENTRIES);
+		if (ssunlikely(rc == -1)) {
+			while (--i >= 0)
+				ss_uring_close(&o->ring[i]);
+			free(o);
+			return -1;
+		}
+		i++;
+	}
+	ss_uringvfs_of(f) = o;
+	return 0;
 }
 
-uint32_t ss_timestamp(void)
+static inline void
+ss_uringvfs_free(ssvfs *f)
 {
-	return time(NULL);
+	ssuringvfs *o = ss_uringvfs_of(f);
+	int i = 0;
+	while (i < SS_URINGVFS_RINGS) {
+		ss_uring_close(&o->ring[i]);
+		ss_spinlockfree(&o->ring[i].lock);
+		i++;
+	}
+	free(o);
 }
-#line 1 "sophia/std/ss_zstdfilter.c"
-
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
 
+static int64_t
+ss_uringvfs_size(ssvfs *f, char *path)
+{
+	return ss_stdvfs.size(f, path);
+}
 
+static int
+ss_uringvfs_exists(ssvfs *f, char *path)
+{
+	return ss_stdvfs.exists(f, path);
+}
 
-/* zstd git commit: 765207c54934d478488c236749b01c7d6fc63d70 */
+static int
+ss_uringvfs_unlink(ssvfs *f, char *path)
+{
+	return ss_stdvfs.unlink(f, path);
+}
 
-/*
-    zstd - standard compression library
-    Copyright (C) 2014-2015, Yann Collet.
+static int
+ss_uringvfs_rename(ssvfs *f, char *src, char *dest)
+{
+	return ss_stdvfs.rename(f, src, dest);
+}
 
-    BSD 2-Clause License (http://www.opensource.org/licenses/bsd-license.php)
+static int
+ss_uringvfs_link(ssvfs *f, char *src, char *dest)
+{
+	return ss_stdvfs.link(f, src, dest);
+}
 
-    Redistribution and use in source and binary forms, with or without
-    modification, are permitted provided that the following conditions are
-    met:
-    * Redistributions of source code must retain the above copyright
-    notice, this list of conditions and the following disclaimer.
-    * Redistributions in binary form must reproduce the above
-    copyright notice, this list of conditions and the following disclaimer
-    in the documentation and/or other materials provided with the
-    distribution.
-    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
-    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
-    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
-    A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
-    OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
-    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
-    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
-    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
-    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
-    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
-    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+static int
+ss_uringvfs_mkdir(ssvfs *f, char *path, int mode)
+{
+	return ss_stdvfs.mkdir(f, path, mode);
+}
 
-    You can contact the author at :
-    - zstd source repository : https://github.com/Cyan4973/zstd
-    - ztsd public forum : https://groups.google.com/forum/#!forum/lz4c
-*/
+static int
+ss_uringvfs_rmdir(ssvfs *f, char *path)
+{
+	return ss_stdvfs.rmdir(f, path);
+}
 
-/*
-    FSE : Finite State Entropy coder
-    Copyright (C) 2013-2015, Yann Collet.
+static int
+ss_uringvfs_open(ssvfs *f, char *path, int flags, int mode)
+{
+	return ss_stdvfs.open(f, path, flags, mode);
+}
 
-    BSD 2-Clause License (http://www.opensource.org/licenses/bsd-license.php)
+static int
+ss_uringvfs_close(ssvfs *f, int fd)
+{
+	return ss_stdvfs.close(f, fd);
+}
 
-    Redistribution and use in source and binary forms, with or without
-    modification, are permitted provided that the following conditions are
-    met:
-    * Redistributions of source code must retain the above copyright
-    notice, this list of conditions and the following disclaimer.
-    * Redistributions in binary form must reproduce the above
-    copyright notice, this list of conditions and the following disclaimer
-    in the documentation and/or other materials provided with the
-    distribution.
-    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
-    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
-    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
-    A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
-    OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
-    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
-    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
-    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
-    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
-    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
-    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+static int
+ss_uringvfs_sync(ssvfs *f, int fd)
+{
+	return ss_stdvfs.sync(f, fd);
+}
 
-    You can contact the author at :
-    - Source repository : https://github.com/Cyan4973/FiniteStateEntropy
-    - Public forum : https://groups.google.com/forum/#!forum/lz4c
-*/
+static int
+ss_uringvfs_sync_file_range(ssvfs *f, int fd, uint64_t start, uint64_t size)
+{
+	return ss_stdvfs.sync_file_range(f, fd, start, size);
+}
 
-/* >>>>> zstd.h */
-
-/**************************************
-*  Version
-**************************************/
-#define ZSTD_VERSION_MAJOR    0    /* for breaking interface changes  */
-#define ZSTD_VERSION_MINOR    0    /* for new (non-breaking) interface capabilities */
-#define ZSTD_VERSION_RELEASE  2    /* for tweaks, bug-fixes, or development */
-#define ZSTD_VERSION_NUMBER (ZSTD_VERSION_MAJOR *100*100 + ZSTD_VERSION_MINOR *100 + ZSTD_VERSION_RELEASE)
-unsigned ZSTD_versionNumber (void);
+static int
+ss_uringvfs_advise(ssvfs *f, int fd, int hint, uint64_t off, uint64_t len)
+{
+	return ss_stdvfs.advise(f, fd, hint, off, len);
+}
 
+static int
+ss_uringvfs_advisev(ssvfs *f, int hint, ssvfsio *io, int count)
+{
+	/* read-ahead hints of a batch are submitted
+	 * together, errors are ignored */
+	ssuring *u = ss_uring_pop(f);
+	if (ssunlikely(u == NULL)) {
+		int i = 0;
+		while (i < count) {
+			ss_stdvfs.advise(f, io[i].fd, hint, io[i].offset, io[i].size);
+			i++;
+		}
+		return 0;
+	}
+	int advice = POSIX_FADV_DONTNEED;
+	if (hint == SS_ADVISE_WILLNEED)
+		advice = POSIX_FADV_WILLNEED;
+	int res[SS_URINGVFS_ENTRIES];
+	int rc = 0;
+	int pos = 0;
+	while (pos < count) {
+		int n = count - pos;
+		if (n > SS_URINGVFS_ENTRIES)
+			n = SS_URINGVFS_ENTRIES;
+		int i = 0;
+		while (i < n) {
+			struct io_uring_sqe *sqe = ss_uring_sqe(u, i);
+			sqe->opcode         = IORING_OP_FADVISE;
+			sqe->fd             = io[pos + i].fd;
+			sqe->off            = io[pos + i].offset;
+			sqe->len            = io[pos + i].size;
+			sqe->fadvise_advice = advice;
+			i++;
+		}
+		rc = ss_uring_run(u, n, res);
+		if (ssunlikely(rc == -1))
+			break;
+		pos += n;
+	}
+	ss_uring_push(u);
+	return rc;
+}
 
-/**************************************
-*  Simple one-step functions
-**************************************/
-size_t ZSTD_compress(   void* dst, size_t maxDstSize,
-                  const void* src, size_t srcSize);
+static int
+ss_uringvfs_truncate(ssvfs *f, int fd, uint64_t size)
+{
+	return ss_stdvfs.truncate(f, fd, size);
+}
 
-size_t ZSTD_decompress( void* dst, size_t maxOriginalSize,
-                  const void* src, size_t compressedSize);
+static int64_t
+ss_uringvfs_pread(ssvfs *f, int fd, uint64_t off, void *buf, int size)
+{
+	ssuring *u = ss_uring_pop(f);
+	if (ssunlikely(u == NULL))
+		return ss_stdvfs.pread(f, fd, off, buf, size);
+	struct io_uring_sqe *sqe = ss_uring_sqe(u, 0);
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd     = fd;
+	sqe->off    = off;
+	sqe->addr   = (uintptr_t)buf;
+	sqe->len    = size;
+	int res;
+	int rc = ss_uring_run(u, 1, &res);
+	ss_uring_push(u);
+	if (ssunlikely(rc == -1))
+		return -1;
+	if (ssunlikely(ss_uring_result(res) == -1))
+		return -1;
+	if (ssunlikely(res == 0))
+		return -1;
+	/* finish a short read synchronously */
+	if (ssunlikely(res < size)) {
+		int64_t n = ss_stdvfs.pread(f, fd, off + res, (char*)buf + res,
+		                            size - res);
+		if (ssunlikely(n == -1))
+			return -1;
+	}
+	return size;
+}
 
-/*
-ZSTD_compress() :
-    Compresses 'srcSize' bytes from buffer 'src' into buffer 'dst', of maximum size 'dstSize'.
-    Destination buffer should be sized to handle worst cases situations (input data not compressible).
-    Worst case size evaluation is provided by function ZSTD_compressBound().
-    return : the number of bytes written into buffer 'dst'
-             or an error code if it fails (which can be tested using ZSTD_isError())
+static int64_t
+ss_uringvfs_pwrite(ssvfs *f, int fd, uint64_t off, void *buf, int size)
+{
+	return ss_stdvfs.pwrite(f, fd, off, buf, size);
+}
 
-ZSTD_decompress() :
-    compressedSize : is obviously the source size
-    maxOriginalSize : is the size of the 'dst' buffer, which must be already allocated.
-                      It must be equal or larger than originalSize, otherwise decompression will fail.
-    return : the number of bytes decompressed into destination buffer (originalSize)
-             or an errorCode if it fails (which can be tested using ZSTD_isError())
-*/
+static int64_t
+ss_uringvfs_write(ssvfs *f, int fd, void *buf, int size)
+{
+	return ss_stdvfs.write(f, fd, buf, size);
+}
 
+static int64_t
+ss_uringvfs_writerest(ssvfs *f, int fd, ssiov *iov, int64_t written)
+{
+	/* finish a short write synchronously */
+	struct iovec *v = iov->v;
+	int n = iov->iovc;
+	int64_t skip = written;
+	while (n > 0 && (int64_t)v->iov_len <= skip) {
+		skip -= v->iov_len;
+		v++;
+		n--;
+	}
+	if (n == 0)
+		return written;
+	v->iov_base = (char*)v->iov_base + skip;
+	v->iov_len -= skip;
+	ssiov rest = {
+		.v      = v,
+		.iovmax = n,
+		.iovc   = n
+	};
+	int64_t rc = ss_stdvfs.writev(f, fd, &rest);
+	if (ssunlikely(rc == -1))
+		return -1;
+	return written + rc;
+}
 
-/**************************************
-*  Tool functions
-**************************************/
-size_t      ZSTD_compressBound(size_t srcSize);   /* maximum compressed size */
+static inline struct io_uring_sqe*
+ss_uringvfs_writesqe(ssuring *u, int fd, ssiov *iov)
+{
+	struct io_uring_sqe *sqe = ss_uring_sqe(u, 0);
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd     = fd;
+	sqe->off    = (uint64_t)-1; /* current position */
+	sqe->addr   = (uintptr_t)iov->v;
+	sqe->len    = iov->iovc;
+	return sqe;
+}
 
-/* Error Management */
-unsigned    ZSTD_isError(size_t code);         /* tells if a return value is an error code */
-const char* ZSTD_getErrorName(size_t code);    /* provides error code string (useful for debugging) */
+static int64_t
+ss_uringvfs_writev(ssvfs *f, int fd, ssiov *iov)
+{
+	ssuring *u = ss_uring_pop(f);
+	if (ssunlikely(u == NULL))
+		return ss_stdvfs.writev(f, fd, iov);
+	ss_uringvfs_writesqe(u, fd, iov);
+	int res;
+	int rc = ss_uring_run(u, 1, &res);
+	ss_uring_push(u);
+	if (ssunlikely(rc == -1))
+		return -1;
+	if (ssunlikely(ss_uring_result(res) == -1))
+		return -1;
+	return ss_uringvfs_writerest(f, fd, iov, res);
+}
 
-/* <<<<< zstd.h EOF */
+static int64_t
+ss_uringvfs_writev_sync(ssvfs *f, int fd, ssiov *iov)
+{
+	ssuring *u = ss_uring_pop(f);
+	if (ssunlikely(u == NULL))
+		return ss_stdvfs.writev_sync(f, fd, iov);
+	int64_t total = 0;
+	int i = 0;
+	while (i < iov->iovc) {
+		total += iov->v[i].iov_len;
+		i++;
+	}
+	/* write and data sync are linked, the sync starts
+	 * only after a complete write */
+	struct io_uring_sqe *sqe = ss_uringvfs_writesqe(u, fd, iov);
+	sqe->flags |= IOSQE_IO_LINK;
+	sqe = ss_uring_sqe(u, 1);
+	sqe->opcode      = IORING_OP_FSYNC;
+	sqe->fd          = fd;
+	sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+	int res[2];
+	int rc = ss_uring_run(u, 2, res);
+	ss_uring_push(u);
+	if (ssunlikely(rc == -1))
+		return -1;
+	if (ssunlikely(ss_uring_result(res[0]) == -1))
+		return -1;
+	if (sslikely(res[0] == total))
+		return (ss_uring_result(res[1]) == -1) ? -1 : total;
+	/* short write cancels the linked sync */
+	int64_t size = ss_uringvfs_writerest(f, fd, iov, res[0]);
+	if (ssunlikely(size == -1))
+		return -1;
+	if (ssunlikely(ss_stdvfs.sync(f, fd) == -1))
+		return -1;
+	return size;
+}
 
-/* >>>>> zstd_static.h */
+static int64_t
+ss_uringvfs_seek(ssvfs *f, int fd, uint64_t off)
+{
+	return ss_stdvfs.seek(f, fd, off);
+}
 
-/**************************************
-*  Streaming functions
-**************************************/
-typedef void* ZSTD_cctx_t;
-ZSTD_cctx_t ZSTD_createCCtx(void);
-size_t      ZSTD_freeCCtx(ZSTD_cctx_t cctx);
+static int
+ss_uringvfs_ioprio_low(ssvfs *f)
+{
+	return ss_stdvfs.ioprio_low(f);
+}
 
-size_t ZSTD_compressBegin(ZSTD_cctx_t cctx, void* dst, size_t maxDstSize);
-size_t ZSTD_compressContinue(ZSTD_cctx_t cctx, void* dst, size_t maxDstSize, const void* src, size_t srcSize);
-size_t ZSTD_compressEnd(ZSTD_cctx_t cctx, void* dst, size_t maxDstSize);
+static int
+ss_uringvfs_mmap(ssvfs *f, ssmmap *m, int fd, uint64_t size, int ro)
+{
+	return ss_stdvfs.mmap(f, m, fd, size, ro);
+}
 
-typedef void* ZSTD_dctx_t;
-ZSTD_dctx_t ZSTD_createDCtx(void);
-size_t      ZSTD_freeDCtx(ZSTD_dctx_t dctx);
+static int
+ss_uringvfs_mmap_allocate(ssvfs *f, ssmmap *m, uint64_t size)
+{
+	return ss_stdvfs.mmap_allocate(f, m, size);
+}
 
-size_t ZSTD_nextSrcSizeToDecompress(ZSTD_dctx_t dctx);
-size_t ZSTD_decompressContinue(ZSTD_dctx_t dctx, void* dst, size_t maxDstSize, const void* src, size_t srcSize);
-/*
-  Use above functions alternatively.
-  ZSTD_nextSrcSizeToDecompress() tells how much bytes to provide as input to ZSTD_decompressContinue().
-  This value is expected to be provided, precisely, as 'srcSize'.
-  Otherwise, compression will fail (result is an error code, which can be tested using ZSTD_isError() )
-  ZSTD_decompressContinue() result is the number of bytes regenerated within 'dst'.
-  It can be zero, which is not an error; it just means ZSTD_decompressContinue() has decoded some header.
-*/
+static int
+ss_uringvfs_mremap(ssvfs *f, ssmmap *m, uint64_t size)
+{
+	return ss_stdvfs.mremap(f, m, size);
+}
 
-/**************************************
-*  Error management
-**************************************/
-#define ZSTD_LIST_ERRORS(ITEM) \
-        ITEM(ZSTD_OK_NoError) ITEM(ZSTD_ERROR_GENERIC) \
-        ITEM(ZSTD_ERROR_wrongMagicNumber) \
-        ITEM(ZSTD_ERROR_wrongSrcSize) ITEM(ZSTD_ERROR_maxDstSize_tooSmall) \
-        ITEM(ZSTD_ERROR_wrongLBlockSize) \
-        ITEM(ZSTD_ERROR_maxCode)
+static int
+ss_uringvfs_munmap(ssvfs *f, ssmmap *m)
+{
+	return ss_stdvfs.munmap(f, m);
+}
 
-#define ZSTD_GENERATE_ENUM(ENUM) ENUM,
-typedef enum { ZSTD_LIST_ERRORS(ZSTD_GENERATE_ENUM) } ZSTD_errorCodes;   /* exposed list of errors; static linking only */
+ssvfsif ss_uringvfs =
+{
+	.init            = ss_uringvfs_init,
+	.free            = ss_uringvfs_free,
+	.size            = ss_uringvfs_size,
+	.exists          = ss_uringvfs_exists,
+	.unlink          = ss_uringvfs_unlink,
+	.rename          = ss_uringvfs_rename,
+	.link            = ss_uringvfs_link,
+	.mkdir           = ss_uringvfs_mkdir,
+	.rmdir           = ss_uringvfs_rmdir,
+	.open            = ss_uringvfs_open,
+	.close           = ss_uringvfs_close,
+	.sync            = ss_uringvfs_sync,
+	.sync_file_range = ss_uringvfs_sync_file_range,
+	.advise          = ss_uringvfs_advise,
+	.truncate        = ss_uringvfs_truncate,
+	.pread           = ss_uringvfs_pread,
+	.pwrite          = ss_uringvfs_pwrite,
+	.write           = ss_uringvfs_write,
+	.writev          = ss_uringvfs_writev,
+	.writev_sync     = ss_uringvfs_writev_sync,
+	.advisev         = ss_uringvfs_advisev,
+	.seek            = ss_uringvfs_seek,
+	.ioprio_low      = ss_uringvfs_ioprio_low,
+	.mmap            = ss_uringvfs_mmap,
+	.mmap_allocate   = ss_uringvfs_mmap_allocate,
+	.mremap          = ss_uringvfs_mremap,
+	.munmap          = ss_uringvfs_munmap
+};
 
-/* <<<<< zstd_static.h EOF */
+#else
 
-/* >>>>> fse.h */
+static inline int
+ss_uringvfs_init(ssvfs *f ssunused, va_list args ssunused)
+{
+	errno = ENOSYS;
+	return -1;
+}
 
-/******************************************
-*  FSE simple functions
-******************************************/
-size_t FSE_compress(void* dst, size_t maxDstSize,
-              const void* src, size_t srcSize);
-size_t FSE_decompress(void* dst, size_t maxDstSize,
-                const void* cSrc, size_t cSrcSize);
-/*
-FSE_compress():
-    Compress content of buffer 'src', of size 'srcSize', into destination buffer 'dst'.
-    'dst' buffer must be already allocated, and sized to handle worst case situations.
-    Worst case size evaluation is provided by FSE_compressBound().
-    return : size of compressed data
-    Special values : if result == 0, data is uncompressible => Nothing is stored within cSrc !!
-                     if result == 1, data is one constant element x srcSize times. Use RLE compression.
-                     if FSE_isError(result), it's an error code.
+static inline void
+ss_uringvfs_free(ssvfs *f ssunused)
+{ }
 
-FSE_decompress():
-    Decompress FSE data from buffer 'cSrc', of size 'cSrcSize',
-    into already allocated destination buffer 'dst', of size 'maxDstSize'.
-    ** Important ** : This function doesn't decompress uncompressed nor RLE data !
-    return : size of regenerated data (<= maxDstSize)
-             or an error code, which can be tested using FSE_isError()
-*/
+/* initialization always fails and the caller falls
+ * back to ss_stdvfs */
+ssvfsif ss_uringvfs =
+{
+	.init            = ss_uringvfs_init,
+	.free            = ss_uringvfs_free
+};
 
+#endif
+#line 1 "sophia/std/ss_thread.c"
 
-size_t FSE_decompressRLE(void* dst, size_t originalSize,
-                   const void* cSrc, size_t cSrcSize);
 /*
-FSE_decompressRLE():
-    Decompress specific RLE corner case (equivalent to memset()).
-    cSrcSize must be == 1. originalSize must be exact.
-    return : size of regenerated data (==originalSize)
-             or an error code, which can be tested using FSE_isError()
-
-Note : there is no function provided for uncompressed data, as it's just a simple memcpy()
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
 */
 
 
-/******************************************
-*  Tool functions
-******************************************/
-size_t FSE_compressBound(size_t size);       /* maximum compressed size */
-
-/* Error Management */
-unsigned    FSE_isError(size_t code);        /* tells if a return value is an error code */
-const char* FSE_getErrorName(size_t code);   /* provides error code string (useful for debugging) */
-
 
-/******************************************
-*  FSE advanced functions
-******************************************/
-/*
-FSE_compress2():
-    Same as FSE_compress(), but allows the selection of 'maxSymbolValue' and 'tableLog'
-    Both parameters can be defined as '0' to mean : use default value
-    return : size of compressed data
-             or -1 if there is an error
-*/
-size_t FSE_compress2 (void* dst, size_t dstSize, const void* src, size_t srcSize, unsigned maxSymbolValue, unsigned tableLog);
+int ss_threadpool_init(ssthreadpool *p)
+{
+	ss_listinit(&p->list);
+	p->n = 0;
+	return 0;
+}
 
+int ss_threadpool_shutdown(ssthreadpool *p, ssa *a)
+{
+	int rcret = 0;
+	int rc;
+	sslist *i, *n;
+	ss_listforeach_safe(&p->list, i, n) {
+		ssthread *t = sscast(i, ssthread, link);
+		rc = pthread_join(t->id, NULL);
+		if (ssunlikely(rc != 0))
+			rcret = -1;
+		ss_free(a, t);
+	}
+	return rcret;
+}
 
-/******************************************
-   FSE detailed API
-******************************************/
-/*
-int FSE_compress(char* dest, const char* source, int inputSize) does the following:
-1. count symbol occurrence from source[] into table count[]
-2. normalize counters so that sum(count[]) == Power_of_2 (2^tableLog)
-3. save normalized counters to memory buffer using writeHeader()
-4. build encoding table 'CTable' from normalized counters
-5. encode the data stream using encoding table
-
-int FSE_decompress(char* dest, int originalSize, const char* compressed) performs:
-1. read normalized counters with readHeader()
-2. build decoding table 'DTable' from normalized counters
-3. decode the data stream using decoding table
-
-The following API allows triggering specific sub-functions.
-*/
-
-/* *** COMPRESSION *** */
-
-size_t FSE_count(unsigned* count, const unsigned char* src, size_t srcSize, unsigned* maxSymbolValuePtr);
-
-unsigned FSE_optimalTableLog(unsigned tableLog, size_t srcSize, unsigned maxSymbolValue);
-size_t FSE_normalizeCount(short* normalizedCounter, unsigned tableLog, const unsigned* count, size_t total, unsigned maxSymbolValue);
-
-size_t FSE_headerBound(unsigned maxSymbolValue, unsigned tableLog);
-size_t FSE_writeHeader (void* headerBuffer, size_t headerBufferSize, const short* normalizedCounter, unsigned maxSymbolValue, unsigned tableLog);
+int ss_threadpool_new(ssthreadpool *p, ssa *a, int n, ssthreadf f, void *arg)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		ssthread *t = ss_malloc(a, sizeof(*t));
+		if (ssunlikely(t == NULL))
+			goto error;
+		ss_listinit(&t->link);
+		ss_listappend(&p->list, &t->link);
+		p->n++;
+		t->f = f;
+		t->arg = arg;
+		int rc;
+		rc = pthread_create(&t->id, NULL, f, t);
+		if (ssunlikely(rc != 0))
+			goto error;
+	}
+	return 0;
+error:
+	ss_threadpool_shutdown(p, a);
+	return -1;
+}
 
-void*  FSE_createCTable (unsigned tableLog, unsigned maxSymbolValue);
-void   FSE_freeCTable (void* CTable);
-size_t FSE_buildCTable(void* CTable, const short* normalizedCounter, unsigned maxSymbolValue, unsigned tableLog);
+int ss_threadpool_add(ssthreadpool *p, ssa *a, ssthreadf f, void *arg)
+{
+	/* unlike ss_threadpool_new(), threads already in
+	 * the pool are left running on error */
+	ssthread *t = ss_malloc(a, sizeof(*t));
+	if (ssunlikely(t == NULL))
+		return -1;
+	t->f = f;
+	t->arg = arg;
+	int rc = pthread_create(&t->id, NULL, f, t);
+	if (ssunlikely(rc != 0)) {
+		ss_free(a, t);
+		return -1;
+	}
+	ss_listinit(&t->link);
+	ss_listappend(&p->list, &t->link);
+	p->n++;
+	return 0;
+}
 
-size_t FSE_compress_usingCTable (void* dst, size_t dstSize, const void* src, size_t srcSize, const void* CTable);
+int ss_thread_setname(ssthread *t, char *name)
+{
+	#if defined(__APPLE__)
+		(void)t;
+		return pthread_setname_np(name);
+	#elif defined(__NetBSD__)
+		return pthread_setname_np(t->id, "%s", (void*)name);
+	#elif defined(__FreeBSD__)
+		return pthread_set_name_np(t->id, name);
+	#else
+		return pthread_setname_np(t->id, name);
+	#endif
+}
+#line 1 "sophia/std/ss_job.c"
 
 /*
-The first step is to count all symbols. FSE_count() provides one quick way to do this job.
-Result will be saved into 'count', a table of unsigned int, which must be already allocated, and have '*maxSymbolValuePtr+1' cells.
-'source' is a table of char of size 'sourceSize'. All values within 'src' MUST be <= *maxSymbolValuePtr
-*maxSymbolValuePtr will be updated, with its real value (necessarily <= original value)
-FSE_count() will return the number of occurrence of the most frequent symbol.
-If there is an error, the function will return an ErrorCode (which can be tested using FSE_isError()).
-
-The next step is to normalize the frequencies.
-FSE_normalizeCount() will ensure that sum of frequencies is == 2 ^'tableLog'.
-It also guarantees a minimum of 1 to any Symbol which frequency is >= 1.
-You can use input 'tableLog'==0 to mean "use default tableLog value".
-If you are unsure of which tableLog value to use, you can optionally call FSE_optimalTableLog(),
-which will provide the optimal valid tableLog given sourceSize, maxSymbolValue, and a user-defined maximum (0 means "default").
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
 
-The result of FSE_normalizeCount() will be saved into a table,
-called 'normalizedCounter', which is a table of signed short.
-'normalizedCounter' must be already allocated, and have at least 'maxSymbolValue+1' cells.
-The return value is tableLog if everything proceeded as expected.
-It is 0 if there is a single symbol within distribution.
-If there is an error(typically, invalid tableLog value), the function will return an ErrorCode (which can be tested using FSE_isError()).
 
-'normalizedCounter' can be saved in a compact manner to a memory area using FSE_writeHeader().
-'header' buffer must be already allocated.
-For guaranteed success, buffer size must be at least FSE_headerBound().
-The result of the function is the number of bytes written into 'header'.
-If there is an error, the function will return an ErrorCode (which can be tested using FSE_isError()) (for example, buffer size too small).
 
-'normalizedCounter' can then be used to create the compression tables 'CTable'.
-The space required by 'CTable' must be already allocated. Its size is provided by FSE_sizeof_CTable().
-'CTable' must be aligned of 4 bytes boundaries.
-You can then use FSE_buildCTable() to fill 'CTable'.
-In both cases, if there is an error, the function will return an ErrorCode (which can be tested using FSE_isError()).
+/*
+	A simple FIFO of jobs served by a pool of threads.
 
-'CTable' can then be used to compress 'source', with FSE_compress_usingCTable().
-Similar to FSE_count(), the convention is that 'source' is assumed to be a table of char of size 'sourceSize'
-The function returns the size of compressed data (without header), or -1 if failed.
+	A thread waiting for a group of jobs to complete runs
+	queued jobs itself, so jobs may safely push and wait for
+	more jobs, and a queue started without threads runs
+	everything in the waiting thread.
 */
 
+static inline void
+ss_jobrun(ssjobq *q, ssjob *j)
+{
+	ssjobgroup *g = j->group;
+	int rc = j->function(j);
+	ss_mutexlock(&q->lock);
+	if (ssunlikely(rc == -1))
+		g->rc = -1;
+	g->pending--;
+	if (g->pending == 0)
+		ss_condbroadcast(&q->cond);
+	ss_mutexunlock(&q->lock);
+}
 
-/* *** DECOMPRESSION *** */
-
-size_t FSE_readHeader (short* normalizedCounter, unsigned* maxSymbolValuePtr, unsigned* tableLogPtr, const void* headerBuffer, size_t hbSize);
+static void*
+ss_jobqworker(void *arg)
+{
+	ssthread *self = arg;
+	ssjobq *q = self->arg;
+	ss_mutexlock(&q->lock);
+	for (;;) {
+		if (! ss_listempty(&q->list)) {
+			ssjob *j = sscast(ss_listpop(&q->list), ssjob, link);
+			ss_mutexunlock(&q->lock);
+			ss_jobrun(q, j);
+			ss_mutexlock(&q->lock);
+			continue;
+		}
+		if (q->shutdown)
+			break;
+		ss_condwait(&q->cond, &q->lock);
+	}
+	ss_mutexunlock(&q->lock);
+	return NULL;
+}
 
-void*  FSE_createDTable(unsigned tableLog);
-void   FSE_freeDTable(void* DTable);
-size_t FSE_buildDTable (void* DTable, const short* const normalizedCounter, unsigned maxSymbolValue, unsigned tableLog);
+int ss_jobqinit(ssjobq *q)
+{
+	ss_mutexinit(&q->lock);
+	ss_condinit(&q->cond);
+	ss_listinit(&q->list);
+	ss_threadpool_init(&q->tp);
+	q->shutdown = 0;
+	return 0;
+}
 
-size_t FSE_decompress_usingDTable(void* dst, size_t maxDstSize, const void* cSrc, size_t cSrcSize, const void* DTable, size_t fastMode);
+int ss_jobqstart(ssjobq *q, ssa *a, int n)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		int rc = ss_threadpool_add(&q->tp, a, ss_jobqworker, q);
+		if (ssunlikely(rc == -1))
+			return -1;
+	}
+	return 0;
+}
 
-/*
-If the block is RLE compressed, or uncompressed, use the relevant specific functions.
+int ss_jobqshutdown(ssjobq *q, ssa *a)
+{
+	ss_mutexlock(&q->lock);
+	q->shutdown = 1;
+	ss_condbroadcast(&q->cond);
+	ss_mutexunlock(&q->lock);
+	int rc = ss_threadpool_shutdown(&q->tp, a);
+	ss_condfree(&q->cond);
+	ss_mutexfree(&q->lock);
+	return rc;
+}
 
-The first step is to obtain the normalized frequencies of symbols.
-This can be performed by reading a header with FSE_readHeader().
-'normalizedCounter' must be already allocated, and have at least '*maxSymbolValuePtr+1' cells of short.
-In practice, that means it's necessary to know 'maxSymbolValue' beforehand,
-or size the table to handle worst case situations (typically 256).
-FSE_readHeader will provide 'tableLog' and 'maxSymbolValue' stored into the header.
-The result of FSE_readHeader() is the number of bytes read from 'header'.
-The following values have special meaning :
-return 2 : there is only a single symbol value. The value is provided into the second byte of header.
-return 1 : data is uncompressed
-If there is an error, the function will return an error code, which can be tested using FSE_isError().
+void ss_jobqpush(ssjobq *q, ssjob *j)
+{
+	ss_mutexlock(&q->lock);
+	j->group->pending++;
+	ss_listappend(&q->list, &j->link);
+	ss_condbroadcast(&q->cond);
+	ss_mutexunlock(&q->lock);
+}
 
-The next step is to create the decompression tables 'DTable' from 'normalizedCounter'.
-This is performed by the function FSE_buildDTable().
-The space required by 'DTable' must be already allocated and properly aligned.
-One can create a DTable using FSE_createDTable().
-The function will return 1 if DTable is compatible with fastMode, 0 otherwise.
-If there is an error, the function will return an error code, which can be tested using FSE_isError().
+int ss_jobqwait(ssjobq *q, ssjobgroup *g)
+{
+	ss_mutexlock(&q->lock);
+	while (g->pending > 0) {
+		if (! ss_listempty(&q->list)) {
+			ssjob *j = sscast(ss_listpop(&q->list), ssjob, link);
+			ss_mutexunlock(&q->lock);
+			ss_jobrun(q, j);
+			ss_mutexlock(&q->lock);
+			continue;
+		}
+		ss_condwait(&q->cond, &q->lock);
+	}
+	int rc = g->rc;
+	ss_mutexunlock(&q->lock);
+	return rc;
+}
+#line 1 "sophia/std/ss_time.c"
 
-'DTable' can then be used to decompress 'compressed', with FSE_decompress_usingDTable().
-Only trigger fastMode if it was authorized by result of FSE_buildDTable(), otherwise decompression will fail.
-cSrcSize must be correct, otherwise decompression will fail.
-FSE_decompress_usingDTable() result will tell how many bytes were regenerated.
-If there is an error, the function will return an error code, which can be tested using FSE_isError().
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
 */
 
 
-/******************************************
-*  FSE streaming compression API
-******************************************/
-typedef struct
-{
-    size_t bitContainer;
-    int    bitPos;
-    char*  startPtr;
-    char*  ptr;
-} FSE_CStream_t;
 
-typedef struct
+void ss_sleep(uint64_t ns)
 {
-    ptrdiff_t   value;
-    const void* stateTable;
-    const void* symbolTT;
-    unsigned    stateLog;
-} FSE_CState_t;
-
-void   FSE_initCStream(FSE_CStream_t* bitC, void* dstBuffer);
-void   FSE_initCState(FSE_CState_t* CStatePtr, const void* CTable);
+	struct timespec ts;
+	ts.tv_sec  = 0;
+	ts.tv_nsec = ns;
+	nanosleep(&ts, NULL);
+}
 
-void   FSE_encodeByte(FSE_CStream_t* bitC, FSE_CState_t* CStatePtr, unsigned char symbol);
-void   FSE_addBits(FSE_CStream_t* bitC, size_t value, unsigned nbBits);
-void   FSE_flushBits(FSE_CStream_t* bitC);
+uint64_t ss_utime(void)
+{
+#if defined(__APPLE__)
+	struct timeval t;
+	gettimeofday(&t, NULL);
+	return t.tv_sec * 1000000ULL + t.tv_usec;
+#else
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000ULL + t.tv_nsec / 1000;
+#endif
+}
 
-void   FSE_flushCState(FSE_CStream_t* bitC, const FSE_CState_t* CStatePtr);
-size_t FSE_closeCStream(FSE_CStream_t* bitC);
+uint32_t ss_timestamp(void)
+{
+	return time(NULL);
+}
+#line 1 "sophia/std/ss_zstdfilter.c"
 
 /*
-These functions are inner components of FSE_compress_usingCTable().
-They allow creation of custom streams, mixing multiple tables and bit sources.
-
-A key property to keep in mind is that encoding and decoding are done **in reverse direction**.
-So the first symbol you will encode is the last you will decode, like a lifo stack.
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
 
-You will need a few variables to track your CStream. They are :
 
-void* CTable;           // Provided by FSE_buildCTable()
-FSE_CStream_t bitC;     // bitStream tracking structure
-FSE_CState_t state;     // State tracking structure
 
+/* zstd git commit: 765207c54934d478488c236749b01c7d6fc63d70 */
 
-The first thing to do is to init the bitStream, and the state.
-    FSE_initCStream(&bitC, dstBuffer);
-    FSE_initState(&state, CTable);
+/*
+    zstd - standard compression library
+    Copyright (C) 2014-2015, Yann Collet.
 
-You can then encode your input data, byte after byte.
-FSE_encodeByte() outputs a maximum of 'tableLog' bits at a time.
-Remember decoding will be done in reverse direction.
-    FSE_encodeByte(&bitStream, &state, symbol);
+    BSD 2-Clause License (http://www.opensource.org/licenses/bsd-license.php)
 
-At any time, you can add any bit sequence.
-Note : maximum allowed nbBits is 25, for compatibility with 32-bits decoders
-    FSE_addBits(&bitStream, bitField, nbBits);
-
-The above methods don't commit data to memory, they just store it into local register, for speed.
-Local register size is 64-bits on 64-bits systems, 32-bits on 32-bits systems (size_t).
-Writing data to memory is a manual operation, performed by the flushBits function.
-    FSE_flushBits(&bitStream);
-
-Your last FSE encoding operation shall be to flush your last state value(s).
-    FSE_flushState(&bitStream, &state);
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above
+    copyright notice, this list of conditions and the following disclaimer
+    in the documentation and/or other materials provided with the
+    distribution.
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+    A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
-You must then close the bitStream if you opened it with FSE_initCStream().
-It's possible to embed some user-info into the header, as an optionalId [0-31].
-The function returns the size in bytes of CStream.
-If there is an error, it returns an errorCode (which can be tested using FSE_isError()).
-    size_t size = FSE_closeCStream(&bitStream, optionalId);
+    You can contact the author at :
+    - zstd source repository : https://github.com/Cyan4973/zstd
+    - ztsd public forum : https://groups.google.com/forum/#!forum/lz4c
 */
 
+/*
+    FSE : Finite State Entropy coder
+    Copyright (C) 2013-2015, Yann Collet.
 
-/******************************************
-*  FSE streaming decompression API
-******************************************/
-//typedef unsigned int bitD_t;
-typedef size_t bitD_t;
+    BSD 2-Clause License (http://www.opensource.org/licenses/bsd-license.php)
 
-typedef struct
-{
-    bitD_t   bitContainer;
-    unsigned bitsConsumed;
-    const char* ptr;
-    const char* start;
-} FSE_DStream_t;
+    Redistribution and use in source and binary forms, with or without
+    modification, are permitted provided that the following conditions are
+    met:
+    * Redistributions of source code must retain the above copyright
+    notice, this list of conditions and the following disclaimer.
+    * Redistributions in binary form must reproduce the above
+    copyright notice, this list of conditions and the following disclaimer
+    in the documentation and/or other materials provided with the
+    distribution.
+    THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+    "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+    LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+    A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+    OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+    SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+    LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+    DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+    THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
-typedef struct
-{
-    bitD_t      state;
-    const void* table;
-} FSE_DState_t;
+    You can contact the author at :
+    - Source repository : https://github.com/Cyan4973/FiniteStateEntropy
+    - Public forum : https://groups.google.com/forum/#!forum/lz4c
+*/
 
+/* >>>>> zstd.h */
 
-size_t FSE_initDStream(FSE_DStream_t* bitD, const void* srcBuffer, size_t srcSize);
-void   FSE_initDState(FSE_DState_t* DStatePtr, FSE_DStream_t* bitD, const void* DTable);
+/**************************************
+*  Version
+**************************************/
+#define ZSTD_VERSION_MAJOR    0    /* for breaking interface changes  */
+#define ZSTD_VERSION_MINOR    0    /* for new (non-breaking) interface capabilities */
+#define ZSTD_VERSION_RELEASE  2    /* for tweaks, bug-fixes, or development */
+#define ZSTD_VERSION_NUMBER (ZSTD_VERSION_MAJOR *100*100 + ZSTD_VERSION_MINOR *100 + ZSTD_VERSION_RELEASE)
+unsigned ZSTD_versionNumber (void);
 
-unsigned char FSE_decodeSymbol(FSE_DState_t* DStatePtr, FSE_DStream_t* bitD);
-bitD_t        FSE_readBits(FSE_DStream_t* bitD, unsigned nbBits);
-unsigned int  FSE_reloadDStream(FSE_DStream_t* bitD);
 
-unsigned FSE_endOfDStream(const FSE_DStream_t* bitD);
-unsigned FSE_endOfDState(const FSE_DState_t* DStatePtr);
+/**************************************
+*  Simple one-step functions
+**************************************/
+size_t ZSTD_compress(   void* dst, size_t maxDstSize,
+                  const void* src, size_t srcSize);
+
+size_t ZSTD_decompress( void* dst, size_t maxOriginalSize,
+                  const void* src, size_t compressedSize);
 
 /*
-Let's now decompose FSE_decompress_usingDTable() into its unitary elements.
-You will decode FSE-encoded symbols from the bitStream,
-and also any other bitFields you put in, **in reverse order**.
+ZSTD_compress() :
+    Compresses 'srcSize' bytes from buffer 'src' into buffer 'dst', of maximum size 'dstSize'.
+    Destination buffer should be sized to handle worst cases situations (input data not compressible).
+    Worst case size evaluation is provided by function ZSTD_compressBound().
+    return : the number of bytes written into buffer 'dst'
+             or an error code if it fails (which can be tested using ZSTD_isError())
 
-You will need a few variables to track your bitStream. They are :
+ZSTD_decompress() :
+    compressedSize : is obviously the source size
+    maxOriginalSize : is the size of the 'dst' buffer, which must be already allocated.
+                      It must be equal or larger than originalSize, otherwise decompression will fail.
+    return : the number of bytes decompressed into destination buffer (originalSize)
+             or an errorCode if it fails (which can be tested using ZSTD_isError())
+*/
 
-FSE_DStream_t DStream;    // Stream context
-FSE_DState_t DState;      // State context. Multiple ones are possible
-const void* DTable;       // Decoding table, provided by FSE_buildDTable()
-U32 tableLog;             // Provided by FSE_readHeader()
 
-The first thing to do is to init the bitStream.
-    errorCode = FSE_initDStream(&DStream, &optionalId, srcBuffer, srcSize);
+/**************************************
+*  Tool functions
+**************************************/
+size_t      ZSTD_compressBound(size_t srcSize);   /* maximum compressed size */
 
-You should then retrieve your initial state(s) (multiple ones are possible) :
-    errorCode = FSE_initDState(&DState, &DStream, DTable, tableLog);
+/* Error Management */
+unsigned    ZSTD_isError(size_t code);         /* tells if a return value is an error code */
+const char* ZSTD_getErrorName(size_t code);    /* provides error code string (useful for debugging) */
 
-You can then decode your data, symbol after symbol.
-For information the maximum number of bits read by FSE_decodeSymbol() is 'tableLog'.
-Keep in mind that symbols are decoded in reverse order, like a lifo stack (last in, first out).
-    unsigned char symbol = FSE_decodeSymbol(&DState, &DStream);
+/* <<<<< zstd.h EOF */
 
-You can retrieve any bitfield you eventually stored into the bitStream (in reverse order)
-Note : maximum allowed nbBits is 25
-    unsigned int bitField = FSE_readBits(&DStream, nbBits);
+/* >>>>> zstd_static.h */
 
-All above operations only read from local register (which size is controlled by bitD_t==32 bits).
-Reading data from memory is manually performed by the reload method.
-    endSignal = FSE_reloadDStream(&DStream);
+/**************************************
+*  Streaming functions
+**************************************/
+typedef void* ZSTD_cctx_t;
+ZSTD_cctx_t ZSTD_createCCtx(void);
+size_t      ZSTD_freeCCtx(ZSTD_cctx_t cctx);
 
-FSE_reloadDStream() result tells if there is still some more data to read from DStream.
-0 : there is still some data left into the DStream.
-1 Dstream reached end of buffer, but is not yet fully extracted. It will not load data from memory any more.
-2 Dstream reached its exact end, corresponding in general to decompression completed.
-3 Dstream went too far. Decompression result is corrupted.
+size_t ZSTD_compressBegin(ZSTD_cctx_t cctx, void* dst, size_t maxDstSize);
+size_t ZSTD_compressContinue(ZSTD_cctx_t cctx, void* dst, size_t maxDstSize, const void* src, size_t srcSize);
+size_t ZSTD_compressEnd(ZSTD_cctx_t cctx, void* dst, size_t maxDstSize);
 
-When reaching end of buffer(1), progress slowly if you decode multiple symbols per loop,
-to properly detect the exact end of stream.
-After each decoded symbol, check if DStream is fully consumed using this simple test :
-    FSE_reloadDStream(&DStream) >= 2
+typedef void* ZSTD_dctx_t;
+ZSTD_dctx_t ZSTD_createDCtx(void);
+size_t      ZSTD_freeDCtx(ZSTD_dctx_t dctx);
 
-When it's done, verify decompression is fully completed, by checking both DStream and the relevant states.
-Checking if DStream has reached its end is performed by :
-    FSE_endOfDStream(&DStream);
-Check also the states. There might be some entropy left there, still able to decode some high probability symbol.
-    FSE_endOfDState(&DState);
+size_t ZSTD_nextSrcSizeToDecompress(ZSTD_dctx_t dctx);
+size_t ZSTD_decompressContinue(ZSTD_dctx_t dctx, void* dst, size_t maxDstSize, const void* src, size_t srcSize);
+/*
+  Use above functions alternatively.
+  ZSTD_nextSrcSizeToDecompress() tells how much bytes to provide as input to ZSTD_decompressContinue().
+  This value is expected to be provided, precisely, as 'srcSize'.
+  Otherwise, compression will fail (result is an error code, which can be tested using ZSTD_isError() )
+  ZSTD_decompressContinue() result is the number of bytes regenerated within 'dst'.
+  It can be zero, which is not an error; it just means ZSTD_decompressContinue() has decoded some header.
 */
 
-/* <<<<< fse.h EOF */
+/**************************************
+*  Error management
+**************************************/
+#define ZSTD_LIST_ERRORS(ITEM) \
+        ITEM(ZSTD_OK_NoError) ITEM(ZSTD_ERROR_GENERIC) \
+        ITEM(ZSTD_ERROR_wrongMagicNumber) \
+        ITEM(ZSTD_ERROR_wrongSrcSize) ITEM(ZSTD_ERROR_maxDstSize_tooSmall) \
+        ITEM(ZSTD_ERROR_wrongLBlockSize) \
+        ITEM(ZSTD_ERROR_maxCode)
+
+#define ZSTD_GENERATE_ENUM(ENUM) ENUM,
+typedef enum { ZSTD_LIST_ERRORS(ZSTD_GENERATE_ENUM) } ZSTD_errorCodes;   /* exposed list of errors; static linking only */
 
+/* <<<<< zstd_static.h EOF */
 
-/* >>>>> fse_static.h */
+/* >>>>> fse.h */
 
 /******************************************
-*  Tool functions
+*  FSE simple functions
 ******************************************/
-#define FSE_MAX_HEADERSIZE 512
-#define FSE_COMPRESSBOUND(size) (size + (size>>7) + FSE_MAX_HEADERSIZE)   /* Macro can be useful for static allocation */
+size_t FSE_compress(void* dst, size_t maxDstSize,
+              const void* src, size_t srcSize);
+size_t FSE_decompress(void* dst, size_t maxDstSize,
+                const void* cSrc, size_t cSrcSize);
+/*
+FSE_compress():
+    Compress content of buffer 'src', of size 'srcSize', into destination buffer 'dst'.
+    'dst' buffer must be already allocated, and sized to handle worst case situations.
+    Worst case size evaluation is provided by FSE_compressBound().
+    return : size of compressed data
+    Special values : if result == 0, data is uncompressible => Nothing is stored within cSrc !!
+                     if result == 1, data is one constant element x srcSize times. Use RLE compression.
+                     if FSE_isError(result), it's an error code.
 
+FSE_decompress():
+    Decompress FSE data from buffer 'cSrc', of size 'cSrcSize',
+    into already allocated destination buffer 'dst', of size 'maxDstSize'.
+    ** Important ** : This function doesn't decompress uncompressed nor RLE data !
+    return : size of regenerated data (<= maxDstSize)
+             or an error code, which can be tested using FSE_isError()
+*/
 
-/******************************************
-*  Static allocation
-******************************************/
-/* You can statically allocate a CTable as a table of U32 using below macro */
-#define FSE_CTABLE_SIZE_U32(maxTableLog, maxSymbolValue)   (1 + (1<<(maxTableLog-1)) + ((maxSymbolValue+1)*2))
-#define FSE_DTABLE_SIZE_U32(maxTableLog)                   ((1<<maxTableLog)+1)
 
-/******************************************
-*  Error Management
-******************************************/
-#define FSE_LIST_ERRORS(ITEM) \
-        ITEM(FSE_OK_NoError) ITEM(FSE_ERROR_GENERIC) \
-        ITEM(FSE_ERROR_tableLog_tooLarge) ITEM(FSE_ERROR_maxSymbolValue_tooLarge) \
-        ITEM(FSE_ERROR_dstSize_tooSmall) ITEM(FSE_ERROR_srcSize_wrong)\
-        ITEM(FSE_ERROR_corruptionDetected) \
-        ITEM(FSE_ERROR_maxCode)
+size_t FSE_decompressRLE(void* dst, size_t originalSize,
+                   const void* cSrc, size_t cSrcSize);
+/*
+FSE_decompressRLE():
+    Decompress specific RLE corner case (equivalent to memset()).
+    cSrcSize must be == 1. originalSize must be exact.
+    return : size of regenerated data (==originalSize)
+             or an error code, which can be tested using FSE_isError()
 
-#define FSE_GENERATE_ENUM(ENUM) ENUM,
-typedef enum { FSE_LIST_ERRORS(FSE_GENERATE_ENUM) } FSE_errorCodes;  /* enum is exposed, to detect & handle specific errors; compare function result to -enum value */
+Note : there is no function provided for uncompressed data, as it's just a simple memcpy()
+*/
 
 
 /******************************************
-*  FSE advanced API
+*  Tool functions
 ******************************************/
-size_t FSE_countFast(unsigned* count, const unsigned char* src, size_t srcSize, unsigned* maxSymbolValuePtr);
-/* same as FSE_count(), but won't check if input really respect that all values within src are <= *maxSymbolValuePtr */
+size_t FSE_compressBound(size_t size);       /* maximum compressed size */
 
-size_t FSE_buildCTable_raw (void* CTable, unsigned nbBits);
-/* create a fake CTable, designed to not compress an input where each element uses nbBits */
-
-size_t FSE_buildCTable_rle (void* CTable, unsigned char symbolValue);
-/* create a fake CTable, designed to compress a single identical value */
+/* Error Management */
+unsigned    FSE_isError(size_t code);        /* tells if a return value is an error code */
+const char* FSE_getErrorName(size_t code);   /* provides error code string (useful for debugging) */
 
-size_t FSE_buildDTable_raw (void* DTable, unsigned nbBits);
-/* create a fake DTable, designed to read an uncompressed bitstream where each element uses nbBits */
 
-size_t FSE_buildDTable_rle (void* DTable, unsigned char symbolValue);
-/* create a fake DTable, designed to always generate the same symbolValue */
+/******************************************
+*  FSE advanced functions
+******************************************/
+/*
+FSE_compress2():
+    Same as FSE_compress(), but allows the selection of 'maxSymbolValue' and 'tableLog'
+    Both parameters can be defined as '0' to mean : use default value
+    return : size of compressed data
+             or -1 if there is an error
+*/
+size_t FSE_compress2 (void* dst, size_t dstSize, const void* src, size_t srcSize, unsigned maxSymbolValue, unsigned tableLog);
 
 
 /******************************************
-*  FSE streaming API
+   FSE detailed API
 ******************************************/
-bitD_t FSE_readBitsFast(FSE_DStream_t* bitD, unsigned nbBits);
-/* faster, but works only if nbBits >= 1 (otherwise, result will be corrupted) */
+/*
+int FSE_compress(char* dest, const char* source, int inputSize) does the following:
+1. count symbol occurrence from source[] into table count[]
+2. normalize counters so that sum(count[]) == Power_of_2 (2^tableLog)
+3. save normalized counters to memory buffer using writeHeader()
+4. build encoding table 'CTable' from normalized counters
+5. encode the data stream using encoding table
 
-unsigned char FSE_decodeSymbolFast(FSE_DState_t* DStatePtr, FSE_DStream_t* bitD);
-/* faster, but works only if nbBits >= 1 (otherwise, result will be corrupted) */
+int FSE_decompress(char* dest, int originalSize, const char* compressed) performs:
+1. read normalized counters with readHeader()
+2. build decoding table 'DTable' from normalized counters
+3. decode the data stream using decoding table
 
-/* <<<<< fse_static.h EOF */
+The following API allows triggering specific sub-functions.
+*/
 
-/* >>>>> fse.c */
+/* *** COMPRESSION *** */
 
-#ifndef FSE_COMMONDEFS_ONLY
+size_t FSE_count(unsigned* count, const unsigned char* src, size_t srcSize, unsigned* maxSymbolValuePtr);
 
-/****************************************************************
-*  Tuning parameters
-****************************************************************/
-/* MEMORY_USAGE :
-*  Memory usage formula : N->2^N Bytes (examples : 10 -> 1KB; 12 -> 4KB ; 16 -> 64KB; 20 -> 1MB; etc.)
-*  Increasing memory usage improves compression ratio
-*  Reduced memory usage can improve speed, due to cache effect
-*  Recommended max value is 14, for 16KB, which nicely fits into Intel x86 L1 cache */
-#define FSE_MAX_MEMORY_USAGE 14
-#define FSE_DEFAULT_MEMORY_USAGE 13
+unsigned FSE_optimalTableLog(unsigned tableLog, size_t srcSize, unsigned maxSymbolValue);
+size_t FSE_normalizeCount(short* normalizedCounter, unsigned tableLog, const unsigned* count, size_t total, unsigned maxSymbolValue);
 
-/* FSE_MAX_SYMBOL_VALUE :
-*  Maximum symbol value authorized.
-*  Required for proper stack allocation */
-#define FSE_MAX_SYMBOL_VALUE 255
+size_t FSE_headerBound(unsigned maxSymbolValue, unsigned tableLog);
+size_t FSE_writeHeader (void* headerBuffer, size_t headerBufferSize, const short* normalizedCounter, unsigned maxSymbolValue, unsigned tableLog);
 
+void*  FSE_createCTable (unsigned tableLog, unsigned maxSymbolValue);
+void   FSE_freeCTable (void* CTable);
+size_t FSE_buildCTable(void* CTable, const short* normalizedCounter, unsigned maxSymbolValue, unsigned tableLog);
 
-/****************************************************************
-*  Generic function type & suffix (C template emulation)
-****************************************************************/
-#define FSE_FUNCTION_TYPE BYTE
-#define FSE_FUNCTION_EXTENSION
+size_t FSE_compress_usingCTable (void* dst, size_t dstSize, const void* src, size_t srcSize, const void* CTable);
 
-#endif   /* !FSE_COMMONDEFS_ONLY */
+/*
+The first step is to count all symbols. FSE_count() provides one quick way to do this job.
+Result will be saved into 'count', a table of unsigned int, which must be already allocated, and have '*maxSymbolValuePtr+1' cells.
+'source' is a table of char of size 'sourceSize'. All values within 'src' MUST be <= *maxSymbolValuePtr
+*maxSymbolValuePtr will be updated, with its real value (necessarily <= original value)
+FSE_count() will return the number of occurrence of the most frequent symbol.
+If there is an error, the function will return an ErrorCode (which can be tested using FSE_isError()).
 
+The next step is to normalize the frequencies.
+FSE_normalizeCount() will ensure that sum of frequencies is == 2 ^'tableLog'.
+It also guarantees a minimum of 1 to any Symbol which frequency is >= 1.
+You can use input 'tableLog'==0 to mean "use default tableLog value".
+If you are unsure of which tableLog value to use, you can optionally call FSE_optimalTableLog(),
+which will provide the optimal valid tableLog given sourceSize, maxSymbolValue, and a user-defined maximum (0 means "default").
 
-/****************************************************************
-*  Compiler specifics
-****************************************************************/
-#  define GCC_VERSION (__GNUC__ * 100 + __GNUC_MINOR__)
-#  ifdef __GNUC__
-#    define FORCE_INLINE static inline __attribute__((always_inline))
-#  else
-#    define FORCE_INLINE static inline
-#  endif
+The result of FSE_normalizeCount() will be saved into a table,
+called 'normalizedCounter', which is a table of signed short.
+'normalizedCounter' must be already allocated, and have at least 'maxSymbolValue+1' cells.
+The return value is tableLog if everything proceeded as expected.
+It is 0 if there is a single symbol within distribution.
+If there is an error(typically, invalid tableLog value), the function will return an ErrorCode (which can be tested using FSE_isError()).
 
-#ifndef MEM_ACCESS_MODULE
-#define MEM_ACCESS_MODULE
-/****************************************************************
-*  Basic Types
-*****************************************************************/
-#ifndef ZTYPES
-#define ZTYPES 1
+'normalizedCounter' can be saved in a compact manner to a memory area using FSE_writeHeader().
+'header' buffer must be already allocated.
+For guaranteed success, buffer size must be at least FSE_headerBound().
+The result of the function is the number of bytes written into 'header'.
+If there is an error, the function will return an ErrorCode (which can be tested using FSE_isError()) (for example, buffer size too small).
 
-#if defined (__STDC_VERSION__) && __STDC_VERSION__ >= 199901L   /* C99 */
-typedef  uint8_t BYTE;
-typedef uint16_t U16;
-typedef  int16_t S16;
-typedef uint32_t U32;
-typedef  int32_t S32;
-typedef uint64_t U64;
-typedef  int64_t S64;
-#else
-typedef unsigned char       BYTE;
-typedef unsigned short      U16;
-typedef   signed short      S16;
-typedef unsigned int        U32;
-typedef   signed int        S32;
-typedef unsigned long long  U64;
-typedef   signed long long  S64;
-#endif
+'normalizedCounter' can then be used to create the compression tables 'CTable'.
+The space required by 'CTable' must be already allocated. Its size is provided by FSE_sizeof_CTable().
+'CTable' must be aligned of 4 bytes boundaries.
+You can then use FSE_buildCTable() to fill 'CTable'.
+In both cases, if there is an error, the function will return an ErrorCode (which can be tested using FSE_isError()).
 
-#endif
+'CTable' can then be used to compress 'source', with FSE_compress_usingCTable().
+Similar to FSE_count(), the convention is that 'source' is assumed to be a table of char of size 'sourceSize'
+The function returns the size of compressed data (without header), or -1 if failed.
+*/
 
-#endif   /* MEM_ACCESS_MODULE */
 
-/****************************************************************
-*  Memory I/O
-*****************************************************************/
-static unsigned FSE_isLittleEndian(void)
-{
-    const union { U32 i; BYTE c[4]; } one = { 1 };   /* don't use static : performance detrimental  */
-    return one.c[0];
-}
+/* *** DECOMPRESSION *** */
 
-static U32 FSE_read32(const void* memPtr)
-{
-    U32 val32;
-    memcpy(&val32, memPtr, 4);
-    return val32;
-}
+size_t FSE_readHeader (short* normalizedCounter, unsigned* maxSymbolValuePtr, unsigned* tableLogPtr, const void* headerBuffer, size_t hbSize);
 
-static U32 FSE_readLE32(const void* memPtr)
-{
-    if (FSE_isLittleEndian())
-        return FSE_read32(memPtr);
-    else
-    {
-        const BYTE* p = (const BYTE*)memPtr;
-        return (U32)((U32)p[0] + ((U32)p[1]<<8) + ((U32)p[2]<<16) + ((U32)p[3]<<24));
-    }
-}
+void*  FSE_createDTable(unsigned tableLog);
+void   FSE_freeDTable(void* DTable);
+size_t FSE_buildDTable (void* DTable, const short* const normalizedCounter, unsigned maxSymbolValue, unsigned tableLog);
 
-static void FSE_writeLE32(void* memPtr, U32 val32)
-{
-    if (FSE_isLittleEndian())
-    {
-        memcpy(memPtr, &val32, 4);
-    }
-    else
-    {
-        BYTE* p = (BYTE*)memPtr;
-        p[0] = (BYTE)val32;
-        p[1] = (BYTE)(val32>>8);
-        p[2] = (BYTE)(val32>>16);
-        p[3] = (BYTE)(val32>>24);
-    }
-}
+size_t FSE_decompress_usingDTable(void* dst, size_t maxDstSize, const void* cSrc, size_t cSrcSize, const void* DTable, size_t fastMode);
 
-static U64 FSE_read64(const void* memPtr)
-{
-    U64 val64;
-    memcpy(&val64, memPtr, 8);
-    return val64;
-}
+/*
+If the block is RLE compressed, or uncompressed, use the relevant specific functions.
 
-static U64 FSE_readLE64(const void* memPtr)
-{
-    if (FSE_isLittleEndian())
-        return FSE_read64(memPtr);
-    else
-    {
-        const BYTE* p = (const BYTE*)memPtr;
-        return (U64)((U64)p[0] + ((U64)p[1]<<8) + ((U64)p[2]<<16) + ((U64)p[3]<<24)
-                     + ((U64)p[4]<<32) + ((U64)p[5]<<40) + ((U64)p[6]<<48) + ((U64)p[7]<<56));
-    }
-}
+The first step is to obtain the normalized frequencies of symbols.
+This can be performed by reading a header with FSE_readHeader().
+'normalizedCounter' must be already allocated, and have at least '*maxSymbolValuePtr+1' cells of short.
+In practice, that means it's necessary to know 'maxSymbolValue' beforehand,
+or size the table to handle worst case situations (typically 256).
+FSE_readHeader will provide 'tableLog' and 'maxSymbolValue' stored into the header.
+The result of FSE_readHeader() is the number of bytes read from 'header'.
+The following values have special meaning :
+return 2 : there is only a single symbol value. The value is provided into the second byte of header.
+return 1 : data is uncompressed
+If there is an error, the function will return an error code, which can be tested using FSE_isError().
 
-static void FSE_writeLE64(void* memPtr, U64 val64)
-{
-    if (FSE_isLittleEndian())
-    {
-        memcpy(memPtr, &val64, 8);
-    }
-    else
-    {
-        BYTE* p = (BYTE*)memPtr;
-        p[0] = (BYTE)val64;
-        p[1] = (BYTE)(val64>>8);
-        p[2] = (BYTE)(val64>>16);
-        p[3] = (BYTE)(val64>>24);
-        p[4] = (BYTE)(val64>>32);
-        p[5] = (BYTE)(val64>>40);
-        p[6] = (BYTE)(val64>>48);
-        p[7] = (BYTE)(val64>>56);
-    }
-}
+The next step is to create the decompression tables 'DTable' from 'normalizedCounter'.
+This is performed by the function FSE_buildDTable().
+The space required by 'DTable' must be already allocated and properly aligned.
+One can create a DTable using FSE_createDTable().
+The function will return 1 if DTable is compatible with fastMode, 0 otherwise.
+If there is an error, the function will return an error code, which can be tested using FSE_isError().
 
-static size_t FSE_readLEST(const void* memPtr)
-{
-    if (sizeof(size_t)==4)
-        return (size_t)FSE_readLE32(memPtr);
-    else
-        return (size_t)FSE_readLE64(memPtr);
-}
+'DTable' can then be used to decompress 'compressed', with FSE_decompress_usingDTable().
+Only trigger fastMode if it was authorized by result of FSE_buildDTable(), otherwise decompression will fail.
+cSrcSize must be correct, otherwise decompression will fail.
+FSE_decompress_usingDTable() result will tell how many bytes were regenerated.
+If there is an error, the function will return an error code, which can be tested using FSE_isError().
+*/
 
-static void FSE_writeLEST(void* memPtr, size_t val)
+
+/******************************************
+*  FSE streaming compression API
+******************************************/
+typedef struct
 {
-    if (sizeof(size_t)==4)
-        FSE_writeLE32(memPtr, (U32)val);
-    else
-        FSE_writeLE64(memPtr, (U64)val);
-}
+    size_t bitContainer;
+    int    bitPos;
+    char*  startPtr;
+    char*  ptr;
+} FSE_CStream_t;
 
+typedef struct
+{
+    ptrdiff_t   value;
+    const void* stateTable;
+    const void* symbolTT;
+    unsigned    stateLog;
+} FSE_CState_t;
 
-/****************************************************************
-*  Constants
-*****************************************************************/
-#define FSE_MAX_TABLELOG  (FSE_MAX_MEMORY_USAGE-2)
-#define FSE_MAX_TABLESIZE (1U<<FSE_MAX_TABLELOG)
-#define FSE_MAXTABLESIZE_MASK (FSE_MAX_TABLESIZE-1)
-#define FSE_DEFAULT_TABLELOG (FSE_DEFAULT_MEMORY_USAGE-2)
-#define FSE_MIN_TABLELOG 5
+void   FSE_initCStream(FSE_CStream_t* bitC, void* dstBuffer);
+void   FSE_initCState(FSE_CState_t* CStatePtr, const void* CTable);
 
-#define FSE_TABLELOG_ABSOLUTE_MAX 15
-#if FSE_MAX_TABLELOG > FSE_TABLELOG_ABSOLUTE_MAX
-#error "FSE_MAX_TABLELOG > FSE_TABLELOG_ABSOLUTE_MAX is not supported"
-#endif
+void   FSE_encodeByte(FSE_CStream_t* bitC, FSE_CState_t* CStatePtr, unsigned char symbol);
+void   FSE_addBits(FSE_CStream_t* bitC, size_t value, unsigned nbBits);
+void   FSE_flushBits(FSE_CStream_t* bitC);
 
+void   FSE_flushCState(FSE_CStream_t* bitC, const FSE_CState_t* CStatePtr);
+size_t FSE_closeCStream(FSE_CStream_t* bitC);
 
-/****************************************************************
-*  Error Management
-****************************************************************/
-#define FSE_STATIC_ASSERT(c) { enum { FSE_static_assert = 1/(int)(!!(c)) }; }   /* use only *after* variable declarations */
+/*
+These functions are inner components of FSE_compress_usingCTable().
+They allow creation of custom streams, mixing multiple tables and bit sources.
 
+A key property to keep in mind is that encoding and decoding are done **in reverse direction**.
+So the first symbol you will encode is the last you will decode, like a lifo stack.
 
-/****************************************************************
-*  Complex types
-****************************************************************/
-typedef struct
-{
-    int  deltaFindState;
-    U16  maxState;
-    BYTE minBitsOut;
-    /* one byte padding */
-} FSE_symbolCompressionTransform;
+You will need a few variables to track your CStream. They are :
 
-typedef struct
-{
-    U32 fakeTable[FSE_CTABLE_SIZE_U32(FSE_MAX_TABLELOG, FSE_MAX_SYMBOL_VALUE)];   /* compatible with FSE_compressU16() */
-} CTable_max_t;
+void* CTable;           // Provided by FSE_buildCTable()
+FSE_CStream_t bitC;     // bitStream tracking structure
+FSE_CState_t state;     // State tracking structure
 
 
-/****************************************************************
-*  Internal functions
-****************************************************************/
-FORCE_INLINE unsigned FSE_highbit32 (register U32 val)
-{
-#   if defined(_MSC_VER)   /* Visual */
-    unsigned long r;
-    _BitScanReverse ( &r, val );
-    return (unsigned) r;
-#   elif defined(__GNUC__) && (GCC_VERSION >= 304)   /* GCC Intrinsic */
-    return 31 - __builtin_clz (val);
-#   else   /* Software version */
-    static const unsigned DeBruijnClz[32] = { 0, 9, 1, 10, 13, 21, 2, 29, 11, 14, 16, 18, 22, 25, 3, 30, 8, 12, 20, 28, 15, 17, 24, 7, 19, 27, 23, 6, 26, 5, 4, 31 };
-    U32 v = val;
-    unsigned r;
-    v |= v >> 1;
-    v |= v >> 2;
-    v |= v >> 4;
-    v |= v >> 8;
-    v |= v >> 16;
-    r = DeBruijnClz[ (U32) (v * 0x07C4ACDDU) >> 27];
-    return r;
-#   endif
-}
+The first thing to do is to init the bitStream, and the state.
+    FSE_initCStream(&bitC, dstBuffer);
+    FSE_initState(&state, CTable);
 
+You can then encode your input data, byte after byte.
+FSE_encodeByte() outputs a maximum of 'tableLog' bits at a time.
+Remember decoding will be done in reverse direction.
+    FSE_encodeByte(&bitStream, &state, symbol);
 
-#ifndef FSE_COMMONDEFS_ONLY
+At any time, you can add any bit sequence.
+Note : maximum allowed nbBits is 25, for compatibility with 32-bits decoders
+    FSE_addBits(&bitStream, bitField, nbBits);
 
-unsigned FSE_isError(size_t code) { return (code > (size_t)(-FSE_ERROR_maxCode)); }
+The above methods don't commit data to memory, they just store it into local register, for speed.
+Local register size is 64-bits on 64-bits systems, 32-bits on 32-bits systems (size_t).
+Writing data to memory is a manual operation, performed by the flushBits function.
+    FSE_flushBits(&bitStream);
 
-#define FSE_GENERATE_STRING(STRING) #STRING,
-static const char* FSE_errorStrings[] = { FSE_LIST_ERRORS(FSE_GENERATE_STRING) };
+Your last FSE encoding operation shall be to flush your last state value(s).
+    FSE_flushState(&bitStream, &state);
 
-const char* FSE_getErrorName(size_t code)
-{
-    static const char* codeError = "Unspecified error code";
-    if (FSE_isError(code)) return FSE_errorStrings[-(int)(code)];
-    return codeError;
-}
+You must then close the bitStream if you opened it with FSE_initCStream().
+It's possible to embed some user-info into the header, as an optionalId [0-31].
+The function returns the size in bytes of CStream.
+If there is an error, it returns an errorCode (which can be tested using FSE_isError()).
+    size_t size = FSE_closeCStream(&bitStream, optionalId);
+*/
 
-static short FSE_abs(short a)
-{
-    return a<0? -a : a;
-}
 
+/******************************************
+*  FSE streaming decompression API
+******************************************/
+//typedef unsigned int bitD_t;
+typedef size_t bitD_t;
 
-/****************************************************************
-*  Header bitstream management
-****************************************************************/
-size_t FSE_headerBound(unsigned maxSymbolValue, unsigned tableLog)
+typedef struct
 {
-    size_t maxHeaderSize = (((maxSymbolValue+1) * tableLog) >> 3) + 1;
-    return maxSymbolValue ? maxHeaderSize : FSE_MAX_HEADERSIZE;
-}
+    bitD_t   bitContainer;
+    unsigned bitsConsumed;
+    const char* ptr;
+    const char* start;
+} FSE_DStream_t;
 
-static size_t FSE_writeHeader_generic (void* header, size_t headerBufferSize,
-                                       const short* normalizedCounter, unsigned maxSymbolValue, unsigned tableLog,
-                                       unsigned safeWrite)
+typedef struct
 {
-    BYTE* const ostart = (BYTE*) header;
-    BYTE* out = ostart;
-    BYTE* const oend = ostart + headerBufferSize;
-    int nbBits;
-    const int tableSize = 1 << tableLog;
-    int remaining;
-    int threshold;
-    U32 bitStream;
-    int bitCount;
-    unsigned charnum = 0;
-    int previous0 = 0;
+    bitD_t      state;
+    const void* table;
+} FSE_DState_t;
 
-    bitStream = 0;
-    bitCount  = 0;
-    /* Table Size */
-    bitStream += (tableLog-FSE_MIN_TABLELOG) << bitCount;
-    bitCount  += 4;
 
-    /* Init */
-    remaining = tableSize+1;   /* +1 for extra accuracy */
-    threshold = tableSize;
-    nbBits = tableLog+1;
+size_t FSE_initDStream(FSE_DStream_t* bitD, const void* srcBuffer, size_t srcSize);
+void   FSE_initDState(FSE_DState_t* DStatePtr, FSE_DStream_t* bitD, const void* DTable);
 
-    while (remaining>1)   /* stops at 1 */
-    {
-        if (previous0)
-        {
-            unsigned start = charnum;
-            while (!normalizedCounter[charnum]) charnum++;
-            while (charnum >= start+24)
-            {
-                start+=24;
-                bitStream += 0xFFFF<<bitCount;
-                if ((!safeWrite) && (out > oend-2)) return (size_t)-FSE_ERROR_GENERIC;   /* Buffer overflow */
-                out[0] = (BYTE)bitStream;
-                out[1] = (BYTE)(bitStream>>8);
-                out+=2;
-                bitStream>>=16;
-            }
-            while (charnum >= start+3)
-            {
-                start+=3;
-                bitStream += 3 << bitCount;
-                bitCount += 2;
-            }
-            bitStream += (charnum-start) << bitCount;
-            bitCount += 2;
-            if (bitCount>16)
-            {
-                if ((!safeWrite) && (out > oend - 2)) return (size_t)-FSE_ERROR_GENERIC;   /* Buffer overflow */
-                out[0] = (BYTE)bitStream;
-                out[1] = (BYTE)(bitStream>>8);
-                out += 2;
-                bitStream >>= 16;
-                bitCount -= 16;
-            }
-        }
-        {
-            short count = normalizedCounter[charnum++];
-            const short max = (short)((2*threshold-1)-remaining);
-            remaining -= FSE_abs(count);
-            if (remaining<0) return (size_t)-FSE_ERROR_GENERIC;
-            count++;   /* +1 for extra accuracy */
-            if (count>=threshold) count += max;   /* [0..max[ [max..threshold[ (...) [threshold+max 2*threshold[ */
-            bitStream += count << bitCount;
-            bitCount  += nbBits;
-            bitCount  -= (count<max);
-            previous0 = (count==1);
-            while (remaining<threshold) nbBits--, threshold>>=1;
-        }
-        if (bitCount>16)
-        {
-            if ((!safeWrite) && (out > oend - 2)) return (size_t)-FSE_ERROR_GENERIC;   /* Buffer overflow */
-            out[0] = (BYTE)bitStream;
-            out[1] = (BYTE)(bitStream>>8);
-            out += 2;
-            bitStream >>= 16;
-            bitCount -= 16;
-        }
-    }
+unsigned char FSE_decodeSymbol(FSE_DState_t* DStatePtr, FSE_DStream_t* bitD);
+bitD_t        FSE_readBits(FSE_DStream_t* bitD, unsigned nbBits);
+unsigned int  FSE_reloadDStream(FSE_DStream_t* bitD);
 
-    /* flush remaining bitStream */
-    if ((!safeWrite) && (out > oend - 2)) return (size_t)-FSE_ERROR_GENERIC;   /* Buffer overflow */
-    out[0] = (BYTE)bitStream;
-    out[1] = (BYTE)(bitStream>>8);
-    out+= (bitCount+7) /8;
+unsigned FSE_endOfDStream(const FSE_DStream_t* bitD);
+unsigned FSE_endOfDState(const FSE_DState_t* DStatePtr);
 
-    if (charnum > maxSymbolValue + 1) return (size_t)-FSE_ERROR_GENERIC;   /* Too many symbols written (a bit too late?) */
+/*
+Let's now decompose FSE_decompress_usingDTable() into its unitary elements.
+You will decode FSE-encoded symbols from the bitStream,
+and also any other bitFields you put in, **in reverse order**.
 
-    return (out-ostart);
-}
+You will need a few variables to track your bitStream. They are :
 
+FSE_DStream_t DStream;    // Stream context
+FSE_DState_t DState;      // State context. Multiple ones are possible
+const void* DTable;       // Decoding table, provided by FSE_buildDTable()
+U32 tableLog;             // Provided by FSE_readHeader()
 
-size_t FSE_writeHeader (void* header, size_t headerBufferSize, const short* normalizedCounter, unsigned maxSymbolValue, unsigned tableLog)
-{
-    if (tableLog > FSE_MAX_TABLELOG) return (size_t)-FSE_ERROR_GENERIC;   /* Unsupported */
-    if (tableLog < FSE_MIN_TABLELOG) return (size_t)-FSE_ERROR_GENERIC;   /* Unsupported */
-
-    if (headerBufferSize < FSE_headerBound(maxSymbolValue, tableLog))
-        return FSE_writeHeader_generic(header, headerBufferSize, normalizedCounter, maxSymbolValue, tableLog, 0);
-
-    return FSE_writeHeader_generic(header, headerBufferSize, normalizedCounter, maxSymbolValue, tableLog, 1);
-}
+The first thing to do is to init the bitStream.
+    errorCode = FSE_initDStream(&DStream, &optionalId, srcBuffer, srcSize);
 
+You should then retrieve your initial state(s) (multiple ones are possible) :
+    errorCode = FSE_initDState(&DState, &DStream, DTable, tableLog);
 
-size_t FSE_readHeader (short* normalizedCounter, unsigned* maxSVPtr, unsigned* tableLogPtr,
-                 const void* headerBuffer, size_t hbSize)
-{
-    const BYTE* const istart = (const BYTE*) headerBuffer;
-    const BYTE* ip = istart;
-    int nbBits;
-    int remaining;
-    int threshold;
-    U32 bitStream;
-    int bitCount;
-    unsigned charnum = 0;
-    int previous0 = 0;
+You can then decode your data, symbol after symbol.
+For information the maximum number of bits read by FSE_decodeSymbol() is 'tableLog'.
+Keep in mind that symbols are decoded in reverse order, like a lifo stack (last in, first out).
+    unsigned char symbol = FSE_decodeSymbol(&DState, &DStream);
 
-    bitStream = FSE_readLE32(ip);
-    nbBits = (bitStream & 0xF) + FSE_MIN_TABLELOG;   /* extract tableLog */
-    if (nbBits > FSE_TABLELOG_ABSOLUTE_MAX) return (size_t)-FSE_ERROR_tableLog_tooLarge;
-    bitStream >>= 4;
-    bitCount = 4;
-    *tableLogPtr = nbBits;
-    remaining = (1<<nbBits)+1;
-    threshold = 1<<nbBits;
-    nbBits++;
+You can retrieve any bitfield you eventually stored into the bitStream (in reverse order)
+Note : maximum allowed nbBits is 25
+    unsigned int bitField = FSE_readBits(&DStream, nbBits);
 
-    while ((remaining>1) && (charnum<=*maxSVPtr))
-    {
-        if (previous0)
-        {
-            unsigned n0 = charnum;
-            while ((bitStream & 0xFFFF) == 0xFFFF)
-            {
-                n0+=24;
-                ip+=2;
-                bitStream = FSE_readLE32(ip) >> bitCount;
-            }
-            while ((bitStream & 3) == 3)
-            {
-                n0+=3;
-                bitStream>>=2;
-                bitCount+=2;
-            }
-            n0 += bitStream & 3;
-            bitCount += 2;
-            if (n0 > *maxSVPtr) return (size_t)-FSE_ERROR_GENERIC;
-            while (charnum < n0) normalizedCounter[charnum++] = 0;
-            ip += bitCount>>3;
-            bitCount &= 7;
-            bitStream = FSE_readLE32(ip) >> bitCount;
-        }
-        {
-            const short max = (short)((2*threshold-1)-remaining);
-            short count;
+All above operations only read from local register (which size is controlled by bitD_t==32 bits).
+Reading data from memory is manually performed by the reload method.
+    endSignal = FSE_reloadDStream(&DStream);
 
-            if ((bitStream & (threshold-1)) < (U32)max)
-            {
-                count = (short)(bitStream & (threshold-1));
-                bitCount   += nbBits-1;
-            }
-            else
-            {
-                count = (short)(bitStream & (2*threshold-1));
-                if (count >= threshold) count -= max;
-                bitCount   += nbBits;
-            }
+FSE_reloadDStream() result tells if there is still some more data to read from DStream.
+0 : there is still some data left into the DStream.
+1 Dstream reached end of buffer, but is not yet fully extracted. It will not load data from memory any more.
+2 Dstream reached its exact end, corresponding in general to decompression completed.
+3 Dstream went too far. Decompression result is corrupted.
 
-            count--;   /* extra accuracy */
-            remaining -= FSE_abs(count);
-            normalizedCounter[charnum++] = count;
-            previous0 = !count;
-            while (remaining < threshold)
-            {
-                nbBits--;
-                threshold >>= 1;
-            }
+When reaching end of buffer(1), progress slowly if you decode multiple symbols per loop,
+to properly detect the exact end of stream.
+After each decoded symbol, check if DStream is fully consumed using this simple test :
+    FSE_reloadDStream(&DStream) >= 2
 
-            ip += bitCount>>3;
-            bitCount &= 7;
-            bitStream = FSE_readLE32(ip) >> bitCount;
-        }
-    }
-    if (remaining != 1) return (size_t)-FSE_ERROR_GENERIC;
-    *maxSVPtr = charnum-1;
+When it's done, verify decompression is fully completed, by checking both DStream and the relevant states.
+Checking if DStream has reached its end is performed by :
+    FSE_endOfDStream(&DStream);
+Check also the states. There might be some entropy left there, still able to decode some high probability symbol.
+    FSE_endOfDState(&DState);
+*/
 
-    ip += bitCount>0;
-    if ((size_t)(ip-istart) >= hbSize) return (size_t)-FSE_ERROR_srcSize_wrong;   /* arguably a bit late , tbd */
-    return ip-istart;
-}
+/* <<<<< fse.h EOF */
 
 
-/****************************************************************
-*  FSE Compression Code
-****************************************************************/
-/*
-CTable is a variable size structure which contains :
-    U16 tableLog;
-    U16 maxSymbolValue;
-    U16 nextStateNumber[1 << tableLog];                         // This size is variable
-    FSE_symbolCompressionTransform symbolTT[maxSymbolValue+1];  // This size is variable
-Allocation is manual, since C standard does not support variable-size structures.
-*/
+/* >>>>> fse_static.h */
 
-size_t FSE_sizeof_CTable (unsigned maxSymbolValue, unsigned tableLog)
-{
-    size_t size;
-    FSE_STATIC_ASSERT((size_t)FSE_CTABLE_SIZE_U32(FSE_MAX_TABLELOG, FSE_MAX_SYMBOL_VALUE)*4 >= sizeof(CTable_max_t));   /* A compilation error here means FSE_CTABLE_SIZE_U32 is not large enough */
-    if (tableLog > FSE_MAX_TABLELOG) return (size_t)-FSE_ERROR_GENERIC;
-    size = FSE_CTABLE_SIZE_U32 (tableLog, maxSymbolValue) * sizeof(U32);
-    return size;
-}
+/******************************************
+*  Tool functions
+******************************************/
+#define FSE_MAX_HEADERSIZE 512
+#define FSE_COMPRESSBOUND(size) (size + (size>>7) + FSE_MAX_HEADERSIZE)   /* Macro can be useful for static allocation */
 
-void* FSE_createCTable (unsigned maxSymbolValue, unsigned tableLog)
-{
-    size_t size;
-    if (tableLog > FSE_TABLELOG_ABSOLUTE_MAX) tableLog = FSE_TABLELOG_ABSOLUTE_MAX;
-    size = FSE_CTABLE_SIZE_U32 (tableLog, maxSymbolValue) * sizeof(U32);
-    return malloc(size);
-}
 
-void  FSE_freeCTable (void* CTable)
-{
-    free(CTable);
-}
+/******************************************
+*  Static allocation
+******************************************/
+/* You can statically allocate a CTable as a table of U32 using below macro */
+#define FSE_CTABLE_SIZE_U32(maxTableLog, maxSymbolValue)   (1 + (1<<(maxTableLog-1)) + ((maxSymbolValue+1)*2))
+#define FSE_DTABLE_SIZE_U32(maxTableLog)                   ((1<<maxTableLog)+1)
 
+/******************************************
+*  Error Management
+******************************************/
+#define FSE_LIST_ERRORS(ITEM) \
+        ITEM(FSE_OK_NoError) ITEM(FSE_ERROR_GENERIC) \
+        ITEM(FSE_ERROR_tableLog_tooLarge) ITEM(FSE_ERROR_maxSymbolValue_tooLarge) \
+        ITEM(FSE_ERROR_dstSize_tooSmall) ITEM(FSE_ERROR_srcSize_wrong)\
+        ITEM(FSE_ERROR_corruptionDetected) \
+        ITEM(FSE_ERROR_maxCode)
 
-unsigned FSE_optimalTableLog(unsigned maxTableLog, size_t srcSize, unsigned maxSymbolValue)
-{
-    U32 tableLog = maxTableLog;
-    if (tableLog==0) tableLog = FSE_DEFAULT_TABLELOG;
-    if ((FSE_highbit32((U32)(srcSize - 1)) - 2) < tableLog) tableLog = FSE_highbit32((U32)(srcSize - 1)) - 2;   /* Accuracy can be reduced */
-    if ((FSE_highbit32(maxSymbolValue+1)+1) > tableLog) tableLog = FSE_highbit32(maxSymbolValue+1)+1;   /* Need a minimum to safely represent all symbol values */
-    if (tableLog < FSE_MIN_TABLELOG) tableLog = FSE_MIN_TABLELOG;
-    if (tableLog > FSE_MAX_TABLELOG) tableLog = FSE_MAX_TABLELOG;
-    return tableLog;
-}
+#define FSE_GENERATE_ENUM(ENUM) ENUM,
+typedef enum { FSE_LIST_ERRORS(FSE_GENERATE_ENUM) } FSE_errorCodes;  /* enum is exposed, to detect & handle specific errors; compare function result to -enum value */
 
 
-typedef struct
-{
-    U32 id;
-    U32 count;
-} rank_t;
+/******************************************
+*  FSE advanced API
+******************************************/
+size_t FSE_countFast(unsigned* count, const unsigned char* src, size_t srcSize, unsigned* maxSymbolValuePtr);
+/* same as FSE_count(), but won't check if input really respect that all values within src are <= *maxSymbolValuePtr */
 
-int FSE_compareRankT(const void* r1, const void* r2)
-{
-    const rank_t* R1 = (const rank_t*)r1;
-    const rank_t* R2 = (const rank_t*)r2;
+size_t FSE_buildCTable_raw (void* CTable, unsigned nbBits);
+/* create a fake CTable, designed to not compress an input where each element uses nbBits */
 
-    return 2 * (R1->count < R2->count) - 1;
-}
+size_t FSE_buildCTable_rle (void* CTable, unsigned char symbolValue);
+/* create a fake CTable, designed to compress a single identical value */
 
+size_t FSE_buildDTable_raw (void* DTable, unsigned nbBits);
+/* create a fake DTable, designed to read an uncompressed bitstream where each element uses nbBits */
 
-#if 0
-static size_t FSE_adjustNormSlow(short* norm, int pointsToRemove, const unsigned* count, U32 maxSymbolValue)
-{
-    rank_t rank[FSE_MAX_SYMBOL_VALUE+2];
-    U32 s;
+size_t FSE_buildDTable_rle (void* DTable, unsigned char symbolValue);
+/* create a fake DTable, designed to always generate the same symbolValue */
 
-    /* Init */
-    for (s=0; s<=maxSymbolValue; s++)
-    {
-        rank[s].id = s;
-        rank[s].count = count[s];
-        if (norm[s] <= 1) rank[s].count = 0;
-    }
-    rank[maxSymbolValue+1].id = 0;
-    rank[maxSymbolValue+1].count = 0;   /* ensures comparison ends here in worst case */
 
-    /* Sort according to count */
-    qsort(rank, maxSymbolValue+1, sizeof(rank_t), FSE_compareRankT);
+/******************************************
+*  FSE streaming API
+******************************************/
+bitD_t FSE_readBitsFast(FSE_DStream_t* bitD, unsigned nbBits);
+/* faster, but works only if nbBits >= 1 (otherwise, result will be corrupted) */
 
-    while(pointsToRemove)
-    {
-        int newRank = 1;
-        rank_t savedR;
-        if (norm[rank[0].id] == 1)
-            return (size_t)-FSE_ERROR_GENERIC;
-        norm[rank[0].id]--;
-        pointsToRemove--;
-        rank[0].count -= (rank[0].count + 6) >> 3;
-        if (norm[rank[0].id] == 1)
-            rank[0].count=0;
-        savedR = rank[0];
-        while (rank[newRank].count > savedR.count)
-        {
-            rank[newRank-1] = rank[newRank];
-            newRank++;
-        }
-        rank[newRank-1] = savedR;
-    }
+unsigned char FSE_decodeSymbolFast(FSE_DState_t* DStatePtr, FSE_DStream_t* bitD);
+/* faster, but works only if nbBits >= 1 (otherwise, result will be corrupted) */
 
-    return 0;
-}
+/* <<<<< fse_static.h EOF */
 
-#else
+/* >>>>> fse.c */
 
-/* Secondary normalization method.
-   To be used when primary method fails. */
+#ifndef FSE_COMMONDEFS_ONLY
 
-static size_t FSE_normalizeM2(short* norm, U32 tableLog, const unsigned* count, size_t total, U32 maxSymbolValue)
+/****************************************************************
+*  Tuning parameters
+****************************************************************/
+/* MEMORY_USAGE :
+*  Memory usage formula : N->2^N Bytes (examples : 10 -> 1KB; 12 -> 4KB ; 16 -> 64KB; 20 -> 1MB; etc.)
+*  Increasing memory usage improves compression ratio
+*  Reduced memory usage can improve speed, due to cache effect
+*  Recommended max value is 14, for 16KB, which nicely fits into Intel x86 L1 cache */
+#define FSE_MAX_MEMORY_USAGE 14
+#define FSE_DEFAULT_MEMORY_USAGE 13
+
+/* FSE_MAX_SYMBOL_VALUE :
+*  Maximum symbol value authorized.
+*  Required for proper stack allocation */
+#define FSE_MAX_SYMBOL_VALUE 255
+
+
+/****************************************************************
+*  Generic function type & suffix (C template emulation)
+****************************************************************/
+#define FSE_FUNCTION_TYPE BYTE
+#define FSE_FUNCTION_EXTENSION
+
+#endif   /* !FSE_COMMONDEFS_ONLY */
+
+
+/****************************************************************
+*  Compiler specifics
+****************************************************************/
+#  define GCC_VERSION (__GNUC__ * 100 + __GNUC_MINOR__)
+#  ifdef __GNUC__
+#    define FORCE_INLINE static inline __attribute__((always_inline))
+#  else
+#    define FORCE_INLINE static inline
+#  endif
+
+#ifndef MEM_ACCESS_MODULE
+#define MEM_ACCESS_MODULE
+/****************************************************************
+*  Basic Types
+*****************************************************************/
+#ifndef ZTYPES
+#define ZTYPES 1
+
+#if defined (__STDC_VERSION__) && __STDC_VERSION__ >= 199901L   /* C99 */
+typedef  uint8_t BYTE;
+typedef uint16_t U16;
+typedef  int16_t S16;
+typedef uint32_t U32;
+typedef  int32_t S32;
+typedef uint64_t U64;
+typedef  int64_t S64;
+#else
+typedef unsigned char       BYTE;
+typedef unsigned short      U16;
+typedef   signed short      S16;
+typedef unsigned int        U32;
+typedef   signed int        S32;
+typedef unsigned long long  U64;
+typedef   signed long long  S64;
+#endif
+
+#endif
+
+#endif   /* MEM_ACCESS_MODULE */
+
+/****************************************************************
+*  Memory I/O
+*****************************************************************/
+static unsigned FSE_isLittleEndian(void)
 {
-    U32 s;
-    U32 distributed = 0;
-    U32 ToDistribute;
+    const union { U32 i; BYTE c[4]; } one = { 1 };   /* don't use static : performance detrimental  */
+    return one.c[0];
+}
 
-    /* Init */
-    U32 lowThreshold = (U32)(total >> tableLog);
-    U32 lowOne = (U32)((total * 3) >> (tableLog + 1));
+static U32 FSE_read32(const void* memPtr)
+{
+    U32 val32;
+    memcpy(&val32, memPtr, 4);
+    return val32;
+}
 
-    for (s=0; s<=maxSymbolValue; s++)
+static U32 FSE_readLE32(const void* memPtr)
+{
+    if (FSE_isLittleEndian())
+        return FSE_read32(memPtr);
+    else
     {
-        if (count[s] == 0)
-        {
-            norm[s]=0;
-            continue;
-        }
-        if (count[s] <= lowThreshold)
-        {
-            norm[s] = -1;
-            distributed++;
-            total -= count[s];
-            continue;
-        }
-        if (count[s] <= lowOne)
-        {
-            norm[s] = 1;
-            distributed++;
-            total -= count[s];
-            continue;
-        }
-        norm[s]=-2;
+        const BYTE* p = (const BYTE*)memPtr;
+        return (U32)((U32)p[0] + ((U32)p[1]<<8) + ((U32)p[2]<<16) + ((U32)p[3]<<24));
     }
-    ToDistribute = (1 << tableLog) - distributed;
+}
 
-    if ((total / ToDistribute) > lowOne)
+static void FSE_writeLE32(void* memPtr, U32 val32)
+{
+    if (FSE_isLittleEndian())
     {
-        /* risk of rounding to zero */
-        lowOne = (U32)((total * 3) / (ToDistribute * 2));
-        for (s=0; s<=maxSymbolValue; s++)
-        {
-            if ((norm[s] == -2) && (count[s] <= lowOne))
-            {
-                norm[s] = 1;
-                distributed++;
-                total -= count[s];
-                continue;
-            }
-        }
-        ToDistribute = (1 << tableLog) - distributed;
+        memcpy(memPtr, &val32, 4);
+    }
+    else
+    {
+        BYTE* p = (BYTE*)memPtr;
+        p[0] = (BYTE)val32;
+        p[1] = (BYTE)(val32>>8);
+        p[2] = (BYTE)(val32>>16);
+        p[3] = (BYTE)(val32>>24);
     }
+}
 
-    if (distributed == maxSymbolValue+1)
+static U64 FSE_read64(const void* memPtr)
+{
+    U64 val64;
+    memcpy(&val64, memPtr, 8);
+    return val64;
+}
+
+static U64 FSE_readLE64(const void* memPtr)
+{
+    if (FSE_isLittleEndian())
+        return FSE_read64(memPtr);
+    else
     {
-        /* all values are pretty poor;
-           probably incompressible data (should have already been detected);
-           find max, then give all remaining points to max */
-        U32 maxV = 0, maxC =0;
-        for (s=0; s<=maxSymbolValue; s++)
-            if (count[s] > maxC) maxV=s, maxC=count[s];
-        norm[maxV] += ToDistribute;
-        return 0;
+        const BYTE* p = (const BYTE*)memPtr;
+        return (U64)((U64)p[0] + ((U64)p[1]<<8) + ((U64)p[2]<<16) + ((U64)p[3]<<24)
+                     + ((U64)p[4]<<32) + ((U64)p[5]<<40) + ((U64)p[6]<<48) + ((U64)p[7]<<56));
     }
+}
 
+static void FSE_writeLE64(void* memPtr, U64 val64)
+{
+    if (FSE_isLittleEndian())
     {
-        U64 const vStepLog = 62 - tableLog;
-        U64 const mid = (1ULL << (vStepLog-1)) - 1;
-        U64 const rStep = ((((U64)1<<vStepLog) * ToDistribute) + mid) / total;   /* scale on remaining */
-        U64 tmpTotal = mid;
-        for (s=0; s<=maxSymbolValue; s++)
-        {
-            if (norm[s]==-2)
-            {
-                U64 end = tmpTotal + (count[s] * rStep);
-                U32 sStart = (U32)(tmpTotal >> vStepLog);
-                U32 sEnd = (U32)(end >> vStepLog);
-                U32 weight = sEnd - sStart;
-                if (weight < 1)
-                    return (size_t)-FSE_ERROR_GENERIC;
-                norm[s] = weight;
-                tmpTotal = end;
-            }
-        }
+        memcpy(memPtr, &val64, 8);
+    }
+    else
+    {
+        BYTE* p = (BYTE*)memPtr;
+        p[0] = (BYTE)val64;
+        p[1] = (BYTE)(val64>>8);
+        p[2] = (BYTE)(val64>>16);
+        p[3] = (BYTE)(val64>>24);
+        p[4] = (BYTE)(val64>>32);
+        p[5] = (BYTE)(val64>>40);
+        p[6] = (BYTE)(val64>>48);
+        p[7] = (BYTE)(val64>>56);
     }
+}
 
-    return 0;
+static size_t FSE_readLEST(const void* memPtr)
+{
+    if (sizeof(size_t)==4)
+        return (size_t)FSE_readLE32(memPtr);
+    else
+        return (size_t)FSE_readLE64(memPtr);
+}
+
+static void FSE_writeLEST(void* memPtr, size_t val)
+{
+    if (sizeof(size_t)==4)
+        FSE_writeLE32(memPtr, (U32)val);
+    else
+        FSE_writeLE64(memPtr, (U64)val);
 }
+
+
+/****************************************************************
+*  Constants
+*****************************************************************/
+#define FSE_MAX_TABLELOG  (FSE_MAX_MEMORY_USAGE-2)
+#define FSE_MAX_TABLESIZE (1U<<FSE_MAX_TABLELOG)
+#define FSE_MAXTABLESIZE_MASK (FSE_MAX_TABLESIZE-1)
+#define FSE_DEFAULT_TABLELOG (FSE_DEFAULT_MEMORY_USAGE-2)
+#define FSE_MIN_TABLELOG 5
+
+#define FSE_TABLELOG_ABSOLUTE_MAX 15
+#if FSE_MAX_TABLELOG > FSE_TABLELOG_ABSOLUTE_MAX
+#error "FSE_MAX_TABLELOG > FSE_TABLELOG_ABSOLUTE_MAX is not supported"
 #endif
 
 
-size_t FSE_normalizeCount (short* normalizedCounter, unsigned tableLog,
-                           const unsigned* count, size_t total,
-                           unsigned maxSymbolValue)
-{
-    /* Sanity checks */
-    if (tableLog==0) tableLog = FSE_DEFAULT_TABLELOG;
-    if (tableLog < FSE_MIN_TABLELOG) return (size_t)-FSE_ERROR_GENERIC;   /* Unsupported size */
-    if (tableLog > FSE_MAX_TABLELOG) return (size_t)-FSE_ERROR_GENERIC;   /* Unsupported size */
-    if ((1U<<tableLog) <= maxSymbolValue) return (size_t)-FSE_ERROR_GENERIC;   /* Too small tableLog, compression potentially impossible */
+/****************************************************************
+*  Error Management
+****************************************************************/
+#define FSE_STATIC_ASSERT(c) { enum { FSE_static_assert = 1/(int)(!!(c)) }; }   /* use only *after* variable declarations */
 
-    {
-        U32 const rtbTable[] = {     0, 473195, 504333, 520860, 550000, 700000, 750000, 830000 };
-        U64 const scale = 62 - tableLog;
-        U64 const step = ((U64)1<<62) / total;   /* <== here, one division ! */
-        U64 const vStep = 1ULL<<(scale-20);
-        int stillToDistribute = 1<<tableLog;
-        unsigned s;
-        unsigned largest=0;
-        short largestP=0;
-        U32 lowThreshold = (U32)(total >> tableLog);
 
-        for (s=0; s<=maxSymbolValue; s++)
-        {
-            if (count[s] == total) return 0;
-            if (count[s] == 0)
-            {
-                normalizedCounter[s]=0;
-                continue;
-            }
-            if (count[s] <= lowThreshold)
-            {
-                normalizedCounter[s] = -1;
-                stillToDistribute--;
-            }
-            else
-            {
-                short proba = (short)((count[s]*step) >> scale);
-                if (proba<8)
-                {
-                    U64 restToBeat = vStep * rtbTable[proba];
-                    proba += (count[s]*step) - ((U64)proba<<scale) > restToBeat;
-                }
-                if (proba > largestP)
-                {
-                    largestP=proba;
-                    largest=s;
-                }
-                normalizedCounter[s] = proba;
-                stillToDistribute -= proba;
-            }
-        }
-        if (-stillToDistribute >= (normalizedCounter[largest] >> 1))
-        {
-            /* corner case, need another normalization method */
-            size_t errorCode = FSE_normalizeM2(normalizedCounter, tableLog, count, total, maxSymbolValue);
-            if (FSE_isError(errorCode)) return errorCode;
-        }
-        else normalizedCounter[largest] += (short)stillToDistribute;
-    }
-
-#if 0
-    {   /* Print Table (debug) */
-        U32 s;
-        U32 nTotal = 0;
-        for (s=0; s<=maxSymbolValue; s++)
-            printf("%3i: %4i \n", s, normalizedCounter[s]);
-        for (s=0; s<=maxSymbolValue; s++)
-            nTotal += abs(normalizedCounter[s]);
-        if (nTotal != (1U<<tableLog))
-            printf("Warning !!! Total == %u != %u !!!", nTotal, 1U<<tableLog);
-        getchar();
-    }
-#endif
-
-    return tableLog;
-}
-
-
-/* fake CTable, for raw (uncompressed) input */
-size_t FSE_buildCTable_raw (void* CTable, unsigned nbBits)
+/****************************************************************
+*  Complex types
+****************************************************************/
+typedef struct
 {
-    const unsigned tableSize = 1 << nbBits;
-    const unsigned tableMask = tableSize - 1;
-    const unsigned maxSymbolValue = tableMask;
-    U16* tableU16 = ( (U16*) CTable) + 2;
-    FSE_symbolCompressionTransform* symbolTT = (FSE_symbolCompressionTransform*) ((((U32*)CTable)+1) + (tableSize>>1));
-    unsigned s;
-
-    /* Sanity checks */
-    if (nbBits < 1) return (size_t)-FSE_ERROR_GENERIC;             /* min size */
-    if (((size_t)CTable) & 3) return (size_t)-FSE_ERROR_GENERIC;   /* Must be allocated of 4 bytes boundaries */
-
-    /* header */
-    tableU16[-2] = (U16) nbBits;
-    tableU16[-1] = (U16) maxSymbolValue;
-
-    /* Build table */
-    for (s=0; s<tableSize; s++)
-        tableU16[s] = (U16)(tableSize + s);
-
-    /* Build Symbol Transformation Table */
-    for (s=0; s<=maxSymbolValue; s++)
-    {
-        symbolTT[s].minBitsOut = (BYTE)nbBits;
-        symbolTT[s].deltaFindState = s-1;
-        symbolTT[s].maxState = (U16)( (tableSize*2) - 1);   /* ensures state <= maxState */
-    }
-
-    return 0;
-}
-
+    int  deltaFindState;
+    U16  maxState;
+    BYTE minBitsOut;
+    /* one byte padding */
+} FSE_symbolCompressionTransform;
 
-/* fake CTable, for rle (100% always same symbol) input */
-size_t FSE_buildCTable_rle (void* CTable, BYTE symbolValue)
+typedef struct
 {
-    const unsigned tableSize = 1;
-    U16* tableU16 = ( (U16*) CTable) + 2;
-    FSE_symbolCompressionTransform* symbolTT = (FSE_symbolCompressionTransform*) ((U32*)CTable + 2);
-
-    /* safety checks */
-    if (((size_t)CTable) & 3) return (size_t)-FSE_ERROR_GENERIC;   /* Must be 4 bytes aligned */
-
-    /* header */
-    tableU16[-2] = (U16) 0;
-    tableU16[-1] = (U16) symbolValue;
-
-    /* Build table */
-    tableU16[0] = 0;
-    tableU16[1] = 0;   /* just in case */
-
-    /* Build Symbol Transformation Table */
-    {
-        symbolTT[symbolValue].minBitsOut = 0;
-        symbolTT[symbolValue].deltaFindState = 0;
-        symbolTT[symbolValue].maxState = (U16)(2*tableSize-1);   /* ensures state <= maxState */
-    }
-
-    return 0;
-}
+    U32 fakeTable[FSE_CTABLE_SIZE_U32(FSE_MAX_TABLELOG, FSE_MAX_SYMBOL_VALUE)];   /* compatible with FSE_compressU16() */
+} CTable_max_t;
 
 
-void FSE_initCStream(FSE_CStream_t* bitC, void* start)
+/****************************************************************
+*  Internal functions
+****************************************************************/
+FORCE_INLINE unsigned FSE_highbit32 (register U32 val)
 {
-    bitC->bitContainer = 0;
-    bitC->bitPos = 0;   /* reserved for unusedBits */
-    bitC->startPtr = (char*)start;
-    bitC->ptr = bitC->startPtr;
+#   if defined(_MSC_VER)   /* Visual */
+    unsigned long r;
+    _BitScanReverse ( &r, val );
+    return (unsigned) r;
+#   elif defined(__GNUC__) && (GCC_VERSION >= 304)   /* GCC Intrinsic */
+    return 31 - __builtin_clz (val);
+#   else   /* Software version */
+    static const unsigned DeBruijnClz[32] = { 0, 9, 1, 10, 13, 21, 2, 29, 11, 14, 16, 18, 22, 25, 3, 30, 8, 12, 20, 28, 15, 17, 24, 7, 19, 27, 23, 6, 26, 5, 4, 31 };
+    U32 v = val;
+    unsigned r;
+    v |= v >> 1;
+    v |= v >> 2;
+    v |= v >> 4;
+    v |= v >> 8;
+    v |= v >> 16;
+    r = DeBruijnClz[ (U32) (v * 0x07C4ACDDU) >> 27];
+    return r;
+#   endif
 }
 
-void FSE_initCState(FSE_CState_t* statePtr, const void* CTable)
-{
-    const U32 tableLog = ( (U16*) CTable) [0];
-    statePtr->value = (ptrdiff_t)1<<tableLog;
-    statePtr->stateTable = ((const U16*) CTable) + 2;
-    statePtr->symbolTT = (const U32*)CTable + 1 + (tableLog ? (1<<(tableLog-1)) : 1);
-    statePtr->stateLog = tableLog;
-}
 
-void FSE_addBits(FSE_CStream_t* bitC, size_t value, unsigned nbBits)
-{
-    static const unsigned mask[] = { 0, 1, 3, 7, 0xF, 0x1F, 0x3F, 0x7F, 0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF, 0x1FFF, 0x3FFF, 0x7FFF, 0xFFFF, 0x1FFFF, 0x3FFFF, 0x7FFFF, 0xFFFFF, 0x1FFFFF, 0x3FFFFF, 0x7FFFFF,  0xFFFFFF, 0x1FFFFFF };   /* up to 25 bits */
-    bitC->bitContainer |= (value & mask[nbBits]) << bitC->bitPos;
-    bitC->bitPos += nbBits;
-}
+#ifndef FSE_COMMONDEFS_ONLY
 
-void FSE_encodeByte(FSE_CStream_t* bitC, FSE_CState_t* statePtr, BYTE symbol)
-{
-    const FSE_symbolCompressionTransform* const symbolTT = (const FSE_symbolCompressionTransform*) statePtr->symbolTT;
-    const U16* const stateTable = (const U16*) statePtr->stateTable;
-    int nbBitsOut  = symbolTT[symbol].minBitsOut;
-    nbBitsOut -= (int)((symbolTT[symbol].maxState - statePtr->value) >> 31);
-    FSE_addBits(bitC, statePtr->value, nbBitsOut);
-    statePtr->value = stateTable[ (statePtr->value >> nbBitsOut) + symbolTT[symbol].deltaFindState];
-}
+unsigned FSE_isError(size_t code) { return (code > (size_t)(-FSE_ERROR_maxCode)); }
 
-void FSE_flushBits(FSE_CStream_t* bitC)
+#define FSE_GENERATE_STRING(STRING) #STRING,
+static const char* FSE_errorStrings[] = { FSE_LIST_ERRORS(FSE_GENERATE_STRING) };
+
+const char* FSE_getErrorName(size_t code)
 {
-    size_t nbBytes = bitC->bitPos >> 3;
-    FSE_writeLEST(bitC->ptr, bitC->bitContainer);
-    bitC->bitPos &= 7;
-    bitC->ptr += nbBytes;
-    bitC->bitContainer >>= nbBytes*8;
+    static const char* codeError = "Unspecified error code";
+    if (FSE_isError(code)) return FSE_errorStrings[-(int)(code)];
+    return codeError;
 }
 
-void FSE_flushCState(FSE_CStream_t* bitC, const FSE_CState_t* statePtr)
+static short FSE_abs(short a)
 {
-    FSE_addBits(bitC, statePtr->value, statePtr->stateLog);
-    FSE_flushBits(bitC);
+    return a<0? -a : a;
 }
 
 
-size_t FSE_closeCStream(FSE_CStream_t* bitC)
+/****************************************************************
+*  Header bitstream management
+****************************************************************/
+size_t FSE_headerBound(unsigned maxSymbolValue, unsigned tableLog)
 {
-    char* endPtr;
-
-    FSE_addBits(bitC, 1, 1);
-    FSE_flushBits(bitC);
-
-    endPtr = bitC->ptr;
-    endPtr += bitC->bitPos > 0;
-
-    return (endPtr - bitC->startPtr);
+    size_t maxHeaderSize = (((maxSymbolValue+1) * tableLog) >> 3) + 1;
+    return maxSymbolValue ? maxHeaderSize : FSE_MAX_HEADERSIZE;
 }
 
-
-size_t FSE_compress_usingCTable (void* dst, size_t dstSize,
-                           const void* src, size_t srcSize,
-                           const void* CTable)
+static size_t FSE_writeHeader_generic (void* header, size_t headerBufferSize,
+                                       const short* normalizedCounter, unsigned maxSymbolValue, unsigned tableLog,
+                                       unsigned safeWrite)
 {
-    const BYTE* const istart = (const BYTE*) src;
-    const BYTE* ip;
-    const BYTE* const iend = istart + srcSize;
-
-    FSE_CStream_t bitC;
-    FSE_CState_t CState1, CState2;
-
+    BYTE* const ostart = (BYTE*) header;
+    BYTE* out = ostart;
+    BYTE* const oend = ostart + headerBufferSize;
+    int nbBits;
+    const int tableSize = 1 << tableLog;
+    int remaining;
+    int threshold;
+    U32 bitStream;
+    int bitCount;
+    unsigned charnum = 0;
+    int previous0 = 0;
 
-    /* init */
-    (void)dstSize;   /* objective : ensure it fits into dstBuffer (Todo) */
-    FSE_initCStream(&bitC, dst);
-    FSE_initCState(&CState1, CTable);
-    CState2 = CState1;
+    bitStream = 0;
+    bitCount  = 0;
+    /* Table Size */
+    bitStream += (tableLog-FSE_MIN_TABLELOG) << bitCount;
+    bitCount  += 4;
 
-    ip=iend;
+    /* Init */
+    remaining = tableSize+1;   /* +1 for extra accuracy */
+    threshold = tableSize;
+    nbBits = tableLog+1;
 
-    /* join to even */
-    if (srcSize & 1)
+    while (remaining>1)   /* stops at 1 */
     {
-        FSE_encodeByte(&bitC, &CState1, *--ip);
-        FSE_flushBits(&bitC);
+        if (previous0)
+        {
+            unsigned start = charnum;
+            while (!normalizedCounter[charnum]) charnum++;
+            while (charnum >= start+24)
+            {
+                start+=24;
+                bitStream += 0xFFFF<<bitCount;
+                if ((!safeWrite) && (out > oend-2)) return (size_t)-FSE_ERROR_GENERIC;   /* Buffer overflow */
+                out[0] = (BYTE)bitStream;
+                out[1] = (BYTE)(bitStream>>8);
+                out+=2;
+                bitStream>>=16;
+            }
+            while (charnum >= start+3)
+            {
+                start+=3;
+                bitStream += 3 << bitCount;
+                bitCount += 2;
+            }
+            bitStream += (charnum-start) << bitCount;
+            bitCount += 2;
+            if (bitCount>16)
+            {
+                if ((!safeWrite) && (out > oend - 2)) return (size_t)-FSE_ERROR_GENERIC;   /* Buffer overflow */
+                out[0] = (BYTE)bitStream;
+                out[1] = (BYTE)(bitStream>>8);
+                out += 2;
+                bitStream >>= 16;
+                bitCount -= 16;
+            }
+        }
+        {
+            short count = normalizedCounter[charnum++];
+            const short max = (short)((2*threshold-1)-remaining);
+            remaining -= FSE_abs(count);
+            if (remaining<0) return (size_t)-FSE_ERROR_GENERIC;
+            count++;   /* +1 for extra accuracy */
+            if (count>=threshold) count += max;   /* [0..max[ [max..threshold[ (...) [threshold+max 2*threshold[ */
+            bitStream += count << bitCount;
+            bitCount  += nbBits;
+            bitCount  -= (count<max);
+            previous0 = (count==1);
+            while (remaining<threshold) nbBits--, threshold>>=1;
+        }
+        if (bitCount>16)
+        {
+            if ((!safeWrite) && (out > oend - 2)) return (size_t)-FSE_ERROR_GENERIC;   /* Buffer overflow */
+            out[0] = (BYTE)bitStream;
+            out[1] = (BYTE)(bitStream>>8);
+            out += 2;
+            bitStream >>= 16;
+            bitCount -= 16;
+        }
     }
 
-    /* join to mod 4 */
-    if ((sizeof(size_t)*8 > FSE_MAX_TABLELOG*4+7 ) && (srcSize & 2))   /* test bit 2 */
-    {
-        FSE_encodeByte(&bitC, &CState2, *--ip);
-        FSE_encodeByte(&bitC, &CState1, *--ip);
-        FSE_flushBits(&bitC);
-    }
+    /* flush remaining bitStream */
+    if ((!safeWrite) && (out > oend - 2)) return (size_t)-FSE_ERROR_GENERIC;   /* Buffer overflow */
+    out[0] = (BYTE)bitStream;
+    out[1] = (BYTE)(bitStream>>8);
+    out+= (bitCount+7) /8;
 
-    /* 2 or 4 encoding per loop */
-    while (ip>istart)
-    {
-        FSE_encodeByte(&bitC, &CState2, *--ip);
+    if (charnum > maxSymbolValue + 1) return (size_t)-FSE_ERROR_GENERIC;   /* Too many symbols written (a bit too late?) */
 
-        if (sizeof(size_t)*8 < FSE_MAX_TABLELOG*2+7 )   /* this test must be static */
-            FSE_flushBits(&bitC);
+    return (out-ostart);
+}
 
-        FSE_encodeByte(&bitC, &CState1, *--ip);
 
-        if (sizeof(size_t)*8 > FSE_MAX_TABLELOG*4+7 )   /* this test must be static */
-        {
-            FSE_encodeByte(&bitC, &CState2, *--ip);
-            FSE_encodeByte(&bitC, &CState1, *--ip);
-        }
+size_t FSE_writeHeader (void* header, size_t headerBufferSize, const short* normalizedCounter, unsigned maxSymbolValue, unsigned tableLog)
+{
+    if (tableLog > FSE_MAX_TABLELOG) return (size_t)-FSE_ERROR_GENERIC;   /* Unsupported */
+    if (tableLog < FSE_MIN_TABLELOG) return (size_t)-FSE_ERROR_GENERIC;   /* Unsupported */
 
-        FSE_flushBits(&bitC);
-    }
+    if (headerBufferSize < FSE_headerBound(maxSymbolValue, tableLog))
+        return FSE_writeHeader_generic(header, headerBufferSize, normalizedCounter, maxSymbolValue, tableLog, 0);
 
-    FSE_flushCState(&bitC, &CState2);
-    FSE_flushCState(&bitC, &CState1);
-    return FSE_closeCStream(&bitC);
+    return FSE_writeHeader_generic(header, headerBufferSize, normalizedCounter, maxSymbolValue, tableLog, 1);
 }
 
 
-size_t FSE_compressBound(size_t size) { return FSE_COMPRESSBOUND(size); }
-
-
-size_t FSE_compress2 (void* dst, size_t dstSize, const void* src, size_t srcSize, unsigned maxSymbolValue, unsigned tableLog)
+size_t FSE_readHeader (short* normalizedCounter, unsigned* maxSVPtr, unsigned* tableLogPtr,
+                 const void* headerBuffer, size_t hbSize)
 {
-    const BYTE* const istart = (const BYTE*) src;
+    const BYTE* const istart = (const BYTE*) headerBuffer;
     const BYTE* ip = istart;
+    int nbBits;
+    int remaining;
+    int threshold;
+    U32 bitStream;
+    int bitCount;
+    unsigned charnum = 0;
+    int previous0 = 0;
 
-    BYTE* const ostart = (BYTE*) dst;
-    BYTE* op = ostart;
-    BYTE* const oend = ostart + dstSize;
-
-    U32   count[FSE_MAX_SYMBOL_VALUE+1];
-    S16   norm[FSE_MAX_SYMBOL_VALUE+1];
-    CTable_max_t CTable;
-    size_t errorCode;
-
-    /* early out */
-    if (dstSize < FSE_compressBound(srcSize)) return (size_t)-FSE_ERROR_dstSize_tooSmall;
-    if (srcSize <= 1) return srcSize;  /* Uncompressed or RLE */
-    if (!maxSymbolValue) maxSymbolValue = FSE_MAX_SYMBOL_VALUE;
-    if (!tableLog) tableLog = FSE_DEFAULT_TABLELOG;
-
-    /* Scan input and build symbol stats */
-    errorCode = FSE_count (count, ip, srcSize, &maxSymbolValue);
-    if (FSE_isError(errorCode)) return errorCode;
-    if (errorCode == srcSize) return 1;
-    if (errorCode < (srcSize >> 7)) return 0;   /* Heuristic : not compressible enough */
+    bitStream = FSE_readLE32(ip);
+    nbBits = (bitStream & 0xF) + FSE_MIN_TABLELOG;   /* extract tableLog */
+    if (nbBits > FSE_TABLELOG_ABSOLUTE_MAX) return (size_t)-FSE_ERROR_tableLog_tooLarge;
+    bitStream >>= 4;
+    bitCount = 4;
+    *tableLogPtr = nbBits;
+    remaining = (1<<nbBits)+1;
+    threshold = 1<<nbBits;
+    nbBits++;
 
-    tableLog = FSE_optimalTableLog(tableLog, srcSize, maxSymbolValue);
-    errorCode = FSE_normalizeCount (norm, tableLog, count, srcSize, maxSymbolValue);
-    if (FSE_isError(errorCode)) return errorCode;
+    while ((remaining>1) && (charnum<=*maxSVPtr))
+    {
+        if (previous0)
+        {
+            unsigned n0 = charnum;
+            while ((bitStream & 0xFFFF) == 0xFFFF)
+            {
+                n0+=24;
+                ip+=2;
+                bitStream = FSE_readLE32(ip) >> bitCount;
+            }
+            while ((bitStream & 3) == 3)
+            {
+                n0+=3;
+                bitStream>>=2;
+                bitCount+=2;
+            }
+            n0 += bitStream & 3;
+            bitCount += 2;
+            if (n0 > *maxSVPtr) return (size_t)-FSE_ERROR_GENERIC;
+            while (charnum < n0) normalizedCounter[charnum++] = 0;
+            ip += bitCount>>3;
+            bitCount &= 7;
+            bitStream = FSE_readLE32(ip) >> bitCount;
+        }
+        {
+            const short max = (short)((2*threshold-1)-remaining);
+            short count;
 
-    /* Write table description header */
-    errorCode = FSE_writeHeader (op, FSE_MAX_HEADERSIZE, norm, maxSymbolValue, tableLog);
-    if (FSE_isError(errorCode)) return errorCode;
-    op += errorCode;
+            if ((bitStream & (threshold-1)) < (U32)max)
+            {
+                count = (short)(bitStream & (threshold-1));
+                bitCount   += nbBits-1;
+            }
+            else
+            {
+                count = (short)(bitStream & (2*threshold-1));
+                if (count >= threshold) count -= max;
+                bitCount   += nbBits;
+            }
 
-    /* Compress */
-    errorCode = FSE_buildCTable (&CTable, norm, maxSymbolValue, tableLog);
-    if (FSE_isError(errorCode)) return errorCode;
-    op += FSE_compress_usingCTable(op, oend - op, ip, srcSize, &CTable);
+            count--;   /* extra accuracy */
+            remaining -= FSE_abs(count);
+            normalizedCounter[charnum++] = count;
+            previous0 = !count;
+            while (remaining < threshold)
+            {
+                nbBits--;
+                threshold >>= 1;
+            }
 
-    /* check compressibility */
-    if ( (size_t)(op-ostart) >= srcSize-1 )
-        return 0;
+            ip += bitCount>>3;
+            bitCount &= 7;
+            bitStream = FSE_readLE32(ip) >> bitCount;
+        }
+    }
+    if (remaining != 1) return (size_t)-FSE_ERROR_GENERIC;
+    *maxSVPtr = charnum-1;
 
-    return op-ostart;
+    ip += bitCount>0;
+    if ((size_t)(ip-istart) >= hbSize) return (size_t)-FSE_ERROR_srcSize_wrong;   /* arguably a bit late , tbd */
+    return ip-istart;
 }
 
 
-size_t FSE_compress (void* dst, size_t dstSize, const void* src, size_t srcSize)
+/****************************************************************
+*  FSE Compression Code
+****************************************************************/
+/*
+CTable is a variable size structure which contains :
+    U16 tableLog;
+    U16 maxSymbolValue;
+    U16 nextStateNumber[1 << tableLog];                         // This size is variable
+    FSE_symbolCompressionTransform symbolTT[maxSymbolValue+1];  // This size is variable
+Allocation is manual, since C standard does not support variable-size structures.
+*/
+
+size_t FSE_sizeof_CTable (unsigned maxSymbolValue, unsigned tableLog)
 {
-    return FSE_compress2(dst, dstSize, src, (U32)srcSize, FSE_MAX_SYMBOL_VALUE, FSE_DEFAULT_TABLELOG);
+    size_t size;
+    FSE_STATIC_ASSERT((size_t)FSE_CTABLE_SIZE_U32(FSE_MAX_TABLELOG, FSE_MAX_SYMBOL_VALUE)*4 >= sizeof(CTable_max_t));   /* A compilation error here means FSE_CTABLE_SIZE_U32 is not large enough */
+    if (tableLog > FSE_MAX_TABLELOG) return (size_t)-FSE_ERROR_GENERIC;
+    size = FSE_CTABLE_SIZE_U32 (tableLog, maxSymbolValue) * sizeof(U32);
+    return size;
 }
 
-
-/*********************************************************
-*  Decompression (Byte symbols)
-*********************************************************/
-typedef struct
+void* FSE_createCTable (unsigned maxSymbolValue, unsigned tableLog)
 {
-    U16  newState;
-    BYTE symbol;
-    BYTE nbBits;
-} FSE_decode_t;   /* size == U32 */
+    size_t size;
+    if (tableLog > FSE_TABLELOG_ABSOLUTE_MAX) tableLog = FSE_TABLELOG_ABSOLUTE_MAX;
+    size = FSE_CTABLE_SIZE_U32 (tableLog, maxSymbolValue) * sizeof(U32);
+    return malloc(size);
+}
 
-/* Specific corner case : RLE compression */
-size_t FSE_decompressRLE(void* dst, size_t originalSize,
-                   const void* cSrc, size_t cSrcSize)
+void  FSE_freeCTable (void* CTable)
 {
-    if (cSrcSize != 1) return (size_t)-FSE_ERROR_srcSize_wrong;
-    memset(dst, *(BYTE*)cSrc, originalSize);
-    return originalSize;
+    free(CTable);
 }
 
 
-size_t FSE_buildDTable_rle (void* DTable, BYTE symbolValue)
+unsigned FSE_optimalTableLog(unsigned maxTableLog, size_t srcSize, unsigned maxSymbolValue)
 {
-    U32* const base32 = (U32*)DTable;
-    FSE_decode_t* const cell = (FSE_decode_t*)(base32 + 1);
+    U32 tableLog = maxTableLog;
+    if (tableLog==0) tableLog = FSE_DEFAULT_TABLELOG;
+    if ((FSE_highbit32((U32)(srcSize - 1)) - 2) < tableLog) tableLog = FSE_highbit32((U32)(srcSize - 1)) - 2;   /* Accuracy can be reduced */
+    if ((FSE_highbit32(maxSymbolValue+1)+1) > tableLog) tableLog = FSE_highbit32(maxSymbolValue+1)+1;   /* Need a minimum to safely represent all symbol values */
+    if (tableLog < FSE_MIN_TABLELOG) tableLog = FSE_MIN_TABLELOG;
+    if (tableLog > FSE_MAX_TABLELOG) tableLog = FSE_MAX_TABLELOG;
+    return tableLog;
+}
 
-    /* Sanity check */
-    if (((size_t)DTable) & 3) return (size_t)-FSE_ERROR_GENERIC;   /* Must be allocated of 4 bytes boundaries */
 
-    base32[0] = 0;
+typedef struct
+{
+    U32 id;
+    U32 count;
+} rank_t;
 
-    cell->newState = 0;
-    cell->symbol = symbolValue;
-    cell->nbBits = 0;
+int FSE_compareRankT(const void* r1, const void* r2)
+{
+    const rank_t* R1 = (const rank_t*)r1;
+    const rank_t* R2 = (const rank_t*)r2;
 
-    return 0;
+    return 2 * (R1->count < R2->count) - 1;
 }
 
 
-size_t FSE_buildDTable_raw (void* DTable, unsigned nbBits)
+#if 0
+static size_t FSE_adjustNormSlow(short* norm, int pointsToRemove, const unsigned* count, U32 maxSymbolValue)
 {
-    U32* const base32 = (U32*)DTable;
-    FSE_decode_t* dinfo = (FSE_decode_t*)(base32 + 1);
-    const unsigned tableSize = 1 << nbBits;
-    const unsigned tableMask = tableSize - 1;
-    const unsigned maxSymbolValue = tableMask;
-    unsigned s;
-
-    /* Sanity checks */
-    if (nbBits < 1) return (size_t)-FSE_ERROR_GENERIC;             /* min size */
-    if (((size_t)DTable) & 3) return (size_t)-FSE_ERROR_GENERIC;   /* Must be allocated of 4 bytes boundaries */
+    rank_t rank[FSE_MAX_SYMBOL_VALUE+2];
+    U32 s;
 
-    /* Build Decoding Table */
-    base32[0] = nbBits;
+    /* Init */
     for (s=0; s<=maxSymbolValue; s++)
     {
-        dinfo[s].newState = 0;
-        dinfo[s].symbol = (BYTE)s;
-        dinfo[s].nbBits = (BYTE)nbBits;
+        rank[s].id = s;
+        rank[s].count = count[s];
+        if (norm[s] <= 1) rank[s].count = 0;
     }
+    rank[maxSymbolValue+1].id = 0;
+    rank[maxSymbolValue+1].count = 0;   /* ensures comparison ends here in worst case */
 
-    return 0;
-}
-
-
-/* FSE_initDStream
- * Initialize a FSE_DStream_t.
- * srcBuffer must point at the beginning of an FSE block.
- * The function result is the size of the FSE_block (== srcSize).
- * If srcSize is too small, the function will return an errorCode;
- */
-size_t FSE_initDStream(FSE_DStream_t* bitD, const void* srcBuffer, size_t srcSize)
-{
-    if (srcSize < 1) return (size_t)-FSE_ERROR_srcSize_wrong;
+    /* Sort according to count */
+    qsort(rank, maxSymbolValue+1, sizeof(rank_t), FSE_compareRankT);
 
-    if (srcSize >=  sizeof(bitD_t))
-    {
-        U32 contain32;
-        bitD->start = (char*)srcBuffer;
-        bitD->ptr   = (char*)srcBuffer + srcSize - sizeof(bitD_t);
-        bitD->bitContainer = FSE_readLEST(bitD->ptr);
-        contain32 = ((BYTE*)srcBuffer)[srcSize-1];
-        if (contain32 == 0) return (size_t)-FSE_ERROR_GENERIC;   /* stop bit not present */
-        bitD->bitsConsumed = 8 - FSE_highbit32(contain32);
-    }
-    else
+    while(pointsToRemove)
     {
-        U32 contain32;
-        bitD->start = (char*)srcBuffer;
-        bitD->ptr   = bitD->start;
-        bitD->bitContainer = *(BYTE*)(bitD->start);
-        switch(srcSize)
+        int newRank = 1;
+        rank_t savedR;
+        if (norm[rank[0].id] == 1)
+            return (size_t)-FSE_ERROR_GENERIC;
+        norm[rank[0].id]--;
+        pointsToRemove--;
+        rank[0].count -= (rank[0].count + 6) >> 3;
+        if (norm[rank[0].id] == 1)
+            rank[0].count=0;
+        savedR = rank[0];
+        while (rank[newRank].count > savedR.count)
         {
-            case 7: bitD->bitContainer += (bitD_t)(((BYTE*)(bitD->start))[6]) << (sizeof(bitD_t)*8 - 16);
-            case 6: bitD->bitContainer += (bitD_t)(((BYTE*)(bitD->start))[5]) << (sizeof(bitD_t)*8 - 24);
-            case 5: bitD->bitContainer += (bitD_t)(((BYTE*)(bitD->start))[4]) << (sizeof(bitD_t)*8 - 32);
-            case 4: bitD->bitContainer += (bitD_t)(((BYTE*)(bitD->start))[3]) << 24;
-            case 3: bitD->bitContainer += (bitD_t)(((BYTE*)(bitD->start))[2]) << 16;
-            case 2: bitD->bitContainer += (bitD_t)(((BYTE*)(bitD->start))[1]) <<  8;
-            default:;
+            rank[newRank-1] = rank[newRank];
+            newRank++;
         }
-        contain32 = ((BYTE*)srcBuffer)[srcSize-1];
-        if (contain32 == 0) return (size_t)-FSE_ERROR_GENERIC;   /* stop bit not present */
-        bitD->bitsConsumed = 8 - FSE_highbit32(contain32);
-        bitD->bitsConsumed += (U32)(sizeof(bitD_t) - srcSize)*8;
+        rank[newRank-1] = savedR;
     }
 
-    return srcSize;
+    return 0;
 }
 
+#else
 
-/* FSE_readBits
- * Read next n bits from the bitContainer.
- * Use the fast variant *only* if n > 0.
- * Note : for this function to work properly on 32-bits, don't read more than maxNbBits==25
- * return : value extracted.
- */
-bitD_t FSE_readBits(FSE_DStream_t* bitD, U32 nbBits)
-{
-    bitD_t value = ((bitD->bitContainer << bitD->bitsConsumed) >> 1) >> (((sizeof(bitD_t)*8)-1)-nbBits);
-    bitD->bitsConsumed += nbBits;
-    return value;
-}
+/* Secondary normalization method.
+   To be used when primary method fails. */
 
-bitD_t FSE_readBitsFast(FSE_DStream_t* bitD, U32 nbBits)   /* only if nbBits >= 1 */
+static size_t FSE_normalizeM2(short* norm, U32 tableLog, const unsigned* count, size_t total, U32 maxSymbolValue)
 {
-    bitD_t value = (bitD->bitContainer << bitD->bitsConsumed) >> ((sizeof(bitD_t)*8)-nbBits);
-    bitD->bitsConsumed += nbBits;
-    return value;
-}
+    U32 s;
+    U32 distributed = 0;
+    U32 ToDistribute;
 
-unsigned FSE_reloadDStream(FSE_DStream_t* bitD)
-{
-    if (bitD->ptr >= bitD->start + sizeof(bitD_t))
+    /* Init */
+    U32 lowThreshold = (U32)(total >> tableLog);
+    U32 lowOne = (U32)((total * 3) >> (tableLog + 1));
+
+    for (s=0; s<=maxSymbolValue; s++)
     {
-        bitD->ptr -= bitD->bitsConsumed >> 3;
-        bitD->bitsConsumed &= 7;
-        bitD->bitContainer = FSE_readLEST(bitD->ptr);
-        return 0;
+        if (count[s] == 0)
+        {
+            norm[s]=0;
+            continue;
+        }
+        if (count[s] <= lowThreshold)
+        {
+            norm[s] = -1;
+            distributed++;
+            total -= count[s];
+            continue;
+        }
+        if (count[s] <= lowOne)
+        {
+            norm[s] = 1;
+            distributed++;
+            total -= count[s];
+            continue;
+        }
+        norm[s]=-2;
     }
-    if (bitD->ptr == bitD->start)
+    ToDistribute = (1 << tableLog) - distributed;
+
+    if ((total / ToDistribute) > lowOne)
     {
-        if (bitD->bitsConsumed < sizeof(bitD_t)*8) return 1;
-        if (bitD->bitsConsumed == sizeof(bitD_t)*8) return 2;
-        return 3;
+        /* risk of rounding to zero */
+        lowOne = (U32)((total * 3) / (ToDistribute * 2));
+        for (s=0; s<=maxSymbolValue; s++)
+        {
+            if ((norm[s] == -2) && (count[s] <= lowOne))
+            {
+                norm[s] = 1;
+                distributed++;
+                total -= count[s];
+                continue;
+            }
+        }
+        ToDistribute = (1 << tableLog) - distributed;
     }
+
+    if (distributed == maxSymbolValue+1)
     {
-        U32 nbBytes = bitD->bitsConsumed >> 3;
-        if (bitD->ptr - nbBytes < bitD->start)
-            nbBytes = (U32)(bitD->ptr - bitD->start);  /* note : necessarily ptr > start */
-        bitD->ptr -= nbBytes;
-        bitD->bitsConsumed -= nbBytes*8;
-        bitD->bitContainer = FSE_readLEST(bitD->ptr);   /* note : necessarily srcSize > sizeof(bitD) */
-        return (bitD->ptr == bitD->start);
+        /* all values are pretty poor;
+           probably incompressible data (should have already been detected);
+           find max, then give all remaining points to max */
+        U32 maxV = 0, maxC =0;
+        for (s=0; s<=maxSymbolValue; s++)
+            if (count[s] > maxC) maxV=s, maxC=count[s];
+        norm[maxV] += ToDistribute;
+        return 0;
     }
-}
 
+    {
+        U64 const vStepLog = 62 - tableLog;
+        U64 const mid = (1ULL << (vStepLog-1)) - 1;
+        U64 const rStep = ((((U64)1<<vStepLog) * ToDistribute) + mid) / total;   /* scale on remaining */
+        U64 tmpTotal = mid;
+        for (s=0; s<=maxSymbolValue; s++)
+        {
+            if (norm[s]==-2)
+            {
+                U64 end = tmpTotal + (count[s] * rStep);
+                U32 sStart = (U32)(tmpTotal >> vStepLog);
+                U32 sEnd = (U32)(end >> vStepLog);
+                U32 weight = sEnd - sStart;
+                if (weight < 1)
+                    return (size_t)-FSE_ERROR_GENERIC;
+                norm[s] = weight;
+                tmpTotal = end;
+            }
+        }
+    }
 
-void FSE_initDState(FSE_DState_t* DStatePtr, FSE_DStream_t* bitD, const void* DTable)
-{
-    const U32* const base32 = (const U32*)DTable;
-    DStatePtr->state = FSE_readBits(bitD, base32[0]);
-    FSE_reloadDStream(bitD);
-    DStatePtr->table = base32 + 1;
+    return 0;
 }
+#endif
 
-BYTE FSE_decodeSymbol(FSE_DState_t* DStatePtr, FSE_DStream_t* bitD)
-{
-    const FSE_decode_t DInfo = ((const FSE_decode_t*)(DStatePtr->table))[DStatePtr->state];
-    const U32  nbBits = DInfo.nbBits;
-    BYTE symbol = DInfo.symbol;
-    bitD_t lowBits = FSE_readBits(bitD, nbBits);
-
-    DStatePtr->state = DInfo.newState + lowBits;
-    return symbol;
-}
 
-BYTE FSE_decodeSymbolFast(FSE_DState_t* DStatePtr, FSE_DStream_t* bitD)
+size_t FSE_normalizeCount (short* normalizedCounter, unsigned tableLog,
+                           const unsigned* count, size_t total,
+                           unsigned maxSymbolValue)
 {
-    const FSE_decode_t DInfo = ((const FSE_decode_t*)(DStatePtr->table))[DStatePtr->state];
-    const U32 nbBits = DInfo.nbBits;
-    BYTE symbol = DInfo.symbol;
-    bitD_t lowBits = FSE_readBitsFast(bitD, nbBits);
-
-    DStatePtr->state = DInfo.newState + lowBits;
-    return symbol;
-}
+    /* Sanity checks */
+    if (tableLog==0) tableLog = FSE_DEFAULT_TABLELOG;
+    if (tableLog < FSE_MIN_TABLELOG) return (size_t)-FSE_ERROR_GENERIC;   /* Unsupported size */
+    if (tableLog > FSE_MAX_TABLELOG) return (size_t)-FSE_ERROR_GENERIC;   /* Unsupported size */
+    if ((1U<<tableLog) <= maxSymbolValue) return (size_t)-FSE_ERROR_GENERIC;   /* Too small tableLog, compression potentially impossible */
 
-/* FSE_endOfDStream
-   Tells if bitD has reached end of bitStream or not */
+    {
+        U32 const rtbTable[] = {     0, 473195, 504333, 520860, 550000, 700000, 750000, 830000 };
+        U64 const scale = 62 - tableLog;
+        U64 const step = ((U64)1<<62) / total;   /* <== here, one division ! */
+        U64 const vStep = 1ULL<<(scale-20);
+        int stillToDistribute = 1<<tableLog;
+        unsigned s;
+        unsigned largest=0;
+        short largestP=0;
+        U32 lowThreshold = (U32)(total >> tableLog);
 
-unsigned FSE_endOfDStream(const FSE_DStream_t* bitD)
-{
-    return FSE_reloadDStream((FSE_DStream_t*)bitD)==2;
-}
+        for (s=0; s<=maxSymbolValue; s++)
+        {
+            if (count[s] == total) return 0;
+            if (count[s] == 0)
+            {
+                normalizedCounter[s]=0;
+                continue;
+            }
+            if (count[s] <= lowThreshold)
+            {
+                normalizedCounter[s] = -1;
+                stillToDistribute--;
+            }
+            else
+            {
+                short proba = (short)((count[s]*step) >> scale);
+                if (proba<8)
+                {
+                    U64 restToBeat = vStep * rtbTable[proba];
+                    proba += (count[s]*step) - ((U64)proba<<scale) > restToBeat;
+                }
+                if (proba > largestP)
+                {
+                    largestP=proba;
+                    largest=s;
+                }
+                normalizedCounter[s] = proba;
+                stillToDistribute -= proba;
+            }
+        }
+        if (-stillToDistribute >= (normalizedCounter[largest] >> 1))
+        {
+            /* corner case, need another normalization method */
+            size_t errorCode = FSE_normalizeM2(normalizedCounter, tableLog, count, total, maxSymbolValue);
+            if (FSE_isError(errorCode)) return errorCode;
+        }
+        else normalizedCounter[largest] += (short)stillToDistribute;
+    }
 
-unsigned FSE_endOfDState(const FSE_DState_t* statePtr)
-{
-    return statePtr->state == 0;
+#if 0
+    {   /* Print Table (debug) */
+        U32 s;
+        U32 nTotal = 0;
+        for (s=0; s<=maxSymbolValue; s++)
+            printf("%3i: %4i \n", s, normalizedCounter[s]);
+        for (s=0; s<=maxSymbolValue; s++)
+            nTotal += abs(normalizedCounter[s]);
+        if (nTotal != (1U<<tableLog))
+            printf("Warning !!! Total == %u != %u !!!", nTotal, 1U<<tableLog);
+        getchar();
+    }
+#endif
+
+    return tableLog;
 }
 
 
-FORCE_INLINE size_t FSE_decompress_usingDTable_generic(
-          void* dst, size_t maxDstSize,
-    const void* cSrc, size_t cSrcSize,
-    const void* DTable, unsigned fast)
+/* fake CTable, for raw (uncompressed) input */
+size_t FSE_buildCTable_raw (void* CTable, unsigned nbBits)
 {
-    BYTE* const ostart = (BYTE*) dst;
-    BYTE* op = ostart;
-    BYTE* const omax = op + maxDstSize;
-    BYTE* const olimit = omax-3;
-
-    FSE_DStream_t bitD;
-    FSE_DState_t state1, state2;
-    size_t errorCode;
+    const unsigned tableSize = 1 << nbBits;
+    const unsigned tableMask = tableSize - 1;
+    const unsigned maxSymbolValue = tableMask;
+    U16* tableU16 = ( (U16*) CTable) + 2;
+    FSE_symbolCompressionTransform* symbolTT = (FSE_symbolCompressionTransform*) ((((U32*)CTable)+1) + (tableSize>>1));
+    unsigned s;
 
-    /* Init */
-    errorCode = FSE_initDStream(&bitD, cSrc, cSrcSize);   /* replaced last arg by maxCompressed Size */
-    if (FSE_isError(errorCode)) return errorCode;
+    /* Sanity checks */
+    if (nbBits < 1) return (size_t)-FSE_ERROR_GENERIC;             /* min size */
+    if (((size_t)CTable) & 3) return (size_t)-FSE_ERROR_GENERIC;   /* Must be allocated of 4 bytes boundaries */
 
-    FSE_initDState(&state1, &bitD, DTable);
-    FSE_initDState(&state2, &bitD, DTable);
+    /* header */
+    tableU16[-2] = (U16) nbBits;
+    tableU16[-1] = (U16) maxSymbolValue;
 
+    /* Build table */
+    for (s=0; s<tableSize; s++)
+        tableU16[s] = (U16)(tableSize + s);
 
-    /* 2 symbols per loop */
-    while (!FSE_reloadDStream(&bitD) && (op<olimit))
+    /* Build Symbol Transformation Table */
+    for (s=0; s<=maxSymbolValue; s++)
     {
-        *op++ = fast ? FSE_decodeSymbolFast(&state1, &bitD) : FSE_decodeSymbol(&state1, &bitD);
+        symbolTT[s].minBitsOut = (BYTE)nbBits;
+        symbolTT[s].deltaFindState = s-1;
+        symbolTT[s].maxState = (U16)( (tableSize*2) - 1);   /* ensures state <= maxState */
+    }
 
-        if (FSE_MAX_TABLELOG*2+7 > sizeof(bitD_t)*8)    /* This test must be static */
-            FSE_reloadDStream(&bitD);
+    return 0;
+}
 
-        *op++ = fast ? FSE_decodeSymbolFast(&state2, &bitD) : FSE_decodeSymbol(&state2, &bitD);
 
-        if (FSE_MAX_TABLELOG*4+7 < sizeof(bitD_t)*8)    /* This test must be static */
-        {
-            *op++ = fast ? FSE_decodeSymbolFast(&state1, &bitD) : FSE_decodeSymbol(&state1, &bitD);
-            *op++ = fast ? FSE_decodeSymbolFast(&state2, &bitD) : FSE_decodeSymbol(&state2, &bitD);
-        }
-    }
+/* fake CTable, for rle (100% always same symbol) input */
+size_t FSE_buildCTable_rle (void* CTable, BYTE symbolValue)
+{
+    const unsigned tableSize = 1;
+    U16* tableU16 = ( (U16*) CTable) + 2;
+    FSE_symbolCompressionTransform* symbolTT = (FSE_symbolCompressionTransform*) ((U32*)CTable + 2);
 
-    /* tail */
-    while (1)
-    {
-        if ( (FSE_reloadDStream(&bitD)>2) || (op==omax) || (FSE_endOfDState(&state1) && FSE_endOfDStream(&bitD)) )
-            break;
+    /* safety checks */
+    if (((size_t)CTable) & 3) return (size_t)-FSE_ERROR_GENERIC;   /* Must be 4 bytes aligned */
 
-        *op++ = fast ? FSE_decodeSymbolFast(&state1, &bitD) : FSE_decodeSymbol(&state1, &bitD);
+    /* header */
+    tableU16[-2] = (U16) 0;
+    tableU16[-1] = (U16) symbolValue;
 
-        if ( (FSE_reloadDStream(&bitD)>2) || (op==omax) || (FSE_endOfDState(&state2) && FSE_endOfDStream(&bitD)) )
-            break;
+    /* Build table */
+    tableU16[0] = 0;
+    tableU16[1] = 0;   /* just in case */
 
-        *op++ = fast ? FSE_decodeSymbolFast(&state2, &bitD) : FSE_decodeSymbol(&state2, &bitD);
+    /* Build Symbol Transformation Table */
+    {
+        symbolTT[symbolValue].minBitsOut = 0;
+        symbolTT[symbolValue].deltaFindState = 0;
+        symbolTT[symbolValue].maxState = (U16)(2*tableSize-1);   /* ensures state <= maxState */
     }
 
-    /* end ? */
-    if (FSE_endOfDStream(&bitD) && FSE_endOfDState(&state1) && FSE_endOfDState(&state2) )
-        return op-ostart;
+    return 0;
+}
 
-    if (op==omax) return (size_t)-FSE_ERROR_dstSize_tooSmall;   /* dst buffer is full, but cSrc unfinished */
 
-    return (size_t)-FSE_ERROR_corruptionDetected;
+void FSE_initCStream(FSE_CStream_t* bitC, void* start)
+{
+    bitC->bitContainer = 0;
+    bitC->bitPos = 0;   /* reserved for unusedBits */
+    bitC->startPtr = (char*)start;
+    bitC->ptr = bitC->startPtr;
 }
 
+void FSE_initCState(FSE_CState_t* statePtr, const void* CTable)
+{
+    const U32 tableLog = ( (U16*) CTable) [0];
+    statePtr->value = (ptrdiff_t)1<<tableLog;
+    statePtr->stateTable = ((const U16*) CTable) + 2;
+    statePtr->symbolTT = (const U32*)CTable + 1 + (tableLog ? (1<<(tableLog-1)) : 1);
+    statePtr->stateLog = tableLog;
+}
 
-size_t FSE_decompress_usingDTable(void* dst, size_t originalSize,
-                            const void* cSrc, size_t cSrcSize,
-                            const void* DTable, size_t fastMode)
+void FSE_addBits(FSE_CStream_t* bitC, size_t value, unsigned nbBits)
 {
-    /* select fast mode (static) */
-    if (fastMode) return FSE_decompress_usingDTable_generic(dst, originalSize, cSrc, cSrcSize, DTable, 1);
-    return FSE_decompress_usingDTable_generic(dst, originalSize, cSrc, cSrcSize, DTable, 0);
+    static const unsigned mask[] = { 0, 1, 3, 7, 0xF, 0x1F, 0x3F, 0x7F, 0xFF, 0x1FF, 0x3FF, 0x7FF, 0xFFF, 0x1FFF, 0x3FFF, 0x7FFF, 0xFFFF, 0x1FFFF, 0x3FFFF, 0x7FFFF, 0xFFFFF, 0x1FFFFF, 0x3FFFFF, 0x7FFFFF,  0xFFFFFF, 0x1FFFFFF };   /* up to 25 bits */
+    bitC->bitContainer |= (value & mask[nbBits]) << bitC->bitPos;
+    bitC->bitPos += nbBits;
+}
+
+void FSE_encodeByte(FSE_CStream_t* bitC, FSE_CState_t* statePtr, BYTE symbol)
+{
+    const FSE_symbolCompressionTransform* const symbolTT = (const FSE_symbolCompressionTransform*) statePtr->symbolTT;
+    const U16* const stateTable = (const U16*) statePtr->stateTable;
+    int nbBitsOut  = symbolTT[symbol].minBitsOut;
+    nbBitsOut -= (int)((symbolTT[symbol].maxState - statePtr->value) >> 31);
+    FSE_addBits(bitC, statePtr->value, nbBitsOut);
+    statePtr->value = stateTable[ (statePtr->value >> nbBitsOut) + symbolTT[symbol].deltaFindState];
 }
 
+void FSE_flushBits(FSE_CStream_t* bitC)
+{
+    size_t nbBytes = bitC->bitPos >> 3;
+    FSE_writeLEST(bitC->ptr, bitC->bitContainer);
+    bitC->bitPos &= 7;
+    bitC->ptr += nbBytes;
+    bitC->bitContainer >>= nbBytes*8;
+}
 
-size_t FSE_decompress(void* dst, size_t maxDstSize, const void* cSrc, size_t cSrcSize)
+void FSE_flushCState(FSE_CStream_t* bitC, const FSE_CState_t* statePtr)
 {
-    const BYTE* const istart = (const BYTE*)cSrc;
-    const BYTE* ip = istart;
-    short counting[FSE_MAX_SYMBOL_VALUE+1];
-    FSE_decode_t DTable[FSE_DTABLE_SIZE_U32(FSE_MAX_TABLELOG)];
-    unsigned maxSymbolValue = FSE_MAX_SYMBOL_VALUE;
-    unsigned tableLog;
-    size_t errorCode, fastMode;
+    FSE_addBits(bitC, statePtr->value, statePtr->stateLog);
+    FSE_flushBits(bitC);
+}
 
-    if (cSrcSize<2) return (size_t)-FSE_ERROR_srcSize_wrong;   /* too small input size */
 
-    /* normal FSE decoding mode */
-    errorCode = FSE_readHeader (counting, &maxSymbolValue, &tableLog, istart, cSrcSize);
-    if (FSE_isError(errorCode)) return errorCode;
-    if (errorCode >= cSrcSize) return (size_t)-FSE_ERROR_srcSize_wrong;   /* too small input size */
-    ip += errorCode;
-    cSrcSize -= errorCode;
+size_t FSE_closeCStream(FSE_CStream_t* bitC)
+{
+    char* endPtr;
 
-    fastMode = FSE_buildDTable (DTable, counting, maxSymbolValue, tableLog);
-    if (FSE_isError(fastMode)) return fastMode;
+    FSE_addBits(bitC, 1, 1);
+    FSE_flushBits(bitC);
 
-    /* always return, even if it is an error code */
-    return FSE_decompress_usingDTable (dst, maxDstSize, ip, cSrcSize, DTable, fastMode);
+    endPtr = bitC->ptr;
+    endPtr += bitC->bitPos > 0;
+
+    return (endPtr - bitC->startPtr);
 }
 
 
-#endif   /* FSE_COMMONDEFS_ONLY */
+size_t FSE_compress_usingCTable (void* dst, size_t dstSize,
+                           const void* src, size_t srcSize,
+                           const void* CTable)
+{
+    const BYTE* const istart = (const BYTE*) src;
+    const BYTE* ip;
+    const BYTE* const iend = istart + srcSize;
 
-/*
-  2nd part of the file
-  designed to be included
-  for type-specific functions (template equivalent in C)
-  Objective is to write such functions only once, for better maintenance
-*/
+    FSE_CStream_t bitC;
+    FSE_CState_t CState1, CState2;
 
-/* safety checks */
-#ifndef FSE_FUNCTION_EXTENSION
-#  error "FSE_FUNCTION_EXTENSION must be defined"
-#endif
-#ifndef FSE_FUNCTION_TYPE
-#  error "FSE_FUNCTION_TYPE must be defined"
-#endif
-
-/* Function names */
-#define FSE_CAT(X,Y) X##Y
-#define FSE_FUNCTION_NAME(X,Y) FSE_CAT(X,Y)
-#define FSE_TYPE_NAME(X,Y) FSE_CAT(X,Y)
 
+    /* init */
+    (void)dstSize;   /* objective : ensure it fits into dstBuffer (Todo) */
+    FSE_initCStream(&bitC, dst);
+    FSE_initCState(&CState1, CTable);
+    CState2 = CState1;
 
-/* Function templates */
-size_t FSE_FUNCTION_NAME(FSE_count_generic, FSE_FUNCTION_EXTENSION) (unsigned* count, const FSE_FUNCTION_TYPE* source, size_t sourceSize, unsigned* maxSymbolValuePtr, unsigned safe)
-{
-    const FSE_FUNCTION_TYPE* ip = source;
-    const FSE_FUNCTION_TYPE* const iend = ip+sourceSize;
-    unsigned maxSymbolValue = *maxSymbolValuePtr;
-    unsigned max=0;
-    int s;
-
-    U32 Counting1[FSE_MAX_SYMBOL_VALUE+1] = { 0 };
-    U32 Counting2[FSE_MAX_SYMBOL_VALUE+1] = { 0 };
-    U32 Counting3[FSE_MAX_SYMBOL_VALUE+1] = { 0 };
-    U32 Counting4[FSE_MAX_SYMBOL_VALUE+1] = { 0 };
+    ip=iend;
 
-    /* safety checks */
-    if (!sourceSize)
+    /* join to even */
+    if (srcSize & 1)
     {
-        memset(count, 0, (maxSymbolValue + 1) * sizeof(FSE_FUNCTION_TYPE));
-        *maxSymbolValuePtr = 0;
-        return 0;
+        FSE_encodeByte(&bitC, &CState1, *--ip);
+        FSE_flushBits(&bitC);
     }
-    if (maxSymbolValue > FSE_MAX_SYMBOL_VALUE) return (size_t)-FSE_ERROR_GENERIC;   /* maxSymbolValue too large : unsupported */
-    if (!maxSymbolValue) maxSymbolValue = FSE_MAX_SYMBOL_VALUE;            /* 0 == default */
 
-    if ((safe) || (sizeof(FSE_FUNCTION_TYPE)>1))
+    /* join to mod 4 */
+    if ((sizeof(size_t)*8 > FSE_MAX_TABLELOG*4+7 ) && (srcSize & 2))   /* test bit 2 */
     {
-        /* check input values, to avoid count table overflow */
-        while (ip < iend-3)
-        {
-            if (*ip>maxSymbolValue) return (size_t)-FSE_ERROR_GENERIC; Counting1[*ip++]++;
-            if (*ip>maxSymbolValue) return (size_t)-FSE_ERROR_GENERIC; Counting2[*ip++]++;
-            if (*ip>maxSymbolValue) return (size_t)-FSE_ERROR_GENERIC; Counting3[*ip++]++;
-            if (*ip>maxSymbolValue) return (size_t)-FSE_ERROR_GENERIC; Counting4[*ip++]++;
-        }
+        FSE_encodeByte(&bitC, &CState2, *--ip);
+        FSE_encodeByte(&bitC, &CState1, *--ip);
+        FSE_flushBits(&bitC);
     }
-    else
+
+    /* 2 or 4 encoding per loop */
+    while (ip>istart)
     {
-        U32 cached = FSE_read32(ip); ip += 4;
-        while (ip < iend-15)
+        FSE_encodeByte(&bitC, &CState2, *--ip);
+
+        if (sizeof(size_t)*8 < FSE_MAX_TABLELOG*2+7 )   /* this test must be static */
+            FSE_flushBits(&bitC);
+
+        FSE_encodeByte(&bitC, &CState1, *--ip);
+
+        if (sizeof(size_t)*8 > FSE_MAX_TABLELOG*4+7 )   /* this test must be static */
         {
-            U32 c = cached; cached = FSE_read32(ip); ip += 4;
-            Counting1[(BYTE) c     ]++;
-            Counting2[(BYTE)(c>>8) ]++;
-            Counting3[(BYTE)(c>>16)]++;
-            Counting4[       c>>24 ]++;
-            c = cached; cached = FSE_read32(ip); ip += 4;
-            Counting1[(BYTE) c     ]++;
-            Counting2[(BYTE)(c>>8) ]++;
-            Counting3[(BYTE)(c>>16)]++;
-            Counting4[       c>>24 ]++;
-            c = cached; cached = FSE_read32(ip); ip += 4;
-            Counting1[(BYTE) c     ]++;
-            Counting2[(BYTE)(c>>8) ]++;
-            Counting3[(BYTE)(c>>16)]++;
-            Counting4[       c>>24 ]++;
-            c = cached; cached = FSE_read32(ip); ip += 4;
-            Counting1[(BYTE) c     ]++;
-            Counting2[(BYTE)(c>>8) ]++;
-            Counting3[(BYTE)(c>>16)]++;
-            Counting4[       c>>24 ]++;
+            FSE_encodeByte(&bitC, &CState2, *--ip);
+            FSE_encodeByte(&bitC, &CState1, *--ip);
         }
-        ip-=4;
-    }
-
-    /* finish last symbols */
-    while (ip<iend) { if ((safe) && (*ip>maxSymbolValue)) return (size_t)-FSE_ERROR_GENERIC; Counting1[*ip++]++; }
 
-    for (s=0; s<=(int)maxSymbolValue; s++)
-    {
-        count[s] = Counting1[s] + Counting2[s] + Counting3[s] + Counting4[s];
-        if (count[s] > max) max = count[s];
+        FSE_flushBits(&bitC);
     }
 
-    while (!count[maxSymbolValue]) maxSymbolValue--;
-    *maxSymbolValuePtr = maxSymbolValue;
-    return (int)max;
-}
-
-/* hidden fast variant (unsafe) */
-size_t FSE_FUNCTION_NAME(FSE_countFast, FSE_FUNCTION_EXTENSION) (unsigned* count, const FSE_FUNCTION_TYPE* source, size_t sourceSize, unsigned* maxSymbolValuePtr)
-{
-    return FSE_FUNCTION_NAME(FSE_count_generic, FSE_FUNCTION_EXTENSION) (count, source, sourceSize, maxSymbolValuePtr, 0);
+    FSE_flushCState(&bitC, &CState2);
+    FSE_flushCState(&bitC, &CState1);
+    return FSE_closeCStream(&bitC);
 }
 
-size_t FSE_FUNCTION_NAME(FSE_count, FSE_FUNCTION_EXTENSION) (unsigned* count, const FSE_FUNCTION_TYPE* source, size_t sourceSize, unsigned* maxSymbolValuePtr)
-{
-    if ((sizeof(FSE_FUNCTION_TYPE)==1) && (*maxSymbolValuePtr >= 255))
-    {
-        *maxSymbolValuePtr = 255;
-        return FSE_FUNCTION_NAME(FSE_count_generic, FSE_FUNCTION_EXTENSION) (count, source, sourceSize, maxSymbolValuePtr, 0);
-    }
-    return FSE_FUNCTION_NAME(FSE_count_generic, FSE_FUNCTION_EXTENSION) (count, source, sourceSize, maxSymbolValuePtr, 1);
-}
 
+size_t FSE_compressBound(size_t size) { return FSE_COMPRESSBOUND(size); }
 
-static U32 FSE_tableStep(U32 tableSize) { return (tableSize>>1) + (tableSize>>3) + 3; }
 
-size_t FSE_FUNCTION_NAME(FSE_buildCTable, FSE_FUNCTION_EXTENSION)
-(void* CTable, const short* normalizedCounter, unsigned maxSymbolValue, unsigned tableLog)
+size_t FSE_compress2 (void* dst, size_t dstSize, const void* src, size_t srcSize, unsigned maxSymbolValue, unsigned tableLog)
 {
-    const unsigned tableSize = 1 << tableLog;
-    const unsigned tableMask = tableSize - 1;
-    U16* tableU16 = ( (U16*) CTable) + 2;
-    FSE_symbolCompressionTransform* symbolTT = (FSE_symbolCompressionTransform*) (((U32*)CTable) + 1 + (tableLog ? tableSize>>1 : 1) );
-    const unsigned step = FSE_tableStep(tableSize);
-    unsigned cumul[FSE_MAX_SYMBOL_VALUE+2];
-    U32 position = 0;
-    FSE_FUNCTION_TYPE tableSymbol[FSE_MAX_TABLESIZE];
-    U32 highThreshold = tableSize-1;
-    unsigned symbol;
-    unsigned i;
+    const BYTE* const istart = (const BYTE*) src;
+    const BYTE* ip = istart;
 
-    /* safety checks */
-    if (((size_t)CTable) & 3) return (size_t)-FSE_ERROR_GENERIC;   /* Must be allocated of 4 bytes boundaries */
+    BYTE* const ostart = (BYTE*) dst;
+    BYTE* op = ostart;
+    BYTE* const oend = ostart + dstSize;
 
-    /* header */
-    tableU16[-2] = (U16) tableLog;
-    tableU16[-1] = (U16) maxSymbolValue;
+    U32   count[FSE_MAX_SYMBOL_VALUE+1];
+    S16   norm[FSE_MAX_SYMBOL_VALUE+1];
+    CTable_max_t CTable;
+    size_t errorCode;
 
-    /* For explanations on how to distribute symbol values over the table :
-    *  http://fastcompression.blogspot.fr/2014/02/fse-distributing-symbol-values.html */
+    /* early out */
+    if (dstSize < FSE_compressBound(srcSize)) return (size_t)-FSE_ERROR_dstSize_tooSmall;
+    if (srcSize <= 1) return srcSize;  /* Uncompressed or RLE */
+    if (!maxSymbolValue) maxSymbolValue = FSE_MAX_SYMBOL_VALUE;
+    if (!tableLog) tableLog = FSE_DEFAULT_TABLELOG;
 
-    /* symbol start positions */
-    cumul[0] = 0;
-    for (i=1; i<=maxSymbolValue+1; i++)
-    {
-        if (normalizedCounter[i-1]==-1)   /* Low prob symbol */
-        {
-            cumul[i] = cumul[i-1] + 1;
-            tableSymbol[highThreshold--] = (FSE_FUNCTION_TYPE)(i-1);
-        }
-        else
-            cumul[i] = cumul[i-1] + normalizedCounter[i-1];
-    }
-    cumul[maxSymbolValue+1] = tableSize+1;
+    /* Scan input and build symbol stats */
+    errorCode = FSE_count (count, ip, srcSize, &maxSymbolValue);
+    if (FSE_isError(errorCode)) return errorCode;
+    if (errorCode == srcSize) return 1;
+    if (errorCode < (srcSize >> 7)) return 0;   /* Heuristic : not compressible enough */
 
-    /* Spread symbols */
-    for (symbol=0; symbol<=maxSymbolValue; symbol++)
-    {
-        int nbOccurences;
-        for (nbOccurences=0; nbOccurences<normalizedCounter[symbol]; nbOccurences++)
-        {
-            tableSymbol[position] = (FSE_FUNCTION_TYPE)symbol;
-            position = (position + step) & tableMask;
-            while (position > highThreshold) position = (position + step) & tableMask;   /* Lowprob area */
-        }
-    }
+    tableLog = FSE_optimalTableLog(tableLog, srcSize, maxSymbolValue);
+    errorCode = FSE_normalizeCount (norm, tableLog, count, srcSize, maxSymbolValue);
+    if (FSE_isError(errorCode)) return errorCode;
 
-    if (position!=0) return (size_t)-FSE_ERROR_GENERIC;   /* Must have gone through all positions */
+    /* Write table description header */
+    errorCode = FSE_writeHeader (op, FSE_MAX_HEADERSIZE, norm, maxSymbolValue, tableLog);
+    if (FSE_isError(errorCode)) return errorCode;
+    op += errorCode;
 
-    /* Build table */
-    for (i=0; i<tableSize; i++)
-    {
-        FSE_FUNCTION_TYPE s = tableSymbol[i];
-        tableU16[cumul[s]++] = (U16) (tableSize+i);   // Table U16 : sorted by symbol order; gives next state value
-    }
+    /* Compress */
+    errorCode = FSE_buildCTable (&CTable, norm, maxSymbolValue, tableLog);
+    if (FSE_isError(errorCode)) return errorCode;
+    op += FSE_compress_usingCTable(op, oend - op, ip, srcSize, &CTable);
 
-    // Build Symbol Transformation Table
-    {
-        unsigned s;
-        unsigned total = 0;
-        for (s=0; s<=maxSymbolValue; s++)
-        {
-            switch (normalizedCounter[s])
-            {
-            case 0:
-                break;
-            case -1:
-            case 1:
-                symbolTT[s].minBitsOut = (BYTE)tableLog;
-                symbolTT[s].deltaFindState = total - 1;
-                total ++;
-                symbolTT[s].maxState = (U16)( (tableSize*2) - 1);   /* ensures state <= maxState */
-                break;
-            default :
-                symbolTT[s].minBitsOut = (BYTE)( (tableLog-1) - FSE_highbit32 (normalizedCounter[s]-1) );
-                symbolTT[s].deltaFindState = total - normalizedCounter[s];
-                total +=  normalizedCounter[s];
-                symbolTT[s].maxState = (U16)( (normalizedCounter[s] << (symbolTT[s].minBitsOut+1)) - 1);
-            }
-        }
-    }
+    /* check compressibility */
+    if ( (size_t)(op-ostart) >= srcSize-1 )
+        return 0;
 
-    return 0;
+    return op-ostart;
 }
 
 
-#define FSE_DECODE_TYPE FSE_TYPE_NAME(FSE_decode_t, FSE_FUNCTION_EXTENSION)
-
-void* FSE_FUNCTION_NAME(FSE_createDTable, FSE_FUNCTION_EXTENSION) (unsigned tableLog)
-{
-    if (tableLog > FSE_TABLELOG_ABSOLUTE_MAX) tableLog = FSE_TABLELOG_ABSOLUTE_MAX;
-    return malloc( ((size_t)1<<tableLog) * sizeof (FSE_DECODE_TYPE) );
-}
-
-void FSE_FUNCTION_NAME(FSE_freeDTable, FSE_FUNCTION_EXTENSION) (void* DTable)
+size_t FSE_compress (void* dst, size_t dstSize, const void* src, size_t srcSize)
 {
-    free(DTable);
+    return FSE_compress2(dst, dstSize, src, (U32)srcSize, FSE_MAX_SYMBOL_VALUE, FSE_DEFAULT_TABLELOG);
 }
 
 
-size_t FSE_FUNCTION_NAME(FSE_buildDTable, FSE_FUNCTION_EXTENSION)
-(void* DTable, const short* const normalizedCounter, unsigned maxSymbolValue, unsigned tableLog)
+/*********************************************************
+*  Decompression (Byte symbols)
+*********************************************************/
+typedef struct
 {
-    U32* const base32 = (U32*)DTable;
-    FSE_DECODE_TYPE* const tableDecode = (FSE_DECODE_TYPE*) (base32+1);
-    const U32 tableSize = 1 << tableLog;
-    const U32 tableMask = tableSize-1;
-    const U32 step = FSE_tableStep(tableSize);
-    U16 symbolNext[FSE_MAX_SYMBOL_VALUE+1];
-    U32 position = 0;
-    U32 highThreshold = tableSize-1;
-    const S16 largeLimit= 1 << (tableLog-1);
-    U32 noLarge = 1;
-    U32 s;
+    U16  newState;
+    BYTE symbol;
+    BYTE nbBits;
+} FSE_decode_t;   /* size == U32 */
 
-    /* Sanity Checks */
-    if (maxSymbolValue > FSE_MAX_SYMBOL_VALUE) return (size_t)-FSE_ERROR_maxSymbolValue_tooLarge;
-    if (tableLog > FSE_MAX_TABLELOG) return (size_t)-FSE_ERROR_tableLog_tooLarge;
+/* Specific corner case : RLE compression */
+size_t FSE_decompressRLE(void* dst, size_t originalSize,
+                   const void* cSrc, size_t cSrcSize)
+{
+    if (cSrcSize != 1) return (size_t)-FSE_ERROR_srcSize_wrong;
+    memset(dst, *(BYTE*)cSrc, originalSize);
+    return originalSize;
+}
 
-    /* Init, lay down lowprob symbols */
-    base32[0] = tableLog;
-    for (s=0; s<=maxSymbolValue; s++)
-    {
-        if (normalizedCounter[s]==-1)
-        {
-            tableDecode[highThreshold--].symbol = (FSE_FUNCTION_TYPE)s;
-            symbolNext[s] = 1;
-        }
-        else
-        {
-            if (normalizedCounter[s] >= largeLimit) noLarge=0;
-            symbolNext[s] = normalizedCounter[s];
-        }
-    }
 
-    /* Spread symbols */
+size_t FSE_buildDTable_rle (void* DTable, BYTE symbolValue)
+{
+    U32* const base32 = (U32*)DTable;
+    FSE_decode_t* const cell = (FSE_decode_t*)(base32 + 1);
+
+    /* Sanity check */
+    if (((size_t)DTable) & 3) return (size_t)-FSE_ERROR_GENERIC;   /* Must be allocated of 4 bytes boundaries */
+
+    base32[0] = 0;
+
+    cell->newState = 0;
+    cell->symbol = symbolValue;
+    cell->nbBits = 0;
+
+    return 0;
+}
+
+
+size_t FSE_buildDTable_raw (void* DTable, unsigned nbBits)
+{
+    U32* const base32 = (U32*)DTable;
+    FSE_decode_t* dinfo = (FSE_decode_t*)(base32 + 1);
+    const unsigned tableSize = 1 << nbBits;
+    const unsigned tableMask = tableSize - 1;
+    const unsigned maxSymbolValue = tableMask;
+    unsigned s;
+
+    /* Sanity checks */
+    if (nbBits < 1) return (size_t)-FSE_ERROR_GENERIC;             /* min size */
+    if (((size_t)DTable) & 3) return (size_t)-FSE_ERROR_GENERIC;   /* Must be allocated of 4 bytes boundaries */
+
+    /* Build Decoding Table */
+    base32[0] = nbBits;
     for (s=0; s<=maxSymbolValue; s++)
     {
-        int i;
-        for (i=0; i<normalizedCounter[s]; i++)
-        {
-            tableDecode[position].symbol = (FSE_FUNCTION_TYPE)s;
-            position = (position + step) & tableMask;
-            while (position > highThreshold) position = (position + step) & tableMask;   /* lowprob area */
-        }
+        dinfo[s].newState = 0;
+        dinfo[s].symbol = (BYTE)s;
+        dinfo[s].nbBits = (BYTE)nbBits;
     }
 
-    if (position!=0) return (size_t)-FSE_ERROR_GENERIC;   /* position must reach all cells once, otherwise normalizedCounter is incorrect */
+    return 0;
+}
 
-    /* Build Decoding table */
+
+/* FSE_initDStream
+ * Initialize a FSE_DStream_t.
+ * srcBuffer must point at the beginning of an FSE block.
+ * The function result is the size of the FSE_block (== srcSize).
+ * If srcSize is too small, the function will return an errorCode;
+ */
+size_t FSE_initDStream(FSE_DStream_t* bitD, const void* srcBuffer, size_t srcSize)
+{
+    if (srcSize < 1) return (size_t)-FSE_ERROR_srcSize_wrong;
+
+    if (srcSize >=  sizeof(bitD_t))
     {
-        U32 i;
-        for (i=0; i<tableSize; i++)
+        U32 contain32;
+        bitD->start = (char*)srcBuffer;
+        bitD->ptr   = (char*)srcBuffer + srcSize - sizeof(bitD_t);
+        bitD->bitContainer = FSE_readLEST(bitD->ptr);
+        contain32 = ((BYTE*)srcBuffer)[srcSize-1];
+        if (contain32 == 0) return (size_t)-FSE_ERROR_GENERIC;   /* stop bit not present */
+        bitD->bitsConsumed = 8 - FSE_highbit32(contain32);
+    }
+    else
+    {
+        U32 contain32;
+        bitD->start = (char*)srcBuffer;
+        bitD->ptr   = bitD->start;
+        bitD->bitContainer = *(BYTE*)(bitD->start);
+        switch(srcSize)
         {
-            FSE_FUNCTION_TYPE symbol = tableDecode[i].symbol;
-            U16 nextState = symbolNext[symbol]++;
-            tableDecode[i].nbBits = (BYTE) (tableLog - FSE_highbit32 ((U32)nextState) );
-            tableDecode[i].newState = (U16) ( (nextState << tableDecode[i].nbBits) - tableSize);
+            case 7: bitD->bitContainer += (bitD_t)(((BYTE*)(bitD->start))[6]) << (sizeof(bitD_t)*8 - 16);
+            case 6: bitD->bitContainer += (bitD_t)(((BYTE*)(bitD->start))[5]) << (sizeof(bitD_t)*8 - 24);
+            case 5: bitD->bitContainer += (bitD_t)(((BYTE*)(bitD->start))[4]) << (sizeof(bitD_t)*8 - 32);
+            case 4: bitD->bitContainer += (bitD_t)(((BYTE*)(bitD->start))[3]) << 24;
+            case 3: bitD->bitContainer += (bitD_t)(((BYTE*)(bitD->start))[2]) << 16;
+            case 2: bitD->bitContainer += (bitD_t)(((BYTE*)(bitD->start))[1]) <<  8;
+            default:;
         }
+        contain32 = ((BYTE*)srcBuffer)[srcSize-1];
+        if (contain32 == 0) return (size_t)-FSE_ERROR_GENERIC;   /* stop bit not present */
+        bitD->bitsConsumed = 8 - FSE_highbit32(contain32);
+        bitD->bitsConsumed += (U32)(sizeof(bitD_t) - srcSize)*8;
     }
 
-    return noLarge;
+    return srcSize;
 }
 
-/* <<<<< fse.c EOF */
-
-
-/* >>>>> zstd.c */
-
-/****************************************************************
-*  Tuning parameters
-*****************************************************************/
-/* MEMORY_USAGE :
-*  Memory usage formula : N->2^N Bytes (examples : 10 -> 1KB; 12 -> 4KB ; 16 -> 64KB; 20 -> 1MB; etc.)
-*  Increasing memory usage improves compression ratio
-*  Reduced memory usage can improve speed, due to cache effect */
-#define ZSTD_MEMORY_USAGE 17
-
 
-/**************************************
-   CPU Feature Detection
-**************************************/
-/*
- * Automated efficient unaligned memory access detection
- * Based on known hardware architectures
- * This list will be updated thanks to feedbacks
+/* FSE_readBits
+ * Read next n bits from the bitContainer.
+ * Use the fast variant *only* if n > 0.
+ * Note : for this function to work properly on 32-bits, don't read more than maxNbBits==25
+ * return : value extracted.
  */
-#if defined(CPU_HAS_EFFICIENT_UNALIGNED_MEMORY_ACCESS) \
-    || defined(__ARM_FEATURE_UNALIGNED) \
-    || defined(__i386__) || defined(__x86_64__) \
-    || defined(_M_IX86) || defined(_M_X64) \
-    || defined(__ARM_ARCH_7__) || defined(__ARM_ARCH_8__) \
-    || (defined(_M_ARM) && (_M_ARM >= 7))
-#  define ZSTD_UNALIGNED_ACCESS 1
-#else
-#  define ZSTD_UNALIGNED_ACCESS 0
-#endif
+bitD_t FSE_readBits(FSE_DStream_t* bitD, U32 nbBits)
+{
+    bitD_t value = ((bitD->bitContainer << bitD->bitsConsumed) >> 1) >> (((sizeof(bitD_t)*8)-1)-nbBits);
+    bitD->bitsConsumed += nbBits;
+    return value;
+}
 
-#ifndef MEM_ACCESS_MODULE
-#define MEM_ACCESS_MODULE
-/********************************************************
-*  Basic Types
-*********************************************************/
-#if defined (__STDC_VERSION__) && __STDC_VERSION__ >= 199901L   /* C99 */
-typedef  uint8_t BYTE;
-typedef uint16_t U16;
-typedef  int16_t S16;
-typedef uint32_t U32;
-typedef  int32_t S32;
-typedef uint64_t U64;
-#else
-typedef unsigned char       BYTE;
-typedef unsigned short      U16;
-typedef   signed short      S16;
-typedef unsigned int        U32;
-typedef   signed int        S32;
-typedef unsigned long long  U64;
-#endif
+bitD_t FSE_readBitsFast(FSE_DStream_t* bitD, U32 nbBits)   /* only if nbBits >= 1 */
+{
+    bitD_t value = (bitD->bitContainer << bitD->bitsConsumed) >> ((sizeof(bitD_t)*8)-nbBits);
+    bitD->bitsConsumed += nbBits;
+    return value;
+}
 
-#endif   /* MEM_ACCESS_MODULE */
+unsigned FSE_reloadDStream(FSE_DStream_t* bitD)
+{
+    if (bitD->ptr >= bitD->start + sizeof(bitD_t))
+    {
+        bitD->ptr -= bitD->bitsConsumed >> 3;
+        bitD->bitsConsumed &= 7;
+        bitD->bitContainer = FSE_readLEST(bitD->ptr);
+        return 0;
+    }
+    if (bitD->ptr == bitD->start)
+    {
+        if (bitD->bitsConsumed < sizeof(bitD_t)*8) return 1;
+        if (bitD->bitsConsumed == sizeof(bitD_t)*8) return 2;
+        return 3;
+    }
+    {
+        U32 nbBytes = bitD->bitsConsumed >> 3;
+        if (bitD->ptr - nbBytes < bitD->start)
+            nbBytes = (U32)(bitD->ptr - bitD->start);  /* note : necessarily ptr > start */
+        bitD->ptr -= nbBytes;
+        bitD->bitsConsumed -= nbBytes*8;
+        bitD->bitContainer = FSE_readLEST(bitD->ptr);   /* note : necessarily srcSize > sizeof(bitD) */
+        return (bitD->ptr == bitD->start);
+    }
+}
 
-/********************************************************
-*  Constants
-*********************************************************/
-static const U32 ZSTD_magicNumber = 0xFD2FB51C;   /* Initial (limited) frame format */
 
-#define HASH_LOG (ZSTD_MEMORY_USAGE - 2)
-#define HASH_TABLESIZE (1 << HASH_LOG)
-#define HASH_MASK (HASH_TABLESIZE - 1)
+void FSE_initDState(FSE_DState_t* DStatePtr, FSE_DStream_t* bitD, const void* DTable)
+{
+    const U32* const base32 = (const U32*)DTable;
+    DStatePtr->state = FSE_readBits(bitD, base32[0]);
+    FSE_reloadDStream(bitD);
+    DStatePtr->table = base32 + 1;
+}
 
-#define KNUTH 2654435761
+BYTE FSE_decodeSymbol(FSE_DState_t* DStatePtr, FSE_DStream_t* bitD)
+{
+    const FSE_decode_t DInfo = ((const FSE_decode_t*)(DStatePtr->table))[DStatePtr->state];
+    const U32  nbBits = DInfo.nbBits;
+    BYTE symbol = DInfo.symbol;
+    bitD_t lowBits = FSE_readBits(bitD, nbBits);
 
-#define BIT7 128
-#define BIT6  64
-#define BIT5  32
-#define BIT4  16
+    DStatePtr->state = DInfo.newState + lowBits;
+    return symbol;
+}
 
-#ifndef KB
-#define KB *(1 <<10)
-#endif
-#ifndef MB
-#define MB *(1 <<20)
-#endif
-#ifndef GB
-#define GB *(1U<<30)
-#endif
-
-#define BLOCKSIZE (128 KB)                 /* define, for static allocation */
-static const U32 g_maxDistance = 4 * BLOCKSIZE;
-static const U32 g_maxLimit = 1 GB;
-static const U32 g_searchStrength = 8;
+BYTE FSE_decodeSymbolFast(FSE_DState_t* DStatePtr, FSE_DStream_t* bitD)
+{
+    const FSE_decode_t DInfo = ((const FSE_decode_t*)(DStatePtr->table))[DStatePtr->state];
+    const U32 nbBits = DInfo.nbBits;
+    BYTE symbol = DInfo.symbol;
+    bitD_t lowBits = FSE_readBitsFast(bitD, nbBits);
 
-#define WORKPLACESIZE (BLOCKSIZE*11/4)
-#define MINMATCH 4
-#define MLbits   7
-#define LLbits   6
-#define Offbits  5
-#define MaxML  ((1<<MLbits )-1)
-#define MaxLL  ((1<<LLbits )-1)
-#define MaxOff ((1<<Offbits)-1)
-#define LitFSELog  11
-#define MLFSELog   10
-#define LLFSELog   10
-#define OffFSELog   9
+    DStatePtr->state = DInfo.newState + lowBits;
+    return symbol;
+}
 
-#define LITERAL_NOENTROPY 63
-#define COMMAND_NOENTROPY 7   /* to remove */
+/* FSE_endOfDStream
+   Tells if bitD has reached end of bitStream or not */
 
-static const size_t ZSTD_blockHeaderSize = 3;
-static const size_t ZSTD_frameHeaderSize = 4;
+unsigned FSE_endOfDStream(const FSE_DStream_t* bitD)
+{
+    return FSE_reloadDStream((FSE_DStream_t*)bitD)==2;
+}
 
+unsigned FSE_endOfDState(const FSE_DState_t* statePtr)
+{
+    return statePtr->state == 0;
+}
 
-/********************************************************
-*  Memory operations
-*********************************************************/
-static unsigned ZSTD_32bits(void) { return sizeof(void*)==4; }
-static unsigned ZSTD_64bits(void) { return sizeof(void*)==8; }
 
-static unsigned ZSTD_isLittleEndian(void)
+FORCE_INLINE size_t FSE_decompress_usingDTable_generic(
+          void* dst, size_t maxDstSize,
+    const void* cSrc, size_t cSrcSize,
+    const void* DTable, unsigned fast)
 {
-    const union { U32 i; BYTE c[4]; } one = { 1 };   /* don't use static : performance detrimental  */
-    return one.c[0];
-}
+    BYTE* const ostart = (BYTE*) dst;
+    BYTE* op = ostart;
+    BYTE* const omax = op + maxDstSize;
+    BYTE* const olimit = omax-3;
 
-static U16    ZSTD_read16(const void* p) { return *(U16*)p; }
+    FSE_DStream_t bitD;
+    FSE_DState_t state1, state2;
+    size_t errorCode;
 
-static U32    ZSTD_read32(const void* p) { return *(U32*)p; }
+    /* Init */
+    errorCode = FSE_initDStream(&bitD, cSrc, cSrcSize);   /* replaced last arg by maxCompressed Size */
+    if (FSE_isError(errorCode)) return errorCode;
 
-static size_t ZSTD_read_ARCH(const void* p) { return *(size_t*)p; }
+    FSE_initDState(&state1, &bitD, DTable);
+    FSE_initDState(&state2, &bitD, DTable);
 
-static void   ZSTD_copy4(void* dst, const void* src) { memcpy(dst, src, 4); }
 
-static void   ZSTD_copy8(void* dst, const void* src) { memcpy(dst, src, 8); }
+    /* 2 symbols per loop */
+    while (!FSE_reloadDStream(&bitD) && (op<olimit))
+    {
+        *op++ = fast ? FSE_decodeSymbolFast(&state1, &bitD) : FSE_decodeSymbol(&state1, &bitD);
 
-#define COPY8(d,s)    { ZSTD_copy8(d,s); d+=8; s+=8; }
+        if (FSE_MAX_TABLELOG*2+7 > sizeof(bitD_t)*8)    /* This test must be static */
+            FSE_reloadDStream(&bitD);
 
-static void ZSTD_wildcopy(void* dst, const void* src, size_t length)
-{
-    const BYTE* ip = (const BYTE*)src;
-    BYTE* op = (BYTE*)dst;
-    BYTE* const oend = op + length;
-    while (op < oend) COPY8(op, ip);
-}
+        *op++ = fast ? FSE_decodeSymbolFast(&state2, &bitD) : FSE_decodeSymbol(&state2, &bitD);
 
-static U32 ZSTD_readLE32(const void* memPtr)
-{
-    if (ZSTD_isLittleEndian())
-        return ZSTD_read32(memPtr);
-    else
-    {
-        const BYTE* p = (const BYTE*)memPtr;
-        return (U32)((U32)p[0] + ((U32)p[1]<<8) + ((U32)p[2]<<16) + ((U32)p[3]<<24));
+        if (FSE_MAX_TABLELOG*4+7 < sizeof(bitD_t)*8)    /* This test must be static */
+        {
+            *op++ = fast ? FSE_decodeSymbolFast(&state1, &bitD) : FSE_decodeSymbol(&state1, &bitD);
+            *op++ = fast ? FSE_decodeSymbolFast(&state2, &bitD) : FSE_decodeSymbol(&state2, &bitD);
+        }
     }
-}
 
-static void ZSTD_writeLE32(void* memPtr, U32 val32)
-{
-    if (ZSTD_isLittleEndian())
-    {
-        memcpy(memPtr, &val32, 4);
-    }
-    else
+    /* tail */
+    while (1)
     {
-        BYTE* p = (BYTE*)memPtr;
-        p[0] = (BYTE)val32;
-        p[1] = (BYTE)(val32>>8);
-        p[2] = (BYTE)(val32>>16);
-        p[3] = (BYTE)(val32>>24);
+        if ( (FSE_reloadDStream(&bitD)>2) || (op==omax) || (FSE_endOfDState(&state1) && FSE_endOfDStream(&bitD)) )
+            break;
+
+        *op++ = fast ? FSE_decodeSymbolFast(&state1, &bitD) : FSE_decodeSymbol(&state1, &bitD);
+
+        if ( (FSE_reloadDStream(&bitD)>2) || (op==omax) || (FSE_endOfDState(&state2) && FSE_endOfDStream(&bitD)) )
+            break;
+
+        *op++ = fast ? FSE_decodeSymbolFast(&state2, &bitD) : FSE_decodeSymbol(&state2, &bitD);
     }
-}
 
-static U32 ZSTD_readBE32(const void* memPtr)
-{
-    const BYTE* p = (const BYTE*)memPtr;
-    return (U32)(((U32)p[0]<<24) + ((U32)p[1]<<16) + ((U32)p[2]<<8) + ((U32)p[3]<<0));
-}
+    /* end ? */
+    if (FSE_endOfDStream(&bitD) && FSE_endOfDState(&state1) && FSE_endOfDState(&state2) )
+        return op-ostart;
 
-static void ZSTD_writeBE32(void* memPtr, U32 value)
-{
-    BYTE* const p = (BYTE* const) memPtr;
-    p[0] = (BYTE)(value>>24);
-    p[1] = (BYTE)(value>>16);
-    p[2] = (BYTE)(value>>8);
-    p[3] = (BYTE)(value>>0);
-}
+    if (op==omax) return (size_t)-FSE_ERROR_dstSize_tooSmall;   /* dst buffer is full, but cSrc unfinished */
 
-static size_t ZSTD_writeProgressive(void* ptr, size_t value)
-{
-    BYTE* const bStart = (BYTE* const)ptr;
-    BYTE* byte = bStart;
+    return (size_t)-FSE_ERROR_corruptionDetected;
+}
 
-    do
-    {
-        BYTE l = value & 127;
-        value >>= 7;
-        if (value) l += 128;
-        *byte++ = l;
-    } while (value);
 
-    return byte - bStart;
+size_t FSE_decompress_usingDTable(void* dst, size_t originalSize,
+                            const void* cSrc, size_t cSrcSize,
+                            const void* DTable, size_t fastMode)
+{
+    /* select fast mode (static) */
+    if (fastMode) return FSE_decompress_usingDTable_generic(dst, originalSize, cSrc, cSrcSize, DTable, 1);
+    return FSE_decompress_usingDTable_generic(dst, originalSize, cSrc, cSrcSize, DTable, 0);
 }
 
 
-static size_t ZSTD_readProgressive(size_t* result, const void* ptr)
+size_t FSE_decompress(void* dst, size_t maxDstSize, const void* cSrc, size_t cSrcSize)
 {
-    const BYTE* const bStart = (const BYTE* const)ptr;
-    const BYTE* byte = bStart;
-    size_t r = 0;
-    U32 shift = 0;
+    const BYTE* const istart = (const BYTE*)cSrc;
+    const BYTE* ip = istart;
+    short counting[FSE_MAX_SYMBOL_VALUE+1];
+    FSE_decode_t DTable[FSE_DTABLE_SIZE_U32(FSE_MAX_TABLELOG)];
+    unsigned maxSymbolValue = FSE_MAX_SYMBOL_VALUE;
+    unsigned tableLog;
+    size_t errorCode, fastMode;
 
-    do
-    {
-        r += (*byte & 127) << shift;
-        shift += 7;
-    } while (*byte++ & 128);
+    if (cSrcSize<2) return (size_t)-FSE_ERROR_srcSize_wrong;   /* too small input size */
 
-    *result = r;
-    return byte - bStart;
+    /* normal FSE decoding mode */
+    errorCode = FSE_readHeader (counting, &maxSymbolValue, &tableLog, istart, cSrcSize);
+    if (FSE_isError(errorCode)) return errorCode;
+    if (errorCode >= cSrcSize) return (size_t)-FSE_ERROR_srcSize_wrong;   /* too small input size */
+    ip += errorCode;
+    cSrcSize -= errorCode;
+
+    fastMode = FSE_buildDTable (DTable, counting, maxSymbolValue, tableLog);
+    if (FSE_isError(fastMode)) return fastMode;
+
+    /* always return, even if it is an error code */
+    return FSE_decompress_usingDTable (dst, maxDstSize, ip, cSrcSize, DTable, fastMode);
 }
 
 
-/**************************************
-*  Local structures
-***************************************/
-typedef enum { bt_compressed, bt_raw, bt_rle, bt_end } blockType_t;
+#endif   /* FSE_COMMONDEFS_ONLY */
 
-typedef struct
-{
-    blockType_t blockType;
-    U32 origSize;
-} blockProperties_t;
+/*
+  2nd part of the file
+  designed to be included
+  for type-specific functions (template equivalent in C)
+  Objective is to write such functions only once, for better maintenance
+*/
 
-typedef struct {
-    void* buffer;
-    U32*  offsetStart;
-    U32*  offset;
-    BYTE* litStart;
-    BYTE* lit;
-    BYTE* litLengthStart;
-    BYTE* litLength;
-    BYTE* matchLengthStart;
-    BYTE* matchLength;
-    BYTE* dumpsStart;
-    BYTE* dumps;
-} seqStore_t;
+/* safety checks */
+#ifndef FSE_FUNCTION_EXTENSION
+#  error "FSE_FUNCTION_EXTENSION must be defined"
+#endif
+#ifndef FSE_FUNCTION_TYPE
+#  error "FSE_FUNCTION_TYPE must be defined"
+#endif
 
-void ZSTD_resetSeqStore(seqStore_t* ssPtr)
-{
-    ssPtr->offset = ssPtr->offsetStart;
-    ssPtr->lit = ssPtr->litStart;
-    ssPtr->litLength = ssPtr->litLengthStart;
-    ssPtr->matchLength = ssPtr->matchLengthStart;
-    ssPtr->dumps = ssPtr->dumpsStart;
-}
+/* Function names */
+#define FSE_CAT(X,Y) X##Y
+#define FSE_FUNCTION_NAME(X,Y) FSE_CAT(X,Y)
+#define FSE_TYPE_NAME(X,Y) FSE_CAT(X,Y)
 
 
-typedef struct
+/* Function templates */
+size_t FSE_FUNCTION_NAME(FSE_count_generic, FSE_FUNCTION_EXTENSION) (unsigned* count, const FSE_FUNCTION_TYPE* source, size_t sourceSize, unsigned* maxSymbolValuePtr, unsigned safe)
 {
-    const BYTE* base;
-    U32 current;
-    U32 nextUpdate;
-    seqStore_t seqStore;
-#ifdef __AVX2__
-    __m256i hashTable[HASH_TABLESIZE>>3];
-#else
-    U32 hashTable[HASH_TABLESIZE];
-#endif
-} cctxi_t;
+    const FSE_FUNCTION_TYPE* ip = source;
+    const FSE_FUNCTION_TYPE* const iend = ip+sourceSize;
+    unsigned maxSymbolValue = *maxSymbolValuePtr;
+    unsigned max=0;
+    int s;
 
+    U32 Counting1[FSE_MAX_SYMBOL_VALUE+1] = { 0 };
+    U32 Counting2[FSE_MAX_SYMBOL_VALUE+1] = { 0 };
+    U32 Counting3[FSE_MAX_SYMBOL_VALUE+1] = { 0 };
+    U32 Counting4[FSE_MAX_SYMBOL_VALUE+1] = { 0 };
 
-ZSTD_cctx_t ZSTD_createCCtx(void)
-{
-    cctxi_t* ctx = (cctxi_t*) malloc( sizeof(cctxi_t) );
-    ctx->seqStore.buffer = malloc(WORKPLACESIZE);
-    ctx->seqStore.offsetStart = (U32*) (ctx->seqStore.buffer);
-    ctx->seqStore.litStart = (BYTE*) (ctx->seqStore.offsetStart + (BLOCKSIZE>>2));
-    ctx->seqStore.litLengthStart =  ctx->seqStore.litStart + BLOCKSIZE;
-    ctx->seqStore.matchLengthStart = ctx->seqStore.litLengthStart + (BLOCKSIZE>>2);
-    ctx->seqStore.dumpsStart = ctx->seqStore.matchLengthStart + (BLOCKSIZE>>2);
-    return (ZSTD_cctx_t)ctx;
-}
+    /* safety checks */
+    if (!sourceSize)
+    {
+        memset(count, 0, (maxSymbolValue + 1) * sizeof(FSE_FUNCTION_TYPE));
+        *maxSymbolValuePtr = 0;
+        return 0;
+    }
+    if (maxSymbolValue > FSE_MAX_SYMBOL_VALUE) return (size_t)-FSE_ERROR_GENERIC;   /* maxSymbolValue too large : unsupported */
+    if (!maxSymbolValue) maxSymbolValue = FSE_MAX_SYMBOL_VALUE;            /* 0 == default */
 
-void ZSTD_resetCCtx(ZSTD_cctx_t cctx)
-{
-    cctxi_t* ctx = (cctxi_t*)cctx;
-    ctx->base = NULL;
-    memset(ctx->hashTable, 0, HASH_TABLESIZE*4);
+    if ((safe) || (sizeof(FSE_FUNCTION_TYPE)>1))
+    {
+        /* check input values, to avoid count table overflow */
+        while (ip < iend-3)
+        {
+            if (*ip>maxSymbolValue) return (size_t)-FSE_ERROR_GENERIC; Counting1[*ip++]++;
+            if (*ip>maxSymbolValue) return (size_t)-FSE_ERROR_GENERIC; Counting2[*ip++]++;
+            if (*ip>maxSymbolValue) return (size_t)-FSE_ERROR_GENERIC; Counting3[*ip++]++;
+            if (*ip>maxSymbolValue) return (size_t)-FSE_ERROR_GENERIC; Counting4[*ip++]++;
+        }
+    }
+    else
+    {
+        U32 cached = FSE_read32(ip); ip += 4;
+        while (ip < iend-15)
+        {
+            U32 c = cached; cached = FSE_read32(ip); ip += 4;
+            Counting1[(BYTE) c     ]++;
+            Counting2[(BYTE)(c>>8) ]++;
+            Counting3[(BYTE)(c>>16)]++;
+            Counting4[       c>>24 ]++;
+            c = cached; cached = FSE_read32(ip); ip += 4;
+            Counting1[(BYTE) c     ]++;
+            Counting2[(BYTE)(c>>8) ]++;
+            Counting3[(BYTE)(c>>16)]++;
+            Counting4[       c>>24 ]++;
+            c = cached; cached = FSE_read32(ip); ip += 4;
+            Counting1[(BYTE) c     ]++;
+            Counting2[(BYTE)(c>>8) ]++;
+            Counting3[(BYTE)(c>>16)]++;
+            Counting4[       c>>24 ]++;
+            c = cached; cached = FSE_read32(ip); ip += 4;
+            Counting1[(BYTE) c     ]++;
+            Counting2[(BYTE)(c>>8) ]++;
+            Counting3[(BYTE)(c>>16)]++;
+            Counting4[       c>>24 ]++;
+        }
+        ip-=4;
+    }
+
+    /* finish last symbols */
+    while (ip<iend) { if ((safe) && (*ip>maxSymbolValue)) return (size_t)-FSE_ERROR_GENERIC; Counting1[*ip++]++; }
+
+    for (s=0; s<=(int)maxSymbolValue; s++)
+    {
+        count[s] = Counting1[s] + Counting2[s] + Counting3[s] + Counting4[s];
+        if (count[s] > max) max = count[s];
+    }
+
+    while (!count[maxSymbolValue]) maxSymbolValue--;
+    *maxSymbolValuePtr = maxSymbolValue;
+    return (int)max;
 }
 
-size_t ZSTD_freeCCtx(ZSTD_cctx_t cctx)
+/* hidden fast variant (unsafe) */
+size_t FSE_FUNCTION_NAME(FSE_countFast, FSE_FUNCTION_EXTENSION) (unsigned* count, const FSE_FUNCTION_TYPE* source, size_t sourceSize, unsigned* maxSymbolValuePtr)
 {
-    cctxi_t* ctx = (cctxi_t*) (cctx);
-    free(ctx->seqStore.buffer);
-    free(ctx);
-    return 0;
+    return FSE_FUNCTION_NAME(FSE_count_generic, FSE_FUNCTION_EXTENSION) (count, source, sourceSize, maxSymbolValuePtr, 0);
 }
 
-
-/**************************************
-*  Error Management
-**************************************/
-/* tells if a return value is an error code */
-unsigned ZSTD_isError(size_t code)
+size_t FSE_FUNCTION_NAME(FSE_count, FSE_FUNCTION_EXTENSION) (unsigned* count, const FSE_FUNCTION_TYPE* source, size_t sourceSize, unsigned* maxSymbolValuePtr)
 {
-    return (code > (size_t)(-ZSTD_ERROR_maxCode));
+    if ((sizeof(FSE_FUNCTION_TYPE)==1) && (*maxSymbolValuePtr >= 255))
+    {
+        *maxSymbolValuePtr = 255;
+        return FSE_FUNCTION_NAME(FSE_count_generic, FSE_FUNCTION_EXTENSION) (count, source, sourceSize, maxSymbolValuePtr, 0);
+    }
+    return FSE_FUNCTION_NAME(FSE_count_generic, FSE_FUNCTION_EXTENSION) (count, source, sourceSize, maxSymbolValuePtr, 1);
 }
 
-#define ZSTD_GENERATE_STRING(STRING) #STRING,
-static const char* ZSTD_errorStrings[] = { ZSTD_LIST_ERRORS(ZSTD_GENERATE_STRING) };
 
-/* provides error code string (useful for debugging) */
-const char* ZSTD_getErrorName(size_t code)
+static U32 FSE_tableStep(U32 tableSize) { return (tableSize>>1) + (tableSize>>3) + 3; }
+
+size_t FSE_FUNCTION_NAME(FSE_buildCTable, FSE_FUNCTION_EXTENSION)
+(void* CTable, const short* normalizedCounter, unsigned maxSymbolValue, unsigned tableLog)
 {
-    static const char* codeError = "Unspecified error code";
-    if (ZSTD_isError(code)) return ZSTD_errorStrings[-(int)(code)];
-    return codeError;
-}
+    const unsigned tableSize = 1 << tableLog;
+    const unsigned tableMask = tableSize - 1;
+    U16* tableU16 = ( (U16*) CTable) + 2;
+    FSE_symbolCompressionTransform* symbolTT = (FSE_symbolCompressionTransform*) (((U32*)CTable) + 1 + (tableLog ? tableSize>>1 : 1) );
+    const unsigned step = FSE_tableStep(tableSize);
+    unsigned cumul[FSE_MAX_SYMBOL_VALUE+2];
+    U32 position = 0;
+    FSE_FUNCTION_TYPE tableSymbol[FSE_MAX_TABLESIZE];
+    U32 highThreshold = tableSize-1;
+    unsigned symbol;
+    unsigned i;
 
+    /* safety checks */
+    if (((size_t)CTable) & 3) return (size_t)-FSE_ERROR_GENERIC;   /* Must be allocated of 4 bytes boundaries */
 
-/**************************************
-*  Tool functions
-**************************************/
-unsigned ZSTD_versionNumber (void) { return ZSTD_VERSION_NUMBER; }
+    /* header */
+    tableU16[-2] = (U16) tableLog;
+    tableU16[-1] = (U16) maxSymbolValue;
 
-static unsigned ZSTD_highbit(U32 val)
-{
-#   if defined(_MSC_VER)   /* Visual */
-    unsigned long r;
-    _BitScanReverse(&r, val);
-    return (unsigned)r;
-#   elif defined(__GNUC__) && (GCC_VERSION >= 304)   /* GCC Intrinsic */
-    return 31 - __builtin_clz(val);
-#   else   /* Software version */
-    static const int DeBruijnClz[32] = { 0, 9, 1, 10, 13, 21, 2, 29, 11, 14, 16, 18, 22, 25, 3, 30, 8, 12, 20, 28, 15, 17, 24, 7, 19, 27, 23, 6, 26, 5, 4, 31 };
-    U32 v = val;
-    int r;
-    v |= v >> 1;
-    v |= v >> 2;
-    v |= v >> 4;
-    v |= v >> 8;
-    v |= v >> 16;
-    r = DeBruijnClz[(U32)(v * 0x07C4ACDDU) >> 27];
-    return r;
-#   endif
-}
+    /* For explanations on how to distribute symbol values over the table :
+    *  http://fastcompression.blogspot.fr/2014/02/fse-distributing-symbol-values.html */
 
-static unsigned ZSTD_NbCommonBytes (register size_t val)
-{
-    if (ZSTD_isLittleEndian())
+    /* symbol start positions */
+    cumul[0] = 0;
+    for (i=1; i<=maxSymbolValue+1; i++)
     {
-        if (ZSTD_64bits())
-        {
-#       if defined(_MSC_VER) && defined(_WIN64) && !defined(LZ4_FORCE_SW_BITCOUNT)
-            unsigned long r = 0;
-            _BitScanForward64( &r, (U64)val );
-            return (int)(r>>3);
-#       elif defined(__GNUC__) && (GCC_VERSION >= 304) && !defined(LZ4_FORCE_SW_BITCOUNT)
-            return (__builtin_ctzll((U64)val) >> 3);
-#       else
-            static const int DeBruijnBytePos[64] = { 0, 0, 0, 0, 0, 1, 1, 2, 0, 3, 1, 3, 1, 4, 2, 7, 0, 2, 3, 6, 1, 5, 3, 5, 1, 3, 4, 4, 2, 5, 6, 7, 7, 0, 1, 2, 3, 3, 4, 6, 2, 6, 5, 5, 3, 4, 5, 6, 7, 1, 2, 4, 6, 4, 4, 5, 7, 2, 6, 5, 7, 6, 7, 7 };
-            return DeBruijnBytePos[((U64)((val & -(long long)val) * 0x0218A392CDABBD3FULL)) >> 58];
-#       endif
-        }
-        else /* 32 bits */
+        if (normalizedCounter[i-1]==-1)   /* Low prob symbol */
         {
-#       if defined(_MSC_VER) && !defined(LZ4_FORCE_SW_BITCOUNT)
-            unsigned long r;
-            _BitScanForward( &r, (U32)val );
-            return (int)(r>>3);
-#       elif defined(__GNUC__) && (GCC_VERSION >= 304) && !defined(LZ4_FORCE_SW_BITCOUNT)
-            return (__builtin_ctz((U32)val) >> 3);
-#       else
-            static const int DeBruijnBytePos[32] = { 0, 0, 3, 0, 3, 1, 3, 0, 3, 2, 2, 1, 3, 2, 0, 1, 3, 3, 1, 2, 2, 2, 2, 0, 3, 1, 2, 0, 1, 0, 1, 1 };
-            return DeBruijnBytePos[((U32)((val & -(S32)val) * 0x077CB531U)) >> 27];
-#       endif
+            cumul[i] = cumul[i-1] + 1;
+            tableSymbol[highThreshold--] = (FSE_FUNCTION_TYPE)(i-1);
         }
+        else
+            cumul[i] = cumul[i-1] + normalizedCounter[i-1];
     }
-    else   /* Big Endian CPU */
+    cumul[maxSymbolValue+1] = tableSize+1;
+
+    /* Spread symbols */
+    for (symbol=0; symbol<=maxSymbolValue; symbol++)
     {
-        if (ZSTD_64bits())
-        {
-#       if defined(_MSC_VER) && defined(_WIN64) && !defined(LZ4_FORCE_SW_BITCOUNT)
-            unsigned long r = 0;
-            _BitScanReverse64( &r, val );
-            return (unsigned)(r>>3);
-#       elif defined(__GNUC__) && (GCC_VERSION >= 304) && !defined(LZ4_FORCE_SW_BITCOUNT)
-            return (__builtin_clzll(val) >> 3);
-#       else
-            unsigned r;
-            const unsigned n32 = sizeof(size_t)*4;   /* calculate this way due to compiler complaining in 32-bits mode */
-            if (!(val>>n32)) { r=4; } else { r=0; val>>=n32; }
-            if (!(val>>16)) { r+=2; val>>=8; } else { val>>=24; }
-            r += (!val);
-            return r;
-#       endif
-        }
-        else /* 32 bits */
+        int nbOccurences;
+        for (nbOccurences=0; nbOccurences<normalizedCounter[symbol]; nbOccurences++)
         {
-#       if defined(_MSC_VER) && !defined(LZ4_FORCE_SW_BITCOUNT)
-            unsigned long r = 0;
-            _BitScanReverse( &r, (unsigned long)val );
-            return (unsigned)(r>>3);
-#       elif defined(__GNUC__) && (GCC_VERSION >= 304) && !defined(LZ4_FORCE_SW_BITCOUNT)
-            return (__builtin_clz(val) >> 3);
-#       else
-            unsigned r;
-            if (!(val>>16)) { r=2; val>>=8; } else { r=0; val>>=24; }
-            r += (!val);
-            return r;
-#       endif
+            tableSymbol[position] = (FSE_FUNCTION_TYPE)symbol;
+            position = (position + step) & tableMask;
+            while (position > highThreshold) position = (position + step) & tableMask;   /* Lowprob area */
         }
     }
-}
 
-static unsigned ZSTD_count(const BYTE* pIn, const BYTE* pMatch, const BYTE* pInLimit)
-{
-    const BYTE* const pStart = pIn;
+    if (position!=0) return (size_t)-FSE_ERROR_GENERIC;   /* Must have gone through all positions */
 
-    while ((pIn<pInLimit-(sizeof(size_t)-1)))
+    /* Build table */
+    for (i=0; i<tableSize; i++)
     {
-        size_t diff = ZSTD_read_ARCH(pMatch) ^ ZSTD_read_ARCH(pIn);
-        if (!diff) { pIn+=sizeof(size_t); pMatch+=sizeof(size_t); continue; }
-        pIn += ZSTD_NbCommonBytes(diff);
-        return (unsigned)(pIn - pStart);
+        FSE_FUNCTION_TYPE s = tableSymbol[i];
+        tableU16[cumul[s]++] = (U16) (tableSize+i);   // Table U16 : sorted by symbol order; gives next state value
     }
 
-    if (ZSTD_64bits()) if ((pIn<(pInLimit-3)) && (ZSTD_read32(pMatch) == ZSTD_read32(pIn))) { pIn+=4; pMatch+=4; }
-    if ((pIn<(pInLimit-1)) && (ZSTD_read16(pMatch) == ZSTD_read16(pIn))) { pIn+=2; pMatch+=2; }
-    if ((pIn<pInLimit) && (*pMatch == *pIn)) pIn++;
-    return (unsigned)(pIn - pStart);
-}
-
+    // Build Symbol Transformation Table
+    {
+        unsigned s;
+        unsigned total = 0;
+        for (s=0; s<=maxSymbolValue; s++)
+        {
+            switch (normalizedCounter[s])
+            {
+            case 0:
+                break;
+            case -1:
+            case 1:
+                symbolTT[s].minBitsOut = (BYTE)tableLog;
+                symbolTT[s].deltaFindState = total - 1;
+                total ++;
+                symbolTT[s].maxState = (U16)( (tableSize*2) - 1);   /* ensures state <= maxState */
+                break;
+            default :
+                symbolTT[s].minBitsOut = (BYTE)( (tableLog-1) - FSE_highbit32 (normalizedCounter[s]-1) );
+                symbolTT[s].deltaFindState = total - normalizedCounter[s];
+                total +=  normalizedCounter[s];
+                symbolTT[s].maxState = (U16)( (normalizedCounter[s] << (symbolTT[s].minBitsOut+1)) - 1);
+            }
+        }
+    }
 
-/********************************************************
-*  Compression
-*********************************************************/
-size_t ZSTD_compressBound(size_t srcSize)   /* maximum compressed size */
-{
-    return FSE_compressBound(srcSize) + 12;
+    return 0;
 }
 
 
-static size_t ZSTD_compressRle (void* dst, size_t maxDstSize, const void* src, size_t srcSize)
-{
-    BYTE* const ostart = (BYTE* const)dst;
-
-    /* at this stage : dstSize >= FSE_compressBound(srcSize) > (ZSTD_blockHeaderSize+1) (checked by ZSTD_compressLiterals()) */
-    (void)maxDstSize;
-
-    ostart[ZSTD_blockHeaderSize] = *(BYTE*)src;
-
-    /* Build header */
-    ostart[0]  = (BYTE)(srcSize>>16);
-    ostart[1]  = (BYTE)(srcSize>>8);
-    ostart[2]  = (BYTE)srcSize;
-    ostart[0] += (BYTE)(bt_rle<<6);
+#define FSE_DECODE_TYPE FSE_TYPE_NAME(FSE_decode_t, FSE_FUNCTION_EXTENSION)
 
-    return ZSTD_blockHeaderSize+1;
+void* FSE_FUNCTION_NAME(FSE_createDTable, FSE_FUNCTION_EXTENSION) (unsigned tableLog)
+{
+    if (tableLog > FSE_TABLELOG_ABSOLUTE_MAX) tableLog = FSE_TABLELOG_ABSOLUTE_MAX;
+    return malloc( ((size_t)1<<tableLog) * sizeof (FSE_DECODE_TYPE) );
 }
 
-
-static size_t ZSTD_noCompressBlock (void* dst, size_t maxDstSize, const void* src, size_t srcSize)
+void FSE_FUNCTION_NAME(FSE_freeDTable, FSE_FUNCTION_EXTENSION) (void* DTable)
 {
-    BYTE* const ostart = (BYTE* const)dst;
-
-    if (srcSize + ZSTD_blockHeaderSize > maxDstSize) return (size_t)-ZSTD_ERROR_maxDstSize_tooSmall;
-    memcpy(ostart + ZSTD_blockHeaderSize, src, srcSize);
-
-    /* Build header */
-    ostart[0] = (BYTE)(srcSize>>16);
-    ostart[1] = (BYTE)(srcSize>>8);
-    ostart[2] = (BYTE)srcSize;
-    ostart[0] += (BYTE)(bt_raw<<6);   /* is a raw (uncompressed) block */
-
-    return ZSTD_blockHeaderSize+srcSize;
+    free(DTable);
 }
 
 
-/* return : size of CStream in bits */
-static size_t ZSTD_compressLiterals_usingCTable(void* dst, size_t dstSize,
-                                          const void* src, size_t srcSize,
-                                          const void* CTable)
+size_t FSE_FUNCTION_NAME(FSE_buildDTable, FSE_FUNCTION_EXTENSION)
+(void* DTable, const short* const normalizedCounter, unsigned maxSymbolValue, unsigned tableLog)
 {
-    const BYTE* const istart = (const BYTE*)src;
-    const BYTE* ip = istart;
-    const BYTE* const iend = istart + srcSize;
-    FSE_CStream_t bitC;
-    FSE_CState_t CState1, CState2;
+    U32* const base32 = (U32*)DTable;
+    FSE_DECODE_TYPE* const tableDecode = (FSE_DECODE_TYPE*) (base32+1);
+    const U32 tableSize = 1 << tableLog;
+    const U32 tableMask = tableSize-1;
+    const U32 step = FSE_tableStep(tableSize);
+    U16 symbolNext[FSE_MAX_SYMBOL_VALUE+1];
+    U32 position = 0;
+    U32 highThreshold = tableSize-1;
+    const S16 largeLimit= 1 << (tableLog-1);
+    U32 noLarge = 1;
+    U32 s;
 
-    /* init */
-    (void)dstSize;   // objective : ensure it fits into dstBuffer (Todo)
-    FSE_initCStream(&bitC, dst);
-    FSE_initCState(&CState1, CTable);
-    CState2 = CState1;
+    /* Sanity Checks */
+    if (maxSymbolValue > FSE_MAX_SYMBOL_VALUE) return (size_t)-FSE_ERROR_maxSymbolValue_tooLarge;
+    if (tableLog > FSE_MAX_TABLELOG) return (size_t)-FSE_ERROR_tableLog_tooLarge;
 
-    /* Note : at this stage, srcSize > LITERALS_NOENTROPY (checked by ZSTD_compressLiterals()) */
-    // join to mod 2
-    if (srcSize & 1)
+    /* Init, lay down lowprob symbols */
+    base32[0] = tableLog;
+    for (s=0; s<=maxSymbolValue; s++)
     {
-        FSE_encodeByte(&bitC, &CState1, *ip++);
-        FSE_flushBits(&bitC);
+        if (normalizedCounter[s]==-1)
+        {
+            tableDecode[highThreshold--].symbol = (FSE_FUNCTION_TYPE)s;
+            symbolNext[s] = 1;
+        }
+        else
+        {
+            if (normalizedCounter[s] >= largeLimit) noLarge=0;
+            symbolNext[s] = normalizedCounter[s];
+        }
     }
 
-    // join to mod 4
-    if ((sizeof(size_t)*8 > LitFSELog*4+7 ) && (srcSize & 2))   // test bit 2
+    /* Spread symbols */
+    for (s=0; s<=maxSymbolValue; s++)
     {
-        FSE_encodeByte(&bitC, &CState2, *ip++);
-        FSE_encodeByte(&bitC, &CState1, *ip++);
-        FSE_flushBits(&bitC);
+        int i;
+        for (i=0; i<normalizedCounter[s]; i++)
+        {
+            tableDecode[position].symbol = (FSE_FUNCTION_TYPE)s;
+            position = (position + step) & tableMask;
+            while (position > highThreshold) position = (position + step) & tableMask;   /* lowprob area */
+        }
     }
 
-    // 2 or 4 encoding per loop
-    while (ip<iend)
-    {
-        FSE_encodeByte(&bitC, &CState2, *ip++);
-
-        if (sizeof(size_t)*8 < LitFSELog*2+7 )   // this test must be static
-            FSE_flushBits(&bitC);
-
-        FSE_encodeByte(&bitC, &CState1, *ip++);
+    if (position!=0) return (size_t)-FSE_ERROR_GENERIC;   /* position must reach all cells once, otherwise normalizedCounter is incorrect */
 
-        if (sizeof(size_t)*8 > LitFSELog*4+7 )   // this test must be static
+    /* Build Decoding table */
+    {
+        U32 i;
+        for (i=0; i<tableSize; i++)
         {
-            FSE_encodeByte(&bitC, &CState2, *ip++);
-            FSE_encodeByte(&bitC, &CState1, *ip++);
+            FSE_FUNCTION_TYPE symbol = tableDecode[i].symbol;
+            U16 nextState = symbolNext[symbol]++;
+            tableDecode[i].nbBits = (BYTE) (tableLog - FSE_highbit32 ((U32)nextState) );
+            tableDecode[i].newState = (U16) ( (nextState << tableDecode[i].nbBits) - tableSize);
         }
-
-        FSE_flushBits(&bitC);
     }
 
-    FSE_flushCState(&bitC, &CState2);
-    FSE_flushCState(&bitC, &CState1);
-    return FSE_closeCStream(&bitC);
+    return noLarge;
 }
 
-
-size_t ZSTD_minGain(size_t srcSize)
-{
-    return (srcSize >> 6) + 1;
-}
+/* <<<<< fse.c EOF */
 
 
-static size_t ZSTD_compressLiterals (void* dst, size_t dstSize,
-                                     const void* src, size_t srcSize)
-{
-    const BYTE* const istart = (const BYTE*) src;
-    const BYTE* ip = istart;
+/* >>>>> zstd.c */
 
-    BYTE* const ostart = (BYTE*) dst;
-    BYTE* op = ostart + ZSTD_blockHeaderSize;
-    BYTE* const oend = ostart + dstSize;
+/****************************************************************
+*  Tuning parameters
+*****************************************************************/
+/* MEMORY_USAGE :
+*  Memory usage formula : N->2^N Bytes (examples : 10 -> 1KB; 12 -> 4KB ; 16 -> 64KB; 20 -> 1MB; etc.)
+*  Increasing memory usage improves compression ratio
+*  Reduced memory usage can improve speed, due to cache effect */
+#define ZSTD_MEMORY_USAGE 17
 
-    U32 maxSymbolValue = 256;
-    U32 tableLog = LitFSELog;
-    U32 count[256];
-    S16 norm[256];
-    U32 CTable[ FSE_CTABLE_SIZE_U32(LitFSELog, 256) ];
-    size_t errorCode;
-    const size_t minGain = ZSTD_minGain(srcSize);
 
-    /* early out */
-    if (dstSize < FSE_compressBound(srcSize)) return (size_t)-ZSTD_ERROR_maxDstSize_tooSmall;
+/**************************************
+   CPU Feature Detection
+**************************************/
+/*
+ * Automated efficient unaligned memory access detection
+ * Based on known hardware architectures
+ * This list will be updated thanks to feedbacks
+ */
+#if defined(CPU_HAS_EFFICIENT_UNALIGNED_MEMORY_ACCESS) \
+    || defined(__ARM_FEATURE_UNALIGNED) \
+    || defined(__i386__) || defined(__x86_64__) \
+    || defined(_M_IX86) || defined(_M_X64) \
+    || defined(__ARM_ARCH_7__) || defined(__ARM_ARCH_8__) \
+    || (defined(_M_ARM) && (_M_ARM >= 7))
+#  define ZSTD_UNALIGNED_ACCESS 1
+#else
+#  define ZSTD_UNALIGNED_ACCESS 0
+#endif
 
-    /* Scan input and build symbol stats */
-    errorCode = FSE_count (count, ip, srcSize, &maxSymbolValue);
-    if (FSE_isError(errorCode)) return (size_t)-ZSTD_ERROR_GENERIC;
-    if (errorCode == srcSize) return 1;
-    //if (errorCode < ((srcSize * 7) >> 10)) return 0;
-    //if (errorCode < (srcSize >> 7)) return 0;
-    if (errorCode < (srcSize >> 6)) return 0;   /* heuristic : probably not compressible enough */
+#ifndef MEM_ACCESS_MODULE
+#define MEM_ACCESS_MODULE
+/********************************************************
+*  Basic Types
+*********************************************************/
+#if defined (__STDC_VERSION__) && __STDC_VERSION__ >= 199901L   /* C99 */
+typedef  uint8_t BYTE;
+typedef uint16_t U16;
+typedef  int16_t S16;
+typedef uint32_t U32;
+typedef  int32_t S32;
+typedef uint64_t U64;
+#else
+typedef unsigned char       BYTE;
+typedef unsigned short      U16;
+typedef   signed short      S16;
+typedef unsigned int        U32;
+typedef   signed int        S32;
+typedef unsigned long long  U64;
+#endif
 
-    tableLog = FSE_optimalTableLog(tableLog, srcSize, maxSymbolValue);
-    errorCode = (int)FSE_normalizeCount (norm, tableLog, count, srcSize, maxSymbolValue);
-    if (FSE_isError(errorCode)) return (size_t)-ZSTD_ERROR_GENERIC;
+#endif   /* MEM_ACCESS_MODULE */
 
-    /* Write table description header */
-    errorCode = FSE_writeHeader (op, FSE_MAX_HEADERSIZE, norm, maxSymbolValue, tableLog);
-    if (FSE_isError(errorCode)) return (size_t)-ZSTD_ERROR_GENERIC;
-    op += errorCode;
+/********************************************************
+*  Constants
+*********************************************************/
+static const U32 ZSTD_magicNumber = 0xFD2FB51C;   /* Initial (limited) frame format */
 
-    /* Compress */
-    errorCode = FSE_buildCTable (&CTable, norm, maxSymbolValue, tableLog);
-    if (FSE_isError(errorCode)) return (size_t)-ZSTD_ERROR_GENERIC;
-    errorCode = ZSTD_compressLiterals_usingCTable(op, oend - op, ip, srcSize, &CTable);
-    if (ZSTD_isError(errorCode)) return errorCode;
-    op += errorCode;
+#define HASH_LOG (ZSTD_MEMORY_USAGE - 2)
+#define HASH_TABLESIZE (1 << HASH_LOG)
+#define HASH_MASK (HASH_TABLESIZE - 1)
 
-    /* check compressibility */
-    if ( (size_t)(op-ostart) >= srcSize-minGain)
-        return 0;
+#define KNUTH 2654435761
 
-    /* Build header */
-    {
-        size_t totalSize;
-        totalSize  = op - ostart - ZSTD_blockHeaderSize;
-        ostart[0]  = (BYTE)(totalSize>>16);
-        ostart[1]  = (BYTE)(totalSize>>8);
-        ostart[2]  = (BYTE)totalSize;
-        ostart[0] += (BYTE)(bt_compressed<<6); /* is a block, is compressed */
-    }
+#define BIT7 128
+#define BIT6  64
+#define BIT5  32
+#define BIT4  16
 
-    return op-ostart;
-}
+#ifndef KB
+#define KB *(1 <<10)
+#endif
+#ifndef MB
+#define MB *(1 <<20)
+#endif
+#ifndef GB
+#define GB *(1U<<30)
+#endif
 
+#define BLOCKSIZE (128 KB)                 /* define, for static allocation */
+static const U32 g_maxDistance = 4 * BLOCKSIZE;
+static const U32 g_maxLimit = 1 GB;
+static const U32 g_searchStrength = 8;
 
-static size_t ZSTD_compressSequences(BYTE* dst, size_t maxDstSize,
-                                     const seqStore_t* seqStorePtr,
-                                     size_t lastLLSize, size_t srcSize)
+#define WORKPLACESIZE (BLOCKSIZE*11/4)
+#define MINMATCH 4
+#define MLbits   7
+#define LLbits   6
+#define Offbits  5
+#define MaxML  ((1<<MLbits )-1)
+#define MaxLL  ((1<<LLbits )-1)
+#define MaxOff ((1<<Offbits)-1)
+#define LitFSELog  11
+#define MLFSELog   10
+#define LLFSELog   10
+#define OffFSELog   9
+
+#define LITERAL_NOENTROPY 63
+#define COMMAND_NOENTROPY 7   /* to remove */
+
+static const size_t ZSTD_blockHeaderSize = 3;
+static const size_t ZSTD_frameHeaderSize = 4;
+
+
+/********************************************************
+*  Memory operations
+*********************************************************/
+static unsigned ZSTD_32bits(void) { return sizeof(void*)==4; }
+static unsigned ZSTD_64bits(void) { return sizeof(void*)==8; }
+
+static unsigned ZSTD_isLittleEndian(void)
 {
-    FSE_CStream_t blockStream;
-    U32 count[256];
-    S16 norm[256];
-    size_t mostFrequent;
-    U32 max = 255;
-    U32 tableLog = 11;
-    U32 CTable_LitLength  [FSE_CTABLE_SIZE_U32(LLFSELog, MaxLL )];
-    U32 CTable_OffsetBits [FSE_CTABLE_SIZE_U32(OffFSELog,MaxOff)];
-    U32 CTable_MatchLength[FSE_CTABLE_SIZE_U32(MLFSELog, MaxML )];
-    U32 LLtype, Offtype, MLtype;
-    const BYTE* const op_lit_start = seqStorePtr->litStart;
-    const BYTE* op_lit = seqStorePtr->lit;
-    const BYTE* const op_litLength_start = seqStorePtr->litLengthStart;
-    const BYTE* op_litLength = seqStorePtr->litLength;
-    const U32*  op_offset = seqStorePtr->offset;
-    const BYTE* op_matchLength = seqStorePtr->matchLength;
-    const size_t nbSeq = op_litLength - op_litLength_start;
-    BYTE* op;
-    BYTE offsetBits_start[BLOCKSIZE / 4];
-    BYTE* offsetBitsPtr = offsetBits_start;
-    const size_t minGain = ZSTD_minGain(srcSize);
-    const size_t maxCSize = srcSize - minGain;
-    const size_t minSeqSize = 1 /*lastL*/ + 2 /*dHead*/ + 2 /*dumpsIn*/ + 5 /*SeqHead*/ + 3 /*SeqIn*/ + 1 /*margin*/ + ZSTD_blockHeaderSize;
-    const size_t maxLSize = maxCSize > minSeqSize ? maxCSize - minSeqSize : 0;
-    BYTE* seqHead;
+    const union { U32 i; BYTE c[4]; } one = { 1 };   /* don't use static : performance detrimental  */
+    return one.c[0];
+}
 
+static U16    ZSTD_read16(const void* p) { return *(U16*)p; }
 
-    /* init */
-    op = dst;
+static U32    ZSTD_read32(const void* p) { return *(U32*)p; }
 
-    /* Encode literals */
-    {
-        size_t cSize;
-        size_t litSize = op_lit - op_lit_start;
-        if (litSize <= LITERAL_NOENTROPY) cSize = ZSTD_noCompressBlock (op, maxDstSize, op_lit_start, litSize);
-        else
-        {
-            cSize = ZSTD_compressLiterals(op, maxDstSize, op_lit_start, litSize);
-            if (cSize == 1) cSize = ZSTD_compressRle (op, maxDstSize, op_lit_start, litSize);
-            else if (cSize == 0)
-            {
-                if (litSize >= maxLSize) return 0;   /* block not compressible enough */
-                cSize = ZSTD_noCompressBlock (op, maxDstSize, op_lit_start, litSize);
-            }
-        }
-        if (ZSTD_isError(cSize)) return cSize;
-        op += cSize;
-    }
+static size_t ZSTD_read_ARCH(const void* p) { return *(size_t*)p; }
 
-    /* Encode Sequences */
+static void   ZSTD_copy4(void* dst, const void* src) { memcpy(dst, src, 4); }
 
-    /* seqHeader */
-    op += ZSTD_writeProgressive(op, lastLLSize);
-    seqHead = op;
+static void   ZSTD_copy8(void* dst, const void* src) { memcpy(dst, src, 8); }
 
-    /* dumps */
-    {
-        size_t dumpsLength = seqStorePtr->dumps - seqStorePtr->dumpsStart;
-        if (dumpsLength < 512)
-        {
-            op[0] = (BYTE)(dumpsLength >> 8);
-            op[1] = (BYTE)(dumpsLength);
-            op += 2;
-        }
-        else
-        {
-            op[0] = 2;
-            op[1] = (BYTE)(dumpsLength>>8);
-            op[2] = (BYTE)(dumpsLength);
-            op += 3;
-        }
-        memcpy(op, seqStorePtr->dumpsStart, dumpsLength);
-        op += dumpsLength;
-    }
+#define COPY8(d,s)    { ZSTD_copy8(d,s); d+=8; s+=8; }
 
-    /* Encoding table of Literal Lengths */
-    max = MaxLL;
-    mostFrequent = FSE_countFast(count, seqStorePtr->litLengthStart, nbSeq, &max);
-    if (mostFrequent == nbSeq)
-    {
-        *op++ = *(seqStorePtr->litLengthStart);
-        FSE_buildCTable_rle(CTable_LitLength, (BYTE)max);
-        LLtype = bt_rle;
-    }
-    else if ((nbSeq < 64) || (mostFrequent < (nbSeq >> (LLbits-1))))
-    {
-        FSE_buildCTable_raw(CTable_LitLength, LLbits);
-        LLtype = bt_raw;
-    }
-    else
-    {
-        tableLog = FSE_optimalTableLog(LLFSELog, nbSeq, max);
-        FSE_normalizeCount(norm, tableLog, count, nbSeq, max);
-        op += FSE_writeHeader(op, maxDstSize, norm, max, tableLog);
-        FSE_buildCTable(CTable_LitLength, norm, max, tableLog);
-        LLtype = bt_compressed;
-    }
+static void ZSTD_wildcopy(void* dst, const void* src, size_t length)
+{
+    const BYTE* ip = (const BYTE*)src;
+    BYTE* op = (BYTE*)dst;
+    BYTE* const oend = op + length;
+    while (op < oend) COPY8(op, ip);
+}
 
-    /* Encoding table of Offsets */
-    {
-        /* create OffsetBits */
-        size_t i;
-        const U32* const op_offset_start = seqStorePtr->offsetStart;
-        max = MaxOff;
-        for (i=0; i<nbSeq; i++)
-        {
-            offsetBits_start[i] = (BYTE)ZSTD_highbit(op_offset_start[i]) + 1;
-            if (op_offset_start[i]==0) offsetBits_start[i]=0;
-        }
-        offsetBitsPtr += nbSeq;
-        mostFrequent = FSE_countFast(count, offsetBits_start, nbSeq, &max);
-    }
-    if (mostFrequent == nbSeq)
-    {
-        *op++ = *offsetBits_start;
-        FSE_buildCTable_rle(CTable_OffsetBits, (BYTE)max);
-        Offtype = bt_rle;
-    }
-    else if ((nbSeq < 64) || (mostFrequent < (nbSeq >> (Offbits-1))))
-    {
-        FSE_buildCTable_raw(CTable_OffsetBits, Offbits);
-        Offtype = bt_raw;
-    }
+static U32 ZSTD_readLE32(const void* memPtr)
+{
+    if (ZSTD_isLittleEndian())
+        return ZSTD_read32(memPtr);
     else
     {
-        tableLog = FSE_optimalTableLog(OffFSELog, nbSeq, max);
-        FSE_normalizeCount(norm, tableLog, count, nbSeq, max);
-        op += FSE_writeHeader(op, maxDstSize, norm, max, tableLog);
-        FSE_buildCTable(CTable_OffsetBits, norm, max, tableLog);
-        Offtype = bt_compressed;
+        const BYTE* p = (const BYTE*)memPtr;
+        return (U32)((U32)p[0] + ((U32)p[1]<<8) + ((U32)p[2]<<16) + ((U32)p[3]<<24));
     }
+}
 
-    /* Encoding Table of MatchLengths */
-    max = MaxML;
-    mostFrequent = FSE_countFast(count, seqStorePtr->matchLengthStart, nbSeq, &max);
-    if (mostFrequent == nbSeq)
-    {
-        *op++ = *seqStorePtr->matchLengthStart;
-        FSE_buildCTable_rle(CTable_MatchLength, (BYTE)max);
-        MLtype = bt_rle;
-    }
-    else if ((nbSeq < 64) || (mostFrequent < (nbSeq >> (MLbits-1))))
+static void ZSTD_writeLE32(void* memPtr, U32 val32)
+{
+    if (ZSTD_isLittleEndian())
     {
-        FSE_buildCTable_raw(CTable_MatchLength, MLbits);
-        MLtype = bt_raw;
+        memcpy(memPtr, &val32, 4);
     }
     else
     {
-        tableLog = FSE_optimalTableLog(MLFSELog, nbSeq, max);
-        FSE_normalizeCount(norm, tableLog, count, nbSeq, max);
-        op += FSE_writeHeader(op, maxDstSize, norm, max, tableLog);
-        FSE_buildCTable(CTable_MatchLength, norm, max, tableLog);
-        MLtype = bt_compressed;
+        BYTE* p = (BYTE*)memPtr;
+        p[0] = (BYTE)val32;
+        p[1] = (BYTE)(val32>>8);
+        p[2] = (BYTE)(val32>>16);
+        p[3] = (BYTE)(val32>>24);
     }
+}
 
-    seqHead[0] += (BYTE)((LLtype<<6) + (Offtype<<4) + (MLtype<<2));
-
-    /* Encoding */
-    {
-        FSE_CState_t stateMatchLength;
-        FSE_CState_t stateOffsetBits;
-        FSE_CState_t stateLitLength;
+static U32 ZSTD_readBE32(const void* memPtr)
+{
+    const BYTE* p = (const BYTE*)memPtr;
+    return (U32)(((U32)p[0]<<24) + ((U32)p[1]<<16) + ((U32)p[2]<<8) + ((U32)p[3]<<0));
+}
 
-        FSE_initCStream(&blockStream, op);
-        FSE_initCState(&stateMatchLength, CTable_MatchLength);
-        FSE_initCState(&stateOffsetBits, CTable_OffsetBits);
-        FSE_initCState(&stateLitLength, CTable_LitLength);
-
-        while (op_litLength > op_litLength_start)
-        {
-            BYTE matchLength = *(--op_matchLength);
-            U32  offset = *(--op_offset);
-            BYTE offCode = *(--offsetBitsPtr);                              /* 32b*/  /* 64b*/
-            U32 nbBits = (offCode-1) * (!!offCode);
-            BYTE litLength = *(--op_litLength);                             /* (7)*/  /* (7)*/
-            FSE_encodeByte(&blockStream, &stateMatchLength, matchLength);   /* 17 */  /* 17 */
-            if (ZSTD_32bits()) FSE_flushBits(&blockStream);                 /*  7 */
-            FSE_addBits(&blockStream, offset, nbBits);                      /* 32 */  /* 42 */
-            if (ZSTD_32bits()) FSE_flushBits(&blockStream);                 /*  7 */
-            FSE_encodeByte(&blockStream, &stateOffsetBits, offCode);        /* 16 */  /* 51 */
-            FSE_encodeByte(&blockStream, &stateLitLength, litLength);       /* 26 */  /* 61 */
-            FSE_flushBits(&blockStream);                                    /*  7 */  /*  7 */
-        }
-
-        FSE_flushCState(&blockStream, &stateMatchLength);
-        FSE_flushCState(&blockStream, &stateOffsetBits);
-        FSE_flushCState(&blockStream, &stateLitLength);
-    }
+static void ZSTD_writeBE32(void* memPtr, U32 value)
+{
+    BYTE* const p = (BYTE* const) memPtr;
+    p[0] = (BYTE)(value>>24);
+    p[1] = (BYTE)(value>>16);
+    p[2] = (BYTE)(value>>8);
+    p[3] = (BYTE)(value>>0);
+}
 
-    op += FSE_closeCStream(&blockStream);
+static size_t ZSTD_writeProgressive(void* ptr, size_t value)
+{
+    BYTE* const bStart = (BYTE* const)ptr;
+    BYTE* byte = bStart;
 
-    /* check compressibility */
-    if ((size_t)(op-dst) >= maxCSize) return 0;
+    do
+    {
+        BYTE l = value & 127;
+        value >>= 7;
+        if (value) l += 128;
+        *byte++ = l;
+    } while (value);
 
-    return op - dst;
+    return byte - bStart;
 }
 
 
-static void ZSTD_storeSeq(seqStore_t* seqStorePtr, size_t litLength, const BYTE* literals, size_t offset, size_t matchLength)
+static size_t ZSTD_readProgressive(size_t* result, const void* ptr)
 {
-    BYTE* op_lit = seqStorePtr->lit;
-    BYTE* const l_end = op_lit + litLength;
-
-    /* copy Literals */
-    while (op_lit<l_end) COPY8(op_lit, literals);
-    seqStorePtr->lit += litLength;
+    const BYTE* const bStart = (const BYTE* const)ptr;
+    const BYTE* byte = bStart;
+    size_t r = 0;
+    U32 shift = 0;
 
-    /* literal Length */
-    if (litLength >= MaxLL)
+    do
     {
-        *(seqStorePtr->litLength++) = MaxLL;
-        if (litLength<255 + MaxLL)
-            *(seqStorePtr->dumps++) = (BYTE)(litLength - MaxLL);
-        else
-        {
-            *(seqStorePtr->dumps++) = 255;
-            ZSTD_writeLE32(seqStorePtr->dumps, (U32)litLength); seqStorePtr->dumps += 3;
-        }
-    }
-    else *(seqStorePtr->litLength++) = (BYTE)litLength;
-
-    /* match offset */
-    *(seqStorePtr->offset++) = (U32)offset;
+        r += (*byte & 127) << shift;
+        shift += 7;
+    } while (*byte++ & 128);
 
-    /* match Length */
-    if (matchLength >= MaxML)
-    {
-        *(seqStorePtr->matchLength++) = MaxML;
-        if (matchLength < 255+MaxML)
-            *(seqStorePtr->dumps++) = (BYTE)(matchLength - MaxML);
-        else
-        {
-            *(seqStorePtr->dumps++) = 255;
-            ZSTD_writeLE32(seqStorePtr->dumps, (U32)matchLength); seqStorePtr->dumps+=3;
-        }
-    }
-    else *(seqStorePtr->matchLength++) = (BYTE)matchLength;
+    *result = r;
+    return byte - bStart;
 }
 
 
-//static const U32 hashMask = (1<<HASH_LOG)-1;
-//static const U64 prime5bytes =         889523592379ULL;
-//static const U64 prime6bytes =      227718039650203ULL;
-static const U64 prime7bytes =    58295818150454627ULL;
-//static const U64 prime8bytes = 14923729446516375013ULL;
-
-//static U32   ZSTD_hashPtr(const void* p) { return (U32) _bextr_u64(*(U64*)p * prime7bytes, (56-HASH_LOG), HASH_LOG); }
-//static U32   ZSTD_hashPtr(const void* p) { return ( (*(U64*)p * prime7bytes) << 8 >> (64-HASH_LOG)); }
-//static U32   ZSTD_hashPtr(const void* p) { return ( (*(U64*)p * prime7bytes) >> (56-HASH_LOG)) & ((1<<HASH_LOG)-1); }
-//static U32   ZSTD_hashPtr(const void* p) { return ( ((*(U64*)p & 0xFFFFFFFFFFFFFF) * prime7bytes) >> (64-HASH_LOG)); }
-
-//static U32   ZSTD_hashPtr(const void* p) { return ( (*(U64*)p * prime8bytes) >> (64-HASH_LOG)); }
-static U32   ZSTD_hashPtr(const void* p) { return ( (*(U64*)p * prime7bytes) >> (56-HASH_LOG)) & HASH_MASK; }
-//static U32   ZSTD_hashPtr(const void* p) { return ( (*(U64*)p * prime6bytes) >> (48-HASH_LOG)) & HASH_MASK; }
-//static U32   ZSTD_hashPtr(const void* p) { return ( (*(U64*)p * prime5bytes) >> (40-HASH_LOG)) & HASH_MASK; }
-//static U32   ZSTD_hashPtr(const void* p) { return ( (*(U32*)p * KNUTH) >> (32-HASH_LOG)); }
-
-static void  ZSTD_addPtr(U32* table, const BYTE* p, const BYTE* start) { table[ZSTD_hashPtr(p)] = (U32)(p-start); }
+/**************************************
+*  Local structures
+***************************************/
+typedef enum { bt_compressed, bt_raw, bt_rle, bt_end } blockType_t;
 
-static const BYTE* ZSTD_updateMatch(U32* table, const BYTE* p, const BYTE* start)
+typedef struct
 {
-    U32 h = ZSTD_hashPtr(p);
-    const BYTE* r;
-    r = table[h] + start;
-    //table[h] = (U32)(p - start);
-    ZSTD_addPtr(table, p, start);
-    return r;
-}
+    blockType_t blockType;
+    U32 origSize;
+} blockProperties_t;
 
-static int ZSTD_checkMatch(const BYTE* match, const BYTE* ip)
+typedef struct {
+    void* buffer;
+    U32*  offsetStart;
+    U32*  offset;
+    BYTE* litStart;
+    BYTE* lit;
+    BYTE* litLengthStart;
+    BYTE* litLength;
+    BYTE* matchLengthStart;
+    BYTE* matchLength;
+    BYTE* dumpsStart;
+    BYTE* dumps;
+} seqStore_t;
+
+void ZSTD_resetSeqStore(seqStore_t* ssPtr)
 {
-    return ZSTD_read32(match) == ZSTD_read32(ip);
+    ssPtr->offset = ssPtr->offsetStart;
+    ssPtr->lit = ssPtr->litStart;
+    ssPtr->litLength = ssPtr->litLengthStart;
+    ssPtr->matchLength = ssPtr->matchLengthStart;
+    ssPtr->dumps = ssPtr->dumpsStart;
 }
 
 
-static size_t ZSTD_compressBlock(void* cctx, void* dst, size_t maxDstSize, const void* src, size_t srcSize)
+typedef struct
 {
-    cctxi_t* ctx = (cctxi_t*) cctx;
-    U32*  HashTable = (U32*)(ctx->hashTable);
-    seqStore_t* seqStorePtr = &(ctx->seqStore);
-    const BYTE* const base = ctx->base;
-
-    const BYTE* const istart = (const BYTE*)src;
-    const BYTE* ip = istart + 1;
-    const BYTE* anchor = istart;
-    const BYTE* const iend = istart + srcSize;
-    const BYTE* const ilimit = iend - 16;
-
-    size_t prevOffset=0, offset=0;
-    size_t lastLLSize;
-
-
-    /* init */
-    ZSTD_resetSeqStore(seqStorePtr);
-
-    /* Main Search Loop */
-    while (ip < ilimit)
-    {
-        const BYTE* match = (BYTE*) ZSTD_updateMatch(HashTable, ip, base);
+    const BYTE* base;
+    U32 current;
+    U32 nextUpdate;
+    seqStore_t seqStore;
+#ifdef __AVX2__
+    __m256i hashTable[HASH_TABLESIZE>>3];
+#else
+    U32 hashTable[HASH_TABLESIZE];
+#endif
+} cctxi_t;
 
-        if (!ZSTD_checkMatch(match,ip)) { ip += ((ip-anchor) >> g_searchStrength) + 1; continue; }
 
-        /* catch up */
-        while ((ip>anchor) && (match>base) && (ip[-1] == match[-1])) { ip--; match--; }
+ZSTD_cctx_t ZSTD_createCCtx(void)
+{
+    cctxi_t* ctx = (cctxi_t*) malloc( sizeof(cctxi_t) );
+    ctx->seqStore.buffer = malloc(WORKPLACESIZE);
+    ctx->seqStore.offsetStart = (U32*) (ctx->seqStore.buffer);
+    ctx->seqStore.litStart = (BYTE*) (ctx->seqStore.offsetStart + (BLOCKSIZE>>2));
+    ctx->seqStore.litLengthStart =  ctx->seqStore.litStart + BLOCKSIZE;
+    ctx->seqStore.matchLengthStart = ctx->seqStore.litLengthStart + (BLOCKSIZE>>2);
+    ctx->seqStore.dumpsStart = ctx->seqStore.matchLengthStart + (BLOCKSIZE>>2);
+    return (ZSTD_cctx_t)ctx;
+}
 
-        {
-            size_t litLength = ip-anchor;
-            size_t matchLength = ZSTD_count(ip+MINMATCH, match+MINMATCH, iend);
-            size_t offsetCode;
-            if (litLength) prevOffset = offset;
-            offsetCode = ip-match;
-            if (offsetCode == prevOffset) offsetCode = 0;
-            prevOffset = offset;
-            offset = ip-match;
-            ZSTD_storeSeq(seqStorePtr, litLength, anchor, offsetCode, matchLength);
+void ZSTD_resetCCtx(ZSTD_cctx_t cctx)
+{
+    cctxi_t* ctx = (cctxi_t*)cctx;
+    ctx->base = NULL;
+    memset(ctx->hashTable, 0, HASH_TABLESIZE*4);
+}
 
-            /* Fill Table */
-            ZSTD_addPtr(HashTable, ip+1, base);
-            ip += matchLength + MINMATCH;
-            if (ip<=iend-8) ZSTD_addPtr(HashTable, ip-2, base);
-            anchor = ip;
-        }
-    }
+size_t ZSTD_freeCCtx(ZSTD_cctx_t cctx)
+{
+    cctxi_t* ctx = (cctxi_t*) (cctx);
+    free(ctx->seqStore.buffer);
+    free(ctx);
+    return 0;
+}
 
-    /* Last Literals */
-    lastLLSize = iend - anchor;
-    memcpy(seqStorePtr->lit, anchor, lastLLSize);
-    seqStorePtr->lit += lastLLSize;
 
-    /* Finale compression stage */
-    return ZSTD_compressSequences((BYTE*)dst, maxDstSize,
-                                  seqStorePtr, lastLLSize, srcSize);
+/**************************************
+*  Error Management
+**************************************/
+/* tells if a return value is an error code */
+unsigned ZSTD_isError(size_t code)
+{
+    return (code > (size_t)(-ZSTD_ERROR_maxCode));
 }
 
+#define ZSTD_GENERATE_STRING(STRING) #STRING,
+static const char* ZSTD_errorStrings[] = { ZSTD_LIST_ERRORS(ZSTD_GENERATE_STRING) };
 
-size_t ZSTD_compressBegin(ZSTD_cctx_t ctx, void* dst, size_t maxDstSize)
+/* provides error code string (useful for debugging) */
+const char* ZSTD_getErrorName(size_t code)
 {
-    /* Sanity check */
-    if (maxDstSize < ZSTD_frameHeaderSize) return (size_t)-ZSTD_ERROR_maxDstSize_tooSmall;
-
-    /* Init */
-    ZSTD_resetCCtx(ctx);
+    static const char* codeError = "Unspecified error code";
+    if (ZSTD_isError(code)) return ZSTD_errorStrings[-(int)(code)];
+    return codeError;
+}
 
-    /* Write Header */
-    ZSTD_writeBE32(dst, ZSTD_magicNumber);
-
-    return ZSTD_frameHeaderSize;
-}
 
+/**************************************
+*  Tool functions
+**************************************/
+unsigned ZSTD_versionNumber (void) { return ZSTD_VERSION_NUMBER; }
 
-/* this should be auto-vectorized by compiler */
-static void ZSTD_scaleDownCtx(void* cctx, const U32 limit)
+static unsigned ZSTD_highbit(U32 val)
 {
-    cctxi_t* ctx = (cctxi_t*) cctx;
-    int i;
-
-#if defined(__AVX2__)   /* <immintrin.h> */
-    /* AVX2 version */
-    __m256i* h = ctx->hashTable;
-    const __m256i limit8 = _mm256_set1_epi32(limit);
-    for (i=0; i<(HASH_TABLESIZE>>3); i++)
-    {
-        __m256i src =_mm256_loadu_si256((const __m256i*)(h+i));
-  const __m256i dec = _mm256_min_epu32(src, limit8);
-                src = _mm256_sub_epi32(src, dec);
-        _mm256_storeu_si256((__m256i*)(h+i), src);
-    }
-#else
-    U32* h = ctx->hashTable;
-    for (i=0; i<HASH_TABLESIZE; ++i)
-    {
-        U32 dec;
-        if (h[i] > limit) dec = limit; else dec = h[i];
-        h[i] -= dec;
-    }
-#endif
+#   if defined(_MSC_VER)   /* Visual */
+    unsigned long r;
+    _BitScanReverse(&r, val);
+    return (unsigned)r;
+#   elif defined(__GNUC__) && (GCC_VERSION >= 304)   /* GCC Intrinsic */
+    return 31 - __builtin_clz(val);
+#   else   /* Software version */
+    static const int DeBruijnClz[32] = { 0, 9, 1, 10, 13, 21, 2, 29, 11, 14, 16, 18, 22, 25, 3, 30, 8, 12, 20, 28, 15, 17, 24, 7, 19, 27, 23, 6, 26, 5, 4, 31 };
+    U32 v = val;
+    int r;
+    v |= v >> 1;
+    v |= v >> 2;
+    v |= v >> 4;
+    v |= v >> 8;
+    v |= v >> 16;
+    r = DeBruijnClz[(U32)(v * 0x07C4ACDDU) >> 27];
+    return r;
+#   endif
 }
 
-
-/* this should be auto-vectorized by compiler */
-static void ZSTD_limitCtx(void* cctx, const U32 limit)
+static unsigned ZSTD_NbCommonBytes (register size_t val)
 {
-    cctxi_t* ctx = (cctxi_t*) cctx;
-    int i;
-
-    if (limit > g_maxLimit)
-    {
-        ZSTD_scaleDownCtx(cctx, limit);
-        ctx->base += limit;
-        ctx->current -= limit;
-        ctx->nextUpdate -= limit;
-        return;
-    }
-
-#if defined(__AVX2__)   /* <immintrin.h> */
-    /* AVX2 version */
+    if (ZSTD_isLittleEndian())
     {
-        __m256i* h = ctx->hashTable;
-        const __m256i limit8 = _mm256_set1_epi32(limit);
-        //printf("Address h : %0X\n", (U32)h);    // address test
-        for (i=0; i<(HASH_TABLESIZE>>3); i++)
+        if (ZSTD_64bits())
         {
-            __m256i src =_mm256_loadu_si256((const __m256i*)(h+i));   // Unfortunately, clang doesn't guarantee 32-bytes alignment
-                    src = _mm256_max_epu32(src, limit8);
-            _mm256_storeu_si256((__m256i*)(h+i), src);
+#       if defined(_MSC_VER) && defined(_WIN64) && !defined(LZ4_FORCE_SW_BITCOUNT)
+            unsigned long r = 0;
+            _BitScanForward64( &r, (U64)val );
+            return (int)(r>>3);
+#       elif defined(__GNUC__) && (GCC_VERSION >= 304) && !defined(LZ4_FORCE_SW_BITCOUNT)
+            return (__builtin_ctzll((U64)val) >> 3);
+#       else
+            static const int DeBruijnBytePos[64] = { 0, 0, 0, 0, 0, 1, 1, 2, 0, 3, 1, 3, 1, 4, 2, 7, 0, 2, 3, 6, 1, 5, 3, 5, 1, 3, 4, 4, 2, 5, 6, 7, 7, 0, 1, 2, 3, 3, 4, 6, 2, 6, 5, 5, 3, 4, 5, 6, 7, 1, 2, 4, 6, 4, 4, 5, 7, 2, 6, 5, 7, 6, 7, 7 };
+            return DeBruijnBytePos[((U64)((val & -(long long)val) * 0x0218A392CDABBD3FULL)) >> 58];
+#       endif
+        }
+        else /* 32 bits */
+        {
+#       if defined(_MSC_VER) && !defined(LZ4_FORCE_SW_BITCOUNT)
+            unsigned long r;
+            _BitScanForward( &r, (U32)val );
+            return (int)(r>>3);
+#       elif defined(__GNUC__) && (GCC_VERSION >= 304) && !defined(LZ4_FORCE_SW_BITCOUNT)
+            return (__builtin_ctz((U32)val) >> 3);
+#       else
+            static const int DeBruijnBytePos[32] = { 0, 0, 3, 0, 3, 1, 3, 0, 3, 2, 2, 1, 3, 2, 0, 1, 3, 3, 1, 2, 2, 2, 2, 0, 3, 1, 2, 0, 1, 0, 1, 1 };
+            return DeBruijnBytePos[((U32)((val & -(S32)val) * 0x077CB531U)) >> 27];
+#       endif
         }
     }
-#else
+    else   /* Big Endian CPU */
     {
-        U32* h = (U32*)(ctx->hashTable);
-        for (i=0; i<HASH_TABLESIZE; ++i)
+        if (ZSTD_64bits())
         {
-            if (h[i] < limit) h[i] = limit;
+#       if defined(_MSC_VER) && defined(_WIN64) && !defined(LZ4_FORCE_SW_BITCOUNT)
+            unsigned long r = 0;
+            _BitScanReverse64( &r, val );
+            return (unsigned)(r>>3);
+#       elif defined(__GNUC__) && (GCC_VERSION >= 304) && !defined(LZ4_FORCE_SW_BITCOUNT)
+            return (__builtin_clzll(val) >> 3);
+#       else
+            unsigned r;
+            const unsigned n32 = sizeof(size_t)*4;   /* calculate this way due to compiler complaining in 32-bits mode */
+            if (!(val>>n32)) { r=4; } else { r=0; val>>=n32; }
+            if (!(val>>16)) { r+=2; val>>=8; } else { val>>=24; }
+            r += (!val);
+            return r;
+#       endif
+        }
+        else /* 32 bits */
+        {
+#       if defined(_MSC_VER) && !defined(LZ4_FORCE_SW_BITCOUNT)
+            unsigned long r = 0;
+            _BitScanReverse( &r, (unsigned long)val );
+            return (unsigned)(r>>3);
+#       elif defined(__GNUC__) && (GCC_VERSION >= 304) && !defined(LZ4_FORCE_SW_BITCOUNT)
+            return (__builtin_clz(val) >> 3);
+#       else
+            unsigned r;
+            if (!(val>>16)) { r=2; val>>=8; } else { r=0; val>>=24; }
+            r += (!val);
+            return r;
+#       endif
         }
     }
-#endif
 }
 
-
-size_t ZSTD_compressContinue(ZSTD_cctx_t cctx, void* dst, size_t maxDstSize, const void* src, size_t srcSize)
+static unsigned ZSTD_count(const BYTE* pIn, const BYTE* pMatch, const BYTE* pInLimit)
 {
-    cctxi_t* ctx = (cctxi_t*) cctx;
-    const BYTE* const istart = (const BYTE* const)src;
-    const BYTE* ip = istart;
-    BYTE* const ostart = (BYTE* const)dst;
-    BYTE* op = ostart;
-    const U32 updateRate = 2 * BLOCKSIZE;
+    const BYTE* const pStart = pIn;
 
-    /*  Init */
-    if (ctx->base==NULL)
-        ctx->base = (const BYTE*)src, ctx->current=0, ctx->nextUpdate = g_maxDistance;
-    if (src != ctx->base + ctx->current)   /* not contiguous */
+    while ((pIn<pInLimit-(sizeof(size_t)-1)))
     {
-            ZSTD_resetCCtx(ctx);
-            ctx->base = (const BYTE*)src;
-            ctx->current = 0;
+        size_t diff = ZSTD_read_ARCH(pMatch) ^ ZSTD_read_ARCH(pIn);
+        if (!diff) { pIn+=sizeof(size_t); pMatch+=sizeof(size_t); continue; }
+        pIn += ZSTD_NbCommonBytes(diff);
+        return (unsigned)(pIn - pStart);
     }
-    ctx->current += (U32)srcSize;
 
-    while (srcSize)
-    {
-        size_t cSize;
-        size_t blockSize = BLOCKSIZE;
-        if (blockSize > srcSize) blockSize = srcSize;
-
-        /* update hash table */
-        if (g_maxDistance <= BLOCKSIZE)   /* static test => all blocks are independent */
-        {
-            ZSTD_resetCCtx(ctx);
-            ctx->base = ip;
-            ctx->current=0;
-        }
-        else if (ip >= ctx->base + ctx->nextUpdate)
-        {
-            ctx->nextUpdate += updateRate;
-            ZSTD_limitCtx(ctx, ctx->nextUpdate - g_maxDistance);
-        }
+    if (ZSTD_64bits()) if ((pIn<(pInLimit-3)) && (ZSTD_read32(pMatch) == ZSTD_read32(pIn))) { pIn+=4; pMatch+=4; }
+    if ((pIn<(pInLimit-1)) && (ZSTD_read16(pMatch) == ZSTD_read16(pIn))) { pIn+=2; pMatch+=2; }
+    if ((pIn<pInLimit) && (*pMatch == *pIn)) pIn++;
+    return (unsigned)(pIn - pStart);
+}
 
-        /* compress */
-        if (maxDstSize < ZSTD_blockHeaderSize) return (size_t)-ZSTD_ERROR_maxDstSize_tooSmall;
-        cSize = ZSTD_compressBlock(ctx, op+ZSTD_blockHeaderSize, maxDstSize-ZSTD_blockHeaderSize, ip, blockSize);
-        if (cSize == 0)
-        {
-            cSize = ZSTD_noCompressBlock(op, maxDstSize, ip, blockSize);   /* block is not compressible */
-            if (ZSTD_isError(cSize)) return cSize;
-        }
-        else
-        {
-            if (ZSTD_isError(cSize)) return cSize;
-            op[0] = (BYTE)(cSize>>16);
-            op[1] = (BYTE)(cSize>>8);
-            op[2] = (BYTE)cSize;
-            op[0] += (BYTE)(bt_compressed << 6); /* is a compressed block */
-            cSize += 3;
-        }
-        op += cSize;
-        maxDstSize -= cSize;
-        ip += blockSize;
-        srcSize -= blockSize;
-    }
 
-    return op-ostart;
+/********************************************************
+*  Compression
+*********************************************************/
+size_t ZSTD_compressBound(size_t srcSize)   /* maximum compressed size */
+{
+    return FSE_compressBound(srcSize) + 12;
 }
 
 
-size_t ZSTD_compressEnd(ZSTD_cctx_t ctx, void* dst, size_t maxDstSize)
+static size_t ZSTD_compressRle (void* dst, size_t maxDstSize, const void* src, size_t srcSize)
 {
-    BYTE* op = (BYTE*)dst;
+    BYTE* const ostart = (BYTE* const)dst;
 
-    /* Sanity check */
-    (void)ctx;
-    if (maxDstSize < ZSTD_blockHeaderSize) return (size_t)-ZSTD_ERROR_maxDstSize_tooSmall;
+    /* at this stage : dstSize >= FSE_compressBound(srcSize) > (ZSTD_blockHeaderSize+1) (checked by ZSTD_compressLiterals()) */
+    (void)maxDstSize;
 
-    /* End of frame */
-    op[0] = (BYTE)(bt_end << 6);
-    op[1] = 0;
-    op[2] = 0;
+    ostart[ZSTD_blockHeaderSize] = *(BYTE*)src;
 
-    return 3;
+    /* Build header */
+    ostart[0]  = (BYTE)(srcSize>>16);
+    ostart[1]  = (BYTE)(srcSize>>8);
+    ostart[2]  = (BYTE)srcSize;
+    ostart[0] += (BYTE)(bt_rle<<6);
+
+    return ZSTD_blockHeaderSize+1;
 }
 
 
-static size_t ZSTD_compressCCtx(void* ctx, void* dst, size_t maxDstSize, const void* src, size_t srcSize)
+static size_t ZSTD_noCompressBlock (void* dst, size_t maxDstSize, const void* src, size_t srcSize)
 {
     BYTE* const ostart = (BYTE* const)dst;
-    BYTE* op = ostart;
-
-    /* Header */
-    {
-        size_t headerSize = ZSTD_compressBegin(ctx, dst, maxDstSize);
-        if(ZSTD_isError(headerSize)) return headerSize;
-        op += headerSize;
-        maxDstSize -= headerSize;
-    }
 
-    /* Compression */
-    {
-        size_t cSize = ZSTD_compressContinue(ctx, op, maxDstSize, src, srcSize);
-        if (ZSTD_isError(cSize)) return cSize;
-        op += cSize;
-        maxDstSize -= cSize;
-    }
+    if (srcSize + ZSTD_blockHeaderSize > maxDstSize) return (size_t)-ZSTD_ERROR_maxDstSize_tooSmall;
+    memcpy(ostart + ZSTD_blockHeaderSize, src, srcSize);
 
-    /* Close frame */
-    {
-        size_t endSize = ZSTD_compressEnd(ctx, op, maxDstSize);
-        if(ZSTD_isError(endSize)) return endSize;
-        op += endSize;
-    }
-
-    return (op - ostart);
-}
-
-
-size_t ZSTD_compress(void* dst, size_t maxDstSize, const void* src, size_t srcSize)
-{
-    void* ctx;
-    size_t r;
-
-    ctx = ZSTD_createCCtx();
-    r = ZSTD_compressCCtx(ctx, dst, maxDstSize, src, srcSize);
-    ZSTD_freeCCtx(ctx);
-    return r;
-}
-
-
-/**************************************************************
-*   Decompression code
-**************************************************************/
-
-size_t ZSTD_getcBlockSize(const void* src, size_t srcSize, blockProperties_t* bpPtr)
-{
-    const BYTE* const in = (const BYTE* const)src;
-    BYTE headerFlags;
-    U32 cSize;
-
-    if (srcSize < 3) return (size_t)-ZSTD_ERROR_wrongSrcSize;
-
-    headerFlags = *in;
-    cSize = in[2] + (in[1]<<8) + ((in[0] & 7)<<16);
-
-    bpPtr->blockType = (blockType_t)(headerFlags >> 6);
-    bpPtr->origSize = (bpPtr->blockType == bt_rle) ? cSize : 0;
+    /* Build header */
+    ostart[0] = (BYTE)(srcSize>>16);
+    ostart[1] = (BYTE)(srcSize>>8);
+    ostart[2] = (BYTE)srcSize;
+    ostart[0] += (BYTE)(bt_raw<<6);   /* is a raw (uncompressed) block */
 
-    if (bpPtr->blockType == bt_end) return 0;
-    if (bpPtr->blockType == bt_rle) return 1;
-    return cSize;
+    return ZSTD_blockHeaderSize+srcSize;
 }
 
 
-static size_t ZSTD_copyUncompressedBlock(void* dst, size_t maxDstSize, const void* src, size_t srcSize)
+/* return : size of CStream in bits */
+static size_t ZSTD_compressLiterals_usingCTable(void* dst, size_t dstSize,
+                                          const void* src, size_t srcSize,
+                                          const void* CTable)
 {
-    if (srcSize > maxDstSize) return (size_t)-ZSTD_ERROR_maxDstSize_tooSmall;
-    memcpy(dst, src, srcSize);
-    return srcSize;
-}
-
+    const BYTE* const istart = (const BYTE*)src;
+    const BYTE* ip = istart;
+    const BYTE* const iend = istart + srcSize;
+    FSE_CStream_t bitC;
+    FSE_CState_t CState1, CState2;
 
-/* force inline : 'fast' really needs to be evaluated at compile time */
-FORCE_INLINE size_t ZSTD_decompressLiterals_usingDTable_generic(
-                       void* const dst, size_t maxDstSize,
-                 const void* src, size_t srcSize,
-                 const void* DTable, U32 fast)
-{
-    BYTE* op = (BYTE*) dst;
-    BYTE* const olimit = op;
-    BYTE* const oend = op + maxDstSize;
-    FSE_DStream_t bitD;
-    FSE_DState_t state1, state2;
-    size_t errorCode;
+    /* init */
+    (void)dstSize;   // objective : ensure it fits into dstBuffer (Todo)
+    FSE_initCStream(&bitC, dst);
+    FSE_initCState(&CState1, CTable);
+    CState2 = CState1;
 
-    /* Init */
-    errorCode = FSE_initDStream(&bitD, src, srcSize);
-    if (FSE_isError(errorCode)) return (size_t)-ZSTD_ERROR_GENERIC;
+    /* Note : at this stage, srcSize > LITERALS_NOENTROPY (checked by ZSTD_compressLiterals()) */
+    // join to mod 2
+    if (srcSize & 1)
+    {
+        FSE_encodeByte(&bitC, &CState1, *ip++);
+        FSE_flushBits(&bitC);
+    }
 
-    FSE_initDState(&state1, &bitD, DTable);
-    FSE_initDState(&state2, &bitD, DTable);
-    op = oend;
+    // join to mod 4
+    if ((sizeof(size_t)*8 > LitFSELog*4+7 ) && (srcSize & 2))   // test bit 2
+    {
+        FSE_encodeByte(&bitC, &CState2, *ip++);
+        FSE_encodeByte(&bitC, &CState1, *ip++);
+        FSE_flushBits(&bitC);
+    }
 
-    /* 2-4 symbols per loop */
-    while (!FSE_reloadDStream(&bitD) && (op>olimit+3))
+    // 2 or 4 encoding per loop
+    while (ip<iend)
     {
-        *--op = fast ? FSE_decodeSymbolFast(&state1, &bitD) : FSE_decodeSymbol(&state1, &bitD);
+        FSE_encodeByte(&bitC, &CState2, *ip++);
 
-        if (LitFSELog*2+7 > sizeof(size_t)*8)    /* This test must be static */
-            FSE_reloadDStream(&bitD);
+        if (sizeof(size_t)*8 < LitFSELog*2+7 )   // this test must be static
+            FSE_flushBits(&bitC);
 
-        *--op = fast ? FSE_decodeSymbolFast(&state2, &bitD) : FSE_decodeSymbol(&state2, &bitD);
+        FSE_encodeByte(&bitC, &CState1, *ip++);
 
-        if (LitFSELog*4+7 < sizeof(size_t)*8)    /* This test must be static */
+        if (sizeof(size_t)*8 > LitFSELog*4+7 )   // this test must be static
         {
-            *--op = fast ? FSE_decodeSymbolFast(&state1, &bitD) : FSE_decodeSymbol(&state1, &bitD);
-            *--op = fast ? FSE_decodeSymbolFast(&state2, &bitD) : FSE_decodeSymbol(&state2, &bitD);
+            FSE_encodeByte(&bitC, &CState2, *ip++);
+            FSE_encodeByte(&bitC, &CState1, *ip++);
         }
-    }
-
-    /* tail */
-    while (1)
-    {
-        if ( (FSE_reloadDStream(&bitD)>2) || (op==olimit) || (FSE_endOfDState(&state1) && FSE_endOfDStream(&bitD)) )
-            break;
-
-        *--op = fast ? FSE_decodeSymbolFast(&state1, &bitD) : FSE_decodeSymbol(&state1, &bitD);
-
-        if ( (FSE_reloadDStream(&bitD)>2) || (op==olimit) || (FSE_endOfDState(&state2) && FSE_endOfDStream(&bitD)) )
-            break;
 
-        *--op = fast ? FSE_decodeSymbolFast(&state2, &bitD) : FSE_decodeSymbol(&state2, &bitD);
+        FSE_flushBits(&bitC);
     }
 
-    /* end ? */
-    if (FSE_endOfDStream(&bitD) && FSE_endOfDState(&state1) && FSE_endOfDState(&state2) )
-        return oend-op;
-
-    if (op==olimit) return (size_t)-ZSTD_ERROR_maxDstSize_tooSmall;   /* dst buffer is full, but cSrc unfinished */
-
-    return (size_t)-ZSTD_ERROR_GENERIC;
+    FSE_flushCState(&bitC, &CState2);
+    FSE_flushCState(&bitC, &CState1);
+    return FSE_closeCStream(&bitC);
 }
 
-static size_t ZSTD_decompressLiterals_usingDTable(
-                       void* const dst, size_t maxDstSize,
-                 const void* src, size_t srcSize,
-                 const void* DTable, U32 fast)
+
+size_t ZSTD_minGain(size_t srcSize)
 {
-    if (fast) return ZSTD_decompressLiterals_usingDTable_generic(dst, maxDstSize, src, srcSize, DTable, 1);
-    return ZSTD_decompressLiterals_usingDTable_generic(dst, maxDstSize, src, srcSize, DTable, 0);
+    return (srcSize >> 6) + 1;
 }
 
-static size_t ZSTD_decompressLiterals(void* ctx, void* dst, size_t maxDstSize,
-                                const void* src, size_t srcSize)
+
+static size_t ZSTD_compressLiterals (void* dst, size_t dstSize,
+                                     const void* src, size_t srcSize)
 {
-    /* assumed : blockType == blockCompressed */
-    const BYTE* ip = (const BYTE*)src;
-    short norm[256];
-    void* DTable = ctx;
-    U32 maxSymbolValue = 255;
-    U32 tableLog;
-    U32 fastMode;
+    const BYTE* const istart = (const BYTE*) src;
+    const BYTE* ip = istart;
+
+    BYTE* const ostart = (BYTE*) dst;
+    BYTE* op = ostart + ZSTD_blockHeaderSize;
+    BYTE* const oend = ostart + dstSize;
+
+    U32 maxSymbolValue = 256;
+    U32 tableLog = LitFSELog;
+    U32 count[256];
+    S16 norm[256];
+    U32 CTable[ FSE_CTABLE_SIZE_U32(LitFSELog, 256) ];
     size_t errorCode;
+    const size_t minGain = ZSTD_minGain(srcSize);
 
-    if (srcSize < 2) return (size_t)-ZSTD_ERROR_wrongLBlockSize;   /* too small input size */
+    /* early out */
+    if (dstSize < FSE_compressBound(srcSize)) return (size_t)-ZSTD_ERROR_maxDstSize_tooSmall;
 
-    errorCode = FSE_readHeader (norm, &maxSymbolValue, &tableLog, ip, srcSize);
+    /* Scan input and build symbol stats */
+    errorCode = FSE_count (count, ip, srcSize, &maxSymbolValue);
     if (FSE_isError(errorCode)) return (size_t)-ZSTD_ERROR_GENERIC;
-    ip += errorCode;
-    srcSize -= errorCode;
+    if (errorCode == srcSize) return 1;
+    //if (errorCode < ((srcSize * 7) >> 10)) return 0;
+    //if (errorCode < (srcSize >> 7)) return 0;
+    if (errorCode < (srcSize >> 6)) return 0;   /* heuristic : probably not compressible enough */
 
-    errorCode = FSE_buildDTable (DTable, norm, maxSymbolValue, tableLog);
+    tableLog = FSE_optimalTableLog(tableLog, srcSize, maxSymbolValue);
+    errorCode = (int)FSE_normalizeCount (norm, tableLog, count, srcSize, maxSymbolValue);
     if (FSE_isError(errorCode)) return (size_t)-ZSTD_ERROR_GENERIC;
-    fastMode = (U32)errorCode;
-
-    return ZSTD_decompressLiterals_usingDTable (dst, maxDstSize, ip, srcSize, DTable, fastMode);
-}
 
+    /* Write table description header */
+    errorCode = FSE_writeHeader (op, FSE_MAX_HEADERSIZE, norm, maxSymbolValue, tableLog);
+    if (FSE_isError(errorCode)) return (size_t)-ZSTD_ERROR_GENERIC;
+    op += errorCode;
 
-size_t ZSTD_decodeLiteralsBlock(void* ctx,
-                                void* dst, size_t maxDstSize,
-                          const BYTE** litPtr,
-                          const void* src, size_t srcSize)
-{
-    const BYTE* const istart = (const BYTE* const)src;
-    const BYTE* ip = istart;
-    BYTE* const ostart = (BYTE* const)dst;
-    BYTE* const oend = ostart + maxDstSize;
-    blockProperties_t litbp;
+    /* Compress */
+    errorCode = FSE_buildCTable (&CTable, norm, maxSymbolValue, tableLog);
+    if (FSE_isError(errorCode)) return (size_t)-ZSTD_ERROR_GENERIC;
+    errorCode = ZSTD_compressLiterals_usingCTable(op, oend - op, ip, srcSize, &CTable);
+    if (ZSTD_isError(errorCode)) return errorCode;
+    op += errorCode;
 
-    size_t litcSize = ZSTD_getcBlockSize(src, srcSize, &litbp);
-    if (ZSTD_isError(litcSize)) return litcSize;
-    if (litcSize > srcSize - ZSTD_blockHeaderSize) return (size_t)-ZSTD_ERROR_wrongLBlockSize;
-    ip += ZSTD_blockHeaderSize;
+    /* check compressibility */
+    if ( (size_t)(op-ostart) >= srcSize-minGain)
+        return 0;
 
-    switch(litbp.blockType)
+    /* Build header */
     {
-    case bt_raw: *litPtr = ip; ip+= litcSize; break;
-    case bt_rle:
-        {
-            size_t rleSize = litbp.origSize;
-            memset(oend - rleSize, *ip, rleSize);
-            *litPtr = oend - rleSize;
-            ip++;
-            break;
-        }
-    case bt_compressed:
-        {
-            size_t cSize = ZSTD_decompressLiterals(ctx, dst, maxDstSize, ip, litcSize);
-            if (ZSTD_isError(cSize)) return cSize;
-            *litPtr = oend - cSize;
-            ip += litcSize;
-            break;
-        }
-    default:
-        return (size_t)-ZSTD_ERROR_GENERIC;
+        size_t totalSize;
+        totalSize  = op - ostart - ZSTD_blockHeaderSize;
+        ostart[0]  = (BYTE)(totalSize>>16);
+        ostart[1]  = (BYTE)(totalSize>>8);
+        ostart[2]  = (BYTE)totalSize;
+        ostart[0] += (BYTE)(bt_compressed<<6); /* is a block, is compressed */
     }
 
-    return ip-istart;
+    return op-ostart;
 }
 
 
-size_t ZSTD_decodeSeqHeaders(size_t* lastLLPtr, const BYTE** dumpsPtr,
-                               void* DTableLL, void* DTableML, void* DTableOffb,
-                         const void* src, size_t srcSize)
+static size_t ZSTD_compressSequences(BYTE* dst, size_t maxDstSize,
+                                     const seqStore_t* seqStorePtr,
+                                     size_t lastLLSize, size_t srcSize)
 {
-    const BYTE* const istart = (const BYTE* const)src;
-    const BYTE* ip = istart;
-    const BYTE* const iend = istart + srcSize;
+    FSE_CStream_t blockStream;
+    U32 count[256];
+    S16 norm[256];
+    size_t mostFrequent;
+    U32 max = 255;
+    U32 tableLog = 11;
+    U32 CTable_LitLength  [FSE_CTABLE_SIZE_U32(LLFSELog, MaxLL )];
+    U32 CTable_OffsetBits [FSE_CTABLE_SIZE_U32(OffFSELog,MaxOff)];
+    U32 CTable_MatchLength[FSE_CTABLE_SIZE_U32(MLFSELog, MaxML )];
     U32 LLtype, Offtype, MLtype;
-    U32 LLlog, Offlog, MLlog;
-    size_t dumpsLength;
+    const BYTE* const op_lit_start = seqStorePtr->litStart;
+    const BYTE* op_lit = seqStorePtr->lit;
+    const BYTE* const op_litLength_start = seqStorePtr->litLengthStart;
+    const BYTE* op_litLength = seqStorePtr->litLength;
+    const U32*  op_offset = seqStorePtr->offset;
+    const BYTE* op_matchLength = seqStorePtr->matchLength;
+    const size_t nbSeq = op_litLength - op_litLength_start;
+    BYTE* op;
+    BYTE offsetBits_start[BLOCKSIZE / 4];
+    BYTE* offsetBitsPtr = offsetBits_start;
+    const size_t minGain = ZSTD_minGain(srcSize);
+    const size_t maxCSize = srcSize - minGain;
+    const size_t minSeqSize = 1 /*lastL*/ + 2 /*dHead*/ + 2 /*dumpsIn*/ + 5 /*SeqHead*/ + 3 /*SeqIn*/ + 1 /*margin*/ + ZSTD_blockHeaderSize;
+    const size_t maxLSize = maxCSize > minSeqSize ? maxCSize - minSeqSize : 0;
+    BYTE* seqHead;
 
-    /* SeqHead */
-    ip += ZSTD_readProgressive(lastLLPtr, ip);
-    LLtype  = *ip >> 6;
-    Offtype = (*ip >> 4) & 3;
-    MLtype  = (*ip >> 2) & 3;
-    if (*ip & 2)
+
+    /* init */
+    op = dst;
+
+    /* Encode literals */
     {
-        dumpsLength  = ip[2];
-        dumpsLength += ip[1] << 8;
-        ip += 3;
+        size_t cSize;
+        size_t litSize = op_lit - op_lit_start;
+        if (litSize <= LITERAL_NOENTROPY) cSize = ZSTD_noCompressBlock (op, maxDstSize, op_lit_start, litSize);
+        else
+        {
+            cSize = ZSTD_compressLiterals(op, maxDstSize, op_lit_start, litSize);
+            if (cSize == 1) cSize = ZSTD_compressRle (op, maxDstSize, op_lit_start, litSize);
+            else if (cSize == 0)
+            {
+                if (litSize >= maxLSize) return 0;   /* block not compressible enough */
+                cSize = ZSTD_noCompressBlock (op, maxDstSize, op_lit_start, litSize);
+            }
+        }
+        if (ZSTD_isError(cSize)) return cSize;
+        op += cSize;
     }
-    else
+
+    /* Encode Sequences */
+
+    /* seqHeader */
+    op += ZSTD_writeProgressive(op, lastLLSize);
+    seqHead = op;
+
+    /* dumps */
     {
-        dumpsLength  = ip[1];
-        dumpsLength += (ip[0] & 1) << 8;
-        ip += 2;
+        size_t dumpsLength = seqStorePtr->dumps - seqStorePtr->dumpsStart;
+        if (dumpsLength < 512)
+        {
+            op[0] = (BYTE)(dumpsLength >> 8);
+            op[1] = (BYTE)(dumpsLength);
+            op += 2;
+        }
+        else
+        {
+            op[0] = 2;
+            op[1] = (BYTE)(dumpsLength>>8);
+            op[2] = (BYTE)(dumpsLength);
+            op += 3;
+        }
+        memcpy(op, seqStorePtr->dumpsStart, dumpsLength);
+        op += dumpsLength;
     }
-    *dumpsPtr = ip;
-    ip += dumpsLength;
 
-    /* sequences */
+    /* Encoding table of Literal Lengths */
+    max = MaxLL;
+    mostFrequent = FSE_countFast(count, seqStorePtr->litLengthStart, nbSeq, &max);
+    if (mostFrequent == nbSeq)
     {
-        S16 norm[MaxML+1];    /* assumption : MaxML >= MaxLL and MaxOff */
-        size_t headerSize;
+        *op++ = *(seqStorePtr->litLengthStart);
+        FSE_buildCTable_rle(CTable_LitLength, (BYTE)max);
+        LLtype = bt_rle;
+    }
+    else if ((nbSeq < 64) || (mostFrequent < (nbSeq >> (LLbits-1))))
+    {
+        FSE_buildCTable_raw(CTable_LitLength, LLbits);
+        LLtype = bt_raw;
+    }
+    else
+    {
+        tableLog = FSE_optimalTableLog(LLFSELog, nbSeq, max);
+        FSE_normalizeCount(norm, tableLog, count, nbSeq, max);
+        op += FSE_writeHeader(op, maxDstSize, norm, max, tableLog);
+        FSE_buildCTable(CTable_LitLength, norm, max, tableLog);
+        LLtype = bt_compressed;
+    }
 
-        /* Build DTables */
-        switch(LLtype)
+    /* Encoding table of Offsets */
+    {
+        /* create OffsetBits */
+        size_t i;
+        const U32* const op_offset_start = seqStorePtr->offsetStart;
+        max = MaxOff;
+        for (i=0; i<nbSeq; i++)
         {
-        U32 max;
-        case bt_rle :
-            LLlog = 0;
-            FSE_buildDTable_rle(DTableLL, *ip++); break;
-        case bt_raw :
-            LLlog = LLbits;
-            FSE_buildDTable_raw(DTableLL, LLbits); break;
-        default :
-            max = MaxLL;
-            headerSize = FSE_readHeader(norm, &max, &LLlog, ip, iend-ip);
-            if (FSE_isError(headerSize)) return (size_t)-ZSTD_ERROR_GENERIC;
-            ip += headerSize;
-            FSE_buildDTable(DTableLL, norm, max, LLlog);
+            offsetBits_start[i] = (BYTE)ZSTD_highbit(op_offset_start[i]) + 1;
+            if (op_offset_start[i]==0) offsetBits_start[i]=0;
         }
+        offsetBitsPtr += nbSeq;
+        mostFrequent = FSE_countFast(count, offsetBits_start, nbSeq, &max);
+    }
+    if (mostFrequent == nbSeq)
+    {
+        *op++ = *offsetBits_start;
+        FSE_buildCTable_rle(CTable_OffsetBits, (BYTE)max);
+        Offtype = bt_rle;
+    }
+    else if ((nbSeq < 64) || (mostFrequent < (nbSeq >> (Offbits-1))))
+    {
+        FSE_buildCTable_raw(CTable_OffsetBits, Offbits);
+        Offtype = bt_raw;
+    }
+    else
+    {
+        tableLog = FSE_optimalTableLog(OffFSELog, nbSeq, max);
+        FSE_normalizeCount(norm, tableLog, count, nbSeq, max);
+        op += FSE_writeHeader(op, maxDstSize, norm, max, tableLog);
+        FSE_buildCTable(CTable_OffsetBits, norm, max, tableLog);
+        Offtype = bt_compressed;
+    }
 
-        switch(Offtype)
-        {
-        U32 max;
-        case bt_rle :
-            Offlog = 0;
-            FSE_buildDTable_rle(DTableOffb, *ip++); break;
-        case bt_raw :
-            Offlog = Offbits;
-            FSE_buildDTable_raw(DTableOffb, Offbits); break;
-        default :
-            max = MaxOff;
-            headerSize = FSE_readHeader(norm, &max, &Offlog, ip, iend-ip);
-            if (FSE_isError(headerSize)) return (size_t)-ZSTD_ERROR_GENERIC;
-            ip += headerSize;
-            FSE_buildDTable(DTableOffb, norm, max, Offlog);
-        }
+    /* Encoding Table of MatchLengths */
+    max = MaxML;
+    mostFrequent = FSE_countFast(count, seqStorePtr->matchLengthStart, nbSeq, &max);
+    if (mostFrequent == nbSeq)
+    {
+        *op++ = *seqStorePtr->matchLengthStart;
+        FSE_buildCTable_rle(CTable_MatchLength, (BYTE)max);
+        MLtype = bt_rle;
+    }
+    else if ((nbSeq < 64) || (mostFrequent < (nbSeq >> (MLbits-1))))
+    {
+        FSE_buildCTable_raw(CTable_MatchLength, MLbits);
+        MLtype = bt_raw;
+    }
+    else
+    {
+        tableLog = FSE_optimalTableLog(MLFSELog, nbSeq, max);
+        FSE_normalizeCount(norm, tableLog, count, nbSeq, max);
+        op += FSE_writeHeader(op, maxDstSize, norm, max, tableLog);
+        FSE_buildCTable(CTable_MatchLength, norm, max, tableLog);
+        MLtype = bt_compressed;
+    }
 
-        switch(MLtype)
+    seqHead[0] += (BYTE)((LLtype<<6) + (Offtype<<4) + (MLtype<<2));
+
+    /* Encoding */
+    {
+        FSE_CState_t stateMatchLength;
+        FSE_CState_t stateOffsetBits;
+        FSE_CState_t stateLitLength;
+
+        FSE_initCStream(&blockStream, op);
+        FSE_initCState(&stateMatchLength, CTable_MatchLength);
+        FSE_initCState(&stateOffsetBits, CTable_OffsetBits);
+        FSE_initCState(&stateLitLength, CTable_LitLength);
+
+        while (op_litLength > op_litLength_start)
         {
-        U32 max;
-        case bt_rle :
-            MLlog = 0;
-            FSE_buildDTable_rle(DTableML, *ip++); break;
-        case bt_raw :
-            MLlog = MLbits;
-            FSE_buildDTable_raw(DTableML, MLbits); break;
-        default :
-            max = MaxML;
-            headerSize = FSE_readHeader(norm, &max, &MLlog, ip, iend-ip);
-            if (FSE_isError(headerSize)) return (size_t)-ZSTD_ERROR_GENERIC;
-            ip += headerSize;
-            FSE_buildDTable(DTableML, norm, max, MLlog);
+            BYTE matchLength = *(--op_matchLength);
+            U32  offset = *(--op_offset);
+            BYTE offCode = *(--offsetBitsPtr);                              /* 32b*/  /* 64b*/
+            U32 nbBits = (offCode-1) * (!!offCode);
+            BYTE litLength = *(--op_litLength);                             /* (7)*/  /* (7)*/
+            FSE_encodeByte(&blockStream, &stateMatchLength, matchLength);   /* 17 */  /* 17 */
+            if (ZSTD_32bits()) FSE_flushBits(&blockStream);                 /*  7 */
+            FSE_addBits(&blockStream, offset, nbBits);                      /* 32 */  /* 42 */
+            if (ZSTD_32bits()) FSE_flushBits(&blockStream);                 /*  7 */
+            FSE_encodeByte(&blockStream, &stateOffsetBits, offCode);        /* 16 */  /* 51 */
+            FSE_encodeByte(&blockStream, &stateLitLength, litLength);       /* 26 */  /* 61 */
+            FSE_flushBits(&blockStream);                                    /*  7 */  /*  7 */
         }
+
+        FSE_flushCState(&blockStream, &stateMatchLength);
+        FSE_flushCState(&blockStream, &stateOffsetBits);
+        FSE_flushCState(&blockStream, &stateLitLength);
     }
 
-    return ip-istart;
-}
+    op += FSE_closeCStream(&blockStream);
 
+    /* check compressibility */
+    if ((size_t)(op-dst) >= maxCSize) return 0;
 
-#define ZSTD_prefetch(p) { const BYTE pByte = *(volatile const BYTE*)p; }
+    return op - dst;
+}
 
-FORCE_INLINE size_t ZSTD_decompressBlock(void* ctx, void* dst, size_t maxDstSize,
-                             const void* src, size_t srcSize)
+
+static void ZSTD_storeSeq(seqStore_t* seqStorePtr, size_t litLength, const BYTE* literals, size_t offset, size_t matchLength)
 {
-    const BYTE* ip = (const BYTE*)src;
-    const BYTE* const iend = ip + srcSize;
-    BYTE* const ostart = (BYTE* const)dst;
-    BYTE* op = ostart;
-    BYTE* const oend = ostart + maxDstSize;
-    size_t errorCode;
-    size_t lastLLSize;
-    const BYTE* dumps;
-    const BYTE* litPtr;
-    const BYTE* litEnd;
-    const size_t dec32table[] = {4, 1, 2, 1, 4, 4, 4, 4};   /* added */
-    const size_t dec64table[] = {8, 8, 8, 7, 8, 9,10,11};   /* substracted */
-    void* DTableML = ctx;
-    void* DTableLL = ((U32*)ctx) + FSE_DTABLE_SIZE_U32(MLFSELog);
-    void* DTableOffb = ((U32*)DTableLL) + FSE_DTABLE_SIZE_U32(LLFSELog);
+    BYTE* op_lit = seqStorePtr->lit;
+    BYTE* const l_end = op_lit + litLength;
 
-    /* blockType == blockCompressed, srcSize is trusted */
+    /* copy Literals */
+    while (op_lit<l_end) COPY8(op_lit, literals);
+    seqStorePtr->lit += litLength;
 
-    /* literal sub-block */
-    errorCode = ZSTD_decodeLiteralsBlock(ctx, dst, maxDstSize, &litPtr, src, srcSize);
-    if (ZSTD_isError(errorCode)) return errorCode;
-    ip += errorCode;
+    /* literal Length */
+    if (litLength >= MaxLL)
+    {
+        *(seqStorePtr->litLength++) = MaxLL;
+        if (litLength<255 + MaxLL)
+            *(seqStorePtr->dumps++) = (BYTE)(litLength - MaxLL);
+        else
+        {
+            *(seqStorePtr->dumps++) = 255;
+            ZSTD_writeLE32(seqStorePtr->dumps, (U32)litLength); seqStorePtr->dumps += 3;
+        }
+    }
+    else *(seqStorePtr->litLength++) = (BYTE)litLength;
 
-    /* Build Decoding Tables */
-    errorCode = ZSTD_decodeSeqHeaders(&lastLLSize, &dumps,
-                                      DTableLL, DTableML, DTableOffb,
-                                      ip, iend-ip);
-    if (ZSTD_isError(errorCode)) return errorCode;
-    /* end pos */
-    if ((litPtr>=ostart) && (litPtr<=oend))
-        litEnd = oend - lastLLSize;
-    else
-        litEnd = ip - lastLLSize;
-    ip += errorCode;
+    /* match offset */
+    *(seqStorePtr->offset++) = (U32)offset;
 
-    /* decompression */
+    /* match Length */
+    if (matchLength >= MaxML)
     {
-        FSE_DStream_t DStream;
-        FSE_DState_t stateLL, stateOffb, stateML;
-        size_t prevOffset = 0, offset = 0;
-        size_t qutt=0;
+        *(seqStorePtr->matchLength++) = MaxML;
+        if (matchLength < 255+MaxML)
+            *(seqStorePtr->dumps++) = (BYTE)(matchLength - MaxML);
+        else
+        {
+            *(seqStorePtr->dumps++) = 255;
+            ZSTD_writeLE32(seqStorePtr->dumps, (U32)matchLength); seqStorePtr->dumps+=3;
+        }
+    }
+    else *(seqStorePtr->matchLength++) = (BYTE)matchLength;
+}
 
-        FSE_initDStream(&DStream, ip, iend-ip);
-        FSE_initDState(&stateLL, &DStream, DTableLL);
-        FSE_initDState(&stateOffb, &DStream, DTableOffb);
-        FSE_initDState(&stateML, &DStream, DTableML);
 
-        while (FSE_reloadDStream(&DStream)<2)
-        {
-            U32 nbBits, offsetCode;
-            const BYTE* match;
-            size_t litLength;
-            size_t matchLength;
-            size_t newOffset;
+//static const U32 hashMask = (1<<HASH_LOG)-1;
+//static const U64 prime5bytes =         889523592379ULL;
+//static const U64 prime6bytes =      227718039650203ULL;
+static const U64 prime7bytes =    58295818150454627ULL;
+//static const U64 prime8bytes = 14923729446516375013ULL;
 
-_another_round:
+//static U32   ZSTD_hashPtr(const void* p) { return (U32) _bextr_u64(*(U64*)p * prime7bytes, (56-HASH_LOG), HASH_LOG); }
+//static U32   ZSTD_hashPtr(const void* p) { return ( (*(U64*)p * prime7bytes) << 8 >> (64-HASH_LOG)); }
+//static U32   ZSTD_hashPtr(const void* p) { return ( (*(U64*)p * prime7bytes) >> (56-HASH_LOG)) & ((1<<HASH_LOG)-1); }
+//static U32   ZSTD_hashPtr(const void* p) { return ( ((*(U64*)p & 0xFFFFFFFFFFFFFF) * prime7bytes) >> (64-HASH_LOG)); }
 
-            /* Literals */
-            litLength = FSE_decodeSymbol(&stateLL, &DStream);
-            if (litLength) prevOffset = offset;
-            if (litLength == MaxLL)
-            {
-                BYTE add = *dumps++;
-                if (add < 255) litLength += add;
-                else
-                {
-                    //litLength = (*(U32*)dumps) & 0xFFFFFF;
-                    litLength = ZSTD_readLE32(dumps) & 0xFFFFFF;
-                    dumps += 3;
-                }
-            }
-            if (((size_t)(litPtr - op) < 8) || ((size_t)(oend-(litPtr+litLength)) < 8))
-                memmove(op, litPtr, litLength);   /* overwrite risk */
-            else
-                ZSTD_wildcopy(op, litPtr, litLength);
-            op += litLength;
-            litPtr += litLength;
+//static U32   ZSTD_hashPtr(const void* p) { return ( (*(U64*)p * prime8bytes) >> (64-HASH_LOG)); }
+static U32   ZSTD_hashPtr(const void* p) { return ( (*(U64*)p * prime7bytes) >> (56-HASH_LOG)) & HASH_MASK; }
+//static U32   ZSTD_hashPtr(const void* p) { return ( (*(U64*)p * prime6bytes) >> (48-HASH_LOG)) & HASH_MASK; }
+//static U32   ZSTD_hashPtr(const void* p) { return ( (*(U64*)p * prime5bytes) >> (40-HASH_LOG)) & HASH_MASK; }
+//static U32   ZSTD_hashPtr(const void* p) { return ( (*(U32*)p * KNUTH) >> (32-HASH_LOG)); }
 
-            /* Offset */
-            offsetCode = FSE_decodeSymbol(&stateOffb, &DStream);
-            if (ZSTD_32bits()) FSE_reloadDStream(&DStream);
-            nbBits = offsetCode - 1;
-            if (offsetCode==0) nbBits = 0;   /* cmove */
-            newOffset = FSE_readBits(&DStream, nbBits);
-            if (ZSTD_32bits()) FSE_reloadDStream(&DStream);
-            newOffset += (size_t)1 << nbBits;
-            if (offsetCode==0) newOffset = prevOffset;
-            match = op - newOffset;
-            prevOffset = offset;
-            offset = newOffset;
+static void  ZSTD_addPtr(U32* table, const BYTE* p, const BYTE* start) { table[ZSTD_hashPtr(p)] = (U32)(p-start); }
 
-            /* MatchLength */
-            matchLength = FSE_decodeSymbol(&stateML, &DStream);
-            if (matchLength == MaxML)
-            {
-                BYTE add = *dumps++;
-                if (add < 255) matchLength += add;
-                else
-                {
-                    matchLength = ZSTD_readLE32(dumps) & 0xFFFFFF;
-                    dumps += 3;
-                }
-            }
-            matchLength += MINMATCH;
+static const BYTE* ZSTD_updateMatch(U32* table, const BYTE* p, const BYTE* start)
+{
+    U32 h = ZSTD_hashPtr(p);
+    const BYTE* r;
+    r = table[h] + start;
+    //table[h] = (U32)(p - start);
+    ZSTD_addPtr(table, p, start);
+    return r;
+}
 
-            /* copy Match */
-            {
-                BYTE* const endMatch = op + matchLength;
-                U64 saved[2];
+static int ZSTD_checkMatch(const BYTE* match, const BYTE* ip)
+{
+    return ZSTD_read32(match) == ZSTD_read32(ip);
+}
 
-                if ((size_t)(litPtr - endMatch) < 12)
-                {
-                    qutt = endMatch + 12 - litPtr;
-                    if ((litPtr + qutt) > oend) qutt = oend-litPtr;
-                    memcpy(saved, litPtr, qutt);
-                }
 
-                if (offset < 8)
-                {
-                    const size_t dec64 = dec64table[offset];
-                    op[0] = match[0];
-                    op[1] = match[1];
-                    op[2] = match[2];
-                    op[3] = match[3];
-                    match += dec32table[offset];
-                    ZSTD_copy4(op+4, match);
-                    match -= dec64;
-                } else { ZSTD_copy8(op, match); }
+static size_t ZSTD_compressBlock(void* cctx, void* dst, size_t maxDstSize, const void* src, size_t srcSize)
+{
+    cctxi_t* ctx = (cctxi_t*) cctx;
+    U32*  HashTable = (U32*)(ctx->hashTable);
+    seqStore_t* seqStorePtr = &(ctx->seqStore);
+    const BYTE* const base = ctx->base;
 
-                if (endMatch > oend-12)
-                {
-                    if (op < oend-16)
-                    {
-                        ZSTD_wildcopy(op+8, match+8, (oend-8) - (op+8));
-                        match += (oend-8) - op;
-                        op = oend-8;
-                    }
-                    while (op<endMatch) *op++ = *match++;
-                }
-                else
-                    ZSTD_wildcopy(op+8, match+8, matchLength-8);   /* works even if matchLength < 8 */
+    const BYTE* const istart = (const BYTE*)src;
+    const BYTE* ip = istart + 1;
+    const BYTE* anchor = istart;
+    const BYTE* const iend = istart + srcSize;
+    const BYTE* const ilimit = iend - 16;
 
-                op = endMatch;
+    size_t prevOffset=0, offset=0;
+    size_t lastLLSize;
 
-                if ((size_t)(litPtr - endMatch) < 12)
-                    memcpy((void*)litPtr, saved, qutt);
-            }
-        }
 
-        /* check if reached exact end */
-        if (FSE_reloadDStream(&DStream) > 2) return (size_t)-ZSTD_ERROR_GENERIC;   /* requested too much : data is corrupted */
-        if (!FSE_endOfDState(&stateLL) && !FSE_endOfDState(&stateML) && !FSE_endOfDState(&stateOffb)) goto _another_round;   /* some ultra-compressible sequence remain ! */
-        if (litPtr != litEnd) goto _another_round;   /* literals not entirely spent */
+    /* init */
+    ZSTD_resetSeqStore(seqStorePtr);
 
-        /* last literal segment */
-        if (op != litPtr) memmove(op, litPtr, lastLLSize);
-        op += lastLLSize;
+    /* Main Search Loop */
+    while (ip < ilimit)
+    {
+        const BYTE* match = (BYTE*) ZSTD_updateMatch(HashTable, ip, base);
+
+        if (!ZSTD_checkMatch(match,ip)) { ip += ((ip-anchor) >> g_searchStrength) + 1; continue; }
+
+        /* catch up */
+        while ((ip>anchor) && (match>base) && (ip[-1] == match[-1])) { ip--; match--; }
+
+        {
+            size_t litLength = ip-anchor;
+            size_t matchLength = ZSTD_count(ip+MINMATCH, match+MINMATCH, iend);
+            size_t offsetCode;
+            if (litLength) prevOffset = offset;
+            offsetCode = ip-match;
+            if (offsetCode == prevOffset) offsetCode = 0;
+            prevOffset = offset;
+            offset = ip-match;
+            ZSTD_storeSeq(seqStorePtr, litLength, anchor, offsetCode, matchLength);
+
+            /* Fill Table */
+            ZSTD_addPtr(HashTable, ip+1, base);
+            ip += matchLength + MINMATCH;
+            if (ip<=iend-8) ZSTD_addPtr(HashTable, ip-2, base);
+            anchor = ip;
+        }
     }
 
-    return op-ostart;
+    /* Last Literals */
+    lastLLSize = iend - anchor;
+    memcpy(seqStorePtr->lit, anchor, lastLLSize);
+    seqStorePtr->lit += lastLLSize;
+
+    /* Finale compression stage */
+    return ZSTD_compressSequences((BYTE*)dst, maxDstSize,
+                                  seqStorePtr, lastLLSize, srcSize);
 }
 
 
-static size_t ZSTD_decompressDCtx(void* ctx, void* dst, size_t maxDstSize, const void* src, size_t srcSize)
+size_t ZSTD_compressBegin(ZSTD_cctx_t ctx, void* dst, size_t maxDstSize)
 {
-    const BYTE* ip = (const BYTE*)src;
-    const BYTE* iend = ip + srcSize;
-    BYTE* const ostart = (BYTE* const)dst;
-    BYTE* op = ostart;
-    BYTE* const oend = ostart + maxDstSize;
-    size_t remainingSize = srcSize;
-    U32 magicNumber;
-    size_t errorCode=0;
-    blockProperties_t blockProperties;
-
-    /* Header */
-    if (srcSize < ZSTD_frameHeaderSize) return (size_t)-ZSTD_ERROR_wrongSrcSize;
-    magicNumber = ZSTD_readBE32(src);
-    if (magicNumber != ZSTD_magicNumber) return (size_t)-ZSTD_ERROR_wrongMagicNumber;
-    ip += ZSTD_frameHeaderSize; remainingSize -= ZSTD_frameHeaderSize;
-
-    while (1)
-    {
-        size_t blockSize = ZSTD_getcBlockSize(ip, iend-ip, &blockProperties);
-        if (ZSTD_isError(blockSize))
-            return blockSize;
-
-        ip += ZSTD_blockHeaderSize;
-        remainingSize -= ZSTD_blockHeaderSize;
-        if (ip+blockSize > iend)
-            return (size_t)-ZSTD_ERROR_wrongSrcSize;
+    /* Sanity check */
+    if (maxDstSize < ZSTD_frameHeaderSize) return (size_t)-ZSTD_ERROR_maxDstSize_tooSmall;
 
-        switch(blockProperties.blockType)
-        {
-        case bt_compressed:
-            errorCode = ZSTD_decompressBlock(ctx, op, oend-op, ip, blockSize);
-            break;
-        case bt_raw :
-            errorCode = ZSTD_copyUncompressedBlock(op, oend-op, ip, blockSize);
-            break;
-        case bt_rle :
-            return (size_t)-ZSTD_ERROR_GENERIC;   /* not yet handled */
-            break;
-        case bt_end :
-            /* end of frame */
-            if (remainingSize) return (size_t)-ZSTD_ERROR_wrongSrcSize;
-            break;
-        default:
-            return (size_t)-ZSTD_ERROR_GENERIC;
-        }
-        if (blockSize == 0) break;   /* bt_end */
+    /* Init */
+    ZSTD_resetCCtx(ctx);
 
-        if (ZSTD_isError(errorCode)) return errorCode;
-        op += errorCode;
-        ip += blockSize;
-        remainingSize -= blockSize;
-    }
+    /* Write Header */
+    ZSTD_writeBE32(dst, ZSTD_magicNumber);
 
-    return op-ostart;
+    return ZSTD_frameHeaderSize;
 }
 
 
-size_t ZSTD_decompress(void* dst, size_t maxDstSize, const void* src, size_t srcSize)
+/* this should be auto-vectorized by compiler */
+static void ZSTD_scaleDownCtx(void* cctx, const U32 limit)
 {
-    U32 ctx[FSE_DTABLE_SIZE_U32(LLFSELog) + FSE_DTABLE_SIZE_U32(OffFSELog) + FSE_DTABLE_SIZE_U32(MLFSELog)];
-    return ZSTD_decompressDCtx(ctx, dst, maxDstSize, src, srcSize);
-}
+    cctxi_t* ctx = (cctxi_t*) cctx;
+    int i;
 
+#if defined(__AVX2__)   /* <immintrin.h> */
+    /* AVX2 version */
+    __m256i* h = ctx->hashTable;
+    const __m256i limit8 = _mm256_set1_epi32(limit);
+    for (i=0; i<(HASH_TABLESIZE>>3); i++)
+    {
+        __m256i src =_mm256_loadu_si256((const __m256i*)(h+i));
+  const __m256i dec = _mm256_min_epu32(src, limit8);
+                src = _mm256_sub_epi32(src, dec);
+        _mm256_storeu_si256((__m256i*)(h+i), src);
+    }
+#else
+    U32* h = ctx->hashTable;
+    for (i=0; i<HASH_TABLESIZE; ++i)
+    {
+        U32 dec;
+        if (h[i] > limit) dec = limit; else dec = h[i];
+        h[i] -= dec;
+    }
+#endif
+}
 
-/*******************************
-*  Streaming Decompression API
-*******************************/
 
-typedef struct
+/* this should be auto-vectorized by compiler */
+static void ZSTD_limitCtx(void* cctx, const U32 limit)
 {
-    U32 ctx[FSE_DTABLE_SIZE_U32(LLFSELog) + FSE_DTABLE_SIZE_U32(OffFSELog) + FSE_DTABLE_SIZE_U32(MLFSELog)];
-    size_t expected;
-    blockType_t bType;
-    U32 phase;
-} dctx_t;
-
+    cctxi_t* ctx = (cctxi_t*) cctx;
+    int i;
 
-ZSTD_dctx_t ZSTD_createDCtx(void)
-{
-    dctx_t* dctx = (dctx_t*)malloc(sizeof(dctx_t));
-    dctx->expected = ZSTD_frameHeaderSize;
-    dctx->phase = 0;
-    return (ZSTD_dctx_t)dctx;
-}
+    if (limit > g_maxLimit)
+    {
+        ZSTD_scaleDownCtx(cctx, limit);
+        ctx->base += limit;
+        ctx->current -= limit;
+        ctx->nextUpdate -= limit;
+        return;
+    }
 
-size_t ZSTD_freeDCtx(ZSTD_dctx_t dctx)
-{
-    free(dctx);
-    return 0;
+#if defined(__AVX2__)   /* <immintrin.h> */
+    /* AVX2 version */
+    {
+        __m256i* h = ctx->hashTable;
+        const __m256i limit8 = _mm256_set1_epi32(limit);
+        //printf("Address h : %0X\n", (U32)h);    // address test
+        for (i=0; i<(HASH_TABLESIZE>>3); i++)
+        {
+            __m256i src =_mm256_loadu_si256((const __m256i*)(h+i));   // Unfortunately, clang doesn't guarantee 32-bytes alignment
+                    src = _mm256_max_epu32(src, limit8);
+            _mm256_storeu_si256((__m256i*)(h+i), src);
+        }
+    }
+#else
+    {
+        U32* h = (U32*)(ctx->hashTable);
+        for (i=0; i<HASH_TABLESIZE; ++i)
+        {
+            if (h[i] < limit) h[i] = limit;
+        }
+    }
+#endif
 }
 
 
-size_t ZSTD_nextSrcSizeToDecompress(ZSTD_dctx_t dctx)
-{
-    return ((dctx_t*)dctx)->expected;
-}
-
-size_t ZSTD_decompressContinue(ZSTD_dctx_t dctx, void* dst, size_t maxDstSize, const void* src, size_t srcSize)
+size_t ZSTD_compressContinue(ZSTD_cctx_t cctx, void* dst, size_t maxDstSize, const void* src, size_t srcSize)
 {
-    dctx_t* ctx = (dctx_t*)dctx;
-
-    /* Sanity check */
-    if (srcSize != ctx->expected) return (size_t)-ZSTD_ERROR_wrongSrcSize;
+    cctxi_t* ctx = (cctxi_t*) cctx;
+    const BYTE* const istart = (const BYTE* const)src;
+    const BYTE* ip = istart;
+    BYTE* const ostart = (BYTE* const)dst;
+    BYTE* op = ostart;
+    const U32 updateRate = 2 * BLOCKSIZE;
 
-    /* Decompress : frame header */
-    if (ctx->phase == 0)
+    /*  Init */
+    if (ctx->base==NULL)
+        ctx->base = (const BYTE*)src, ctx->current=0, ctx->nextUpdate = g_maxDistance;
+    if (src != ctx->base + ctx->current)   /* not contiguous */
     {
-        /* Check frame magic header */
-        U32 magicNumber = ZSTD_readBE32(src);
-        if (magicNumber != ZSTD_magicNumber) return (size_t)-ZSTD_ERROR_wrongMagicNumber;
-        ctx->phase = 1;
-        ctx->expected = ZSTD_blockHeaderSize;
-        return 0;
+            ZSTD_resetCCtx(ctx);
+            ctx->base = (const BYTE*)src;
+            ctx->current = 0;
     }
+    ctx->current += (U32)srcSize;
 
-    /* Decompress : block header */
-    if (ctx->phase == 1)
+    while (srcSize)
     {
-        blockProperties_t bp;
-        size_t blockSize = ZSTD_getcBlockSize(src, ZSTD_blockHeaderSize, &bp);
-        if (ZSTD_isError(blockSize)) return blockSize;
-        if (bp.blockType == bt_end)
+        size_t cSize;
+        size_t blockSize = BLOCKSIZE;
+        if (blockSize > srcSize) blockSize = srcSize;
+
+        /* update hash table */
+        if (g_maxDistance <= BLOCKSIZE)   /* static test => all blocks are independent */
         {
-            ctx->expected = 0;
-            ctx->phase = 0;
+            ZSTD_resetCCtx(ctx);
+            ctx->base = ip;
+            ctx->current=0;
         }
-        else
+        else if (ip >= ctx->base + ctx->nextUpdate)
         {
-            ctx->expected = blockSize;
-            ctx->bType = bp.blockType;
-            ctx->phase = 2;
+            ctx->nextUpdate += updateRate;
+            ZSTD_limitCtx(ctx, ctx->nextUpdate - g_maxDistance);
         }
 
-        return 0;
-    }
-
-    /* Decompress : block content */
-    {
-        size_t rSize;
-        switch(ctx->bType)
+        /* compress */
+        if (maxDstSize < ZSTD_blockHeaderSize) return (size_t)-ZSTD_ERROR_maxDstSize_tooSmall;
+        cSize = ZSTD_compressBlock(ctx, op+ZSTD_blockHeaderSize, maxDstSize-ZSTD_blockHeaderSize, ip, blockSize);
+        if (cSize == 0)
         {
-        case bt_compressed:
-            rSize = ZSTD_decompressBlock(ctx, dst, maxDstSize, src, srcSize);
-            break;
-        case bt_raw :
-            rSize = ZSTD_copyUncompressedBlock(dst, maxDstSize, src, srcSize);
-            break;
-        case bt_rle :
-            return (size_t)-ZSTD_ERROR_GENERIC;   /* not yet handled */
-            break;
-        case bt_end :   /* should never happen (filtered at phase 1) */
-            rSize = 0;
-            break;
-        default:
-            return (size_t)-ZSTD_ERROR_GENERIC;
+            cSize = ZSTD_noCompressBlock(op, maxDstSize, ip, blockSize);   /* block is not compressible */
+            if (ZSTD_isError(cSize)) return cSize;
         }
-        ctx->phase = 1;
-        ctx->expected = ZSTD_blockHeaderSize;
-        return rSize;
+        else
+        {
+            if (ZSTD_isError(cSize)) return cSize;
+            op[0] = (BYTE)(cSize>>16);
+            op[1] = (BYTE)(cSize>>8);
+            op[2] = (BYTE)cSize;
+            op[0] += (BYTE)(bt_compressed << 6); /* is a compressed block */
+            cSize += 3;
+        }
+        op += cSize;
+        maxDstSize -= cSize;
+        ip += blockSize;
+        srcSize -= blockSize;
     }
 
+    return op-ostart;
 }
 
-/* <<<<< zstd.c EOF */
 
-typedef struct sszstdfilter sszstdfilter;
+size_t ZSTD_compressEnd(ZSTD_cctx_t ctx, void* dst, size_t maxDstSize)
+{
+    BYTE* op = (BYTE*)dst;
 
-struct sszstdfilter {
-	void *ctx;
-} sspacked;
+    /* Sanity check */
+    (void)ctx;
+    if (maxDstSize < ZSTD_blockHeaderSize) return (size_t)-ZSTD_ERROR_maxDstSize_tooSmall;
 
-static int
-ss_zstdfilter_init(ssfilter *f, va_list args ssunused)
-{
-	sszstdfilter *z = (sszstdfilter*)f->priv;
-	switch (f->op) {
-	case SS_FINPUT:
-		z->ctx = ZSTD_createCCtx();
-		if (ssunlikely(z->ctx == NULL))
-			return -1;
-		break;	
-	case SS_FOUTPUT:
-		z->ctx = NULL;
-		break;	
-	}
-	return 0;
-}
+    /* End of frame */
+    op[0] = (BYTE)(bt_end << 6);
+    op[1] = 0;
+    op[2] = 0;
 
-static int
-ss_zstdfilter_free(ssfilter *f)
-{
-	sszstdfilter *z = (sszstdfilter*)f->priv;
-	switch (f->op) {
-	case SS_FINPUT:
-		ZSTD_freeCCtx(z->ctx);
-		break;	
-	case SS_FOUTPUT:
-		break;	
-	}
-	return 0;
+    return 3;
 }
 
-static int
-ss_zstdfilter_reset(ssfilter *f)
-{
-	sszstdfilter *z = (sszstdfilter*)f->priv;
-	switch (f->op) {
-	case SS_FINPUT:
-		ZSTD_resetCCtx(z->ctx);
-		break;	
-	case SS_FOUTPUT:
-		break;
-	}
-	return 0;
-}
 
-static int
-ss_zstdfilter_start(ssfilter *f, ssbuf *dest)
+static size_t ZSTD_compressCCtx(void* ctx, void* dst, size_t maxDstSize, const void* src, size_t srcSize)
 {
-	sszstdfilter *z = (sszstdfilter*)f->priv;
-	int rc;
-	size_t block;
-	size_t sz;
-	switch (f->op) {
-	case SS_FINPUT:;
-		block = ZSTD_frameHeaderSize;
-		rc = ss_bufensure(dest, f->a, block);
-		if (ssunlikely(rc == -1))
-			return -1;
-		sz = ZSTD_compressBegin(z->ctx, dest->p, block);
-		if (ssunlikely(ZSTD_isError(sz)))
-			return -1;
-		ss_bufadvance(dest, sz);
-		break;	
-	case SS_FOUTPUT:
-		/* do nothing */
-		break;
-	}
-	return 0;
-}
+    BYTE* const ostart = (BYTE* const)dst;
+    BYTE* op = ostart;
 
-static int
-ss_zstdfilter_next(ssfilter *f, ssbuf *dest, char *buf, int size)
-{
-	sszstdfilter *z = (sszstdfilter*)f->priv;
-	int rc;
-	if (ssunlikely(size == 0))
-		return 0;
-	switch (f->op) {
-	case SS_FINPUT:;
-		size_t block = ZSTD_compressBound(size);
-		rc = ss_bufensure(dest, f->a, block);
-		if (ssunlikely(rc == -1))
-			return -1;
-		size_t sz = ZSTD_compressContinue(z->ctx, dest->p, block, buf, size);
-		if (ssunlikely(ZSTD_isError(sz)))
-			return -1;
-		ss_bufadvance(dest, sz);
-		break;	
-	case SS_FOUTPUT:
-		/* do a single-pass decompression.
-		 *
-		 * Assume that destination buffer is allocated to
-		 * original size.
-		 */
-		sz = ZSTD_decompress(dest->p, ss_bufunused(dest), buf, size);
-		if (ssunlikely(ZSTD_isError(sz)))
-			return -1;
-		break;
-	}
-	return 0;
+    /* Header */
+    {
+        size_t headerSize = ZSTD_compressBegin(ctx, dst, maxDstSize);
+        if(ZSTD_isError(headerSize)) return headerSize;
+        op += headerSize;
+        maxDstSize -= headerSize;
+    }
+
+    /* Compression */
+    {
+        size_t cSize = ZSTD_compressContinue(ctx, op, maxDstSize, src, srcSize);
+        if (ZSTD_isError(cSize)) return cSize;
+        op += cSize;
+        maxDstSize -= cSize;
+    }
+
+    /* Close frame */
+    {
+        size_t endSize = ZSTD_compressEnd(ctx, op, maxDstSize);
+        if(ZSTD_isError(endSize)) return endSize;
+        op += endSize;
+    }
+
+    return (op - ostart);
 }
 
-static int
-ss_zstdfilter_complete(ssfilter *f, ssbuf *dest)
+
+size_t ZSTD_compress(void* dst, size_t maxDstSize, const void* src, size_t srcSize)
 {
-	sszstdfilter *z = (sszstdfilter*)f->priv;
-	int rc;
-	switch (f->op) {
-	case SS_FINPUT:;
-		size_t block = ZSTD_blockHeaderSize;
-		rc = ss_bufensure(dest, f->a, block);
-		if (ssunlikely(rc == -1))
-			return -1;
-		size_t sz = ZSTD_compressEnd(z->ctx, dest->p, block);
-		if (ssunlikely(ZSTD_isError(sz)))
-			return -1;
-		ss_bufadvance(dest, sz);
-		break;	
-	case SS_FOUTPUT:
-		/* do nothing */
-		break;
-	}
-	return 0;
+    void* ctx;
+    size_t r;
+
+    ctx = ZSTD_createCCtx();
+    r = ZSTD_compressCCtx(ctx, dst, maxDstSize, src, srcSize);
+    ZSTD_freeCCtx(ctx);
+    return r;
 }
 
-ssfilterif ss_zstdfilter =
+
+/**************************************************************
+*   Decompression code
+**************************************************************/
+
+size_t ZSTD_getcBlockSize(const void* src, size_t srcSize, blockProperties_t* bpPtr)
 {
-	.name     = "zstd",
-	.init     = ss_zstdfilter_init,
-	.free     = ss_zstdfilter_free,
-	.reset    = ss_zstdfilter_reset,
-	.start    = ss_zstdfilter_start,
-	.next     = ss_zstdfilter_next,
-	.complete = ss_zstdfilter_complete
-};
-#line 1 "sophia/format/sf_scheme.h"
-#ifndef SF_SCHEME_H_
-#define SF_SCHEME_H_
+    const BYTE* const in = (const BYTE* const)src;
+    BYTE headerFlags;
+    U32 cSize;
 
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
+    if (srcSize < 3) return (size_t)-ZSTD_ERROR_wrongSrcSize;
 
-typedef struct sffield sffield;
-typedef struct sfscheme sfscheme;
+    headerFlags = *in;
+    cSize = in[2] + (in[1]<<8) + ((in[0] & 7)<<16);
 
-typedef int (*sfcmpversionf)(char*, char*, void*);
-typedef int (*sfcmpf)(char*, int, char*, int, void*);
+    bpPtr->blockType = (blockType_t)(headerFlags >> 6);
+    bpPtr->origSize = (bpPtr->blockType == bt_rle) ? cSize : 0;
 
-struct sffield {
-	sstype    type;
-	int       position;
-	int       position_key;
-	uint32_t  position_ref;
-	uint32_t  fixed_size;
-	uint32_t  fixed_offset;
-	char     *name;
-	char     *options;
-	int       lsn;
-	int       flags;
-	int       key;
-	int       timestamp;
-	int       expire;
-	sfcmpf    cmp;
-};
+    if (bpPtr->blockType == bt_end) return 0;
+    if (bpPtr->blockType == bt_rle) return 1;
+    return cSize;
+}
 
-struct sfscheme {
-	sffield **fields;
-	sffield **keys;
-	int       fields_count;
-	int       keys_count;
-	sfcmpf    cmp;
-	void     *cmparg;
-	int       offset_expire;
-	int       offset_lsn;
-	int       offset_flags;
-	int       var_offset;
-	int       var_count;
-	int       has_lsn;
-	int       has_flags;
-	int       has_timestamp;
-	int       has_expire;
-};
 
-static inline sffield*
-sf_fieldnew(ssa *a, char *name)
+static size_t ZSTD_copyUncompressedBlock(void* dst, size_t maxDstSize, const void* src, size_t srcSize)
 {
-	sffield *f = ss_malloc(a, sizeof(sffield));
-	if (ssunlikely(f == NULL))
-		return NULL;
-	f->timestamp = 0;
-	f->expire = 0;
-	f->lsn = 0;
-	f->flags = 0;
-	f->key = 0;
-	f->fixed_size = 0;
-	f->fixed_offset = 0;
-	f->position = 0;
-	f->position_ref = 0;
-	f->name = ss_strdup(a, name);
-	if (ssunlikely(f->name == NULL)) {
-		ss_free(a, f);
-		return NULL;
-	}
-	f->type = SS_UNDEF;
-	f->options = NULL;
-	f->cmp = NULL;
-	return f;
+    if (srcSize > maxDstSize) return (size_t)-ZSTD_ERROR_maxDstSize_tooSmall;
+    memcpy(dst, src, srcSize);
+    return srcSize;
 }
 
-static inline void
-sf_fieldfree(sffield *f, ssa *a)
+
+/* force inline : 'fast' really needs to be evaluated at compile time */
+FORCE_INLINE size_t ZSTD_decompressLiterals_usingDTable_generic(
+                       void* const dst, size_t maxDstSize,
+                 const void* src, size_t srcSize,
+                 const void* DTable, U32 fast)
 {
-	if (f->name) {
-		ss_free(a, f->name);
-		f->name = NULL;
-	}
-	if (f->options) {
-		ss_free(a, f->options);
-		f->options = NULL;
-	}
-	ss_free(a, f);
-}
-
-static inline int
-sf_fieldoptions(sffield *f, ssa *a, char *options)
-{
-	char *sz = ss_strdup(a, options);
-	if (ssunlikely(sz == NULL))
-		return -1;
-	if (f->options)
-		ss_free(a, f->options);
-	f->options = sz;
-	return 0;
-}
-
-void sf_schemeinit(sfscheme*);
-void sf_schemefree(sfscheme*, ssa*);
-int  sf_schemeadd(sfscheme*, ssa*, sffield*);
-int  sf_schemevalidate(sfscheme*, ssa*);
-int  sf_schemesave(sfscheme*, ssa*, ssbuf*);
-int  sf_schemeload(sfscheme*, ssa*, char*, int);
+    BYTE* op = (BYTE*) dst;
+    BYTE* const olimit = op;
+    BYTE* const oend = op + maxDstSize;
+    FSE_DStream_t bitD;
+    FSE_DState_t state1, state2;
+    size_t errorCode;
 
-static inline void
-sf_schemeset_comparator(sfscheme *s, sfcmpf cmp)
-{
-	s->cmp = cmp;
-}
+    /* Init */
+    errorCode = FSE_initDStream(&bitD, src, srcSize);
+    if (FSE_isError(errorCode)) return (size_t)-ZSTD_ERROR_GENERIC;
 
-static inline void
-sf_schemeset_comparatorarg(sfscheme *s, void *arg)
-{
-	s->cmparg = arg;
-}
+    FSE_initDState(&state1, &bitD, DTable);
+    FSE_initDState(&state2, &bitD, DTable);
+    op = oend;
 
-sffield*
-sf_schemefind(sfscheme*, char*);
+    /* 2-4 symbols per loop */
+    while (!FSE_reloadDStream(&bitD) && (op>olimit+3))
+    {
+        *--op = fast ? FSE_decodeSymbolFast(&state1, &bitD) : FSE_decodeSymbol(&state1, &bitD);
 
-static inline sffield*
-sf_schemeof(sfscheme *s, int pos)
-{
-	assert(pos < s->fields_count);
-	return s->fields[pos];
-}
+        if (LitFSELog*2+7 > sizeof(size_t)*8)    /* This test must be static */
+            FSE_reloadDStream(&bitD);
 
-static inline int
-sf_schemeeq(sfscheme *a, sfscheme *b)
-{
-	if (a->fields_count != b->fields_count)
-		return 0;
-	int i = 0;
-	while (i < a->fields_count) {
-		sffield *key_a = a->fields[i];
-		sffield *key_b = b->fields[i];
-		if (key_a->type != key_b->type)
-			return 0;
-		i++;
-	}
-	return 1;
-}
+        *--op = fast ? FSE_decodeSymbolFast(&state2, &bitD) : FSE_decodeSymbol(&state2, &bitD);
 
-static inline int
-sf_schemefixed(sfscheme *s)
-{
-	return s->var_count == 0;
-}
+        if (LitFSELog*4+7 < sizeof(size_t)*8)    /* This test must be static */
+        {
+            *--op = fast ? FSE_decodeSymbolFast(&state1, &bitD) : FSE_decodeSymbol(&state1, &bitD);
+            *--op = fast ? FSE_decodeSymbolFast(&state2, &bitD) : FSE_decodeSymbol(&state2, &bitD);
+        }
+    }
 
-int  sf_compare(sfscheme*, char*, char*);
-int  sf_compareprefix(sfscheme*, char*, uint32_t, char*);
+    /* tail */
+    while (1)
+    {
+        if ( (FSE_reloadDStream(&bitD)>2) || (op==olimit) || (FSE_endOfDState(&state1) && FSE_endOfDStream(&bitD)) )
+            break;
 
-#endif
-#line 1 "sophia/format/sf.h"
-#ifndef SF_H_
-#define SF_H_
+        *--op = fast ? FSE_decodeSymbolFast(&state1, &bitD) : FSE_decodeSymbol(&state1, &bitD);
 
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
+        if ( (FSE_reloadDStream(&bitD)>2) || (op==olimit) || (FSE_endOfDState(&state2) && FSE_endOfDStream(&bitD)) )
+            break;
 
-typedef struct sfvar sfvar;
-typedef struct sfv sfv;
+        *--op = fast ? FSE_decodeSymbolFast(&state2, &bitD) : FSE_decodeSymbol(&state2, &bitD);
+    }
 
-#define SVNONE   0
-#define SVDELETE 1
-#define SVUPSERT 2
-#define SVGET    4
-#define SVDUP    8
-#define SVBEGIN  16
+    /* end ? */
+    if (FSE_endOfDStream(&bitD) && FSE_endOfDState(&state1) && FSE_endOfDState(&state2) )
+        return oend-op;
 
-struct sfvar {
-	uint32_t size;
-} sspacked;
+    if (op==olimit) return (size_t)-ZSTD_ERROR_maxDstSize_tooSmall;   /* dst buffer is full, but cSrc unfinished */
 
-struct sfv {
-	char     *pointer;
-	uint32_t  size;
-	union {
-		uint8_t  u8;
-		uint16_t u16;
-		uint32_t u32;
-		uint64_t u64;
-	} numeric;
-};
+    return (size_t)-ZSTD_ERROR_GENERIC;
+}
 
-static inline uint32_t
-sf_ttl(sfscheme *s, char *data)
+static size_t ZSTD_decompressLiterals_usingDTable(
+                       void* const dst, size_t maxDstSize,
+                 const void* src, size_t srcSize,
+                 const void* DTable, U32 fast)
 {
-	assert(s->has_expire);
-	return *(uint32_t*)(data + s->offset_expire);
+    if (fast) return ZSTD_decompressLiterals_usingDTable_generic(dst, maxDstSize, src, srcSize, DTable, 1);
+    return ZSTD_decompressLiterals_usingDTable_generic(dst, maxDstSize, src, srcSize, DTable, 0);
 }
 
-static inline uint8_t
-sf_flags(sfscheme *s, char *data)
+static size_t ZSTD_decompressLiterals(void* ctx, void* dst, size_t maxDstSize,
+                                const void* src, size_t srcSize)
 {
-	assert(s->has_flags);
-	return *(uint8_t*)(data + s->offset_flags);
-}
+    /* assumed : blockType == blockCompressed */
+    const BYTE* ip = (const BYTE*)src;
+    short norm[256];
+    void* DTable = ctx;
+    U32 maxSymbolValue = 255;
+    U32 tableLog;
+    U32 fastMode;
+    size_t errorCode;
 
-static inline int
-sf_flagsequ(uint8_t flags, uint8_t value) {
-	return (flags & value) > 0;
-}
+    if (srcSize < 2) return (size_t)-ZSTD_ERROR_wrongLBlockSize;   /* too small input size */
 
-static inline int
-sf_is(sfscheme *s, char *data, uint8_t flags) {
-	return sf_flagsequ(sf_flags(s, data), flags) > 0;
-}
+    errorCode = FSE_readHeader (norm, &maxSymbolValue, &tableLog, ip, srcSize);
+    if (FSE_isError(errorCode)) return (size_t)-ZSTD_ERROR_GENERIC;
+    ip += errorCode;
+    srcSize -= errorCode;
 
-static inline void
-sf_flagsset(sfscheme *s, char *data, uint8_t flags)
-{
-	assert(s->has_flags);
-	*(uint8_t*)(data + s->offset_flags) = flags;
-}
+    errorCode = FSE_buildDTable (DTable, norm, maxSymbolValue, tableLog);
+    if (FSE_isError(errorCode)) return (size_t)-ZSTD_ERROR_GENERIC;
+    fastMode = (U32)errorCode;
 
-static inline sfvar*
-sf_var(sfscheme *s, int pos, char *data)
-{
-	return &((sfvar*)(data + s->var_offset))[pos];
+    return ZSTD_decompressLiterals_usingDTable (dst, maxDstSize, ip, srcSize, DTable, fastMode);
 }
 
-static inline uint32_t
-sf_size(sfscheme *s, char *data)
-{
-	if (sslikely(sf_schemefixed(s)))
-		return s->var_offset;
-	uint32_t size = s->var_offset + (sizeof(sfvar) * s->var_count);
-	sfvar *v = sf_var(s, 0, data);
-	sfvar *end = sf_var(s, s->var_count, data);
-	for (; v < end; v++)
-		size += v->size;
-	return size;
-}
 
-static inline uint64_t
-sf_lsn(sfscheme *s, char *data)
+size_t ZSTD_decodeLiteralsBlock(void* ctx,
+                                void* dst, size_t maxDstSize,
+                          const BYTE** litPtr,
+                          const void* src, size_t srcSize)
 {
-	assert(s->has_lsn);
-	return *(uint64_t*)(data + s->offset_lsn);
-}
+    const BYTE* const istart = (const BYTE* const)src;
+    const BYTE* ip = istart;
+    BYTE* const ostart = (BYTE* const)dst;
+    BYTE* const oend = ostart + maxDstSize;
+    blockProperties_t litbp;
 
-static inline void
-sf_lsnset(sfscheme *s, char *data, uint64_t lsn)
-{
-	assert(s->has_lsn);
-	*(uint64_t*)(data + s->offset_lsn) = lsn;
+    size_t litcSize = ZSTD_getcBlockSize(src, srcSize, &litbp);
+    if (ZSTD_isError(litcSize)) return litcSize;
+    if (litcSize > srcSize - ZSTD_blockHeaderSize) return (size_t)-ZSTD_ERROR_wrongLBlockSize;
+    ip += ZSTD_blockHeaderSize;
+
+    switch(litbp.blockType)
+    {
+    case bt_raw: *litPtr = ip; ip+= litcSize; break;
+    case bt_rle:
+        {
+            size_t rleSize = litbp.origSize;
+            memset(oend - rleSize, *ip, rleSize);
+            *litPtr = oend - rleSize;
+            ip++;
+            break;
+        }
+    case bt_compressed:
+        {
+            size_t cSize = ZSTD_decompressLiterals(ctx, dst, maxDstSize, ip, litcSize);
+            if (ZSTD_isError(cSize)) return cSize;
+            *litPtr = oend - cSize;
+            ip += litcSize;
+            break;
+        }
+    default:
+        return (size_t)-ZSTD_ERROR_GENERIC;
+    }
+
+    return ip-istart;
 }
 
-static inline char*
-sf_fieldptr(sfscheme *s, sffield *f, char *data, uint32_t *size)
-{
-	if (sslikely(f->fixed_size > 0)) {
-		*size = f->fixed_size;
-		return data + f->fixed_offset;
-	}
-	uint32_t offset = s->var_offset + (sizeof(sfvar) * s->var_count);
-	uint32_t pos = 0;
-	sfvar *v = sf_var(s, 0, data);
-	for (; pos < f->position_ref; v++, pos++)
-		offset += v->size;
-	*size = v->size;
-	return data + offset;
-}
 
-static inline char*
-sf_field(sfscheme *s, int pos, char *data, uint32_t *size)
+size_t ZSTD_decodeSeqHeaders(size_t* lastLLPtr, const BYTE** dumpsPtr,
+                               void* DTableLL, void* DTableML, void* DTableOffb,
+                         const void* src, size_t srcSize)
 {
-	return sf_fieldptr(s, s->fields[pos], data, size);
-}
+    const BYTE* const istart = (const BYTE* const)src;
+    const BYTE* ip = istart;
+    const BYTE* const iend = istart + srcSize;
+    U32 LLtype, Offtype, MLtype;
+    U32 LLlog, Offlog, MLlog;
+    size_t dumpsLength;
 
-static inline int
-sf_fieldsize(sfscheme *s, int pos, char *data)
-{
-	sffield *f = s->fields[pos];
-	if (sslikely(f->fixed_size > 0))
-		return f->fixed_size;
-	return sf_var(s, f->position_ref, data)->size;
-}
+    /* SeqHead */
+    ip += ZSTD_readProgressive(lastLLPtr, ip);
+    LLtype  = *ip >> 6;
+    Offtype = (*ip >> 4) & 3;
+    MLtype  = (*ip >> 2) & 3;
+    if (*ip & 2)
+    {
+        dumpsLength  = ip[2];
+        dumpsLength += ip[1] << 8;
+        ip += 3;
+    }
+    else
+    {
+        dumpsLength  = ip[1];
+        dumpsLength += (ip[0] & 1) << 8;
+        ip += 2;
+    }
+    *dumpsPtr = ip;
+    ip += dumpsLength;
 
-static inline int
-sf_writesize(sfscheme *s, sfv *v)
-{
-	if (sf_schemefixed(s))
-		return s->var_offset;
-	int sum = s->var_offset;
-	int i;
-	for (i = 0; i < s->fields_count; i++) {
-		sffield *f = s->fields[i];
-		if (f->fixed_size != 0)
-			continue;
-		sum += sizeof(sfvar)+ v[i].size;
-	}
-	return sum;
-}
+    /* sequences */
+    {
+        S16 norm[MaxML+1];    /* assumption : MaxML >= MaxLL and MaxOff */
+        size_t headerSize;
 
-static inline void
-sf_write(sfscheme *s, sfv *v, char *dest)
-{
-	int var_value_offset =
-		s->var_offset + sizeof(sfvar) * s->var_count;
-	int i;
-	for (i = 0; i < s->fields_count; i++) {
-		sffield *f = s->fields[i];
-		if (f->fixed_size) {
-			if (sslikely(v[i].size > 0))
-				memcpy(dest + f->fixed_offset, v[i].pointer, v[i].size);
-			else
-				memset(dest + f->fixed_offset, 0, f->fixed_size);
-			continue;
-		}
-		sfvar *var = sf_var(s, f->position_ref, dest);
-		var->size = v[i].size;
-		if (sslikely(v[i].size > 0))
-			memcpy(dest + var_value_offset, v[i].pointer, v[i].size);
-		var_value_offset += var->size;
-	}
-}
+        /* Build DTables */
+        switch(LLtype)
+        {
+        U32 max;
+        case bt_rle :
+            LLlog = 0;
+            FSE_buildDTable_rle(DTableLL, *ip++); break;
+        case bt_raw :
+            LLlog = LLbits;
+            FSE_buildDTable_raw(DTableLL, LLbits); break;
+        default :
+            max = MaxLL;
+            headerSize = FSE_readHeader(norm, &max, &LLlog, ip, iend-ip);
+            if (FSE_isError(headerSize)) return (size_t)-ZSTD_ERROR_GENERIC;
+            ip += headerSize;
+            FSE_buildDTable(DTableLL, norm, max, LLlog);
+        }
 
-static inline uint64_t
-sf_hash(sfscheme *s, char *data)
-{
-	uint64_t hash = 0;
-	int i;
-	for (i = 0; i < s->keys_count; i++) {
-		uint32_t size;
-		char *field = sf_field(s, i, data, &size);
-		hash ^= ss_fnv(field, size);
-	}
-	return hash;
-}
+        switch(Offtype)
+        {
+        U32 max;
+        case bt_rle :
+            Offlog = 0;
+            FSE_buildDTable_rle(DTableOffb, *ip++); break;
+        case bt_raw :
+            Offlog = Offbits;
+            FSE_buildDTable_raw(DTableOffb, Offbits); break;
+        default :
+            max = MaxOff;
+            headerSize = FSE_readHeader(norm, &max, &Offlog, ip, iend-ip);
+            if (FSE_isError(headerSize)) return (size_t)-ZSTD_ERROR_GENERIC;
+            ip += headerSize;
+            FSE_buildDTable(DTableOffb, norm, max, Offlog);
+        }
 
-static inline int
-sf_comparable_size(sfscheme *s, char *data)
-{
-	int sum = s->var_offset;
-	int i;
-	for (i = 0; i < s->fields_count; i++) {
-		sffield *f = s->fields[i];
-		if (f->fixed_size != 0)
-			continue;
-		if (f->key)
-			sum += sf_fieldsize(s, i, data);
-		sum += sizeof(sfvar);
-	}
-	return sum;
-}
+        switch(MLtype)
+        {
+        U32 max;
+        case bt_rle :
+            MLlog = 0;
+            FSE_buildDTable_rle(DTableML, *ip++); break;
+        case bt_raw :
+            MLlog = MLbits;
+            FSE_buildDTable_raw(DTableML, MLbits); break;
+        default :
+            max = MaxML;
+            headerSize = FSE_readHeader(norm, &max, &MLlog, ip, iend-ip);
+            if (FSE_isError(headerSize)) return (size_t)-ZSTD_ERROR_GENERIC;
+            ip += headerSize;
+            FSE_buildDTable(DTableML, norm, max, MLlog);
+        }
+    }
 
-static inline void
-sf_comparable_write(sfscheme *s, char *src, char *dest)
-{
-	int var_value_offset =
-		s->var_offset + sizeof(sfvar) * s->var_count;
-	memcpy(dest, src, s->var_offset);
-	int i;
-	for (i = 0; i < s->fields_count; i++) {
-		sffield *f = s->fields[i];
-		if (f->fixed_size != 0)
-			continue;
-		sfvar *var = sf_var(s, f->position_ref, dest);
-		if (! f->key) {
-			var->size = 0;
-			continue;
-		}
-		char *ptr = sf_fieldptr(s, f, src, &var->size);
-		memcpy(dest + var_value_offset, ptr, var->size);
-		var_value_offset += var->size;
-	}
+    return ip-istart;
 }
 
-#endif
-#line 1 "sophia/format/sf_limit.h"
-#ifndef SF_LIMIT_H_
-#define SF_LIMIT_H_
 
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
+#define ZSTD_prefetch(p) { const BYTE pByte = *(volatile const BYTE*)p; }
 
-typedef struct sflimit sflimit;
+FORCE_INLINE size_t ZSTD_decompressBlock(void* ctx, void* dst, size_t maxDstSize,
+                             const void* src, size_t srcSize)
+{
+    const BYTE* ip = (const BYTE*)src;
+    const BYTE* const iend = ip + srcSize;
+    BYTE* const ostart = (BYTE* const)dst;
+    BYTE* op = ostart;
+    BYTE* const oend = ostart + maxDstSize;
+    size_t errorCode;
+    size_t lastLLSize;
+    const BYTE* dumps;
+    const BYTE* litPtr;
+    const BYTE* litEnd;
+    const size_t dec32table[] = {4, 1, 2, 1, 4, 4, 4, 4};   /* added */
+    const size_t dec64table[] = {8, 8, 8, 7, 8, 9,10,11};   /* substracted */
+    void* DTableML = ctx;
+    void* DTableLL = ((U32*)ctx) + FSE_DTABLE_SIZE_U32(MLFSELog);
+    void* DTableOffb = ((U32*)DTableLL) + FSE_DTABLE_SIZE_U32(LLFSELog);
 
-struct sflimit {
-	uint8_t   u8_min;
-	uint8_t   u8_max;
-	uint16_t  u16_min;
-	uint16_t  u16_max;
-	uint32_t  u32_min;
-	uint32_t  u32_max;
-	uint64_t  u64_min;
-	uint64_t  u64_max;
-	int64_t   i64_min;
-	int64_t   i64_max;
-	char     *string_min;
-	uint32_t  string_min_size;
-	char     *string_max;
-	uint32_t  string_max_size;
-	uint32_t  field_max_size;
-};
+    /* blockType == blockCompressed, srcSize is trusted */
 
-static inline int
-sf_limitinit(sflimit *b, ssa *a)
-{
-	b->field_max_size = 2 * 1024 * 1024;
-	b->u8_min  = 0;
-	b->u8_max  = UINT8_MAX;
-	b->u16_min = 0;
-	b->u16_max = UINT16_MAX;
-	b->u32_min = 0;
-	b->u32_max = UINT32_MAX;
-	b->u64_min = 0;
-	b->u64_max = UINT64_MAX;
-	b->i64_min = INT64_MIN;
-	b->i64_max = UINT64_MAX;
-	b->string_min_size = 0;
-	b->string_min = "";
-	b->string_max_size = 1024;
-	b->string_max = ss_malloc(a, b->string_max_size);
-	if (ssunlikely(b->string_max == NULL))
+    /* literal sub-block */
+    errorCode = ZSTD_decodeLiteralsBlock(ctx, dst, maxDstSize, &litPtr, src, srcSize);
+    if (ZSTD_isError(errorCode)) return errorCode;
+    ip += errorCode;
+
+    /* Build Decoding Tables */
+    errorCode = ZSTD_decodeSeqHeaders(&lastLLSize, &dumps,
+                                      DTableLL, DTableML, DTableOffb,
+                                      ip, iend-ip);
+    if (ZSTD_isError(errorCode)) return errorCode;
+    /* end pos */
+    if ((litPtr>=ostart) && (litPtr<=oend))
+        litEnd = oend - lastLLSize;
+    else
+        litEnd = ip - lastLLSize;
+    ip += errorCode;
+
+    /* decompression */
+    {
+        FSE_DStream_t DStream;
+        FSE_DState_t stateLL, stateOffb, stateML;
+        size_t prevOffset = 0, offset = 0;
+        size_t qutt=0;
+
+        FSE_initDStream(&DStream, ip, iend-ip);
+        FSE_initDState(&stateLL, &DStream, DTableLL);
+        FSE_initDState(&stateOffb, &DStream, DTableOffb);
+        FSE_initDState(&stateML, &DStream, DTableML);
+
+        while (FSE_reloadDStream(&DStream)<2)
+        {
+            U32 nbBits, offsetCode;
+            const BYTE* match;
+            size_t litLength;
+            size_t matchLength;
+            size_t newOffset;
+
+_another_round:
+
+            /* Literals */
+            litLength = FSE_decodeSymbol(&stateLL, &DStream);
+            if (litLength) prevOffset = offset;
+            if (litLength == MaxLL)
+            {
+                BYTE add = *dumps++;
+                if (add < 255) litLength += add;
+                else
+                {
+                    //litLength = (*(U32*)dumps) & 0xFFFFFF;
+                    litLength = ZSTD_readLE32(dumps) & 0xFFFFFF;
+                    dumps += 3;
+                }
+            }
+            if (((size_t)(litPtr - op) < 8) || ((size_t)(oend-(litPtr+litLength)) < 8))
+                memmove(op, litPtr, litLength);   /* overwrite risk */
+            else
+                ZSTD_wildcopy(op, litPtr, litLength);
+            op += litLength;
+            litPtr += litLength;
+
+            /* Offset */
+            offsetCode = FSE_decodeSymbol(&stateOffb, &DStream);
+            if (ZSTD_32bits()) FSE_reloadDStream(&DStream);
+            nbBits = offsetCode - 1;
+            if (offsetCode==0) nbBits = 0;   /* cmove */
+            newOffset = FSE_readBits(&DStream, nbBits);
+            if (ZSTD_32bits()) FSE_reloadDStream(&DStream);
+            newOffset += (size_t)1 << nbBits;
+            if (offsetCode==0) newOffset = prevOffset;
+            match = op - newOffset;
+            prevOffset = offset;
+            offset = newOffset;
+
+            /* MatchLength */
+            matchLength = FSE_decodeSymbol(&stateML, &DStream);
+            if (matchLength == MaxML)
+            {
+                BYTE add = *dumps++;
+                if (add < 255) matchLength += add;
+                else
+                {
+                    matchLength = ZSTD_readLE32(dumps) & 0xFFFFFF;
+                    dumps += 3;
+                }
+            }
+            matchLength += MINMATCH;
+
+            /* copy Match */
+            {
+                BYTE* const endMatch = op + matchLength;
+                U64 saved[2];
+
+                if ((size_t)(litPtr - endMatch) < 12)
+                {
+                    qutt = endMatch + 12 - litPtr;
+                    if ((litPtr + qutt) > oend) qutt = oend-litPtr;
+                    memcpy(saved, litPtr, qutt);
+                }
+
+                if (offset < 8)
+                {
+                    const size_t dec64 = dec64table[offset];
+                    op[0] = match[0];
+                    op[1] = match[1];
+                    op[2] = match[2];
+                    op[3] = match[3];
+                    match += dec32table[offset];
+                    ZSTD_copy4(op+4, match);
+                    match -= dec64;
+                } else { ZSTD_copy8(op, match); }
+
+                if (endMatch > oend-12)
+                {
+                    if (op < oend-16)
+                    {
+                        ZSTD_wildcopy(op+8, match+8, (oend-8) - (op+8));
+                        match += (oend-8) - op;
+                        op = oend-8;
+                    }
+                    while (op<endMatch) *op++ = *match++;
+                }
+                else
+                    ZSTD_wildcopy(op+8, match+8, matchLength-8);   /* works even if matchLength < 8 */
+
+                op = endMatch;
+
+                if ((size_t)(litPtr - endMatch) < 12)
+                    memcpy((void*)litPtr, saved, qutt);
+            }
+        }
+
+        /* check if reached exact end */
+        if (FSE_reloadDStream(&DStream) > 2) return (size_t)-ZSTD_ERROR_GENERIC;   /* requested too much : data is corrupted */
+        if (!FSE_endOfDState(&stateLL) && !FSE_endOfDState(&stateML) && !FSE_endOfDState(&stateOffb)) goto _another_round;   /* some ultra-compressible sequence remain ! */
+        if (litPtr != litEnd) goto _another_round;   /* literals not entirely spent */
+
+        /* last literal segment */
+        if (op != litPtr) memmove(op, litPtr, lastLLSize);
+        op += lastLLSize;
+    }
+
+    return op-ostart;
+}
+
+
+static size_t ZSTD_decompressDCtx(void* ctx, void* dst, size_t maxDstSize, const void* src, size_t srcSize)
+{
+    const BYTE* ip = (const BYTE*)src;
+    const BYTE* iend = ip + srcSize;
+    BYTE* const ostart = (BYTE* const)dst;
+    BYTE* op = ostart;
+    BYTE* const oend = ostart + maxDstSize;
+    size_t remainingSize = srcSize;
+    U32 magicNumber;
+    size_t errorCode=0;
+    blockProperties_t blockProperties;
+
+    /* Header */
+    if (srcSize < ZSTD_frameHeaderSize) return (size_t)-ZSTD_ERROR_wrongSrcSize;
+    magicNumber = ZSTD_readBE32(src);
+    if (magicNumber != ZSTD_magicNumber) return (size_t)-ZSTD_ERROR_wrongMagicNumber;
+    ip += ZSTD_frameHeaderSize; remainingSize -= ZSTD_frameHeaderSize;
+
+    while (1)
+    {
+        size_t blockSize = ZSTD_getcBlockSize(ip, iend-ip, &blockProperties);
+        if (ZSTD_isError(blockSize))
+            return blockSize;
+
+        ip += ZSTD_blockHeaderSize;
+        remainingSize -= ZSTD_blockHeaderSize;
+        if (ip+blockSize > iend)
+            return (size_t)-ZSTD_ERROR_wrongSrcSize;
+
+        switch(blockProperties.blockType)
+        {
+        case bt_compressed:
+            errorCode = ZSTD_decompressBlock(ctx, op, oend-op, ip, blockSize);
+            break;
+        case bt_raw :
+            errorCode = ZSTD_copyUncompressedBlock(op, oend-op, ip, blockSize);
+            break;
+        case bt_rle :
+            return (size_t)-ZSTD_ERROR_GENERIC;   /* not yet handled */
+            break;
+        case bt_end :
+            /* end of frame */
+            if (remainingSize) return (size_t)-ZSTD_ERROR_wrongSrcSize;
+            break;
+        default:
+            return (size_t)-ZSTD_ERROR_GENERIC;
+        }
+        if (blockSize == 0) break;   /* bt_end */
+
+        if (ZSTD_isError(errorCode)) return errorCode;
+        op += errorCode;
+        ip += blockSize;
+        remainingSize -= blockSize;
+    }
+
+    return op-ostart;
+}
+
+
+size_t ZSTD_decompress(void* dst, size_t maxDstSize, const void* src, size_t srcSize)
+{
+    U32 ctx[FSE_DTABLE_SIZE_U32(LLFSELog) + FSE_DTABLE_SIZE_U32(OffFSELog) + FSE_DTABLE_SIZE_U32(MLFSELog)];
+    return ZSTD_decompressDCtx(ctx, dst, maxDstSize, src, srcSize);
+}
+
+
+/*******************************
+*  Streaming Decompression API
+*******************************/
+
+typedef struct
+{
+    U32 ctx[FSE_DTABLE_SIZE_U32(LLFSELog) + FSE_DTABLE_SIZE_U32(OffFSELog) + FSE_DTABLE_SIZE_U32(MLFSELog)];
+    size_t expected;
+    blockType_t bType;
+    U32 phase;
+} dctx_t;
+
+
+ZSTD_dctx_t ZSTD_createDCtx(void)
+{
+    dctx_t* dctx = (dctx_t*)malloc(sizeof(dctx_t));
+    dctx->expected = ZSTD_frameHeaderSize;
+    dctx->phase = 0;
+    return (ZSTD_dctx_t)dctx;
+}
+
+size_t ZSTD_freeDCtx(ZSTD_dctx_t dctx)
+{
+    free(dctx);
+    return 0;
+}
+
+
+size_t ZSTD_nextSrcSizeToDecompress(ZSTD_dctx_t dctx)
+{
+    return ((dctx_t*)dctx)->expected;
+}
+
+size_t ZSTD_decompressContinue(ZSTD_dctx_t dctx, void* dst, size_t maxDstSize, const void* src, size_t srcSize)
+{
+    dctx_t* ctx = (dctx_t*)dctx;
+
+    /* Sanity check */
+    if (srcSize != ctx->expected) return (size_t)-ZSTD_ERROR_wrongSrcSize;
+
+    /* Decompress : frame header */
+    if (ctx->phase == 0)
+    {
+        /* Check frame magic header */
+        U32 magicNumber = ZSTD_readBE32(src);
+        if (magicNumber != ZSTD_magicNumber) return (size_t)-ZSTD_ERROR_wrongMagicNumber;
+        ctx->phase = 1;
+        ctx->expected = ZSTD_blockHeaderSize;
+        return 0;
+    }
+
+    /* Decompress : block header */
+    if (ctx->phase == 1)
+    {
+        blockProperties_t bp;
+        size_t blockSize = ZSTD_getcBlockSize(src, ZSTD_blockHeaderSize, &bp);
+        if (ZSTD_isError(blockSize)) return blockSize;
+        if (bp.blockType == bt_end)
+        {
+            ctx->expected = 0;
+            ctx->phase = 0;
+        }
+        else
+        {
+            ctx->expected = blockSize;
+            ctx->bType = bp.blockType;
+            ctx->phase = 2;
+        }
+
+        return 0;
+    }
+
+    /* Decompress : block content */
+    {
+        size_t rSize;
+        switch(ctx->bType)
+        {
+        case bt_compressed:
+            rSize = ZSTD_decompressBlock(ctx, dst, maxDstSize, src, srcSize);
+            break;
+        case bt_raw :
+            rSize = ZSTD_copyUncompressedBlock(dst, maxDstSize, src, srcSize);
+            break;
+        case bt_rle :
+            return (size_t)-ZSTD_ERROR_GENERIC;   /* not yet handled */
+            break;
+        case bt_end :   /* should never happen (filtered at phase 1) */
+            rSize = 0;
+            break;
+        default:
+            return (size_t)-ZSTD_ERROR_GENERIC;
+        }
+        ctx->phase = 1;
+        ctx->expected = ZSTD_blockHeaderSize;
+        return rSize;
+    }
+
+}
+
+/* <<<<< zstd.c EOF */
+
+typedef struct sszstdfilter sszstdfilter;
+
+struct sszstdfilter {
+	void *ctx;
+} sspacked;
+
+static int
+ss_zstdfilter_init(ssfilter *f, va_list args ssunused)
+{
+	sszstdfilter *z = (sszstdfilter*)f->priv;
+	switch (f->op) {
+	case SS_FINPUT:
+		z->ctx = ZSTD_createCCtx();
+		if (ssunlikely(z->ctx == NULL))
+			return -1;
+		break;	
+	case SS_FOUTPUT:
+		z->ctx = NULL;
+		break;	
+	}
+	return 0;
+}
+
+static int
+ss_zstdfilter_free(ssfilter *f)
+{
+	sszstdfilter *z = (sszstdfilter*)f->priv;
+	switch (f->op) {
+	case SS_FINPUT:
+		ZSTD_freeCCtx(z->ctx);
+		break;	
+	case SS_FOUTPUT:
+		break;	
+	}
+	return 0;
+}
+
+static int
+ss_zstdfilter_reset(ssfilter *f)
+{
+	sszstdfilter *z = (sszstdfilter*)f->priv;
+	switch (f->op) {
+	case SS_FINPUT:
+		ZSTD_resetCCtx(z->ctx);
+		break;	
+	case SS_FOUTPUT:
+		break;
+	}
+	return 0;
+}
+
+static int
+ss_zstdfilter_start(ssfilter *f, ssbuf *dest)
+{
+	sszstdfilter *z = (sszstdfilter*)f->priv;
+	int rc;
+	size_t block;
+	size_t sz;
+	switch (f->op) {
+	case SS_FINPUT:;
+		block = ZSTD_frameHeaderSize;
+		rc = ss_bufensure(dest, f->a, block);
+		if (ssunlikely(rc == -1))
+			return -1;
+		sz = ZSTD_compressBegin(z->ctx, dest->p, block);
+		if (ssunlikely(ZSTD_isError(sz)))
+			return -1;
+		ss_bufadvance(dest, sz);
+		break;	
+	case SS_FOUTPUT:
+		/* do nothing */
+		break;
+	}
+	return 0;
+}
+
+static int
+ss_zstdfilter_next(ssfilter *f, ssbuf *dest, char *buf, int size)
+{
+	sszstdfilter *z = (sszstdfilter*)f->priv;
+	int rc;
+	if (ssunlikely(size == 0))
+		return 0;
+	switch (f->op) {
+	case SS_FINPUT:;
+		size_t block = ZSTD_compressBound(size);
+		rc = ss_bufensure(dest, f->a, block);
+		if (ssunlikely(rc == -1))
+			return -1;
+		size_t sz = ZSTD_compressContinue(z->ctx, dest->p, block, buf, size);
+		if (ssunlikely(ZSTD_isError(sz)))
+			return -1;
+		ss_bufadvance(dest, sz);
+		break;	
+	case SS_FOUTPUT:
+		/* do a single-pass decompression.
+		 *
+		 * Assume that destination buffer is allocated to
+		 * original size.
+		 */
+		sz = ZSTD_decompress(dest->p, ss_bufunused(dest), buf, size);
+		if (ssunlikely(ZSTD_isError(sz)))
+			return -1;
+		break;
+	}
+	return 0;
+}
+
+static int
+ss_zstdfilter_complete(ssfilter *f, ssbuf *dest)
+{
+	sszstdfilter *z = (sszstdfilter*)f->priv;
+	int rc;
+	switch (f->op) {
+	case SS_FINPUT:;
+		size_t block = ZSTD_blockHeaderSize;
+		rc = ss_bufensure(dest, f->a, block);
+		if (ssunlikely(rc == -1))
+			return -1;
+		size_t sz = ZSTD_compressEnd(z->ctx, dest->p, block);
+		if (ssunlikely(ZSTD_isError(sz)))
+			return -1;
+		ss_bufadvance(dest, sz);
+		break;	
+	case SS_FOUTPUT:
+		/* do nothing */
+		break;
+	}
+	return 0;
+}
+
+ssfilterif ss_zstdfilter =
+{
+	.name     = "zstd",
+	.init     = ss_zstdfilter_init,
+	.free     = ss_zstdfilter_free,
+	.reset    = ss_zstdfilter_reset,
+	.start    = ss_zstdfilter_start,
+	.next     = ss_zstdfilter_next,
+	.complete = ss_zstdfilter_complete
+};
+#line 1 "sophia/format/sf_scheme.h"
+#ifndef SF_SCHEME_H_
+#define SF_SCHEME_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct sffield sffield;
+typedef struct sfscheme sfscheme;
+
+typedef int (*sfcmpversionf)(char*, char*, void*);
+typedef int (*sfcmpf)(char*, int, char*, int, void*);
+
+/* order-preserving prefix of the first key part */
+#define SF_PREFIXNONE   0
+#define SF_PREFIXSTRING 1
+#define SF_PREFIXU      2
+#define SF_PREFIXUREV   3
+
+/* key compare path chosen for the scheme */
+#define SF_CMPGENERIC   0
+#define SF_CMPU32       1
+#define SF_CMPU64       2
+#define SF_CMPSTRING    3
+
+struct sffield {
+	sstype    type;
+	int       position;
+	int       position_key;
+	uint32_t  position_ref;
+	uint32_t  fixed_size;
+	uint32_t  fixed_offset;
+	char     *name;
+	char     *options;
+	int       lsn;
+	int       flags;
+	int       key;
+	int       timestamp;
+	int       expire;
+	sfcmpf    cmp;
+	int       cmpkind;
+};
+
+struct sfscheme {
+	sffield **fields;
+	sffield **keys;
+	int       fields_count;
+	int       keys_count;
+	sfcmpf    cmp;
+	void     *cmparg;
+	int       offset_expire;
+	int       offset_lsn;
+	int       offset_flags;
+	int       var_offset;
+	int       var_count;
+	int       has_lsn;
+	int       has_flags;
+	int       has_timestamp;
+	int       has_expire;
+	int       keyprefix;
+	int       cmpfast;
+	uint32_t  cmpoffset;
+	uint64_t  cmpmask;
+};
+
+static inline sffield*
+sf_fieldnew(ssa *a, char *name)
+{
+	sffield *f = ss_malloc(a, sizeof(sffield));
+	if (ssunlikely(f == NULL))
+		return NULL;
+	f->timestamp = 0;
+	f->expire = 0;
+	f->lsn = 0;
+	f->flags = 0;
+	f->key = 0;
+	f->fixed_size = 0;
+	f->fixed_offset = 0;
+	f->position = 0;
+	f->position_ref = 0;
+	f->name = ss_strdup(a, name);
+	if (ssunlikely(f->name == NULL)) {
+		ss_free(a, f);
+		return NULL;
+	}
+	f->type = SS_UNDEF;
+	f->options = NULL;
+	f->cmp = NULL;
+	f->cmpkind = SF_PREFIXNONE;
+	return f;
+}
+
+static inline void
+sf_fieldfree(sffield *f, ssa *a)
+{
+	if (f->name) {
+		ss_free(a, f->name);
+		f->name = NULL;
+	}
+	if (f->options) {
+		ss_free(a, f->options);
+		f->options = NULL;
+	}
+	ss_free(a, f);
+}
+
+static inline int
+sf_fieldoptions(sffield *f, ssa *a, char *options)
+{
+	char *sz = ss_strdup(a, options);
+	if (ssunlikely(sz == NULL))
+		return -1;
+	if (f->options)
+		ss_free(a, f->options);
+	f->options = sz;
+	return 0;
+}
+
+void sf_schemeinit(sfscheme*);
+void sf_schemefree(sfscheme*, ssa*);
+int  sf_schemeadd(sfscheme*, ssa*, sffield*);
+int  sf_schemevalidate(sfscheme*, ssa*);
+int  sf_schemesave(sfscheme*, ssa*, ssbuf*);
+int  sf_schemeload(sfscheme*, ssa*, char*, int);
+
+static inline void
+sf_schemeset_comparator(sfscheme *s, sfcmpf cmp)
+{
+	s->cmp = cmp;
+}
+
+static inline void
+sf_schemeset_comparatorarg(sfscheme *s, void *arg)
+{
+	s->cmparg = arg;
+}
+
+sffield*
+sf_schemefind(sfscheme*, char*);
+
+static inline sffield*
+sf_schemeof(sfscheme *s, int pos)
+{
+	assert(pos < s->fields_count);
+	return s->fields[pos];
+}
+
+static inline int
+sf_schemeeq(sfscheme *a, sfscheme *b)
+{
+	if (a->fields_count != b->fields_count)
+		return 0;
+	int i = 0;
+	while (i < a->fields_count) {
+		sffield *key_a = a->fields[i];
+		sffield *key_b = b->fields[i];
+		if (key_a->type != key_b->type)
+			return 0;
+		i++;
+	}
+	return 1;
+}
+
+static inline int
+sf_schemefixed(sfscheme *s)
+{
+	return s->var_count == 0;
+}
+
+int  sf_comparegeneric(sfscheme*, char*, char*);
+int  sf_compareprefix(sfscheme*, char*, uint32_t, char*);
+
+#endif
+#line 1 "sophia/format/sf.h"
+#ifndef SF_H_
+#define SF_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct sfvar sfvar;
+typedef struct sfv sfv;
+
+#define SVNONE   0
+#define SVDELETE 1
+#define SVUPSERT 2
+#define SVGET    4
+#define SVDUP    8
+#define SVBEGIN  16
+#define SVVLOG   32
+#define SVRANGE  64
+
+struct sfvar {
+	uint32_t size;
+} sspacked;
+
+struct sfv {
+	char     *pointer;
+	uint32_t  size;
+	union {
+		uint8_t  u8;
+		uint16_t u16;
+		uint32_t u32;
+		uint64_t u64;
+	} numeric;
+};
+
+static inline uint32_t
+sf_ttl(sfscheme *s, char *data)
+{
+	assert(s->has_expire);
+	return *(uint32_t*)(data + s->offset_expire);
+}
+
+static inline uint8_t
+sf_flags(sfscheme *s, char *data)
+{
+	assert(s->has_flags);
+	return *(uint8_t*)(data + s->offset_flags);
+}
+
+static inline int
+sf_flagsequ(uint8_t flags, uint8_t value) {
+	return (flags & value) > 0;
+}
+
+static inline int
+sf_is(sfscheme *s, char *data, uint8_t flags) {
+	return sf_flagsequ(sf_flags(s, data), flags) > 0;
+}
+
+static inline void
+sf_flagsset(sfscheme *s, char *data, uint8_t flags)
+{
+	assert(s->has_flags);
+	*(uint8_t*)(data + s->offset_flags) = flags;
+}
+
+static inline sfvar*
+sf_var(sfscheme *s, int pos, char *data)
+{
+	return &((sfvar*)(data + s->var_offset))[pos];
+}
+
+static inline uint32_t
+sf_size(sfscheme *s, char *data)
+{
+	if (sslikely(sf_schemefixed(s)))
+		return s->var_offset;
+	uint32_t size = s->var_offset + (sizeof(sfvar) * s->var_count);
+	sfvar *v = sf_var(s, 0, data);
+	sfvar *end = sf_var(s, s->var_count, data);
+	for (; v < end; v++)
+		size += v->size;
+	return size;
+}
+
+static inline uint64_t
+sf_lsn(sfscheme *s, char *data)
+{
+	assert(s->has_lsn);
+	return *(uint64_t*)(data + s->offset_lsn);
+}
+
+static inline void
+sf_lsnset(sfscheme *s, char *data, uint64_t lsn)
+{
+	assert(s->has_lsn);
+	*(uint64_t*)(data + s->offset_lsn) = lsn;
+}
+
+static inline char*
+sf_fieldptr(sfscheme *s, sffield *f, char *data, uint32_t *size)
+{
+	if (sslikely(f->fixed_size > 0)) {
+		*size = f->fixed_size;
+		return data + f->fixed_offset;
+	}
+	uint32_t offset = s->var_offset + (sizeof(sfvar) * s->var_count);
+	uint32_t pos = 0;
+	sfvar *v = sf_var(s, 0, data);
+	for (; pos < f->position_ref; v++, pos++)
+		offset += v->size;
+	*size = v->size;
+	return data + offset;
+}
+
+static inline char*
+sf_field(sfscheme *s, int pos, char *data, uint32_t *size)
+{
+	return sf_fieldptr(s, s->fields[pos], data, size);
+}
+
+static inline int
+sf_compare(sfscheme *s, char *a, char *b)
+{
+	/* single key schemes are compared inline, reverse
+	 * order is handled by flipping the bits */
+	switch (s->cmpfast) {
+	case SF_CMPU64: {
+		uint64_t av = sscastu64(a + s->cmpoffset) ^ s->cmpmask;
+		uint64_t bv = sscastu64(b + s->cmpoffset) ^ s->cmpmask;
+		return (av > bv) - (av < bv);
+	}
+	case SF_CMPU32: {
+		uint32_t av = sscastu32(a + s->cmpoffset) ^ (uint32_t)s->cmpmask;
+		uint32_t bv = sscastu32(b + s->cmpoffset) ^ (uint32_t)s->cmpmask;
+		return (av > bv) - (av < bv);
+	}
+	case SF_CMPSTRING: {
+		uint32_t asz, bsz;
+		char *ap = sf_fieldptr(s, s->keys[0], a, &asz);
+		char *bp = sf_fieldptr(s, s->keys[0], b, &bsz);
+		int rc = memcmp(ap, bp, (asz < bsz) ? asz : bsz);
+		if (ssunlikely(rc == 0))
+			return (asz > bsz) - (asz < bsz);
+		return rc > 0 ? 1 : -1;
+	}
+	}
+	return sf_comparegeneric(s, a, b);
+}
+
+static inline uint64_t
+sf_keyprefix(sfscheme *s, char *data)
+{
+	/* keys with different prefixes compare the same way
+	 * as their prefixes, equal prefixes tell nothing */
+	if (ssunlikely(s->keyprefix == SF_PREFIXNONE))
+		return 0;
+	uint32_t size;
+	char *p = sf_fieldptr(s, s->keys[0], data, &size);
+	uint64_t v = 0;
+	if (s->keyprefix == SF_PREFIXSTRING) {
+		uint32_t n = (size < 8) ? size : 8;
+		uint32_t i = 0;
+		for (; i < n; i++)
+			v |= (uint64_t)(uint8_t)p[i] << ((7 - i) * 8);
+		return v;
+	}
+	switch (size) {
+	case 1: v = *(uint8_t*)p;
+		break;
+	case 2: v = *(uint16_t*)p;
+		break;
+	case 4: v = sscastu32(p);
+		break;
+	case 8: v = sscastu64(p);
+		break;
+	}
+	if (s->keyprefix == SF_PREFIXUREV)
+		return ~v;
+	return v;
+}
+
+static inline int
+sf_fieldsize(sfscheme *s, int pos, char *data)
+{
+	sffield *f = s->fields[pos];
+	if (sslikely(f->fixed_size > 0))
+		return f->fixed_size;
+	return sf_var(s, f->position_ref, data)->size;
+}
+
+static inline int
+sf_writesize(sfscheme *s, sfv *v)
+{
+	if (sf_schemefixed(s))
+		return s->var_offset;
+	int sum = s->var_offset;
+	int i;
+	for (i = 0; i < s->fields_count; i++) {
+		sffield *f = s->fields[i];
+		if (f->fixed_size != 0)
+			continue;
+		sum += sizeof(sfvar)+ v[i].size;
+	}
+	return sum;
+}
+
+static inline void
+sf_write(sfscheme *s, sfv *v, char *dest)
+{
+	int var_value_offset =
+		s->var_offset + sizeof(sfvar) * s->var_count;
+	int i;
+	for (i = 0; i < s->fields_count; i++) {
+		sffield *f = s->fields[i];
+		if (f->fixed_size) {
+			if (sslikely(v[i].size > 0))
+				memcpy(dest + f->fixed_offset, v[i].pointer, v[i].size);
+			else
+				memset(dest + f->fixed_offset, 0, f->fixed_size);
+			continue;
+		}
+		sfvar *var = sf_var(s, f->position_ref, dest);
+		var->size = v[i].size;
+		if (sslikely(v[i].size > 0))
+			memcpy(dest + var_value_offset, v[i].pointer, v[i].size);
+		var_value_offset += var->size;
+	}
+}
+
+static inline uint64_t
+sf_hash(sfscheme *s, char *data)
+{
+	/* chain the key parts, so that permuted or equal
+	 * parts do not collide. the size of each part keeps
+	 * ("ab", "c") and ("a", "bc") apart */
+	unsigned hash = 2166136261;
+	int i;
+	for (i = 0; i < s->keys_count; i++) {
+		uint32_t size;
+		char *field = sf_field(s, i, data, &size);
+		hash = ss_fnvnext(hash, (char*)&size, sizeof(size));
+		hash = ss_fnvnext(hash, field, size);
+	}
+	return hash;
+}
+
+static inline int
+sf_comparable_size(sfscheme *s, char *data)
+{
+	int sum = s->var_offset;
+	int i;
+	for (i = 0; i < s->fields_count; i++) {
+		sffield *f = s->fields[i];
+		if (f->fixed_size != 0)
+			continue;
+		if (f->key)
+			sum += sf_fieldsize(s, i, data);
+		sum += sizeof(sfvar);
+	}
+	return sum;
+}
+
+static inline void
+sf_comparable_write(sfscheme *s, char *src, char *dest)
+{
+	int var_value_offset =
+		s->var_offset + sizeof(sfvar) * s->var_count;
+	memcpy(dest, src, s->var_offset);
+	int i;
+	for (i = 0; i < s->fields_count; i++) {
+		sffield *f = s->fields[i];
+		if (f->fixed_size != 0)
+			continue;
+		sfvar *var = sf_var(s, f->position_ref, dest);
+		if (! f->key) {
+			var->size = 0;
+			continue;
+		}
+		char *ptr = sf_fieldptr(s, f, src, &var->size);
+		memcpy(dest + var_value_offset, ptr, var->size);
+		var_value_offset += var->size;
+	}
+}
+
+#endif
+#line 1 "sophia/format/sf_limit.h"
+#ifndef SF_LIMIT_H_
+#define SF_LIMIT_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct sflimit sflimit;
+
+struct sflimit {
+	uint8_t   u8_min;
+	uint8_t   u8_max;
+	uint16_t  u16_min;
+	uint16_t  u16_max;
+	uint32_t  u32_min;
+	uint32_t  u32_max;
+	uint64_t  u64_min;
+	uint64_t  u64_max;
+	int64_t   i64_min;
+	int64_t   i64_max;
+	char     *string_min;
+	uint32_t  string_min_size;
+	char     *string_max;
+	uint32_t  string_max_size;
+	uint32_t  field_max_size;
+};
+
+static inline int
+sf_limitinit(sflimit *b, ssa *a)
+{
+	b->field_max_size = 2 * 1024 * 1024;
+	b->u8_min  = 0;
+	b->u8_max  = UINT8_MAX;
+	b->u16_min = 0;
+	b->u16_max = UINT16_MAX;
+	b->u32_min = 0;
+	b->u32_max = UINT32_MAX;
+	b->u64_min = 0;
+	b->u64_max = UINT64_MAX;
+	b->i64_min = INT64_MIN;
+	b->i64_max = UINT64_MAX;
+	b->string_min_size = 0;
+	b->string_min = "";
+	b->string_max_size = 1024;
+	b->string_max = ss_malloc(a, b->string_max_size);
+	if (ssunlikely(b->string_max == NULL))
+		return -1;
+	memset(b->string_max, 0xff, b->string_max_size);
+	return 0;
+}
+
+static inline void
+sf_limitfree(sflimit *b, ssa *a)
+{
+	if (b->string_max)
+		ss_free(a, b->string_max);
+}
+
+static inline void
+sf_limitapply(sflimit *b, sfscheme *s, sfv *fields, ssorder order)
+{
+	int i;
+	for (i = 0; i < s->fields_count; i++) {
+		sfv *v = &fields[i];
+		if (v->pointer)
+			continue;
+		sffield *part = s->fields[i];
+		switch (part->type) {
+		case SS_U8:
+			if (order == SS_LT || order == SS_LTE) {
+				v->pointer = (char*)&b->u8_max;
+				v->size = sizeof(uint8_t);
+			} else {
+				v->pointer = (char*)&b->u8_min;
+				v->size = sizeof(uint8_t);
+			}
+			break;
+		case SS_U8REV:
+			if (order == SS_LT || order == SS_LTE) {
+				v->pointer = (char*)&b->u8_min;
+				v->size = sizeof(uint8_t);
+			} else {
+				v->pointer = (char*)&b->u8_max;
+				v->size = sizeof(uint8_t);
+			}
+			break;
+		case SS_U16:
+			if (order == SS_LT || order == SS_LTE) {
+				v->pointer = (char*)&b->u16_max;
+				v->size = sizeof(uint16_t);
+			} else {
+				v->pointer = (char*)&b->u16_min;
+				v->size = sizeof(uint16_t);
+			}
+			break;
+		case SS_U16REV:
+			if (order == SS_LT || order == SS_LTE) {
+				v->pointer = (char*)&b->u16_min;
+				v->size = sizeof(uint16_t);
+			} else {
+				v->pointer = (char*)&b->u16_max;
+				v->size = sizeof(uint16_t);
+			}
+			break;
+		case SS_U32:
+			if (order == SS_LT || order == SS_LTE) {
+				v->pointer = (char*)&b->u32_max;
+				v->size = sizeof(uint32_t);
+			} else {
+				v->pointer = (char*)&b->u32_min;
+				v->size = sizeof(uint32_t);
+			}
+			break;
+		case SS_U32REV:
+			if (order == SS_LT || order == SS_LTE) {
+				v->pointer = (char*)&b->u32_min;
+				v->size = sizeof(uint32_t);
+			} else {
+				v->pointer = (char*)&b->u32_max;
+				v->size = sizeof(uint32_t);
+			}
+			break;
+		case SS_U64:
+			if (order == SS_LT || order == SS_LTE) {
+				v->pointer = (char*)&b->u64_max;
+				v->size = sizeof(uint64_t);
+			} else {
+				v->pointer = (char*)&b->u64_min;
+				v->size = sizeof(uint64_t);
+			}
+			break;
+		case SS_U64REV:
+			if (order == SS_LT || order == SS_LTE) {
+				v->pointer = (char*)&b->u64_min;
+				v->size = sizeof(uint64_t);
+			} else {
+				v->pointer = (char*)&b->u64_max;
+				v->size = sizeof(uint64_t);
+			}
+			break;
+		case SS_I64:
+			if (order == SS_LT || order == SS_LTE) {
+				v->pointer = (char*)&b->i64_max;
+				v->size = sizeof(int64_t);
+			} else {
+				v->pointer = (char*)&b->i64_min;
+				v->size = sizeof(int64_t);
+			}
+			break;
+		case SS_STRING:
+			if (order == SS_LT || order == SS_LTE) {
+				v->pointer = b->string_max;
+				v->size = b->string_max_size;
+			} else {
+				v->pointer = b->string_min;
+				v->size = b->string_min_size;
+			}
+			break;
+		default: assert(0);
+			break;
+		}
+	}
+}
+
+#endif
+#line 1 "sophia/format/sf_auto.h"
+#ifndef SF_AUTO_H_
+#define SF_AUTO_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+static inline void
+sf_autoset(sfscheme *s, sfv *fields, uint32_t *ts)
+{
+	int i;
+	for (i = 0; i < s->fields_count; i++) {
+		sffield *part = s->fields[i];
+		if (part->timestamp == 0)
+			continue;
+		sfv *v = &fields[i];
+		if (v->pointer)
+			continue;
+		assert(part->type == SS_U32);
+		v->pointer = (char*)ts;
+		v->size = sizeof(uint32_t);
+	}
+}
+
+#endif
+#line 1 "sophia/format/sf_upsert.h"
+#ifndef SF_UPSERT_H_
+#define SF_UPSERT_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef int (*sfupsertf)(int count,
+                         char **src,    uint32_t *src_size,
+                         char **upsert, uint32_t *upsert_size,
+                         char **result, uint32_t *result_size,
+                         void *arg);
+
+enum {
+	SF_UPSERT_NONE,
+	SF_UPSERT_ADD,
+	SF_UPSERT_MAX,
+	SF_UPSERT_MIN,
+	SF_UPSERT_APPEND,
+	SF_UPSERT_APPEND_STRING
+};
+
+typedef struct {
+	sfupsertf function;
+	void *arg;
+	int op;
+	uint32_t limit;
+	sfscheme *scheme;
+} sfupsert;
+
+int      sf_upsertop(sfupsert*, sfscheme*, char*);
+sffield *sf_upsertvalidate(sfupsert*, sfscheme*);
+char    *sf_upsertname(sfupsert*);
+
+static inline void
+sf_upsertinit(sfupsert *u)
+{
+	memset(u, 0, sizeof(*u));
+}
+
+static inline void
+sf_upsertset(sfupsert *u, sfupsertf function)
+{
+	u->function = function;
+}
+
+static inline void
+sf_upsertset_arg(sfupsert *u, void *arg)
+{
+	u->arg = arg;
+}
+
+static inline int
+sf_upserthas(sfupsert *u) {
+	return u->function != NULL;
+}
+
+#endif
+#line 1 "sophia/format/sf_scheme.c"
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+
+
+
+static inline sshot int
+sf_cmpstring(char *a, int asz, char *b, int bsz, void *arg ssunused)
+{
+	int size = (asz < bsz) ? asz : bsz;
+	int rc = memcmp(a, b, size);
+	if (ssunlikely(rc == 0)) {
+		if (sslikely(asz == bsz))
+			return 0;
+		return (asz < bsz) ? -1 : 1;
+	}
+	return rc > 0 ? 1 : -1;
+}
+
+static inline sshot int
+sf_cmpu8(char *a, int asz ssunused, char *b, int bsz ssunused, void *arg ssunused)
+{
+	uint8_t av = *(uint8_t*)a;
+	uint8_t bv = *(uint8_t*)b;
+	if (av == bv)
+		return 0;
+	return (av > bv) ? 1 : -1;
+}
+
+static inline sshot int
+sf_cmpu8_reverse(char *a, int asz ssunused, char *b, int bsz ssunused, void *arg ssunused)
+{
+	uint8_t av = *(uint8_t*)a;
+	uint8_t bv = *(uint8_t*)b;
+	if (av == bv)
+		return 0;
+	return (av > bv) ? -1 : 1;
+}
+
+static inline sshot int
+sf_cmpu16(char *a, int asz ssunused, char *b, int bsz ssunused, void *arg ssunused)
+{
+	uint16_t av = *(uint16_t*)a;
+	uint16_t bv = *(uint16_t*)b;
+	if (av == bv)
+		return 0;
+	return (av > bv) ? 1 : -1;
+}
+
+static inline sshot int
+sf_cmpu16_reverse(char *a, int asz ssunused, char *b, int bsz ssunused, void *arg ssunused)
+{
+	uint16_t av = *(uint16_t*)a;
+	uint16_t bv = *(uint16_t*)b;
+	if (av == bv)
+		return 0;
+	return (av > bv) ? -1 : 1;
+}
+
+static inline sshot int
+sf_cmpu32(char *a, int asz ssunused, char *b, int bsz ssunused, void *arg ssunused)
+{
+	uint32_t av = sscastu32(a);
+	uint32_t bv = sscastu32(b);
+	if (av == bv)
+		return 0;
+	return (av > bv) ? 1 : -1;
+}
+
+static inline sshot int
+sf_cmpu32_reverse(char *a, int asz ssunused, char *b, int bsz ssunused, void *arg ssunused)
+{
+	uint32_t av = sscastu32(a);
+	uint32_t bv = sscastu32(b);
+	if (av == bv)
+		return 0;
+	return (av > bv) ? -1 : 1;
+}
+
+static inline sshot int
+sf_cmpu64(char *a, int asz ssunused, char *b, int bsz ssunused,
+              void *arg ssunused)
+{
+	uint64_t av = sscastu64(a);
+	uint64_t bv = sscastu64(b);
+	if (av == bv)
+		return 0;
+	return (av > bv) ? 1 : -1;
+}
+
+static inline sshot int
+sf_cmpu64_reverse(char *a, int asz ssunused, char *b, int bsz ssunused,
+              void *arg ssunused)
+{
+	uint64_t av = sscastu64(a);
+	uint64_t bv = sscastu64(b);
+	if (av == bv)
+		return 0;
+	return (av > bv) ? -1 : 1;
+}
+
+static inline int
+sf_schemeprefix(sffield *f)
+{
+	/* a prefix can only stand for keys ordered by
+	 * one of the builtin comparators */
+	if (f->cmp == sf_cmpstring)
+		return SF_PREFIXSTRING;
+	if (f->cmp == sf_cmpu8  || f->cmp == sf_cmpu16 ||
+	    f->cmp == sf_cmpu32 || f->cmp == sf_cmpu64)
+		return SF_PREFIXU;
+	if (f->cmp == sf_cmpu8_reverse  || f->cmp == sf_cmpu16_reverse ||
+	    f->cmp == sf_cmpu32_reverse || f->cmp == sf_cmpu64_reverse)
+		return SF_PREFIXUREV;
+	return SF_PREFIXNONE;
+}
+
+static inline int
+sf_cmpunsigned(char *a, char *b, int size)
+{
+	switch (size) {
+	case 1: return sf_cmpu8(a, size, b, size, NULL);
+	case 2: return sf_cmpu16(a, size, b, size, NULL);
+	case 4: return sf_cmpu32(a, size, b, size, NULL);
+	}
+	return sf_cmpu64(a, size, b, size, NULL);
+}
+
+static inline void
+sf_schemecmp(sfscheme *s)
+{
+	int i = 0;
+	while (i < s->keys_count) {
+		sffield *f = s->keys[i];
+		f->cmpkind = sf_schemeprefix(f);
+		i++;
+	}
+	s->cmpfast   = SF_CMPGENERIC;
+	s->cmpoffset = 0;
+	s->cmpmask   = 0;
+	if (s->keys_count != 1)
+		return;
+	sffield *key = s->keys[0];
+	switch (key->cmpkind) {
+	case SF_PREFIXSTRING:
+		s->cmpfast = SF_CMPSTRING;
+		break;
+	case SF_PREFIXUREV:
+		s->cmpmask = UINT64_MAX;
+		/* fallthrough */
+	case SF_PREFIXU:
+		if (key->fixed_size == sizeof(uint64_t))
+			s->cmpfast = SF_CMPU64;
+		else
+		if (key->fixed_size == sizeof(uint32_t))
+			s->cmpfast = SF_CMPU32;
+		s->cmpoffset = key->fixed_offset;
+		break;
+	}
+}
+
+sshot int
+sf_comparegeneric(sfscheme *s, char *a, char *b)
+{
+	sffield **part = s->keys;
+	sffield **last = part + s->keys_count;
+	int rc;
+	while (part < last) {
+		sffield *key = *part;
+		uint32_t a_fieldsize;
+		char *a_field = sf_fieldptr(s, key, a, &a_fieldsize);
+		uint32_t b_fieldsize;
+		char *b_field = sf_fieldptr(s, key, b, &b_fieldsize);
+		/* builtin types are compared without an indirect call */
+		switch (key->cmpkind) {
+		case SF_PREFIXSTRING:
+			rc = sf_cmpstring(a_field, a_fieldsize, b_field, b_fieldsize, NULL);
+			break;
+		case SF_PREFIXU:
+			rc = sf_cmpunsigned(a_field, b_field, a_fieldsize);
+			break;
+		case SF_PREFIXUREV:
+			rc = sf_cmpunsigned(b_field, a_field, a_fieldsize);
+			break;
+		default:
+			rc = key->cmp(a_field, a_fieldsize, b_field, b_fieldsize,
+			              s->cmparg);
+			break;
+		}
+		if (rc != 0)
+			return rc;
+		part++;
+	}
+	return 0;
+}
+
+sshot int
+sf_compareprefix(sfscheme *s, char *prefix, uint32_t prefixsize, char *key)
+{
+	uint32_t keysize;
+	key = sf_field(s, 0, key, &keysize);
+	if (keysize < prefixsize)
+		return 0;
+	return (memcmp(prefix, key, prefixsize) == 0) ? 1 : 0;
+}
+
+void sf_schemeinit(sfscheme *s)
+{
+	s->fields = NULL;
+	s->fields_count = 0;
+	s->keys = NULL;
+	s->keys_count = 0;
+	s->var_offset = 0;
+	s->offset_expire = 0;
+	s->offset_lsn = 0;
+	s->offset_flags = 0;
+	s->var_count  = 0;
+	s->cmp = NULL;
+	s->cmparg = NULL;
+	s->has_lsn = 0;
+	s->has_flags = 0;
+	s->has_timestamp = 0;
+	s->has_expire = 0;
+	s->keyprefix = SF_PREFIXNONE;
+	s->cmpfast = SF_CMPGENERIC;
+	s->cmpoffset = 0;
+	s->cmpmask = 0;
+}
+
+void sf_schemefree(sfscheme *s, ssa *a)
+{
+	if (s->fields) {
+		int i = 0;
+		while (i < s->fields_count) {
+			sf_fieldfree(s->fields[i], a);
+			i++;
+		}
+		ss_free(a, s->fields);
+		s->fields = NULL;
+	}
+	if (s->keys) {
+		ss_free(a, s->keys);
+		s->keys = NULL;
+	}
+}
+
+int sf_schemeadd(sfscheme *s, ssa *a, sffield *f)
+{
+	int size = sizeof(sffield*) * (s->fields_count + 1);
+	sffield **fields = ss_malloc(a, size);
+	if (ssunlikely(fields == NULL))
+		return -1;
+	memcpy(fields, s->fields, size - sizeof(sffield*));
+	fields[s->fields_count] = f;
+	f->position = s->fields_count;
+	f->position_key = -1;
+	if (s->fields)
+		ss_free(a, s->fields);
+	s->fields = fields;
+	s->fields_count++;
+	return 0;
+}
+
+static inline int
+sf_schemeset(sfscheme *s, sffield *f, char *opt)
+{
+	(void)s;
+	if (strcmp(opt, "string") == 0) {
+		f->type = SS_STRING;
+		f->fixed_size = 0;
+		f->cmp = sf_cmpstring;
+	} else
+	if (strcmp(opt, "u8") == 0) {
+		f->type = SS_U8;
+		f->fixed_size = sizeof(uint8_t);
+		f->cmp = sf_cmpu8;
+	} else
+	if (strcmp(opt, "u8_rev") == 0) {
+		f->type = SS_U8REV;
+		f->fixed_size = sizeof(uint8_t);
+		f->cmp = sf_cmpu8_reverse;
+	} else
+	if (strcmp(opt, "u16") == 0) {
+		f->type = SS_U16;
+		f->fixed_size = sizeof(uint16_t);
+		f->cmp = sf_cmpu16;
+	} else
+	if (strcmp(opt, "u16_rev") == 0) {
+		f->type = SS_U16REV;
+		f->fixed_size = sizeof(uint16_t);
+		f->cmp = sf_cmpu16_reverse;
+	} else
+	if (strcmp(opt, "u32") == 0) {
+		f->type = SS_U32;
+		f->fixed_size = sizeof(uint32_t);
+		f->cmp = sf_cmpu32;
+	} else
+	if (strcmp(opt, "u32_rev") == 0) {
+		f->type = SS_U32REV;
+		f->fixed_size = sizeof(uint32_t);
+		f->cmp = sf_cmpu32_reverse;
+	} else
+	if (strcmp(opt, "u64") == 0) {
+		f->type = SS_U64;
+		f->fixed_size = sizeof(uint64_t);
+		f->cmp = sf_cmpu64;
+	} else
+	if (strcmp(opt, "u64_rev") == 0) {
+		f->type = SS_U64REV;
+		f->fixed_size = sizeof(uint64_t);
+		f->cmp = sf_cmpu64_reverse;
+	} else
+	if (strncmp(opt, "key", 3) == 0) {
+		char *p = opt + 3;
+		if (ssunlikely(*p != '('))
+			return -1;
+		p++;
+		if (ssunlikely(! isdigit(*p)))
+			return -1;
+		int v = 0;
+		while (isdigit(*p)) {
+			v = (v * 10) + *p - '0';
+			p++;
+		}
+		if (ssunlikely(*p != ')'))
+			return -1;
+		p++;
+		f->position_key = v;
+		f->key = 1;
+	} else
+	if (strncmp(opt, "lsn", 3) == 0) {
+		f->lsn = 1;
+	} else
+	if (strncmp(opt, "flags", 5) == 0) {
+		f->flags = 1;
+	} else
+	if (strncmp(opt, "timestamp", 9) == 0) {
+		f->timestamp = 1;
+	} else
+	if (strncmp(opt, "expire", 6) == 0) {
+		f->expire = 1;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+int
+sf_schemevalidate(sfscheme *s, ssa *a)
+{
+	/* validate fields */
+	if (s->fields_count == 0) {
+		return -1;
+	}
+
+	/* add meta fields */
+	int rc;
+
+	/* flags */
+	sffield *meta_flags = sf_fieldnew(a, "_flags");
+	if (ssunlikely(meta_flags == NULL))
+		return -1;
+	rc = sf_fieldoptions(meta_flags, a, "u8,flags");
+	if (ssunlikely(rc == -1)) {
+		sf_fieldfree(meta_flags, a);
+		return -1;
+	}
+	rc = sf_schemeadd(s, a, meta_flags);
+	if (ssunlikely(rc == -1)) {
+		sf_fieldfree(meta_flags, a);
+		return -1;
+	}
+
+	/* lsn */
+	sffield *meta_lsn = sf_fieldnew(a, "_lsn");
+	if (ssunlikely(meta_lsn == NULL))
+		return -1;
+	rc = sf_fieldoptions(meta_lsn, a, "u64,lsn");
+	if (ssunlikely(rc == -1)) {
+		sf_fieldfree(meta_lsn, a);
+		return -1;
+	}
+	rc = sf_schemeadd(s, a, meta_lsn);
+	if (ssunlikely(rc == -1)) {
+		sf_fieldfree(meta_lsn, a);
+		return -1;
+	}
+
+	int fixed_offset = 0;
+	int fixed_pos = 0;
+	int i = 0;
+	while (i < s->fields_count)
+	{
+		/* validate and apply field options */
+		sffield *f = s->fields[i];
+		if (f->options == NULL) {
+			return -1;
+		}
+		char opts[256];
+		snprintf(opts, sizeof(opts), "%s", f->options);
+		char *p;
+		for (p = strtok(opts, " ,"); p;
+		     p = strtok(NULL, " ,"))
+		{
+			rc = sf_schemeset(s, f, p);
+			if (ssunlikely(rc == -1))
+				return -1;
+		}
+		/* set user compare function, it overrides
+		 * the one chosen by the field type */
+		if (s->cmp) {
+			f->cmp = s->cmp;
+		}
+		/* validate auto modifiers */
+		if (f->timestamp) {
+			if (f->type != SS_U32)
+				return -1;
+			s->has_timestamp = 1;
+		}
+		if (f->expire) {
+			if (! f->timestamp)
+				return -1;
+			if (s->has_expire)
+				return -1;
+			s->has_expire = 1;
+		}
+		/* meta fields */
+
+		/* flags */
+		if (f->flags) {
+			if (f->type != SS_U8)
+				return -1;
+			if (s->has_flags)
+				return -1;
+			s->has_flags = 1;
+		}
+		/* lsn */
+		if (f->lsn) {
+			if (f->type != SS_U64)
+				return -1;
+			if (s->has_lsn)
+				return -1;
+			s->has_lsn = 1;
+		}
+
+		/* calculate offset and position for fixed
+		 * size types */
+		if (f->fixed_size > 0) {
+			f->position_ref = fixed_pos;
+			fixed_pos++;
+			f->fixed_offset = fixed_offset;
+			fixed_offset += f->fixed_size;
+			if (f->expire)
+				s->offset_expire = f->fixed_offset;
+			else
+			if (f->lsn)
+				s->offset_lsn = f->fixed_offset;
+			else
+			if (f->flags)
+				s->offset_flags = f->fixed_offset;
+		} else {
+			s->var_count++;
+		}
+		if (f->key)
+			s->keys_count++;
+		i++;
+	}
+	s->var_offset = fixed_offset;
+
+	/* validate keys */
+	if (ssunlikely(s->keys_count == 0))
+		return -1;
+	int size = sizeof(sffield*) * s->keys_count;
+	s->keys = ss_malloc(a, size);
+	if (ssunlikely(s->keys == NULL))
+		return -1;
+	memset(s->keys, 0, size);
+	int pos_var = 0;
+	i = 0;
+	while (i < s->fields_count) {
+		sffield *f = s->fields[i];
+		if (f->key) {
+			if (ssunlikely(f->position_key < 0))
+				return -1;
+			if (ssunlikely(f->position_key >= s->fields_count))
+				return -1;
+			if (ssunlikely(f->position_key >= s->keys_count))
+				return -1;
+			if (ssunlikely(s->keys[f->position_key] != NULL))
+				return -1;
+			s->keys[f->position_key] = f;
+		}
+		if (f->fixed_size == 0)
+			f->position_ref = pos_var++;
+		i++;
+	}
+	i = 0;
+	while (i < s->keys_count) {
+		sffield *f = s->keys[i];
+		if (f == NULL)
+			return -1;
+		i++;
+	}
+	s->keyprefix = sf_schemeprefix(s->keys[0]);
+	sf_schemecmp(s);
+	return 0;
+}
+
+int sf_schemesave(sfscheme *s, ssa *a, ssbuf *buf)
+{
+	/* fields count */
+	uint32_t v = s->fields_count;
+	if (s->has_lsn)
+		v--;
+	if (s->has_flags)
+		v--;
+	int rc = ss_bufadd(buf, a, &v, sizeof(uint32_t));
+	if (ssunlikely(rc == -1))
+		return -1;
+	int fields_count = v;
+	int i = 0;
+	while (i < fields_count) {
+		sffield *field = s->fields[i];
+		assert(field->lsn == 0);
+		assert(field->flags == 0);
+		/* name */
+		v = strlen(field->name) + 1;
+		rc = ss_bufensure(buf, a, sizeof(uint32_t) + v);
+		if (ssunlikely(rc == -1))
+			goto error;
+		memcpy(buf->p, &v, sizeof(v));
+		ss_bufadvance(buf, sizeof(uint32_t));
+		memcpy(buf->p, field->name, v);
+		ss_bufadvance(buf, v);
+		/* options */
+		v = strlen(field->options) + 1;
+		rc = ss_bufensure(buf, a, sizeof(uint32_t) + v);
+		if (ssunlikely(rc == -1))
+			goto error;
+		memcpy(buf->p, &v, sizeof(v));
+		ss_bufadvance(buf, sizeof(uint32_t));
+		memcpy(buf->p, field->options, v);
+		ss_bufadvance(buf, v);
+		i++;
+	}
+	return 0;
+error:
+	ss_buffree(buf, a);
+	return -1;
+}
+
+int sf_schemeload(sfscheme *s, ssa *a, char *buf, int size ssunused)
+{
+	/* count */
+	char *p = buf;
+	uint32_t v = sscastu32(p);
+	p += sizeof(uint32_t);
+	int count = v;
+	int i = 0;
+	while (i < count) {
+		/* name */
+		v = sscastu32(p);
+		p += sizeof(uint32_t);
+		sffield *field = sf_fieldnew(a, p);
+		if (ssunlikely(field == NULL))
+			goto error;
+		p += v;
+		/* options */
+		v = sscastu32(p);
+		p += sizeof(uint32_t);
+		int rc = sf_fieldoptions(field, a, p);
+		if (ssunlikely(rc == -1)) {
+			sf_fieldfree(field, a);
+			goto error;
+		}
+		rc = sf_schemeadd(s, a, field);
+		if (ssunlikely(rc == -1)) {
+			sf_fieldfree(field, a);
+			goto error;
+		}
+		p += v;
+		i++;
+	}
+	return 0;
+error:
+	sf_schemefree(s, a);
+	return -1;
+}
+
+sffield*
+sf_schemefind(sfscheme *s, char *name)
+{
+	int i;
+	for (i = 0; i < s->fields_count; i++)
+		if (strcmp(s->fields[i]->name, name) == 0)
+			return s->fields[i];
+	return NULL;
+}
+#line 1 "sophia/format/sf_upsert.c"
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+
+
+/*
+ * Built-in upsert operators.
+ *
+ * An operator is applied to every value field of the document, key and
+ * automatic fields keep the value of the original document. Numeric
+ * operators work on u8 .. u64 fields, append operators work on string
+ * fields. Every result which differs from the source field is allocated
+ * with malloc(3), as expected by sv_upsertdo().
+*/
+
+typedef struct {
+	char *name;
+	int   op;
+} sfupsertopname;
+
+static sfupsertopname sf_upsertops[] =
+{
+	{ "none",          SF_UPSERT_NONE          },
+	{ "add",           SF_UPSERT_ADD           },
+	{ "max",           SF_UPSERT_MAX           },
+	{ "min",           SF_UPSERT_MIN           },
+	{ "append",        SF_UPSERT_APPEND        },
+	{ "append_string", SF_UPSERT_APPEND_STRING },
+	{ NULL,            0                       }
+};
+
+static inline int
+sf_upsertvalue(sffield *f)
+{
+	return !f->key && !f->lsn && !f->flags && !f->timestamp && !f->expire;
+}
+
+static inline int
+sf_upsertnumeric(sstype type)
+{
+	switch (type) {
+	case SS_U8:
+	case SS_U8REV:
+	case SS_U16:
+	case SS_U16REV:
+	case SS_U32:
+	case SS_U32REV:
+	case SS_U64:
+	case SS_U64REV:
+		return 1;
+	default: break;
+	}
+	return 0;
+}
+
+static inline uint64_t
+sf_upsertload(sstype type, char *pointer)
+{
+	switch (type) {
+	case SS_U8:
+	case SS_U8REV:  return *(uint8_t*)pointer;
+	case SS_U16:
+	case SS_U16REV: return *(uint16_t*)pointer;
+	case SS_U32:
+	case SS_U32REV: return *(uint32_t*)pointer;
+	case SS_U64:
+	case SS_U64REV: return *(uint64_t*)pointer;
+	default: assert(0);
+	}
+	return 0;
+}
+
+static inline void
+sf_upsertstore(sstype type, char *pointer, uint64_t value)
+{
+	switch (type) {
+	case SS_U8:
+	case SS_U8REV:  *(uint8_t*)pointer  = value;
+		break;
+	case SS_U16:
+	case SS_U16REV: *(uint16_t*)pointer = value;
+		break;
+	case SS_U32:
+	case SS_U32REV: *(uint32_t*)pointer = value;
+		break;
+	case SS_U64:
+	case SS_U64REV: *(uint64_t*)pointer = value;
+		break;
+	default: assert(0);
+	}
+}
+
+static inline int
+sf_upsertnum(sfupsert *u, sstype type,
+             char *src, uint32_t src_size, char *upsert,
+             char **result)
+{
+	uint64_t a = sf_upsertload(type, src);
+	uint64_t b = sf_upsertload(type, upsert);
+	uint64_t value;
+	switch (u->op) {
+	case SF_UPSERT_ADD: value = a + b;
+		break;
+	case SF_UPSERT_MAX: value = (a > b) ? a : b;
+		break;
+	case SF_UPSERT_MIN: value = (a < b) ? a : b;
+		break;
+	default: assert(0);
 		return -1;
-	memset(b->string_max, 0xff, b->string_max_size);
+	}
+	char *p = malloc(src_size);
+	if (ssunlikely(p == NULL))
+		return -1;
+	sf_upsertstore(type, p, value);
+	*result = p;
+	return 0;
+}
+
+static inline int
+sf_upsertappend(sfupsert *u,
+                char *src, uint32_t src_size,
+                char *upsert, uint32_t upsert_size,
+                char **result, uint32_t *result_size)
+{
+	/* string values are stored with a trailing zero byte,
+	 * which is dropped from the original value */
+	int terminate = u->op == SF_UPSERT_APPEND_STRING;
+	if (terminate) {
+		if (src_size > 0 && src[src_size - 1] == 0)
+			src_size--;
+		if (upsert_size > 0 && upsert[upsert_size - 1] == 0)
+			upsert_size--;
+	}
+	/* bounded list: drop oldest elements from the head,
+	 * an element being the size of the appended value */
+	uint32_t size = src_size + upsert_size;
+	uint32_t skip = 0;
+	if (u->limit && size > u->limit) {
+		skip = size - u->limit;
+		if (upsert_size > 0)
+			skip = ((skip + upsert_size - 1) / upsert_size) * upsert_size;
+		if (skip > size)
+			skip = size;
+	}
+	uint32_t total = size - skip + terminate;
+	char *p = malloc(total > 0 ? total : 1);
+	if (ssunlikely(p == NULL))
+		return -1;
+	char *pos = p;
+	if (skip < src_size) {
+		memcpy(pos, src + skip, src_size - skip);
+		pos += src_size - skip;
+		skip = 0;
+	} else {
+		skip -= src_size;
+	}
+	memcpy(pos, upsert + skip, upsert_size - skip);
+	pos += upsert_size - skip;
+	if (terminate)
+		*pos = 0;
+	*result = p;
+	*result_size = total;
+	return 0;
+}
+
+static int
+sf_upsertbuiltin(int count,
+                 char **src,    uint32_t *src_size,
+                 char **upsert, uint32_t *upsert_size,
+                 char **result, uint32_t *result_size,
+                 void *arg)
+{
+	sfupsert *u = arg;
+	sfscheme *s = u->scheme;
+	assert(count == s->fields_count);
+	int rc = 0;
+	int i = 0;
+	for (; i < count; i++) {
+		sffield *f = s->fields[i];
+		if (! sf_upsertvalue(f))
+			continue;
+		switch (u->op) {
+		case SF_UPSERT_ADD:
+		case SF_UPSERT_MAX:
+		case SF_UPSERT_MIN:
+			/* first statement is taken as is */
+			if (src == NULL)
+				break;
+			rc = sf_upsertnum(u, f->type, src[i], src_size[i],
+			                  upsert[i], &result[i]);
+			break;
+		case SF_UPSERT_APPEND:
+		case SF_UPSERT_APPEND_STRING:
+			if (src == NULL) {
+				rc = sf_upsertappend(u, NULL, 0,
+				                     upsert[i], upsert_size[i],
+				                     &result[i], &result_size[i]);
+				break;
+			}
+			rc = sf_upsertappend(u, src[i], src_size[i],
+			                     upsert[i], upsert_size[i],
+			                     &result[i], &result_size[i]);
+			break;
+		}
+		if (ssunlikely(rc == -1))
+			goto error;
+	}
+	return 0;
+error:
+	for (i = 0; i < count; i++) {
+		char *orig = (src) ? src[i] : upsert[i];
+		if (result[i] != orig)
+			free(result[i]);
+	}
+	return -1;
+}
+
+int sf_upsertop(sfupsert *u, sfscheme *s, char *name)
+{
+	sfupsertopname *op = sf_upsertops;
+	while (op->name) {
+		if (strcmp(op->name, name) == 0)
+			break;
+		op++;
+	}
+	if (ssunlikely(op->name == NULL))
+		return -1;
+	if (op->op == SF_UPSERT_NONE) {
+		/* keep user-defined upsert function */
+		if (u->function == sf_upsertbuiltin) {
+			u->function = NULL;
+			u->arg = NULL;
+		}
+		u->op = SF_UPSERT_NONE;
+		u->scheme = NULL;
+		return 0;
+	}
+	u->function = sf_upsertbuiltin;
+	u->arg = u;
+	u->op = op->op;
+	u->scheme = s;
+	return 0;
+}
+
+sffield *sf_upsertvalidate(sfupsert *u, sfscheme *s)
+{
+	if (u->op == SF_UPSERT_NONE)
+		return NULL;
+	int i = 0;
+	for (; i < s->fields_count; i++) {
+		sffield *f = s->fields[i];
+		if (! sf_upsertvalue(f))
+			continue;
+		switch (u->op) {
+		case SF_UPSERT_ADD:
+		case SF_UPSERT_MAX:
+		case SF_UPSERT_MIN:
+			if (! sf_upsertnumeric(f->type))
+				return f;
+			break;
+		case SF_UPSERT_APPEND:
+		case SF_UPSERT_APPEND_STRING:
+			if (f->type != SS_STRING)
+				return f;
+			break;
+		}
+	}
+	return NULL;
+}
+
+char *sf_upsertname(sfupsert *u)
+{
+	sfupsertopname *op = sf_upsertops;
+	while (op->name) {
+		if (op->op == u->op)
+			return op->name;
+		op++;
+	}
+	return NULL;
+}
+#line 1 "sophia/runtime/sr_version.h"
+#ifndef SR_VERSION_H_
+#define SR_VERSION_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+#define SR_VERSION_MAGIC      8529643324614668147ULL
+
+#define SR_VERSION_A         '2'
+#define SR_VERSION_B         '2'
+
+#define SR_VERSION_STORAGE_A '2'
+#define SR_VERSION_STORAGE_B '2'
+
+#if defined(SOPHIA_BUILD)
+# define SR_VERSION_COMMIT SOPHIA_BUILD
+#else
+# define SR_VERSION_COMMIT "unknown"
+#endif
+
+typedef struct srversion srversion;
+
+struct srversion {
+	uint64_t magic;
+	uint8_t  a, b, c;
+} sspacked;
+
+static inline void
+sr_version(srversion *v)
+{
+	v->magic = SR_VERSION_MAGIC;
+	v->a = SR_VERSION_A;
+	v->b = SR_VERSION_B;
+	v->c = 0;
+}
+
+static inline int
+sr_version_check(srversion *v)
+{
+	if (v->magic != SR_VERSION_MAGIC)
+		return 0;
+	if (v->a != SR_VERSION_STORAGE_A)
+		return 0;
+	if (v->b != SR_VERSION_STORAGE_B)
+		return 0;
+	return 1;
+}
+
+static inline void
+sr_version_storage(srversion *v)
+{
+	v->magic = SR_VERSION_MAGIC;
+	v->a = SR_VERSION_STORAGE_A;
+	v->b = SR_VERSION_STORAGE_B;
+	v->c = 0;
+}
+
+static inline int
+sr_versionstorage_check(srversion *v)
+{
+	if (v->magic != SR_VERSION_MAGIC)
+		return 0;
+	if (v->a != SR_VERSION_STORAGE_A)
+		return 0;
+	if (v->b != SR_VERSION_STORAGE_B)
+		return 0;
+	return 1;
+}
+
+#endif
+#line 1 "sophia/runtime/sr_log.h"
+#ifndef SR_LOG_H_
+#define SR_LOG_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct srlog srlog;
+
+typedef void (*srlogcbf)(char*, void*);
+
+struct srlog {
+	srlogcbf log;
+	void *arg;
+};
+
+static inline void
+sr_loginit(srlog *log)
+{
+	log->log = NULL;
+	log->arg = NULL;
+}
+
+static inline void
+sr_log(srlog *log, char *fmt, ...)
+{
+	if (log->log == NULL)
+		return;
+	char message[1024];
+	va_list args;
+	va_start(args, fmt);
+	vsnprintf(message, sizeof(message), fmt, args);
+	va_end(args);
+	log->log(message, log->arg);
+}
+
+#endif
+#line 1 "sophia/runtime/sr_error.h"
+#ifndef SR_ERROR_H_
+#define SR_ERROR_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct srerror srerror;
+
+enum {
+	SR_ERROR_NONE  = 0,
+	SR_ERROR = 1,
+	SR_ERROR_MALFUNCTION = 2
+};
+
+struct srerror {
+	ssspinlock lock;
+	int type;
+	const char *file;
+	const char *function;
+	int line;
+	char error[256];
+	uint64_t errors;
+	srlog *log;
+};
+
+static inline void
+sr_errorinit(srerror *e, srlog *log)
+{
+	e->type = SR_ERROR_NONE;
+	e->errors = 0;
+	e->error[0] = 0;
+	e->line = 0;
+	e->function = NULL;
+	e->file = NULL;
+	e->log = log;
+	ss_spinlockinit(&e->lock);
+}
+
+static inline void
+sr_errorfree(srerror *e)
+{
+	ss_spinlockfree(&e->lock);
+}
+
+static inline void
+sr_errorreset(srerror *e)
+{
+	ss_spinlock(&e->lock);
+	e->type = SR_ERROR_NONE;
+	e->error[0] = 0;
+	e->line = 0;
+	e->function = NULL;
+	e->file = NULL;
+	ss_spinunlock(&e->lock);
+}
+
+static inline void
+sr_malfunction_set(srerror *e)
+{
+	ss_spinlock(&e->lock);
+	e->type = SR_ERROR_MALFUNCTION;
+	ss_spinunlock(&e->lock);
+}
+
+static inline int
+sr_errorof(srerror *e)
+{
+	ss_spinlock(&e->lock);
+	int type = e->type;
+	ss_spinunlock(&e->lock);
+	return type;
+}
+
+static inline int
+sr_errorcopy(srerror *e, char *buf, int bufsize)
+{
+	ss_spinlock(&e->lock);
+	int len = snprintf(buf, bufsize, "%s", e->error);
+	ss_spinunlock(&e->lock);
+	return len;
+}
+
+static inline void
+sr_verrorset(srerror *e, int type,
+             const char *file,
+             const char *function, int line,
+             char *fmt, va_list args)
+{
+	ss_spinlock(&e->lock);
+	e->errors++;
+	if (ssunlikely(e->type == SR_ERROR_MALFUNCTION)) {
+		ss_spinunlock(&e->lock);
+		return;
+	}
+	e->file     = file;
+	e->function = function;
+	e->line     = line;
+	e->type     = type;
+	int len;
+	len = snprintf(e->error, sizeof(e->error), "%s:%d ", file, line);
+	vsnprintf(e->error + len, sizeof(e->error) - len, fmt, args);
+	sr_log(e->log, e->error);
+	ss_spinunlock(&e->lock);
+}
+
+static inline int
+sr_errorset(srerror *e, int type,
+            const char *file,
+            const char *function, int line,
+            char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	sr_verrorset(e, type, file, function, line, fmt, args);
+	va_end(args);
+	return -1;
+}
+
+#define sr_e(e, type, fmt, ...) \
+	sr_errorset(e, type, __FILE__, __func__, __LINE__, fmt, __VA_ARGS__)
+
+#define sr_error(e, fmt, ...) \
+	sr_e(e, SR_ERROR, fmt, __VA_ARGS__)
+
+#define sr_malfunction(e, fmt, ...) \
+	sr_e(e, SR_ERROR_MALFUNCTION, fmt, __VA_ARGS__)
+
+#define sr_oom(e) \
+	sr_e(e, SR_ERROR, "%s", "memory allocation failed")
+
+#define sr_oom_malfunction(e) \
+	sr_e(e, SR_ERROR_MALFUNCTION, "%s", "memory allocation failed")
+
+#endif
+#line 1 "sophia/runtime/sr_status.h"
+#ifndef SR_STATUS_H_
+#define SR_STATUS_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+enum {
+	SR_OFFLINE,
+	SR_ONLINE,
+	SR_RECOVER,
+	SR_SHUTDOWN,
+	SR_MALFUNCTION
+};
+
+typedef struct srstatus srstatus;
+
+struct srstatus {
+	int status;
+	ssspinlock lock;
+};
+
+static inline void
+sr_statusinit(srstatus *s)
+{
+	s->status = SR_OFFLINE;
+	ss_spinlockinit(&s->lock);
+}
+
+static inline void
+sr_statusfree(srstatus *s)
+{
+	ss_spinlockfree(&s->lock);
+}
+
+static inline void
+sr_statuslock(srstatus *s) {
+	ss_spinlock(&s->lock);
+}
+
+static inline void
+sr_statusunlock(srstatus *s) {
+	ss_spinunlock(&s->lock);
+}
+
+static inline int
+sr_statusset(srstatus *s, int status)
+{
+	ss_spinlock(&s->lock);
+	int old = s->status;
+	s->status = status;
+	ss_spinunlock(&s->lock);
+	return old;
+}
+
+static inline int
+sr_status(srstatus *s)
+{
+	ss_spinlock(&s->lock);
+	int status = s->status;
+	ss_spinunlock(&s->lock);
+	return status;
+}
+
+static inline char*
+sr_statusof(srstatus *s)
+{
+	int status = sr_status(s);
+	switch (status) {
+	case SR_OFFLINE:     return "offline";
+	case SR_ONLINE:      return "online";
+	case SR_RECOVER:     return "recover";
+	case SR_SHUTDOWN:    return "shutdown";
+	case SR_MALFUNCTION: return "malfunction";
+	}
+	assert(0);
+	return NULL;
+}
+
+static inline int
+sr_statusactive_is(int status)
+{
+	switch (status) {
+	case SR_ONLINE:
+	case SR_RECOVER:
+		return 1;
+	case SR_SHUTDOWN:
+	case SR_OFFLINE:
+	case SR_MALFUNCTION:
+		return 0;
+	}
+	assert(0);
 	return 0;
 }
 
-static inline void
-sf_limitfree(sflimit *b, ssa *a)
+static inline int
+sr_statusactive(srstatus *s) {
+	return sr_statusactive_is(sr_status(s));
+}
+
+static inline int
+sr_online(srstatus *s) {
+	return sr_status(s) == SR_ONLINE;
+}
+
+#endif
+#line 1 "sophia/runtime/sr_stat.h"
+#ifndef SR_STAT_H_
+#define SR_STAT_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct srstatxm srstatxm;
+typedef struct srstat srstat;
+
+struct srstatxm {
+	/* transaction */
+	uint64_t tx;
+	uint64_t tx_rlb;
+	uint64_t tx_conflict;
+	uint64_t tx_lock;
+	ssavg    tx_latency;
+	ssavg    tx_stmts;
+};
+
+enum {
+	SR_HGET,
+	SR_HSET,
+	SR_HDELETE,
+	SR_HUPSERT,
+	SR_HCURSOR,
+	SR_HPREAD,
+	SR_HDECOMPRESS,
+	SR_HGET_MEMORY,
+	SR_HGET_DISK,
+	SR_HGET_UPSERT,
+	SR_HMAX
+};
+
+struct srstat {
+	ssspinlock lock;
+	/* latency histograms, SR_HMAX */
+	sshist  *hist;
+	/* memory */
+	uint64_t v_count;
+	uint64_t v_allocated;
+	/* field */
+	ssavg    field;
+	/* set */
+	uint64_t set;
+	ssavg    set_latency;
+	/* delete */
+	uint64_t del;
+	ssavg    del_latency;
+	/* upsert */
+	uint64_t upsert;
+	ssavg    upsert_latency;
+	/* get */
+	uint64_t get;
+	ssavg    get_read_disk;
+	ssavg    get_read_cache;
+	ssavg    get_latency;
+	/* pread */
+	uint64_t pread;
+	ssavg    pread_latency;
+	/* cursor */
+	uint64_t cursor;
+	ssavg    cursor_latency;
+	ssavg    cursor_read_disk;
+	ssavg    cursor_read_cache;
+	ssavg    cursor_ops;
+};
+
+static inline void
+sr_statxm_init(srstatxm *s)
+{
+	memset(s, 0, sizeof(*s));
+}
+
+static inline void
+sr_statxm_prepare(srstatxm *s)
+{
+	ss_avgprepare(&s->tx_latency);
+	ss_avgprepare(&s->tx_stmts);
+}
+
+static inline void
+sr_statxm(srstatxm *s, uint64_t start, uint32_t count,
+          int rlb, int conflict)
+{
+	uint64_t diff = ss_utime() - start;
+	s->tx++;
+	s->tx_rlb += rlb;
+	s->tx_conflict += conflict;
+	ss_avgupdate(&s->tx_stmts, count);
+	ss_avgupdate(&s->tx_latency, diff);
+}
+
+static inline void
+sr_statxm_lock(srstatxm *s)
+{
+	s->tx_lock++;
+}
+
+static inline void
+sr_statinit(srstat *s)
+{
+	memset(s, 0, sizeof(*s));
+	ss_spinlockinit(&s->lock);
+}
+
+static inline void
+sr_statfree(srstat *s) {
+	ss_spinlockfree(&s->lock);
+}
+
+static inline void
+sr_statprepare(srstat *s)
+{
+	ss_avgprepare(&s->field);
+	ss_avgprepare(&s->set_latency);
+	ss_avgprepare(&s->del_latency);
+	ss_avgprepare(&s->upsert_latency);
+	ss_avgprepare(&s->get_read_disk);
+	ss_avgprepare(&s->get_read_cache);
+	ss_avgprepare(&s->get_latency);
+	ss_avgprepare(&s->pread_latency);
+	ss_avgprepare(&s->cursor_latency);
+	ss_avgprepare(&s->cursor_read_disk);
+	ss_avgprepare(&s->cursor_read_cache);
+	ss_avgprepare(&s->cursor_ops);
+	if (s->hist) {
+		int i = 0;
+		while (i < SR_HMAX) {
+			ss_histprepare(&s->hist[i]);
+			i++;
+		}
+	}
+}
+
+static inline void
+sr_stathist(srstat *s, int id, uint64_t v)
+{
+	if (sslikely(s->hist))
+		ss_histadd(&s->hist[id], v);
+}
+
+static inline void
+sr_statfield(srstat *s, int size)
+{
+	ss_spinlock(&s->lock);
+	ss_avgupdate(&s->field, size);
+	ss_spinunlock(&s->lock);
+}
+
+static inline void
+sr_statset(srstat *s, uint64_t start)
+{
+	uint64_t diff = ss_utime() - start;
+	ss_spinlock(&s->lock);
+	s->set++;
+	ss_avgupdate(&s->set_latency, diff);
+	ss_spinunlock(&s->lock);
+	sr_stathist(s, SR_HSET, diff);
+}
+
+static inline void
+sr_statdelete(srstat *s, uint64_t start)
+{
+	uint64_t diff = ss_utime() - start;
+	ss_spinlock(&s->lock);
+	s->del++;
+	ss_avgupdate(&s->del_latency, diff);
+	ss_spinunlock(&s->lock);
+	sr_stathist(s, SR_HDELETE, diff);
+}
+
+static inline void
+sr_statupsert(srstat *s, uint64_t start)
+{
+	uint64_t diff = ss_utime() - start;
+	ss_spinlock(&s->lock);
+	s->upsert++;
+	ss_avgupdate(&s->upsert_latency, diff);
+	ss_spinunlock(&s->lock);
+	sr_stathist(s, SR_HUPSERT, diff);
+}
+
+static inline void
+sr_statget(srstat *s, uint64_t diff, int read_disk, int read_cache)
+{
+	ss_spinlock(&s->lock);
+	s->get++;
+	ss_avgupdate(&s->get_read_disk, read_disk);
+	ss_avgupdate(&s->get_read_cache, read_cache);
+	ss_avgupdate(&s->get_latency, diff);
+	ss_spinunlock(&s->lock);
+	sr_stathist(s, SR_HGET, diff);
+}
+
+static inline void
+sr_statpread(srstat *s, uint64_t start, int from_compaction)
+{
+	if (from_compaction)
+		return;
+	uint64_t diff = ss_utime() - start;
+	ss_spinlock(&s->lock);
+	s->pread++;
+	ss_avgupdate(&s->pread_latency, diff);
+	ss_spinunlock(&s->lock);
+	sr_stathist(s, SR_HPREAD, diff);
+}
+
+static inline void
+sr_statcursor(srstat *s, uint64_t start, int read_disk, int read_cache, int ops)
+{
+	uint64_t diff = ss_utime() - start;
+	ss_spinlock(&s->lock);
+	s->cursor++;
+	ss_avgupdate(&s->cursor_read_disk, read_disk);
+	ss_avgupdate(&s->cursor_read_cache, read_cache);
+	ss_avgupdate(&s->cursor_latency, diff);
+	ss_avgupdate(&s->cursor_ops, ops);
+	ss_spinunlock(&s->lock);
+	sr_stathist(s, SR_HCURSOR, diff);
+}
+
+static inline void
+sr_statcopy(srstat *s, srstat *dest)
+{
+	ss_spinlock(&s->lock);
+	*dest = *s;
+	ss_spinunlock(&s->lock);
+}
+
+#endif
+#line 1 "sophia/runtime/sr_seq.h"
+#ifndef SR_SEQ_H_
+#define SR_SEQ_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef enum {
+	SR_DSN,
+	SR_DSNNEXT,
+	SR_NSN,
+	SR_NSNNEXT,
+	SR_BSN,
+	SR_BSNNEXT,
+	SR_LSN,
+	SR_LSNNEXT,
+	SR_LFSN,
+	SR_LFSNNEXT,
+	SR_TSN,
+	SR_TSNNEXT
+} srseqop;
+
+typedef struct {
+	ssspinlock lock;
+	uint32_t   dsn;
+	uint64_t   nsn;
+	uint32_t   bsn;
+	uint64_t   lsn;
+	uint64_t   lfsn;
+	uint64_t   tsn;
+} srseq;
+
+static inline void
+sr_seqinit(srseq *n) {
+	memset(n, 0, sizeof(*n));
+	ss_spinlockinit(&n->lock);
+}
+
+static inline void
+sr_seqfree(srseq *n) {
+	ss_spinlockfree(&n->lock);
+}
+
+static inline void
+sr_seqlock(srseq *n) {
+	ss_spinlock(&n->lock);
+}
+
+static inline void
+sr_sequnlock(srseq *n) {
+	ss_spinunlock(&n->lock);
+}
+
+static inline uint64_t
+sr_seqdo(srseq *n, srseqop op)
+{
+	uint64_t v = 0;
+	switch (op) {
+	case SR_LSN:       v = n->lsn;
+		break;
+	case SR_LSNNEXT:   v = ++n->lsn;
+		break;
+	case SR_TSN:       v = n->tsn;
+		break;
+	case SR_TSNNEXT:   v = ++n->tsn;
+		break;
+	case SR_NSN:       v = n->nsn;
+		break;
+	case SR_NSNNEXT:   v = ++n->nsn;
+		break;
+	case SR_LFSN:      v = n->lfsn;
+		break;
+	case SR_LFSNNEXT:  v = ++n->lfsn;
+		break;
+	case SR_BSN:       v = n->bsn;
+		break;
+	case SR_BSNNEXT:   v = ++n->bsn;
+		break;
+	case SR_DSN:       v = n->dsn;
+		break;
+	case SR_DSNNEXT:   v = ++n->dsn;
+		break;
+	}
+	return v;
+}
+
+static inline uint64_t
+sr_seq(srseq *n, srseqop op)
+{
+	sr_seqlock(n);
+	uint64_t v = sr_seqdo(n, op);
+	sr_sequnlock(n);
+	return v;
+}
+
+#endif
+#line 1 "sophia/runtime/sr_rate.h"
+#ifndef SR_RATE_H_
+#define SR_RATE_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+/* Token bucket shared by background writers (compaction
+ * and backup). The configured limit is cut in half each
+ * time the windowed foreground get latency exceeds the
+ * target, and grows back linearly once it settles. */
+
+#define SR_RATE_PERIOD    100000 /* adaptation window, usec */
+#define SR_RATE_SLICE     100000 /* max single sleep, usec */
+#define SR_RATE_YIELD     100    /* foreground read yield, usec */
+#define SR_RATE_YIELD_MAX 10
+#define SR_RATE_CHUNK     (1024 * 1024)
+
+typedef struct srrate srrate;
+
+struct srrate {
+	ssspinlock lock;
+	/* configuration */
+	uint32_t limit_mb;
+	uint32_t latency;
+	/* bucket */
+	uint64_t limit;
+	uint64_t rate;
+	int64_t  tokens;
+	uint64_t last;
+	/* foreground latency window */
+	uint64_t window_time;
+	uint64_t window_count;
+	uint64_t window_total;
+	/* foreground reads in progress */
+	volatile uint32_t reads;
+	/* statistics */
+	uint32_t rate_mb;
+	uint64_t throttle;
+};
+
+static inline void
+sr_rateinit(srrate *r)
+{
+	memset(r, 0, sizeof(*r));
+	ss_spinlockinit(&r->lock);
+}
+
+static inline void
+sr_ratefree(srrate *r) {
+	ss_spinlockfree(&r->lock);
+}
+
+static inline int
+sr_rateactive(srrate *r) {
+	return r && r->limit_mb > 0;
+}
+
+/* limit_mb may be changed online, restart the bucket
+ * once a new value is noticed; called under lock */
+static inline void
+sr_ratesync(srrate *r, uint64_t now)
+{
+	uint64_t limit = (uint64_t)r->limit_mb * 1024 * 1024;
+	if (sslikely(limit == r->limit))
+		return;
+	r->limit   = limit;
+	r->rate    = limit;
+	r->rate_mb = r->limit_mb;
+	r->tokens  = 0;
+	r->last    = now;
+}
+
+static inline void
+sr_rateread_begin(srrate *r) {
+	if (r)
+		__sync_add_and_fetch(&r->reads, 1);
+}
+
+static inline void
+sr_rateread_end(srrate *r) {
+	if (r)
+		__sync_sub_and_fetch(&r->reads, 1);
+}
+
+/* foreground get latency, the same sample that goes
+ * to sr_statget() */
+static inline void
+sr_ratefeed(srrate *r, uint64_t latency)
+{
+	if (sslikely(! sr_rateactive(r) || r->latency == 0))
+		return;
+	ss_spinlock(&r->lock);
+	r->window_count++;
+	r->window_total += latency;
+	ss_spinunlock(&r->lock);
+}
+
+/* called under lock */
+static inline void
+sr_rateadapt(srrate *r, uint64_t now)
+{
+	if ((now - r->window_time) < SR_RATE_PERIOD)
+		return;
+	uint64_t count = r->window_count;
+	uint64_t total = r->window_total;
+	r->window_time  = now;
+	r->window_count = 0;
+	r->window_total = 0;
+	if (r->latency == 0 || r->limit == 0)
+		return;
+	uint64_t step = r->limit / 16;
+	if (step == 0)
+		step = 1;
+	if (count > 0 && (total / count) > r->latency) {
+		r->rate /= 2;
+		if (r->rate < step)
+			r->rate = step;
+	} else {
+		r->rate += step;
+		if (r->rate > r->limit)
+			r->rate = r->limit;
+	}
+	r->rate_mb = r->rate / (1024 * 1024);
+}
+
+static inline void
+sr_ratewait(srrate *r, uint64_t size)
+{
+	if (! sr_rateactive(r))
+		return;
+	uint64_t start = ss_utime();
+
+	/* let foreground reads go first */
+	int i = 0;
+	while (r->reads > 0 && i < SR_RATE_YIELD_MAX) {
+		ss_sleep(SR_RATE_YIELD * 1000);
+		i++;
+	}
+
+	/* take tokens, sleep off the debt */
+	uint64_t wait = 0;
+	ss_spinlock(&r->lock);
+	uint64_t now = ss_utime();
+	sr_ratesync(r, now);
+	sr_rateadapt(r, now);
+	if (r->rate > 0) {
+		int64_t burst = r->rate / (1000000 / SR_RATE_PERIOD);
+		r->tokens += (now - r->last) * r->rate / 1000000;
+		if (r->tokens > burst)
+			r->tokens = burst;
+		r->last = now;
+		r->tokens -= size;
+		if (r->tokens < 0)
+			wait = (uint64_t)(-r->tokens) * 1000000 / r->rate;
+	}
+	ss_spinunlock(&r->lock);
+	while (wait > 0) {
+		uint64_t slice = wait;
+		if (slice > SR_RATE_SLICE)
+			slice = SR_RATE_SLICE;
+		ss_sleep(slice * 1000);
+		wait -= slice;
+	}
+
+	uint64_t diff = ss_utime() - start;
+	ss_spinlock(&r->lock);
+	r->throttle += diff;
+	ss_spinunlock(&r->lock);
+}
+
+#endif
+#line 1 "sophia/runtime/sr_backup.h"
+#ifndef SR_BACKUP_H_
+#define SR_BACKUP_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+/* Progress of the current (or last) backup, shared by
+ * the workers which copy files. Every file put into the
+ * backup is recorded in the manifest. */
+
+typedef struct srbackup srbackup;
+
+struct srbackup {
+	ssmutex  lock;
+	/* configuration */
+	uint32_t incremental;
+	/* statistics */
+	uint32_t files_copied;
+	uint32_t files_linked;
+	uint64_t bytes_copied;
+	uint64_t bytes_linked;
+	ssbuf    manifest;
+};
+
+static inline void
+sr_backupinit(srbackup *b)
+{
+	ss_mutexinit(&b->lock);
+	b->incremental  = 0;
+	b->files_copied = 0;
+	b->files_linked = 0;
+	b->bytes_copied = 0;
+	b->bytes_linked = 0;
+	ss_bufinit(&b->manifest);
+}
+
+static inline void
+sr_backupfree(srbackup *b, ssa *a)
+{
+	ss_buffree(&b->manifest, a);
+	ss_mutexfree(&b->lock);
+}
+
+static inline void
+sr_backupreset(srbackup *b)
+{
+	ss_mutexlock(&b->lock);
+	b->files_copied = 0;
+	b->files_linked = 0;
+	b->bytes_copied = 0;
+	b->bytes_linked = 0;
+	ss_bufreset(&b->manifest);
+	ss_mutexunlock(&b->lock);
+}
+
+/* files which are never modified once written are
+ * hard-linked by an incremental backup. Returns 0 if the
+ * file has to be copied instead: full backup, or the
+ * backup is on another file system */
+static inline int
+sr_backuplink(srbackup *b, ssvfs *vfs, char *src, char *dest)
+{
+	if (b == NULL || !b->incremental)
+		return 0;
+	return ss_vfslink(vfs, src, dest) == 0;
+}
+
+static inline int
+sr_backupadd(srbackup *b, ssa *a, char *dir, char *path,
+             uint64_t size, int linked)
+{
+	if (b == NULL)
+		return 0;
+	char *name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	char line[PATH_MAX];
+	int len = snprintf(line, sizeof(line), "%s %s/%s %" PRIu64 "\n",
+	                   linked ? "link" : "copy", dir, name, size);
+	ss_mutexlock(&b->lock);
+	if (linked) {
+		b->files_linked++;
+		b->bytes_linked += size;
+	} else {
+		b->files_copied++;
+		b->bytes_copied += size;
+	}
+	int rc = ss_bufadd(&b->manifest, a, line, len);
+	ss_mutexunlock(&b->lock);
+	return rc;
+}
+
+#endif
+#line 1 "sophia/runtime/sr.h"
+#ifndef SR_H_
+#define SR_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct sr sr;
+
+struct sr {
+	srstatus *status;
+	srlog *log;
+	srerror *e;
+	sfupsert *upsert;
+	sfscheme *scheme;
+	srseq *seq;
+	ssa *a;
+	ssa *av;
+	ssvfs *vfs;
+	ssinjection *i;
+	srstat *stat;
+	srrate *rate;
+	srbackup *backup;
+	ssjobq *jobq;
+	sscrcf crc;
+	void *ptr;
+};
+
+static inline void
+sr_init(sr *r,
+        srstatus *status,
+        srlog *log,
+        srerror *e,
+        ssa *a,
+        ssa *av,
+        ssvfs *vfs,
+        srseq *seq,
+        sfupsert *upsert,
+        sfscheme *scheme,
+        ssinjection *i,
+        srstat *stat,
+        srrate *rate,
+        srbackup *backup,
+        ssjobq *jobq,
+        sscrcf crc,
+        void *ptr)
+{
+	r->status = status;
+	r->log    = log;
+	r->e      = e;
+	r->a      = a;
+	r->av     = av;
+	r->vfs    = vfs;
+	r->seq    = seq;
+	r->scheme = scheme;
+	r->upsert = upsert;
+	r->i      = i;
+	r->stat   = stat;
+	r->rate   = rate;
+	r->backup = backup;
+	r->jobq   = jobq;
+	r->crc    = crc;
+	r->ptr    = ptr;
+}
+
+#endif
+#line 1 "sophia/runtime/sr_conf.h"
+#ifndef SR_CONF_H_
+#define SR_CONF_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct srconf srconf;
+typedef struct srconfdump srconfdump;
+typedef struct srconfstmt srconfstmt;
+
+typedef int (*srconff)(srconf*, srconfstmt*);
+
+typedef enum {
+	SR_WRITE,
+	SR_READ,
+	SR_SERIALIZE
+} srconfop;
+
+enum {
+	SR_RO = 1,
+	SR_NS = 2
+};
+
+struct srconf {
+	char    *key;
+	int      flags;
+	sstype   type;
+	srconff  function;
+	void    *value;
+	void    *ptr;
+	srconf  *next;
+};
+
+struct srconfdump {
+	uint8_t  type;
+	uint16_t keysize;
+	uint32_t valuesize;
+} sspacked;
+
+struct srconfstmt {
+	srconfop    op;
+	const char *path;
+	void       *value;
+	sstype      valuetype;
+	int         valuesize;
+	srconf     *match;
+	ssbuf      *serialize;
+	void       *ptr;
+	sr         *r;
+};
+
+int sr_confexec(srconf*, srconfstmt*);
+int sr_conf_read(srconf*, srconfstmt*);
+int sr_conf_write(srconf*, srconfstmt*);
+int sr_conf_serialize(srconf*, srconfstmt*);
+
+static inline srconf*
+sr_c(srconf **link, srconf **cp, srconff func,
+     char *key, int type,
+     void *value)
 {
-	if (b->string_max)
-		ss_free(a, b->string_max);
+	srconf *c = *cp;
+	c->key      = key;
+	c->function = func;
+	c->flags    = 0;
+	c->type     = type;
+	c->value    = value;
+	c->ptr      = NULL;
+	c->next     = NULL;
+	*cp = c + 1;
+	if (sslikely(link)) {
+		if (sslikely(*link))
+			(*link)->next = c;
+		*link = c;
+	}
+	return c;
 }
 
-static inline void
-sf_limitapply(sflimit *b, sfscheme *s, sfv *fields, ssorder order)
+static inline srconf*
+sr_C(srconf **link, srconf **cp, srconff func,
+     char *key, int type,
+     void *value, int flags, void *ptr)
 {
-	int i;
-	for (i = 0; i < s->fields_count; i++) {
-		sfv *v = &fields[i];
-		if (v->pointer)
-			continue;
-		sffield *part = s->fields[i];
-		switch (part->type) {
-		case SS_U8:
-			if (order == SS_LT || order == SS_LTE) {
-				v->pointer = (char*)&b->u8_max;
-				v->size = sizeof(uint8_t);
-			} else {
-				v->pointer = (char*)&b->u8_min;
-				v->size = sizeof(uint8_t);
-			}
-			break;
-		case SS_U8REV:
-			if (order == SS_LT || order == SS_LTE) {
-				v->pointer = (char*)&b->u8_min;
-				v->size = sizeof(uint8_t);
-			} else {
-				v->pointer = (char*)&b->u8_max;
-				v->size = sizeof(uint8_t);
-			}
-			break;
-		case SS_U16:
-			if (order == SS_LT || order == SS_LTE) {
-				v->pointer = (char*)&b->u16_max;
-				v->size = sizeof(uint16_t);
-			} else {
-				v->pointer = (char*)&b->u16_min;
-				v->size = sizeof(uint16_t);
-			}
-			break;
-		case SS_U16REV:
-			if (order == SS_LT || order == SS_LTE) {
-				v->pointer = (char*)&b->u16_min;
-				v->size = sizeof(uint16_t);
-			} else {
-				v->pointer = (char*)&b->u16_max;
-				v->size = sizeof(uint16_t);
-			}
-			break;
-		case SS_U32:
-			if (order == SS_LT || order == SS_LTE) {
-				v->pointer = (char*)&b->u32_max;
-				v->size = sizeof(uint32_t);
-			} else {
-				v->pointer = (char*)&b->u32_min;
-				v->size = sizeof(uint32_t);
-			}
-			break;
-		case SS_U32REV:
-			if (order == SS_LT || order == SS_LTE) {
-				v->pointer = (char*)&b->u32_min;
-				v->size = sizeof(uint32_t);
-			} else {
-				v->pointer = (char*)&b->u32_max;
-				v->size = sizeof(uint32_t);
-			}
-			break;
-		case SS_U64:
-			if (order == SS_LT || order == SS_LTE) {
-				v->pointer = (char*)&b->u64_max;
-				v->size = sizeof(uint64_t);
-			} else {
-				v->pointer = (char*)&b->u64_min;
-				v->size = sizeof(uint64_t);
-			}
-			break;
-		case SS_U64REV:
-			if (order == SS_LT || order == SS_LTE) {
-				v->pointer = (char*)&b->u64_min;
-				v->size = sizeof(uint64_t);
-			} else {
-				v->pointer = (char*)&b->u64_max;
-				v->size = sizeof(uint64_t);
-			}
-			break;
-		case SS_I64:
-			if (order == SS_LT || order == SS_LTE) {
-				v->pointer = (char*)&b->i64_max;
-				v->size = sizeof(int64_t);
-			} else {
-				v->pointer = (char*)&b->i64_min;
-				v->size = sizeof(int64_t);
-			}
-			break;
-		case SS_STRING:
-			if (order == SS_LT || order == SS_LTE) {
-				v->pointer = b->string_max;
-				v->size = b->string_max_size;
-			} else {
-				v->pointer = b->string_min;
-				v->size = b->string_min_size;
-			}
+	srconf *c = sr_c(link, cp, func, key, type, value);
+	c->flags = flags;
+	c->ptr = ptr;
+	return c;
+}
+
+static inline char*
+sr_confkey(srconfdump *v) {
+	return (char*)v + sizeof(srconfdump);
+}
+
+static inline char*
+sr_confvalue(srconfdump *v) {
+	return sr_confkey(v) + v->keysize;
+}
+
+static inline void*
+sr_confnext(srconfdump *v) {
+	return sr_confvalue(v) + v->valuesize;
+}
+
+#endif
+#line 1 "sophia/runtime/sr_conf.c"
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+
+
+
+
+int sr_conf_read(srconf *m, srconfstmt *s)
+{
+	switch (m->type) {
+	case SS_U32:
+		s->valuesize = sizeof(uint32_t);
+		if (s->valuetype == SS_I64) {
+			sscasti64(s->value) = sscastu32(m->value);
+		} else
+		if (s->valuetype == SS_U32) {
+			sscastu32(s->value) = sscastu32(m->value);
+		} else
+		if (s->valuetype == SS_U64) {
+			sscastu64(s->value) = sscastu32(m->value);
+		} else {
+			goto bad_type;
+		}
+		break;
+	case SS_U64:
+		s->valuesize = sizeof(uint64_t);
+		if (s->valuetype == SS_I64) {
+			sscasti64(s->value) = sscastu64(m->value);
+		} else
+		if (s->valuetype == SS_U32) {
+			sscastu32(s->value) = sscastu64(m->value);
+		} else
+		if (s->valuetype == SS_U64) {
+			sscastu64(s->value) = sscastu64(m->value);
+		} else {
+			goto bad_type;
+		}
+		break;
+	case SS_STRING: {
+		if (s->valuetype != SS_STRING)
+			goto bad_type;
+		char **result = s->value;
+		*result = NULL;
+		s->valuesize = 0;
+		char *string = m->value;
+		if (string == NULL)
 			break;
-		default: assert(0);
+		int size = strlen(string) + 1; 
+		s->valuesize = size;
+		*result = malloc(size);
+		if (ssunlikely(*result == NULL))
+			return sr_oom(s->r->e);
+		memcpy(*result, string, size);
+		break;
+	}
+	case SS_STRINGPTR: {
+		if (s->valuetype != SS_STRING)
+			goto bad_type;
+		char **result = s->value;
+		*result = NULL;
+		s->valuesize = 0;
+		char **string = m->value;
+		if (*string == NULL)
 			break;
-		}
+		int size = strlen(*string) + 1;
+		s->valuesize = size;
+		*result = malloc(size);
+		if (ssunlikely(*result == NULL))
+			return sr_oom(s->r->e);
+		memcpy(*result, *string, size);
+		break;
+	}
+	case SS_OBJECT:
+		if (s->valuetype != SS_STRING)
+			goto bad_type;
+		*(void**)s->value = m->value;
+		s->valuesize = sizeof(void*);
+		break;
+	default:
+		goto bad_type;
 	}
-}
 
-#endif
-#line 1 "sophia/format/sf_auto.h"
-#ifndef SF_AUTO_H_
-#define SF_AUTO_H_
+	return 0;
 
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
+bad_type:
+	return sr_error(s->r->e, "configuration read bad type (%s) -> (%s) %s",
+	                ss_typeof(s->valuetype),
+	                ss_typeof(m->type), s->path);
+}
 
-static inline void
-sf_autoset(sfscheme *s, sfv *fields, uint32_t *ts)
+int sr_conf_write(srconf *m, srconfstmt *s)
 {
-	int i;
-	for (i = 0; i < s->fields_count; i++) {
-		sffield *part = s->fields[i];
-		if (part->timestamp == 0)
-			continue;
-		sfv *v = &fields[i];
-		if (v->pointer)
-			continue;
-		assert(part->type == SS_U32);
-		v->pointer = (char*)ts;
-		v->size = sizeof(uint32_t);
+	if (m->flags & SR_RO) {
+		sr_error(s->r->e, "%s is read-only", s->path);
+		return -1;
 	}
-}
-
-#endif
-#line 1 "sophia/format/sf_upsert.h"
-#ifndef SF_UPSERT_H_
-#define SF_UPSERT_H_
-
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
+	switch (m->type) {
+	case SS_U32:
+		if (s->valuetype == SS_I64) {
+			sscastu32(m->value) = sscasti64(s->value);
+		} else
+		if (s->valuetype == SS_U32) {
+			sscastu32(m->value) = sscastu32(s->value);
+		} else
+		if (s->valuetype == SS_U64) {
+			sscastu32(m->value) = sscastu64(s->value);
+		} else {
+			goto bad_type;
+		}
+		break;
+	case SS_U64:
+		if (s->valuetype == SS_I64) {
+			sscastu64(m->value) = sscasti64(s->value);
+		} else
+		if (s->valuetype == SS_U32) {
+			sscastu64(m->value) = sscastu32(s->value);
+		} else
+		if (s->valuetype == SS_U64) {
+			sscastu64(m->value) = sscastu64(s->value);
+		} else {
+			goto bad_type;
+		}
+		break;
+	case SS_STRINGPTR: {
+		char **string = m->value;
+		if (s->valuetype == SS_STRING) {
+			int len = s->valuesize + 1;
+			char *sz;
+			sz = ss_malloc(s->r->a, len);
+			if (ssunlikely(sz == NULL))
+				return sr_oom(s->r->e);
+			memcpy(sz, s->value, s->valuesize);
+			sz[s->valuesize] = 0;
+			if (*string)
+				ss_free(s->r->a, *string);
+			*string = sz;
+		} else {
+			goto bad_type;
+		}
+		break;
+	}
+	default:
+		goto bad_type;
+	}
+	return 0;
 
-typedef int (*sfupsertf)(int count,
-                         char **src,    uint32_t *src_size,
-                         char **upsert, uint32_t *upsert_size,
-                         char **result, uint32_t *result_size,
-                         void *arg);
+bad_type:
+	return sr_error(s->r->e, "configuration write bad type (%s) for (%s) %s",
+	                ss_typeof(s->valuetype),
+	                ss_typeof(m->type), s->path);
+}
 
-typedef struct {
-	sfupsertf function;
-	void *arg;
-} sfupsert;
+static inline int
+sr_conf_write_cast(sstype a, sstype b)
+{
+	switch (a) {
+	case SS_U32:
+		if (b == SS_I64) {
+		} else
+		if (b == SS_U32) {
+		} else
+		if (b == SS_U64) {
+		} else {
+			return -1;
+		}
+		break;
+	case SS_U64:
+		if (b == SS_I64) {
+		} else
+		if (b == SS_U32) {
+		} else
+		if (b == SS_U64) {
+		} else {
+			return -1;
+		}
+		break;
+	case SS_STRING:
+	case SS_STRINGPTR:
+		if (b == SS_STRING) {
+		} else {
+			return -1;
+		}
+		break;
+	default:
+		return -1;
+	}
+	return 0;
+}
 
-static inline void
-sf_upsertinit(sfupsert *u)
+int sr_conf_serialize(srconf *m, srconfstmt *s)
 {
-	memset(u, 0, sizeof(*u));
+	char buf[128];
+	char name_function[] = "function";
+	char name_object[] = "object";
+	void *value = NULL;
+	srconfdump v = {
+		.type = m->type
+	};
+	switch (m->type) {
+	case SS_U32:
+		v.valuesize  = snprintf(buf, sizeof(buf), "%" PRIu32, sscastu32(m->value));
+		v.valuesize += 1;
+		value = buf;
+		break;
+	case SS_U64:
+		v.valuesize  = snprintf(buf, sizeof(buf), "%" PRIu64, sscastu64(m->value));
+		v.valuesize += 1;
+		value = buf;
+		break;
+	case SS_I64:
+		v.valuesize  = snprintf(buf, sizeof(buf), "%" PRIi64, sscasti64(m->value));
+		v.valuesize += 1;
+		value = buf;
+		break;
+	case SS_STRING: {
+		char *string = m->value;
+		if (string) {
+			v.valuesize = strlen(string) + 1;
+			value = string;
+		} else {
+			v.valuesize = 0;
+		}
+		break;
+	}
+	case SS_STRINGPTR: {
+		char **string = (char**)m->value;
+		if (*string) {
+			v.valuesize = strlen(*string) + 1;
+			value = *string;
+		} else {
+			v.valuesize = 0;
+		}
+		v.type = SS_STRING;
+		break;
+	}
+	case SS_OBJECT:
+		v.type = SS_STRING;
+		v.valuesize = sizeof(name_object);
+		value = name_object;
+		break;
+	case SS_FUNCTION:
+		v.type = SS_STRING;
+		v.valuesize = sizeof(name_function);
+		value = name_function;
+		break;
+	default:
+		return -1;
+	}
+	char name[128];
+	v.keysize  = snprintf(name, sizeof(name), "%s", s->path);
+	v.keysize += 1;
+	ssbuf *p = s->serialize;
+	int size = sizeof(v) + v.keysize + v.valuesize;
+	int rc = ss_bufensure(p, s->r->a, size);
+	if (ssunlikely(rc == -1))
+		return sr_oom(s->r->e);
+	memcpy(p->p, &v, sizeof(v));
+	memcpy(p->p + sizeof(v), name, v.keysize);
+	memcpy(p->p + sizeof(v) + v.keysize, value, v.valuesize);
+	ss_bufadvance(p, size);
+	return 0;
 }
 
-static inline void
-sf_upsertset(sfupsert *u, sfupsertf function)
+static inline int
+sr_confexec_serialize(srconf *c, srconfstmt *stmt, char *root)
 {
-	u->function = function;
+	char path[256];
+	while (c) {
+		if (root)
+			snprintf(path, sizeof(path), "%s.%s", root, c->key);
+		else
+			snprintf(path, sizeof(path), "%s", c->key);
+		int rc;
+		if (c->flags & SR_NS) {
+			rc = sr_confexec_serialize(c->value, stmt, path);
+			if (ssunlikely(rc == -1))
+				return -1;
+		} else {
+			stmt->path = path;
+			rc = c->function(c, stmt);
+			if (ssunlikely(rc == -1))
+				return -1;
+			stmt->path = NULL;
+		}
+		c = c->next;
+	}
+	return 0;
 }
 
-static inline void
-sf_upsertset_arg(sfupsert *u, void *arg)
+int sr_confexec(srconf *start, srconfstmt *s)
 {
-	u->arg = arg;
-}
+	if (s->op == SR_SERIALIZE)
+		return sr_confexec_serialize(start, s, NULL);
+	char path[256];
+	snprintf(path, sizeof(path), "%s", s->path);
+	char *ptr = NULL;
+	char *token;
+	token = strtok_r(path, ".", &ptr);
+	if (ssunlikely(token == NULL))
+		return -1;
+	srconf *c = start;
+	while (c) {
+		if (strcmp(token, c->key) != 0) {
+			c = c->next;
+			continue;
+		}
+		if (c->flags & SR_NS) {
+			token = strtok_r(NULL, ".", &ptr);
+			if (ssunlikely(token == NULL))
+			{
+				if (s->op == SR_WRITE && c->type != SS_UNDEF) {
+					int rc = sr_conf_write_cast(c->type, s->valuetype);
+					if (ssunlikely(rc == -1))
+						goto bad_type;
+				}
+				s->match = c;
+				if (c->function)
+					return c->function(c, s);
+				/* not supported */
+				goto bad_path;
+			}
+			c = (srconf*)c->value;
+			continue;
+		}
+		s->match = c;
+		token = strtok_r(NULL, ".", &ptr);
+		if (ssunlikely(token != NULL))
+			goto bad_path;
+		return c->function(c, s);
+	}
 
-static inline int
-sf_upserthas(sfupsert *u) {
-	return u->function != NULL;
-}
+bad_path:
+	return sr_error(s->r->e, "bad configuration path: %s", s->path);
 
-#endif
-#line 1 "sophia/format/sf_scheme.c"
+bad_type:
+	return sr_error(s->r->e, "incompatible type (%s) for (%s) %s",
+	                ss_typeof(s->valuetype),
+	                ss_typeof(c->type), s->path);
+}
+#line 1 "sophia/object/so.h"
+#ifndef SO_H_
+#define SO_H_
 
 /*
  * sophia database
@@ -13839,522 +18268,188 @@ sf_upserthas(sfupsert *u) {
  * BSD License
 */
 
+typedef struct soif soif;
+typedef struct sotype sotype;
+typedef struct so so;
 
+struct soif {
+	int      (*open)(so*);
+	int      (*destroy)(so*);
+	void     (*free)(so*);
+	void    *(*document)(so*);
+	int      (*setstring)(so*, const char*, void*, int);
+	int      (*setint)(so*, const char*, int64_t);
+	void    *(*getobject)(so*, const char*);
+	void    *(*getstring)(so*, const char*, int*);
+	int64_t  (*getint)(so*, const char*);
+	int      (*setfield)(so*, int, void*, int);
+	int      (*setfieldint)(so*, int, int64_t);
+	void    *(*getfield)(so*, int, int*);
+	int64_t  (*getfieldint)(so*, int);
+	int      (*set)(so*, so*);
+	int      (*upsert)(so*, so*);
+	int      (*del)(so*, so*);
+	void    *(*get)(so*, so*);
+	int      (*getv)(so*, so**, int);
+	void    *(*begin)(so*);
+	int      (*prepare)(so*);
+	int      (*commit)(so*);
+	void    *(*cursor)(so*);
+};
 
-
-static inline sshot int
-sf_cmpstring(char *a, int asz, char *b, int bsz, void *arg ssunused)
-{
-	int size = (asz < bsz) ? asz : bsz;
-	int rc = memcmp(a, b, size);
-	if (ssunlikely(rc == 0)) {
-		if (sslikely(asz == bsz))
-			return 0;
-		return (asz < bsz) ? -1 : 1;
-	}
-	return rc > 0 ? 1 : -1;
-}
-
-static inline sshot int
-sf_cmpu8(char *a, int asz ssunused, char *b, int bsz ssunused, void *arg ssunused)
-{
-	uint8_t av = *(uint8_t*)a;
-	uint8_t bv = *(uint8_t*)b;
-	if (av == bv)
-		return 0;
-	return (av > bv) ? 1 : -1;
-}
-
-static inline sshot int
-sf_cmpu8_reverse(char *a, int asz ssunused, char *b, int bsz ssunused, void *arg ssunused)
-{
-	uint8_t av = *(uint8_t*)a;
-	uint8_t bv = *(uint8_t*)b;
-	if (av == bv)
-		return 0;
-	return (av > bv) ? -1 : 1;
-}
-
-static inline sshot int
-sf_cmpu16(char *a, int asz ssunused, char *b, int bsz ssunused, void *arg ssunused)
-{
-	uint16_t av = *(uint16_t*)a;
-	uint16_t bv = *(uint16_t*)b;
-	if (av == bv)
-		return 0;
-	return (av > bv) ? 1 : -1;
-}
-
-static inline sshot int
-sf_cmpu16_reverse(char *a, int asz ssunused, char *b, int bsz ssunused, void *arg ssunused)
-{
-	uint16_t av = *(uint16_t*)a;
-	uint16_t bv = *(uint16_t*)b;
-	if (av == bv)
-		return 0;
-	return (av > bv) ? -1 : 1;
-}
-
-static inline sshot int
-sf_cmpu32(char *a, int asz ssunused, char *b, int bsz ssunused, void *arg ssunused)
-{
-	uint32_t av = sscastu32(a);
-	uint32_t bv = sscastu32(b);
-	if (av == bv)
-		return 0;
-	return (av > bv) ? 1 : -1;
-}
-
-static inline sshot int
-sf_cmpu32_reverse(char *a, int asz ssunused, char *b, int bsz ssunused, void *arg ssunused)
-{
-	uint32_t av = sscastu32(a);
-	uint32_t bv = sscastu32(b);
-	if (av == bv)
-		return 0;
-	return (av > bv) ? -1 : 1;
-}
-
-static inline sshot int
-sf_cmpu64(char *a, int asz ssunused, char *b, int bsz ssunused,
-              void *arg ssunused)
-{
-	uint64_t av = sscastu64(a);
-	uint64_t bv = sscastu64(b);
-	if (av == bv)
-		return 0;
-	return (av > bv) ? 1 : -1;
-}
-
-static inline sshot int
-sf_cmpu64_reverse(char *a, int asz ssunused, char *b, int bsz ssunused,
-              void *arg ssunused)
-{
-	uint64_t av = sscastu64(a);
-	uint64_t bv = sscastu64(b);
-	if (av == bv)
-		return 0;
-	return (av > bv) ? -1 : 1;
-}
-
-sshot int
-sf_compare(sfscheme *s, char *a, char *b)
-{
-	sffield **part = s->keys;
-	sffield **last = part + s->keys_count;
-	int rc;
-	while (part < last) {
-		sffield *key = *part;
-		uint32_t a_fieldsize;
-		char *a_field = sf_fieldptr(s, key, a, &a_fieldsize);
-		uint32_t b_fieldsize;
-		char *b_field = sf_fieldptr(s, key, b, &b_fieldsize);
-		rc = key->cmp(a_field, a_fieldsize, b_field, b_fieldsize, NULL);
-		if (rc != 0)
-			return rc;
-		part++;
-	}
-	return 0;
-}
-
-sshot int
-sf_compareprefix(sfscheme *s, char *prefix, uint32_t prefixsize, char *key)
-{
-	uint32_t keysize;
-	key = sf_field(s, 0, key, &keysize);
-	if (keysize < prefixsize)
-		return 0;
-	return (memcmp(prefix, key, prefixsize) == 0) ? 1 : 0;
-}
-
-void sf_schemeinit(sfscheme *s)
-{
-	s->fields = NULL;
-	s->fields_count = 0;
-	s->keys = NULL;
-	s->keys_count = 0;
-	s->var_offset = 0;
-	s->offset_expire = 0;
-	s->offset_lsn = 0;
-	s->offset_flags = 0;
-	s->var_count  = 0;
-	s->cmp = NULL;
-	s->cmparg = NULL;
-	s->has_lsn = 0;
-	s->has_flags = 0;
-	s->has_timestamp = 0;
-	s->has_expire = 0;
-}
-
-void sf_schemefree(sfscheme *s, ssa *a)
+struct sotype {
+	uint32_t magic;
+	char *name;
+};
+
+struct so {
+	soif *i;
+	sotype *type;
+	so *parent;
+	so *env;
+	uint8_t destroyed;
+	sslist link;
+};
+
+static inline void
+so_init(so *o, sotype *type, soif *i, so *parent, so *env)
 {
-	if (s->fields) {
-		int i = 0;
-		while (i < s->fields_count) {
-			sf_fieldfree(s->fields[i], a);
-			i++;
-		}
-		ss_free(a, s->fields);
-		s->fields = NULL;
-	}
-	if (s->keys) {
-		ss_free(a, s->keys);
-		s->keys = NULL;
-	}
+	o->type      = type;
+	o->i         = i;
+	o->parent    = parent;
+	o->env       = env;
+	o->destroyed = 0;
+	ss_listinit(&o->link);
 }
 
-int sf_schemeadd(sfscheme *s, ssa *a, sffield *f)
+static inline void
+so_mark_destroyed(so *o)
 {
-	int size = sizeof(sffield*) * (s->fields_count + 1);
-	sffield **fields = ss_malloc(a, size);
-	if (ssunlikely(fields == NULL))
-		return -1;
-	memcpy(fields, s->fields, size - sizeof(sffield*));
-	fields[s->fields_count] = f;
-	f->position = s->fields_count;
-	f->position_key = -1;
-	if (s->fields)
-		ss_free(a, s->fields);
-	s->fields = fields;
-	s->fields_count++;
-	return 0;
+	o->destroyed = 1;
 }
 
-static inline int
-sf_schemeset(sfscheme *s, sffield *f, char *opt)
+static inline void*
+so_cast_dynamic(void *ptr, sotype *type,
+          const char *file,
+          const char *function, int line)
 {
-	(void)s;
-	if (strcmp(opt, "string") == 0) {
-		f->type = SS_STRING;
-		f->fixed_size = 0;
-		f->cmp = sf_cmpstring;
-	} else
-	if (strcmp(opt, "u8") == 0) {
-		f->type = SS_U8;
-		f->fixed_size = sizeof(uint8_t);
-		f->cmp = sf_cmpu8;
-	} else
-	if (strcmp(opt, "u8_rev") == 0) {
-		f->type = SS_U8REV;
-		f->fixed_size = sizeof(uint8_t);
-		f->cmp = sf_cmpu8_reverse;
-	} else
-	if (strcmp(opt, "u16") == 0) {
-		f->type = SS_U16;
-		f->fixed_size = sizeof(uint16_t);
-		f->cmp = sf_cmpu16;
-	} else
-	if (strcmp(opt, "u16_rev") == 0) {
-		f->type = SS_U16REV;
-		f->fixed_size = sizeof(uint16_t);
-		f->cmp = sf_cmpu16_reverse;
-	} else
-	if (strcmp(opt, "u32") == 0) {
-		f->type = SS_U32;
-		f->fixed_size = sizeof(uint32_t);
-		f->cmp = sf_cmpu32;
-	} else
-	if (strcmp(opt, "u32_rev") == 0) {
-		f->type = SS_U32REV;
-		f->fixed_size = sizeof(uint32_t);
-		f->cmp = sf_cmpu32_reverse;
-	} else
-	if (strcmp(opt, "u64") == 0) {
-		f->type = SS_U64;
-		f->fixed_size = sizeof(uint64_t);
-		f->cmp = sf_cmpu64;
-	} else
-	if (strcmp(opt, "u64_rev") == 0) {
-		f->type = SS_U64REV;
-		f->fixed_size = sizeof(uint64_t);
-		f->cmp = sf_cmpu64_reverse;
-	} else
-	if (strncmp(opt, "key", 3) == 0) {
-		char *p = opt + 3;
-		if (ssunlikely(*p != '('))
-			return -1;
-		p++;
-		if (ssunlikely(! isdigit(*p)))
-			return -1;
-		int v = 0;
-		while (isdigit(*p)) {
-			v = (v * 10) + *p - '0';
-			p++;
-		}
-		if (ssunlikely(*p != ')'))
-			return -1;
-		p++;
-		f->position_key = v;
-		f->key = 1;
-	} else
-	if (strncmp(opt, "lsn", 3) == 0) {
-		f->lsn = 1;
-	} else
-	if (strncmp(opt, "flags", 5) == 0) {
-		f->flags = 1;
-	} else
-	if (strncmp(opt, "timestamp", 9) == 0) {
-		f->timestamp = 1;
-	} else
-	if (strncmp(opt, "expire", 6) == 0) {
-		f->expire = 1;
-	} else {
-		return -1;
-	}
-	return 0;
+	int eq = ptr != NULL && ((so*)ptr)->type == type;
+	if (sslikely(eq))
+		return ptr;
+	fprintf(stderr, "%s:%d %s(%p) expected '%s' object\n",
+	        file, line, function, ptr, type->name);
+	abort();
+	return NULL;
 }
 
-int
-sf_schemevalidate(sfscheme *s, ssa *a)
-{
-	/* validate fields */
-	if (s->fields_count == 0) {
-		return -1;
-	}
+#define so_cast(o, cast, type) \
+	((cast)so_cast_dynamic(o, type, __FILE__, __func__, __LINE__))
 
-	/* add meta fields */
-	int rc;
+#define so_open(o)      (o)->i->open(o)
+#define so_destroy(o)   (o)->i->destroy(o)
+#define so_free(o)      (o)->i->free(o)
+#define so_document(o)  (o)->i->document(o)
+#define so_set(o, v)    (o)->i->set(o, v)
+#define so_upsert(o, v) (o)->i->upsert(o, v)
+#define so_delete(o, v) (o)->i->del(o, v)
+#define so_get(o, v)    (o)->i->get(o, v)
+#define so_begin(o)     (o)->i->begin(o)
+#define so_prepare(o)   (o)->i->prepare(o)
+#define so_commit(o)    (o)->i->commit(o)
+#define so_cursor(o)    (o)->i->cursor(o)
 
-	/* flags */
-	sffield *meta_flags = sf_fieldnew(a, "_flags");
-	if (ssunlikely(meta_flags == NULL))
-		return -1;
-	rc = sf_fieldoptions(meta_flags, a, "u8,flags");
-	if (ssunlikely(rc == -1)) {
-		sf_fieldfree(meta_flags, a);
-		return -1;
-	}
-	rc = sf_schemeadd(s, a, meta_flags);
-	if (ssunlikely(rc == -1)) {
-		sf_fieldfree(meta_flags, a);
-		return -1;
-	}
+#define so_setstring(o, path, pointer, size) \
+	(o)->i->setstring(o, path, pointer, size)
+#define so_setint(o, path, v) \
+	(o)->i->setint(o, path, v)
+#define so_getobject(o, path) \
+	(o)->i->getobject(o, path)
+#define so_getstring(o, path, sizep) \
+	(o)->i->getstring(o, path, sizep)
+#define so_getint(o, path) \
+	(o)->i->getnumber(o, path)
 
-	/* lsn */
-	sffield *meta_lsn = sf_fieldnew(a, "_lsn");
-	if (ssunlikely(meta_lsn == NULL))
-		return -1;
-	rc = sf_fieldoptions(meta_lsn, a, "u64,lsn");
-	if (ssunlikely(rc == -1)) {
-		sf_fieldfree(meta_lsn, a);
-		return -1;
-	}
-	rc = sf_schemeadd(s, a, meta_lsn);
-	if (ssunlikely(rc == -1)) {
-		sf_fieldfree(meta_lsn, a);
-		return -1;
-	}
+#endif
+#line 1 "sophia/object/so_list.h"
+#ifndef SO_LIST_H_
+#define SO_LIST_H_
 
-	int fixed_offset = 0;
-	int fixed_pos = 0;
-	int i = 0;
-	while (i < s->fields_count)
-	{
-		/* validate and apply field options */
-		sffield *f = s->fields[i];
-		if (f->options == NULL) {
-			return -1;
-		}
-		/* set user compare function */
-		if (s->cmp) {
-			f->cmp = s->cmp;
-		}
-		char opts[256];
-		snprintf(opts, sizeof(opts), "%s", f->options);
-		char *p;
-		for (p = strtok(opts, " ,"); p;
-		     p = strtok(NULL, " ,"))
-		{
-			rc = sf_schemeset(s, f, p);
-			if (ssunlikely(rc == -1))
-				return -1;
-		}
-		/* validate auto modifiers */
-		if (f->timestamp) {
-			if (f->type != SS_U32)
-				return -1;
-			s->has_timestamp = 1;
-		}
-		if (f->expire) {
-			if (! f->timestamp)
-				return -1;
-			if (s->has_expire)
-				return -1;
-			s->has_expire = 1;
-		}
-		/* meta fields */
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
 
-		/* flags */
-		if (f->flags) {
-			if (f->type != SS_U8)
-				return -1;
-			if (s->has_flags)
-				return -1;
-			s->has_flags = 1;
-		}
-		/* lsn */
-		if (f->lsn) {
-			if (f->type != SS_U64)
-				return -1;
-			if (s->has_lsn)
-				return -1;
-			s->has_lsn = 1;
-		}
+typedef struct solist solist;
 
-		/* calculate offset and position for fixed
-		 * size types */
-		if (f->fixed_size > 0) {
-			f->position_ref = fixed_pos;
-			fixed_pos++;
-			f->fixed_offset = fixed_offset;
-			fixed_offset += f->fixed_size;
-			if (f->expire)
-				s->offset_expire = f->fixed_offset;
-			else
-			if (f->lsn)
-				s->offset_lsn = f->fixed_offset;
-			else
-			if (f->flags)
-				s->offset_flags = f->fixed_offset;
-		} else {
-			s->var_count++;
-		}
-		if (f->key)
-			s->keys_count++;
-		i++;
-	}
-	s->var_offset = fixed_offset;
+struct solist {
+	sslist list;
+	int n;
+};
 
-	/* validate keys */
-	if (ssunlikely(s->keys_count == 0))
-		return -1;
-	int size = sizeof(sffield*) * s->keys_count;
-	s->keys = ss_malloc(a, size);
-	if (ssunlikely(s->keys == NULL))
-		return -1;
-	memset(s->keys, 0, size);
-	int pos_var = 0;
-	i = 0;
-	while (i < s->fields_count) {
-		sffield *f = s->fields[i];
-		if (f->key) {
-			if (ssunlikely(f->position_key < 0))
-				return -1;
-			if (ssunlikely(f->position_key >= s->fields_count))
-				return -1;
-			if (ssunlikely(f->position_key >= s->keys_count))
-				return -1;
-			if (ssunlikely(s->keys[f->position_key] != NULL))
-				return -1;
-			s->keys[f->position_key] = f;
-		}
-		if (f->fixed_size == 0)
-			f->position_ref = pos_var++;
-		i++;
-	}
-	i = 0;
-	while (i < s->keys_count) {
-		sffield *f = s->keys[i];
-		if (f == NULL)
-			return -1;
-		i++;
-	}
-	return 0;
+static inline void
+so_listinit(solist *i)
+{
+	ss_listinit(&i->list);
+	i->n = 0;
 }
 
-int sf_schemesave(sfscheme *s, ssa *a, ssbuf *buf)
+static inline int
+so_listdestroy(solist *i)
 {
-	/* fields count */
-	uint32_t v = s->fields_count;
-	if (s->has_lsn)
-		v--;
-	if (s->has_flags)
-		v--;
-	int rc = ss_bufadd(buf, a, &v, sizeof(uint32_t));
-	if (ssunlikely(rc == -1))
-		return -1;
-	int fields_count = v;
-	int i = 0;
-	while (i < fields_count) {
-		sffield *field = s->fields[i];
-		assert(field->lsn == 0);
-		assert(field->flags == 0);
-		/* name */
-		v = strlen(field->name) + 1;
-		rc = ss_bufensure(buf, a, sizeof(uint32_t) + v);
-		if (ssunlikely(rc == -1))
-			goto error;
-		memcpy(buf->p, &v, sizeof(v));
-		ss_bufadvance(buf, sizeof(uint32_t));
-		memcpy(buf->p, field->name, v);
-		ss_bufadvance(buf, v);
-		/* options */
-		v = strlen(field->options) + 1;
-		rc = ss_bufensure(buf, a, sizeof(uint32_t) + v);
+	int rcret = 0;
+	int rc;
+	sslist *p, *n;
+	ss_listforeach_safe(&i->list, p, n) {
+		so *o = sscast(p, so, link);
+		rc = so_destroy(o);
 		if (ssunlikely(rc == -1))
-			goto error;
-		memcpy(buf->p, &v, sizeof(v));
-		ss_bufadvance(buf, sizeof(uint32_t));
-		memcpy(buf->p, field->options, v);
-		ss_bufadvance(buf, v);
-		i++;
+			rcret = -1;
 	}
-	return 0;
-error:
-	ss_buffree(buf, a);
-	return -1;
+	i->n = 0;
+	ss_listinit(&i->list);
+	return rcret;
 }
 
-int sf_schemeload(sfscheme *s, ssa *a, char *buf, int size ssunused)
+static inline void
+so_listfree(solist *i)
 {
-	/* count */
-	char *p = buf;
-	uint32_t v = sscastu32(p);
-	p += sizeof(uint32_t);
-	int count = v;
-	int i = 0;
-	while (i < count) {
-		/* name */
-		v = sscastu32(p);
-		p += sizeof(uint32_t);
-		sffield *field = sf_fieldnew(a, p);
-		if (ssunlikely(field == NULL))
-			goto error;
-		p += v;
-		/* options */
-		v = sscastu32(p);
-		p += sizeof(uint32_t);
-		int rc = sf_fieldoptions(field, a, p);
-		if (ssunlikely(rc == -1)) {
-			sf_fieldfree(field, a);
-			goto error;
-		}
-		rc = sf_schemeadd(s, a, field);
-		if (ssunlikely(rc == -1)) {
-			sf_fieldfree(field, a);
-			goto error;
-		}
-		p += v;
-		i++;
+	sslist *p, *n;
+	ss_listforeach_safe(&i->list, p, n) {
+		so *o = sscast(p, so, link);
+		so_free(o);
 	}
-	return 0;
-error:
-	sf_schemefree(s, a);
-	return -1;
+	i->n = 0;
+	ss_listinit(&i->list);
 }
 
-sffield*
-sf_schemefind(sfscheme *s, char *name)
+static inline void
+so_listadd(solist *i, so *o)
 {
-	int i;
-	for (i = 0; i < s->fields_count; i++)
-		if (strcmp(s->fields[i]->name, name) == 0)
-			return s->fields[i];
-	return NULL;
+	ss_listappend(&i->list, &o->link);
+	i->n++;
 }
-#line 1 "sophia/runtime/sr_version.h"
-#ifndef SR_VERSION_H_
-#define SR_VERSION_H_
+
+static inline void
+so_listdel(solist *i, so *o)
+{
+	ss_listunlink(&o->link);
+	i->n--;
+}
+
+static inline so*
+so_listfirst(solist *i)
+{
+	assert(i->n > 0);
+	return sscast(i->list.next, so, link);
+}
+
+#endif
+#line 1 "sophia/object/so_pool.h"
+#ifndef SO_POOL_H_
+#define SO_POOL_H_
 
 /*
  * sophia database
@@ -14364,73 +18459,81 @@ sf_schemefind(sfscheme *s, char *name)
  * BSD License
 */
 
-#define SR_VERSION_MAGIC      8529643324614668147ULL
-
-#define SR_VERSION_A         '2'
-#define SR_VERSION_B         '2'
-
-#define SR_VERSION_STORAGE_A '2'
-#define SR_VERSION_STORAGE_B '2'
+typedef struct sopool sopool;
 
-#if defined(SOPHIA_BUILD)
-# define SR_VERSION_COMMIT SOPHIA_BUILD
-#else
-# define SR_VERSION_COMMIT "unknown"
-#endif
+struct sopool {
+	ssspinlock lock;
+	int free_max;
+	solist list;
+	solist free;
+};
 
-typedef struct srversion srversion;
+static inline void
+so_poolinit(sopool *p, int n)
+{
+	ss_spinlockinit(&p->lock);
+	so_listinit(&p->list);
+	so_listinit(&p->free);
+	p->free_max = n;
+}
 
-struct srversion {
-	uint64_t magic;
-	uint8_t  a, b, c;
-} sspacked;
+static inline int
+so_pooldestroy(sopool *p)
+{
+	ss_spinlockfree(&p->lock);
+	int rcret = 0;
+	int rc = so_listdestroy(&p->list);
+	if (ssunlikely(rc == -1))
+		rcret = -1;
+	so_listfree(&p->free);
+	return rcret;
+}
 
 static inline void
-sr_version(srversion *v)
+so_pooladd(sopool *p, so *o)
 {
-	v->magic = SR_VERSION_MAGIC;
-	v->a = SR_VERSION_A;
-	v->b = SR_VERSION_B;
-	v->c = 0;
+	ss_spinlock(&p->lock);
+	so_listadd(&p->list, o);
+	ss_spinunlock(&p->lock);
 }
 
-static inline int
-sr_version_check(srversion *v)
+static inline void
+so_poolgc(sopool *p, so *o)
 {
-	if (v->magic != SR_VERSION_MAGIC)
-		return 0;
-	if (v->a != SR_VERSION_STORAGE_A)
-		return 0;
-	if (v->b != SR_VERSION_STORAGE_B)
-		return 0;
-	return 1;
+	ss_spinlock(&p->lock);
+	so_listdel(&p->list, o);
+	if (p->free.n < p->free_max) {
+		so_listadd(&p->free, o);
+		ss_spinunlock(&p->lock);
+		return;
+	}
+	ss_spinunlock(&p->lock);
+	so_free(o);
 }
 
 static inline void
-sr_version_storage(srversion *v)
+so_poolpush(sopool *p, so *o)
 {
-	v->magic = SR_VERSION_MAGIC;
-	v->a = SR_VERSION_STORAGE_A;
-	v->b = SR_VERSION_STORAGE_B;
-	v->c = 0;
+	ss_spinlock(&p->lock);
+	so_listadd(&p->free, o);
+	ss_spinunlock(&p->lock);
 }
 
-static inline int
-sr_versionstorage_check(srversion *v)
+static inline so*
+so_poolpop(sopool *p)
 {
-	if (v->magic != SR_VERSION_MAGIC)
-		return 0;
-	if (v->a != SR_VERSION_STORAGE_A)
-		return 0;
-	if (v->b != SR_VERSION_STORAGE_B)
-		return 0;
-	return 1;
+	so *o = NULL;
+	ss_spinlock(&p->lock);
+	if (sslikely(p->free.n)) {
+		o = so_listfirst(&p->free);
+		so_listdel(&p->free, o);
+	}
+	ss_spinunlock(&p->lock);
+	return o;
 }
 
 #endif
-#line 1 "sophia/runtime/sr_log.h"
-#ifndef SR_LOG_H_
-#define SR_LOG_H_
+#line 1 "sophia/object/so.c"
 
 /*
  * sophia database
@@ -14440,39 +18543,13 @@ sr_versionstorage_check(srversion *v)
  * BSD License
 */
 
-typedef struct srlog srlog;
-
-typedef void (*srlogcbf)(char*, void*);
 
-struct srlog {
-	srlogcbf log;
-	void *arg;
-};
 
-static inline void
-sr_loginit(srlog *log)
-{
-	log->log = NULL;
-	log->arg = NULL;
-}
 
-static inline void
-sr_log(srlog *log, char *fmt, ...)
-{
-	if (log->log == NULL)
-		return;
-	char message[1024];
-	va_list args;
-	va_start(args, fmt);
-	vsnprintf(message, sizeof(message), fmt, args);
-	va_end(args);
-	log->log(message, log->arg);
-}
 
-#endif
-#line 1 "sophia/runtime/sr_error.h"
-#ifndef SR_ERROR_H_
-#define SR_ERROR_H_
+#line 1 "sophia/version/sv_v.h"
+#ifndef SV_V_H_
+#define SV_V_H_
 
 /*
  * sophia database
@@ -14482,137 +18559,127 @@ sr_log(srlog *log, char *fmt, ...)
  * BSD License
 */
 
-typedef struct srerror srerror;
+typedef struct svv svv;
 
-enum {
-	SR_ERROR_NONE  = 0,
-	SR_ERROR = 1,
-	SR_ERROR_MALFUNCTION = 2
-};
+struct svv {
+	uint16_t refs;
+	void    *log;
+	svv     *next;
+	ssrbnode node;
+} sspacked;
 
-struct srerror {
-	ssspinlock lock;
-	int type;
-	const char *file;
-	const char *function;
-	int line;
-	char error[256];
-	uint64_t errors;
-	srlog *log;
-};
+static inline svv*
+sv_vv(char *data) {
+	if (ssunlikely(data == NULL))
+		return NULL;
+	return (svv*)(data - sizeof(svv));
+}
 
-static inline void
-sr_errorinit(srerror *e, srlog *log)
-{
-	e->type = SR_ERROR_NONE;
-	e->errors = 0;
-	e->error[0] = 0;
-	e->line = 0;
-	e->function = NULL;
-	e->file = NULL;
-	e->log = log;
-	ss_spinlockinit(&e->lock);
+static inline char*
+sv_vpointer(svv *v) {
+	return (char*)(v) + sizeof(svv);
 }
 
-static inline void
-sr_errorfree(srerror *e)
-{
-	ss_spinlockfree(&e->lock);
+static inline uint8_t
+sv_vflags(svv *v, sr *r) {
+	return sf_flags(r->scheme, sv_vpointer(v));
 }
 
-static inline void
-sr_errorreset(srerror *e)
-{
-	ss_spinlock(&e->lock);
-	e->type = SR_ERROR_NONE;
-	e->error[0] = 0;
-	e->line = 0;
-	e->function = NULL;
-	e->file = NULL;
-	ss_spinunlock(&e->lock);
+static inline uint32_t
+sv_vsize(svv *v, sr *r) {
+	return sizeof(svv) + sf_size(r->scheme, sv_vpointer(v));
 }
 
-static inline void
-sr_malfunction_set(srerror *e)
-{
-	ss_spinlock(&e->lock);
-	e->type = SR_ERROR_MALFUNCTION;
-	ss_spinunlock(&e->lock);
+static inline uint64_t
+sv_vlsn(svv *v, sr *r) {
+	return sf_lsn(r->scheme, sv_vpointer(v));
 }
 
-static inline int
-sr_errorof(srerror *e)
+static inline svv*
+sv_vbuild(sr *r, sfv *fields)
 {
-	ss_spinlock(&e->lock);
-	int type = e->type;
-	ss_spinunlock(&e->lock);
-	return type;
+	uint32_t size = sf_writesize(r->scheme, fields);
+	svv *v = ss_malloc(r->av, sizeof(svv) + size);
+	if (ssunlikely(v == NULL))
+		return NULL;
+	v->refs  = 1;
+	v->log   = NULL;
+	v->next  = NULL;
+	memset(&v->node, 0, sizeof(v->node));
+	char *ptr = sv_vpointer(v);
+	sf_write(r->scheme, fields, ptr);
+	/* update runtime statistics */
+	ss_spinlock(&r->stat->lock);
+	r->stat->v_count++;
+	r->stat->v_allocated += sizeof(svv) + size;
+	ss_spinunlock(&r->stat->lock);
+	return v;
 }
 
-static inline int
-sr_errorcopy(srerror *e, char *buf, int bufsize)
+static inline svv*
+sv_vbuildraw(sr *r, char *src)
 {
-	ss_spinlock(&e->lock);
-	int len = snprintf(buf, bufsize, "%s", e->error);
-	ss_spinunlock(&e->lock);
-	return len;
+	uint32_t size = sf_size(r->scheme, src);
+	svv *v = ss_malloc(r->av, sizeof(svv) + size);
+	if (ssunlikely(v == NULL))
+		return NULL;
+	v->refs  = 1;
+	v->log   = NULL;
+	v->next  = NULL;
+	memset(&v->node, 0, sizeof(v->node));
+	memcpy(sv_vpointer(v), src, size);
+	/* update runtime statistics */
+	ss_spinlock(&r->stat->lock);
+	r->stat->v_count++;
+	r->stat->v_allocated += sizeof(svv) + size;
+	ss_spinunlock(&r->stat->lock);
+	return v;
 }
 
 static inline void
-sr_verrorset(srerror *e, int type,
-             const char *file,
-             const char *function, int line,
-             char *fmt, va_list args)
-{
-	ss_spinlock(&e->lock);
-	e->errors++;
-	if (ssunlikely(e->type == SR_ERROR_MALFUNCTION)) {
-		ss_spinunlock(&e->lock);
-		return;
-	}
-	e->file     = file;
-	e->function = function;
-	e->line     = line;
-	e->type     = type;
-	int len;
-	len = snprintf(e->error, sizeof(e->error), "%s:%d ", file, line);
-	vsnprintf(e->error + len, sizeof(e->error) - len, fmt, args);
-	sr_log(e->log, e->error);
-	ss_spinunlock(&e->lock);
+sv_vref(svv *v) {
+	v->refs++;
 }
 
 static inline int
-sr_errorset(srerror *e, int type,
-            const char *file,
-            const char *function, int line,
-            char *fmt, ...)
+sv_vunref(sr *r, svv *v)
 {
-	va_list args;
-	va_start(args, fmt);
-	sr_verrorset(e, type, file, function, line, fmt, args);
-	va_end(args);
-	return -1;
+	if (sslikely(--v->refs == 0)) {
+		uint32_t size = sv_vsize(v, r);
+		/* update runtime statistics */
+		ss_spinlock(&r->stat->lock);
+		assert(r->stat->v_count > 0);
+		assert(r->stat->v_allocated >= size);
+		r->stat->v_count--;
+		r->stat->v_allocated -= size;
+		ss_spinunlock(&r->stat->lock);
+		ss_free(r->av, v);
+		return 1;
+	}
+	return 0;
 }
 
-#define sr_e(e, type, fmt, ...) \
-	sr_errorset(e, type, __FILE__, __func__, __LINE__, fmt, __VA_ARGS__)
-
-#define sr_error(e, fmt, ...) \
-	sr_e(e, SR_ERROR, fmt, __VA_ARGS__)
-
-#define sr_malfunction(e, fmt, ...) \
-	sr_e(e, SR_ERROR_MALFUNCTION, fmt, __VA_ARGS__)
-
-#define sr_oom(e) \
-	sr_e(e, SR_ERROR, "%s", "memory allocation failed")
+static inline void
+sv_vfree(sr *r, svv *v)
+{
+	while (v) {
+		svv *n = v->next;
+		sv_vunref(r, v);
+		v = n;
+	}
+}
 
-#define sr_oom_malfunction(e) \
-	sr_e(e, SR_ERROR_MALFUNCTION, "%s", "memory allocation failed")
+static inline svv*
+sv_vvisible(svv *v, sr *r, uint64_t vlsn) {
+	while (v && sv_vlsn(v, r) > vlsn)
+		v = v->next;
+	return v;
+}
 
 #endif
-#line 1 "sophia/runtime/sr_status.h"
-#ifndef SR_STATUS_H_
-#define SR_STATUS_H_
+#line 1 "sophia/version/sv_upsert.h"
+#ifndef SV_UPSERT_H_
+#define SV_UPSERT_H_
 
 /*
  * sophia database
@@ -14622,108 +18689,243 @@ sr_errorset(srerror *e, int type,
  * BSD License
 */
 
-enum {
-	SR_OFFLINE,
-	SR_ONLINE,
-	SR_RECOVER,
-	SR_SHUTDOWN,
-	SR_MALFUNCTION
+typedef struct svupsertnode svupsertnode;
+typedef struct svupsert svupsert;
+
+struct svupsertnode {
+	ssbuf buf;
 };
 
-typedef struct srstatus srstatus;
+#define SV_UPSERTRESRV 16
 
-struct srstatus {
-	int status;
-	ssspinlock lock;
+struct svupsert {
+	svupsertnode reserve[SV_UPSERTRESRV];
+	ssbuf        stack;
+	ssbuf        tmp;
+	int          max;
+	int          count;
+	char        *result;
 };
 
 static inline void
-sr_statusinit(srstatus *s)
+sv_upsertinit(svupsert *u)
 {
-	s->status = SR_OFFLINE;
-	ss_spinlockinit(&s->lock);
+	const int reserve = SV_UPSERTRESRV;
+	int i = 0;
+	while (i < reserve) {
+		ss_bufinit(&u->reserve[i].buf);
+		i++;
+	}
+	u->result = NULL;
+	u->count  = 0;
+	u->max    = reserve;
+	ss_bufinit_reserve(&u->stack, u->reserve, sizeof(u->reserve));
+	ss_bufinit(&u->tmp);
 }
 
 static inline void
-sr_statusfree(srstatus *s)
+sv_upsertfree(svupsert *u, sr *r)
 {
-	ss_spinlockfree(&s->lock);
+	svupsertnode *n = (svupsertnode*)u->stack.s;
+	int i = 0;
+	while (i < u->max) {
+		ss_buffree(&n[i].buf, r->a);
+		i++;
+	}
+	ss_buffree(&u->stack, r->a);
+	ss_buffree(&u->tmp, r->a);
 }
 
 static inline void
-sr_statuslock(srstatus *s) {
-	ss_spinlock(&s->lock);
+sv_upsertreset(svupsert *u)
+{
+	svupsertnode *n = (svupsertnode*)u->stack.s;
+	int i = 0;
+	while (i < u->count) {
+		ss_bufreset(&n[i].buf);
+		i++;
+	}
+	u->result = NULL;
+	u->count  = 0;
+	ss_bufreset(&u->stack);
+	ss_bufreset(&u->tmp);
 }
 
 static inline void
-sr_statusunlock(srstatus *s) {
-	ss_spinunlock(&s->lock);
-}
-
-static inline int
-sr_statusset(srstatus *s, int status)
+sv_upsertgc(svupsert *u, sr *r, int wm_stack, int wm_buf)
 {
-	ss_spinlock(&s->lock);
-	int old = s->status;
-	s->status = status;
-	ss_spinunlock(&s->lock);
-	return old;
+	svupsertnode *n = (svupsertnode*)u->stack.s;
+	if (u->max >= wm_stack) {
+		sv_upsertfree(u, r);
+		sv_upsertinit(u);
+		return;
+	}
+	ss_bufgc(&u->tmp, r->a, wm_buf);
+	int i = 0;
+	while (i < u->count) {
+		ss_bufgc(&n[i].buf, r->a, wm_buf);
+		i++;
+	}
+	u->count = 0;
+	u->result = NULL;
 }
 
 static inline int
-sr_status(srstatus *s)
+sv_upsertpush(svupsert *u, sr *r, char *pointer)
 {
-	ss_spinlock(&s->lock);
-	int status = s->status;
-	ss_spinunlock(&s->lock);
-	return status;
+	svupsertnode *n;
+	int rc;
+	if (sslikely(u->max > u->count)) {
+		n = (svupsertnode*)u->stack.p;
+		ss_bufreset(&n->buf);
+	} else {
+		rc = ss_bufensure(&u->stack, r->a, sizeof(svupsertnode));
+		if (ssunlikely(rc == -1))
+			return -1;
+		n = (svupsertnode*)u->stack.p;
+		ss_bufinit(&n->buf);
+		u->max++;
+	}
+	uint32_t size = sf_size(r->scheme, pointer);
+	rc = ss_bufensure(&n->buf, r->a, size);
+	if (ssunlikely(rc == -1))
+		return -1;
+	memcpy(n->buf.p, pointer, size);
+	ss_bufadvance(&n->buf, size);
+	ss_bufadvance(&u->stack, sizeof(svupsertnode));
+	u->count++;
+	return 0;
 }
 
-static inline char*
-sr_statusof(srstatus *s)
+static inline svupsertnode*
+sv_upsertpop(svupsert *u)
 {
-	int status = sr_status(s);
-	switch (status) {
-	case SR_OFFLINE:     return "offline";
-	case SR_ONLINE:      return "online";
-	case SR_RECOVER:     return "recover";
-	case SR_SHUTDOWN:    return "shutdown";
-	case SR_MALFUNCTION: return "malfunction";
-	}
-	assert(0);
-	return NULL;
+	if (u->count == 0)
+		return NULL;
+	int pos = u->count - 1;
+	u->count--;
+	u->stack.p -= sizeof(svupsertnode);
+	return ss_bufat(&u->stack, sizeof(svupsertnode), pos);
 }
 
 static inline int
-sr_statusactive_is(int status)
+sv_upsertdo(svupsert *u, sr *r, svupsertnode *a, svupsertnode *b)
 {
-	switch (status) {
-	case SR_ONLINE:
-	case SR_RECOVER:
-		return 1;
-	case SR_SHUTDOWN:
-	case SR_OFFLINE:
-	case SR_MALFUNCTION:
-		return 0;
+	assert(r->scheme->fields_count <= 16);
+
+	uint32_t  src_size[16];
+	char     *src[16];
+	void     *src_ptr;
+	uint32_t *src_size_ptr;
+
+	uint32_t  upsert_size[16];
+	char     *upsert[16];
+	uint32_t  result_size[16];
+	char     *result[16];
+
+	int i = 0;
+	if (sslikely(a && !(sf_flags(r->scheme, a->buf.s) & SVDELETE) ))
+	{
+		src_ptr = src;
+		src_size_ptr = src_size;
+		for (; i < r->scheme->fields_count; i++) {
+			src[i]    = sf_field(r->scheme, i, a->buf.s, &src_size[i]);
+			upsert[i] = sf_field(r->scheme, i, b->buf.s, &upsert_size[i]);
+			result[i] = src[i];
+			result_size[i] = src_size[i];
+		}
+	} else {
+		src_ptr = NULL;
+		src_size_ptr = NULL;
+		for (; i < r->scheme->fields_count; i++) {
+			upsert[i] = sf_field(r->scheme, i, b->buf.s, &upsert_size[i]);
+			result[i] = upsert[i];
+			result_size[i] = upsert_size[i];
+		}
+	}
+
+	/* execute */
+	int rc;
+	rc = r->upsert->function(r->scheme->fields_count,
+	                         src_ptr,
+	                         src_size_ptr,
+	                         upsert,
+	                         upsert_size,
+	                         result,
+	                         result_size,
+	                         r->upsert->arg);
+	if (ssunlikely(rc == -1))
+		return -1;
+
+	/* validate and create new record */
+	sfv v[16];
+	i = 0;
+	for ( ; i < r->scheme->fields_count; i++) {
+		v[i].pointer = result[i];
+		v[i].size = result_size[i];
+	}
+	uint32_t size = sf_writesize(r->scheme, v);
+	ss_bufreset(&u->tmp);
+	rc = ss_bufensure(&u->tmp, r->a, size);
+	if (ssunlikely(rc == -1))
+		goto cleanup;
+	sf_write(r->scheme, v, u->tmp.s);
+	ss_bufadvance(&u->tmp, size);
+	/* update meta-fields */
+	sf_flagsset(r->scheme, u->tmp.s,
+	            sf_flags(r->scheme, b->buf.s) & ~SVUPSERT);
+	sf_lsnset(r->scheme, u->tmp.s, sf_lsn(r->scheme, b->buf.s));
+
+	/* save result */
+	rc = sv_upsertpush(u, r, u->tmp.s);
+cleanup:
+	/* free fields */
+	i = 0;
+	for ( ; i < r->scheme->fields_count; i++) {
+		if (src_ptr == NULL) {
+			if (v[i].pointer != upsert[i])
+				free(v[i].pointer);
+		} else {
+			if (v[i].pointer != src[i])
+				free(v[i].pointer);
+		}
 	}
-	assert(0);
-	return 0;
-}
-
-static inline int
-sr_statusactive(srstatus *s) {
-	return sr_statusactive_is(sr_status(s));
+	return rc;
 }
 
 static inline int
-sr_online(srstatus *s) {
-	return sr_status(s) == SR_ONLINE;
+sv_upsert(svupsert *u, sr *r)
+{
+	assert(u->count >= 1 );
+	svupsertnode *f = ss_bufat(&u->stack, sizeof(svupsertnode), u->count - 1);
+	int rc;
+	if (sf_flags(r->scheme, f->buf.s) & SVUPSERT) {
+		f = sv_upsertpop(u);
+		rc = sv_upsertdo(u, r, NULL, f);
+		if (ssunlikely(rc == -1))
+			return -1;
+	}
+	if (u->count == 1)
+		goto done;
+	while (u->count > 1) {
+		svupsertnode *f = sv_upsertpop(u);
+		svupsertnode *s = sv_upsertpop(u);
+		assert(f != NULL);
+		assert(s != NULL);
+		rc = sv_upsertdo(u, r, f, s);
+		if (ssunlikely(rc == -1))
+			return -1;
+	}
+done:
+	f = ss_bufat(&u->stack, sizeof(svupsertnode), 0);
+	u->result = f->buf.s;
+	return 0;
 }
 
 #endif
-#line 1 "sophia/runtime/sr_stat.h"
-#ifndef SR_STAT_H_
-#define SR_STAT_H_
+#line 1 "sophia/version/sv_log.h"
+#ifndef SV_LOG_H_
+#define SV_LOG_H_
 
 /*
  * sophia database
@@ -14733,197 +18935,230 @@ sr_online(srstatus *s) {
  * BSD License
 */
 
-typedef struct srstatxm srstatxm;
-typedef struct srstat srstat;
+typedef struct svlogindex svlogindex;
+typedef struct svlogv svlogv;
+typedef struct svlog svlog;
 
-struct srstatxm {
-	/* transaction */
-	uint64_t tx;
-	uint64_t tx_rlb;
-	uint64_t tx_conflict;
-	uint64_t tx_lock;
-	ssavg    tx_latency;
-	ssavg    tx_stmts;
-};
+struct svlogindex {
+	uint32_t head, tail;
+	uint32_t count;
+	sr *r;
+} sspacked;
 
-struct srstat {
-	ssspinlock lock;
-	/* memory */
-	uint64_t v_count;
-	uint64_t v_allocated;
-	/* field */
-	ssavg    field;
-	/* set */
-	uint64_t set;
-	ssavg    set_latency;
-	/* delete */
-	uint64_t del;
-	ssavg    del_latency;
-	/* upsert */
-	uint64_t upsert;
-	ssavg    upsert_latency;
-	/* get */
-	uint64_t get;
-	ssavg    get_read_disk;
-	ssavg    get_read_cache;
-	ssavg    get_latency;
-	/* pread */
-	uint64_t pread;
-	ssavg    pread_latency;
-	/* cursor */
-	uint64_t cursor;
-	ssavg    cursor_latency;
-	ssavg    cursor_read_disk;
-	ssavg    cursor_read_cache;
-	ssavg    cursor_ops;
+struct svlogv {
+	uint32_t index_id;
+	uint32_t next;
+	svv     *v;
+	void    *ptr;
+} sspacked;
+
+struct svlog {
+	int    count_write;
+	svlogv reserve_buf[1];
+	svlogv reserve_index[4];
+	ssbuf  index;
+	ssbuf  buf;
 };
 
 static inline void
-sr_statxm_init(srstatxm *s)
+sv_logvinit(svlogv *v, uint32_t id)
 {
-	memset(s, 0, sizeof(*s));
+	v->index_id = id;
+	v->next     = UINT32_MAX;
+	v->v        = NULL;
+	v->ptr      = NULL;
 }
 
-static inline void
-sr_statxm_prepare(srstatxm *s)
+static inline int
+sv_loginit(svlog *l, sr *r, int index_max)
 {
-	ss_avgprepare(&s->tx_latency);
-	ss_avgprepare(&s->tx_stmts);
+	l->count_write = 0;
+	ss_bufinit_reserve(&l->index, l->reserve_index, sizeof(l->reserve_index));
+	ss_bufinit_reserve(&l->buf, l->reserve_buf, sizeof(l->reserve_buf));
+	if (index_max == 0)
+		return 0;
+	int size = sizeof(svlogindex) * index_max;
+	int rc = ss_bufensure(&l->index, r->a, size);
+	if (ssunlikely(rc == -1))
+		return -1;
+	ss_bufadvance(&l->index, size);
+	int i = 0;
+	while (i < index_max) {
+		svlogindex *index =
+			ss_bufat(&l->index, sizeof(svlogindex), i);
+		index->head = UINT32_MAX;
+		index->tail = 0;
+		index->count = 0;
+		index->r = NULL;
+		i++;
+	}
+	return 0;
 }
 
 static inline void
-sr_statxm(srstatxm *s, uint64_t start, uint32_t count,
-          int rlb, int conflict)
+sv_loginit_index(svlog *l, int pos, sr *r)
 {
-	uint64_t diff = ss_utime() - start;
-	s->tx++;
-	s->tx_rlb += rlb;
-	s->tx_conflict += conflict;
-	ss_avgupdate(&s->tx_stmts, count);
-	ss_avgupdate(&s->tx_latency, diff);
+	svlogindex *index =
+		ss_bufat(&l->index, sizeof(svlogindex), pos);
+	index->r = r;
 }
 
 static inline void
-sr_statxm_lock(srstatxm *s)
+sv_logfree(svlog *l, sr *r)
 {
-	s->tx_lock++;
+	ss_buffree(&l->index, r->a);
+	ss_buffree(&l->buf, r->a);
+	l->count_write = 0;
 }
 
 static inline void
-sr_statinit(srstat *s)
+sv_logreset(svlog *l, int index_max)
 {
-	memset(s, 0, sizeof(*s));
-	ss_spinlockinit(&s->lock);
+	int i = 0;
+	while (i < index_max) {
+		svlogindex *index =
+			ss_bufat(&l->index, sizeof(svlogindex), i);
+		index->head  = UINT32_MAX;
+		index->tail  = 0;
+		index->count = 0;
+		i++;
+	}
+	ss_bufreset(&l->buf);
+	l->count_write = 0;
 }
 
-static inline void
-sr_statfree(srstat *s) {
-	ss_spinlockfree(&s->lock);
+static inline int
+sv_logcount(svlog *l) {
+	return ss_bufused(&l->buf) / sizeof(svlogv);
 }
 
-static inline void
-sr_statprepare(srstat *s)
+static inline int
+sv_logcount_write(svlog *l) {
+	return l->count_write;
+}
+
+static inline svlogv*
+sv_logat(svlog *l, int pos) {
+	return ss_bufat(&l->buf, sizeof(svlogv), pos);
+}
+
+static inline svlogindex*
+sv_logindex(svlog *l, int id) {
+	return ss_bufat(&l->index, sizeof(svlogindex), id);
+}
+
+static inline int
+sv_logadd(svlog *l, sr *r, svlogv *v)
 {
-	ss_avgprepare(&s->field);
-	ss_avgprepare(&s->set_latency);
-	ss_avgprepare(&s->del_latency);
-	ss_avgprepare(&s->upsert_latency);
-	ss_avgprepare(&s->get_read_disk);
-	ss_avgprepare(&s->get_read_cache);
-	ss_avgprepare(&s->get_latency);
-	ss_avgprepare(&s->pread_latency);
-	ss_avgprepare(&s->cursor_latency);
-	ss_avgprepare(&s->cursor_read_disk);
-	ss_avgprepare(&s->cursor_read_cache);
-	ss_avgprepare(&s->cursor_ops);
+	uint32_t n = sv_logcount(l);
+	int rc = ss_bufadd(&l->buf, r->a, v, sizeof(svlogv));
+	if (ssunlikely(rc == -1))
+		return -1;
+	svlogindex *index =
+		ss_bufat(&l->index, sizeof(svlogindex), v->index_id);
+	if (index->head == UINT32_MAX) {
+		index->head = n;
+	} else {
+		svlogv *tail = sv_logat(l, index->tail);
+		tail->next = n;
+	}
+	index->tail = n;
+	index->count++;
+	if (! (sv_vflags(v->v, r) & SVGET))
+		l->count_write++;
+	return 0;
 }
 
 static inline void
-sr_statfield(srstat *s, int size)
+sv_logreplace(svlog *l, sr *r, int n, svlogv *v)
 {
-	ss_spinlock(&s->lock);
-	ss_avgupdate(&s->field, size);
-	ss_spinunlock(&s->lock);
+	svlogv *ov = sv_logat(l, n);
+	if (! (sv_vflags(ov->v, r) & SVGET))
+		l->count_write--;
+	if (! (sv_vflags(v->v, r) & SVGET))
+		l->count_write++;
+	ss_bufset(&l->buf, sizeof(svlogv), n, (char*)v,
+	          sizeof(svlogv));
 }
 
-static inline void
-sr_statset(srstat *s, uint64_t start)
-{
-	uint64_t diff = ss_utime() - start;
-	ss_spinlock(&s->lock);
-	s->set++;
-	ss_avgupdate(&s->set_latency, diff);
-	ss_spinunlock(&s->lock);
-}
+#endif
+#line 1 "sophia/version/sv_merge.h"
+#ifndef SV_MERGE_H_
+#define SV_MERGE_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct svmergesrc svmergesrc;
+typedef struct svmerge svmerge;
+
+struct svmergesrc {
+	ssiter *i, src;
+	uint8_t dup;
+	void *ptr;
+} sspacked;
+
+struct svmerge {
+	svmergesrc reserve[16];
+	ssbuf buf;
+};
 
 static inline void
-sr_statdelete(srstat *s, uint64_t start)
+sv_mergeinit(svmerge *m)
 {
-	uint64_t diff = ss_utime() - start;
-	ss_spinlock(&s->lock);
-	s->del++;
-	ss_avgupdate(&s->del_latency, diff);
-	ss_spinunlock(&s->lock);
+	ss_bufinit_reserve(&m->buf, m->reserve, sizeof(m->reserve));
 }
 
-static inline void
-sr_statupsert(srstat *s, uint64_t start)
+static inline int
+sv_mergeprepare(svmerge *m, sr *r, int count)
 {
-	uint64_t diff = ss_utime() - start;
-	ss_spinlock(&s->lock);
-	s->upsert++;
-	ss_avgupdate(&s->upsert_latency, diff);
-	ss_spinunlock(&s->lock);
+	int rc = ss_bufensure(&m->buf, r->a, sizeof(svmergesrc) * count);
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+	return 0;
 }
 
-static inline void
-sr_statget(srstat *s, uint64_t diff, int read_disk, int read_cache)
+static inline svmergesrc*
+sv_mergenextof(svmergesrc *src)
 {
-	ss_spinlock(&s->lock);
-	s->get++;
-	ss_avgupdate(&s->get_read_disk, read_disk);
-	ss_avgupdate(&s->get_read_cache, read_cache);
-	ss_avgupdate(&s->get_latency, diff);
-	ss_spinunlock(&s->lock);
+	return (svmergesrc*)((char*)src + sizeof(svmergesrc));
 }
 
 static inline void
-sr_statpread(srstat *s, uint64_t start, int from_compaction)
+sv_mergefree(svmerge *m, ssa *a)
 {
-	if (from_compaction)
-		return;
-	uint64_t diff = ss_utime() - start;
-	ss_spinlock(&s->lock);
-	s->pread++;
-	ss_avgupdate(&s->pread_latency, diff);
-	ss_spinunlock(&s->lock);
+	ss_buffree(&m->buf, a);
 }
 
 static inline void
-sr_statcursor(srstat *s, uint64_t start, int read_disk, int read_cache, int ops)
+sv_mergereset(svmerge *m)
 {
-	uint64_t diff = ss_utime() - start;
-	ss_spinlock(&s->lock);
-	s->cursor++;
-	ss_avgupdate(&s->cursor_read_disk, read_disk);
-	ss_avgupdate(&s->cursor_read_cache, read_cache);
-	ss_avgupdate(&s->cursor_latency, diff);
-	ss_avgupdate(&s->cursor_ops, ops);
-	ss_spinunlock(&s->lock);
+	m->buf.p = m->buf.s;
 }
 
-static inline void
-sr_statcopy(srstat *s, srstat *dest)
+static inline svmergesrc*
+sv_mergeadd(svmerge *m, ssiter *i)
 {
-	ss_spinlock(&s->lock);
-	*dest = *s;
-	ss_spinunlock(&s->lock);
+	assert(m->buf.p < m->buf.e);
+	svmergesrc *s = (svmergesrc*)m->buf.p;
+	s->dup = 0;
+	s->i = i;
+	s->ptr = NULL;
+	if (i == NULL)
+		s->i = &s->src;
+	ss_bufadvance(&m->buf, sizeof(svmergesrc));
+	return s;
 }
 
 #endif
-#line 1 "sophia/runtime/sr_seq.h"
-#ifndef SR_SEQ_H_
-#define SR_SEQ_H_
+#line 1 "sophia/version/sv_mergeiter.h"
+#ifndef SV_MERGEITER_H_
+#define SV_MERGEITER_H_
 
 /*
  * sophia database
@@ -14933,98 +19168,190 @@ sr_statcopy(srstat *s, srstat *dest)
  * BSD License
 */
 
-typedef enum {
-	SR_DSN,
-	SR_DSNNEXT,
-	SR_NSN,
-	SR_NSNNEXT,
-	SR_BSN,
-	SR_BSNNEXT,
-	SR_LSN,
-	SR_LSNNEXT,
-	SR_LFSN,
-	SR_LFSNNEXT,
-	SR_TSN,
-	SR_TSNNEXT
-} srseqop;
+/*
+ * Merge serveral sorted streams into one.
+ * Track duplicates.
+ *
+ * Merger does not recognize duplicates from
+ * a single stream, assumed that they are tracked
+ * by the incoming data sources.
+*/
 
-typedef struct {
-	ssspinlock lock;
-	uint32_t   dsn;
-	uint64_t   nsn;
-	uint32_t   bsn;
-	uint64_t   lsn;
-	uint64_t   lfsn;
-	uint64_t   tsn;
-} srseq;
+typedef struct svmergeiter svmergeiter;
+
+struct svmergeiter {
+	ssorder order;
+	svmerge *merge;
+	svmergesrc *src, *end;
+	svmergesrc *v;
+	sr *r;
+} sspacked;
 
 static inline void
-sr_seqinit(srseq *n) {
-	memset(n, 0, sizeof(*n));
-	ss_spinlockinit(&n->lock);
+sv_mergeiter_dupreset(svmergeiter *i, svmergesrc *pos)
+{
+	svmergesrc *v = i->src;
+	while (v != pos) {
+		v->dup = 0;
+		v = sv_mergenextof(v);
+	}
 }
 
 static inline void
-sr_seqfree(srseq *n) {
-	ss_spinlockfree(&n->lock);
+sv_mergeiter_gt(svmergeiter *i)
+{
+	if (i->v) {
+		i->v->dup = 0;
+		ss_iteratornext(i->v->i);
+	}
+	i->v = NULL;
+	svmergesrc *min, *src;
+	char *minv;
+	minv = NULL;
+	min  = NULL;
+	src  = i->src;
+	for (; src < i->end; src = sv_mergenextof(src))
+	{
+		char *v = ss_iteratorof(src->i);
+		if (v == NULL)
+			continue;
+		if (min == NULL) {
+			minv = v;
+			min = src;
+			continue;
+		}
+		int rc;
+		rc = sf_compare(i->r->scheme, minv, v);
+		switch (rc) {
+		case 0:
+			/*
+			assert( lsn(v) < lsn(minv) );
+			*/
+			src->dup = 1;
+			break;
+		case 1:
+			sv_mergeiter_dupreset(i, src);
+			minv = v;
+			min = src;
+			break;
+		}
+	}
+	if (ssunlikely(min == NULL))
+		return;
+	i->v = min;
+}
+
+static inline void
+sv_mergeiter_lt(svmergeiter *i)
+{
+	if (i->v) {
+		i->v->dup = 0;
+		ss_iteratornext(i->v->i);
+	}
+	i->v = NULL;
+	svmergesrc *max, *src;
+	char *maxv;
+	maxv = NULL;
+	max  = NULL;
+	src  = i->src;
+	for (; src < i->end; src = sv_mergenextof(src))
+	{
+		char *v = ss_iteratorof(src->i);
+		if (v == NULL)
+			continue;
+		if (max == NULL) {
+			maxv = v;
+			max = src;
+			continue;
+		}
+		int rc;
+		rc = sf_compare(i->r->scheme, maxv, v);
+		switch (rc) {
+		case  0:
+			/*
+			assert(sv_lsn(v) < sv_lsn(maxv));
+			*/
+			src->dup = 1;
+			break;
+		case -1:
+			sv_mergeiter_dupreset(i, src);
+			maxv = v;
+			max = src;
+			break;
+		}
+	}
+	if (ssunlikely(max == NULL))
+		return;
+	i->v = max;
+}
+
+static inline void
+sv_mergeiter_next(ssiter *it)
+{
+	svmergeiter *im = (svmergeiter*)it->priv;
+	switch (im->order) {
+	case SS_GT:
+	case SS_GTE:
+		sv_mergeiter_gt(im);
+		break;
+	case SS_LT:
+	case SS_LTE:
+		sv_mergeiter_lt(im);
+		break;
+	default: assert(0);
+	}
+}
+
+static inline int
+sv_mergeiter_open(ssiter *i, sr *r, svmerge *m, ssorder o)
+{
+	svmergeiter *im = (svmergeiter*)i->priv;
+	im->merge = m;
+	im->r     = r;
+	im->order = o;
+	im->src   = (svmergesrc*)(im->merge->buf.s);
+	im->end   = (svmergesrc*)(im->merge->buf.p);
+	im->v     = NULL;
+	sv_mergeiter_next(i);
+	return 0;
 }
 
 static inline void
-sr_seqlock(srseq *n) {
-	ss_spinlock(&n->lock);
-}
+sv_mergeiter_close(ssiter *i ssunused)
+{ }
 
-static inline void
-sr_sequnlock(srseq *n) {
-	ss_spinunlock(&n->lock);
+static inline int
+sv_mergeiter_has(ssiter *i)
+{
+	svmergeiter *im = (svmergeiter*)i->priv;
+	return im->v != NULL;
 }
 
-static inline uint64_t
-sr_seqdo(srseq *n, srseqop op)
+static inline void*
+sv_mergeiter_of(ssiter *i)
 {
-	uint64_t v = 0;
-	switch (op) {
-	case SR_LSN:       v = n->lsn;
-		break;
-	case SR_LSNNEXT:   v = ++n->lsn;
-		break;
-	case SR_TSN:       v = n->tsn;
-		break;
-	case SR_TSNNEXT:   v = ++n->tsn;
-		break;
-	case SR_NSN:       v = n->nsn;
-		break;
-	case SR_NSNNEXT:   v = ++n->nsn;
-		break;
-	case SR_LFSN:      v = n->lfsn;
-		break;
-	case SR_LFSNNEXT:  v = ++n->lfsn;
-		break;
-	case SR_BSN:       v = n->bsn;
-		break;
-	case SR_BSNNEXT:   v = ++n->bsn;
-		break;
-	case SR_DSN:       v = n->dsn;
-		break;
-	case SR_DSNNEXT:   v = ++n->dsn;
-		break;
-	}
-	return v;
+	svmergeiter *im = (svmergeiter*)i->priv;
+	if (ssunlikely(im->v == NULL))
+		return NULL;
+	return ss_iteratorof(im->v->i);
 }
 
-static inline uint64_t
-sr_seq(srseq *n, srseqop op)
+static inline uint32_t
+sv_mergeisdup(ssiter *i)
 {
-	sr_seqlock(n);
-	uint64_t v = sr_seqdo(n, op);
-	sr_sequnlock(n);
-	return v;
+	svmergeiter *im = (svmergeiter*)i->priv;
+	assert(im->v != NULL);
+	if (im->v->dup)
+		return SVDUP;
+	return 0;
 }
 
+extern ssiterif sv_mergeiter;
+
 #endif
-#line 1 "sophia/runtime/sr.h"
-#ifndef SR_H_
-#define SR_H_
+#line 1 "sophia/version/sv_range.h"
+#ifndef SV_RANGE_H_
+#define SV_RANGE_H_
 
 /*
  * sophia database
@@ -15034,59 +19361,73 @@ sr_seq(srseq *n, srseqop op)
  * BSD License
 */
 
-typedef struct sr sr;
+typedef struct svrange svrange;
+typedef struct svrangeset svrangeset;
 
-struct sr {
-	srstatus *status;
-	srlog *log;
-	srerror *e;
-	sfupsert *upsert;
-	sfscheme *scheme;
-	srseq *seq;
-	ssa *a;
-	ssa *av;
-	ssvfs *vfs;
-	ssinjection *i;
-	srstat *stat;
-	sscrcf crc;
-	void *ptr;
+/* range delete of keys start <= key < stop,
+ * hiding versions older than lsn */
+struct svrange {
+	svv      *start;
+	svv      *stop;
+	uint64_t  lsn;
 };
 
-static inline void
-sr_init(sr *r,
-        srstatus *status,
-        srlog *log,
-        srerror *e,
-        ssa *a,
-        ssa *av,
-        ssvfs *vfs,
-        srseq *seq,
-        sfupsert *upsert,
-        sfscheme *scheme,
-        ssinjection *i,
-        srstat *stat,
-        sscrcf crc,
-        void *ptr)
+/* immutable set of range deletes, shared by
+ * readers and compaction */
+struct svrangeset {
+	uint32_t refs;
+	uint32_t count;
+	svrange  r[];
+};
+
+static inline int
+sv_rangehas(svrange *range, sr *r, char *key)
 {
-	r->status = status;
-	r->log    = log;
-	r->e      = e;
-	r->a      = a;
-	r->av     = av;
-	r->vfs    = vfs;
-	r->seq    = seq;
-	r->scheme = scheme;
-	r->upsert = upsert;
-	r->i      = i;
-	r->stat   = stat;
-	r->crc    = crc;
-	r->ptr    = ptr;
+	if (sf_compare(r->scheme, key, sv_vpointer(range->start)) < 0)
+		return 0;
+	return sf_compare(r->scheme, key, sv_vpointer(range->stop)) < 0;
+}
+
+static inline uint64_t
+sv_rangecover(svrangeset *s, sr *r, char *key, uint64_t vlsn)
+{
+	/* lsn of the latest range delete visible at vlsn
+	 * which covers the key, versions of the key
+	 * older than it are deleted */
+	uint64_t lsn = 0;
+	if (sslikely(s == NULL))
+		return 0;
+	uint32_t i = 0;
+	for (; i < s->count; i++) {
+		svrange *range = &s->r[i];
+		if (range->lsn > vlsn || range->lsn <= lsn)
+			continue;
+		if (sv_rangehas(range, r, key))
+			lsn = range->lsn;
+	}
+	return lsn;
+}
+
+static inline uint64_t
+sv_rangeapplied(svrangeset *s, uint64_t vlsn)
+{
+	/* latest range delete which is applied by a
+	 * compaction running with vlsn */
+	uint64_t lsn = 0;
+	if (s == NULL)
+		return 0;
+	uint32_t i = 0;
+	for (; i < s->count; i++) {
+		if (s->r[i].lsn <= vlsn && s->r[i].lsn > lsn)
+			lsn = s->r[i].lsn;
+	}
+	return lsn;
 }
 
 #endif
-#line 1 "sophia/runtime/sr_conf.h"
-#ifndef SR_CONF_H_
-#define SR_CONF_H_
+#line 1 "sophia/version/sv_readiter.h"
+#ifndef SV_READITER_H_
+#define SV_READITER_H_
 
 /*
  * sophia database
@@ -15096,106 +19437,176 @@ sr_init(sr *r,
  * BSD License
 */
 
-typedef struct srconf srconf;
-typedef struct srconfdump srconfdump;
-typedef struct srconfstmt srconfstmt;
-
-typedef int (*srconff)(srconf*, srconfstmt*);
-
-typedef enum {
-	SR_WRITE,
-	SR_READ,
-	SR_SERIALIZE
-} srconfop;
-
-enum {
-	SR_RO = 1,
-	SR_NS = 2
-};
-
-struct srconf {
-	char    *key;
-	int      flags;
-	sstype   type;
-	srconff  function;
-	void    *value;
-	void    *ptr;
-	srconf  *next;
-};
+typedef struct svreaditer svreaditer;
 
-struct srconfdump {
-	uint8_t  type;
-	uint16_t keysize;
-	uint32_t valuesize;
+struct svreaditer {
+	ssiter   *merge;
+	uint64_t  vlsn;
+	int       next;
+	int       nextdup;
+	int       save_delete;
+	svrangeset *ranges;
+	uint64_t  cover;
+	svupsert *u;
+	sr       *r;
+	char     *v;
 } sspacked;
 
-struct srconfstmt {
-	srconfop    op;
-	const char *path;
-	void       *value;
-	sstype      valuetype;
-	int         valuesize;
-	srconf     *match;
-	ssbuf      *serialize;
-	void       *ptr;
-	sr         *r;
-};
+static inline int
+sv_readiter_upsert(svreaditer *i)
+{
+	sv_upsertreset(i->u);
+	/* upsert begin */
+	char *v = ss_iterof(sv_mergeiter, i->merge);
+	assert(v != NULL);
+	assert(sf_flags(i->r->scheme, v) & SVUPSERT);
+	int rc = sv_upsertpush(i->u, i->r, v);
+	if (ssunlikely(rc == -1))
+		return -1;
+	ss_iternext(sv_mergeiter, i->merge);
+	/* iterate over upsert statements */
+	int skip = 0;
+	for (; ss_iterhas(sv_mergeiter, i->merge); ss_iternext(sv_mergeiter, i->merge))
+	{
+		v = ss_iterof(sv_mergeiter, i->merge);
+		int dup = sf_is(i->r->scheme, v, SVDUP) || sv_mergeisdup(i->merge);
+		if (! dup)
+			break;
+		if (skip)
+			continue;
+		/* versions hidden by a range delete */
+		if (sf_lsn(i->r->scheme, v) < i->cover) {
+			skip = 1;
+			continue;
+		}
+		int rc = sv_upsertpush(i->u, i->r, v);
+		if (ssunlikely(rc == -1))
+			return -1;
+		if (! (sf_flags(i->r->scheme, v) & SVUPSERT))
+			skip = 1;
+	}
+	/* upsert */
+	rc = sv_upsert(i->u, i->r);
+	if (ssunlikely(rc == -1))
+		return -1;
+	return 0;
+}
 
-int sr_confexec(srconf*, srconfstmt*);
-int sr_conf_read(srconf*, srconfstmt*);
-int sr_conf_write(srconf*, srconfstmt*);
-int sr_conf_serialize(srconf*, srconfstmt*);
+static inline void
+sv_readiter_next(ssiter *i)
+{
+	svreaditer *im = (svreaditer*)i->priv;
+	if (im->next)
+		ss_iternext(sv_mergeiter, im->merge);
+	im->next = 0;
+	im->v = NULL;
+	for (; ss_iterhas(sv_mergeiter, im->merge); ss_iternext(sv_mergeiter, im->merge))
+	{
+		char *v = ss_iterof(sv_mergeiter, im->merge);
+		int dup = sf_is(im->r->scheme, v, SVDUP) || sv_mergeisdup(im->merge);
+		if (im->nextdup) {
+			if (dup)
+				continue;
+			im->nextdup = 0;
+		}
+		/* skip version out of visible range */
+		uint64_t lsn = sf_lsn(im->r->scheme, v);
+		if (lsn > im->vlsn) {
+			continue;
+		}
+		im->nextdup = 1;
+		if (ssunlikely(!im->save_delete && sf_is(im->r->scheme, v, SVDELETE)))
+			continue;
+		/* key deleted by a range delete, the caller
+		 * checks it when deletes are saved */
+		im->cover = 0;
+		if (ssunlikely(im->ranges)) {
+			im->cover = sv_rangecover(im->ranges, im->r, v, im->vlsn);
+			if (!im->save_delete && lsn < im->cover)
+				continue;
+		}
+		if (ssunlikely(sf_is(im->r->scheme, v, SVUPSERT))) {
+			int rc = sv_readiter_upsert(im);
+			if (ssunlikely(rc == -1))
+				return;
+			im->v = im->u->result;
+			im->next = 0;
+		} else {
+			im->v = v;
+			im->next = 1;
+		}
+		break;
+	}
+}
 
-static inline srconf*
-sr_c(srconf **link, srconf **cp, srconff func,
-     char *key, int type,
-     void *value)
+static inline void
+sv_readiter_forward(ssiter *i)
 {
-	srconf *c = *cp;
-	c->key      = key;
-	c->function = func;
-	c->flags    = 0;
-	c->type     = type;
-	c->value    = value;
-	c->ptr      = NULL;
-	c->next     = NULL;
-	*cp = c + 1;
-	if (sslikely(link)) {
-		if (sslikely(*link))
-			(*link)->next = c;
-		*link = c;
+	svreaditer *im = (svreaditer*)i->priv;
+	if (im->next)
+		ss_iternext(sv_mergeiter, im->merge);
+	im->next = 0;
+	im->v = NULL;
+	for (; ss_iterhas(sv_mergeiter, im->merge); ss_iternext(sv_mergeiter, im->merge))
+	{
+		char *v = ss_iterof(sv_mergeiter, im->merge);
+		int dup = sf_is(im->r->scheme, v, SVDUP) || sv_mergeisdup(im->merge);
+		if (dup)
+			continue;
+		im->next = 0;
+		im->v = v;
+		break;
 	}
-	return c;
 }
 
-static inline srconf*
-sr_C(srconf **link, srconf **cp, srconff func,
-     char *key, int type,
-     void *value, int flags, void *ptr)
+static inline int
+sv_readiter_open(ssiter *i, sr *r, ssiter *iterator, svupsert *u,
+                 svrangeset *ranges,
+                 uint64_t vlsn, int save_delete)
 {
-	srconf *c = sr_c(link, cp, func, key, type, value);
-	c->flags = flags;
-	c->ptr = ptr;
-	return c;
+	svreaditer *im  = (svreaditer*)i->priv;
+	im->r           = r;
+	im->u           = u;
+	im->ranges      = ranges;
+	im->cover       = 0;
+	im->vlsn        = vlsn;
+	im->v           = NULL;
+	im->next        = 0;
+	im->nextdup     = 0;
+	im->save_delete = save_delete;
+	im->merge       = iterator;
+	assert(im->merge->vif == &sv_mergeiter);
+	/* iteration can start from duplicate */
+	sv_readiter_next(i);
+	return 0;
 }
 
-static inline char*
-sr_confkey(srconfdump *v) {
-	return (char*)v + sizeof(srconfdump);
-}
+static inline void
+sv_readiter_close(ssiter *i ssunused)
+{ }
 
-static inline char*
-sr_confvalue(srconfdump *v) {
-	return sr_confkey(v) + v->keysize;
+static inline int
+sv_readiter_has(ssiter *i)
+{
+	svreaditer *im = (svreaditer*)i->priv;
+	return im->v != NULL;
 }
 
 static inline void*
-sr_confnext(srconfdump *v) {
-	return sr_confvalue(v) + v->valuesize;
+sv_readiter_of(ssiter *i)
+{
+	svreaditer *im = (svreaditer*)i->priv;
+	if (ssunlikely(im->v == NULL))
+		return NULL;
+	return im->v;
 }
 
+extern ssiterif sv_readiter;
+
 #endif
-#line 1 "sophia/runtime/sr_conf.c"
+#line 1 "sophia/version/sv_writeiter.h"
+#ifndef SV_WRITEITER_H_
+#define SV_WRITEITER_H_
 
 /*
  * sophia database
@@ -15205,345 +19616,246 @@ sr_confnext(srconfdump *v) {
  * BSD License
 */
 
+typedef struct svwriteiter svwriteiter;
 
-
-
-
-int sr_conf_read(srconf *m, srconfstmt *s)
-{
-	switch (m->type) {
-	case SS_U32:
-		s->valuesize = sizeof(uint32_t);
-		if (s->valuetype == SS_I64) {
-			sscasti64(s->value) = sscastu32(m->value);
-		} else
-		if (s->valuetype == SS_U32) {
-			sscastu32(s->value) = sscastu32(m->value);
-		} else
-		if (s->valuetype == SS_U64) {
-			sscastu64(s->value) = sscastu32(m->value);
-		} else {
-			goto bad_type;
-		}
-		break;
-	case SS_U64:
-		s->valuesize = sizeof(uint64_t);
-		if (s->valuetype == SS_I64) {
-			sscasti64(s->value) = sscastu64(m->value);
-		} else
-		if (s->valuetype == SS_U32) {
-			sscastu32(s->value) = sscastu64(m->value);
-		} else
-		if (s->valuetype == SS_U64) {
-			sscastu64(s->value) = sscastu64(m->value);
-		} else {
-			goto bad_type;
-		}
-		break;
-	case SS_STRING: {
-		if (s->valuetype != SS_STRING)
-			goto bad_type;
-		char **result = s->value;
-		*result = NULL;
-		s->valuesize = 0;
-		char *string = m->value;
-		if (string == NULL)
-			break;
-		int size = strlen(string) + 1; 
-		s->valuesize = size;
-		*result = malloc(size);
-		if (ssunlikely(*result == NULL))
-			return sr_oom(s->r->e);
-		memcpy(*result, string, size);
-		break;
-	}
-	case SS_STRINGPTR: {
-		if (s->valuetype != SS_STRING)
-			goto bad_type;
-		char **result = s->value;
-		*result = NULL;
-		s->valuesize = 0;
-		char **string = m->value;
-		if (*string == NULL)
-			break;
-		int size = strlen(*string) + 1;
-		s->valuesize = size;
-		*result = malloc(size);
-		if (ssunlikely(*result == NULL))
-			return sr_oom(s->r->e);
-		memcpy(*result, *string, size);
-		break;
-	}
-	case SS_OBJECT:
-		if (s->valuetype != SS_STRING)
-			goto bad_type;
-		*(void**)s->value = m->value;
-		s->valuesize = sizeof(void*);
-		break;
-	default:
-		goto bad_type;
-	}
-
-	return 0;
-
-bad_type:
-	return sr_error(s->r->e, "configuration read bad type (%s) -> (%s) %s",
-	                ss_typeof(s->valuetype),
-	                ss_typeof(m->type), s->path);
-}
-
-int sr_conf_write(srconf *m, srconfstmt *s)
-{
-	if (m->flags & SR_RO) {
-		sr_error(s->r->e, "%s is read-only", s->path);
-		return -1;
-	}
-	switch (m->type) {
-	case SS_U32:
-		if (s->valuetype == SS_I64) {
-			sscastu32(m->value) = sscasti64(s->value);
-		} else
-		if (s->valuetype == SS_U32) {
-			sscastu32(m->value) = sscastu32(s->value);
-		} else
-		if (s->valuetype == SS_U64) {
-			sscastu32(m->value) = sscastu64(s->value);
-		} else {
-			goto bad_type;
-		}
-		break;
-	case SS_U64:
-		if (s->valuetype == SS_I64) {
-			sscastu64(m->value) = sscasti64(s->value);
-		} else
-		if (s->valuetype == SS_U32) {
-			sscastu64(m->value) = sscastu32(s->value);
-		} else
-		if (s->valuetype == SS_U64) {
-			sscastu64(m->value) = sscastu64(s->value);
-		} else {
-			goto bad_type;
-		}
-		break;
-	case SS_STRINGPTR: {
-		char **string = m->value;
-		if (s->valuetype == SS_STRING) {
-			int len = s->valuesize + 1;
-			char *sz;
-			sz = ss_malloc(s->r->a, len);
-			if (ssunlikely(sz == NULL))
-				return sr_oom(s->r->e);
-			memcpy(sz, s->value, s->valuesize);
-			sz[s->valuesize] = 0;
-			if (*string)
-				ss_free(s->r->a, *string);
-			*string = sz;
-		} else {
-			goto bad_type;
-		}
-		break;
-	}
-	default:
-		goto bad_type;
-	}
-	return 0;
-
-bad_type:
-	return sr_error(s->r->e, "configuration write bad type (%s) for (%s) %s",
-	                ss_typeof(s->valuetype),
-	                ss_typeof(m->type), s->path);
-}
+struct svwriteiter {
+	uint64_t  vlsn;
+	uint64_t  limit;
+	uint64_t  size;
+	uint32_t  sizev;
+	uint32_t  expire;
+	uint32_t  now;
+	int       next;
+	int       upsert;
+	uint64_t  prevlsn;
+	int       vdup;
+	char     *v;
+	svrangeset *ranges;
+	uint64_t  cover;
+	svupsert *u;
+	ssiter   *merge;
+	sr       *r;
+} sspacked;
 
 static inline int
-sr_conf_write_cast(sstype a, sstype b)
+sv_writeiter_upsert(svwriteiter *i)
 {
-	switch (a) {
-	case SS_U32:
-		if (b == SS_I64) {
-		} else
-		if (b == SS_U32) {
-		} else
-		if (b == SS_U64) {
-		} else {
-			return -1;
-		}
-		break;
-	case SS_U64:
-		if (b == SS_I64) {
-		} else
-		if (b == SS_U32) {
-		} else
-		if (b == SS_U64) {
-		} else {
-			return -1;
+	/* apply upsert only on statements which are the latest or
+	 * ready to be garbage-collected */
+	sv_upsertreset(i->u);
+
+	/* upsert begin */
+	char *v = ss_iterof(sv_mergeiter, i->merge);
+	assert(v != NULL);
+	assert(sf_flags(i->r->scheme, v) & SVUPSERT);
+	assert(sf_lsn(i->r->scheme, v) <= i->vlsn);
+	int rc = sv_upsertpush(i->u, i->r, v);
+	if (ssunlikely(rc == -1))
+		return -1;
+	ss_iternext(sv_mergeiter, i->merge);
+
+	/* iterate over upsert statements */
+	int last_non_upd = 0;
+	for (; ss_iterhas(sv_mergeiter, i->merge); ss_iternext(sv_mergeiter, i->merge))
+	{
+		v = ss_iterof(sv_mergeiter, i->merge);
+		int flags = sf_flags(i->r->scheme, v);
+		int dup = sf_flagsequ(flags, SVDUP) || sv_mergeisdup(i->merge);
+		if (! dup)
+			break;
+		/* stop forming upserts on a second non-upsert stmt,
+		 * but continue to iterate stream */
+		if (last_non_upd)
+			continue;
+		/* versions deleted by a range delete */
+		if (sf_lsn(i->r->scheme, v) < i->cover) {
+			last_non_upd = 1;
+			continue;
 		}
-		break;
-	case SS_STRING:
-	case SS_STRINGPTR:
-		if (b == SS_STRING) {
-		} else {
+		last_non_upd = ! sf_flagsequ(flags, SVUPSERT);
+		int rc = sv_upsertpush(i->u, i->r, v);
+		if (ssunlikely(rc == -1))
 			return -1;
-		}
-		break;
-	default:
-		return -1;
 	}
+
+	/* upsert */
+	rc = sv_upsert(i->u, i->r);
+	if (ssunlikely(rc == -1))
+		return -1;
 	return 0;
 }
 
-int sr_conf_serialize(srconf *m, srconfstmt *s)
+static inline void
+sv_writeiter_next(ssiter *i)
 {
-	char buf[128];
-	char name_function[] = "function";
-	char name_object[] = "object";
-	void *value = NULL;
-	srconfdump v = {
-		.type = m->type
-	};
-	switch (m->type) {
-	case SS_U32:
-		v.valuesize  = snprintf(buf, sizeof(buf), "%" PRIu32, sscastu32(m->value));
-		v.valuesize += 1;
-		value = buf;
-		break;
-	case SS_U64:
-		v.valuesize  = snprintf(buf, sizeof(buf), "%" PRIu64, sscastu64(m->value));
-		v.valuesize += 1;
-		value = buf;
-		break;
-	case SS_I64:
-		v.valuesize  = snprintf(buf, sizeof(buf), "%" PRIi64, sscasti64(m->value));
-		v.valuesize += 1;
-		value = buf;
-		break;
-	case SS_STRING: {
-		char *string = m->value;
-		if (string) {
-			v.valuesize = strlen(string) + 1;
-			value = string;
-		} else {
-			v.valuesize = 0;
+	svwriteiter *im = (svwriteiter*)i->priv;
+	if (im->next)
+		ss_iternext(sv_mergeiter, im->merge);
+	im->next = 0;
+	im->v = NULL;
+	im->vdup = 0;
+
+	for (; ss_iterhas(sv_mergeiter, im->merge); ss_iternext(sv_mergeiter, im->merge))
+	{
+		char *v = ss_iterof(sv_mergeiter, im->merge);
+		/* range delete logic: versions older than a range
+		 * delete visible to every reader are dropped */
+		if (ssunlikely(im->ranges)) {
+			if (! (sf_is(im->r->scheme, v, SVDUP) || sv_mergeisdup(im->merge)))
+				im->cover = sv_rangecover(im->ranges, im->r, v, im->vlsn);
+			if (sf_lsn(im->r->scheme, v) < im->cover)
+				continue;
 		}
-		break;
-	}
-	case SS_STRINGPTR: {
-		char **string = (char**)m->value;
-		if (*string) {
-			v.valuesize = strlen(*string) + 1;
-			value = *string;
+		/* expiration logic */
+		if (im->expire > 0) {
+			uint32_t timestamp = sf_ttl(im->r->scheme, v);
+			if ((im->now - timestamp) >= im->expire)
+				 continue;
+		}
+		uint64_t lsn = sf_lsn(im->r->scheme, v);
+		int flags = sf_flags(im->r->scheme, v);
+		int dup = sf_flagsequ(flags, SVDUP) || sv_mergeisdup(im->merge);
+		if (im->size >= im->limit) {
+			if (! dup)
+				break;
+		}
+
+		if (ssunlikely(dup)) {
+			/* keep atleast one visible version for <= vlsn */
+			if (im->prevlsn <= im->vlsn) {
+				if (im->upsert) {
+					im->upsert = sf_flagsequ(flags, SVUPSERT);
+				} else {
+					continue;
+				}
+			}
 		} else {
-			v.valuesize = 0;
+			im->upsert = 0;
+			/* delete (stray) */
+			int del = sf_flagsequ(flags, SVDELETE);
+			if (ssunlikely(del && (lsn <= im->vlsn))) {
+				im->prevlsn = lsn;
+				continue;
+			}
+			im->size += im->sizev + sf_size(im->r->scheme, v);
+			/* upsert (track first statement start) */
+			if (sf_flagsequ(flags, SVUPSERT))
+				im->upsert = 1;
 		}
-		v.type = SS_STRING;
-		break;
-	}
-	case SS_OBJECT:
-		v.type = SS_STRING;
-		v.valuesize = sizeof(name_object);
-		value = name_object;
-		break;
-	case SS_FUNCTION:
-		v.type = SS_STRING;
-		v.valuesize = sizeof(name_function);
-		value = name_function;
+
+		/* upsert */
+		if (sf_flagsequ(flags, SVUPSERT)) {
+			if (lsn <= im->vlsn) {
+				int rc;
+				rc = sv_writeiter_upsert(im);
+				if (ssunlikely(rc == -1))
+					return;
+				im->upsert = 0;
+				im->prevlsn = lsn;
+				im->v = im->u->result;
+				im->vdup = dup;
+				im->next = 0;
+				break;
+			}
+		}
+
+		im->prevlsn = lsn;
+		im->v = v;
+		im->vdup = dup;
+		im->next = 1;
 		break;
-	default:
-		return -1;
 	}
-	char name[128];
-	v.keysize  = snprintf(name, sizeof(name), "%s", s->path);
-	v.keysize += 1;
-	ssbuf *p = s->serialize;
-	int size = sizeof(v) + v.keysize + v.valuesize;
-	int rc = ss_bufensure(p, s->r->a, size);
-	if (ssunlikely(rc == -1))
-		return sr_oom(s->r->e);
-	memcpy(p->p, &v, sizeof(v));
-	memcpy(p->p + sizeof(v), name, v.keysize);
-	memcpy(p->p + sizeof(v) + v.keysize, value, v.valuesize);
-	ss_bufadvance(p, size);
+}
+
+static inline int
+sv_writeiter_open(ssiter *i, sr *r, ssiter *merge, svupsert *u,
+                  svrangeset *ranges,
+                  uint64_t limit,
+                  uint32_t sizev,
+                  uint32_t expire,
+                  uint32_t timestamp,
+                  uint64_t vlsn)
+{
+	svwriteiter *im = (svwriteiter*)i->priv;
+	im->u       = u;
+	im->ranges  = ranges;
+	im->cover   = 0;
+	im->r       = r;
+	im->limit   = limit;
+	im->size    = 0;
+	im->sizev   = sizev;
+	im->expire  = expire;
+	im->now     = timestamp;
+	im->vlsn    = vlsn;
+	im->next    = 0;
+	im->prevlsn = 0;
+	im->v       = NULL;
+	im->vdup    = 0;
+	im->upsert  = 0;
+	im->merge   = merge;
+	assert(im->merge->vif == &sv_mergeiter);
+	sv_writeiter_next(i);
 	return 0;
 }
 
+static inline void
+sv_writeiter_close(ssiter *i ssunused)
+{ }
+
+static inline int
+sv_writeiter_has(ssiter *i)
+{
+	svwriteiter *im = (svwriteiter*)i->priv;
+	return im->v != NULL;
+}
+
+static inline void*
+sv_writeiter_of(ssiter *i)
+{
+	svwriteiter *im = (svwriteiter*)i->priv;
+	if (ssunlikely(im->v == NULL))
+		return NULL;
+	return im->v;
+}
+
 static inline int
-sr_confexec_serialize(srconf *c, srconfstmt *stmt, char *root)
+sv_writeiter_resume(ssiter *i)
 {
-	char path[256];
-	while (c) {
-		if (root)
-			snprintf(path, sizeof(path), "%s.%s", root, c->key);
-		else
-			snprintf(path, sizeof(path), "%s", c->key);
-		int rc;
-		if (c->flags & SR_NS) {
-			rc = sr_confexec_serialize(c->value, stmt, path);
-			if (ssunlikely(rc == -1))
-				return -1;
-		} else {
-			stmt->path = path;
-			rc = c->function(c, stmt);
-			if (ssunlikely(rc == -1))
-				return -1;
-			stmt->path = NULL;
-		}
-		c = c->next;
-	}
-	return 0;
+	svwriteiter *im = (svwriteiter*)i->priv;
+	im->v       = ss_iterof(sv_mergeiter, im->merge);
+	if (ssunlikely(im->v == NULL))
+		return 0;
+	im->vdup    = sf_is(im->r->scheme, im->v, SVDUP) || sv_mergeisdup(im->merge);
+	im->prevlsn = sf_lsn(im->r->scheme, im->v);
+	im->next    = 1;
+	im->upsert  = 0;
+	im->size    = im->sizev + sf_size(im->r->scheme, im->v);
+	return 1;
 }
 
-int sr_confexec(srconf *start, srconfstmt *s)
+static inline void
+sv_writeiter_setsize(ssiter *i, uint64_t size)
 {
-	if (s->op == SR_SERIALIZE)
-		return sr_confexec_serialize(start, s, NULL);
-	char path[256];
-	snprintf(path, sizeof(path), "%s", s->path);
-	char *ptr = NULL;
-	char *token;
-	token = strtok_r(path, ".", &ptr);
-	if (ssunlikely(token == NULL))
-		return -1;
-	srconf *c = start;
-	while (c) {
-		if (strcmp(token, c->key) != 0) {
-			c = c->next;
-			continue;
-		}
-		if (c->flags & SR_NS) {
-			token = strtok_r(NULL, ".", &ptr);
-			if (ssunlikely(token == NULL))
-			{
-				if (s->op == SR_WRITE && c->type != SS_UNDEF) {
-					int rc = sr_conf_write_cast(c->type, s->valuetype);
-					if (ssunlikely(rc == -1))
-						goto bad_type;
-				}
-				s->match = c;
-				if (c->function)
-					return c->function(c, s);
-				/* not supported */
-				goto bad_path;
-			}
-			c = (srconf*)c->value;
-			continue;
-		}
-		s->match = c;
-		token = strtok_r(NULL, ".", &ptr);
-		if (ssunlikely(token != NULL))
-			goto bad_path;
-		return c->function(c, s);
-	}
-
-bad_path:
-	return sr_error(s->r->e, "bad configuration path: %s", s->path);
+	/* let the page builder account the page size
+	 * when it differs from the size of documents */
+	svwriteiter *im = (svwriteiter*)i->priv;
+	im->size = size;
+}
 
-bad_type:
-	return sr_error(s->r->e, "incompatible type (%s) for (%s) %s",
-	                ss_typeof(s->valuetype),
-	                ss_typeof(c->type), s->path);
+static inline int
+sv_writeiter_is_duplicate(ssiter *i)
+{
+	svwriteiter *im = (svwriteiter*)i->priv;
+	assert(im->v != NULL);
+	return im->vdup;
 }
-#line 1 "sophia/object/so.h"
-#ifndef SO_H_
-#define SO_H_
+
+extern ssiterif sv_writeiter;
+
+#endif
+#line 1 "sophia/version/sv_btree.h"
+#ifndef SV_BTREE_H_
+#define SV_BTREE_H_
 
 /*
  * sophia database
@@ -15553,106 +19865,123 @@ bad_type:
  * BSD License
 */
 
-typedef struct soif soif;
-typedef struct sotype sotype;
-typedef struct so so;
+typedef struct svbtreenode svbtreenode;
+typedef struct svbtreeleaf svbtreeleaf;
+typedef struct svbtreeinner svbtreeinner;
+typedef struct svbtreecur svbtreecur;
+typedef struct svbtreepos svbtreepos;
+typedef struct svbtree svbtree;
 
-struct soif {
-	int      (*open)(so*);
-	int      (*destroy)(so*);
-	void     (*free)(so*);
-	void    *(*document)(so*);
-	int      (*setstring)(so*, const char*, void*, int);
-	int      (*setint)(so*, const char*, int64_t);
-	void    *(*getobject)(so*, const char*);
-	void    *(*getstring)(so*, const char*, int*);
-	int64_t  (*getint)(so*, const char*);
-	int      (*set)(so*, so*);
-	int      (*upsert)(so*, so*);
-	int      (*del)(so*, so*);
-	void    *(*get)(so*, so*);
-	void    *(*begin)(so*);
-	int      (*prepare)(so*);
-	int      (*commit)(so*);
-	void    *(*cursor)(so*);
+typedef void (*svbtreef)(sr*, svv*);
+
+#define SV_BTREE_FANOUT 32
+#define SV_BTREE_DEPTH  12
+
+struct svbtreenode {
+	uint16_t count;
+	uint16_t leaf;
 };
 
-struct sotype {
-	uint32_t magic;
-	char *name;
+/* leaf slots hold version chain heads in key order */
+struct svbtreeleaf {
+	svbtreenode  h;
+	svbtreeleaf *prev;
+	svbtreeleaf *next;
+	uint64_t     prefix[SV_BTREE_FANOUT];
+	svv         *v[SV_BTREE_FANOUT];
 };
 
-struct so {
-	soif *i;
-	sotype *type;
-	so *parent;
-	so *env;
-	uint8_t destroyed;
-	sslist link;
+/* an inner slot refers to the leftmost leaf of its child,
+ * whose first key is the lower bound of the child */
+struct svbtreeinner {
+	svbtreenode  h;
+	uint64_t     prefix[SV_BTREE_FANOUT];
+	svbtreeleaf *min[SV_BTREE_FANOUT];
+	svbtreenode *child[SV_BTREE_FANOUT];
+};
+
+struct svbtreecur {
+	svbtreeleaf *leaf;
+	int          pos;
+};
+
+struct svbtreepos {
+	svbtreeinner *path[SV_BTREE_DEPTH];
+	int           slot[SV_BTREE_DEPTH];
+	int           depth;
+	svbtreecur    c;
+	int           eq;
+	uint64_t      prefix;
+};
+
+struct svbtree {
+	svbtreenode *root;
+	svbtreeleaf *first;
+	svbtreeleaf *last;
+	uint32_t     height;
 };
 
 static inline void
-so_init(so *o, sotype *type, soif *i, so *parent, so *env)
+sv_btreeinit(svbtree *t)
 {
-	o->type      = type;
-	o->i         = i;
-	o->parent    = parent;
-	o->env       = env;
-	o->destroyed = 0;
-	ss_listinit(&o->link);
+	t->root   = NULL;
+	t->first  = NULL;
+	t->last   = NULL;
+	t->height = 0;
 }
 
+void sv_btreefree(svbtree*, sr*, svbtreef);
+void sv_btreesearch(svbtree*, sr*, svbtreepos*, char*);
+int  sv_btreeinsert(svbtree*, sr*, svbtreepos*, svv*);
+
 static inline void
-so_mark_destroyed(so *o)
-{
-	o->destroyed = 1;
+sv_btreefirst(svbtree *t, svbtreecur *c) {
+	c->leaf = t->first;
+	c->pos  = 0;
 }
 
-static inline void*
-so_cast_dynamic(void *ptr, sotype *type,
-          const char *file,
-          const char *function, int line)
-{
-	int eq = ptr != NULL && ((so*)ptr)->type == type;
-	if (sslikely(eq))
-		return ptr;
-	fprintf(stderr, "%s:%d %s(%p) expected '%s' object\n",
-	        file, line, function, ptr, type->name);
-	abort();
-	return NULL;
+static inline void
+sv_btreelast(svbtree *t, svbtreecur *c) {
+	c->leaf = t->last;
+	c->pos  = (c->leaf) ? c->leaf->h.count - 1 : 0;
 }
 
-#define so_cast(o, cast, type) \
-	((cast)so_cast_dynamic(o, type, __FILE__, __func__, __LINE__))
+static inline svv*
+sv_btreeof(svbtreecur *c) {
+	if (c->leaf == NULL || c->pos >= c->leaf->h.count)
+		return NULL;
+	return c->leaf->v[c->pos];
+}
 
-#define so_open(o)      (o)->i->open(o)
-#define so_destroy(o)   (o)->i->destroy(o)
-#define so_free(o)      (o)->i->free(o)
-#define so_document(o)  (o)->i->document(o)
-#define so_set(o, v)    (o)->i->set(o, v)
-#define so_upsert(o, v) (o)->i->upsert(o, v)
-#define so_delete(o, v) (o)->i->del(o, v)
-#define so_get(o, v)    (o)->i->get(o, v)
-#define so_begin(o)     (o)->i->begin(o)
-#define so_prepare(o)   (o)->i->prepare(o)
-#define so_commit(o)    (o)->i->commit(o)
-#define so_cursor(o)    (o)->i->cursor(o)
+static inline void
+sv_btreenext(svbtreecur *c)
+{
+	if (ssunlikely(c->leaf == NULL))
+		return;
+	c->pos++;
+	if (c->pos < c->leaf->h.count)
+		return;
+	c->leaf = c->leaf->next;
+	c->pos  = 0;
+}
 
-#define so_setstring(o, path, pointer, size) \
-	(o)->i->setstring(o, path, pointer, size)
-#define so_setint(o, path, v) \
-	(o)->i->setint(o, path, v)
-#define so_getobject(o, path) \
-	(o)->i->getobject(o, path)
-#define so_getstring(o, path, sizep) \
-	(o)->i->getstring(o, path, sizep)
-#define so_getint(o, path) \
-	(o)->i->getnumber(o, path)
+static inline void
+sv_btreeprev(svbtreecur *c)
+{
+	if (ssunlikely(c->leaf == NULL))
+		return;
+	c->pos--;
+	if (c->pos >= 0)
+		return;
+	c->leaf = c->leaf->prev;
+	if (c->leaf)
+		c->pos = c->leaf->h.count - 1;
+}
 
 #endif
-#line 1 "sophia/object/so_list.h"
-#ifndef SO_LIST_H_
-#define SO_LIST_H_
+#line 1 "sophia/version/sv_index.h"
+#ifndef SC_INDEX_H_
+#define SC_INDEX_H_
 
 /*
  * sophia database
@@ -15662,74 +19991,49 @@ so_cast_dynamic(void *ptr, sotype *type,
  * BSD License
 */
 
-typedef struct solist solist;
-
-struct solist {
-	sslist list;
-	int n;
-};
-
-static inline void
-so_listinit(solist *i)
-{
-	ss_listinit(&i->list);
-	i->n = 0;
-}
+typedef struct svindexpos svindexpos;
+typedef struct svindex svindex;
 
-static inline int
-so_listdestroy(solist *i)
-{
-	int rcret = 0;
-	int rc;
-	sslist *p, *n;
-	ss_listforeach_safe(&i->list, p, n) {
-		so *o = sscast(p, so, link);
-		rc = so_destroy(o);
-		if (ssunlikely(rc == -1))
-			rcret = -1;
-	}
-	i->n = 0;
-	ss_listinit(&i->list);
-	return rcret;
-}
+#define SV_INDEXRB    0
+#define SV_INDEXBTREE 1
 
-static inline void
-so_listfree(solist *i)
-{
-	sslist *p, *n;
-	ss_listforeach_safe(&i->list, p, n) {
-		so *o = sscast(p, so, link);
-		so_free(o);
-	}
-	i->n = 0;
-	ss_listinit(&i->list);
-}
+struct svindexpos {
+	ssrbnode  *node;
+	int        rc;
+	svbtreepos t;
+};
 
-static inline void
-so_listadd(solist *i, so *o)
-{
-	ss_listappend(&i->list, &o->link);
-	i->n++;
-}
+struct svindex {
+	ssrb     i;
+	svbtree  t;
+	uint32_t count;
+	uint32_t used;
+	uint64_t lsnmin;
+	uint8_t  type;
+} sspacked;
 
-static inline void
-so_listdel(solist *i, so *o)
-{
-	ss_listunlink(&o->link);
-	i->n--;
-}
+ss_rbget(sv_indexmatch,
+         sf_compare(scheme, sv_vpointer(sscast(n, svv, node)), key))
 
-static inline so*
-so_listfirst(solist *i)
+int  sv_indexinit(svindex*, int);
+int  sv_indexreset(svindex*, sr*);
+int  sv_indexfree(svindex*, sr*);
+int  sv_indexgc(svindex*, sr*, svbtreef);
+int  sv_indexupdate(svindex*, sr*, svindexpos*, svv*);
+svv *sv_indexget(svindex*, sr*, svindexpos*, svv*);
+
+static inline int
+sv_indexset(svindex *i, sr *r, svv *v)
 {
-	assert(i->n > 0);
-	return sscast(i->list.next, so, link);
+	svindexpos pos;
+	sv_indexget(i, r, &pos, v);
+	return sv_indexupdate(i, r, &pos, v);
 }
 
 #endif
-#line 1 "sophia/object/so_pool.h"
-#ifndef SO_POOL_H_
-#define SO_POOL_H_
+#line 1 "sophia/version/sv_indexiter.h"
+#ifndef SV_INDEXITER_H_
+#define SV_INDEXITER_H_
 
 /*
  * sophia database
@@ -15739,81 +20043,195 @@ so_listfirst(solist *i)
  * BSD License
 */
 
-typedef struct sopool sopool;
+typedef struct svindexiter svindexiter;
 
-struct sopool {
-	ssspinlock lock;
-	int free_max;
-	solist list;
-	solist free;
-};
+struct svindexiter {
+	svindex   *index;
+	ssrbnode  *v;
+	svbtreecur c;
+	svv       *vcur;
+	ssorder    order;
+} sspacked;
 
-static inline void
-so_poolinit(sopool *p, int n)
+static inline int
+sv_indexiter_openbtree(svindexiter *ii, sr *r, char *key)
 {
-	ss_spinlockinit(&p->lock);
-	so_listinit(&p->list);
-	so_listinit(&p->free);
-	p->free_max = n;
+	svbtree *t = &ii->index->t;
+	svbtreepos p;
+	int eq = 0;
+	switch (ii->order) {
+	case SS_LT:
+	case SS_LTE:
+		if (ssunlikely(key == NULL)) {
+			sv_btreelast(t, &ii->c);
+			break;
+		}
+		sv_btreesearch(t, r, &p, key);
+		ii->c = p.c;
+		eq = p.eq;
+		if (! eq || ii->order == SS_LT)
+			sv_btreeprev(&ii->c);
+		break;
+	case SS_GT:
+	case SS_GTE:
+		if (ssunlikely(key == NULL)) {
+			sv_btreefirst(t, &ii->c);
+			break;
+		}
+		sv_btreesearch(t, r, &p, key);
+		ii->c = p.c;
+		eq = p.eq;
+		if (ii->c.leaf && ii->c.pos == ii->c.leaf->h.count) {
+			ii->c.leaf = ii->c.leaf->next;
+			ii->c.pos  = 0;
+		}
+		if (eq && ii->order == SS_GT)
+			sv_btreenext(&ii->c);
+		break;
+	default: assert(0);
+	}
+	ii->vcur = sv_btreeof(&ii->c);
+	return eq;
 }
 
 static inline int
-so_pooldestroy(sopool *p)
+sv_indexiter_open(ssiter *i, sr *r, svindex *index, ssorder o, char *key)
 {
-	ss_spinlockfree(&p->lock);
-	int rcret = 0;
-	int rc = so_listdestroy(&p->list);
-	if (ssunlikely(rc == -1))
-		rcret = -1;
-	so_listfree(&p->free);
-	return rcret;
+	svindexiter *ii = (svindexiter*)i->priv;
+	ii->index  = index;
+	ii->order  = o;
+	ii->v      = NULL;
+	ii->vcur   = NULL;
+	ii->c.leaf = NULL;
+	ii->c.pos  = 0;
+	if (index->type == SV_INDEXBTREE)
+		return sv_indexiter_openbtree(ii, r, key);
+	int rc;
+	int eq = 0;
+	switch (ii->order) {
+	case SS_LT:
+	case SS_LTE:
+		if (ssunlikely(key == NULL)) {
+			ii->v = ss_rbmax(&ii->index->i);
+			break;
+		}
+		rc = sv_indexmatch(&ii->index->i, r->scheme, key, 0, &ii->v);
+		if (ii->v == NULL)
+			break;
+		switch (rc) {
+		case 0:
+			eq = 1;
+			if (ii->order == SS_LT)
+				ii->v = ss_rbprev(&ii->index->i, ii->v);
+			break;
+		case 1:
+			ii->v = ss_rbprev(&ii->index->i, ii->v);
+			break;
+		}
+		break;
+	case SS_GT:
+	case SS_GTE:
+		if (ssunlikely(key == NULL)) {
+			ii->v = ss_rbmin(&ii->index->i);
+			break;
+		}
+		rc = sv_indexmatch(&ii->index->i, r->scheme, key, 0, &ii->v);
+		if (ii->v == NULL)
+			break;
+		switch (rc) {
+		case  0:
+			eq = 1;
+			if (ii->order == SS_GT)
+				ii->v = ss_rbnext(&ii->index->i, ii->v);
+			break;
+		case -1:
+			ii->v = ss_rbnext(&ii->index->i, ii->v);
+			break;
+		}
+		break;
+	default: assert(0);
+	}
+	ii->vcur = NULL;
+	if (ii->v) {
+		ii->vcur = sscast(ii->v, svv, node);
+	}
+	return eq;
 }
 
 static inline void
-so_pooladd(sopool *p, so *o)
+sv_indexiter_close(ssiter *i ssunused)
+{}
+
+static inline int
+sv_indexiter_has(ssiter *i)
 {
-	ss_spinlock(&p->lock);
-	so_listadd(&p->list, o);
-	ss_spinunlock(&p->lock);
+	svindexiter *ii = (svindexiter*)i->priv;
+	return ii->vcur != NULL;
 }
 
-static inline void
-so_poolgc(sopool *p, so *o)
+static inline void*
+sv_indexiter_of(ssiter *i)
 {
-	ss_spinlock(&p->lock);
-	so_listdel(&p->list, o);
-	if (p->free.n < p->free_max) {
-		so_listadd(&p->free, o);
-		ss_spinunlock(&p->lock);
-		return;
-	}
-	ss_spinunlock(&p->lock);
-	so_free(o);
+	svindexiter *ii = (svindexiter*)i->priv;
+	if (ssunlikely(ii->vcur == NULL))
+		return NULL;
+	return sv_vpointer(ii->vcur);
 }
 
 static inline void
-so_poolpush(sopool *p, so *o)
+sv_indexiter_nextbtree(svindexiter *ii)
 {
-	ss_spinlock(&p->lock);
-	so_listadd(&p->free, o);
-	ss_spinunlock(&p->lock);
+	switch (ii->order) {
+	case SS_LT:
+	case SS_LTE:
+		sv_btreeprev(&ii->c);
+		break;
+	case SS_GT:
+	case SS_GTE:
+		sv_btreenext(&ii->c);
+		break;
+	default: assert(0);
+	}
+	ii->vcur = sv_btreeof(&ii->c);
 }
 
-static inline so*
-so_poolpop(sopool *p)
+static inline void
+sv_indexiter_next(ssiter *i)
 {
-	so *o = NULL;
-	ss_spinlock(&p->lock);
-	if (sslikely(p->free.n)) {
-		o = so_listfirst(&p->free);
-		so_listdel(&p->free, o);
+	svindexiter *ii = (svindexiter*)i->priv;
+	if (ssunlikely(ii->vcur == NULL))
+		return;
+	svv *v = ii->vcur->next;
+	if (v) {
+		ii->vcur = v;
+		return;
+	}
+	if (ii->index->type == SV_INDEXBTREE) {
+		sv_indexiter_nextbtree(ii);
+		return;
+	}
+	switch (ii->order) {
+	case SS_LT:
+	case SS_LTE:
+		ii->v = ss_rbprev(&ii->index->i, ii->v);
+		break;
+	case SS_GT:
+	case SS_GTE:
+		ii->v = ss_rbnext(&ii->index->i, ii->v);
+		break;
+	default: assert(0);
+	}
+	if (sslikely(ii->v)) {
+		ii->vcur = sscast(ii->v, svv, node);
+	} else {
+		ii->vcur = NULL;
 	}
-	ss_spinunlock(&p->lock);
-	return o;
 }
 
+extern ssiterif sv_indexiter;
+
 #endif
-#line 1 "sophia/object/so.c"
+#line 1 "sophia/version/sv_btree.c"
 
 /*
  * sophia database
@@ -15825,141 +20243,280 @@ so_poolpop(sopool *p)
 
 
 
-
-
-#line 1 "sophia/version/sv_v.h"
-#ifndef SV_V_H_
-#define SV_V_H_
-
 /*
- * sophia database
- * sphia.org
+ * B+tree of version chains.
  *
- * Copyright (c) Dmitry Simonenko
- * BSD License
+ * Nodes are wide and keep an order-preserving 64-bit prefix of
+ * every key next to the slot, so most comparisons during a search
+ * stay within the node and never touch the version data. Keys are
+ * only compared in full when prefixes are equal.
+ *
+ * The tree only grows: versions are never removed from it, a chain
+ * head update replaces the leaf slot in place.
 */
 
-typedef struct svv svv;
-
-struct svv {
-	uint16_t refs;
-	void    *log;
-	svv     *next;
-	ssrbnode node;
-} sspacked;
-
-static inline svv*
-sv_vv(char *data) {
-	if (ssunlikely(data == NULL))
-		return NULL;
-	return (svv*)(data - sizeof(svv));
-}
-
-static inline char*
-sv_vpointer(svv *v) {
-	return (char*)(v) + sizeof(svv);
-}
-
-static inline uint8_t
-sv_vflags(svv *v, sr *r) {
-	return sf_flags(r->scheme, sv_vpointer(v));
+static inline int
+sv_btreecmp(sr *r, uint64_t prefix, char *key, uint64_t slot_prefix, svv *slot)
+{
+	if (prefix != slot_prefix)
+		return (prefix < slot_prefix) ? -1 : 1;
+	return sf_compare(r->scheme, key, sv_vpointer(slot));
 }
 
-static inline uint32_t
-sv_vsize(svv *v, sr *r) {
-	return sizeof(svv) + sf_size(r->scheme, sv_vpointer(v));
+static inline int
+sv_btreeleaf_search(svbtreeleaf *n, sr *r, uint64_t prefix, char *key, int *eq)
+{
+	/* first slot which is >= key */
+	int min = 0;
+	int max = n->h.count;
+	while (min < max) {
+		int mid = (min + max) >> 1;
+		int rc = sv_btreecmp(r, prefix, key, n->prefix[mid], n->v[mid]);
+		if (rc > 0) {
+			min = mid + 1;
+		} else {
+			if (rc == 0) {
+				*eq = 1;
+				return mid;
+			}
+			max = mid;
+		}
+	}
+	return min;
 }
 
-static inline uint64_t
-sv_vlsn(svv *v, sr *r) {
-	return sf_lsn(r->scheme, sv_vpointer(v));
+static inline int
+sv_btreeinner_search(svbtreeinner *n, sr *r, uint64_t prefix, char *key)
+{
+	/* last child which lower bound is <= key, the first
+	 * child takes everything below the second one */
+	int min = 1;
+	int max = n->h.count;
+	while (min < max) {
+		int mid = (min + max) >> 1;
+		int rc = sv_btreecmp(r, prefix, key, n->prefix[mid], n->min[mid]->v[0]);
+		if (rc >= 0)
+			min = mid + 1;
+		else
+			max = mid;
+	}
+	return min - 1;
 }
 
-static inline svv*
-sv_vbuild(sr *r, sfv *fields)
+void sv_btreesearch(svbtree *t, sr *r, svbtreepos *p, char *key)
 {
-	uint32_t size = sf_writesize(r->scheme, fields);
-	svv *v = ss_malloc(r->av, sizeof(svv) + size);
-	if (ssunlikely(v == NULL))
+	p->depth  = 0;
+	p->c.leaf = NULL;
+	p->c.pos  = 0;
+	p->eq     = 0;
+	p->prefix = sf_keyprefix(r->scheme, key);
+	svbtreenode *n = t->root;
+	if (ssunlikely(n == NULL))
+		return;
+	while (! n->leaf) {
+		svbtreeinner *inner = (svbtreeinner*)n;
+		int slot = sv_btreeinner_search(inner, r, p->prefix, key);
+		assert(p->depth < SV_BTREE_DEPTH);
+		p->path[p->depth] = inner;
+		p->slot[p->depth] = slot;
+		p->depth++;
+		n = inner->child[slot];
+	}
+	p->c.leaf = (svbtreeleaf*)n;
+	p->c.pos  = sv_btreeleaf_search(p->c.leaf, r, p->prefix, key, &p->eq);
+}
+
+static inline svbtreeleaf*
+sv_btreeleaf_new(sr *r)
+{
+	svbtreeleaf *n = ss_malloc(r->av, sizeof(svbtreeleaf));
+	if (ssunlikely(n == NULL))
 		return NULL;
-	v->refs  = 1;
-	v->log   = NULL;
-	v->next  = NULL;
-	memset(&v->node, 0, sizeof(v->node));
-	char *ptr = sv_vpointer(v);
-	sf_write(r->scheme, fields, ptr);
-	/* update runtime statistics */
-	ss_spinlock(&r->stat->lock);
-	r->stat->v_count++;
-	r->stat->v_allocated += sizeof(svv) + size;
-	ss_spinunlock(&r->stat->lock);
-	return v;
+	n->h.count = 0;
+	n->h.leaf  = 1;
+	n->prev    = NULL;
+	n->next    = NULL;
+	return n;
 }
 
-static inline svv*
-sv_vbuildraw(sr *r, char *src)
+static inline svbtreeinner*
+sv_btreeinner_new(sr *r)
 {
-	uint32_t size = sf_size(r->scheme, src);
-	svv *v = ss_malloc(r->av, sizeof(svv) + size);
-	if (ssunlikely(v == NULL))
+	svbtreeinner *n = ss_malloc(r->av, sizeof(svbtreeinner));
+	if (ssunlikely(n == NULL))
 		return NULL;
-	v->refs  = 1;
-	v->log   = NULL;
-	v->next  = NULL;
-	memset(&v->node, 0, sizeof(v->node));
-	memcpy(sv_vpointer(v), src, size);
-	/* update runtime statistics */
-	ss_spinlock(&r->stat->lock);
-	r->stat->v_count++;
-	r->stat->v_allocated += sizeof(svv) + size;
-	ss_spinunlock(&r->stat->lock);
-	return v;
+	n->h.count = 0;
+	n->h.leaf  = 0;
+	return n;
 }
 
 static inline void
-sv_vref(svv *v) {
-	v->refs++;
+sv_btreeleaf_insert(svbtreeleaf *n, int pos, uint64_t prefix, svv *v)
+{
+	int count = n->h.count - pos;
+	memmove(&n->prefix[pos + 1], &n->prefix[pos], count * sizeof(uint64_t));
+	memmove(&n->v[pos + 1], &n->v[pos], count * sizeof(svv*));
+	n->prefix[pos] = prefix;
+	n->v[pos] = v;
+	n->h.count++;
 }
 
-static inline int
-sv_vunref(sr *r, svv *v)
+static inline void
+sv_btreeinner_insert(svbtreeinner *n, int pos, uint64_t prefix,
+                     svbtreeleaf *min, svbtreenode *child)
 {
-	if (sslikely(--v->refs == 0)) {
-		uint32_t size = sv_vsize(v, r);
-		/* update runtime statistics */
-		ss_spinlock(&r->stat->lock);
-		assert(r->stat->v_count > 0);
-		assert(r->stat->v_allocated >= size);
-		r->stat->v_count--;
-		r->stat->v_allocated -= size;
-		ss_spinunlock(&r->stat->lock);
-		ss_free(r->av, v);
-		return 1;
-	}
-	return 0;
+	int count = n->h.count - pos;
+	memmove(&n->prefix[pos + 1], &n->prefix[pos], count * sizeof(uint64_t));
+	memmove(&n->min[pos + 1], &n->min[pos], count * sizeof(svbtreeleaf*));
+	memmove(&n->child[pos + 1], &n->child[pos], count * sizeof(svbtreenode*));
+	n->prefix[pos] = prefix;
+	n->min[pos] = min;
+	n->child[pos] = child;
+	n->h.count++;
 }
 
 static inline void
-sv_vfree(sr *r, svv *v)
+sv_btreesplit(svbtree *t, svbtreepos *p, svbtreeleaf *right,
+              svbtreeinner **spare)
+{
+	/* link the right half of a split leaf into the parents
+	 * and split them in turn while they are full */
+	uint64_t     prefix = right->prefix[0];
+	svbtreeleaf *min    = right;
+	svbtreenode *child  = &right->h;
+	int level = p->depth - 1;
+	for (; level >= 0; level--) {
+		svbtreeinner *n = p->path[level];
+		int pos = p->slot[level] + 1;
+		if (sslikely(n->h.count < SV_BTREE_FANOUT)) {
+			sv_btreeinner_insert(n, pos, prefix, min, child);
+			return;
+		}
+		svbtreeinner *split = *spare++;
+		int half = SV_BTREE_FANOUT / 2;
+		int count = SV_BTREE_FANOUT - half;
+		memcpy(split->prefix, &n->prefix[half], count * sizeof(uint64_t));
+		memcpy(split->min, &n->min[half], count * sizeof(svbtreeleaf*));
+		memcpy(split->child, &n->child[half], count * sizeof(svbtreenode*));
+		split->h.count = count;
+		n->h.count = half;
+		if (pos <= half)
+			sv_btreeinner_insert(n, pos, prefix, min, child);
+		else
+			sv_btreeinner_insert(split, pos - half, prefix, min, child);
+		prefix = split->prefix[0];
+		min    = split->min[0];
+		child  = &split->h;
+	}
+	/* grow a new root */
+	svbtreeinner *root = *spare;
+	sv_btreeinner_insert(root, 0, t->first->prefix[0], t->first, t->root);
+	sv_btreeinner_insert(root, 1, prefix, min, child);
+	t->root = &root->h;
+	t->height++;
+}
+
+int sv_btreeinsert(svbtree *t, sr *r, svbtreepos *p, svv *v)
 {
-	while (v) {
-		svv *n = v->next;
-		sv_vunref(r, v);
-		v = n;
+	assert(! p->eq);
+	svbtreeleaf *n = p->c.leaf;
+	if (ssunlikely(n == NULL)) {
+		assert(t->root == NULL);
+		n = sv_btreeleaf_new(r);
+		if (ssunlikely(n == NULL))
+			return -1;
+		sv_btreeleaf_insert(n, 0, p->prefix, v);
+		t->root   = &n->h;
+		t->first  = n;
+		t->last   = n;
+		t->height = 1;
+		return 0;
+	}
+	if (sslikely(n->h.count < SV_BTREE_FANOUT)) {
+		sv_btreeleaf_insert(n, p->c.pos, p->prefix, v);
+		return 0;
+	}
+
+	/* allocate every node the split needs before
+	 * changing the tree */
+	svbtreeinner *spare[SV_BTREE_DEPTH + 1];
+	int need = 0;
+	int level = p->depth - 1;
+	while (level >= 0 && p->path[level]->h.count == SV_BTREE_FANOUT) {
+		need++;
+		level--;
+	}
+	if (level < 0) {
+		if (ssunlikely(t->height == SV_BTREE_DEPTH))
+			return -1;
+		need++;
+	}
+	svbtreeleaf *right = sv_btreeleaf_new(r);
+	if (ssunlikely(right == NULL))
+		return -1;
+	int i = 0;
+	for (; i < need; i++) {
+		spare[i] = sv_btreeinner_new(r);
+		if (ssunlikely(spare[i] == NULL)) {
+			while (i-- > 0)
+				ss_free(r->av, spare[i]);
+			ss_free(r->av, right);
+			return -1;
+		}
 	}
+
+	/* split the leaf, appends to the last leaf start a new one
+	 * to keep sequential inserts packed */
+	int half = SV_BTREE_FANOUT / 2;
+	if (n == t->last && p->c.pos == SV_BTREE_FANOUT)
+		half = SV_BTREE_FANOUT;
+	int count = SV_BTREE_FANOUT - half;
+	memcpy(right->prefix, &n->prefix[half], count * sizeof(uint64_t));
+	memcpy(right->v, &n->v[half], count * sizeof(svv*));
+	right->h.count = count;
+	n->h.count = half;
+	if (p->c.pos < half)
+		sv_btreeleaf_insert(n, p->c.pos, p->prefix, v);
+	else
+		sv_btreeleaf_insert(right, p->c.pos - half, p->prefix, v);
+	right->prev = n;
+	right->next = n->next;
+	if (n->next)
+		n->next->prev = right;
+	else
+		t->last = right;
+	n->next = right;
+	sv_btreesplit(t, p, right, spare);
+	return 0;
 }
 
-static inline svv*
-sv_vvisible(svv *v, sr *r, uint64_t vlsn) {
-	while (v && sv_vlsn(v, r) > vlsn)
-		v = v->next;
-	return v;
+static void
+sv_btreefree_node(svbtreenode *n, sr *r, svbtreef f)
+{
+	if (n->leaf) {
+		svbtreeleaf *leaf = (svbtreeleaf*)n;
+		if (f) {
+			int i = 0;
+			for (; i < n->count; i++)
+				f(r, leaf->v[i]);
+		}
+		ss_free(r->av, leaf);
+		return;
+	}
+	svbtreeinner *inner = (svbtreeinner*)n;
+	int i = 0;
+	for (; i < n->count; i++)
+		sv_btreefree_node(inner->child[i], r, f);
+	ss_free(r->av, inner);
 }
 
-#endif
-#line 1 "sophia/version/sv_upsert.h"
-#ifndef SV_UPSERT_H_
-#define SV_UPSERT_H_
+void sv_btreefree(svbtree *t, sr *r, svbtreef f)
+{
+	if (t->root)
+		sv_btreefree_node(t->root, r, f);
+	sv_btreeinit(t);
+}
+#line 1 "sophia/version/sv_index.c"
 
 /*
  * sophia database
@@ -15969,242 +20526,195 @@ sv_vvisible(svv *v, sr *r, uint64_t vlsn) {
  * BSD License
 */
 
-typedef struct svupsertnode svupsertnode;
-typedef struct svupsert svupsert;
 
-struct svupsertnode {
-	ssbuf buf;
-};
 
-#define SV_UPSERTRESRV 16
 
-struct svupsert {
-	svupsertnode reserve[SV_UPSERTRESRV];
-	ssbuf        stack;
-	ssbuf        tmp;
-	int          max;
-	int          count;
-	char        *result;
-};
 
-static inline void
-sv_upsertinit(svupsert *u)
+
+
+ss_rbtruncate(sv_indextruncate,
+              sv_vfree((sr*)arg, sscast(n, svv, node)))
+
+int sv_indexinit(svindex *i, int type)
 {
-	const int reserve = SV_UPSERTRESRV;
-	int i = 0;
-	while (i < reserve) {
-		ss_bufinit(&u->reserve[i].buf);
-		i++;
-	}
-	u->result = NULL;
-	u->count  = 0;
-	u->max    = reserve;
-	ss_bufinit_reserve(&u->stack, u->reserve, sizeof(u->reserve));
-	ss_bufinit(&u->tmp);
+	i->lsnmin = UINT64_MAX;
+	i->count  = 0;
+	i->used   = 0;
+	i->type   = type;
+	ss_rbinit(&i->i);
+	sv_btreeinit(&i->t);
+	return 0;
 }
 
-static inline void
-sv_upsertfree(svupsert *u, sr *r)
+int sv_indexfree(svindex *i, sr *r)
 {
-	svupsertnode *n = (svupsertnode*)u->stack.s;
-	int i = 0;
-	while (i < u->max) {
-		ss_buffree(&n[i].buf, r->a);
-		i++;
+	if (i->type == SV_INDEXBTREE) {
+		sv_btreefree(&i->t, r, sv_vfree);
+		return 0;
 	}
-	ss_buffree(&u->stack, r->a);
-	ss_buffree(&u->tmp, r->a);
+	if (i->i.root)
+		sv_indextruncate(i->i.root, r);
+	ss_rbinit(&i->i);
+	return 0;
 }
 
-static inline void
-sv_upsertreset(svupsert *u)
+int sv_indexreset(svindex *i, sr *r)
 {
-	svupsertnode *n = (svupsertnode*)u->stack.s;
-	int i = 0;
-	while (i < u->count) {
-		ss_bufreset(&n[i].buf);
-		i++;
-	}
-	u->result = NULL;
-	u->count  = 0;
-	ss_bufreset(&u->stack);
-	ss_bufreset(&u->tmp);
+	/* free the index structure, but not the versions
+	 * which have been moved elsewhere */
+	if (i->type == SV_INDEXBTREE)
+		sv_btreefree(&i->t, r, NULL);
+	return sv_indexinit(i, i->type);
 }
 
-static inline void
-sv_upsertgc(svupsert *u, sr *r, int wm_stack, int wm_buf)
+int sv_indexgc(svindex *i, sr *r, svbtreef gc)
 {
-	svupsertnode *n = (svupsertnode*)u->stack.s;
-	if (u->max >= wm_stack) {
-		sv_upsertfree(u, r);
-		sv_upsertinit(u);
-		return;
+	/* free the index structure and pass every
+	 * version chain to the callback */
+	assert(i->type == SV_INDEXBTREE);
+	sv_btreefree(&i->t, r, gc);
+	return 0;
+}
+
+static inline svv*
+sv_vset(svv *head, svv *v, sr *r)
+{
+	assert(sv_vlsn(head, r) != sv_vlsn(v, r));
+	/* default */
+	if (sslikely(sv_vlsn(head, r) < sv_vlsn(v, r))) {
+		v->next = head;
+		sf_flagsset(r->scheme, sv_vpointer(head),
+		            sv_vflags(head, r) | SVDUP);
+		return v;
 	}
-	ss_bufgc(&u->tmp, r->a, wm_buf);
-	int i = 0;
-	while (i < u->count) {
-		ss_bufgc(&n[i].buf, r->a, wm_buf);
-		i++;
+	/* redistribution (starting from highest lsn) */
+	svv *prev = head;
+	svv *c = head->next;
+	while (c) {
+		assert(sv_vlsn(c, r) != sv_vlsn(v, r));
+		if (sv_vlsn(c, r) < sv_vlsn(v, r))
+			break;
+		prev = c;
+		c = c->next;
 	}
-	u->count = 0;
-	u->result = NULL;
+	prev->next = v;
+	v->next = c;
+	sf_flagsset(r->scheme, sv_vpointer(v),
+	            sv_vflags(v, r) | SVDUP);
+	return head;
 }
 
-static inline int
-sv_upsertpush(svupsert *u, sr *r, char *pointer)
+svv*
+sv_indexget(svindex *i, sr *r, svindexpos *p, svv *v)
 {
-	svupsertnode *n;
-	int rc;
-	if (sslikely(u->max > u->count)) {
-		n = (svupsertnode*)u->stack.p;
-		ss_bufreset(&n->buf);
-	} else {
-		rc = ss_bufensure(&u->stack, r->a, sizeof(svupsertnode));
-		if (ssunlikely(rc == -1))
-			return -1;
-		n = (svupsertnode*)u->stack.p;
-		ss_bufinit(&n->buf);
-		u->max++;
+	if (i->type == SV_INDEXBTREE) {
+		sv_btreesearch(&i->t, r, &p->t, sv_vpointer(v));
+		if (p->t.eq)
+			return sv_btreeof(&p->t.c);
+		return NULL;
 	}
-	uint32_t size = sf_size(r->scheme, pointer);
-	rc = ss_bufensure(&n->buf, r->a, size);
-	if (ssunlikely(rc == -1))
-		return -1;
-	memcpy(n->buf.p, pointer, size);
-	ss_bufadvance(&n->buf, size);
-	ss_bufadvance(&u->stack, sizeof(svupsertnode));
-	u->count++;
+	p->rc = sv_indexmatch(&i->i, r->scheme, sv_vpointer(v), 0,
+	                      &p->node);
+	if (p->rc == 0 && p->node)
+		return sscast(p->node, svv, node);
+	return NULL;
+}
+
+int sv_indexupdate(svindex *i, sr *r, svindexpos *p, svv *v)
+{
+	if (i->type == SV_INDEXBTREE) {
+		if (p->t.eq) {
+			svv *head = sv_btreeof(&p->t.c);
+			svv *update = sv_vset(head, v, r);
+			if (head != update)
+				p->t.c.leaf->v[p->t.c.pos] = update;
+		} else {
+			int rc = sv_btreeinsert(&i->t, r, &p->t, v);
+			if (ssunlikely(rc == -1))
+				return -1;
+		}
+	} else
+	if (p->rc == 0 && p->node) {
+		svv *head = sscast(p->node, svv, node);
+		svv *update = sv_vset(head, v, r);
+		if (head != update)
+			ss_rbreplace(&i->i, p->node, &update->node);
+	} else {
+		ss_rbset(&i->i, p->node, p->rc, &v->node);
+	}
+	if (sv_vlsn(v, r) < i->lsnmin)
+		i->lsnmin = sv_vlsn(v, r);
+	i->count++;
+	i->used += sv_vsize(v, r);
 	return 0;
 }
+#line 1 "sophia/version/sv_indexiter.c"
 
-static inline svupsertnode*
-sv_upsertpop(svupsert *u)
-{
-	if (u->count == 0)
-		return NULL;
-	int pos = u->count - 1;
-	u->count--;
-	u->stack.p -= sizeof(svupsertnode);
-	return ss_bufat(&u->stack, sizeof(svupsertnode), pos);
-}
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
 
-static inline int
-sv_upsertdo(svupsert *u, sr *r, svupsertnode *a, svupsertnode *b)
+
+
+
+
+
+ssiterif sv_indexiter =
 {
-	assert(r->scheme->fields_count <= 16);
+	.close   = sv_indexiter_close,
+	.has     = sv_indexiter_has,
+	.of      = sv_indexiter_of,
+	.next    = sv_indexiter_next
+};
+#line 1 "sophia/version/sv_mergeiter.c"
 
-	uint32_t  src_size[16];
-	char     *src[16];
-	void     *src_ptr;
-	uint32_t *src_size_ptr;
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
 
-	uint32_t  upsert_size[16];
-	char     *upsert[16];
-	uint32_t  result_size[16];
-	char     *result[16];
 
-	int i = 0;
-	if (sslikely(a && !(sf_flags(r->scheme, a->buf.s) & SVDELETE) ))
-	{
-		src_ptr = src;
-		src_size_ptr = src_size;
-		for (; i < r->scheme->fields_count; i++) {
-			src[i]    = sf_field(r->scheme, i, a->buf.s, &src_size[i]);
-			upsert[i] = sf_field(r->scheme, i, b->buf.s, &upsert_size[i]);
-			result[i] = src[i];
-			result_size[i] = src_size[i];
-		}
-	} else {
-		src_ptr = NULL;
-		src_size_ptr = NULL;
-		for (; i < r->scheme->fields_count; i++) {
-			upsert[i] = sf_field(r->scheme, i, b->buf.s, &upsert_size[i]);
-			result[i] = upsert[i];
-			result_size[i] = upsert_size[i];
-		}
-	}
 
-	/* execute */
-	int rc;
-	rc = r->upsert->function(r->scheme->fields_count,
-	                         src_ptr,
-	                         src_size_ptr,
-	                         upsert,
-	                         upsert_size,
-	                         result,
-	                         result_size,
-	                         r->upsert->arg);
-	if (ssunlikely(rc == -1))
-		return -1;
 
-	/* validate and create new record */
-	sfv v[16];
-	i = 0;
-	for ( ; i < r->scheme->fields_count; i++) {
-		v[i].pointer = result[i];
-		v[i].size = result_size[i];
-	}
-	uint32_t size = sf_writesize(r->scheme, v);
-	ss_bufreset(&u->tmp);
-	rc = ss_bufensure(&u->tmp, r->a, size);
-	if (ssunlikely(rc == -1))
-		goto cleanup;
-	sf_write(r->scheme, v, u->tmp.s);
-	ss_bufadvance(&u->tmp, size);
-	/* update meta-fields */
-	sf_flagsset(r->scheme, u->tmp.s,
-	            sf_flags(r->scheme, b->buf.s) & ~SVUPSERT);
 
-	/* save result */
-	rc = sv_upsertpush(u, r, u->tmp.s);
-cleanup:
-	/* free fields */
-	i = 0;
-	for ( ; i < r->scheme->fields_count; i++) {
-		if (src_ptr == NULL) {
-			if (v[i].pointer != upsert[i])
-				free(v[i].pointer);
-		} else {
-			if (v[i].pointer != src[i])
-				free(v[i].pointer);
-		}
-	}
-	return rc;
-}
 
-static inline int
-sv_upsert(svupsert *u, sr *r)
+ssiterif sv_mergeiter =
 {
-	assert(u->count >= 1 );
-	svupsertnode *f = ss_bufat(&u->stack, sizeof(svupsertnode), u->count - 1);
-	int rc;
-	if (sf_flags(r->scheme, f->buf.s) & SVUPSERT) {
-		f = sv_upsertpop(u);
-		rc = sv_upsertdo(u, r, NULL, f);
-		if (ssunlikely(rc == -1))
-			return -1;
-	}
-	if (u->count == 1)
-		goto done;
-	while (u->count > 1) {
-		svupsertnode *f = sv_upsertpop(u);
-		svupsertnode *s = sv_upsertpop(u);
-		assert(f != NULL);
-		assert(s != NULL);
-		rc = sv_upsertdo(u, r, f, s);
-		if (ssunlikely(rc == -1))
-			return -1;
-	}
-done:
-	f = ss_bufat(&u->stack, sizeof(svupsertnode), 0);
-	u->result = f->buf.s;
-	return 0;
-}
+	.close = sv_mergeiter_close,
+	.has   = sv_mergeiter_has,
+	.of    = sv_mergeiter_of,
+	.next  = sv_mergeiter_next
+};
+#line 1 "sophia/version/sv_readiter.c"
 
-#endif
-#line 1 "sophia/version/sv_log.h"
-#ifndef SV_LOG_H_
-#define SV_LOG_H_
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+
+
+
+
+
+ssiterif sv_readiter =
+{
+	.close   = sv_readiter_close,
+	.has     = sv_readiter_has,
+	.of      = sv_readiter_of,
+	.next    = sv_readiter_next
+};
+#line 1 "sophia/version/sv_writeiter.c"
 
 /*
  * sophia database
@@ -16214,156 +20724,302 @@ done:
  * BSD License
 */
 
-typedef struct svlogindex svlogindex;
-typedef struct svlogv svlogv;
-typedef struct svlog svlog;
 
-struct svlogindex {
-	uint32_t head, tail;
-	uint32_t count;
-	sr *r;
-} sspacked;
 
-struct svlogv {
-	uint32_t index_id;
-	uint32_t next;
-	svv     *v;
-	void    *ptr;
+
+
+
+ssiterif sv_writeiter =
+{
+	.close   = sv_writeiter_close,
+	.has     = sv_writeiter_has,
+	.of      = sv_writeiter_of,
+	.next    = sv_writeiter_next
+};
+#line 1 "sophia/transaction/sx_v.h"
+#ifndef SX_V_H_
+#define SX_V_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct sxv sxv;
+typedef struct sxvpool sxvpool;
+
+struct sxv {
+	uint64_t  id;
+	uint32_t  lo;
+	uint64_t  csn;
+	uint8_t   conflict;
+	void     *index;
+	svv      *v;
+	sxv      *next;
+	sxv      *prev;
+	sxv      *gc;
+	ssrbnode  node;
 } sspacked;
 
-struct svlog {
-	int    count_write;
-	svlogv reserve_buf[1];
-	svlogv reserve_index[4];
-	ssbuf  index;
-	ssbuf  buf;
+struct sxvpool {
+	sxv *head;
+	int n;
+	ssa *a;
 };
 
 static inline void
-sv_logvinit(svlogv *v, uint32_t id)
+sx_vpool_init(sxvpool *p, ssa *a)
+{
+	p->head = NULL;
+	p->n = 0;
+	p->a = a;
+}
+
+static inline void
+sx_vpool_free(sxvpool *p)
+{
+	sxv *n, *c = p->head;
+	while (c) {
+		n = c->next;
+		ss_free(p->a, c);
+		c = n;
+	}
+}
+
+static inline sxv*
+sx_vpool_pop(sxvpool *p)
+{
+	if (ssunlikely(p->n == 0))
+		return NULL;
+	sxv *v = p->head;
+	p->head = v->next;
+	p->n--;
+	return v;
+}
+
+static inline void
+sx_vpool_push(sxvpool *p, sxv *v)
 {
-	v->index_id = id;
-	v->next     = UINT32_MAX;
-	v->v        = NULL;
-	v->ptr      = NULL;
+	v->v    = NULL;
+	v->next = NULL;
+	v->prev = NULL;
+	v->next = p->head;
+	p->head = v;
+	p->n++;
 }
 
-static inline int
-sv_loginit(svlog *l, sr *r, int index_max)
+static inline sxv*
+sx_valloc(sxvpool *p, svv *ref)
 {
-	l->count_write = 0;
-	ss_bufinit_reserve(&l->index, l->reserve_index, sizeof(l->reserve_index));
-	ss_bufinit_reserve(&l->buf, l->reserve_buf, sizeof(l->reserve_buf));
-	if (index_max == 0)
-		return 0;
-	int size = sizeof(svlogindex) * index_max;
-	int rc = ss_bufensure(&l->index, r->a, size);
-	if (ssunlikely(rc == -1))
-		return -1;
-	ss_bufadvance(&l->index, size);
-	int i = 0;
-	while (i < index_max) {
-		svlogindex *index =
-			ss_bufat(&l->index, sizeof(svlogindex), i);
-		index->head = UINT32_MAX;
-		index->tail = 0;
-		index->count = 0;
-		index->r = NULL;
-		i++;
+	sxv *v = sx_vpool_pop(p);
+	if (ssunlikely(v == NULL)) {
+		v = ss_malloc(p->a, sizeof(sxv));
+		if (ssunlikely(v == NULL))
+			return NULL;
 	}
-	return 0;
+	v->index    = NULL;
+	v->id       = 0;
+	v->lo       = 0;
+	v->csn      = 0;
+	v->v        = ref;
+	v->next     = NULL;
+	v->prev     = NULL;
+	v->gc       = NULL;
+	v->conflict = 0;
+	memset(&v->node, 0, sizeof(v->node));
+	return v;
 }
 
 static inline void
-sv_loginit_index(svlog *l, int pos, sr *r)
+sx_vfree(sxvpool *p, sr *r, sxv *v)
 {
-	svlogindex *index =
-		ss_bufat(&l->index, sizeof(svlogindex), pos);
-	index->r = r;
+	sv_vunref(r, v->v);
+	sx_vpool_push(p, v);
 }
 
 static inline void
-sv_logfree(svlog *l, sr *r)
+sx_vfreeall(sxvpool *p, sr *r, sxv *v)
 {
-	ss_buffree(&l->index, r->a);
-	ss_buffree(&l->buf, r->a);
-	l->count_write = 0;
+	while (v) {
+		sxv *next = v->next;
+		sx_vfree(p, r, v);
+		v = next;
+	}
 }
 
-static inline void
-sv_logreset(svlog *l, int index_max)
+static inline sxv*
+sx_vmatch(sxv *head, uint64_t id)
 {
-	int i = 0;
-	while (i < index_max) {
-		svlogindex *index =
-			ss_bufat(&l->index, sizeof(svlogindex), i);
-		index->head  = UINT32_MAX;
-		index->tail  = 0;
-		index->count = 0;
-		i++;
+	sxv *c = head;
+	while (c) {
+		if (c->id == id)
+			break;
+		c = c->next;
 	}
-	ss_bufreset(&l->buf);
-	l->count_write = 0;
+	return c;
 }
 
-static inline int
-sv_logcount(svlog *l) {
-	return ss_bufused(&l->buf) / sizeof(svlogv);
+static inline void
+sx_vreplace(sxv *v, sxv *n)
+{
+	if (v->prev)
+		v->prev->next = n;
+	if (v->next)
+		v->next->prev = n;
+	n->next = v->next;
+	n->prev = v->prev;
 }
 
-static inline int
-sv_logcount_write(svlog *l) {
-	return l->count_write;
+static inline void
+sx_vlink(sxv *head, sxv *v)
+{
+	sxv *c = head;
+	while (c->next)
+		c = c->next;
+	c->next = v;
+	v->prev = c;
+	v->next = NULL;
 }
 
-static inline svlogv*
-sv_logat(svlog *l, int pos) {
-	return ss_bufat(&l->buf, sizeof(svlogv), pos);
+static inline void
+sx_vunlink(sxv *v)
+{
+	if (v->prev)
+		v->prev->next = v->next;
+	if (v->next)
+		v->next->prev = v->prev;
+	v->prev = NULL;
+	v->next = NULL;
 }
 
-static inline svlogindex*
-sv_logindex(svlog *l, int id) {
-	return ss_bufat(&l->index, sizeof(svlogindex), id);
+static inline void
+sx_vcommit(sxv *v, uint32_t csn)
+{
+	v->id  = UINT64_MAX;
+	v->lo  = UINT32_MAX;
+	v->csn = csn;
 }
 
 static inline int
-sv_logadd(svlog *l, sr *r, svlogv *v)
+sx_vcommitted(sxv *v)
 {
-	uint32_t n = sv_logcount(l);
-	int rc = ss_bufadd(&l->buf, r->a, v, sizeof(svlogv));
-	if (ssunlikely(rc == -1))
-		return -1;
-	svlogindex *index =
-		ss_bufat(&l->index, sizeof(svlogindex), v->index_id);
-	if (index->head == UINT32_MAX) {
-		index->head = n;
-	} else {
-		svlogv *tail = sv_logat(l, index->tail);
-		tail->next = n;
-	}
-	index->tail = n;
-	index->count++;
-	if (! (sv_vflags(v->v, r) & SVGET))
-		l->count_write++;
-	return 0;
+	return v->id == UINT64_MAX && v->lo == UINT32_MAX;
 }
 
 static inline void
-sv_logreplace(svlog *l, sr *r, int n, svlogv *v)
+sx_vabort(sxv *v)
 {
-	svlogv *ov = sv_logat(l, n);
-	if (! (sv_vflags(ov->v, r) & SVGET))
-		l->count_write--;
-	if (! (sv_vflags(v->v, r) & SVGET))
-		l->count_write++;
-	ss_bufset(&l->buf, sizeof(svlogv), n, (char*)v,
-	          sizeof(svlogv));
+	v->conflict = 1;
+}
+
+static inline void
+sx_vabort_all(sxv *v)
+{
+	while (v) {
+		sx_vabort(v);
+		v = v->next;
+	}
+}
+
+static inline int
+sx_vaborted(sxv *v)
+{
+	return v->conflict;
 }
 
 #endif
-#line 1 "sophia/version/sv_merge.h"
-#ifndef SV_MERGE_H_
-#define SV_MERGE_H_
+#line 1 "sophia/transaction/sx.h"
+#ifndef SX_H_
+#define SX_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct sxmanager sxmanager;
+typedef struct sxindex sxindex;
+typedef struct sx sx;
+
+typedef enum {
+	SX_UNDEF,
+	SX_ROLLBACK,
+	SX_LOCK,
+	SX_READY,
+	SX_COMMIT,
+	SX_PREPARE
+} sxstate;
+
+typedef enum {
+	SX_RO,
+	SX_RW
+} sxtype;
+
+struct sxindex {
+	ssrb      i;
+	uint32_t  dsn;
+	so       *object;
+	sr       *r;
+	sslist    link;
+};
+
+typedef int (*sxpreparef)(sx*, svv*, so*, void*);
+
+struct sx {
+	sxtype     type;
+	sxstate    state;
+	uint64_t   id;
+	uint64_t   vlsn;
+	uint64_t   csn;
+	int        log_read;
+	svlog     *log;
+	sslist     deadlock;
+	ssrbnode   node;
+	sxmanager *manager;
+};
+
+struct sxmanager {
+	ssspinlock  lock;
+	sslist      indexes;
+	ssrb        i;
+	uint32_t    count_rd;
+	uint32_t    count_rw;
+	uint32_t    count_gc;
+	uint64_t    csn;
+	sxv        *gc;
+	sxvpool     pool;
+	srseq      *seq;
+};
+
+int       sx_managerinit(sxmanager*, srseq*, ssa*);
+int       sx_managerfree(sxmanager*);
+int       sx_indexinit(sxindex*, sxmanager*, sr*, so*);
+int       sx_indexset(sxindex*, uint32_t);
+int       sx_indexfree(sxindex*, sxmanager*);
+sx       *sx_find(sxmanager*, uint64_t);
+void      sx_init(sxmanager*, sx*, svlog*);
+sxstate   sx_begin(sxmanager*, sx*, sxtype, svlog*, uint64_t);
+void      sx_gc(sx*);
+sxstate   sx_prepare(sx*, sxpreparef, void*);
+sxstate   sx_commit(sx*);
+sxstate   sx_rollback(sx*);
+int       sx_set(sx*, sxindex*, svv*);
+int       sx_get(sx*, sxindex*, svv*, svv**);
+uint64_t  sx_vlsn(sxmanager*);
+int       sx_vlsn_since(sxmanager*, uint64_t);
+sxstate   sx_set_autocommit(sxmanager*, sxindex*, sx*, svlog*, svv*);
+sxstate   sx_get_autocommit(sxmanager*, sxindex*);
+
+#endif
+#line 1 "sophia/transaction/sx_deadlock.h"
+#ifndef SX_DEADLOCK_H_
+#define SX_DEADLOCK_H_
 
 /*
  * sophia database
@@ -16373,71 +21029,10 @@ sv_logreplace(svlog *l, sr *r, int n, svlogv *v)
  * BSD License
 */
 
-typedef struct svmergesrc svmergesrc;
-typedef struct svmerge svmerge;
-
-struct svmergesrc {
-	ssiter *i, src;
-	uint8_t dup;
-	void *ptr;
-} sspacked;
-
-struct svmerge {
-	svmergesrc reserve[16];
-	ssbuf buf;
-};
-
-static inline void
-sv_mergeinit(svmerge *m)
-{
-	ss_bufinit_reserve(&m->buf, m->reserve, sizeof(m->reserve));
-}
-
-static inline int
-sv_mergeprepare(svmerge *m, sr *r, int count)
-{
-	int rc = ss_bufensure(&m->buf, r->a, sizeof(svmergesrc) * count);
-	if (ssunlikely(rc == -1))
-		return sr_oom(r->e);
-	return 0;
-}
-
-static inline svmergesrc*
-sv_mergenextof(svmergesrc *src)
-{
-	return (svmergesrc*)((char*)src + sizeof(svmergesrc));
-}
-
-static inline void
-sv_mergefree(svmerge *m, ssa *a)
-{
-	ss_buffree(&m->buf, a);
-}
-
-static inline void
-sv_mergereset(svmerge *m)
-{
-	m->buf.p = m->buf.s;
-}
-
-static inline svmergesrc*
-sv_mergeadd(svmerge *m, ssiter *i)
-{
-	assert(m->buf.p < m->buf.e);
-	svmergesrc *s = (svmergesrc*)m->buf.p;
-	s->dup = 0;
-	s->i = i;
-	s->ptr = NULL;
-	if (i == NULL)
-		s->i = &s->src;
-	ss_bufadvance(&m->buf, sizeof(svmergesrc));
-	return s;
-}
+int sx_deadlock(sx*);
 
 #endif
-#line 1 "sophia/version/sv_mergeiter.h"
-#ifndef SV_MERGEITER_H_
-#define SV_MERGEITER_H_
+#line 1 "sophia/transaction/sx.c"
 
 /*
  * sophia database
@@ -16447,749 +21042,576 @@ sv_mergeadd(svmerge *m, ssiter *i)
  * BSD License
 */
 
-/*
- * Merge serveral sorted streams into one.
- * Track duplicates.
- *
- * Merger does not recognize duplicates from
- * a single stream, assumed that they are tracked
- * by the incoming data sources.
-*/
 
-typedef struct svmergeiter svmergeiter;
 
-struct svmergeiter {
-	ssorder order;
-	svmerge *merge;
-	svmergesrc *src, *end;
-	svmergesrc *v;
-	sr *r;
-} sspacked;
 
-static inline void
-sv_mergeiter_dupreset(svmergeiter *i, svmergesrc *pos)
-{
-	svmergesrc *v = i->src;
-	while (v != pos) {
-		v->dup = 0;
-		v = sv_mergenextof(v);
-	}
-}
 
-static inline void
-sv_mergeiter_gt(svmergeiter *i)
-{
-	if (i->v) {
-		i->v->dup = 0;
-		ss_iteratornext(i->v->i);
-	}
-	i->v = NULL;
-	svmergesrc *min, *src;
-	char *minv;
-	minv = NULL;
-	min  = NULL;
-	src  = i->src;
-	for (; src < i->end; src = sv_mergenextof(src))
-	{
-		char *v = ss_iteratorof(src->i);
-		if (v == NULL)
-			continue;
-		if (min == NULL) {
-			minv = v;
-			min = src;
-			continue;
-		}
-		int rc;
-		rc = sf_compare(i->r->scheme, minv, v);
-		switch (rc) {
-		case 0:
-			/*
-			assert( lsn(v) < lsn(minv) );
-			*/
-			src->dup = 1;
-			break;
-		case 1:
-			sv_mergeiter_dupreset(i, src);
-			minv = v;
-			min = src;
-			break;
-		}
-	}
-	if (ssunlikely(min == NULL))
-		return;
-	i->v = min;
-}
 
-static inline void
-sv_mergeiter_lt(svmergeiter *i)
-{
-	if (i->v) {
-		i->v->dup = 0;
-		ss_iteratornext(i->v->i);
-	}
-	i->v = NULL;
-	svmergesrc *max, *src;
-	char *maxv;
-	maxv = NULL;
-	max  = NULL;
-	src  = i->src;
-	for (; src < i->end; src = sv_mergenextof(src))
-	{
-		char *v = ss_iteratorof(src->i);
-		if (v == NULL)
-			continue;
-		if (max == NULL) {
-			maxv = v;
-			max = src;
-			continue;
-		}
-		int rc;
-		rc = sf_compare(i->r->scheme, maxv, v);
-		switch (rc) {
-		case  0:
-			/*
-			assert(sv_lsn(v) < sv_lsn(maxv));
-			*/
-			src->dup = 1;
-			break;
-		case -1:
-			sv_mergeiter_dupreset(i, src);
-			maxv = v;
-			max = src;
-			break;
-		}
-	}
-	if (ssunlikely(max == NULL))
-		return;
-	i->v = max;
-}
 
-static inline void
-sv_mergeiter_next(ssiter *it)
-{
-	svmergeiter *im = (svmergeiter*)it->priv;
-	switch (im->order) {
-	case SS_GT:
-	case SS_GTE:
-		sv_mergeiter_gt(im);
-		break;
-	case SS_LT:
-	case SS_LTE:
-		sv_mergeiter_lt(im);
-		break;
-	default: assert(0);
-	}
-}
 
 static inline int
-sv_mergeiter_open(ssiter *i, sr *r, svmerge *m, ssorder o)
+sx_count(sxmanager *m) {
+	return m->count_rd + m->count_rw;
+}
+
+int sx_managerinit(sxmanager *m, srseq *seq, ssa *a)
 {
-	svmergeiter *im = (svmergeiter*)i->priv;
-	im->merge = m;
-	im->r     = r;
-	im->order = o;
-	im->src   = (svmergesrc*)(im->merge->buf.s);
-	im->end   = (svmergesrc*)(im->merge->buf.p);
-	im->v     = NULL;
-	sv_mergeiter_next(i);
+	ss_rbinit(&m->i);
+	m->count_rd = 0;
+	m->count_rw = 0;
+	m->count_gc = 0;
+	m->csn = 0;
+	m->gc  = NULL;
+	ss_spinlockinit(&m->lock);
+	ss_listinit(&m->indexes);
+	sx_vpool_init(&m->pool, a);
+	m->seq = seq;
 	return 0;
 }
 
-static inline void
-sv_mergeiter_close(ssiter *i ssunused)
-{ }
-
-static inline int
-sv_mergeiter_has(ssiter *i)
+int sx_managerfree(sxmanager *m)
 {
-	svmergeiter *im = (svmergeiter*)i->priv;
-	return im->v != NULL;
+	assert(sx_count(m) == 0);
+	sx_vpool_free(&m->pool);
+	ss_spinlockfree(&m->lock);
+	return 0;
 }
 
-static inline void*
-sv_mergeiter_of(ssiter *i)
+int sx_indexinit(sxindex *i, sxmanager *m, sr *r, so *object)
 {
-	svmergeiter *im = (svmergeiter*)i->priv;
-	if (ssunlikely(im->v == NULL))
-		return NULL;
-	return ss_iteratorof(im->v->i);
+	ss_rbinit(&i->i);
+	ss_listinit(&i->link);
+	i->dsn = 0;
+	i->object = object;
+	i->r = r;
+	ss_listappend(&m->indexes, &i->link);
+	return 0;
 }
 
-static inline uint32_t
-sv_mergeisdup(ssiter *i)
+int sx_indexset(sxindex *i, uint32_t dsn)
 {
-	svmergeiter *im = (svmergeiter*)i->priv;
-	assert(im->v != NULL);
-	if (im->v->dup)
-		return SVDUP;
+	i->dsn = dsn;
 	return 0;
 }
 
-extern ssiterif sv_mergeiter;
-
-#endif
-#line 1 "sophia/version/sv_readiter.h"
-#ifndef SV_READITER_H_
-#define SV_READITER_H_
-
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
-
-typedef struct svreaditer svreaditer;
+ss_rbtruncate(sx_truncate, sx_vfreeall( ((void**)arg)[1],
+                                        ((void**)arg)[0], sscast(n, sxv, node)))
 
-struct svreaditer {
-	ssiter   *merge;
-	uint64_t  vlsn;
-	int       next;
-	int       nextdup;
-	int       save_delete;
-	svupsert *u;
-	sr       *r;
-	char     *v;
-} sspacked;
+static inline void
+sx_indextruncate(sxindex *i, sxmanager *m)
+{
+	if (i->i.root == NULL)
+		return;
+	void *args[2] = { i->r, &m->pool };
+	sx_truncate(i->i.root, args);
+	ss_rbinit(&i->i);
+}
 
-static inline int
-sv_readiter_upsert(svreaditer *i)
+int sx_indexfree(sxindex *i, sxmanager *m)
 {
-	sv_upsertreset(i->u);
-	/* upsert begin */
-	char *v = ss_iterof(sv_mergeiter, i->merge);
-	assert(v != NULL);
-	assert(sf_flags(i->r->scheme, v) & SVUPSERT);
-	int rc = sv_upsertpush(i->u, i->r, v);
-	if (ssunlikely(rc == -1))
-		return -1;
-	ss_iternext(sv_mergeiter, i->merge);
-	/* iterate over upsert statements */
-	int skip = 0;
-	for (; ss_iterhas(sv_mergeiter, i->merge); ss_iternext(sv_mergeiter, i->merge))
-	{
-		v = ss_iterof(sv_mergeiter, i->merge);
-		int dup = sf_is(i->r->scheme, v, SVDUP) || sv_mergeisdup(i->merge);
-		if (! dup)
-			break;
-		if (skip)
-			continue;
-		int rc = sv_upsertpush(i->u, i->r, v);
-		if (ssunlikely(rc == -1))
-			return -1;
-		if (! (sf_flags(i->r->scheme, v) & SVUPSERT))
-			skip = 1;
-	}
-	/* upsert */
-	rc = sv_upsert(i->u, i->r);
-	if (ssunlikely(rc == -1))
-		return -1;
+	sx_indextruncate(i, m);
+	ss_listunlink(&i->link);
 	return 0;
 }
 
-static inline void
-sv_readiter_next(ssiter *i)
+uint64_t sx_vlsn(sxmanager *m)
 {
-	svreaditer *im = (svreaditer*)i->priv;
-	if (im->next)
-		ss_iternext(sv_mergeiter, im->merge);
-	im->next = 0;
-	im->v = NULL;
-	for (; ss_iterhas(sv_mergeiter, im->merge); ss_iternext(sv_mergeiter, im->merge))
-	{
-		char *v = ss_iterof(sv_mergeiter, im->merge);
-		int dup = sf_is(im->r->scheme, v, SVDUP) || sv_mergeisdup(im->merge);
-		if (im->nextdup) {
-			if (dup)
-				continue;
-			im->nextdup = 0;
-		}
-		/* skip version out of visible range */
-		if (sf_lsn(im->r->scheme, v) > im->vlsn) {
-			continue;
-		}
-		im->nextdup = 1;
-		if (ssunlikely(!im->save_delete && sf_is(im->r->scheme, v, SVDELETE)))
-			continue;
-		if (ssunlikely(sf_is(im->r->scheme, v, SVUPSERT))) {
-			int rc = sv_readiter_upsert(im);
-			if (ssunlikely(rc == -1))
-				return;
-			im->v = im->u->result;
-			im->next = 0;
-		} else {
-			im->v = v;
-			im->next = 1;
-		}
-		break;
+	ss_spinlock(&m->lock);
+	uint64_t vlsn;
+	if (sx_count(m) > 0) {
+		ssrbnode *node = ss_rbmin(&m->i);
+		sx *min = sscast(node, sx, node);
+		vlsn = min->vlsn;
+	} else {
+		vlsn = sr_seq(m->seq, SR_LSN);
 	}
+	ss_spinunlock(&m->lock);
+	return vlsn;
 }
 
-static inline void
-sv_readiter_forward(ssiter *i)
+int sx_vlsn_since(sxmanager *m, uint64_t lsn)
 {
-	svreaditer *im = (svreaditer*)i->priv;
-	if (im->next)
-		ss_iternext(sv_mergeiter, im->merge);
-	im->next = 0;
-	im->v = NULL;
-	for (; ss_iterhas(sv_mergeiter, im->merge); ss_iternext(sv_mergeiter, im->merge))
-	{
-		char *v = ss_iterof(sv_mergeiter, im->merge);
-		int dup = sf_is(im->r->scheme, v, SVDUP) || sv_mergeisdup(im->merge);
-		if (dup)
-			continue;
-		im->next = 0;
-		im->v = v;
-		break;
+	/* is any active transaction reading at lsn or later */
+	ss_spinlock(&m->lock);
+	int rc = 0;
+	ssrbnode *node = ss_rbmin(&m->i);
+	while (node) {
+		sx *x = sscast(node, sx, node);
+		if (x->vlsn >= lsn) {
+			rc = 1;
+			break;
+		}
+		node = ss_rbnext(&m->i, node);
 	}
+	ss_spinunlock(&m->lock);
+	return rc;
 }
 
-static inline int
-sv_readiter_open(ssiter *i, sr *r, ssiter *iterator, svupsert *u,
-                 uint64_t vlsn, int save_delete)
+ss_rbget(sx_matchtx, ss_cmp((sscast(n, sx, node))->id, sscastu64(key)))
+
+sx *sx_find(sxmanager *m, uint64_t id)
 {
-	svreaditer *im  = (svreaditer*)i->priv;
-	im->r           = r;
-	im->u           = u;
-	im->vlsn        = vlsn;
-	im->v           = NULL;
-	im->next        = 0;
-	im->nextdup     = 0;
-	im->save_delete = save_delete;
-	im->merge       = iterator;
-	assert(im->merge->vif == &sv_mergeiter);
-	/* iteration can start from duplicate */
-	sv_readiter_next(i);
-	return 0;
+	ssrbnode *n = NULL;
+	int rc = sx_matchtx(&m->i, NULL, (char*)&id, sizeof(id), &n);
+	if (rc == 0 && n)
+		return  sscast(n, sx, node);
+	return NULL;
 }
 
-static inline void
-sv_readiter_close(ssiter *i ssunused)
-{ }
-
-static inline int
-sv_readiter_has(ssiter *i)
+static inline sxstate
+sx_promote(sx *x, sxstate state)
 {
-	svreaditer *im = (svreaditer*)i->priv;
-	return im->v != NULL;
+	x->state = state;
+	return state;
 }
 
-static inline void*
-sv_readiter_of(ssiter *i)
+void sx_init(sxmanager *m, sx *x, svlog *log)
 {
-	svreaditer *im = (svreaditer*)i->priv;
-	if (ssunlikely(im->v == NULL))
-		return NULL;
-	return im->v;
+	x->manager = m;
+	x->log = log;
+	sx_promote(x, SX_UNDEF);
+	ss_listinit(&x->deadlock);
 }
 
-extern ssiterif sv_readiter;
-
-#endif
-#line 1 "sophia/version/sv_writeiter.h"
-#ifndef SV_WRITEITER_H_
-#define SV_WRITEITER_H_
-
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
-
-typedef struct svwriteiter svwriteiter;
-
-struct svwriteiter {
-	uint64_t  vlsn;
-	uint64_t  limit;
-	uint64_t  size;
-	uint32_t  sizev;
-	uint32_t  expire;
-	uint32_t  now;
-	int       next;
-	int       upsert;
-	uint64_t  prevlsn;
-	int       vdup;
-	char     *v;
-	svupsert *u;
-	ssiter   *merge;
-	sr       *r;
-} sspacked;
+sxstate sx_begin(sxmanager *m, sx *x, sxtype type, svlog *log, uint64_t vlsn)
+{
+	sx_init(m, x, log);
+	sx_promote(x, SX_READY);
+	x->type = type;
+	x->log_read = -1;
+	sr_seqlock(m->seq);
+	x->csn = m->csn;
+	x->id = sr_seqdo(m->seq, SR_TSNNEXT);
+	if (sslikely(vlsn == UINT64_MAX))
+		x->vlsn = sr_seqdo(m->seq, SR_LSN);
+	else
+		x->vlsn = vlsn;
+	sr_sequnlock(m->seq);
+	ss_spinlock(&m->lock);
+	ssrbnode *n = NULL;
+	int rc = sx_matchtx(&m->i, NULL, (char*)&x->id, sizeof(x->id), &n);
+	if (rc == 0 && n) {
+		assert(0);
+	} else {
+		ss_rbset(&m->i, n, rc, &x->node);
+	}
+	if (type == SX_RO)
+		m->count_rd++;
+	else
+		m->count_rw++;
+	ss_spinunlock(&m->lock);
+	return SX_READY;
+}
 
-static inline int
-sv_writeiter_upsert(svwriteiter *i)
+static inline void
+sx_untrack(sxv *v)
 {
-	/* apply upsert only on statements which are the latest or
-	 * ready to be garbage-collected */
-	sv_upsertreset(i->u);
-
-	/* upsert begin */
-	char *v = ss_iterof(sv_mergeiter, i->merge);
-	assert(v != NULL);
-	assert(sf_flags(i->r->scheme, v) & SVUPSERT);
-	assert(sf_lsn(i->r->scheme, v) <= i->vlsn);
-	int rc = sv_upsertpush(i->u, i->r, v);
-	if (ssunlikely(rc == -1))
-		return -1;
-	ss_iternext(sv_mergeiter, i->merge);
+	if (v->prev == NULL) {
+		sxindex *i = v->index;
+		if (v->next == NULL)
+			ss_rbremove(&i->i, &v->node);
+		else
+			ss_rbreplace(&i->i, &v->node, &v->next->node);
+	}
+	sx_vunlink(v);
+}
 
-	/* iterate over upsert statements */
-	int last_non_upd = 0;
-	for (; ss_iterhas(sv_mergeiter, i->merge); ss_iternext(sv_mergeiter, i->merge))
-	{
-		v = ss_iterof(sv_mergeiter, i->merge);
-		int flags = sf_flags(i->r->scheme, v);
-		int dup = sf_flagsequ(flags, SVDUP) || sv_mergeisdup(i->merge);
-		if (! dup)
-			break;
-		/* stop forming upserts on a second non-upsert stmt,
-		 * but continue to iterate stream */
-		if (last_non_upd)
+static inline uint64_t
+sx_csn(sxmanager *m)
+{
+	uint64_t csn = UINT64_MAX;
+	if (m->count_rw == 0)
+		return csn;
+	ssrbnode *p = ss_rbmin(&m->i);
+	sx *min = NULL;
+	while (p) {
+		min = sscast(p, sx, node);
+		if (min->type == SX_RO) {
+			p = ss_rbnext(&m->i, p);
 			continue;
-		last_non_upd = ! sf_flagsequ(flags, SVUPSERT);
-		int rc = sv_upsertpush(i->u, i->r, v);
-		if (ssunlikely(rc == -1))
-			return -1;
+		}
+		break;
 	}
-
-	/* upsert */
-	rc = sv_upsert(i->u, i->r);
-	if (ssunlikely(rc == -1))
-		return -1;
-	return 0;
+	assert(min != NULL);
+	return min->csn;
 }
 
 static inline void
-sv_writeiter_next(ssiter *i)
+sx_garbage_collect(sxmanager *m)
 {
-	svwriteiter *im = (svwriteiter*)i->priv;
-	if (im->next)
-		ss_iternext(sv_mergeiter, im->merge);
-	im->next = 0;
-	im->v = NULL;
-	im->vdup = 0;
-
-	for (; ss_iterhas(sv_mergeiter, im->merge); ss_iternext(sv_mergeiter, im->merge))
+	uint64_t min_csn = sx_csn(m);
+	sxv *gc = NULL;
+	uint32_t count = 0;
+	sxv *next;
+	sxv *v = m->gc;
+	for (; v; v = next)
 	{
-		char *v = ss_iterof(sv_mergeiter, im->merge);
-		/* expiration logic */
-		if (im->expire > 0) {
-			uint32_t timestamp = sf_ttl(im->r->scheme, v);
-			if ((im->now - timestamp) >= im->expire)
-				 continue;
-		}
-		uint64_t lsn = sf_lsn(im->r->scheme, v);
-		int flags = sf_flags(im->r->scheme, v);
-		int dup = sf_flagsequ(flags, SVDUP) || sv_mergeisdup(im->merge);
-		if (im->size >= im->limit) {
-			if (! dup)
-				break;
-		}
-
-		if (ssunlikely(dup)) {
-			/* keep atleast one visible version for <= vlsn */
-			if (im->prevlsn <= im->vlsn) {
-				if (im->upsert) {
-					im->upsert = sf_flagsequ(flags, SVUPSERT);
-				} else {
-					continue;
-				}
-			}
-		} else {
-			im->upsert = 0;
-			/* delete (stray) */
-			int del = sf_flagsequ(flags, SVDELETE);
-			if (ssunlikely(del && (lsn <= im->vlsn))) {
-				im->prevlsn = lsn;
-				continue;
-			}
-			im->size += im->sizev + sf_size(im->r->scheme, v);
-			/* upsert (track first statement start) */
-			if (sf_flagsequ(flags, SVUPSERT))
-				im->upsert = 1;
-		}
-
-		/* upsert */
-		if (sf_flagsequ(flags, SVUPSERT)) {
-			if (lsn <= im->vlsn) {
-				int rc;
-				rc = sv_writeiter_upsert(im);
-				if (ssunlikely(rc == -1))
-					return;
-				im->upsert = 0;
-				im->prevlsn = lsn;
-				im->v = im->u->result;
-				im->vdup = dup;
-				im->next = 0;
-				break;
-			}
+		next = v->gc;
+		sxindex *i = v->index;
+		assert(sv_vflags(v->v, i->r) & SVGET);
+		assert(sx_vcommitted(v));
+		if (v->csn > min_csn) {
+			v->gc = gc;
+			gc = v;
+			count++;
+			continue;
 		}
-
-		im->prevlsn = lsn;
-		im->v = v;
-		im->vdup = dup;
-		im->next = 1;
-		break;
+		sx_untrack(v);
+		sx_vfree(&m->pool, i->r, v);
 	}
+	m->count_gc = count;
+	m->gc = gc;
 }
 
-static inline int
-sv_writeiter_open(ssiter *i, sr *r, ssiter *merge, svupsert *u,
-                  uint64_t limit,
-                  uint32_t sizev,
-                  uint32_t expire,
-                  uint32_t timestamp,
-                  uint64_t vlsn)
+void sx_gc(sx *x)
 {
-	svwriteiter *im = (svwriteiter*)i->priv;
-	im->u       = u;
-	im->r       = r;
-	im->limit   = limit;
-	im->size    = 0;
-	im->sizev   = sizev;
-	im->expire  = expire;
-	im->now     = timestamp;
-	im->vlsn    = vlsn;
-	im->next    = 0;
-	im->prevlsn = 0;
-	im->v       = NULL;
-	im->vdup    = 0;
-	im->upsert  = 0;
-	im->merge   = merge;
-	assert(im->merge->vif == &sv_mergeiter);
-	sv_writeiter_next(i);
-	return 0;
+	sxmanager *m = x->manager;
+	sx_promote(x, SX_UNDEF);
+	x->log = NULL;
+	if (m->count_gc == 0)
+		return;
+	sx_garbage_collect(m);
 }
 
 static inline void
-sv_writeiter_close(ssiter *i ssunused)
-{ }
-
-static inline int
-sv_writeiter_has(ssiter *i)
+sx_end(sx *x)
 {
-	svwriteiter *im = (svwriteiter*)i->priv;
-	return im->v != NULL;
+	sxmanager *m = x->manager;
+	ss_spinlock(&m->lock);
+	ss_rbremove(&m->i, &x->node);
+	if (x->type == SX_RO)
+		m->count_rd--;
+	else
+		m->count_rw--;
+	ss_spinunlock(&m->lock);
 }
 
-static inline void*
-sv_writeiter_of(ssiter *i)
+static inline void
+sx_rollback_svp(sx *x, ssiter *i, int free)
 {
-	svwriteiter *im = (svwriteiter*)i->priv;
-	if (ssunlikely(im->v == NULL))
-		return NULL;
-	return im->v;
+	sxmanager *m = x->manager;
+	for (; ss_iterhas(ss_bufiter, i); ss_iternext(ss_bufiter, i))
+	{
+		svlogv *lv = ss_iterof(ss_bufiter, i);
+		sxv *v = lv->ptr;
+		/* remove from index and replace head with
+		 * a first waiter */
+		sx_untrack(v);
+		lv->ptr = NULL;
+		if (free) {
+			sxindex *i = v->index;
+			sv_vunref(i->r, v->v);
+		}
+		sx_vpool_push(&m->pool, v);
+	}
 }
 
-static inline int
-sv_writeiter_resume(ssiter *i)
+sxstate sx_rollback(sx *x)
 {
-	svwriteiter *im = (svwriteiter*)i->priv;
-	im->v       = ss_iterof(sv_mergeiter, im->merge);
-	if (ssunlikely(im->v == NULL))
-		return 0;
-	im->vdup    = sf_is(im->r->scheme, im->v, SVDUP) || sv_mergeisdup(im->merge);
-	im->prevlsn = sf_lsn(im->r->scheme, im->v);
-	im->next    = 1;
-	im->upsert  = 0;
-	im->size    = im->sizev + sf_size(im->r->scheme, im->v);
-	return 1;
+	assert(x->state != SX_COMMIT);
+	ssiter i;
+	ss_iterinit(ss_bufiter, &i);
+	ss_iteropen(ss_bufiter, &i, &x->log->buf, sizeof(svlogv));
+	sx_rollback_svp(x, &i, 1);
+	sx_promote(x, SX_ROLLBACK);
+	sx_end(x);
+	return SX_ROLLBACK;
 }
 
 static inline int
-sv_writeiter_is_duplicate(ssiter *i)
+sx_vupsert(sxv *v)
 {
-	svwriteiter *im = (svwriteiter*)i->priv;
-	assert(im->v != NULL);
-	return im->vdup;
+	sxindex *i = v->index;
+	return (sv_vflags(v->v, i->r) & SVUPSERT) > 0;
 }
 
-extern ssiterif sv_writeiter;
-
-#endif
-#line 1 "sophia/version/sv_index.h"
-#ifndef SC_INDEX_H_
-#define SC_INDEX_H_
+static inline void
+sx_vabort_waiters(sxv *v)
+{
+	/* upsert statements are merged on top of the
+	 * committed version and may proceed */
+	while (v) {
+		if (! sx_vupsert(v))
+			sx_vabort(v);
+		v = v->next;
+	}
+}
 
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
+static inline int
+sx_preparecb(sx *x, svlogv *v, uint64_t lsn, sxpreparef prepare, void *arg)
+{
+	if (sslikely(lsn == x->vlsn))
+		return 0;
+	if (prepare == NULL)
+		return 0;
+	sxindex *i = ((sxv*)v->ptr)->index;
+	if (prepare(x, v->v, i->object, arg))
+		return 1;
+	return 0;
+}
 
-typedef struct svindexpos svindexpos;
-typedef struct svindex svindex;
+sxstate sx_prepare(sx *x, sxpreparef prepare, void *arg)
+{
+	uint64_t lsn = sr_seq(x->manager->seq, SR_LSN);
+	/* proceed read-only transactions */
+	if (x->type == SX_RO || sv_logcount_write(x->log) == 0)
+		return sx_promote(x, SX_PREPARE);
+	ssiter i;
+	ss_iterinit(ss_bufiter, &i);
+	ss_iteropen(ss_bufiter, &i, &x->log->buf, sizeof(svlogv));
+	sxstate rc;
+	for (; ss_iterhas(ss_bufiter, &i); ss_iternext(ss_bufiter, &i))
+	{
+		svlogv *lv = ss_iterof(ss_bufiter, &i);
+		sxv *v = lv->ptr;
+		if ((int)v->lo == x->log_read)
+			break;
+		if (sx_vaborted(v))
+			return sx_promote(x, SX_ROLLBACK);
+		/* upsert does not depend on the version it is applied to,
+		 * concurrent updates are not treated as conflicts */
+		if (sx_vupsert(v))
+			continue;
+		if (sslikely(v->prev == NULL)) {
+			rc = sx_preparecb(x, lv, lsn, prepare, arg);
+			if (ssunlikely(rc != 0))
+				return sx_promote(x, SX_ROLLBACK);
+			continue;
+		}
+		if (sx_vcommitted(v->prev)) {
+			if (v->prev->csn > x->csn)
+				return sx_promote(x, SX_ROLLBACK);
+			continue;
+		}
+		/* force commit for read-only conflicts */
+		sxindex *i = v->prev->index;
+		if (sv_vflags(v->prev->v, i->r) & SVGET) {
+			rc = sx_preparecb(x, lv, lsn, prepare, arg);
+			if (ssunlikely(rc != 0))
+				return sx_promote(x, SX_ROLLBACK);
+			continue;
+		}
+		return sx_promote(x, SX_LOCK);
+	}
+	return sx_promote(x, SX_PREPARE);
+}
 
-struct svindexpos {
-	ssrbnode *node;
-	int rc;
-};
+sxstate sx_commit(sx *x)
+{
+	if (x->state == SX_COMMIT)
+		return SX_COMMIT;
+	assert(x->state == SX_PREPARE);
+	sxmanager *m = x->manager;
+	ssiter i;
+	ss_iterinit(ss_bufiter, &i);
+	ss_iteropen(ss_bufiter, &i, &x->log->buf, sizeof(svlogv));
+	uint64_t csn = ++m->csn;
+	for (; ss_iterhas(ss_bufiter, &i); ss_iternext(ss_bufiter, &i))
+	{
+		svlogv *lv = ss_iterof(ss_bufiter, &i);
+		sxv *v = lv->ptr;
+		if ((int)v->lo == x->log_read)
+			break;
+		/* abort conflict reader */
+		if (v->prev && !sx_vcommitted(v->prev)) {
+			sxindex *i = v->prev->index;
+			if (sv_vflags(v->prev->v, i->r) & SVGET)
+				sx_vabort(v->prev);
+			else
+				assert(sx_vupsert(v));
+		}
+		/* abort waiters */
+		sx_vabort_waiters(v->next);
+		/* mark stmt as commited */
+		sx_vcommit(v, csn);
+		lv->ptr = NULL;
+		/* schedule read stmt for gc */
+		sxindex *i = v->index;
+		if (sv_vflags(v->v, i->r) & SVGET) {
+			sv_vref(v->v);
+			v->gc = m->gc;
+			m->gc = v;
+			m->count_gc++;
+		} else {
+			sx_untrack(v);
+			sx_vpool_push(&m->pool, v);
+		}
+	}
 
-struct svindex {
-	ssrb i;
-	uint32_t count;
-	uint32_t used;
-	uint64_t lsnmin;
-} sspacked;
+	/* rollback latest reads */
+	sx_rollback_svp(x, &i, 0);
 
-ss_rbget(sv_indexmatch,
-         sf_compare(scheme, sv_vpointer(sscast(n, svv, node)), key))
+	sx_promote(x, SX_COMMIT);
+	sx_end(x);
+	return SX_COMMIT;
+}
 
-int  sv_indexinit(svindex*);
-int  sv_indexfree(svindex*, sr*);
-int  sv_indexupdate(svindex*, sr*, svindexpos*, svv*);
-svv *sv_indexget(svindex*, sr*, svindexpos*, svv*);
+ss_rbget(sx_match,
+         sf_compare(scheme, sv_vpointer((sscast(n, sxv, node))->v), key))
 
-static inline int
-sv_indexset(svindex *i, sr *r, svv *v)
+int sx_set(sx *x, sxindex *index, svv *version)
 {
-	svindexpos pos;
-	sv_indexget(i, r, &pos, v);
-	sv_indexupdate(i, r, &pos, v);
-	return 0;
-}
-
-#endif
-#line 1 "sophia/version/sv_indexiter.h"
-#ifndef SV_INDEXITER_H_
-#define SV_INDEXITER_H_
+	sxmanager *m = x->manager;
+	sr *r = index->r;
 
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
+	svlogv lv;
+	lv.index_id = index->dsn;
+	lv.next     = UINT32_MAX;
+	lv.v        = version;
+	lv.ptr      = NULL;
 
-typedef struct svindexiter svindexiter;
+	/* allocate mvcc container */
+	sxv *v = sx_valloc(&m->pool, version);
+	if (ssunlikely(v == NULL)) {
+		sv_vunref(r, version);
+		return -1;
+	}
+	v->id    = x->id;
+	v->index = index;
+	lv.ptr   = v;
 
-struct svindexiter {
-	svindex  *index;
-	ssrbnode *v;
-	svv      *vcur;
-	ssorder   order;
-} sspacked;
+	if (! (sv_vflags(version, index->r) & SVGET))
+		x->log_read = -1;
 
-static inline int
-sv_indexiter_open(ssiter *i, sr *r, svindex *index, ssorder o, char *key)
-{
-	svindexiter *ii = (svindexiter*)i->priv;
-	ii->index = index;
-	ii->order = o;
-	ii->v     = NULL;
-	ii->vcur  = NULL;
+	/* update concurrent index */
+	ssrbnode *n = NULL;
 	int rc;
-	int eq = 0;
-	switch (ii->order) {
-	case SS_LT:
-	case SS_LTE:
-		if (ssunlikely(key == NULL)) {
-			ii->v = ss_rbmax(&ii->index->i);
-			break;
-		}
-		rc = sv_indexmatch(&ii->index->i, r->scheme, key, 0, &ii->v);
-		if (ii->v == NULL)
-			break;
-		switch (rc) {
-		case 0:
-			eq = 1;
-			if (ii->order == SS_LT)
-				ii->v = ss_rbprev(&ii->index->i, ii->v);
-			break;
-		case 1:
-			ii->v = ss_rbprev(&ii->index->i, ii->v);
-			break;
-		}
-		break;
-	case SS_GT:
-	case SS_GTE:
-		if (ssunlikely(key == NULL)) {
-			ii->v = ss_rbmin(&ii->index->i);
-			break;
+	rc = sx_match(&index->i, index->r->scheme,
+	              sv_vpointer(version), 0, &n);
+	if (ssunlikely(rc == 0 && n)) {
+		/* exists */
+	} else {
+		int pos = rc;
+		/* unique */
+		v->lo = sv_logcount(x->log);
+		rc = sv_logadd(x->log, r, &lv);
+		if (ssunlikely(rc == -1)) {
+			sr_oom(r->e);
+			goto error;
 		}
-		rc = sv_indexmatch(&ii->index->i, r->scheme, key, 0, &ii->v);
-		if (ii->v == NULL)
-			break;
-		switch (rc) {
-		case  0:
-			eq = 1;
-			if (ii->order == SS_GT)
-				ii->v = ss_rbnext(&ii->index->i, ii->v);
-			break;
-		case -1:
-			ii->v = ss_rbnext(&ii->index->i, ii->v);
-			break;
+		ss_rbset(&index->i, n, pos, &v->node);
+		return 0;
+	}
+	sxv *head = sscast(n, sxv, node);
+	/* match previous update made by current
+	 * transaction */
+	sxv *own = sx_vmatch(head, x->id);
+	if (ssunlikely(own))
+	{
+		if (ssunlikely(sv_vflags(version, index->r) & SVUPSERT)) {
+			sr_error(r->e, "%s", "only one upsert statement is "
+			         "allowed per a transaction key");
+			goto error;
 		}
-		break;
-	default: assert(0);
+		/* replace old document with the new one */
+		lv.next = sv_logat(x->log, own->lo)->next;
+		v->lo = own->lo;
+		if (ssunlikely(sx_vaborted(own)))
+			sx_vabort(v);
+		sx_vreplace(own, v);
+		if (sslikely(head == own))
+			ss_rbreplace(&index->i, &own->node, &v->node);
+		/* update log */
+		sv_logreplace(x->log, r, v->lo, &lv);
+
+		sx_vfree(&m->pool, r, own);
+		return 0;
 	}
-	ii->vcur = NULL;
-	if (ii->v) {
-		ii->vcur = sscast(ii->v, svv, node);
+	/* update log */
+	v->lo = sv_logcount(x->log);
+	rc = sv_logadd(x->log, r, &lv);
+	if (ssunlikely(rc == -1)) {
+		sr_oom(r->e);
+		goto error;
 	}
-	return eq;
+	/* add version */
+	sx_vlink(head, v);
+	return 0;
+error:
+	sx_vfree(&m->pool, r, v);
+	return -1;
 }
 
-static inline void
-sv_indexiter_close(ssiter *i ssunused)
-{}
-
-static inline int
-sv_indexiter_has(ssiter *i)
+int sx_get(sx *x, sxindex *index, svv *key, svv **result)
 {
-	svindexiter *ii = (svindexiter*)i->priv;
-	return ii->v != NULL;
-}
+	ssrbnode *n = NULL;
+	int rc;
+	rc = sx_match(&index->i, index->r->scheme,
+	              sv_vpointer(key), 0, &n);
+	if (! (rc == 0 && n))
+		goto add;
+	sxv *head = sscast(n, sxv, node);
+	sxv *v = sx_vmatch(head, x->id);
+	if (v == NULL)
+		goto add;
+	if (ssunlikely(sv_vflags(v->v, index->r) & SVGET))
+		return 0;
+	if (ssunlikely(sv_vflags(v->v, index->r) & SVDELETE))
+		return 2;
+	*result = sv_vbuildraw(index->r, sv_vpointer(v->v));
+	if (ssunlikely(*result == NULL)) {
+		sr_oom(index->r->e);
+		rc = -1;
+	} else {
+		rc = 1;
+	}
+	return rc;
 
-static inline void*
-sv_indexiter_of(ssiter *i)
-{
-	svindexiter *ii = (svindexiter*)i->priv;
-	if (ssunlikely(ii->v == NULL))
-		return NULL;
-	return sv_vpointer(ii->vcur);
+add:
+	/* track a start of the latest read sequence in the
+	 * transactional log */
+	if (x->log_read == -1)
+		x->log_read = sv_logcount(x->log);
+	rc = sx_set(x, index, key);
+	if (ssunlikely(rc == -1))
+		return -1;
+	sv_vref(key);
+	return 0;
 }
 
-static inline void
-sv_indexiter_next(ssiter *i)
+sxstate sx_set_autocommit(sxmanager *m, sxindex *index, sx *x, svlog *log, svv *v)
 {
-	svindexiter *ii = (svindexiter*)i->priv;
-	if (ssunlikely(ii->v == NULL))
-		return;
-	assert(ii->vcur != NULL);
-	svv *v = ii->vcur->next;
-	if (v) {
-		ii->vcur = v;
-		return;
+	if (sslikely(m->count_rw == 0)) {
+		sx_init(m, x, log);
+		svlogv lv;
+		lv.index_id = index->dsn;
+		lv.next     = UINT32_MAX;
+		lv.v        = v;
+		lv.ptr      = NULL;
+		sv_logadd(x->log, index->r, &lv);
+		sr_seq(index->r->seq, SR_TSNNEXT);
+		sx_promote(x, SX_COMMIT);
+		return SX_COMMIT;
 	}
-	switch (ii->order) {
-	case SS_LT:
-	case SS_LTE:
-		ii->v = ss_rbprev(&ii->index->i, ii->v);
+	sx_begin(m, x, SX_RW, log, 0);
+	int rc = sx_set(x, index, v);
+	if (ssunlikely(rc == -1)) {
+		sx_rollback(x);
+		return SX_ROLLBACK;
+	}
+	sxstate s = sx_prepare(x, NULL, NULL);
+	switch (s) {
+	case SX_PREPARE:
+		s = sx_commit(x);
 		break;
-	case SS_GT:
-	case SS_GTE:
-		ii->v = ss_rbnext(&ii->index->i, ii->v);
+	case SX_LOCK:
+		s = sx_rollback(x);
 		break;
-	default: assert(0);
-	}
-	if (sslikely(ii->v)) {
-		ii->vcur = sscast(ii->v, svv, node);
-	} else {
-		ii->vcur = NULL;
+	case SX_ROLLBACK:
+		break;
+	default:
+		assert(0);
 	}
+	return s;
 }
 
-extern ssiterif sv_indexiter;
-
-#endif
-#line 1 "sophia/version/sv_index.c"
+sxstate sx_get_autocommit(sxmanager *m, sxindex *index)
+{
+	(void)m;
+	sr_seq(index->r->seq, SR_TSNNEXT);
+	return SX_COMMIT;
+}
+#line 1 "sophia/transaction/sx_deadlock.c"
 
 /*
  * sophia database
@@ -17205,81 +21627,77 @@ extern ssiterif sv_indexiter;
 
 
 
-ss_rbtruncate(sv_indextruncate,
-              sv_vfree((sr*)arg, sscast(n, svv, node)))
-
-int sv_indexinit(svindex *i)
-{
-	i->lsnmin = UINT64_MAX;
-	i->count  = 0;
-	i->used   = 0;
-	ss_rbinit(&i->i);
-	return 0;
-}
 
-int sv_indexfree(svindex *i, sr *r)
+static inline int
+sx_deadlock_in(sxmanager *m, sslist *mark, sx *t, sx *p)
 {
-	if (i->i.root)
-		sv_indextruncate(i->i.root, r);
-	ss_rbinit(&i->i);
+	if (p->deadlock.next != &p->deadlock)
+		return 0;
+	ss_listappend(mark, &p->deadlock);
+	ssiter i;
+	ss_iterinit(ss_bufiter, &i);
+	ss_iteropen(ss_bufiter, &i, &p->log->buf, sizeof(svlogv));
+	for (; ss_iterhas(ss_bufiter, &i); ss_iternext(ss_bufiter, &i))
+	{
+		svlogv *lv = ss_iterof(ss_bufiter, &i);
+		sxv *v = lv->ptr;
+		if (v->prev == NULL)
+			continue;
+		do {
+			sx *n = sx_find(m, v->id);
+			assert(n != NULL);
+			if (ssunlikely(n == t))
+				return 1;
+			int rc = sx_deadlock_in(m, mark, t, n);
+			if (ssunlikely(rc == 1))
+				return 1;
+			v = v->prev;
+		} while (v);
+	}
 	return 0;
 }
 
-static inline svv*
-sv_vset(svv *head, svv *v, sr *r)
+static inline void
+sx_deadlock_unmark(sslist *mark)
 {
-	assert(sv_vlsn(head, r) != sv_vlsn(v, r));
-	/* default */
-	if (sslikely(sv_vlsn(head, r) < sv_vlsn(v, r))) {
-		v->next = head;
-		sf_flagsset(r->scheme, sv_vpointer(head),
-		            sv_vflags(head, r) | SVDUP);
-		return v;
-	}
-	/* redistribution (starting from highest lsn) */
-	svv *prev = head;
-	svv *c = head->next;
-	while (c) {
-		assert(sv_vlsn(c, r) != sv_vlsn(v, r));
-		if (sv_vlsn(c, r) < sv_vlsn(v, r))
-			break;
-		prev = c;
-		c = c->next;
+	sslist *i, *n;
+	ss_listforeach_safe(mark, i, n) {
+		sx *t = sscast(i, sx, deadlock);
+		ss_listinit(&t->deadlock);
 	}
-	prev->next = v;
-	v->next = c;
-	sf_flagsset(r->scheme, sv_vpointer(v),
-	            sv_vflags(v, r) | SVDUP);
-	return head;
-}
-
-svv*
-sv_indexget(svindex *i, sr *r, svindexpos *p, svv *v)
-{
-	p->rc = sv_indexmatch(&i->i, r->scheme, sv_vpointer(v), 0,
-	                      &p->node);
-	if (p->rc == 0 && p->node)
-		return sscast(p->node, svv, node);
-	return NULL;
 }
 
-int sv_indexupdate(svindex *i, sr *r, svindexpos *p, svv *v)
+int sx_deadlock(sx *t)
 {
-	if (p->rc == 0 && p->node) {
-		svv *head = sscast(p->node, svv, node);
-		svv *update = sv_vset(head, v, r);
-		if (head != update)
-			ss_rbreplace(&i->i, p->node, &update->node);
-	} else {
-		ss_rbset(&i->i, p->node, p->rc, &v->node);
+	sxmanager *m = t->manager;
+	sslist mark;
+	ss_listinit(&mark);
+	ssiter i;
+	ss_iterinit(ss_bufiter, &i);
+	ss_iteropen(ss_bufiter, &i, &t->log->buf, sizeof(svlogv));
+	while (ss_iterhas(ss_bufiter, &i))
+	{
+		svlogv *lv = ss_iterof(ss_bufiter, &i);
+		sxv *v = lv->ptr;
+		if (v->prev == NULL) {
+			ss_iternext(ss_bufiter, &i);
+			continue;
+		}
+		sx *p = sx_find(m, v->prev->id);
+		assert(p != NULL);
+		int rc = sx_deadlock_in(m, &mark, t, p);
+		if (ssunlikely(rc)) {
+			sx_deadlock_unmark(&mark);
+			return 1;
+		}
+		ss_iternext(ss_bufiter, &i);
 	}
-	if (sv_vlsn(v, r) < i->lsnmin)
-		i->lsnmin = sv_vlsn(v, r);
-	i->count++;
-	i->used += sv_vsize(v, r);
+	sx_deadlock_unmark(&mark);
 	return 0;
 }
-#line 1 "sophia/version/sv_indexiter.c"
+#line 1 "sophia/wal/sw_conf.h"
+#ifndef SW_CONF_H_
+#define SW_CONF_H_
 
 /*
  * sophia database
@@ -17289,19 +21707,55 @@ int sv_indexupdate(svindex *i, sr *r, svindexpos *p, svv *v)
  * BSD License
 */
 
+typedef struct swconf swconf;
 
+struct swconf {
+	uint32_t  enable;
+	char     *path;
+	uint32_t  sync_on_rotate;
+	uint32_t  sync_on_write;
+	uint32_t  rotatewm;
+	uint32_t  group_commit_max_batch;
+	uint32_t  group_commit_max_wait_us;
+};
 
+void sw_confinit(swconf*);
+void sw_conffree(swconf*, ssa*);
+int  sw_confset_path(swconf*, ssa*, char*);
 
+#endif
+#line 1 "sophia/wal/sw_dir.h"
+#ifndef SW_DIR_H_
+#define SW_DIR_H_
 
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
 
-ssiterif sv_indexiter =
-{
-	.close   = sv_indexiter_close,
-	.has     = sv_indexiter_has,
-	.of      = sv_indexiter_of,
-	.next    = sv_indexiter_next
+typedef struct swdirtype swdirtype;
+typedef struct swdirid swdirid;
+
+struct swdirtype {
+	char *ext;
+	uint32_t mask;
+	int count;
 };
-#line 1 "sophia/version/sv_mergeiter.c"
+
+struct swdirid {
+	uint32_t mask;
+	uint64_t id;
+};
+
+int sw_dirread(ssbuf*, ssa*, swdirtype*, char*);
+
+#endif
+#line 1 "sophia/wal/sw_v.h"
+#ifndef SW_V_H_
+#define SW_V_H_
 
 /*
  * sophia database
@@ -17311,19 +21765,24 @@ ssiterif sv_indexiter =
  * BSD License
 */
 
+typedef struct swv swv;
 
+struct swv {
+	uint32_t crc;
+	uint32_t dsn;
+	uint32_t size;
+	uint8_t  flags;
+} sspacked;
 
+static inline char*
+sw_vpointer(swv *v) {
+	return (char*)v + sizeof(*v);
+}
 
-
-
-ssiterif sv_mergeiter =
-{
-	.close = sv_mergeiter_close,
-	.has   = sv_mergeiter_has,
-	.of    = sv_mergeiter_of,
-	.next  = sv_mergeiter_next
-};
-#line 1 "sophia/version/sv_readiter.c"
+#endif
+#line 1 "sophia/wal/sw.h"
+#ifndef SW_H_
+#define SW_H_
 
 /*
  * sophia database
@@ -17333,19 +21792,72 @@ ssiterif sv_mergeiter =
  * BSD License
 */
 
+typedef struct sw sw;
+typedef struct swmanager swmanager;
+typedef struct swtx swtx;
+
+struct sw {
+	uint64_t   id;
+	ssgc       gc;
+	ssmutex    filelock;
+	ssfile     file;
+	swmanager *p;
+	sslist     link;
+	sslist     linkcopy;
+};
 
+struct swmanager {
+	ssspinlock lock;
+	swconf     conf;
+	sslist     list;
+	int        gc;
+	int        n;
+	ssiov      iov;
+	uint64_t   wsn;
+	ssmutex    group_lock;
+	sscond     group_cond;
+	int        group_leader;
+	int        group_error;
+	uint64_t   group_wsn;
+	sshist     hist_write;
+	sshist     hist_sync;
+	sr        *r;
+};
 
+struct swtx {
+	swmanager *p;
+	sw        *l;
+	int        recover;
+	uint64_t   lsn;
+	uint64_t   svp;
+};
 
+static inline swconf*
+sw_conf(swmanager *p) {
+	return &p->conf;
+}
 
+int sw_managerinit(swmanager*, sr*);
+int sw_manageropen(swmanager*);
+int sw_managerrotate(swmanager*);
+int sw_managerrotate_ready(swmanager*);
+int sw_managershutdown(swmanager*);
+int sw_managergc_enable(swmanager*, int);
+int sw_managergc(swmanager*);
+int sw_managerfiles(swmanager*);
+int sw_managercopy(swmanager*, char*, ssbuf*);
+uint64_t sw_managerwsn(swmanager*);
+int sw_managersync(swmanager*, uint64_t);
 
-ssiterif sv_readiter =
-{
-	.close   = sv_readiter_close,
-	.has     = sv_readiter_has,
-	.of      = sv_readiter_of,
-	.next    = sv_readiter_next
-};
-#line 1 "sophia/version/sv_writeiter.c"
+int sw_begin(swmanager*, swtx*, uint64_t, int);
+int sw_commit(swtx*);
+int sw_rollback(swtx*);
+int sw_write(swtx*, svlog*);
+
+#endif
+#line 1 "sophia/wal/sw_iter.h"
+#ifndef SW_ITER_H_
+#define SW_ITER_H_
 
 /*
  * sophia database
@@ -17355,21 +21867,14 @@ ssiterif sv_readiter =
  * BSD License
 */
 
+int sw_iter_open(ssiter *i, sr*, ssfile*, int);
+int sw_iter_error(ssiter*);
+int sw_iter_continue(ssiter*);
 
+extern ssiterif sw_iter;
 
-
-
-
-ssiterif sv_writeiter =
-{
-	.close   = sv_writeiter_close,
-	.has     = sv_writeiter_has,
-	.of      = sv_writeiter_of,
-	.next    = sv_writeiter_next
-};
-#line 1 "sophia/transaction/sx_v.h"
-#ifndef SX_V_H_
-#define SX_V_H_
+#endif
+#line 1 "sophia/wal/sw.c"
 
 /*
  * sophia database
@@ -17379,995 +21884,1098 @@ ssiterif sv_writeiter =
  * BSD License
 */
 
-typedef struct sxv sxv;
-typedef struct sxvpool sxvpool;
 
-struct sxv {
-	uint64_t  id;
-	uint32_t  lo;
-	uint64_t  csn;
-	uint8_t   conflict;
-	void     *index;
-	svv      *v;
-	sxv      *next;
-	sxv      *prev;
-	sxv      *gc;
-	ssrbnode  node;
-} sspacked;
 
-struct sxvpool {
-	sxv *head;
-	int n;
-	ssa *a;
-};
 
-static inline void
-sx_vpool_init(sxvpool *p, ssa *a)
+
+
+
+static inline sw*
+sw_alloc(swmanager *p, uint64_t id)
+{
+	sw *l = ss_malloc(p->r->a, sizeof(*l));
+	if (ssunlikely(l == NULL)) {
+		sr_oom_malfunction(p->r->e);
+		return NULL;
+	}
+	l->id = id;
+	l->p  = NULL;
+	ss_gcinit(&l->gc);
+	ss_mutexinit(&l->filelock);
+	ss_fileinit(&l->file, p->r->vfs);
+	ss_listinit(&l->link);
+	ss_listinit(&l->linkcopy);
+	return l;
+}
+
+static inline int
+sw_close(swmanager *p, sw *l)
+{
+	int rc = ss_fileclose(&l->file);
+	if (ssunlikely(rc == -1)) {
+		sr_malfunction(p->r->e, "log file '%s' close error: %s",
+		               ss_pathof(&l->file.path),
+		               strerror(errno));
+	}
+	ss_mutexfree(&l->filelock);
+	ss_gcfree(&l->gc);
+	ss_free(p->r->a, l);
+	return rc;
+}
+
+static inline sw*
+sw_open(swmanager *p, uint64_t id)
+{
+	sw *l = sw_alloc(p, id);
+	if (ssunlikely(l == NULL))
+		return NULL;
+	sspath path;
+	ss_path(&path, p->conf.path, id, ".log");
+	int rc = ss_fileopen(&l->file, path.path, 0);
+	if (ssunlikely(rc == -1)) {
+		sr_malfunction(p->r->e, "log file '%s' open error: %s",
+		               ss_pathof(&l->file.path),
+		               strerror(errno));
+		goto error;
+	}
+	return l;
+error:
+	sw_close(p, l);
+	return NULL;
+}
+
+static inline sw*
+sw_new(swmanager *p, uint64_t id)
+{
+	sw *l = sw_alloc(p, id);
+	if (ssunlikely(l == NULL))
+		return NULL;
+	sspath path;
+	ss_path(&path, p->conf.path, id, ".log");
+	int rc = ss_filenew(&l->file, path.path, 0);
+	if (ssunlikely(rc == -1)) {
+		sr_malfunction(p->r->e, "log file '%s' create error: %s",
+		               path.path, strerror(errno));
+		goto error;
+	}
+	srversion v;
+	sr_version_storage(&v);
+	rc = ss_filewrite(&l->file, &v, sizeof(v));
+	if (ssunlikely(rc == -1)) {
+		sr_malfunction(p->r->e, "log file '%s' header write error: %s",
+		               ss_pathof(&l->file.path),
+		               strerror(errno));
+		goto error;
+	}
+	return l;
+error:
+	sw_close(p, l);
+	return NULL;
+}
+
+int sw_managerinit(swmanager *p, sr *r)
 {
-	p->head = NULL;
-	p->n = 0;
-	p->a = a;
+	ss_spinlockinit(&p->lock);
+	ss_listinit(&p->list);
+	sw_confinit(&p->conf);
+	p->n    = 0;
+	p->r    = r;
+	p->gc   = 1;
+	ss_mutexinit(&p->group_lock);
+	ss_condinit(&p->group_cond);
+	p->wsn          = 0;
+	p->group_leader = 0;
+	p->group_error  = 0;
+	p->group_wsn    = 0;
+	ss_histinit(&p->hist_write);
+	ss_histinit(&p->hist_sync);
+	struct iovec *iov =
+		ss_malloc(r->a, sizeof(struct iovec) * 1021);
+	if (ssunlikely(iov == NULL))
+		return sr_oom_malfunction(r->e);
+	ss_iovinit(&p->iov, iov, 1021);
+	return 0;
 }
 
-static inline void
-sx_vpool_free(sxvpool *p)
+static inline int
+sw_managercreate(swmanager *p)
 {
-	sxv *n, *c = p->head;
-	while (c) {
-		n = c->next;
-		ss_free(p->a, c);
-		c = n;
-	}
+	int rc;
+	rc = ss_vfsmkdir(p->r->vfs, p->conf.path, 0755);
+	if (ssunlikely(rc == -1))
+		return sr_malfunction(p->r->e, "log directory '%s' create error: %s",
+		                      p->conf.path, strerror(errno));
+	return 1;
 }
 
-static inline sxv*
-sx_vpool_pop(sxvpool *p)
+static inline int
+sw_managerrecover(swmanager *p)
 {
-	if (ssunlikely(p->n == 0))
-		return NULL;
-	sxv *v = p->head;
-	p->head = v->next;
-	p->n--;
-	return v;
+	ssbuf list;
+	ss_bufinit(&list);
+	swdirtype types[] =
+	{
+		{ "log", 1, 0 },
+		{ NULL,  0, 0 }
+	};
+	int rc = sw_dirread(&list, p->r->a, types, p->conf.path);
+	if (ssunlikely(rc == -1))
+		return sr_malfunction(p->r->e, "log directory '%s' open error",
+		                      p->conf.path);
+	ssiter i;
+	ss_iterinit(ss_bufiter, &i);
+	ss_iteropen(ss_bufiter, &i, &list, sizeof(swdirid));
+	while(ss_iterhas(ss_bufiter, &i)) {
+		swdirid *id = ss_iterof(ss_bufiter, &i);
+		sw *l = sw_open(p, id->id);
+		if (ssunlikely(l == NULL)) {
+			ss_buffree(&list, p->r->a);
+			return -1;
+		}
+		l->gc.complete = 1;
+		ss_listappend(&p->list, &l->link);
+		p->n++;
+		ss_iternext(ss_bufiter, &i);
+	}
+	ss_buffree(&list, p->r->a);
+	if (p->n) {
+		sw *last = sscast(p->list.prev, sw, link);
+		last->gc.complete = 0;
+		rc = ss_fileseek(&last->file, last->file.size);
+		if (ssunlikely(rc == -1)) {
+			return sr_malfunction(p->r->e, "log file '%s' seek error: %s",
+			                      ss_pathof(&last->file.path),
+			                      strerror(errno));
+		}
+		p->r->seq->lfsn = last->id;
+		p->r->seq->lfsn++;
+	}
+	return 0;
 }
 
-static inline void
-sx_vpool_push(sxvpool *p, sxv *v)
+int sw_manageropen(swmanager *p)
 {
-	v->v    = NULL;
-	v->next = NULL;
-	v->prev = NULL;
-	v->next = p->head;
-	p->head = v;
-	p->n++;
+	if (ssunlikely(! p->conf.enable))
+		return 0;
+	int exists = ss_vfsexists(p->r->vfs, p->conf.path);
+	int rc;
+	if (! exists) {
+		rc = sw_managercreate(p);
+		if (ssunlikely(rc == -1))
+			return -1;
+		rc = sw_managerrotate(p);
+		if (ssunlikely(rc == -1))
+			return -1;
+	} else {
+		rc = sw_managerrecover(p);
+		if (ssunlikely(rc == -1))
+			return -1;
+	}
+	return 0;
 }
 
-static inline sxv*
-sx_valloc(sxvpool *p, svv *ref)
+static inline int
+sw_managergroup(swmanager *p)
 {
-	sxv *v = sx_vpool_pop(p);
-	if (ssunlikely(v == NULL)) {
-		v = ss_malloc(p->a, sizeof(sxv));
-		if (ssunlikely(v == NULL))
-			return NULL;
-	}
-	v->index    = NULL;
-	v->id       = 0;
-	v->lo       = 0;
-	v->csn      = 0;
-	v->v        = ref;
-	v->next     = NULL;
-	v->prev     = NULL;
-	v->gc       = NULL;
-	v->conflict = 0;
-	memset(&v->node, 0, sizeof(v->node));
-	return v;
+	return p->conf.group_commit_max_batch > 0 && p->conf.sync_on_write;
 }
 
 static inline void
-sx_vfree(sxvpool *p, sr *r, sxv *v)
+sw_managerlead(swmanager *p)
 {
-	sv_vunref(r, v->v);
-	sx_vpool_push(p, v);
+	ss_mutexlock(&p->group_lock);
+	while (p->group_leader)
+		ss_condwait(&p->group_cond, &p->group_lock);
+	p->group_leader = 1;
+	ss_mutexunlock(&p->group_lock);
 }
 
 static inline void
-sx_vfreeall(sxvpool *p, sr *r, sxv *v)
+sw_managerlead_end(swmanager *p, uint64_t wsn, int rc)
 {
-	while (v) {
-		sxv *next = v->next;
-		sx_vfree(p, r, v);
-		v = next;
-	}
+	ss_mutexlock(&p->group_lock);
+	if (ssunlikely(rc == -1))
+		p->group_error = 1;
+	else
+	if (wsn > p->group_wsn)
+		p->group_wsn = wsn;
+	p->group_leader = 0;
+	ss_condbroadcast(&p->group_cond);
+	ss_mutexunlock(&p->group_lock);
 }
 
-static inline sxv*
-sx_vmatch(sxv *head, uint64_t id)
+int sw_managerrotate(swmanager *p)
 {
-	sxv *c = head;
-	while (c) {
-		if (c->id == id)
-			break;
-		c = c->next;
+	if (ssunlikely(! p->conf.enable))
+		return 0;
+	/* with group commit, writes to the current log may
+	 * still wait for their sync: rotation syncs them
+	 * itself, acting as the group leader */
+	int group = sw_managergroup(p);
+	if (group)
+		sw_managerlead(p);
+	int rc = 0;
+	uint64_t wsn = 0;
+	uint64_t lfsn = sr_seq(p->r->seq, SR_LFSNNEXT);
+	sw *l = sw_new(p, lfsn);
+	if (ssunlikely(l == NULL)) {
+		rc = -1;
+		goto done;
 	}
-	return c;
+	sw *log = NULL;
+	ss_spinlock(&p->lock);
+	if (p->n)
+		log = sscast(p->list.prev, sw, link);
+	ss_listappend(&p->list, &l->link);
+	p->n++;
+	wsn = p->wsn;
+	ss_spinunlock(&p->lock);
+	if (log) {
+		assert(log->file.fd != -1);
+		if (p->conf.sync_on_rotate || group) {
+			rc = ss_filesync(&log->file);
+			if (ssunlikely(rc == -1)) {
+				sr_malfunction(p->r->e, "log file '%s' sync error: %s",
+				               ss_pathof(&log->file.path),
+				               strerror(errno));
+				goto done;
+			}
+		}
+		ss_fileadvise(&log->file, SS_ADVISE_DONTNEED, 0, log->file.size);
+		ss_gccomplete(&log->gc);
+	}
+done:
+	if (group)
+		sw_managerlead_end(p, wsn, rc);
+	return rc;
 }
 
-static inline void
-sx_vreplace(sxv *v, sxv *n)
+int sw_managerrotate_ready(swmanager *p)
 {
-	if (v->prev)
-		v->prev->next = n;
-	if (v->next)
-		v->next->prev = n;
-	n->next = v->next;
-	n->prev = v->prev;
+	if (ssunlikely(! p->conf.enable))
+		return 0;
+	ss_spinlock(&p->lock);
+	assert(p->n > 0);
+	sw *l = sscast(p->list.prev, sw, link);
+	int ready = ss_gcrotateready(&l->gc, p->conf.rotatewm);
+	ss_spinunlock(&p->lock);
+	return ready;
 }
 
-static inline void
-sx_vlink(sxv *head, sxv *v)
+int sw_managershutdown(swmanager *p)
 {
-	sxv *c = head;
-	while (c->next)
-		c = c->next;
-	c->next = v;
-	v->prev = c;
-	v->next = NULL;
+	int rcret = 0;
+	int rc;
+	if (p->n) {
+		sslist *i, *n;
+		ss_listforeach_safe(&p->list, i, n) {
+			sw *l = sscast(i, sw, link);
+			rc = sw_close(p, l);
+			if (ssunlikely(rc == -1))
+				rcret = -1;
+		}
+	}
+	if (p->iov.v)
+		ss_free(p->r->a, p->iov.v);
+	sw_conffree(&p->conf, p->r->a);
+	ss_condfree(&p->group_cond);
+	ss_mutexfree(&p->group_lock);
+	ss_spinlockfree(&p->lock);
+	return rcret;
 }
 
-static inline void
-sx_vunlink(sxv *v)
+uint64_t sw_managerwsn(swmanager *p)
 {
-	if (v->prev)
-		v->prev->next = v->next;
-	if (v->next)
-		v->next->prev = v->prev;
-	v->prev = NULL;
-	v->next = NULL;
+	ss_spinlock(&p->lock);
+	uint64_t wsn = p->wsn;
+	ss_spinunlock(&p->lock);
+	return wsn;
 }
 
 static inline void
-sx_vcommit(sxv *v, uint32_t csn)
+sw_managersync_lead(swmanager *p)
 {
-	v->id  = UINT64_MAX;
-	v->lo  = UINT32_MAX;
-	v->csn = csn;
+	uint64_t max_wait = p->conf.group_commit_max_wait_us;
+	/* give concurrent committers a chance to write
+	 * their transactions before the sync */
+	if (max_wait > 0) {
+		ss_spinlock(&p->lock);
+		uint64_t pending = p->wsn - p->group_wsn;
+		ss_spinunlock(&p->lock);
+		if (pending < p->conf.group_commit_max_batch) {
+			if (max_wait > 999999)
+				max_wait = 999999;
+			ss_sleep(max_wait * 1000);
+		}
+	}
+	ss_spinlock(&p->lock);
+	assert(p->n > 0);
+	sw *l = sscast(p->list.prev, sw, link);
+	uint64_t wsn = p->wsn;
+	ss_spinunlock(&p->lock);
+	uint64_t start = ss_utime();
+	int rc = ss_filesync(&l->file);
+	if (ssunlikely(rc == -1))
+		sr_malfunction(p->r->e, "log file '%s' sync error: %s",
+		               ss_pathof(&l->file.path),
+		               strerror(errno));
+	else
+		ss_histadd(&p->hist_sync, ss_utime() - start);
+	sw_managerlead_end(p, wsn, rc);
+}
+
+int sw_managersync(swmanager *p, uint64_t wsn)
+{
+	/* group commit: transactions are written to the log
+	 * one by one, the caller then waits here (without the
+	 * api lock) until a sync covers its write. The first
+	 * waiter to find no active leader syncs on behalf of
+	 * every write made so far */
+	ss_mutexlock(&p->group_lock);
+	for (;;) {
+		if (ssunlikely(p->group_error)) {
+			ss_mutexunlock(&p->group_lock);
+			return -1;
+		}
+		if (p->group_wsn >= wsn)
+			break;
+		if (p->group_leader) {
+			ss_condwait(&p->group_cond, &p->group_lock);
+			continue;
+		}
+		p->group_leader = 1;
+		ss_mutexunlock(&p->group_lock);
+		sw_managersync_lead(p);
+		ss_mutexlock(&p->group_lock);
+	}
+	ss_mutexunlock(&p->group_lock);
+	return 0;
 }
 
 static inline int
-sx_vcommitted(sxv *v)
+sw_gc(swmanager *p, sw *l)
 {
-	return v->id == UINT64_MAX && v->lo == UINT32_MAX;
+	int rc;
+	rc = ss_vfsunlink(p->r->vfs, ss_pathof(&l->file.path));
+	if (ssunlikely(rc == -1)) {
+		return sr_malfunction(p->r->e, "log file '%s' unlink error: %s",
+		                      ss_pathof(&l->file.path),
+		                      strerror(errno));
+	}
+	rc = sw_close(p, l);
+	if (ssunlikely(rc == -1))
+		return -1;
+	return 1;
 }
 
-static inline void
-sx_vabort(sxv *v)
+int sw_managergc_enable(swmanager *p, int enable)
 {
-	v->conflict = 1;
+	ss_spinlock(&p->lock);
+	p->gc = enable;
+	ss_spinunlock(&p->lock);
+	return 0;
 }
 
-static inline void
-sx_vabort_all(sxv *v)
+int sw_managergc(swmanager *p)
 {
-	while (v) {
-		sx_vabort(v);
-		v = v->next;
+	if (ssunlikely(! p->conf.enable))
+		return 0;
+	for (;;) {
+		ss_spinlock(&p->lock);
+		if (ssunlikely(! p->gc)) {
+			ss_spinunlock(&p->lock);
+			return 0;
+		}
+		sw *current = NULL;
+		sslist *i;
+		ss_listforeach(&p->list, i) {
+			sw *l = sscast(i, sw, link);
+			if (sslikely(! ss_gcgarbage(&l->gc)))
+				continue;
+			ss_listunlink(&l->link);
+			p->n--;
+			current = l;
+			break;
+		}
+		ss_spinunlock(&p->lock);
+		if (current) {
+			int rc = sw_gc(p, current);
+			if (ssunlikely(rc == -1))
+				return -1;
+		} else {
+			break;
+		}
 	}
+	return 0;
 }
 
-static inline int
-sx_vaborted(sxv *v)
+int sw_managerfiles(swmanager *p)
 {
-	return v->conflict;
-}
-
-#endif
-#line 1 "sophia/transaction/sx.h"
-#ifndef SX_H_
-#define SX_H_
-
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
-
-typedef struct sxmanager sxmanager;
-typedef struct sxindex sxindex;
-typedef struct sx sx;
-
-typedef enum {
-	SX_UNDEF,
-	SX_ROLLBACK,
-	SX_LOCK,
-	SX_READY,
-	SX_COMMIT,
-	SX_PREPARE
-} sxstate;
-
-typedef enum {
-	SX_RO,
-	SX_RW
-} sxtype;
-
-struct sxindex {
-	ssrb      i;
-	uint32_t  dsn;
-	so       *object;
-	sr       *r;
-	sslist    link;
-};
-
-typedef int (*sxpreparef)(sx*, svv*, so*, void*);
-
-struct sx {
-	sxtype     type;
-	sxstate    state;
-	uint64_t   id;
-	uint64_t   vlsn;
-	uint64_t   csn;
-	int        log_read;
-	svlog     *log;
-	sslist     deadlock;
-	ssrbnode   node;
-	sxmanager *manager;
-};
-
-struct sxmanager {
-	ssspinlock  lock;
-	sslist      indexes;
-	ssrb        i;
-	uint32_t    count_rd;
-	uint32_t    count_rw;
-	uint32_t    count_gc;
-	uint64_t    csn;
-	sxv        *gc;
-	sxvpool     pool;
-	srseq      *seq;
-};
-
-int       sx_managerinit(sxmanager*, srseq*, ssa*);
-int       sx_managerfree(sxmanager*);
-int       sx_indexinit(sxindex*, sxmanager*, sr*, so*);
-int       sx_indexset(sxindex*, uint32_t);
-int       sx_indexfree(sxindex*, sxmanager*);
-sx       *sx_find(sxmanager*, uint64_t);
-void      sx_init(sxmanager*, sx*, svlog*);
-sxstate   sx_begin(sxmanager*, sx*, sxtype, svlog*, uint64_t);
-void      sx_gc(sx*);
-sxstate   sx_prepare(sx*, sxpreparef, void*);
-sxstate   sx_commit(sx*);
-sxstate   sx_rollback(sx*);
-int       sx_set(sx*, sxindex*, svv*);
-int       sx_get(sx*, sxindex*, svv*, svv**);
-uint64_t  sx_vlsn(sxmanager*);
-sxstate   sx_set_autocommit(sxmanager*, sxindex*, sx*, svlog*, svv*);
-sxstate   sx_get_autocommit(sxmanager*, sxindex*);
-
-#endif
-#line 1 "sophia/transaction/sx_deadlock.h"
-#ifndef SX_DEADLOCK_H_
-#define SX_DEADLOCK_H_
-
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
-
-int sx_deadlock(sx*);
-
-#endif
-#line 1 "sophia/transaction/sx.c"
-
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
-
-
-
-
-
-
-
-
-static inline int
-sx_count(sxmanager *m) {
-	return m->count_rd + m->count_rw;
+	ss_spinlock(&p->lock);
+	int n = p->n;
+	ss_spinunlock(&p->lock);
+	return n;
 }
 
-int sx_managerinit(sxmanager *m, srseq *seq, ssa *a)
+int sw_managercopy(swmanager *p, char *dest, ssbuf *buf)
 {
-	ss_rbinit(&m->i);
-	m->count_rd = 0;
-	m->count_rw = 0;
-	m->count_gc = 0;
-	m->csn = 0;
-	m->gc  = NULL;
-	ss_spinlockinit(&m->lock);
-	ss_listinit(&m->indexes);
-	sx_vpool_init(&m->pool, a);
-	m->seq = seq;
+	sslist list;
+	ss_listinit(&list);
+	ss_spinlock(&p->lock);
+	sw *current = sscast(p->list.prev, sw, link);
+	sslist *i;
+	ss_listforeach(&p->list, i) {
+		sw *l = sscast(i, sw, link);
+		if (ss_gcinprogress(&l->gc))
+			break;
+		ss_listappend(&list, &l->linkcopy);
+	}
+	ss_spinunlock(&p->lock);
+
+	ss_bufreset(buf);
+	sslist *n;
+	ss_listforeach_safe(&list, i, n)
+	{
+		sw *l = sscast(i, sw, linkcopy);
+		ss_listinit(&l->linkcopy);
+		sspath path;
+		ss_path(&path, dest, l->id, ".log");
+		/* rotated log files are not written anymore */
+		int rc;
+		if (l != current &&
+		    sr_backuplink(p->r->backup, p->r->vfs,
+		                  ss_pathof(&l->file.path), path.path)) {
+			rc = sr_backupadd(p->r->backup, p->r->a, "log", path.path,
+			                  l->file.size, 1);
+			if (ssunlikely(rc == -1))
+				return sr_oom(p->r->e);
+			continue;
+		}
+		ssfile file;
+		ss_fileinit(&file, p->r->vfs);
+		rc = ss_filenew(&file, path.path, 0);
+		if (ssunlikely(rc == -1)) {
+			sr_error(p->r->e, "log file '%s' create error: %s",
+			         path.path, strerror(errno));
+			return -1;
+		}
+		rc = ss_bufensure(buf, p->r->a, l->file.size);
+		if (ssunlikely(rc == -1)) {
+			sr_oom(p->r->e);
+			ss_fileclose(&file);
+			return -1;
+		}
+		rc = ss_filepread(&l->file, 0, buf->s, l->file.size);
+		if (ssunlikely(rc == -1)) {
+			sr_error(p->r->e, "log file '%s' read error: %s",
+			         ss_pathof(&l->file.path),
+			         strerror(errno));
+			ss_fileclose(&file);
+			return -1;
+		}
+		ss_bufadvance(buf, l->file.size);
+		rc = ss_filewrite(&file, buf->s, l->file.size);
+		if (ssunlikely(rc == -1)) {
+			sr_error(p->r->e, "log file '%s' write error: %s",
+			         path.path,
+			         strerror(errno));
+			ss_fileclose(&file);
+			return -1;
+		}
+		/* sync? */
+		rc = ss_fileclose(&file);
+		if (ssunlikely(rc == -1)) {
+			sr_error(p->r->e, "log file '%s' close error: %s",
+			         path.path, strerror(errno));
+			return -1;
+		}
+		ss_bufreset(buf);
+		rc = sr_backupadd(p->r->backup, p->r->a, "log", path.path,
+		                  file.size, 0);
+		if (ssunlikely(rc == -1))
+			return sr_oom(p->r->e);
+	}
 	return 0;
 }
 
-int sx_managerfree(sxmanager *m)
+int sw_begin(swmanager *p, swtx *t, uint64_t lsn, int recover)
 {
-	assert(sx_count(m) == 0);
-	sx_vpool_free(&m->pool);
-	ss_spinlockfree(&m->lock);
+	ss_spinlock(&p->lock);
+	if (sslikely(lsn == 0)) {
+		lsn = sr_seq(p->r->seq, SR_LSNNEXT);
+	} else {
+		sr_seqlock(p->r->seq);
+		if (lsn > p->r->seq->lsn)
+			p->r->seq->lsn = lsn;
+		sr_sequnlock(p->r->seq);
+	}
+	t->lsn = lsn;
+	t->recover = recover;
+	t->svp = 0;
+	t->p = p;
+	t->l = NULL;
+	if (! p->conf.enable)
+		return 0;
+	assert(p->n > 0);
+	sw *l = sscast(p->list.prev, sw, link);
+	ss_mutexlock(&l->filelock);
+	t->svp = ss_filesvp(&l->file);
+	t->l = l;
+	t->p = p;
 	return 0;
 }
 
-int sx_indexinit(sxindex *i, sxmanager *m, sr *r, so *object)
+int sw_commit(swtx *t)
 {
-	ss_rbinit(&i->i);
-	ss_listinit(&i->link);
-	i->dsn = 0;
-	i->object = object;
-	i->r = r;
-	ss_listappend(&m->indexes, &i->link);
+	if (t->p->conf.enable)
+		ss_mutexunlock(&t->l->filelock);
+	ss_spinunlock(&t->p->lock);
 	return 0;
 }
 
-int sx_indexset(sxindex *i, uint32_t dsn)
+int sw_rollback(swtx *t)
 {
-	i->dsn = dsn;
-	return 0;
+	int rc = 0;
+	if (t->p->conf.enable) {
+		rc = ss_filerlb(&t->l->file, t->svp);
+		if (ssunlikely(rc == -1))
+			sr_malfunction(t->p->r->e, "log file '%s' truncate error: %s",
+			               ss_pathof(&t->l->file.path),
+			               strerror(errno));
+		ss_mutexunlock(&t->l->filelock);
+	}
+	ss_spinunlock(&t->p->lock);
+	return rc;
 }
 
-ss_rbtruncate(sx_truncate, sx_vfreeall( ((void**)arg)[1],
-                                        ((void**)arg)[0], sscast(n, sxv, node)))
-
 static inline void
-sx_indextruncate(sxindex *i, sxmanager *m)
+sw_writeadd(swmanager *p, swtx *t, svlog *vlog, swv *lv, svlogv *logv)
 {
-	if (i->i.root == NULL)
-		return;
-	void *args[2] = { i->r, &m->pool };
-	sx_truncate(i->i.root, args);
-	ss_rbinit(&i->i);
+	sr *r = sv_logindex(vlog, logv->index_id)->r;
+	char *data = sv_vpointer(logv->v);
+	lv->dsn   = logv->index_id;
+	lv->flags = sf_flags(r->scheme, data);
+	lv->size  = sf_size(r->scheme, data);
+	lv->crc   = ss_crcp(p->r->crc, data, lv->size, 0);
+	lv->crc   = ss_crcs(p->r->crc, lv, sizeof(swv), lv->crc);
+	ss_iovadd(&p->iov, lv, sizeof(swv));
+	ss_iovadd(&p->iov, data, lv->size);
+	logv->v->log = t->l;
 }
 
-int sx_indexfree(sxindex *i, sxmanager *m)
+static inline int
+sw_writestmt(swtx *t, svlog *vlog)
 {
-	sx_indextruncate(i, m);
-	ss_listunlink(&i->link);
+	swmanager *p = t->p;
+	svlogv *stmt = NULL;
+	ssiter i;
+	ss_iterinit(ss_bufiter, &i);
+	ss_iteropen(ss_bufiter, &i, &vlog->buf, sizeof(svlogv));
+	for (; ss_iterhas(ss_bufiter, &i); ss_iternext(ss_bufiter, &i)) {
+		svlogv *logv = ss_iterof(ss_bufiter, &i);
+		svv *v = logv->v;
+		sr *r = sv_logindex(vlog, logv->index_id)->r;
+		sf_lsnset(r->scheme, sv_vpointer(v), t->lsn);
+		if (sslikely(! (sf_is(r->scheme, sv_vpointer(v), SVGET)))) {
+			assert(stmt == NULL);
+			stmt = logv;
+		}
+	}
+	assert(stmt != NULL);
+	swv lv;
+	sw_writeadd(t->p, t, vlog, &lv, stmt);
+	int rc = ss_filewritev(&t->l->file, &p->iov);
+	if (ssunlikely(rc == -1)) {
+		sr_malfunction(p->r->e, "log file '%s' write error: %s",
+		               ss_pathof(&t->l->file.path),
+		               strerror(errno));
+		return -1;
+	}
+	ss_gcmark(&t->l->gc, 1);
+	ss_iovreset(&p->iov);
 	return 0;
 }
 
-uint64_t sx_vlsn(sxmanager *m)
+static int
+sw_writestmt_multi(swtx *t, svlog *vlog)
 {
-	ss_spinlock(&m->lock);
-	uint64_t vlsn;
-	if (sx_count(m) > 0) {
-		ssrbnode *node = ss_rbmin(&m->i);
-		sx *min = sscast(node, sx, node);
-		vlsn = min->vlsn;
-	} else {
-		vlsn = sr_seq(m->seq, SR_LSN);
+	swmanager *p = t->p;
+	sw *l = t->l;
+	swv lvbuf[510]; /* 1 + 510 per syscall */
+	int lvp;
+	int rc;
+	lvp = 0;
+	/* transaction header */
+	swv *lv = &lvbuf[0];
+	lv->dsn   = 0;
+	lv->flags = SVBEGIN;
+	lv->size  = sv_logcount_write(vlog);
+	lv->crc   = ss_crcs(p->r->crc, lv, sizeof(swv), 0);
+	ss_iovadd(&p->iov, lv, sizeof(swv));
+	lvp++;
+	/* body */
+	ssiter i;
+	ss_iterinit(ss_bufiter, &i);
+	ss_iteropen(ss_bufiter, &i, &vlog->buf, sizeof(svlogv));
+	for (; ss_iterhas(ss_bufiter, &i); ss_iternext(ss_bufiter, &i))
+	{
+		if (ssunlikely(! ss_iovensure(&p->iov, 2))) {
+			rc = ss_filewritev(&l->file, &p->iov);
+			if (ssunlikely(rc == -1)) {
+				sr_malfunction(p->r->e, "log file '%s' write error: %s",
+				               ss_pathof(&l->file.path),
+				               strerror(errno));
+				return -1;
+			}
+			ss_iovreset(&p->iov);
+			lvp = 0;
+		}
+		svlogv *logv = ss_iterof(ss_bufiter, &i);
+		svv *v = logv->v;
+		sr *r = sv_logindex(vlog, logv->index_id)->r;
+		sf_lsnset(r->scheme, sv_vpointer(v), t->lsn);
+		if (sf_is(r->scheme, sv_vpointer(v), SVGET))
+			continue;
+		lv = &lvbuf[lvp];
+		sw_writeadd(p, t, vlog, lv, logv);
+		lvp++;
 	}
-	ss_spinunlock(&m->lock);
-	return vlsn;
-}
-
-ss_rbget(sx_matchtx, ss_cmp((sscast(n, sx, node))->id, sscastu64(key)))
-
-sx *sx_find(sxmanager *m, uint64_t id)
-{
-	ssrbnode *n = NULL;
-	int rc = sx_matchtx(&m->i, NULL, (char*)&id, sizeof(id), &n);
-	if (rc == 0 && n)
-		return  sscast(n, sx, node);
-	return NULL;
-}
-
-static inline sxstate
-sx_promote(sx *x, sxstate state)
-{
-	x->state = state;
-	return state;
-}
-
-void sx_init(sxmanager *m, sx *x, svlog *log)
-{
-	x->manager = m;
-	x->log = log;
-	sx_promote(x, SX_UNDEF);
-	ss_listinit(&x->deadlock);
+	if (sslikely(ss_iovhas(&p->iov))) {
+		rc = ss_filewritev(&l->file, &p->iov);
+		if (ssunlikely(rc == -1)) {
+			sr_malfunction(p->r->e, "log file '%s' write error: %s",
+			               ss_pathof(&l->file.path),
+			               strerror(errno));
+			return -1;
+		}
+		ss_iovreset(&p->iov);
+	}
+	ss_gcmark(&l->gc, sv_logcount_write(vlog));
+	return 0;
 }
 
-sxstate sx_begin(sxmanager *m, sx *x, sxtype type, svlog *log, uint64_t vlsn)
+int sw_write(swtx *t, svlog *vlog)
 {
-	sx_init(m, x, log);
-	sx_promote(x, SX_READY);
-	x->type = type;
-	x->log_read = -1;
-	sr_seqlock(m->seq);
-	x->csn = m->csn;
-	x->id = sr_seqdo(m->seq, SR_TSNNEXT);
-	if (sslikely(vlsn == UINT64_MAX))
-		x->vlsn = sr_seqdo(m->seq, SR_LSN);
-	else
-		x->vlsn = vlsn;
-	sr_sequnlock(m->seq);
-	ss_spinlock(&m->lock);
-	ssrbnode *n = NULL;
-	int rc = sx_matchtx(&m->i, NULL, (char*)&x->id, sizeof(x->id), &n);
-	if (rc == 0 && n) {
-		assert(0);
-	} else {
-		ss_rbset(&m->i, n, rc, &x->node);
+	int count = sv_logcount_write(vlog);
+	/* fast path for log-disabled, recover or
+	 * ro-transactions
+	 */
+	if (t->recover || !t->p->conf.enable || count == 0)
+	{
+		ssiter i;
+		ss_iterinit(ss_bufiter, &i);
+		ss_iteropen(ss_bufiter, &i, &vlog->buf, sizeof(svlogv));
+		for (; ss_iterhas(ss_bufiter, &i); ss_iternext(ss_bufiter, &i))
+		{
+			svlogv *v = ss_iterof(ss_bufiter, &i);
+			sr *r = sv_logindex(vlog, v->index_id)->r;
+			sf_lsnset(r->scheme, sv_vpointer(v->v), t->lsn);
+		}
+		return 0;
 	}
-	if (type == SX_RO)
-		m->count_rd++;
-	else
-		m->count_rw++;
-	ss_spinunlock(&m->lock);
-	return SX_READY;
-}
 
-static inline void
-sx_untrack(sxv *v)
-{
-	if (v->prev == NULL) {
-		sxindex *i = v->index;
-		if (v->next == NULL)
-			ss_rbremove(&i->i, &v->node);
-		else
-			ss_rbreplace(&i->i, &v->node, &v->next->node);
+	/* write single or multi-stmt transaction */
+	uint64_t start = ss_utime();
+	int rc;
+	if (sslikely(count == 1)) {
+		rc = sw_writestmt(t, vlog);
+	} else {
+		rc = sw_writestmt_multi(t, vlog);
+	}
+	if (ssunlikely(rc == -1))
+		return -1;
+	uint64_t now = ss_utime();
+	ss_histadd(&t->p->hist_write, now - start);
+
+	/* sync, or leave it to sw_managersync() when
+	 * group commit is enabled */
+	if (t->p->conf.sync_on_write) {
+		if (t->p->conf.group_commit_max_batch > 0) {
+			t->p->wsn++;
+			return 0;
+		}
+		rc = ss_filesync(&t->l->file);
+		if (ssunlikely(rc == -1)) {
+			sr_malfunction(t->p->r->e, "log file '%s' sync error: %s",
+			               ss_pathof(&t->l->file.path),
+			               strerror(errno));
+			return -1;
+		}
+		ss_histadd(&t->p->hist_sync, ss_utime() - now);
 	}
-	sx_vunlink(v);
+	return 0;
 }
+#line 1 "sophia/wal/sw_conf.c"
 
-static inline uint64_t
-sx_csn(sxmanager *m)
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+
+
+
+
+
+
+void sw_confinit(swconf *c)
 {
-	uint64_t csn = UINT64_MAX;
-	if (m->count_rw == 0)
-		return csn;
-	ssrbnode *p = ss_rbmin(&m->i);
-	sx *min = NULL;
-	while (p) {
-		min = sscast(p, sx, node);
-		if (min->type == SX_RO) {
-			p = ss_rbnext(&m->i, p);
-			continue;
-		}
-		break;
-	}
-	assert(min != NULL);
-	return min->csn;
+	c->enable         = 1;
+	c->path           = NULL;
+	c->rotatewm       = 500000;
+	c->sync_on_write  = 0;
+	c->sync_on_rotate = 1;
+	c->group_commit_max_batch   = 0;
+	c->group_commit_max_wait_us = 0;
 }
 
-static inline void
-sx_garbage_collect(sxmanager *m)
+void sw_conffree(swconf *c, ssa *a)
 {
-	uint64_t min_csn = sx_csn(m);
-	sxv *gc = NULL;
-	uint32_t count = 0;
-	sxv *next;
-	sxv *v = m->gc;
-	for (; v; v = next)
-	{
-		next = v->gc;
-		sxindex *i = v->index;
-		assert(sv_vflags(v->v, i->r) & SVGET);
-		assert(sx_vcommitted(v));
-		if (v->csn > min_csn) {
-			v->gc = gc;
-			gc = v;
-			count++;
-			continue;
-		}
-		sx_untrack(v);
-		sx_vfree(&m->pool, i->r, v);
-	}
-	m->count_gc = count;
-	m->gc = gc;
+	if (c->path)
+		ss_free(a, c->path);
 }
 
-void sx_gc(sx *x)
+int sw_confset_path(swconf *c, ssa *a, char *path)
 {
-	sxmanager *m = x->manager;
-	sx_promote(x, SX_UNDEF);
-	x->log = NULL;
-	if (m->count_gc == 0)
-		return;
-	sx_garbage_collect(m);
+	char *sz = ss_strdup(a, path);
+	if (ssunlikely(sz == NULL))
+		return -1;
+	if (c->path)
+		ss_free(a, c->path);
+	c->path = sz;
+	return 0;
 }
+#line 1 "sophia/wal/sw_dir.c"
 
-static inline void
-sx_end(sx *x)
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+
+
+
+
+
+
+static inline ssize_t sw_diridof(char *s)
 {
-	sxmanager *m = x->manager;
-	ss_spinlock(&m->lock);
-	ss_rbremove(&m->i, &x->node);
-	if (x->type == SX_RO)
-		m->count_rd--;
-	else
-		m->count_rw--;
-	ss_spinunlock(&m->lock);
+	size_t v = 0;
+	while (*s && *s != '.') {
+		if (ssunlikely(!isdigit(*s)))
+			return -1;
+		v = (v * 10) + *s - '0';
+		s++;
+	}
+	return v;
 }
 
-static inline void
-sx_rollback_svp(sx *x, ssiter *i, int free)
+static inline swdirid*
+sw_dirmatch(ssbuf *list, uint64_t id)
 {
-	sxmanager *m = x->manager;
-	for (; ss_iterhas(ss_bufiter, i); ss_iternext(ss_bufiter, i))
-	{
-		svlogv *lv = ss_iterof(ss_bufiter, i);
-		sxv *v = lv->ptr;
-		/* remove from index and replace head with
-		 * a first waiter */
-		sx_untrack(v);
-		lv->ptr = NULL;
-		if (free) {
-			sxindex *i = v->index;
-			sv_vunref(i->r, v->v);
-		}
-		sx_vpool_push(&m->pool, v);
+	if (ssunlikely(ss_bufused(list) == 0))
+		return NULL;
+	swdirid *n = (swdirid*)list->s;
+	while ((char*)n < list->p) {
+		if (n->id == id)
+			return n;
+		n++;
 	}
+	return NULL;
 }
 
-sxstate sx_rollback(sx *x)
+static inline swdirtype*
+sw_dirtypeof(swdirtype *types, char *ext)
 {
-	assert(x->state != SX_COMMIT);
-	ssiter i;
-	ss_iterinit(ss_bufiter, &i);
-	ss_iteropen(ss_bufiter, &i, &x->log->buf, sizeof(svlogv));
-	sx_rollback_svp(x, &i, 1);
-	sx_promote(x, SX_ROLLBACK);
-	sx_end(x);
-	return SX_ROLLBACK;
+	swdirtype *p = &types[0];
+	int n = 0;
+	while (p[n].ext != NULL) {
+		if (strcmp(p[n].ext, ext) == 0)
+			return &p[n];
+		n++;
+	}
+	return NULL;
 }
 
-static inline int
-sx_preparecb(sx *x, svlogv *v, uint64_t lsn, sxpreparef prepare, void *arg)
+static int
+sw_dircmp(const void *p1, const void *p2)
 {
-	if (sslikely(lsn == x->vlsn))
-		return 0;
-	if (prepare == NULL)
-		return 0;
-	sxindex *i = ((sxv*)v->ptr)->index;
-	if (prepare(x, v->v, i->object, arg))
-		return 1;
-	return 0;
+	swdirid *a = (swdirid*)p1;
+	swdirid *b = (swdirid*)p2;
+	assert(a->id != b->id);
+	return (a->id > b->id)? 1: -1;
 }
 
-sxstate sx_prepare(sx *x, sxpreparef prepare, void *arg)
+int sw_dirread(ssbuf *list, ssa *a, swdirtype *types, char *dir)
 {
-	uint64_t lsn = sr_seq(x->manager->seq, SR_LSN);
-	/* proceed read-only transactions */
-	if (x->type == SX_RO || sv_logcount_write(x->log) == 0)
-		return sx_promote(x, SX_PREPARE);
-	ssiter i;
-	ss_iterinit(ss_bufiter, &i);
-	ss_iteropen(ss_bufiter, &i, &x->log->buf, sizeof(svlogv));
-	sxstate rc;
-	for (; ss_iterhas(ss_bufiter, &i); ss_iternext(ss_bufiter, &i))
-	{
-		svlogv *lv = ss_iterof(ss_bufiter, &i);
-		sxv *v = lv->ptr;
-		if ((int)v->lo == x->log_read)
-			break;
-		if (sx_vaborted(v))
-			return sx_promote(x, SX_ROLLBACK);
-		if (sslikely(v->prev == NULL)) {
-			rc = sx_preparecb(x, lv, lsn, prepare, arg);
-			if (ssunlikely(rc != 0))
-				return sx_promote(x, SX_ROLLBACK);
+	DIR *d = opendir(dir);
+	if (ssunlikely(d == NULL))
+		return -1;
+
+	struct dirent *de;
+	while ((de = readdir(d))) {
+		if (ssunlikely(de->d_name[0] == '.'))
 			continue;
-		}
-		if (sx_vcommitted(v->prev)) {
-			if (v->prev->csn > x->csn)
-				return sx_promote(x, SX_ROLLBACK);
+		ssize_t id = sw_diridof(de->d_name);
+		if (ssunlikely(id == -1))
+			goto error;
+		char *ext = strstr(de->d_name, ".");
+		if (ssunlikely(ext == NULL))
+			goto error;
+		ext++;
+		swdirtype *type = sw_dirtypeof(types, ext);
+		if (ssunlikely(type == NULL))
 			continue;
-		}
-		/* force commit for read-only conflicts */
-		sxindex *i = v->prev->index;
-		if (sv_vflags(v->prev->v, i->r) & SVGET) {
-			rc = sx_preparecb(x, lv, lsn, prepare, arg);
-			if (ssunlikely(rc != 0))
-				return sx_promote(x, SX_ROLLBACK);
+		swdirid *n = sw_dirmatch(list, id);
+		if (n) {
+			n->mask |= type->mask;
+			type->count++;
 			continue;
 		}
-		return sx_promote(x, SX_LOCK);
+		int rc = ss_bufensure(list, a, sizeof(swdirid));
+		if (ssunlikely(rc == -1))
+			goto error;
+		n = (swdirid*)list->p;
+		ss_bufadvance(list, sizeof(swdirid));
+		n->id  = id;
+		n->mask = type->mask;
+		type->count++;
 	}
-	return sx_promote(x, SX_PREPARE);
-}
+	closedir(d);
 
-sxstate sx_commit(sx *x)
-{
-	if (x->state == SX_COMMIT)
-		return SX_COMMIT;
-	assert(x->state == SX_PREPARE);
-	sxmanager *m = x->manager;
-	ssiter i;
-	ss_iterinit(ss_bufiter, &i);
-	ss_iteropen(ss_bufiter, &i, &x->log->buf, sizeof(svlogv));
-	uint64_t csn = ++m->csn;
-	for (; ss_iterhas(ss_bufiter, &i); ss_iternext(ss_bufiter, &i))
-	{
-		svlogv *lv = ss_iterof(ss_bufiter, &i);
-		sxv *v = lv->ptr;
-		if ((int)v->lo == x->log_read)
-			break;
-		/* abort conflict reader */
-		if (v->prev && !sx_vcommitted(v->prev)) {
-			sxindex *i = v->prev->index;
-			assert(sv_vflags(v->prev->v, i->r) & SVGET);
-			sx_vabort(v->prev);
-		}
-		/* abort waiters */
-		sx_vabort_all(v->next);
-		/* mark stmt as commited */
-		sx_vcommit(v, csn);
-		lv->ptr = NULL;
-		/* schedule read stmt for gc */
-		sxindex *i = v->index;
-		if (sv_vflags(v->v, i->r) & SVGET) {
-			sv_vref(v->v);
-			v->gc = m->gc;
-			m->gc = v;
-			m->count_gc++;
-		} else {
-			sx_untrack(v);
-			sx_vpool_push(&m->pool, v);
-		}
-	}
+	if (ssunlikely(ss_bufused(list) == 0))
+		return 0;
 
-	/* rollback latest reads */
-	sx_rollback_svp(x, &i, 0);
+	int n = ss_bufused(list) / sizeof(swdirid);
+	qsort(list->s, n, sizeof(swdirid), sw_dircmp);
+	return n;
 
-	sx_promote(x, SX_COMMIT);
-	sx_end(x);
-	return SX_COMMIT;
+error:
+	closedir(d);
+	return -1;
 }
+#line 1 "sophia/wal/sw_iter.c"
 
-ss_rbget(sx_match,
-         sf_compare(scheme, sv_vpointer((sscast(n, sxv, node))->v), key))
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
 
-int sx_set(sx *x, sxindex *index, svv *version)
-{
-	sxmanager *m = x->manager;
-	sr *r = index->r;
 
-	svlogv lv;
-	lv.index_id = index->dsn;
-	lv.next     = UINT32_MAX;
-	lv.v        = version;
-	lv.ptr      = NULL;
 
-	/* allocate mvcc container */
-	sxv *v = sx_valloc(&m->pool, version);
-	if (ssunlikely(v == NULL)) {
-		sv_vunref(r, version);
-		return -1;
-	}
-	v->id    = x->id;
-	v->index = index;
-	lv.ptr   = v;
 
-	if (! (sv_vflags(version, index->r) & SVGET))
-		x->log_read = -1;
 
-	/* update concurrent index */
-	ssrbnode *n = NULL;
-	int rc;
-	rc = sx_match(&index->i, index->r->scheme,
-	              sv_vpointer(version), 0, &n);
-	if (ssunlikely(rc == 0 && n)) {
-		/* exists */
-	} else {
-		int pos = rc;
-		/* unique */
-		v->lo = sv_logcount(x->log);
-		rc = sv_logadd(x->log, r, &lv);
-		if (ssunlikely(rc == -1)) {
-			sr_oom(r->e);
-			goto error;
+
+
+typedef struct switer switer;
+
+struct switer {
+	int validate;
+	int error;
+	ssfile *log;
+	ssmmap map;
+	swv *v;
+	swv *next;
+	uint32_t count;
+	uint32_t pos;
+	sr *r;
+} sspacked;
+
+static void
+sw_iterseterror(switer *i)
+{
+	i->error = 1;
+	i->v     = NULL;
+	i->next  = NULL;
+}
+
+static int
+sw_iternext_of(switer *i, swv *next, int validate)
+{
+	if (next == NULL)
+		return 0;
+	char *eof   = (char*)i->map.p + i->map.size;
+	char *start = (char*)next;
+
+	/* eof */
+	if (ssunlikely(start == eof)) {
+		if (i->count != i->pos) {
+			sr_malfunction(i->r->e, "corrupted log file '%s': transaction is incomplete",
+			               ss_pathof(&i->log->path));
+			sw_iterseterror(i);
+			return -1;
 		}
-		ss_rbset(&index->i, n, pos, &v->node);
+		i->v = NULL;
+		i->next = NULL;
 		return 0;
 	}
-	sxv *head = sscast(n, sxv, node);
-	/* match previous update made by current
-	 * transaction */
-	sxv *own = sx_vmatch(head, x->id);
-	if (ssunlikely(own))
+
+	char *end = start + next->size;
+	if (ssunlikely((start > eof || (end > eof)))) {
+		sr_malfunction(i->r->e, "corrupted log file '%s': bad record size",
+		               ss_pathof(&i->log->path));
+		sw_iterseterror(i);
+		return -1;
+	}
+	if (validate && i->validate)
 	{
-		if (ssunlikely(sv_vflags(version, index->r) & SVUPSERT)) {
-			sr_error(r->e, "%s", "only one upsert statement is "
-			         "allowed per a transaction key");
-			goto error;
+		uint32_t crc = 0;
+		if (! (next->flags & SVBEGIN)) {
+			crc = ss_crcp(i->r->crc, start + sizeof(swv), next->size, 0);
+		}
+		crc = ss_crcs(i->r->crc, start, sizeof(swv), crc);
+		if (ssunlikely(crc != next->crc)) {
+			sr_malfunction(i->r->e, "corrupted log file '%s': bad record crc",
+			               ss_pathof(&i->log->path));
+			sw_iterseterror(i);
+			return -1;
 		}
-		/* replace old document with the new one */
-		lv.next = sv_logat(x->log, own->lo)->next;
-		v->lo = own->lo;
-		if (ssunlikely(sx_vaborted(own)))
-			sx_vabort(v);
-		sx_vreplace(own, v);
-		if (sslikely(head == own))
-			ss_rbreplace(&index->i, &own->node, &v->node);
-		/* update log */
-		sv_logreplace(x->log, r, v->lo, &lv);
-
-		sx_vfree(&m->pool, r, own);
-		return 0;
 	}
-	/* update log */
-	v->lo = sv_logcount(x->log);
-	rc = sv_logadd(x->log, r, &lv);
-	if (ssunlikely(rc == -1)) {
-		sr_oom(r->e);
-		goto error;
+	i->pos++;
+	if (i->pos > i->count) {
+		/* next transaction */
+		i->v     = NULL;
+		i->pos   = 0;
+		i->count = 0;
+		i->next  = next;
+		return 0;
 	}
-	/* add version */
-	sx_vlink(head, v);
-	return 0;
-error:
-	sx_vfree(&m->pool, r, v);
-	return -1;
+	i->v = next;
+	return 1;
 }
 
-int sx_get(sx *x, sxindex *index, svv *key, svv **result)
+int sw_itercontinue_of(switer *i)
 {
-	ssrbnode *n = NULL;
-	int rc;
-	rc = sx_match(&index->i, index->r->scheme,
-	              sv_vpointer(key), 0, &n);
-	if (! (rc == 0 && n))
-		goto add;
-	sxv *head = sscast(n, sxv, node);
-	sxv *v = sx_vmatch(head, x->id);
-	if (v == NULL)
-		goto add;
-	if (ssunlikely(sv_vflags(v->v, index->r) & SVGET))
+	if (ssunlikely(i->error))
+		return -1;
+	if (ssunlikely(i->v))
+		return 1;
+	if (ssunlikely(i->next == NULL))
 		return 0;
-	if (ssunlikely(sv_vflags(v->v, index->r) & SVDELETE))
-		return 2;
-	*result = sv_vbuildraw(index->r, sv_vpointer(v->v));
-	if (ssunlikely(*result == NULL)) {
-		sr_oom(index->r->e);
-		rc = -1;
+	int validate = 0;
+	i->pos   = 0;
+	i->count = 0;
+	swv *v = i->next;
+	if (v->flags & SVBEGIN) {
+		validate = 1;
+		i->count = v->size;
+		v = (swv*)((char*)i->next + sizeof(swv));
 	} else {
-		rc = 1;
+		i->count = 1;
+		v = i->next;
 	}
-	return rc;
-
-add:
-	/* track a start of the latest read sequence in the
-	 * transactional log */
-	if (x->log_read == -1)
-		x->log_read = sv_logcount(x->log);
-	rc = sx_set(x, index, key);
+	return sw_iternext_of(i, v, validate);
+}
+
+static inline int
+sw_iterprepare(switer *i)
+{
+	srversion *ver = (srversion*)i->map.p;
+	if (! sr_versionstorage_check(ver))
+		return sr_malfunction(i->r->e, "bad log file '%s' version",
+		                      ss_pathof(&i->log->path));
+	if (ssunlikely(i->log->size < (sizeof(srversion))))
+		return sr_malfunction(i->r->e, "corrupted log file '%s': bad size",
+		                      ss_pathof(&i->log->path));
+	swv *next = (swv*)((char*)i->map.p + sizeof(srversion));
+	int rc = sw_iternext_of(i, next, 1);
 	if (ssunlikely(rc == -1))
 		return -1;
-	sv_vref(key);
+	if (sslikely(i->next))
+		return sw_itercontinue_of(i);
 	return 0;
 }
 
-sxstate sx_set_autocommit(sxmanager *m, sxindex *index, sx *x, svlog *log, svv *v)
+int sw_iter_open(ssiter *i, sr *r, ssfile *file, int validate)
 {
-	if (sslikely(m->count_rw == 0)) {
-		sx_init(m, x, log);
-		svlogv lv;
-		lv.index_id = index->dsn;
-		lv.next     = UINT32_MAX;
-		lv.v        = v;
-		lv.ptr      = NULL;
-		sv_logadd(x->log, index->r, &lv);
-		sr_seq(index->r->seq, SR_TSNNEXT);
-		sx_promote(x, SX_COMMIT);
-		return SX_COMMIT;
+	switer *li = (switer*)i->priv;
+	memset(li, 0, sizeof(*li));
+	li->r        = r;
+	li->log      = file;
+	li->validate = validate;
+	if (ssunlikely(li->log->size < sizeof(srversion))) {
+		sr_malfunction(li->r->e, "corrupted log file '%s': bad size",
+		               ss_pathof(&li->log->path));
+		return -1;
 	}
-	sx_begin(m, x, SX_RW, log, 0);
-	int rc = sx_set(x, index, v);
+	if (ssunlikely(li->log->size == sizeof(srversion)))
+		return 0;
+	int rc = ss_vfsmmap(r->vfs, &li->map, li->log->fd, li->log->size, 1);
 	if (ssunlikely(rc == -1)) {
-		sx_rollback(x);
-		return SX_ROLLBACK;
-	}
-	sxstate s = sx_prepare(x, NULL, NULL);
-	switch (s) {
-	case SX_PREPARE:
-		s = sx_commit(x);
-		break;
-	case SX_LOCK:
-		s = sx_rollback(x);
-		break;
-	case SX_ROLLBACK:
-		break;
-	default:
-		assert(0);
+		sr_malfunction(li->r->e, "failed to mmap log file '%s': %s",
+		               ss_pathof(&li->log->path),
+		               strerror(errno));
+		return -1;
 	}
-	return s;
+	rc = sw_iterprepare(li);
+	if (ssunlikely(rc == -1))
+		ss_vfsmunmap(r->vfs, &li->map);
+	return 0;
 }
 
-sxstate sx_get_autocommit(sxmanager *m, sxindex *index)
+static void
+sw_iter_close(ssiter *i)
 {
-	(void)m;
-	sr_seq(index->r->seq, SR_TSNNEXT);
-	return SX_COMMIT;
+	switer *li = (switer*)i->priv;
+	ss_vfsmunmap(li->r->vfs, &li->map);
 }
-#line 1 "sophia/transaction/sx_deadlock.c"
-
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
-
-
-
-
 
-
-
-
-static inline int
-sx_deadlock_in(sxmanager *m, sslist *mark, sx *t, sx *p)
+static int
+sw_iter_has(ssiter *i)
 {
-	if (p->deadlock.next != &p->deadlock)
-		return 0;
-	ss_listappend(mark, &p->deadlock);
-	ssiter i;
-	ss_iterinit(ss_bufiter, &i);
-	ss_iteropen(ss_bufiter, &i, &p->log->buf, sizeof(svlogv));
-	for (; ss_iterhas(ss_bufiter, &i); ss_iternext(ss_bufiter, &i))
-	{
-		svlogv *lv = ss_iterof(ss_bufiter, &i);
-		sxv *v = lv->ptr;
-		if (v->prev == NULL)
-			continue;
-		do {
-			sx *n = sx_find(m, v->id);
-			assert(n != NULL);
-			if (ssunlikely(n == t))
-				return 1;
-			int rc = sx_deadlock_in(m, mark, t, n);
-			if (ssunlikely(rc == 1))
-				return 1;
-			v = v->prev;
-		} while (v);
-	}
-	return 0;
+	switer *li = (switer*)i->priv;
+	return li->v != NULL;
 }
 
-static inline void
-sx_deadlock_unmark(sslist *mark)
+static void*
+sw_iter_of(ssiter *i)
 {
-	sslist *i, *n;
-	ss_listforeach_safe(mark, i, n) {
-		sx *t = sscast(i, sx, deadlock);
-		ss_listinit(&t->deadlock);
-	}
+	switer *li = (switer*)i->priv;
+	return li->v;
 }
 
-int sx_deadlock(sx *t)
+static void
+sw_iter_next(ssiter *i)
 {
-	sxmanager *m = t->manager;
-	sslist mark;
-	ss_listinit(&mark);
-	ssiter i;
-	ss_iterinit(ss_bufiter, &i);
-	ss_iteropen(ss_bufiter, &i, &t->log->buf, sizeof(svlogv));
-	while (ss_iterhas(ss_bufiter, &i))
-	{
-		svlogv *lv = ss_iterof(ss_bufiter, &i);
-		sxv *v = lv->ptr;
-		if (v->prev == NULL) {
-			ss_iternext(ss_bufiter, &i);
-			continue;
-		}
-		sx *p = sx_find(m, v->prev->id);
-		assert(p != NULL);
-		int rc = sx_deadlock_in(m, &mark, t, p);
-		if (ssunlikely(rc)) {
-			sx_deadlock_unmark(&mark);
-			return 1;
-		}
-		ss_iternext(ss_bufiter, &i);
-	}
-	sx_deadlock_unmark(&mark);
-	return 0;
+	switer *li = (switer*)i->priv;
+	if (ssunlikely(li->v == NULL))
+		return;
+	swv *next =
+		(swv*)((char*)li->v + sizeof(swv) + li->v->size);
+	sw_iternext_of(li, next, 1);
 }
-#line 1 "sophia/wal/sw_conf.h"
-#ifndef SW_CONF_H_
-#define SW_CONF_H_
-
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
-
-typedef struct swconf swconf;
-
-struct swconf {
-	uint32_t  enable;
-	char     *path;
-	uint32_t  sync_on_rotate;
-	uint32_t  sync_on_write;
-	uint32_t  rotatewm;
-};
-
-void sw_confinit(swconf*);
-void sw_conffree(swconf*, ssa*);
-int  sw_confset_path(swconf*, ssa*, char*);
-
-#endif
-#line 1 "sophia/wal/sw_dir.h"
-#ifndef SW_DIR_H_
-#define SW_DIR_H_
-
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
-
-typedef struct swdirtype swdirtype;
-typedef struct swdirid swdirid;
-
-struct swdirtype {
-	char *ext;
-	uint32_t mask;
-	int count;
-};
 
-struct swdirid {
-	uint32_t mask;
-	uint64_t id;
+ssiterif sw_iter =
+{
+	.close = sw_iter_close,
+	.has   = sw_iter_has,
+	.of    = sw_iter_of,
+	.next  = sw_iter_next
 };
 
-int sw_dirread(ssbuf*, ssa*, swdirtype*, char*);
-
-#endif
-#line 1 "sophia/wal/sw_v.h"
-#ifndef SW_V_H_
-#define SW_V_H_
-
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
-
-typedef struct swv swv;
-
-struct swv {
-	uint32_t crc;
-	uint32_t dsn;
-	uint32_t size;
-	uint8_t  flags;
-} sspacked;
+int sw_iter_error(ssiter *i)
+{
+	switer *li = (switer*)i->priv;
+	return li->error;
+}
 
-static inline char*
-sw_vpointer(swv *v) {
-	return (char*)v + sizeof(*v);
+int sw_iter_continue(ssiter *i)
+{
+	switer *li = (switer*)i->priv;
+	return sw_itercontinue_of(li);
 }
-
-#endif
-#line 1 "sophia/wal/sw.h"
-#ifndef SW_H_
-#define SW_H_
+#line 1 "sophia/database/sd_page.h"
+#ifndef SD_PAGE_H_
+#define SD_PAGE_H_
 
 /*
  * sophia database
@@ -18377,62 +22985,49 @@ sw_vpointer(swv *v) {
  * BSD License
 */
 
-typedef struct sw sw;
-typedef struct swmanager swmanager;
-typedef struct swtx swtx;
-
-struct sw {
-	uint64_t   id;
-	ssgc       gc;
-	ssmutex    filelock;
-	ssfile     file;
-	swmanager *p;
-	sslist     link;
-	sslist     linkcopy;
-};
+typedef struct sdpageheader sdpageheader;
+typedef struct sdpage sdpage;
 
-struct swmanager {
-	ssspinlock lock;
-	swconf     conf;
-	sslist     list;
-	int        gc;
-	int        n;
-	ssiov      iov;
-	sr        *r;
-};
+struct sdpageheader {
+	uint32_t crc;
+	uint32_t crcdata;
+	uint32_t count;
+	uint32_t countdup;
+	uint32_t sizeorigin;
+	uint32_t size;
+	uint64_t lsnmin;
+	uint64_t lsnmindup;
+	uint64_t lsnmax;
+	uint32_t tsmin;
+	uint32_t sizeencoded;
+} sspacked;
 
-struct swtx {
-	swmanager *p;
-	sw        *l;
-	int        recover;
-	uint64_t   lsn;
-	uint64_t   svp;
+struct sdpage {
+	sdpageheader *h;
 };
 
-static inline swconf*
-sw_conf(swmanager *p) {
-	return &p->conf;
+static inline void
+sd_pageinit(sdpage *p, sdpageheader *h) {
+	p->h = h;
 }
 
-int sw_managerinit(swmanager*, sr*);
-int sw_manageropen(swmanager*);
-int sw_managerrotate(swmanager*);
-int sw_managerrotate_ready(swmanager*);
-int sw_managershutdown(swmanager*);
-int sw_managergc_enable(swmanager*, int);
-int sw_managergc(swmanager*);
-int sw_managerfiles(swmanager*);
-int sw_managercopy(swmanager*, char*, ssbuf*);
-
-int sw_begin(swmanager*, swtx*, uint64_t, int);
-int sw_commit(swtx*);
-int sw_rollback(swtx*);
-int sw_write(swtx*, svlog*);
+static inline char*
+sd_pagepointer(sdpage *p, sr *r, uint32_t pos)
+{
+	assert(pos < p->h->count);
+	char *ptr = (char*)p->h + sizeof(sdpageheader);
+	if (sf_schemefixed(r->scheme))
+		return ptr + (r->scheme->var_offset * pos);
+	uint32_t *offset = (uint32_t*)ptr;
+	assert((sizeof(uint32_t) * p->h->count) +
+	        offset[pos] <= p->h->sizeorigin);
+	return ptr + (sizeof(uint32_t) * p->h->count) + offset[pos];
+}
 
 #endif
-#line 1 "sophia/wal/sw_iter.h"
-#ifndef SW_ITER_H_
-#define SW_ITER_H_
+#line 1 "sophia/database/sd_pageprefix.h"
+#ifndef SD_PAGEPREFIX_H_
+#define SD_PAGEPREFIX_H_
 
 /*
  * sophia database
@@ -18442,598 +23037,375 @@ int sw_write(swtx*, svlog*);
  * BSD License
 */
 
-int sw_iter_open(ssiter *i, sr*, ssfile*, int);
-int sw_iter_error(ssiter*);
-int sw_iter_continue(ssiter*);
-
-extern ssiterif sw_iter;
-
-#endif
-#line 1 "sophia/wal/sw.c"
-
-/*
- * sophia database
- * sphia.org
+/* Prefix-compressed page layout.
  *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
-
-
-
-
-
-
+ * The layout is chosen per node and recorded in the
+ * index header version. Pages are decoded into the plain
+ * layout when they are loaded, so page iteration, search
+ * and the page cache work on plain pages only. The
+ * layout only saves disk space and I/O, a page is always
+ * decoded in full.
+ *
+ * u32 key area size
+ * key area:
+ *   per document: varint shared, varint unshared,
+ *   unshared key bytes, varint size of each variable field
+ * value area:
+ *   per document: fixed fields which are not keys,
+ *   then variable fields which are not keys
+ *
+ * A key is the concatenation of the key fields in key
+ * order. It shares a prefix with the previous key, the
+ * first key of a page is stored in full. The page header
+ * keeps the size of the encoded page before compression
+ * in sizeencoded. */
 
-static inline sw*
-sw_alloc(swmanager *p, uint64_t id)
-{
-	sw *l = ss_malloc(p->r->a, sizeof(*l));
-	if (ssunlikely(l == NULL)) {
-		sr_oom_malfunction(p->r->e);
-		return NULL;
-	}
-	l->id = id;
-	l->p  = NULL;
-	ss_gcinit(&l->gc);
-	ss_mutexinit(&l->filelock);
-	ss_fileinit(&l->file, p->r->vfs);
-	ss_listinit(&l->link);
-	ss_listinit(&l->linkcopy);
-	return l;
-}
+#define SD_PAGEPLAIN   0
+#define SD_PAGEPREFIX  1
 
 static inline int
-sw_close(swmanager *p, sw *l)
-{
-	int rc = ss_fileclose(&l->file);
-	if (ssunlikely(rc == -1)) {
-		sr_malfunction(p->r->e, "log file '%s' close error: %s",
-		               ss_pathof(&l->file.path),
-		               strerror(errno));
-	}
-	ss_mutexfree(&l->filelock);
-	ss_gcfree(&l->gc);
-	ss_free(p->r->a, l);
-	return rc;
-}
-
-static inline sw*
-sw_open(swmanager *p, uint64_t id)
+sd_pageprefix_varintsize(uint32_t v)
 {
-	sw *l = sw_alloc(p, id);
-	if (ssunlikely(l == NULL))
-		return NULL;
-	sspath path;
-	ss_path(&path, p->conf.path, id, ".log");
-	int rc = ss_fileopen(&l->file, path.path, 0);
-	if (ssunlikely(rc == -1)) {
-		sr_malfunction(p->r->e, "log file '%s' open error: %s",
-		               ss_pathof(&l->file.path),
-		               strerror(errno));
-		goto error;
+	int size = 1;
+	while (v >= 0x80) {
+		v >>= 7;
+		size++;
 	}
-	return l;
-error:
-	sw_close(p, l);
-	return NULL;
+	return size;
 }
 
-static inline sw*
-sw_new(swmanager *p, uint64_t id)
+static inline char*
+sd_pageprefix_varintwrite(char *p, uint32_t v)
 {
-	sw *l = sw_alloc(p, id);
-	if (ssunlikely(l == NULL))
-		return NULL;
-	sspath path;
-	ss_path(&path, p->conf.path, id, ".log");
-	int rc = ss_filenew(&l->file, path.path, 0);
-	if (ssunlikely(rc == -1)) {
-		sr_malfunction(p->r->e, "log file '%s' create error: %s",
-		               path.path, strerror(errno));
-		goto error;
-	}
-	srversion v;
-	sr_version_storage(&v);
-	rc = ss_filewrite(&l->file, &v, sizeof(v));
-	if (ssunlikely(rc == -1)) {
-		sr_malfunction(p->r->e, "log file '%s' header write error: %s",
-		               ss_pathof(&l->file.path),
-		               strerror(errno));
-		goto error;
+	while (v >= 0x80) {
+		*p++ = (char)(v | 0x80);
+		v >>= 7;
 	}
-	return l;
-error:
-	sw_close(p, l);
-	return NULL;
-}
-
-int sw_managerinit(swmanager *p, sr *r)
-{
-	ss_spinlockinit(&p->lock);
-	ss_listinit(&p->list);
-	sw_confinit(&p->conf);
-	p->n    = 0;
-	p->r    = r;
-	p->gc   = 1;
-	struct iovec *iov =
-		ss_malloc(r->a, sizeof(struct iovec) * 1021);
-	if (ssunlikely(iov == NULL))
-		return sr_oom_malfunction(r->e);
-	ss_iovinit(&p->iov, iov, 1021);
-	return 0;
-}
-
-static inline int
-sw_managercreate(swmanager *p)
-{
-	int rc;
-	rc = ss_vfsmkdir(p->r->vfs, p->conf.path, 0755);
-	if (ssunlikely(rc == -1))
-		return sr_malfunction(p->r->e, "log directory '%s' create error: %s",
-		                      p->conf.path, strerror(errno));
-	return 1;
+	*p++ = (char)v;
+	return p;
 }
 
-static inline int
-sw_managerrecover(swmanager *p)
-{
-	ssbuf list;
-	ss_bufinit(&list);
-	swdirtype types[] =
-	{
-		{ "log", 1, 0 },
-		{ NULL,  0, 0 }
-	};
-	int rc = sw_dirread(&list, p->r->a, types, p->conf.path);
-	if (ssunlikely(rc == -1))
-		return sr_malfunction(p->r->e, "log directory '%s' open error",
-		                      p->conf.path);
-	ssiter i;
-	ss_iterinit(ss_bufiter, &i);
-	ss_iteropen(ss_bufiter, &i, &list, sizeof(swdirid));
-	while(ss_iterhas(ss_bufiter, &i)) {
-		swdirid *id = ss_iterof(ss_bufiter, &i);
-		sw *l = sw_open(p, id->id);
-		if (ssunlikely(l == NULL)) {
-			ss_buffree(&list, p->r->a);
-			return -1;
-		}
-		l->gc.complete = 1;
-		ss_listappend(&p->list, &l->link);
-		p->n++;
-		ss_iternext(ss_bufiter, &i);
-	}
-	ss_buffree(&list, p->r->a);
-	if (p->n) {
-		sw *last = sscast(p->list.prev, sw, link);
-		last->gc.complete = 0;
-		rc = ss_fileseek(&last->file, last->file.size);
-		if (ssunlikely(rc == -1)) {
-			return sr_malfunction(p->r->e, "log file '%s' seek error: %s",
-			                      ss_pathof(&last->file.path),
-			                      strerror(errno));
-		}
-		p->r->seq->lfsn = last->id;
-		p->r->seq->lfsn++;
+static inline char*
+sd_pageprefix_varintread(char *p, char *end, uint32_t *v)
+{
+	uint32_t result = 0;
+	int shift = 0;
+	while (p < end && shift <= 28) {
+		uint8_t byte = *(uint8_t*)p++;
+		result |= (uint32_t)(byte & 0x7f) << shift;
+		if (! (byte & 0x80)) {
+			*v = result;
+			return p;
+		}
+		shift += 7;
 	}
-	return 0;
+	return NULL;
 }
 
-int sw_manageropen(swmanager *p)
+static inline int
+sd_pageprefix_key(sfscheme *s, char *v, ssbuf *buf, ssa *a)
 {
-	if (ssunlikely(! p->conf.enable))
-		return 0;
-	int exists = ss_vfsexists(p->r->vfs, p->conf.path);
-	int rc;
-	if (! exists) {
-		rc = sw_managercreate(p);
-		if (ssunlikely(rc == -1))
-			return -1;
-		rc = sw_managerrotate(p);
-		if (ssunlikely(rc == -1))
-			return -1;
-	} else {
-		rc = sw_managerrecover(p);
+	int i = 0;
+	while (i < s->keys_count) {
+		uint32_t size;
+		char *ptr = sf_fieldptr(s, s->keys[i], v, &size);
+		int rc = ss_bufadd(buf, a, ptr, size);
 		if (ssunlikely(rc == -1))
 			return -1;
+		i++;
 	}
 	return 0;
 }
 
-int sw_managerrotate(swmanager *p)
-{
-	if (ssunlikely(! p->conf.enable))
-		return 0;
-	uint64_t lfsn = sr_seq(p->r->seq, SR_LFSNNEXT);
-	sw *l = sw_new(p, lfsn);
-	if (ssunlikely(l == NULL))
-		return -1;
-	sw *log = NULL;
-	ss_spinlock(&p->lock);
-	if (p->n)
-		log = sscast(p->list.prev, sw, link);
-	ss_listappend(&p->list, &l->link);
-	p->n++;
-	ss_spinunlock(&p->lock);
-	if (log) {
-		assert(log->file.fd != -1);
-		if (p->conf.sync_on_rotate) {
-			int rc = ss_filesync(&log->file);
-			if (ssunlikely(rc == -1)) {
-				sr_malfunction(p->r->e, "log file '%s' sync error: %s",
-				               ss_pathof(&log->file.path),
-				               strerror(errno));
-				return -1;
-			}
-		}
-		ss_fileadvise(&log->file, 0, 0, log->file.size);
-		ss_gccomplete(&log->gc);
-	}
-	return 0;
-}
+int sd_pageprefix_decode(sr*, sdpageheader*, char*, uint32_t, char*, char*);
 
-int sw_managerrotate_ready(swmanager *p)
-{
-	if (ssunlikely(! p->conf.enable))
-		return 0;
-	ss_spinlock(&p->lock);
-	assert(p->n > 0);
-	sw *l = sscast(p->list.prev, sw, link);
-	int ready = ss_gcrotateready(&l->gc, p->conf.rotatewm);
-	ss_spinunlock(&p->lock);
-	return ready;
-}
+#endif
+#line 1 "sophia/database/sd_pageiter.h"
+#ifndef SD_PAGEITER_H_
+#define SD_PAGEITER_H_
 
-int sw_managershutdown(swmanager *p)
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct sdpageiter sdpageiter;
+
+struct sdpageiter {
+	sdpage  *page;
+	int64_t  pos;
+	char    *current;
+	ssorder  order;
+	char    *key;
+	sr      *r;
+} sspacked;
+
+static inline void
+sd_pageiter_result(sdpageiter *i)
 {
-	int rcret = 0;
-	int rc;
-	if (p->n) {
-		sslist *i, *n;
-		ss_listforeach_safe(&p->list, i, n) {
-			sw *l = sscast(i, sw, link);
-			rc = sw_close(p, l);
-			if (ssunlikely(rc == -1))
-				rcret = -1;
-		}
+	if (ssunlikely(i->pos == i->page->h->count)) {
+		i->current = NULL;
+		return;
 	}
-	if (p->iov.v)
-		ss_free(p->r->a, p->iov.v);
-	sw_conffree(&p->conf, p->r->a);
-	ss_spinlockfree(&p->lock);
-	return rcret;
+	i->current = sd_pagepointer(i->page, i->r, i->pos);
 }
 
-static inline int
-sw_gc(swmanager *p, sw *l)
+static inline void
+sd_pageiter_end(sdpageiter *i)
 {
-	int rc;
-	rc = ss_vfsunlink(p->r->vfs, ss_pathof(&l->file.path));
-	if (ssunlikely(rc == -1)) {
-		return sr_malfunction(p->r->e, "log file '%s' unlink error: %s",
-		                      ss_pathof(&l->file.path),
-		                      strerror(errno));
-	}
-	rc = sw_close(p, l);
-	if (ssunlikely(rc == -1))
-		return -1;
-	return 1;
+	i->pos = i->page->h->count;
+	i->current = NULL;
 }
 
-int sw_managergc_enable(swmanager *p, int enable)
+static inline int
+sd_pageiter_cmp(sdpageiter *i, sr *r, uint32_t pos)
 {
-	ss_spinlock(&p->lock);
-	p->gc = enable;
-	ss_spinunlock(&p->lock);
-	return 0;
+	return sf_compare(r->scheme, sd_pagepointer(i->page, i->r, pos), i->key);
 }
 
-int sw_managergc(swmanager *p)
-{
-	if (ssunlikely(! p->conf.enable))
-		return 0;
-	for (;;) {
-		ss_spinlock(&p->lock);
-		if (ssunlikely(! p->gc)) {
-			ss_spinunlock(&p->lock);
-			return 0;
-		}
-		sw *current = NULL;
-		sslist *i;
-		ss_listforeach(&p->list, i) {
-			sw *l = sscast(i, sw, link);
-			if (sslikely(! ss_gcgarbage(&l->gc)))
-				continue;
-			ss_listunlink(&l->link);
-			p->n--;
-			current = l;
-			break;
-		}
-		ss_spinunlock(&p->lock);
-		if (current) {
-			int rc = sw_gc(p, current);
-			if (ssunlikely(rc == -1))
-				return -1;
-		} else {
-			break;
+static inline int
+sd_pageiter_searchfixed(sdpageiter *i)
+{
+	/* branch-free lower bound over the fixed-size records
+	 * of a page, keys are loaded at a constant stride */
+	sfscheme *s = i->r->scheme;
+	char *first = (char*)i->page->h + sizeof(sdpageheader) + s->cmpoffset;
+	char *start = first;
+	uint32_t stride = s->var_offset;
+	uint32_t count = i->page->h->count;
+	if (s->cmpfast == SF_CMPU64) {
+		uint64_t key = sscastu64(i->key + s->cmpoffset) ^ s->cmpmask;
+		while (count > 1) {
+			uint32_t half = count / 2;
+			uint64_t v = sscastu64(first + (half - 1) * stride) ^ s->cmpmask;
+			first += (v < key) ? half * stride : 0;
+			count -= half;
 		}
+		uint64_t v = sscastu64(first) ^ s->cmpmask;
+		return (first - start) / stride + (v < key);
 	}
-	return 0;
+	uint32_t mask = (uint32_t)s->cmpmask;
+	uint32_t key = sscastu32(i->key + s->cmpoffset) ^ mask;
+	while (count > 1) {
+		uint32_t half = count / 2;
+		uint32_t v = sscastu32(first + (half - 1) * stride) ^ mask;
+		first += (v < key) ? half * stride : 0;
+		count -= half;
+	}
+	uint32_t v = sscastu32(first) ^ mask;
+	return (first - start) / stride + (v < key);
 }
 
-int sw_managerfiles(swmanager *p)
+static inline int
+sd_pageiter_search(sdpageiter *i)
 {
-	ss_spinlock(&p->lock);
-	int n = p->n;
-	ss_spinunlock(&p->lock);
-	return n;
+	sfscheme *s = i->r->scheme;
+	if (sf_schemefixed(s) && (s->cmpfast == SF_CMPU64 ||
+	                          s->cmpfast == SF_CMPU32))
+		return sd_pageiter_searchfixed(i);
+	int min = 0;
+	int mid = 0;
+	int max = i->page->h->count - 1;
+	while (max >= min)
+	{
+		mid = min + (max - min) / 2;
+		int rc = sd_pageiter_cmp(i, i->r, mid);
+		switch (rc) {
+		case -1: min = mid + 1;
+			continue;
+		case  1: max = mid - 1;
+			continue;
+		default: return mid;
+		}
+	}
+	return min;
 }
 
-int sw_managercopy(swmanager *p, char *dest, ssbuf *buf)
+static inline void
+sd_pageiter_chain_head(sdpageiter *i, int64_t pos)
 {
-	sslist list;
-	ss_listinit(&list);
-	ss_spinlock(&p->lock);
-	sslist *i;
-	ss_listforeach(&p->list, i) {
-		sw *l = sscast(i, sw, link);
-		if (ss_gcinprogress(&l->gc))
-			break;
-		ss_listappend(&list, &l->linkcopy);
+	/* find first non-duplicate key */
+	while (pos >= 0) {
+		uint8_t flags =
+			sf_flags(i->r->scheme,
+			         sd_pagepointer(i->page, i->r, pos));
+		if (sslikely(! (flags & SVDUP))) {
+			i->pos = pos;
+			return;
+		}
+		pos--;
 	}
-	ss_spinunlock(&p->lock);
+	sd_pageiter_end(i);
+}
 
-	ss_bufreset(buf);
-	sslist *n;
-	ss_listforeach_safe(&list, i, n)
-	{
-		sw *l = sscast(i, sw, linkcopy);
-		ss_listinit(&l->linkcopy);
-		sspath path;
-		ss_path(&path, dest, l->id, ".log");
-		ssfile file;
-		ss_fileinit(&file, p->r->vfs);
-		int rc = ss_filenew(&file, path.path, 0);
-		if (ssunlikely(rc == -1)) {
-			sr_error(p->r->e, "log file '%s' create error: %s",
-			         path.path, strerror(errno));
-			return -1;
-		}
-		rc = ss_bufensure(buf, p->r->a, l->file.size);
-		if (ssunlikely(rc == -1)) {
-			sr_oom(p->r->e);
-			ss_fileclose(&file);
-			return -1;
-		}
-		rc = ss_filepread(&l->file, 0, buf->s, l->file.size);
-		if (ssunlikely(rc == -1)) {
-			sr_error(p->r->e, "log file '%s' read error: %s",
-			         ss_pathof(&l->file.path),
-			         strerror(errno));
-			ss_fileclose(&file);
-			return -1;
-		}
-		ss_bufadvance(buf, l->file.size);
-		rc = ss_filewrite(&file, buf->s, l->file.size);
-		if (ssunlikely(rc == -1)) {
-			sr_error(p->r->e, "log file '%s' write error: %s",
-			         path.path,
-			         strerror(errno));
-			ss_fileclose(&file);
-			return -1;
-		}
-		/* sync? */
-		rc = ss_fileclose(&file);
-		if (ssunlikely(rc == -1)) {
-			sr_error(p->r->e, "log file '%s' close error: %s",
-			         path.path, strerror(errno));
-			return -1;
+static inline void
+sd_pageiter_chain_next(sdpageiter *i)
+{
+	/* skip to next duplicate chain */
+	int64_t pos = i->pos + 1;
+	while (pos < i->page->h->count) {
+		uint8_t flags =
+			sf_flags(i->r->scheme,
+			         sd_pagepointer(i->page, i->r, pos));
+		if (sslikely(! (flags & SVDUP))) {
+			i->pos = pos;
+			return;
 		}
-		ss_bufreset(buf);
+		pos++;
 	}
-	return 0;
+	sd_pageiter_end(i);
 }
 
-int sw_begin(swmanager *p, swtx *t, uint64_t lsn, int recover)
+static inline int
+sd_pageiter_gt(sdpageiter *i, int e)
 {
-	ss_spinlock(&p->lock);
-	if (sslikely(lsn == 0)) {
-		lsn = sr_seq(p->r->seq, SR_LSNNEXT);
-	} else {
-		sr_seqlock(p->r->seq);
-		if (lsn > p->r->seq->lsn)
-			p->r->seq->lsn = lsn;
-		sr_sequnlock(p->r->seq);
+	if (i->key == NULL) {
+		i->pos = 0;
+		return 0;
 	}
-	t->lsn = lsn;
-	t->recover = recover;
-	t->svp = 0;
-	t->p = p;
-	t->l = NULL;
-	if (! p->conf.enable)
+	int64_t pos = sd_pageiter_search(i);
+	if (ssunlikely(pos >= i->page->h->count))
+		pos = i->page->h->count - 1;
+	sd_pageiter_chain_head(i, pos);
+	if (i->pos == i->page->h->count)
 		return 0;
-	assert(p->n > 0);
-	sw *l = sscast(p->list.prev, sw, link);
-	ss_mutexlock(&l->filelock);
-	t->svp = ss_filesvp(&l->file);
-	t->l = l;
-	t->p = p;
-	return 0;
+	int rc = sd_pageiter_cmp(i, i->r, i->pos);
+	int match = rc == 0;
+	switch (rc) {
+		case  0:
+			if (e) {
+				break;
+			}
+		case -1:
+			sd_pageiter_chain_next(i);
+			break;
+	}
+	return match;
 }
 
-int sw_commit(swtx *t)
+static inline int
+sd_pageiter_lt(sdpageiter *i, int e)
 {
-	if (t->p->conf.enable)
-		ss_mutexunlock(&t->l->filelock);
-	ss_spinunlock(&t->p->lock);
-	return 0;
+	if (i->key == NULL) {
+		sd_pageiter_chain_head(i, i->page->h->count - 1);
+		return 0;
+	}
+	int64_t pos = sd_pageiter_search(i);
+	if (ssunlikely(pos >= i->page->h->count))
+		pos = i->page->h->count - 1;
+	sd_pageiter_chain_head(i, pos);
+	if (i->pos == i->page->h->count)
+		return 0;
+	int rc = sd_pageiter_cmp(i, i->r, i->pos);
+	int match = rc == 0;
+	switch (rc) {
+		case 0:
+			if (e) {
+				break;
+			}
+		case 1:
+			sd_pageiter_chain_head(i, i->pos - 1);
+			break;
+	}
+	return match;
 }
 
-int sw_rollback(swtx *t)
+static inline int
+sd_pageiter_open(ssiter *i, sr *r, sdpage *page, ssorder o,
+                 char *key)
 {
+	sdpageiter *pi = (sdpageiter*)i->priv;
+	pi->r     = r;
+	pi->page  = page;
+	pi->order = o;
+	pi->key   = key;
+	pi->pos   = 0;
+	if (ssunlikely(pi->page->h->count == 0)) {
+		sd_pageiter_end(pi);
+		return 0;
+	}
 	int rc = 0;
-	if (t->p->conf.enable) {
-		rc = ss_filerlb(&t->l->file, t->svp);
-		if (ssunlikely(rc == -1))
-			sr_malfunction(t->p->r->e, "log file '%s' truncate error: %s",
-			               ss_pathof(&t->l->file.path),
-			               strerror(errno));
-		ss_mutexunlock(&t->l->filelock);
+	switch (pi->order) {
+	case SS_GT:  rc = sd_pageiter_gt(pi, 0);
+		break;
+	case SS_GTE: rc = sd_pageiter_gt(pi, 1);
+		break;
+	case SS_LT:  rc = sd_pageiter_lt(pi, 0);
+		break;
+	case SS_LTE: rc = sd_pageiter_lt(pi, 1);
+		break;
+	default: assert(0);
 	}
-	ss_spinunlock(&t->p->lock);
+	sd_pageiter_result(pi);
 	return rc;
 }
 
 static inline void
-sw_writeadd(swmanager *p, swtx *t, svlog *vlog, swv *lv, svlogv *logv)
-{
-	sr *r = sv_logindex(vlog, logv->index_id)->r;
-	char *data = sv_vpointer(logv->v);
-	lv->dsn   = logv->index_id;
-	lv->flags = sf_flags(r->scheme, data);
-	lv->size  = sf_size(r->scheme, data);
-	lv->crc   = ss_crcp(p->r->crc, data, lv->size, 0);
-	lv->crc   = ss_crcs(p->r->crc, lv, sizeof(swv), lv->crc);
-	ss_iovadd(&p->iov, lv, sizeof(swv));
-	ss_iovadd(&p->iov, data, lv->size);
-	logv->v->log = t->l;
-}
+sd_pageiter_close(ssiter *i ssunused)
+{ }
 
 static inline int
-sw_writestmt(swtx *t, svlog *vlog)
+sd_pageiter_has(ssiter *i)
 {
-	swmanager *p = t->p;
-	svlogv *stmt = NULL;
-	ssiter i;
-	ss_iterinit(ss_bufiter, &i);
-	ss_iteropen(ss_bufiter, &i, &vlog->buf, sizeof(svlogv));
-	for (; ss_iterhas(ss_bufiter, &i); ss_iternext(ss_bufiter, &i)) {
-		svlogv *logv = ss_iterof(ss_bufiter, &i);
-		svv *v = logv->v;
-		sr *r = sv_logindex(vlog, logv->index_id)->r;
-		sf_lsnset(r->scheme, sv_vpointer(v), t->lsn);
-		if (sslikely(! (sf_is(r->scheme, sv_vpointer(v), SVGET)))) {
-			assert(stmt == NULL);
-			stmt = logv;
-		}
-	}
-	assert(stmt != NULL);
-	swv lv;
-	sw_writeadd(t->p, t, vlog, &lv, stmt);
-	int rc = ss_filewritev(&t->l->file, &p->iov);
-	if (ssunlikely(rc == -1)) {
-		sr_malfunction(p->r->e, "log file '%s' write error: %s",
-		               ss_pathof(&t->l->file.path),
-		               strerror(errno));
-		return -1;
-	}
-	ss_gcmark(&t->l->gc, 1);
-	ss_iovreset(&p->iov);
-	return 0;
+	sdpageiter *pi = (sdpageiter*)i->priv;
+	return pi->current != NULL;
 }
 
-static int
-sw_writestmt_multi(swtx *t, svlog *vlog)
+static inline void*
+sd_pageiter_of(ssiter *i)
 {
-	swmanager *p = t->p;
-	sw *l = t->l;
-	swv lvbuf[510]; /* 1 + 510 per syscall */
-	int lvp;
-	int rc;
-	lvp = 0;
-	/* transaction header */
-	swv *lv = &lvbuf[0];
-	lv->dsn   = 0;
-	lv->flags = SVBEGIN;
-	lv->size  = sv_logcount_write(vlog);
-	lv->crc   = ss_crcs(p->r->crc, lv, sizeof(swv), 0);
-	ss_iovadd(&p->iov, lv, sizeof(swv));
-	lvp++;
-	/* body */
-	ssiter i;
-	ss_iterinit(ss_bufiter, &i);
-	ss_iteropen(ss_bufiter, &i, &vlog->buf, sizeof(svlogv));
-	for (; ss_iterhas(ss_bufiter, &i); ss_iternext(ss_bufiter, &i))
-	{
-		if (ssunlikely(! ss_iovensure(&p->iov, 2))) {
-			rc = ss_filewritev(&l->file, &p->iov);
-			if (ssunlikely(rc == -1)) {
-				sr_malfunction(p->r->e, "log file '%s' write error: %s",
-				               ss_pathof(&l->file.path),
-				               strerror(errno));
-				return -1;
-			}
-			ss_iovreset(&p->iov);
-			lvp = 0;
-		}
-		svlogv *logv = ss_iterof(ss_bufiter, &i);
-		svv *v = logv->v;
-		sr *r = sv_logindex(vlog, logv->index_id)->r;
-		sf_lsnset(r->scheme, sv_vpointer(v), t->lsn);
-		if (sf_is(r->scheme, sv_vpointer(v), SVGET))
-			continue;
-		lv = &lvbuf[lvp];
-		sw_writeadd(p, t, vlog, lv, logv);
-		lvp++;
-	}
-	if (sslikely(ss_iovhas(&p->iov))) {
-		rc = ss_filewritev(&l->file, &p->iov);
-		if (ssunlikely(rc == -1)) {
-			sr_malfunction(p->r->e, "log file '%s' write error: %s",
-			               ss_pathof(&l->file.path),
-			               strerror(errno));
-			return -1;
-		}
-		ss_iovreset(&p->iov);
-	}
-	ss_gcmark(&l->gc, sv_logcount_write(vlog));
-	return 0;
+	sdpageiter *pi = (sdpageiter*)i->priv;
+	return pi->current;
 }
 
-int sw_write(swtx *t, svlog *vlog)
+static inline void
+sd_pageiter_next(ssiter *i)
 {
-	int count = sv_logcount_write(vlog);
-	/* fast path for log-disabled, recover or
-	 * ro-transactions
-	 */
-	if (t->recover || !t->p->conf.enable || count == 0)
-	{
-		ssiter i;
-		ss_iterinit(ss_bufiter, &i);
-		ss_iteropen(ss_bufiter, &i, &vlog->buf, sizeof(svlogv));
-		for (; ss_iterhas(ss_bufiter, &i); ss_iternext(ss_bufiter, &i))
-		{
-			svlogv *v = ss_iterof(ss_bufiter, &i);
-			sr *r = sv_logindex(vlog, v->index_id)->r;
-			sf_lsnset(r->scheme, sv_vpointer(v->v), t->lsn);
+	sdpageiter *pi = (sdpageiter*)i->priv;
+	if (pi->current == NULL)
+		return;
+	switch (pi->order) {
+	case SS_GTE:
+	case SS_GT:
+		pi->pos++;
+		if (ssunlikely(pi->pos >= pi->page->h->count)) {
+			sd_pageiter_end(pi);
+			return;
+		}
+		break;
+	case SS_LT:
+	case SS_LTE: {
+		/* key (dup) (dup) key (eof) */
+		int64_t pos = pi->pos + 1;
+		if (pos < pi->page->h->count) {
+			uint8_t flags =
+				sf_flags(pi->r->scheme,
+				         sd_pagepointer(pi->page, pi->r, pos));
+			if (flags & SVDUP) {
+				pi->pos = pos;
+				break;
+			}
 		}
-		return 0;
-	}
-
-	/* write single or multi-stmt transaction */
-	int rc;
-	if (sslikely(count == 1)) {
-		rc = sw_writestmt(t, vlog);
-	} else {
-		rc = sw_writestmt_multi(t, vlog);
+		/* skip current chain and position to
+		 * the previous one */
+		sd_pageiter_chain_head(pi, pi->pos);
+		sd_pageiter_chain_head(pi, pi->pos - 1);
+		break;
 	}
-	if (ssunlikely(rc == -1))
-		return -1;
-
-	/* sync */
-	if (t->p->conf.sync_on_write) {
-		rc = ss_filesync(&t->l->file);
-		if (ssunlikely(rc == -1)) {
-			sr_malfunction(t->p->r->e, "log file '%s' sync error: %s",
-			               ss_pathof(&t->l->file.path),
-			               strerror(errno));
-			return -1;
-		}
+	default: assert(0);
 	}
-	return 0;
+	sd_pageiter_result(pi);
 }
-#line 1 "sophia/wal/sw_conf.c"
+
+extern ssiterif sd_pageiter;
+
+#endif
+#line 1 "sophia/database/sd_index.h"
+#ifndef SD_INDEX_H_
+#define SD_INDEX_H_
 
 /*
  * sophia database
@@ -19043,150 +23415,311 @@ int sw_write(swtx *t, svlog *vlog)
  * BSD License
 */
 
+typedef struct sdindexheader sdindexheader;
+typedef struct sdindexpage sdindexpage;
+typedef struct sdindexbloom sdindexbloom;
+typedef struct sdindexvlogref sdindexvlogref;
+typedef struct sdindexvlog sdindexvlog;
+typedef struct sdindexexpire sdindexexpire;
+typedef struct sdindex sdindex;
+
+#define SD_INDEXBLOOM_MAGIC 0x326d6c62
+#define SD_INDEXBLOOM_MAGIC_V1 0x6d6f6c62
+#define SD_INDEXVLOG_MAGIC  0x676f6c76
+#define SD_INDEXEXPIRE_MAGIC 0x72707865
+
+struct sdindexheader {
+	uint32_t  crc;
+	srversion version;
+	uint64_t  offset;
+	uint32_t  size;
+	uint32_t  sizevmax;
+	uint32_t  count;
+	uint32_t  keys;
+	uint64_t  total;
+	uint64_t  totalorigin;
+	uint32_t  tsmin;
+	uint64_t  lsnmin;
+	uint64_t  lsnmax;
+	uint32_t  dupkeys;
+	uint64_t  dupmin;
+	uint16_t  align;
+} sspacked;
+
+struct sdindexpage {
+	uint64_t offset;
+	uint32_t offsetindex;
+	uint32_t size;
+	uint32_t sizeorigin;
+	uint16_t sizemin;
+	uint16_t sizemax;
+	uint64_t lsnmin;
+	uint64_t lsnmax;
+} sspacked;
 
+/* optional bloom filter trailer, placed after the
+ * page min/max keys and covered by the header size */
+struct sdindexbloom {
+	uint32_t magic;
+	uint32_t size;
+	uint32_t keys;
+	uint32_t probes;
+} sspacked;
 
+/* optional value log trailer, placed between the page
+ * min/max keys and the bloom filter: bytes of value
+ * log files referenced by the node */
+struct sdindexvlogref {
+	uint32_t id;
+	uint64_t size;
+	uint64_t end;
+} sspacked;
 
+struct sdindexvlog {
+	uint32_t magic;
+	uint32_t count;
+	uint64_t size;
+} sspacked;
 
+/* optional expire trailer, placed before the value
+ * log trailer: newest timestamp of each page and of
+ * the node */
+struct sdindexexpire {
+	uint32_t magic;
+	uint32_t count;
+	uint32_t tsmax;
+} sspacked;
 
+struct sdindex {
+	ssbuf i;
+	sdindexheader *h;
+};
 
-void sw_confinit(swconf *c)
-{
-	c->enable         = 1;
-	c->path           = NULL;
-	c->rotatewm       = 500000;
-	c->sync_on_write  = 0;
-	c->sync_on_rotate = 1;
+static inline char*
+sd_indexpage_min(sdindex *i, sdindexpage *p) {
+	return (char*)i->i.s + p->offsetindex;
 }
 
-void sw_conffree(swconf *c, ssa *a)
-{
-	if (c->path)
-		ss_free(a, c->path);
+static inline char*
+sd_indexpage_max(sdindex *i, sdindexpage *p) {
+	return sd_indexpage_min(i, p) + p->sizemin;
 }
 
-int sw_confset_path(swconf *c, ssa *a, char *path)
-{
-	char *sz = ss_strdup(a, path);
-	if (ssunlikely(sz == NULL))
-		return -1;
-	if (c->path)
-		ss_free(a, c->path);
-	c->path = sz;
-	return 0;
+static inline void
+sd_indexinit(sdindex *i) {
+	ss_bufinit(&i->i);
+	i->h = NULL;
 }
-#line 1 "sophia/wal/sw_dir.c"
 
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
+static inline void
+sd_indexfree(sdindex *i, sr *r) {
+	ss_buffree(&i->i, r->a);
+}
 
+static inline sdindexheader*
+sd_indexheader(sdindex *i) {
+	assert(i->i.s != NULL);
+	return (sdindexheader*)(i->i.p - sizeof(sdindexheader));
+}
 
+static inline sdindexpage*
+sd_indexpage(sdindex *i, uint32_t pos)
+{
+	assert(pos < i->h->count);
+	sdindexpage *index =
+		(sdindexpage*)
+			((char*)i->h - (i->h->align +
+			               (i->h->count * sizeof(sdindexpage))));
+	return &index[pos];
+}
 
+static inline sdindexpage*
+sd_indexmin(sdindex *i) {
+	return sd_indexpage(i, 0);
+}
 
+static inline sdindexpage*
+sd_indexmax(sdindex *i) {
+	return sd_indexpage(i, i->h->count - 1);
+}
 
+static inline int
+sd_indexprefix(sdindex *i)
+{
+	assert(i->h != NULL);
+	return i->h->version.c == SD_PAGEPREFIX;
+}
 
+static inline uint32_t
+sd_indexkeys(sdindex *i)
+{
+	assert(i->h != NULL);
+	return sd_indexheader(i)->keys;
+}
 
-static inline ssize_t sw_diridof(char *s)
+static inline uint32_t
+sd_indextotal(sdindex *i)
 {
-	size_t v = 0;
-	while (*s && *s != '.') {
-		if (ssunlikely(!isdigit(*s)))
-			return -1;
-		v = (v * 10) + *s - '0';
-		s++;
-	}
-	return v;
+	assert(i->h != NULL);
+	return sd_indexheader(i)->total;
 }
 
-static inline swdirid*
-sw_dirmatch(ssbuf *list, uint64_t id)
+static inline sdindexbloom*
+sd_indexbloom(sdindex *i)
 {
-	if (ssunlikely(ss_bufused(list) == 0))
+	sdindexheader *h = i->h;
+	if (ssunlikely(h->count == 0))
 		return NULL;
-	swdirid *n = (swdirid*)list->s;
-	while ((char*)n < list->p) {
-		if (n->id == id)
-			return n;
-		n++;
-	}
-	return NULL;
+	sdindexpage *max = sd_indexmax(i);
+	char *keys_end = sd_indexpage_max(i, max) + max->sizemax;
+	char *end = (char*)h - (h->align + (h->count * sizeof(sdindexpage)));
+	if (sslikely((end - keys_end) < (int)sizeof(sdindexbloom)))
+		return NULL;
+	sdindexbloom *b = (sdindexbloom*)(end - sizeof(sdindexbloom));
+	if (ssunlikely(b->magic != SD_INDEXBLOOM_MAGIC &&
+	               b->magic != SD_INDEXBLOOM_MAGIC_V1))
+		return NULL;
+	return b;
 }
 
-static inline swdirtype*
-sw_dirtypeof(swdirtype *types, char *ext)
+static inline sdindexvlog*
+sd_indexvlog(sdindex *i)
 {
-	swdirtype *p = &types[0];
-	int n = 0;
-	while (p[n].ext != NULL) {
-		if (strcmp(p[n].ext, ext) == 0)
-			return &p[n];
-		n++;
-	}
-	return NULL;
+	sdindexheader *h = i->h;
+	if (ssunlikely(h->count == 0))
+		return NULL;
+	sdindexpage *max = sd_indexmax(i);
+	char *keys_end = sd_indexpage_max(i, max) + max->sizemax;
+	char *end = (char*)h - (h->align + (h->count * sizeof(sdindexpage)));
+	sdindexbloom *bloom = sd_indexbloom(i);
+	if (bloom)
+		end = (char*)bloom - bloom->size;
+	if (sslikely((end - keys_end) < (int)sizeof(sdindexvlog)))
+		return NULL;
+	sdindexvlog *v = (sdindexvlog*)(end - sizeof(sdindexvlog));
+	if (ssunlikely(v->magic != SD_INDEXVLOG_MAGIC))
+		return NULL;
+	return v;
 }
 
-static int
-sw_dircmp(const void *p1, const void *p2)
+static inline sdindexvlogref*
+sd_indexvlog_ref(sdindexvlog *v, uint32_t pos)
 {
-	swdirid *a = (swdirid*)p1;
-	swdirid *b = (swdirid*)p2;
-	assert(a->id != b->id);
-	return (a->id > b->id)? 1: -1;
+	assert(pos < v->count);
+	sdindexvlogref *ref =
+		(sdindexvlogref*)((char*)v - v->count * sizeof(sdindexvlogref));
+	return &ref[pos];
 }
 
-int sw_dirread(ssbuf *list, ssa *a, swdirtype *types, char *dir)
+static inline sdindexexpire*
+sd_indexexpire(sdindex *i)
 {
-	DIR *d = opendir(dir);
-	if (ssunlikely(d == NULL))
-		return -1;
+	sdindexheader *h = i->h;
+	if (ssunlikely(h->count == 0))
+		return NULL;
+	sdindexpage *max = sd_indexmax(i);
+	char *keys_end = sd_indexpage_max(i, max) + max->sizemax;
+	char *end = (char*)h - (h->align + (h->count * sizeof(sdindexpage)));
+	sdindexbloom *bloom = sd_indexbloom(i);
+	if (bloom)
+		end = (char*)bloom - bloom->size;
+	sdindexvlog *vlog = sd_indexvlog(i);
+	if (vlog)
+		end = (char*)vlog - vlog->count * sizeof(sdindexvlogref);
+	if (sslikely((end - keys_end) < (int)sizeof(sdindexexpire)))
+		return NULL;
+	sdindexexpire *e = (sdindexexpire*)(end - sizeof(sdindexexpire));
+	if (ssunlikely(e->magic != SD_INDEXEXPIRE_MAGIC ||
+	               e->count != h->count))
+		return NULL;
+	return e;
+}
 
-	struct dirent *de;
-	while ((de = readdir(d))) {
-		if (ssunlikely(de->d_name[0] == '.'))
-			continue;
-		ssize_t id = sw_diridof(de->d_name);
-		if (ssunlikely(id == -1))
-			goto error;
-		char *ext = strstr(de->d_name, ".");
-		if (ssunlikely(ext == NULL))
-			goto error;
-		ext++;
-		swdirtype *type = sw_dirtypeof(types, ext);
-		if (ssunlikely(type == NULL))
-			continue;
-		swdirid *n = sw_dirmatch(list, id);
-		if (n) {
-			n->mask |= type->mask;
-			type->count++;
-			continue;
-		}
-		int rc = ss_bufensure(list, a, sizeof(swdirid));
-		if (ssunlikely(rc == -1))
-			goto error;
-		n = (swdirid*)list->p;
-		ss_bufadvance(list, sizeof(swdirid));
-		n->id  = id;
-		n->mask = type->mask;
-		type->count++;
+static inline uint32_t
+sd_indexexpire_page(sdindexexpire *e, uint32_t pos)
+{
+	assert(pos < e->count);
+	uint32_t *tsmax = (uint32_t*)((char*)e - e->count * sizeof(uint32_t));
+	return tsmax[pos];
+}
+
+static inline uint32_t
+sd_indexbloom_hash(sr *r, char *key)
+{
+	/* spread fnv output so that probes do not cluster
+	 * on sequential keys */
+	uint32_t h = sf_hash(r->scheme, key);
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+static inline int
+sd_indexbloom_has(sdindexbloom *b, uint32_t hash)
+{
+	/* filters of the first version xored the hashes of
+	 * key parts, they are kept to locate the trailers
+	 * before them but can not rule a key out */
+	if (ssunlikely(b->magic == SD_INDEXBLOOM_MAGIC_V1))
+		return 1;
+	uint8_t *bits = (uint8_t*)b - b->size;
+	uint32_t nbits = b->size * 8;
+	uint32_t delta = (hash >> 17) | (hash << 15);
+	uint32_t j = 0;
+	while (j < b->probes) {
+		uint32_t pos = hash % nbits;
+		if (! (bits[pos / 8] & (1 << (pos % 8))))
+			return 0;
+		hash += delta;
+		j++;
 	}
-	closedir(d);
+	return 1;
+}
 
-	if (ssunlikely(ss_bufused(list) == 0))
-		return 0;
+static inline uint32_t
+sd_indexsize_ext(sdindexheader *h)
+{
+	return h->align + h->size + sizeof(sdindexheader);
+}
 
-	int n = ss_bufused(list) / sizeof(swdirid);
-	qsort(list->s, n, sizeof(swdirid), sw_dircmp);
-	return n;
+static inline int
+sd_indexcopy(sdindex *i, sr *r, sdindexheader *h)
+{
+	int size = sd_indexsize_ext(h);
+	int rc = ss_bufensure(&i->i, r->a, size);
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+	char *start = (char*)h - (h->align + h->size);
+	memcpy(i->i.s, start, size);
+	ss_bufadvance(&i->i, size);
+	i->h = sd_indexheader(i);
+	return 0;
+}
 
-error:
-	closedir(d);
-	return -1;
+static inline int
+sd_indexcopy_buf(sdindex *i, sr *r, ssbuf *v, ssbuf *m)
+{
+	sdindexheader *h = (sdindexheader*)(m->p - sizeof(sdindexheader));
+	int size = sd_indexsize_ext(h);
+	assert(size == (ss_bufused(v) + ss_bufused(m)));
+	int rc = ss_bufensure(&i->i, r->a, size);
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+	memcpy(i->i.s, v->s, ss_bufused(v));
+	ss_bufadvance(&i->i, ss_bufused(v));
+	memcpy(i->i.p, m->s, ss_bufused(m));
+	ss_bufadvance(&i->i, ss_bufused(m));
+	i->h = sd_indexheader(i);
+	return 0;
 }
-#line 1 "sophia/wal/sw_iter.c"
+
+#endif
+#line 1 "sophia/database/sd_indexiter.h"
+#ifndef SD_INDEXITER_H_
+#define SD_INDEXITER_H_
 
 /*
  * sophia database
@@ -19196,212 +23729,434 @@ error:
  * BSD License
 */
 
+typedef struct sdindexiter sdindexiter;
 
-
-
-
-
-
-typedef struct switer switer;
-
-struct switer {
-	int validate;
-	int error;
-	ssfile *log;
-	ssmmap map;
-	swv *v;
-	swv *next;
-	uint32_t count;
-	uint32_t pos;
-	sr *r;
+struct sdindexiter {
+	sdindex     *index;
+	sdindexpage *v;
+	int          pos;
+	ssorder      cmp;
+	char        *key;
+	sr          *r;
 } sspacked;
 
-static void
-sw_iterseterror(switer *i)
+static inline int
+sd_indexiter_route(sdindexiter *i)
 {
-	i->error = 1;
-	i->v     = NULL;
-	i->next  = NULL;
+	int begin = 0;
+	int end = i->index->h->count - 1;
+	while (begin != end) {
+		int mid = begin + (end - begin) / 2;
+		sdindexpage *page = sd_indexpage(i->index, mid);
+		int rc = sf_compare(i->r->scheme,
+		                    sd_indexpage_max(i->index, page),
+		                    i->key);
+		if (rc < 0) {
+			begin = mid + 1;
+		} else {
+			/* rc >= 0 */
+			end = mid;
+		}
+	}
+	if (ssunlikely(end >= (int)i->index->h->count))
+		end = i->index->h->count - 1;
+	return end;
 }
 
-static int
-sw_iternext_of(switer *i, swv *next, int validate)
+static inline int
+sd_indexiter_open(ssiter *i, sr *r, sdindex *index, ssorder o, char *key)
 {
-	if (next == NULL)
-		return 0;
-	char *eof   = (char*)i->map.p + i->map.size;
-	char *start = (char*)next;
-
-	/* eof */
-	if (ssunlikely(start == eof)) {
-		if (i->count != i->pos) {
-			sr_malfunction(i->r->e, "corrupted log file '%s': transaction is incomplete",
-			               ss_pathof(&i->log->path));
-			sw_iterseterror(i);
-			return -1;
+	sdindexiter *ii = (sdindexiter*)i->priv;
+	ii->r     = r;
+	ii->index = index;
+	ii->cmp   = o;
+	ii->key   = key;
+	ii->v     = NULL;
+	ii->pos   = 0;
+	if (ssunlikely(ii->index->h->count == 1)) {
+		/* skip bootstrap node  */
+		if (ii->index->h->lsnmin == UINT64_MAX &&
+		    ii->index->h->lsnmax == 0)
+			return 0;
+	}
+	if (ii->key == NULL) {
+		switch (ii->cmp) {
+		case SS_LT:
+		case SS_LTE: ii->pos = ii->index->h->count - 1;
+			break;
+		case SS_GT:
+		case SS_GTE: ii->pos = 0;
+			break;
+		default:
+			assert(0);
 		}
-		i->v = NULL;
-		i->next = NULL;
+		ii->v = sd_indexpage(ii->index, ii->pos);
 		return 0;
 	}
+	if (sslikely(ii->index->h->count > 1))
+		ii->pos = sd_indexiter_route(ii);
 
-	char *end = start + next->size;
-	if (ssunlikely((start > eof || (end > eof)))) {
-		sr_malfunction(i->r->e, "corrupted log file '%s': bad record size",
-		               ss_pathof(&i->log->path));
-		sw_iterseterror(i);
-		return -1;
-	}
-	if (validate && i->validate)
-	{
-		uint32_t crc = 0;
-		if (! (next->flags & SVBEGIN)) {
-			crc = ss_crcp(i->r->crc, start + sizeof(swv), next->size, 0);
-		}
-		crc = ss_crcs(i->r->crc, start, sizeof(swv), crc);
-		if (ssunlikely(crc != next->crc)) {
-			sr_malfunction(i->r->e, "corrupted log file '%s': bad record crc",
-			               ss_pathof(&i->log->path));
-			sw_iterseterror(i);
-			return -1;
-		}
+	sdindexpage *p = sd_indexpage(ii->index, ii->pos);
+	int rc;
+	switch (ii->cmp) {
+	case SS_LTE:
+	case SS_LT:
+		rc = sf_compare(ii->r->scheme, sd_indexpage_min(ii->index, p),
+		                ii->key);
+		if (rc ==  1 || (rc == 0 && ii->cmp == SS_LT))
+			ii->pos--;
+		break;
+	case SS_GTE:
+	case SS_GT:
+		rc = sf_compare(ii->r->scheme, sd_indexpage_max(ii->index, p),
+		                ii->key);
+		if (rc == -1 || (rc == 0 && ii->cmp == SS_GT))
+			ii->pos++;
+		break;
+	default: assert(0);
 	}
-	i->pos++;
-	if (i->pos > i->count) {
-		/* next transaction */
-		i->v     = NULL;
-		i->pos   = 0;
-		i->count = 0;
-		i->next  = next;
+	if (ssunlikely(ii->pos == -1 ||
+	               ii->pos >= (int)ii->index->h->count))
 		return 0;
-	}
-	i->v = next;
-	return 1;
+	ii->v = sd_indexpage(ii->index, ii->pos);
+	return 0;
 }
 
-int sw_itercontinue_of(switer *i)
+static inline void
+sd_indexiter_close(ssiter *i ssunused)
+{ }
+
+static inline int
+sd_indexiter_has(ssiter *i)
 {
-	if (ssunlikely(i->error))
-		return -1;
-	if (ssunlikely(i->v))
-		return 1;
-	if (ssunlikely(i->next == NULL))
-		return 0;
-	int validate = 0;
-	i->pos   = 0;
-	i->count = 0;
-	swv *v = i->next;
-	if (v->flags & SVBEGIN) {
-		validate = 1;
-		i->count = v->size;
-		v = (swv*)((char*)i->next + sizeof(swv));
-	} else {
-		i->count = 1;
-		v = i->next;
+	sdindexiter *ii = (sdindexiter*)i->priv;
+	return ii->v != NULL;
+}
+
+static inline void*
+sd_indexiter_of(ssiter *i)
+{
+	sdindexiter *ii = (sdindexiter*)i->priv;
+	return ii->v;
+}
+
+static inline void
+sd_indexiter_next(ssiter *i)
+{
+	sdindexiter *ii = (sdindexiter*)i->priv;
+	switch (ii->cmp) {
+	case SS_LT:
+	case SS_LTE: ii->pos--;
+		break;
+	case SS_GT:
+	case SS_GTE: ii->pos++;
+		break;
+	default:
+		assert(0);
+		break;
 	}
-	return sw_iternext_of(i, v, validate);
+	if (ssunlikely(ii->pos < 0))
+		ii->v = NULL;
+	else
+	if (ssunlikely(ii->pos >= (int)ii->index->h->count))
+		ii->v = NULL;
+	else
+		ii->v = sd_indexpage(ii->index, ii->pos);
 }
 
+extern ssiterif sd_indexiter;
+
+#endif
+#line 1 "sophia/database/sd_vlog.h"
+#ifndef SD_VLOG_H_
+#define SD_VLOG_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct sdvlogref sdvlogref;
+typedef struct sdvlogfile sdvlogfile;
+typedef struct sdvlog sdvlog;
+
+/* value fields of a separated document (SVVLOG) are
+ * replaced by references to the value log */
+struct sdvlogref {
+	uint32_t id;
+	uint32_t size;
+	uint64_t offset;
+} sspacked;
+
+struct sdvlogfile {
+	uint32_t id;
+	uint32_t refs;
+	uint32_t gc;
+	uint32_t writers;
+	uint32_t backup;
+	uint64_t backup_size;
+	uint64_t synced;
+	uint64_t live;
+	ssfile   file;
+	sslist   link;
+};
+
+struct sdvlog {
+	ssmutex     lock;
+	sslist      list;
+	uint32_t    count;
+	uint32_t    gc_count;
+	uint32_t    seq;
+	int         online;
+	int         sync;
+	uint64_t    size_file;
+	sdvlogfile *current;
+	char       *path;
+};
+
 static inline int
-sw_iterprepare(switer *i)
-{
-	srversion *ver = (srversion*)i->map.p;
-	if (! sr_versionstorage_check(ver))
-		return sr_malfunction(i->r->e, "bad log file '%s' version",
-		                      ss_pathof(&i->log->path));
-	if (ssunlikely(i->log->size < (sizeof(srversion))))
-		return sr_malfunction(i->r->e, "corrupted log file '%s': bad size",
-		                      ss_pathof(&i->log->path));
-	swv *next = (swv*)((char*)i->map.p + sizeof(srversion));
-	int rc = sw_iternext_of(i, next, 1);
-	if (ssunlikely(rc == -1))
-		return -1;
-	if (sslikely(i->next))
-		return sw_itercontinue_of(i);
-	return 0;
+sd_vlogfield(sffield *f) {
+	return f->fixed_size == 0 && !f->key;
 }
 
-int sw_iter_open(ssiter *i, sr *r, ssfile *file, int validate)
+static inline uint32_t
+sd_vlogsize(sfscheme *s, char *v)
 {
-	switer *li = (switer*)i->priv;
-	memset(li, 0, sizeof(*li));
-	li->r        = r;
-	li->log      = file;
-	li->validate = validate;
-	if (ssunlikely(li->log->size < sizeof(srversion))) {
-		sr_malfunction(li->r->e, "corrupted log file '%s': bad size",
-		               ss_pathof(&li->log->path));
-		return -1;
-	}
-	if (ssunlikely(li->log->size == sizeof(srversion)))
-		return 0;
-	int rc = ss_vfsmmap(r->vfs, &li->map, li->log->fd, li->log->size, 1);
-	if (ssunlikely(rc == -1)) {
-		sr_malfunction(li->r->e, "failed to mmap log file '%s': %s",
-		               ss_pathof(&li->log->path),
-		               strerror(errno));
-		return -1;
+	/* size of the fields which can be separated */
+	uint32_t size = 0;
+	int i = 0;
+	while (i < s->fields_count) {
+		sffield *f = s->fields[i];
+		if (sd_vlogfield(f))
+			size += sf_var(s, f->position_ref, v)->size;
+		i++;
 	}
-	rc = sw_iterprepare(li);
-	if (ssunlikely(rc == -1))
-		ss_vfsmunmap(r->vfs, &li->map);
-	return 0;
+	return size;
 }
 
-static void
-sw_iter_close(ssiter *i)
-{
-	switer *li = (switer*)i->priv;
-	ss_vfsmunmap(li->r->vfs, &li->map);
+void sd_vloginit(sdvlog*);
+int  sd_vlogopen(sdvlog*, sr*, char*, uint64_t, int);
+int  sd_vlogonline(sdvlog*, sr*);
+void sd_vlogfree(sdvlog*, sr*);
+int  sd_vlogref(sdvlog*, sr*, sdindex*);
+int  sd_vlogunref(sdvlog*, sr*, sdindex*);
+int  sd_vlogunpin(sdvlog*, sr*, ssbuf*);
+int  sd_vlogwrite(sdvlog*, sr*, char*, ssbuf*, ssbuf*);
+int  sd_vlogtrack(sdvlog*, sr*, char*, ssbuf*);
+int  sd_vlogread(sdvlog*, sr*, char*, ssbuf*);
+int  sd_vlogkeys(sr*, char*, ssbuf*);
+int  sd_vlogsync(sdvlog*, sr*, sdindex*);
+int  sd_vlogmark(sdvlog*, uint32_t);
+int  sd_vloggc(sdvlog*, sr*, char*);
+int  sd_vloggc_index(sdvlog*, sdindex*);
+int  sd_vlogcopy(sdvlog*, sr*, sdindex*, char*, char*, uint32_t, ssbuf*);
+void sd_vlogstat(sdvlog*, uint32_t*, uint64_t*, uint64_t*);
+
+#endif
+#line 1 "sophia/database/sd_build.h"
+#ifndef SD_BUILD_H_
+#define SD_BUILD_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct sdbuild sdbuild;
+
+struct sdbuild {
+	ssbuf       m, v, c;
+	ssbuf       pk, pv, pl;
+	ssfilterif *compress_if;
+	ssdictset  *compress_dict;
+	int         compress;
+	int         prefix;
+	int         crc;
+	uint32_t    vmax;
+	uint32_t    tsmax;
+};
+
+void sd_buildinit(sdbuild*);
+void sd_buildfree(sdbuild*, sr*);
+void sd_buildreset(sdbuild*);
+void sd_buildgc(sdbuild*, sr*, int);
+
+static inline sdpageheader*
+sd_buildheader(sdbuild *b) {
+	return (sdpageheader*)(b->m.s);
 }
 
-static int
-sw_iter_has(ssiter *i)
+static inline char*
+sd_buildmin(sdbuild *b, sr *r ssunused)
 {
-	switer *li = (switer*)i->priv;
-	return li->v != NULL;
+	return b->v.s;
 }
 
-static void*
-sw_iter_of(ssiter *i)
+static inline char*
+sd_buildmax(sdbuild *b, sr *r)
 {
-	switer *li = (switer*)i->priv;
-	return li->v;
+	sdpageheader *h = sd_buildheader(b);
+	if (sf_schemefixed(r->scheme))
+		return b->v.s + (r->scheme->var_offset * (h->count - 1));
+	return b->v.s +
+	       *(uint32_t*)((char*)h + sizeof(sdpageheader) +
+	                    (sizeof(uint32_t) * (h->count - 1)));
 }
 
-static void
-sw_iter_next(ssiter *i)
+static inline uint32_t
+sd_buildsize(sdbuild *b)
 {
-	switer *li = (switer*)i->priv;
-	if (ssunlikely(li->v == NULL))
-		return;
-	swv *next =
-		(swv*)((char*)li->v + sizeof(swv) + li->v->size);
-	sw_iternext_of(li, next, 1);
+	/* page size before compression */
+	if (b->prefix)
+		return sizeof(uint32_t) + ss_bufused(&b->pk) +
+		       ss_bufused(&b->pv);
+	return ss_bufused(&b->m) + ss_bufused(&b->v) - sizeof(sdpageheader);
 }
 
-ssiterif sw_iter =
-{
-	.close = sw_iter_close,
-	.has   = sw_iter_has,
-	.of    = sw_iter_of,
-	.next  = sw_iter_next
+int sd_buildbegin(sdbuild*, sr*, int, int, int, ssfilterif*, ssdictset*);
+int sd_buildend(sdbuild*, sr*);
+int sd_buildadd(sdbuild*, sr*, char*, uint8_t);
+
+#endif
+#line 1 "sophia/database/sd_buildindex.h"
+#ifndef SD_BUILDINDEX_H_
+#define SD_BUILDINDEX_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct sdbuildindex sdbuildindex;
+
+struct sdbuildindex {
+	ssbuf         v, m;
+	ssbuf         hash;
+	ssbuf         vlog;
+	ssbuf         expire;
+	sdindexheader build;
 };
 
-int sw_iter_error(ssiter *i)
-{
-	switer *li = (switer*)i->priv;
-	return li->error;
-}
+void sd_buildindex_init(sdbuildindex*);
+void sd_buildindex_free(sdbuildindex*, sr*);
+void sd_buildindex_reset(sdbuildindex*);
+void sd_buildindex_gc(sdbuildindex*, sr*, int);
+int  sd_buildindex_begin(sdbuildindex*, int);
+int  sd_buildindex_end(sdbuildindex*, sr*, uint32_t, uint64_t);
+int  sd_buildindex_add(sdbuildindex*, sr*, sdbuild*, uint64_t);
+int  sd_buildindex_addhash(sdbuildindex*, sr*, char*);
+int  sd_buildindex_bloom(sdbuildindex*, sr*, uint32_t);
+int  sd_buildindex_vlog(sdbuildindex*, sr*);
+int  sd_buildindex_expire(sdbuildindex*, sr*);
 
-int sw_iter_continue(ssiter *i)
-{
-	switer *li = (switer*)i->priv;
-	return sw_itercontinue_of(li);
-}
-#line 1 "sophia/database/sd_page.h"
-#ifndef SD_PAGE_H_
-#define SD_PAGE_H_
+#endif
+#line 1 "sophia/database/sd_merge.h"
+#ifndef SD_MERGE_H_
+#define SD_MERGE_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct sdmergepage sdmergepage;
+typedef struct sdmergeconf sdmergeconf;
+typedef struct sdmerge sdmerge;
+
+#define SD_MERGEBATCH 16
+
+/* page of a batch compressed by the job queue */
+struct sdmergepage {
+	sdbuild build;
+	ssjob   job;
+	sr     *r;
+};
+
+struct sdmergeconf {
+	uint32_t    write;
+	uint32_t    stream;
+	uint64_t    size_stream;
+	uint64_t    size_node;
+	uint32_t    size_page;
+	uint32_t    checksum;
+	uint32_t    prefix;
+	uint32_t    expire;
+	uint32_t    timestamp;
+	uint32_t    compression;
+	ssfilterif *compression_if;
+	ssdictset  *compression_dict;
+	uint32_t    direct_io;
+	uint32_t    direct_io_page_size;
+	uint32_t    bloom_bits_per_key;
+	uint64_t    vlsn;
+	sdvlog     *vlog;
+	uint32_t    vlog_threshold;
+	ssbuf      *vlog_buf;
+	ssbuf      *vlog_buf_read;
+	svrangeset *ranges;
+	ssjobq     *jobq;
+	sdmergepage *batch;
+	uint32_t    batch_size;
+};
+
+struct sdmerge {
+	sdindex      index;
+	ssiter       *merge;
+	ssiter       i;
+	sdmergeconf  *conf;
+	sr           *r;
+	sdbuild      *build;
+	sdbuildindex *build_index;
+	uint64_t     processed;
+	uint64_t     current;
+	uint64_t     limit;
+	int          resume;
+};
+
+int sd_mergeinit(sdmerge*, sr*, ssiter*, sdbuild*, sdbuildindex*,
+                 svupsert*, sdmergeconf*);
+int sd_mergefree(sdmerge*);
+int sd_merge(sdmerge*);
+int sd_mergepage(sdmerge*);
+sdbuild *sd_mergepageof(sdmerge*, int);
+int sd_mergecommit(sdmerge*, sdbuild*, uint64_t);
+int sd_mergeend(sdmerge*, uint64_t);
+
+#endif
+#line 1 "sophia/database/sd_iter.h"
+#ifndef SD_ITER_H_
+#define SD_ITER_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+int sd_iter_open(ssiter*, sr*, ssfile*);
+int sd_iter_iserror(ssiter*);
+int sd_iter_isroot(ssiter*);
+
+extern ssiterif sd_iter;
+
+#endif
+#line 1 "sophia/database/sd_scheme.h"
+#ifndef SD_SCHEME_H_
+#define SD_SCHEME_H_
 
 /*
  * sophia database
@@ -19411,49 +24166,64 @@ int sw_iter_continue(ssiter *i)
  * BSD License
 */
 
-typedef struct sdpageheader sdpageheader;
-typedef struct sdpage sdpage;
+typedef struct sdschemeheader sdschemeheader;
+typedef struct sdschemeopt sdschemeopt;
+typedef struct sdscheme sdscheme;
 
-struct sdpageheader {
+struct sdschemeheader {
 	uint32_t crc;
-	uint32_t crcdata;
+	uint32_t size;
 	uint32_t count;
-	uint32_t countdup;
-	uint32_t sizeorigin;
+} sspacked;
+
+struct sdschemeopt {
+	uint8_t  type;
+	uint8_t  id;
 	uint32_t size;
-	uint64_t lsnmin;
-	uint64_t lsnmindup;
-	uint64_t lsnmax;
-	uint32_t tsmin;
-	uint32_t reserve;
 } sspacked;
 
-struct sdpage {
-	sdpageheader *h;
+struct sdscheme {
+	ssbuf buf;
 };
 
 static inline void
-sd_pageinit(sdpage *p, sdpageheader *h) {
-	p->h = h;
+sd_schemeinit(sdscheme *c) {
+	ss_bufinit(&c->buf);
+}
+
+static inline void
+sd_schemefree(sdscheme *c, sr *r) {
+	ss_buffree(&c->buf, r->a);
 }
 
 static inline char*
-sd_pagepointer(sdpage *p, sr *r, uint32_t pos)
-{
-	assert(pos < p->h->count);
-	char *ptr = (char*)p->h + sizeof(sdpageheader);
-	if (sf_schemefixed(r->scheme))
-		return ptr + (r->scheme->var_offset * pos);
-	uint32_t *offset = (uint32_t*)ptr;
-	assert((sizeof(uint32_t) * p->h->count) +
-	        offset[pos] <= p->h->sizeorigin);
-	return ptr + (sizeof(uint32_t) * p->h->count) + offset[pos];
+sd_schemesz(sdschemeopt *o) {
+	assert(o->type == SS_STRING);
+	return (char*)o + sizeof(sdschemeopt);
+}
+
+static inline uint32_t
+sd_schemeu32(sdschemeopt *o) {
+	assert(o->type == SS_U32);
+	return sscastu32((char*)o + sizeof(sdschemeopt));
+}
+
+static inline uint64_t
+sd_schemeu64(sdschemeopt *o) {
+	assert(o->type == SS_U64);
+	return sscastu64((char*)o + sizeof(sdschemeopt));
 }
 
+int sd_schemebegin(sdscheme*, sr*);
+int sd_schemeadd(sdscheme*, sr*, uint8_t, sstype, void*, uint32_t);
+int sd_schemecommit(sdscheme*, sr*);
+int sd_schemewrite(sdscheme*, sr*, char*, int);
+int sd_schemerecover(sdscheme*, sr*, char*);
+
 #endif
-#line 1 "sophia/database/sd_pageiter.h"
-#ifndef SD_PAGEITER_H_
-#define SD_PAGEITER_H_
+#line 1 "sophia/database/sd_schemeiter.h"
+#ifndef SD_SCHEMEITER_H_
+#define SD_SCHEMEITER_H_
 
 /*
  * sophia database
@@ -19463,243 +24233,70 @@ sd_pagepointer(sdpage *p, sr *r, uint32_t pos)
  * BSD License
 */
 
-typedef struct sdpageiter sdpageiter;
+typedef struct sdschemeiter sdschemeiter;
 
-struct sdpageiter {
-	sdpage  *page;
-	int64_t  pos;
-	char    *current;
-	ssorder  order;
-	char    *key;
-	sr      *r;
+struct sdschemeiter {
+	sdscheme *c;
+	char *p;
 } sspacked;
 
-static inline void
-sd_pageiter_result(sdpageiter *i)
-{
-	if (ssunlikely(i->pos == i->page->h->count)) {
-		i->current = NULL;
-		return;
-	}
-	i->current = sd_pagepointer(i->page, i->r, i->pos);
-}
-
-static inline void
-sd_pageiter_end(sdpageiter *i)
-{
-	i->pos = i->page->h->count;
-	i->current = NULL;
-}
-
-static inline int
-sd_pageiter_cmp(sdpageiter *i, sr *r, uint32_t pos)
-{
-	return sf_compare(r->scheme, sd_pagepointer(i->page, i->r, pos), i->key);
-}
-
 static inline int
-sd_pageiter_search(sdpageiter *i)
-{
-	int min = 0;
-	int mid = 0;
-	int max = i->page->h->count - 1;
-	while (max >= min)
-	{
-		mid = min + (max - min) / 2;
-		int rc = sd_pageiter_cmp(i, i->r, mid);
-		switch (rc) {
-		case -1: min = mid + 1;
-			continue;
-		case  1: max = mid - 1;
-			continue;
-		default: return mid;
-		}
-	}
-	return min;
-}
-
-static inline void
-sd_pageiter_chain_head(sdpageiter *i, int64_t pos)
+sd_schemeiter_open(ssiter *i, sr *r, sdscheme *c, int validate)
 {
-	/* find first non-duplicate key */
-	while (pos >= 0) {
-		uint8_t flags =
-			sf_flags(i->r->scheme,
-			         sd_pagepointer(i->page, i->r, pos));
-		if (sslikely(! (flags & SVDUP))) {
-			i->pos = pos;
-			return;
+	sdschemeiter *ci = (sdschemeiter*)i->priv;
+	ci->c = c;
+	ci->p = NULL;
+	if (validate) {
+		sdschemeheader *h = (sdschemeheader*)c->buf.s;
+		uint32_t crc = ss_crcs(r->crc, h, ss_bufused(&c->buf), 0);
+		if (h->crc != crc) {
+			sr_malfunction(r->e, "%s", "scheme file corrupted");
+			return -1;
 		}
-		pos--;
 	}
-	sd_pageiter_end(i);
+	ci->p = c->buf.s + sizeof(sdschemeheader);
+	return 0;
 }
 
 static inline void
-sd_pageiter_chain_next(sdpageiter *i)
-{
-	/* skip to next duplicate chain */
-	int64_t pos = i->pos + 1;
-	while (pos < i->page->h->count) {
-		uint8_t flags =
-			sf_flags(i->r->scheme,
-			         sd_pagepointer(i->page, i->r, pos));
-		if (sslikely(! (flags & SVDUP))) {
-			i->pos = pos;
-			return;
-		}
-		pos++;
-	}
-	sd_pageiter_end(i);
-}
-
-static inline int
-sd_pageiter_gt(sdpageiter *i, int e)
-{
-	if (i->key == NULL) {
-		i->pos = 0;
-		return 0;
-	}
-	int64_t pos = sd_pageiter_search(i);
-	if (ssunlikely(pos >= i->page->h->count))
-		pos = i->page->h->count - 1;
-	sd_pageiter_chain_head(i, pos);
-	if (i->pos == i->page->h->count)
-		return 0;
-	int rc = sd_pageiter_cmp(i, i->r, i->pos);
-	int match = rc == 0;
-	switch (rc) {
-		case  0:
-			if (e) {
-				break;
-			}
-		case -1:
-			sd_pageiter_chain_next(i);
-			break;
-	}
-	return match;
-}
-
-static inline int
-sd_pageiter_lt(sdpageiter *i, int e)
-{
-	if (i->key == NULL) {
-		sd_pageiter_chain_head(i, i->page->h->count - 1);
-		return 0;
-	}
-	int64_t pos = sd_pageiter_search(i);
-	if (ssunlikely(pos >= i->page->h->count))
-		pos = i->page->h->count - 1;
-	sd_pageiter_chain_head(i, pos);
-	if (i->pos == i->page->h->count)
-		return 0;
-	int rc = sd_pageiter_cmp(i, i->r, i->pos);
-	int match = rc == 0;
-	switch (rc) {
-		case 0:
-			if (e) {
-				break;
-			}
-		case 1:
-			sd_pageiter_chain_head(i, i->pos - 1);
-			break;
-	}
-	return match;
-}
-
-static inline int
-sd_pageiter_open(ssiter *i, sr *r, sdpage *page, ssorder o,
-                 char *key)
+sd_schemeiter_close(ssiter *i ssunused)
 {
-	sdpageiter *pi = (sdpageiter*)i->priv;
-	pi->r     = r;
-	pi->page  = page;
-	pi->order = o;
-	pi->key   = key;
-	pi->pos   = 0;
-	if (ssunlikely(pi->page->h->count == 0)) {
-		sd_pageiter_end(pi);
-		return 0;
-	}
-	int rc = 0;
-	switch (pi->order) {
-	case SS_GT:  rc = sd_pageiter_gt(pi, 0);
-		break;
-	case SS_GTE: rc = sd_pageiter_gt(pi, 1);
-		break;
-	case SS_LT:  rc = sd_pageiter_lt(pi, 0);
-		break;
-	case SS_LTE: rc = sd_pageiter_lt(pi, 1);
-		break;
-	default: assert(0);
-	}
-	sd_pageiter_result(pi);
-	return rc;
-}
-
-static inline void
-sd_pageiter_close(ssiter *i ssunused)
-{ }
+	sdschemeiter *ci = (sdschemeiter*)i->priv;
+	(void)ci;
+}
 
 static inline int
-sd_pageiter_has(ssiter *i)
+sd_schemeiter_has(ssiter *i)
 {
-	sdpageiter *pi = (sdpageiter*)i->priv;
-	return pi->current != NULL;
+	sdschemeiter *ci = (sdschemeiter*)i->priv;
+	return ci->p < ci->c->buf.p;
 }
 
 static inline void*
-sd_pageiter_of(ssiter *i)
+sd_schemeiter_of(ssiter *i)
 {
-	sdpageiter *pi = (sdpageiter*)i->priv;
-	return pi->current;
+	sdschemeiter *ci = (sdschemeiter*)i->priv;
+	if (ssunlikely(ci->p >= ci->c->buf.p))
+		return NULL;
+	return ci->p;
 }
 
 static inline void
-sd_pageiter_next(ssiter *i)
+sd_schemeiter_next(ssiter *i)
 {
-	sdpageiter *pi = (sdpageiter*)i->priv;
-	if (pi->current == NULL)
+	sdschemeiter *ci = (sdschemeiter*)i->priv;
+	if (ssunlikely(ci->p >= ci->c->buf.p))
 		return;
-	switch (pi->order) {
-	case SS_GTE:
-	case SS_GT:
-		pi->pos++;
-		if (ssunlikely(pi->pos >= pi->page->h->count)) {
-			sd_pageiter_end(pi);
-			return;
-		}
-		break;
-	case SS_LT:
-	case SS_LTE: {
-		/* key (dup) (dup) key (eof) */
-		int64_t pos = pi->pos + 1;
-		if (pos < pi->page->h->count) {
-			uint8_t flags =
-				sf_flags(pi->r->scheme,
-				         sd_pagepointer(pi->page, pi->r, pos));
-			if (flags & SVDUP) {
-				pi->pos = pos;
-				break;
-			}
-		}
-		/* skip current chain and position to
-		 * the previous one */
-		sd_pageiter_chain_head(pi, pi->pos);
-		sd_pageiter_chain_head(pi, pi->pos - 1);
-		break;
-	}
-	default: assert(0);
-	}
-	sd_pageiter_result(pi);
+	sdschemeopt *o = (sdschemeopt*)ci->p;
+	ci->p = (char*)o + sizeof(sdschemeopt) + o->size;
 }
 
-extern ssiterif sd_pageiter;
+extern ssiterif sd_schemeiter;
 
 #endif
-#line 1 "sophia/database/sd_index.h"
-#ifndef SD_INDEX_H_
-#define SD_INDEX_H_
+#line 1 "sophia/database/sd_io.h"
+#ifndef SD_IO_H_
+#define SD_IO_H_
 
 /*
  * sophia database
@@ -19709,351 +24306,563 @@ extern ssiterif sd_pageiter;
  * BSD License
 */
 
-typedef struct sdindexheader sdindexheader;
-typedef struct sdindexpage sdindexpage;
-typedef struct sdindex sdindex;
+typedef struct sdio sdio;
 
-struct sdindexheader {
-	uint32_t  crc;
-	srversion version;
-	uint64_t  offset;
-	uint32_t  size;
-	uint32_t  sizevmax;
-	uint32_t  count;
-	uint32_t  keys;
-	uint64_t  total;
-	uint64_t  totalorigin;
-	uint32_t  tsmin;
-	uint64_t  lsnmin;
-	uint64_t  lsnmax;
-	uint32_t  dupkeys;
-	uint64_t  dupmin;
-	uint16_t  align;
-} sspacked;
+struct sdio {
+	ssbuf    buf;
+	int      direct;
+	uint32_t size_page;
+	uint32_t size_align;
+};
 
-struct sdindexpage {
-	uint64_t offset;
-	uint32_t offsetindex;
-	uint32_t size;
-	uint32_t sizeorigin;
-	uint16_t sizemin;
-	uint16_t sizemax;
-	uint64_t lsnmin;
-	uint64_t lsnmax;
-} sspacked;
+static inline uint64_t
+sd_iosize(sdio *s, ssfile *f) {
+	return f->size + (ss_bufused(&s->buf) - s->size_align);
+}
 
-struct sdindex {
-	ssbuf i;
-	sdindexheader *h;
+int sd_ioinit(sdio*);
+int sd_iofree(sdio*, sr*);
+int sd_ioprepare(sdio*, sr*, int, uint32_t, uint32_t);
+int sd_ioreset(sdio*);
+int sd_ioflush(sdio*, sr*, ssfile*);
+int sd_iowrite(sdio*, sr*, ssfile*, char*, int);
+int sd_ioread(sdio*, sr*, ssfile*, uint64_t, char*, int, int, char**);
+
+#endif
+#line 1 "sophia/database/sd_pagecache.h"
+#ifndef SD_PAGECACHE_H_
+#define SD_PAGECACHE_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct sdcachepage sdcachepage;
+typedef struct sdpagecacheshard sdpagecacheshard;
+typedef struct sdpagecache sdpagecache;
+
+#define SD_PAGECACHE_SHARDS 16
+
+struct sdcachepage {
+	uint64_t     node;
+	uint64_t     offset;
+	uint32_t     id;
+	uint32_t     hash;
+	uint32_t     size;
+	uint32_t     refs;
+	sdcachepage *next;
+	sslist       link;
+};
+
+struct sdpagecacheshard {
+	ssspinlock    lock;
+	sdcachepage **i;
+	uint32_t      size;
+	uint32_t      count;
+	uint64_t      used;
+	sslist        lru;
+};
+
+struct sdpagecache {
+	uint64_t         limit;
+	ssa             *a;
+	sdpagecacheshard shard[SD_PAGECACHE_SHARDS];
 };
 
 static inline char*
-sd_indexpage_min(sdindex *i, sdindexpage *p) {
-	return (char*)i->i.s + p->offsetindex;
+sd_cachepage_data(sdcachepage *p) {
+	return (char*)p + sizeof(sdcachepage);
 }
 
-static inline char*
-sd_indexpage_max(sdindex *i, sdindexpage *p) {
-	return sd_indexpage_min(i, p) + p->sizemin;
+static inline int
+sd_pagecache_enabled(sdpagecache *c) {
+	return c != NULL && c->limit > 0;
 }
 
+void sd_pagecache_init(sdpagecache*, ssa*);
+void sd_pagecache_free(sdpagecache*);
+uint64_t sd_pagecache_used(sdpagecache*);
+sdcachepage*
+sd_pagecache_get(sdpagecache*, uint32_t, uint64_t, uint64_t);
+sdcachepage*
+sd_pagecache_add(sdpagecache*, uint32_t, uint64_t, uint64_t, char*, uint32_t);
+void sd_pagecache_unpin(sdpagecache*, sdcachepage*);
+
+#endif
+#line 1 "sophia/database/sd_read.h"
+#ifndef SD_READ_H_
+#define SD_READ_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct sdread sdread;
+typedef struct sdreadarg sdreadarg;
+
+struct sdreadarg {
+	sdio       *io;
+	sdindex    *index;
+	ssbuf      *buf;
+	ssbuf      *buf_read;
+	ssiter     *index_iter;
+	ssiter     *page_iter;
+	ssmmap     *mmap;
+	ssfile     *file;
+	ssorder     o;
+	int         from_compaction;
+	int         has;
+	int         readahead;
+	uint64_t    has_vlsn;
+	int         use_mmap;
+	int         use_mmap_copy;
+	int         use_compression;
+	int         use_direct_io;
+	int         direct_io_page_size;
+	ssfilterif *compression_if;
+	ssdictset  *compression_dict;
+	sdpagecache *page_cache;
+	uint64_t    page_cache_node;
+	uint32_t    page_cache_id;
+	int         page_reuse;
+	sr         *r;
+};
+
+struct sdread {
+	sdreadarg    ra;
+	sdindexpage *ref;
+	sdpage       page;
+	sdcachepage *cached;
+	int          reads;
+	int          reads_cache;
+	int          ahead;
+	int          ahead_hit;
+} sspacked;
+
 static inline void
-sd_indexinit(sdindex *i) {
-	ss_bufinit(&i->i);
-	i->h = NULL;
+sd_read_unpin(sdread *i)
+{
+	if (i->cached) {
+		sd_pagecache_unpin(i->ra.page_cache, i->cached);
+		i->cached = NULL;
+	}
 }
 
-static inline void
-sd_indexfree(sdindex *i, sr *r) {
-	ss_buffree(&i->i, r->a);
+static inline int
+sd_read_pagedecode(sdread *i, sdindexpage *ref, char *page, uint32_t size)
+{
+	/* decode a prefix-compressed page into the buffer,
+	 * the page header is already copied and the encoded
+	 * page must not overlap the first ref->sizeorigin
+	 * bytes of it */
+	sdreadarg *arg = &i->ra;
+	sr *r = arg->r;
+	sdpageheader *h = (sdpageheader*)arg->buf->s;
+	int rc = -1;
+	if (sslikely(h->sizeorigin + sizeof(sdpageheader) == ref->sizeorigin)) {
+		/* buf_read is a scratch buffer for keys */
+		rc = ss_bufensure(arg->buf_read, r->a, ref->sizeorigin);
+		if (ssunlikely(rc == -1))
+			return sr_oom(r->e);
+		rc = sd_pageprefix_decode(r, h, page, size,
+		                          arg->buf->s + sizeof(sdpageheader),
+		                          arg->buf_read->s);
+	}
+	if (ssunlikely(rc == -1)) {
+		sr_malfunction(r->e, "db file '%s' corrupted page",
+		               ss_pathof(&arg->file->path));
+		return -1;
+	}
+	sd_pageinit(&i->page, h);
+	return 0;
 }
 
-static inline sdindexheader*
-sd_indexheader(sdindex *i) {
-	assert(i->i.s != NULL);
-	return (sdindexheader*)(i->i.p - sizeof(sdindexheader));
-}
+static inline int
+sd_read_pageload(sdread *i, sdindexpage *ref)
+{
+	sdreadarg *arg = &i->ra;
+	sr *r = arg->r;
+
+	int page_align = arg->io->size_page * 4;
+	/* pages requested by read-ahead are expected to be
+	 * served from the os page cache */
+	if (i->ahead_hit)
+		i->reads_cache++;
+	else
+		i->reads++;
+
+	/* prefix-compressed pages are decoded into the first
+	 * ref->sizeorigin bytes of the buffer */
+	int prefix = sd_indexprefix(arg->index);
+	int size = ref->sizeorigin + page_align;
+	if (prefix && !arg->use_compression)
+		size += ref->size;
+
+	ss_bufreset(arg->buf);
+	int rc = ss_bufensure(arg->buf, r->a, size);
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+
+	/* compression */
+	char *page_pointer;
+	if (arg->use_compression)
+	{
+		if (arg->use_mmap) {
+			page_pointer = arg->mmap->p + ref->offset;
+		} else {
+			ss_bufreset(arg->buf_read);
+			rc = ss_bufensure(arg->buf_read, r->a, ref->size + page_align);
+			if (ssunlikely(rc == -1))
+				return sr_oom(r->e);
+			rc = sd_ioread(arg->io, r, arg->file, ref->offset,
+			               arg->buf_read->s, ref->size,
+			               arg->from_compaction,
+			               &page_pointer);
+			if (ssunlikely(rc == -1))
+				return -1;
+			ss_bufadvance(arg->buf_read, ref->size);
+		}
+
+		/* copy header, prefix-compressed pages are
+		 * decompressed after the decoded page */
+		sdpageheader *h = (sdpageheader*)page_pointer;
+		if (prefix) {
+			rc = ss_bufensure(arg->buf, r->a, ref->sizeorigin + h->sizeencoded);
+			if (ssunlikely(rc == -1))
+				return sr_oom(r->e);
+		}
+		memcpy(arg->buf->p, page_pointer, sizeof(sdpageheader));
+		if (prefix)
+			ss_bufadvance(arg->buf, ref->sizeorigin);
+		else
+			ss_bufadvance(arg->buf, sizeof(sdpageheader));
+
+		/* decompression */
+		ssfilter f;
+		rc = ss_filterinit(&f, (ssfilterif*)arg->compression_if, r->a, SS_FOUTPUT,
+		                   arg->compression_dict);
+		if (ssunlikely(rc == -1)) {
+			sr_error(r->e, "db file '%s' decompression error",
+			         ss_pathof(&arg->file->path));
+			return -1;
+		}
+		int size = ref->size - sizeof(sdpageheader);
+		uint64_t start = ss_utime();
+		rc = ss_filternext(&f, arg->buf, page_pointer + sizeof(sdpageheader), size);
+		if (ssunlikely(rc == -1)) {
+			sr_error(r->e, "db file '%s' decompression error",
+			         ss_pathof(&arg->file->path));
+			return -1;
+		}
+		ss_filterfree(&f);
+		if (! arg->from_compaction)
+			sr_stathist(r->stat, SR_HDECOMPRESS, ss_utime() - start);
+		if (prefix)
+			return sd_read_pagedecode(i, ref, arg->buf->s + ref->sizeorigin,
+			                          h->sizeencoded);
+		sd_pageinit(&i->page, (sdpageheader*)arg->buf->s);
+		return 0;
+	}
+
+	/* mmap */
+	if (arg->use_mmap) {
+		if (prefix) {
+			page_pointer = arg->mmap->p + ref->offset;
+			memcpy(arg->buf->s, page_pointer, sizeof(sdpageheader));
+			return sd_read_pagedecode(i, ref, page_pointer + sizeof(sdpageheader),
+			                          ref->size - sizeof(sdpageheader));
+		}
+		if (arg->use_mmap_copy) {
+			memcpy(arg->buf->s, arg->mmap->p + ref->offset, ref->sizeorigin);
+			sd_pageinit(&i->page, (sdpageheader*)(arg->buf->s));
+		} else {
+			sd_pageinit(&i->page, (sdpageheader*)(arg->mmap->p + ref->offset));
+		}
+		return 0;
+	}
 
-static inline sdindexpage*
-sd_indexpage(sdindex *i, uint32_t pos)
-{
-	assert(pos < i->h->count);
-	sdindexpage *index =
-		(sdindexpage*)
-			((char*)i->h - (i->h->align +
-			               (i->h->count * sizeof(sdindexpage))));
-	return &index[pos];
-}
+	/* prefix-compressed */
+	if (prefix) {
+		rc = sd_ioread(arg->io, r, arg->file, ref->offset,
+		               arg->buf->s + ref->sizeorigin, ref->size,
+		               arg->from_compaction,
+		               &page_pointer);
+		if (ssunlikely(rc == -1))
+			return -1;
+		memcpy(arg->buf->s, page_pointer, sizeof(sdpageheader));
+		return sd_read_pagedecode(i, ref, page_pointer + sizeof(sdpageheader),
+		                          ref->size - sizeof(sdpageheader));
+	}
 
-static inline sdindexpage*
-sd_indexmin(sdindex *i) {
-	return sd_indexpage(i, 0);
+	/* default */
+	rc = sd_ioread(arg->io, r, arg->file, ref->offset,
+	               arg->buf->s, ref->size,
+	               arg->from_compaction,
+	               &page_pointer);
+	if (ssunlikely(rc == -1))
+		return -1;
+	ss_bufadvance(arg->buf, ref->size);
+	sd_pageinit(&i->page, (sdpageheader*)page_pointer);
+	return 0;
 }
 
-static inline sdindexpage*
-sd_indexmax(sdindex *i) {
-	return sd_indexpage(i, i->h->count - 1);
+static inline int
+sd_read_page(sdread *i, sdindexpage *ref)
+{
+	sdreadarg *arg = &i->ra;
+	sd_read_unpin(i);
+	/* mmap pages without compression are used in place */
+	if (! sd_pagecache_enabled(arg->page_cache) ||
+	     (arg->use_mmap && !arg->use_compression &&
+	      !sd_indexprefix(arg->index)))
+		return sd_read_pageload(i, ref);
+
+	sdcachepage *p;
+	p = sd_pagecache_get(arg->page_cache, arg->page_cache_id,
+	                     arg->page_cache_node, ref->offset);
+	if (p) {
+		i->reads_cache++;
+		i->cached = p;
+		sd_pageinit(&i->page, (sdpageheader*)sd_cachepage_data(p));
+		return 0;
+	}
+	int rc = sd_read_pageload(i, ref);
+	if (ssunlikely(rc == -1))
+		return -1;
+	/* failure to cache the page is not an error */
+	p = sd_pagecache_add(arg->page_cache, arg->page_cache_id,
+	                     arg->page_cache_node, ref->offset,
+	                     (char*)i->page.h, ref->sizeorigin);
+	if (p) {
+		i->cached = p;
+		sd_pageinit(&i->page, (sdpageheader*)sd_cachepage_data(p));
+	}
+	return 0;
 }
 
-static inline uint32_t
-sd_indexkeys(sdindex *i)
+static inline void
+sd_read_advise(sdindex *index, ssfile *file, int from, int to)
 {
-	assert(i->h != NULL);
-	return sd_indexheader(i)->keys;
+	sdindexpage *first = sd_indexpage(index, from);
+	sdindexpage *last  = sd_indexpage(index, to);
+	/* read-ahead is a hint, errors are ignored */
+	ss_fileadvise(file, SS_ADVISE_WILLNEED, first->offset,
+	              (last->offset + last->size) - first->offset);
 }
 
-static inline uint32_t
-sd_indextotal(sdindex *i)
+static inline void
+sd_read_aheadnode(sdindex *index, ssfile *file, ssorder o, int n)
 {
-	assert(i->h != NULL);
-	return sd_indexheader(i)->total;
+	if (ssunlikely(index->h == NULL || index->h->count == 0))
+		return;
+	int count = index->h->count;
+	if (n > count)
+		n = count;
+	if (o == SS_LT || o == SS_LTE)
+		sd_read_advise(index, file, count - n, count - 1);
+	else
+		sd_read_advise(index, file, 0, n - 1);
 }
 
-static inline uint32_t
-sd_indexsize_ext(sdindexheader *h)
+static inline void
+sd_read_ahead(sdread *i)
 {
-	return h->align + h->size + sizeof(sdindexheader);
+	sdreadarg *arg = &i->ra;
+	int n = arg->readahead;
+	int count = arg->index->h->count;
+	int pos = i->ref - sd_indexpage(arg->index, 0);
+	/* i->ahead is the last page advised in scan order, a new
+	 * hint is issued once less than a half of the window
+	 * is left ahead of the current page */
+	int half = (n + 1) / 2;
+	int from, to;
+	if (arg->o == SS_LT || arg->o == SS_LTE) {
+		int ahead = i->ahead >= 0 && i->ahead < pos;
+		i->ahead_hit = i->ahead >= 0 && pos >= i->ahead;
+		if (ahead && (pos - i->ahead) >= half)
+			return;
+		to   = ahead ? i->ahead - 1 : pos - 1;
+		from = (pos > n) ? pos - n : 0;
+		if (from > to)
+			return;
+		sd_read_advise(arg->index, arg->file, from, to);
+		i->ahead = from;
+		return;
+	}
+	int ahead = i->ahead > pos;
+	i->ahead_hit = pos <= i->ahead;
+	if (ahead && (i->ahead - pos) >= half)
+		return;
+	from = ahead ? i->ahead + 1 : pos + 1;
+	to   = (pos + n < count) ? pos + n : count - 1;
+	if (from > to)
+		return;
+	sd_read_advise(arg->index, arg->file, from, to);
+	i->ahead = to;
 }
 
 static inline int
-sd_indexcopy(sdindex *i, sr *r, sdindexheader *h)
+sd_read_openpage(sdread *i, char *key)
 {
-	int size = sd_indexsize_ext(h);
-	int rc = ss_bufensure(&i->i, r->a, size);
+	sdreadarg *arg = &i->ra;
+	assert(i->ref != NULL);
+	if (arg->readahead && !arg->use_direct_io)
+		sd_read_ahead(i);
+	int rc = sd_read_page(i, i->ref);
+	i->ahead_hit = 0;
 	if (ssunlikely(rc == -1))
-		return sr_oom(r->e);
-	char *start = (char*)h - (h->align + h->size);
-	memcpy(i->i.s, start, size);
-	ss_bufadvance(&i->i, size);
-	i->h = sd_indexheader(i);
-	return 0;
+		return -1;
+	ss_iterinit(sd_pageiter, arg->page_iter);
+	return ss_iteropen(sd_pageiter, arg->page_iter, arg->r,
+	                   &i->page, arg->o, key);
 }
 
 static inline int
-sd_indexcopy_buf(sdindex *i, sr *r, ssbuf *v, ssbuf *m)
+sd_read_reusepage(sdread *i, char *key)
 {
-	sdindexheader *h = (sdindexheader*)(m->p - sizeof(sdindexheader));
-	int size = sd_indexsize_ext(h);
-	assert(size == (ss_bufused(v) + ss_bufused(m)));
-	int rc = ss_bufensure(&i->i, r->a, size);
-	if (ssunlikely(rc == -1))
-		return sr_oom(r->e);
-	memcpy(i->i.s, v->s, ss_bufused(v));
-	ss_bufadvance(&i->i, ss_bufused(v));
-	memcpy(i->i.p, m->s, ss_bufused(m));
-	ss_bufadvance(&i->i, ss_bufused(m));
-	i->h = sd_indexheader(i);
-	return 0;
+	sdreadarg *arg = &i->ra;
+	i->reads_cache++;
+	ss_iterinit(sd_pageiter, arg->page_iter);
+	return ss_iteropen(sd_pageiter, arg->page_iter, arg->r,
+	                   &i->page, arg->o, key);
 }
 
-#endif
-#line 1 "sophia/database/sd_indexiter.h"
-#ifndef SD_INDEXITER_H_
-#define SD_INDEXITER_H_
-
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
-
-typedef struct sdindexiter sdindexiter;
-
-struct sdindexiter {
-	sdindex     *index;
-	sdindexpage *v;
-	int          pos;
-	ssorder      cmp;
-	char        *key;
-	sr          *r;
-} sspacked;
+static inline void
+sd_read_next(ssiter*);
 
 static inline int
-sd_indexiter_route(sdindexiter *i)
+sd_read_open(ssiter *iptr, sdreadarg *arg, char *key)
 {
-	int begin = 0;
-	int end = i->index->h->count - 1;
-	while (begin != end) {
-		int mid = begin + (end - begin) / 2;
-		sdindexpage *page = sd_indexpage(i->index, mid);
-		int rc = sf_compare(i->r->scheme,
-		                    sd_indexpage_max(i->index, page),
-		                    i->key);
-		if (rc < 0) {
-			begin = mid + 1;
-		} else {
-			/* rc >= 0 */
-			end = mid;
-		}
+	sdread *i = (sdread*)iptr->priv;
+	/* readers owned by a sicache keep the last page between
+	 * lookups: a lookup routed to the same page reuses it,
+	 * unless the page is used in place from mmap */
+	sdindexpage *last = NULL;
+	if (arg->page_cache) {
+		if (arg->page_reuse &&
+		   (arg->use_compression || !arg->use_mmap || arg->use_mmap_copy ||
+		    sd_indexprefix(arg->index)))
+			last = i->ref;
+		if (last == NULL)
+			sd_read_unpin(i);
+	} else {
+		i->cached = NULL;
 	}
-	if (ssunlikely(end >= (int)i->index->h->count))
-		end = i->index->h->count - 1;
-	return end;
-}
-
-static inline int
-sd_indexiter_open(ssiter *i, sr *r, sdindex *index, ssorder o, char *key)
-{
-	sdindexiter *ii = (sdindexiter*)i->priv;
-	ii->r     = r;
-	ii->index = index;
-	ii->cmp   = o;
-	ii->key   = key;
-	ii->v     = NULL;
-	ii->pos   = 0;
-	if (ssunlikely(ii->index->h->count == 1)) {
-		/* skip bootstrap node  */
-		if (ii->index->h->lsnmin == UINT64_MAX &&
-		    ii->index->h->lsnmax == 0)
-			return 0;
+	i->reads = 0;
+	i->reads_cache = 0;
+	i->ahead = -1;
+	i->ahead_hit = 0;
+	i->ra = *arg;
+	ss_iterinit(sd_indexiter, arg->index_iter);
+	ss_iteropen(sd_indexiter, arg->index_iter, arg->r, arg->index,
+	            arg->o, key);
+	i->ref = ss_iterof(sd_indexiter, arg->index_iter);
+	if (last && i->ref != last) {
+		sd_read_unpin(i);
+		last = NULL;
 	}
-	if (ii->key == NULL) {
-		switch (ii->cmp) {
-		case SS_LT:
-		case SS_LTE: ii->pos = ii->index->h->count - 1;
-			break;
-		case SS_GT:
-		case SS_GTE: ii->pos = 0;
-			break;
-		default:
-			assert(0);
-		}
-		ii->v = sd_indexpage(ii->index, ii->pos);
+	if (i->ref == NULL)
 		return 0;
+	if (arg->has) {
+		assert(arg->o == SS_GTE);
+		if (sslikely(i->ref->lsnmax <= arg->has_vlsn)) {
+			i->ref = NULL;
+			return 0;
+		}
 	}
-	if (sslikely(ii->index->h->count > 1))
-		ii->pos = sd_indexiter_route(ii);
-
-	sdindexpage *p = sd_indexpage(ii->index, ii->pos);
 	int rc;
-	switch (ii->cmp) {
-	case SS_LTE:
-	case SS_LT:
-		rc = sf_compare(ii->r->scheme, sd_indexpage_min(ii->index, p),
-		                ii->key);
-		if (rc ==  1 || (rc == 0 && ii->cmp == SS_LT))
-			ii->pos--;
-		break;
-	case SS_GTE:
-	case SS_GT:
-		rc = sf_compare(ii->r->scheme, sd_indexpage_max(ii->index, p),
-		                ii->key);
-		if (rc == -1 || (rc == 0 && ii->cmp == SS_GT))
-			ii->pos++;
-		break;
-	default: assert(0);
+	if (last)
+		rc = sd_read_reusepage(i, key);
+	else
+		rc = sd_read_openpage(i, key);
+	if (ssunlikely(rc == -1)) {
+		i->ref = NULL;
+		return -1;
 	}
-	if (ssunlikely(ii->pos == -1 ||
-	               ii->pos >= (int)ii->index->h->count))
-		return 0;
-	ii->v = sd_indexpage(ii->index, ii->pos);
-	return 0;
+	if (ssunlikely(! ss_iterhas(sd_pageiter, i->ra.page_iter))) {
+		sd_read_next(iptr);
+		rc = 0;
+	}
+	return rc;
 }
 
 static inline void
-sd_indexiter_close(ssiter *i ssunused)
-{ }
+sd_read_close(ssiter *iptr)
+{
+	sdread *i = (sdread*)iptr->priv;
+	if (i->ra.page_cache)
+		sd_read_unpin(i);
+	i->ref = NULL;
+}
 
 static inline int
-sd_indexiter_has(ssiter *i)
+sd_read_has(ssiter *iptr)
 {
-	sdindexiter *ii = (sdindexiter*)i->priv;
-	return ii->v != NULL;
+	sdread *i = (sdread*)iptr->priv;
+	if (ssunlikely(i->ref == NULL))
+		return 0;
+	return ss_iterhas(sd_pageiter, i->ra.page_iter);
 }
 
 static inline void*
-sd_indexiter_of(ssiter *i)
+sd_read_of(ssiter *iptr)
 {
-	sdindexiter *ii = (sdindexiter*)i->priv;
-	return ii->v;
+	sdread *i = (sdread*)iptr->priv;
+	if (ssunlikely(i->ref == NULL))
+		return NULL;
+	return ss_iterof(sd_pageiter, i->ra.page_iter);
 }
 
 static inline void
-sd_indexiter_next(ssiter *i)
+sd_read_next(ssiter *iptr)
 {
-	sdindexiter *ii = (sdindexiter*)i->priv;
-	switch (ii->cmp) {
-	case SS_LT:
-	case SS_LTE: ii->pos--;
-		break;
-	case SS_GT:
-	case SS_GTE: ii->pos++;
-		break;
-	default:
-		assert(0);
-		break;
+	sdread *i = (sdread*)iptr->priv;
+	if (ssunlikely(i->ref == NULL))
+		return;
+	ss_iternext(sd_pageiter, i->ra.page_iter);
+retry:
+	if (sslikely(ss_iterhas(sd_pageiter, i->ra.page_iter)))
+		return;
+	ss_iternext(sd_indexiter, i->ra.index_iter);
+	i->ref = ss_iterof(sd_indexiter, i->ra.index_iter);
+	if (i->ref == NULL)
+		return;
+	int rc = sd_read_openpage(i, NULL);
+	if (ssunlikely(rc == -1)) {
+		i->ref = NULL;
+		return;
 	}
-	if (ssunlikely(ii->pos < 0))
-		ii->v = NULL;
-	else
-	if (ssunlikely(ii->pos >= (int)ii->index->h->count))
-		ii->v = NULL;
-	else
-		ii->v = sd_indexpage(ii->index, ii->pos);
-}
-
-extern ssiterif sd_indexiter;
-
-#endif
-#line 1 "sophia/database/sd_build.h"
-#ifndef SD_BUILD_H_
-#define SD_BUILD_H_
-
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
-
-typedef struct sdbuild sdbuild;
-
-struct sdbuild {
-	ssbuf       m, v, c;
-	ssfilterif *compress_if;
-	int         compress;
-	int         crc;
-	uint32_t    vmax;
-};
-
-void sd_buildinit(sdbuild*);
-void sd_buildfree(sdbuild*, sr*);
-void sd_buildreset(sdbuild*);
-void sd_buildgc(sdbuild*, sr*, int);
-
-static inline sdpageheader*
-sd_buildheader(sdbuild *b) {
-	return (sdpageheader*)(b->m.s);
+	goto retry;
 }
 
-static inline char*
-sd_buildmin(sdbuild *b, sr *r ssunused)
+static inline int
+sd_read_stat(ssiter *iptr)
 {
-	return b->v.s;
+	sdread *i = (sdread*)iptr->priv;
+	return i->reads;
 }
 
-static inline char*
-sd_buildmax(sdbuild *b, sr *r)
+static inline int
+sd_read_statcache(ssiter *iptr)
 {
-	sdpageheader *h = sd_buildheader(b);
-	if (sf_schemefixed(r->scheme))
-		return b->v.s + (r->scheme->var_offset * (h->count - 1));
-	return b->v.s +
-	       *(uint32_t*)((char*)h + sizeof(sdpageheader) +
-	                    (sizeof(uint32_t) * (h->count - 1)));
+	sdread *i = (sdread*)iptr->priv;
+	return i->reads_cache;
 }
 
-int sd_buildbegin(sdbuild*, sr*, int, int, ssfilterif*);
-int sd_buildend(sdbuild*, sr*);
-int sd_buildadd(sdbuild*, sr*, char*, uint8_t);
+extern ssiterif sd_read;
 
 #endif
-#line 1 "sophia/database/sd_buildindex.h"
-#ifndef SD_BUILDINDEX_H_
-#define SD_BUILDINDEX_H_
+#line 1 "sophia/database/sd_write.h"
+#ifndef SD_WRITE_H_
+#define SD_WRITE_H_
 
 /*
  * sophia database
@@ -20063,25 +24872,15 @@ int sd_buildadd(sdbuild*, sr*, char*, uint8_t);
  * BSD License
 */
 
-typedef struct sdbuildindex sdbuildindex;
-
-struct sdbuildindex {
-	ssbuf         v, m;
-	sdindexheader build;
-};
+int sd_commitpage(sdbuild*, sr*, ssbuf*);
 
-void sd_buildindex_init(sdbuildindex*);
-void sd_buildindex_free(sdbuildindex*, sr*);
-void sd_buildindex_reset(sdbuildindex*);
-void sd_buildindex_gc(sdbuildindex*, sr*, int);
-int  sd_buildindex_begin(sdbuildindex*);
-int  sd_buildindex_end(sdbuildindex*, sr*, uint32_t, uint64_t);
-int  sd_buildindex_add(sdbuildindex*, sr*, sdbuild*, uint64_t);
+int sd_writepage(sr*, ssfile*, sdio*, sdbuild*);
+int sd_writeindex(sr*, ssfile*, sdio*, sdindex*);
 
 #endif
-#line 1 "sophia/database/sd_merge.h"
-#ifndef SD_MERGE_H_
-#define SD_MERGE_H_
+#line 1 "sophia/database/sd_c.h"
+#ifndef SD_C_H_
+#define SD_C_H_
 
 /*
  * sophia database
@@ -20091,69 +24890,114 @@ int  sd_buildindex_add(sdbuildindex*, sr*, sdbuild*, uint64_t);
  * BSD License
 */
 
-typedef struct sdmergeconf sdmergeconf;
-typedef struct sdmerge sdmerge;
+typedef struct sdcbuf sdcbuf;
+typedef struct sdc sdc;
 
-struct sdmergeconf {
-	uint32_t    write;
-	uint32_t    stream;
-	uint64_t    size_stream;
-	uint64_t    size_node;
-	uint32_t    size_page;
-	uint32_t    checksum;
-	uint32_t    expire;
-	uint32_t    timestamp;
-	uint32_t    compression;
-	ssfilterif *compression_if;
-	uint32_t    direct_io;
-	uint32_t    direct_io_page_size;
-	uint64_t    vlsn;
+struct sdcbuf {
+	ssbuf  a; /* decompression */
+	ssbuf  b; /* transformation */
+	ssiter index_iter;
+	ssiter page_iter;
 };
 
-struct sdmerge {
-	sdindex      index;
-	ssiter       *merge;
-	ssiter       i;
-	sdmergeconf  *conf;
-	sr           *r;
-	sdbuild      *build;
-	sdbuildindex *build_index;
-	uint64_t     processed;
-	uint64_t     current;
-	uint64_t     limit;
-	int          resume;
+struct sdc {
+	sdio io;
+	sdbuild build;
+	sdbuildindex build_index;
+	svupsert upsert;
+	ssbuf  a; /* result */
+	ssbuf  b; /* redistribute buffer */
+	ssbuf  c; /* file buffer */
+	ssbuf  d; /* page read buffer */
+	sdcbuf e; /* compression buffer list */
+	ssbuf  f; /* value log document buffer */
+	ssbuf  g; /* value log read buffer */
+	sdmergepage batch[SD_MERGEBATCH]; /* compression batch */
 };
 
-int sd_mergeinit(sdmerge*, sr*, ssiter*, sdbuild*, sdbuildindex*,
-                 svupsert*, sdmergeconf*);
-int sd_mergefree(sdmerge*);
-int sd_merge(sdmerge*);
-int sd_mergepage(sdmerge*, uint64_t);
-int sd_mergeend(sdmerge*, uint64_t);
-
-#endif
-#line 1 "sophia/database/sd_iter.h"
-#ifndef SD_ITER_H_
-#define SD_ITER_H_
+static inline void
+sd_cinit(sdc *sc)
+{
+	sd_ioinit(&sc->io);
+	sv_upsertinit(&sc->upsert);
+	sd_buildinit(&sc->build);
+	sd_buildindex_init(&sc->build_index);
+	ss_bufinit(&sc->a);
+	ss_bufinit(&sc->b);
+	ss_bufinit(&sc->c);
+	ss_bufinit(&sc->d);
+	ss_bufinit(&sc->e.a);
+	ss_bufinit(&sc->e.b);
+	ss_bufinit(&sc->f);
+	ss_bufinit(&sc->g);
+	memset(&sc->e.index_iter, 0, sizeof(sc->e.index_iter));
+	memset(&sc->e.page_iter, 0, sizeof(sc->e.page_iter));
+	int i = 0;
+	for (; i < SD_MERGEBATCH; i++)
+		sd_buildinit(&sc->batch[i].build);
+}
 
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
+static inline void
+sd_cfree(sdc *sc, sr *r)
+{
+	sd_iofree(&sc->io, r);
+	sd_buildfree(&sc->build, r);
+	sd_buildindex_free(&sc->build_index, r);
+	sv_upsertfree(&sc->upsert, r);
+	ss_buffree(&sc->a, r->a);
+	ss_buffree(&sc->b, r->a);
+	ss_buffree(&sc->c, r->a);
+	ss_buffree(&sc->d, r->a);
+	ss_buffree(&sc->e.a, r->a);
+	ss_buffree(&sc->e.b, r->a);
+	ss_buffree(&sc->f, r->a);
+	ss_buffree(&sc->g, r->a);
+	int i = 0;
+	for (; i < SD_MERGEBATCH; i++)
+		sd_buildfree(&sc->batch[i].build, r);
+}
 
-int sd_iter_open(ssiter*, sr*, ssfile*);
-int sd_iter_iserror(ssiter*);
-int sd_iter_isroot(ssiter*);
+static inline void
+sd_cgc(sdc *sc, sr *r, int wm)
+{
+	sd_buildgc(&sc->build, r, wm);
+	sd_buildindex_gc(&sc->build_index, r, wm);
+	sv_upsertgc(&sc->upsert, r, 600, 512);
+	ss_bufgc(&sc->a, r->a, wm);
+	ss_bufgc(&sc->b, r->a, wm);
+	ss_bufgc(&sc->c, r->a, wm);
+	ss_bufgc(&sc->d, r->a, wm);
+	ss_bufgc(&sc->e.a, r->a, wm);
+	ss_bufgc(&sc->e.b, r->a, wm);
+	ss_bufgc(&sc->f, r->a, wm);
+	ss_bufgc(&sc->g, r->a, wm);
+	int i = 0;
+	for (; i < SD_MERGEBATCH; i++)
+		sd_buildgc(&sc->batch[i].build, r, wm);
+}
 
-extern ssiterif sd_iter;
+static inline void
+sd_creset(sdc *sc, sr *r ssunused)
+{
+	sd_ioreset(&sc->io);
+	sd_buildreset(&sc->build);
+	sd_buildindex_reset(&sc->build_index);
+	sv_upsertreset(&sc->upsert);
+	ss_bufreset(&sc->a);
+	ss_bufreset(&sc->b);
+	ss_bufreset(&sc->c);
+	ss_bufreset(&sc->d);
+	ss_bufreset(&sc->e.a);
+	ss_bufreset(&sc->e.b);
+	ss_bufreset(&sc->f);
+	ss_bufreset(&sc->g);
+	int i = 0;
+	for (; i < SD_MERGEBATCH; i++)
+		sd_buildreset(&sc->batch[i].build);
+}
 
 #endif
-#line 1 "sophia/database/sd_scheme.h"
-#ifndef SD_SCHEME_H_
-#define SD_SCHEME_H_
+#line 1 "sophia/database/sd_build.c"
 
 /*
  * sophia database
@@ -20163,172 +25007,309 @@ extern ssiterif sd_iter;
  * BSD License
 */
 
-typedef struct sdschemeheader sdschemeheader;
-typedef struct sdschemeopt sdschemeopt;
-typedef struct sdscheme sdscheme;
 
-struct sdschemeheader {
-	uint32_t crc;
-	uint32_t size;
-	uint32_t count;
-} sspacked;
 
-struct sdschemeopt {
-	uint8_t  type;
-	uint8_t  id;
-	uint32_t size;
-} sspacked;
 
-struct sdscheme {
-	ssbuf buf;
-};
 
-static inline void
-sd_schemeinit(sdscheme *c) {
-	ss_bufinit(&c->buf);
-}
 
-static inline void
-sd_schemefree(sdscheme *c, sr *r) {
-	ss_buffree(&c->buf, r->a);
-}
 
-static inline char*
-sd_schemesz(sdschemeopt *o) {
-	assert(o->type == SS_STRING);
-	return (char*)o + sizeof(sdschemeopt);
+void sd_buildinit(sdbuild *b)
+{
+	ss_bufinit(&b->m);
+	ss_bufinit(&b->v);
+	ss_bufinit(&b->c);
+	ss_bufinit(&b->pk);
+	ss_bufinit(&b->pv);
+	ss_bufinit(&b->pl);
+	b->compress = 0;
+	b->compress_if = NULL;
+	b->compress_dict = NULL;
+	b->prefix = 0;
+	b->crc = 0;
+	b->vmax = 0;
 }
 
-static inline uint32_t
-sd_schemeu32(sdschemeopt *o) {
-	assert(o->type == SS_U32);
-	return sscastu32((char*)o + sizeof(sdschemeopt));
+void sd_buildfree(sdbuild *b, sr *r)
+{
+	ss_buffree(&b->m, r->a);
+	ss_buffree(&b->v, r->a);
+	ss_buffree(&b->c, r->a);
+	ss_buffree(&b->pk, r->a);
+	ss_buffree(&b->pv, r->a);
+	ss_buffree(&b->pl, r->a);
 }
 
-static inline uint64_t
-sd_schemeu64(sdschemeopt *o) {
-	assert(o->type == SS_U64);
-	return sscastu64((char*)o + sizeof(sdschemeopt));
+void sd_buildreset(sdbuild *b)
+{
+	ss_bufreset(&b->m);
+	ss_bufreset(&b->v);
+	ss_bufreset(&b->c);
+	ss_bufreset(&b->pk);
+	ss_bufreset(&b->pv);
+	ss_bufreset(&b->pl);
+	b->vmax = 0;
 }
 
-int sd_schemebegin(sdscheme*, sr*);
-int sd_schemeadd(sdscheme*, sr*, uint8_t, sstype, void*, uint32_t);
-int sd_schemecommit(sdscheme*, sr*);
-int sd_schemewrite(sdscheme*, sr*, char*, int);
-int sd_schemerecover(sdscheme*, sr*, char*);
-
-#endif
-#line 1 "sophia/database/sd_schemeiter.h"
-#ifndef SD_SCHEMEITER_H_
-#define SD_SCHEMEITER_H_
-
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
-
-typedef struct sdschemeiter sdschemeiter;
-
-struct sdschemeiter {
-	sdscheme *c;
-	char *p;
-} sspacked;
-
-static inline int
-sd_schemeiter_open(ssiter *i, sr *r, sdscheme *c, int validate)
+void sd_buildgc(sdbuild *b, sr *r, int wm)
 {
-	sdschemeiter *ci = (sdschemeiter*)i->priv;
-	ci->c = c;
-	ci->p = NULL;
-	if (validate) {
-		sdschemeheader *h = (sdschemeheader*)c->buf.s;
-		uint32_t crc = ss_crcs(r->crc, h, ss_bufused(&c->buf), 0);
-		if (h->crc != crc) {
-			sr_malfunction(r->e, "%s", "scheme file corrupted");
-			return -1;
-		}
-	}
-	ci->p = c->buf.s + sizeof(sdschemeheader);
-	return 0;
+	ss_bufgc(&b->m, r->a, wm);
+	ss_bufgc(&b->v, r->a, wm);
+	ss_bufgc(&b->c, r->a, wm);
+	ss_bufgc(&b->pk, r->a, wm);
+	ss_bufgc(&b->pv, r->a, wm);
+	ss_bufgc(&b->pl, r->a, wm);
+	b->vmax = 0;
 }
 
-static inline void
-sd_schemeiter_close(ssiter *i ssunused)
+int sd_buildbegin(sdbuild *b, sr *r, int crc,
+                  int prefix,
+                  int compress,
+                  ssfilterif *compress_if,
+                  ssdictset *compress_dict)
 {
-	sdschemeiter *ci = (sdschemeiter*)i->priv;
-	(void)ci;
+	b->crc = crc;
+	b->prefix = prefix;
+	b->compress = compress;
+	b->compress_if = compress_if;
+	b->compress_dict = compress_dict;
+	int rc;
+	rc = ss_bufensure(&b->m, r->a, sizeof(sdpageheader));
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+	sdpageheader *h = sd_buildheader(b);
+	memset(h, 0, sizeof(*h));
+	h->lsnmin    = UINT64_MAX;
+	h->lsnmindup = UINT64_MAX;
+	h->tsmin     = UINT32_MAX;
+	h->sizeencoded = 0;
+	b->tsmax = 0;
+	ss_bufadvance(&b->m, sizeof(sdpageheader));
+	return 0;
 }
 
 static inline int
-sd_schemeiter_has(ssiter *i)
+sd_buildadd_raw(sdbuild *b, sr *r, char *v, uint8_t flags)
 {
-	sdschemeiter *ci = (sdschemeiter*)i->priv;
-	return ci->p < ci->c->buf.p;
+	uint32_t size = sf_size(r->scheme, v);
+	int rc = ss_bufensure(&b->v, r->a, size);
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+	memcpy(b->v.p, v, size);
+	sf_flagsset(r->scheme, b->v.p, flags);
+	ss_bufadvance(&b->v, size);
+	return 0;
 }
 
-static inline void*
-sd_schemeiter_of(ssiter *i)
+static inline int
+sd_buildadd_prefix(sdbuild *b, sr *r, char *v, uint32_t pos)
 {
-	sdschemeiter *ci = (sdschemeiter*)i->priv;
-	if (ssunlikely(ci->p >= ci->c->buf.p))
-		return NULL;
-	return ci->p;
-}
+	sfscheme *s = r->scheme;
+	/* pl keeps the previous key, the current one is
+	 * placed right after it */
+	uint32_t size_prev = ss_bufused(&b->pl);
+	int rc = sd_pageprefix_key(s, v, &b->pl, r->a);
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+	char *key = b->pl.s + size_prev;
+	uint32_t size_key = ss_bufused(&b->pl) - size_prev;
+	uint32_t shared = 0;
+	if (pos > 0) {
+		uint32_t max = (size_prev < size_key) ? size_prev : size_key;
+		while (shared < max && b->pl.s[shared] == key[shared])
+			shared++;
+	}
+	uint32_t unshared = size_key - shared;
+
+	/* key */
+	rc = ss_bufensure(&b->pk, r->a, 5 * (2 + s->var_count) + unshared);
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+	char *p = b->pk.p;
+	p = sd_pageprefix_varintwrite(p, shared);
+	p = sd_pageprefix_varintwrite(p, unshared);
+	memcpy(p, key + shared, unshared);
+	p += unshared;
+	int i = 0;
+	while (i < s->var_count) {
+		p = sd_pageprefix_varintwrite(p, sf_var(s, i, v)->size);
+		i++;
+	}
+	ss_bufadvance(&b->pk, p - b->pk.p);
+	memmove(b->pl.s, key, size_key);
+	b->pl.p = b->pl.s + size_key;
 
-static inline void
-sd_schemeiter_next(ssiter *i)
-{
-	sdschemeiter *ci = (sdschemeiter*)i->priv;
-	if (ssunlikely(ci->p >= ci->c->buf.p))
-		return;
-	sdschemeopt *o = (sdschemeopt*)ci->p;
-	ci->p = (char*)o + sizeof(sdschemeopt) + o->size;
+	/* value */
+	rc = ss_bufensure(&b->pv, r->a, sf_size(s, v));
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+	i = 0;
+	while (i < s->fields_count) {
+		sffield *f = s->fields[i];
+		i++;
+		if (f->key)
+			continue;
+		uint32_t size;
+		char *ptr = sf_fieldptr(s, f, v, &size);
+		memcpy(b->pv.p, ptr, size);
+		ss_bufadvance(&b->pv, size);
+	}
+	return 0;
 }
 
-extern ssiterif sd_schemeiter;
-
-#endif
-#line 1 "sophia/database/sd_io.h"
-#ifndef SD_IO_H_
-#define SD_IO_H_
+int sd_buildadd(sdbuild *b, sr *r, char *v, uint8_t flags)
+{
+	uint32_t size = sf_size(r->scheme, v);
 
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
+	/* store document offset */
+	int rc;
+	if (! sf_schemefixed(r->scheme)) {
+		uint32_t offset = ss_bufused(&b->v);
+		rc = ss_bufadd(&b->m, r->a, &offset, sizeof(offset));
+		if (ssunlikely(rc == -1))
+			return sr_oom(r->e);
+		size += sizeof(offset);
+	}
 
-typedef struct sdio sdio;
+	/* copy document */
+	rc = sd_buildadd_raw(b, r, v, flags);
+	if (ssunlikely(rc == -1))
+		return -1;
 
-struct sdio {
-	ssbuf    buf;
-	int      direct;
-	uint32_t size_page;
-	uint32_t size_align;
-};
+	/* update page header */
+	sdpageheader *h = sd_buildheader(b);
+	if (b->prefix) {
+		rc = sd_buildadd_prefix(b, r, b->v.p - sf_size(r->scheme, v),
+		                        h->count);
+		if (ssunlikely(rc == -1))
+			return -1;
+	}
+	h->count++;
+	if (size > b->vmax)
+		b->vmax = size;
+	uint64_t lsn = sf_lsn(r->scheme, v);
+	if (lsn > h->lsnmax)
+		h->lsnmax = lsn;
+	if (lsn < h->lsnmin)
+		h->lsnmin = lsn;
+	if (flags & SVDUP) {
+		h->countdup++;
+		if (lsn < h->lsnmindup)
+			h->lsnmindup = lsn;
+	}
+	if (r->scheme->has_expire) {
+		uint32_t timestamp = sf_ttl(r->scheme, v);
+		if (timestamp < h->tsmin)
+			h->tsmin = timestamp;
+		if (timestamp > b->tsmax)
+			b->tsmax = timestamp;
+	}
+	return 0;
+}
 
-static inline uint64_t
-sd_iosize(sdio *s, ssfile *f) {
-	return f->size + (ss_bufused(&s->buf) - s->size_align);
+static inline int
+sd_buildcompress(sdbuild *b, sr *r)
+{
+	assert(b->compress_if != &ss_nonefilter);
+	/* reserve header */
+	int rc = ss_bufensure(&b->c, r->a, sizeof(sdpageheader));
+	if (ssunlikely(rc == -1))
+		return -1;
+	ss_bufadvance(&b->c, sizeof(sdpageheader));
+	/* compression (including meta-data) */
+	ssfilter f;
+	rc = ss_filterinit(&f, b->compress_if, r->a, SS_FINPUT, b->compress_dict);
+	if (ssunlikely(rc == -1))
+		return -1;
+	rc = ss_filterstart(&f, &b->c);
+	if (ssunlikely(rc == -1))
+		goto error;
+	if (b->prefix) {
+		uint32_t size_keys = ss_bufused(&b->pk);
+		rc = ss_filternext(&f, &b->c, (char*)&size_keys, sizeof(size_keys));
+		if (ssunlikely(rc == -1))
+			goto error;
+		rc = ss_filternext(&f, &b->c, b->pk.s, ss_bufused(&b->pk));
+		if (ssunlikely(rc == -1))
+			goto error;
+		rc = ss_filternext(&f, &b->c, b->pv.s, ss_bufused(&b->pv));
+		if (ssunlikely(rc == -1))
+			goto error;
+	} else {
+		rc = ss_filternext(&f, &b->c, b->m.s + sizeof(sdpageheader),
+		                   ss_bufused(&b->m) - sizeof(sdpageheader));
+		if (ssunlikely(rc == -1))
+			goto error;
+		rc = ss_filternext(&f, &b->c, b->v.s, ss_bufused(&b->v));
+		if (ssunlikely(rc == -1))
+			goto error;
+	}
+	rc = ss_filtercomplete(&f, &b->c);
+	if (ssunlikely(rc == -1))
+		goto error;
+	ss_filterfree(&f);
+	return 0;
+error:
+	ss_filterfree(&f);
+	return -1;
 }
 
-int sd_ioinit(sdio*);
-int sd_iofree(sdio*, sr*);
-int sd_ioprepare(sdio*, sr*, int, uint32_t, uint32_t);
-int sd_ioreset(sdio*);
-int sd_ioflush(sdio*, sr*, ssfile*);
-int sd_iowrite(sdio*, sr*, ssfile*, char*, int);
-int sd_ioread(sdio*, sr*, ssfile*, uint64_t, char*, int, int, char**);
+static inline int
+sd_buildprefix(sdbuild *b, sr *r)
+{
+	/* header, key area size, key area, value area */
+	uint32_t size_keys = ss_bufused(&b->pk);
+	int rc = ss_bufensure(&b->c, r->a, sizeof(sdpageheader) +
+	                      sd_buildsize(b));
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+	ss_bufadvance(&b->c, sizeof(sdpageheader));
+	memcpy(b->c.p, &size_keys, sizeof(size_keys));
+	ss_bufadvance(&b->c, sizeof(size_keys));
+	memcpy(b->c.p, b->pk.s, ss_bufused(&b->pk));
+	ss_bufadvance(&b->c, ss_bufused(&b->pk));
+	memcpy(b->c.p, b->pv.s, ss_bufused(&b->pv));
+	ss_bufadvance(&b->c, ss_bufused(&b->pv));
+	return 0;
+}
 
-#endif
-#line 1 "sophia/database/sd_read.h"
-#ifndef SD_READ_H_
-#define SD_READ_H_
+int sd_buildend(sdbuild *b, sr *r)
+{
+	/* calculate data crc (non-compressed) */
+	sdpageheader *h = sd_buildheader(b);
+	uint32_t crc = 0;
+	if (sslikely(b->crc)) {
+		crc = ss_crcp(r->crc, b->m.s, ss_bufused(&b->m), 0);
+		crc = ss_crcp(r->crc, b->v.s, ss_bufused(&b->v), crc);
+	}
+	h->crcdata = crc;
+	/* compression */
+	int rc;
+	if (b->compress) {
+		rc = sd_buildcompress(b, r);
+		if (ssunlikely(rc == -1))
+			return -1;
+	} else
+	if (b->prefix) {
+		rc = sd_buildprefix(b, r);
+		if (ssunlikely(rc == -1))
+			return -1;
+	}
+	/* update page header, sizeorigin is the size of
+	 * the page in the plain layout */
+	int total = ss_bufused(&b->m) + ss_bufused(&b->v);
+	h->sizeorigin = total - sizeof(sdpageheader);
+	if (b->prefix)
+		h->sizeencoded = sd_buildsize(b);
+	if (b->compress || b->prefix)
+		h->size = ss_bufused(&b->c) - sizeof(sdpageheader);
+	else
+		h->size = h->sizeorigin;
+	h->crc = ss_crcs(r->crc, h, sizeof(sdpageheader), 0);
+	if (b->compress || b->prefix)
+		memcpy(b->c.s, h, sizeof(sdpageheader));
+	return 0;
+}
+#line 1 "sophia/database/sd_buildindex.c"
 
 /*
  * sophia database
@@ -20338,226 +25319,271 @@ int sd_ioread(sdio*, sr*, ssfile*, uint64_t, char*, int, int, char**);
  * BSD License
 */
 
-typedef struct sdread sdread;
-typedef struct sdreadarg sdreadarg;
-
-struct sdreadarg {
-	sdio       *io;
-	sdindex    *index;
-	ssbuf      *buf;
-	ssbuf      *buf_read;
-	ssiter     *index_iter;
-	ssiter     *page_iter;
-	ssmmap     *mmap;
-	ssfile     *file;
-	ssorder     o;
-	int         from_compaction;
-	int         has;
-	uint64_t    has_vlsn;
-	int         use_mmap;
-	int         use_mmap_copy;
-	int         use_compression;
-	int         use_direct_io;
-	int         direct_io_page_size;
-	ssfilterif *compression_if;
-	sr         *r;
-};
-
-struct sdread {
-	sdreadarg    ra;
-	sdindexpage *ref;
-	sdpage       page;
-	int          reads;
-} sspacked;
 
-static inline int
-sd_read_page(sdread *i, sdindexpage *ref)
-{
-	sdreadarg *arg = &i->ra;
-	sr *r = arg->r;
 
-	int page_align = arg->io->size_page * 4;
-	i->reads++;
 
-	ss_bufreset(arg->buf);
-	int rc = ss_bufensure(arg->buf, r->a, ref->sizeorigin + page_align);
-	if (ssunlikely(rc == -1))
-		return sr_oom(r->e);
 
-	/* compression */
-	char *page_pointer;
-	if (arg->use_compression)
-	{
-		if (arg->use_mmap) {
-			page_pointer = arg->mmap->p + ref->offset;
-		} else {
-			ss_bufreset(arg->buf_read);
-			rc = ss_bufensure(arg->buf_read, r->a, ref->size + page_align);
-			if (ssunlikely(rc == -1))
-				return sr_oom(r->e);
-			rc = sd_ioread(arg->io, r, arg->file, ref->offset,
-			               arg->buf_read->s, ref->size,
-			               arg->from_compaction,
-			               &page_pointer);
-			if (ssunlikely(rc == -1))
-				return -1;
-			ss_bufadvance(arg->buf_read, ref->size);
-		}
 
-		/* copy header */
-		memcpy(arg->buf->p, page_pointer, sizeof(sdpageheader));
-		ss_bufadvance(arg->buf, sizeof(sdpageheader));
 
-		/* decompression */
-		ssfilter f;
-		rc = ss_filterinit(&f, (ssfilterif*)arg->compression_if, r->a, SS_FOUTPUT);
-		if (ssunlikely(rc == -1)) {
-			sr_error(r->e, "db file '%s' decompression error",
-			         ss_pathof(&arg->file->path));
-			return -1;
-		}
-		int size = ref->size - sizeof(sdpageheader);
-		rc = ss_filternext(&f, arg->buf, page_pointer + sizeof(sdpageheader), size);
-		if (ssunlikely(rc == -1)) {
-			sr_error(r->e, "db file '%s' decompression error",
-			         ss_pathof(&arg->file->path));
-			return -1;
-		}
-		ss_filterfree(&f);
-		sd_pageinit(&i->page, (sdpageheader*)arg->buf->s);
-		return 0;
-	}
+void sd_buildindex_init(sdbuildindex *i)
+{
+	ss_bufinit(&i->v);
+	ss_bufinit(&i->m);
+	ss_bufinit(&i->hash);
+	ss_bufinit(&i->vlog);
+	ss_bufinit(&i->expire);
+}
 
-	/* mmap */
-	if (arg->use_mmap) {
-		if (arg->use_mmap_copy) {
-			memcpy(arg->buf->s, arg->mmap->p + ref->offset, ref->sizeorigin);
-			sd_pageinit(&i->page, (sdpageheader*)(arg->buf->s));
-		} else {
-			sd_pageinit(&i->page, (sdpageheader*)(arg->mmap->p + ref->offset));
-		}
-		return 0;
-	}
+void sd_buildindex_free(sdbuildindex *i, sr *r)
+{
+	ss_buffree(&i->v, r->a);
+	ss_buffree(&i->m, r->a);
+	ss_buffree(&i->hash, r->a);
+	ss_buffree(&i->vlog, r->a);
+	ss_buffree(&i->expire, r->a);
+}
 
-	/* default */
-	rc = sd_ioread(arg->io, r, arg->file, ref->offset,
-	               arg->buf->s, ref->size,
-	               arg->from_compaction,
-	               &page_pointer);
-	if (ssunlikely(rc == -1))
-		return -1;
-	ss_bufadvance(arg->buf, ref->size);
-	sd_pageinit(&i->page, (sdpageheader*)page_pointer);
-	return 0;
+void sd_buildindex_reset(sdbuildindex *i)
+{
+	ss_bufreset(&i->v);
+	ss_bufreset(&i->m);
+	ss_bufreset(&i->hash);
+	ss_bufreset(&i->expire);
 }
 
-static inline int
-sd_read_openpage(sdread *i, char *key)
+void sd_buildindex_gc(sdbuildindex *i, sr *r, int wm)
 {
-	sdreadarg *arg = &i->ra;
-	assert(i->ref != NULL);
-	int rc = sd_read_page(i, i->ref);
-	if (ssunlikely(rc == -1))
-		return -1;
-	ss_iterinit(sd_pageiter, arg->page_iter);
-	return ss_iteropen(sd_pageiter, arg->page_iter, arg->r,
-	                   &i->page, arg->o, key);
+	ss_bufgc(&i->v, r->a, wm);
+	ss_bufgc(&i->m, r->a, wm);
+	ss_bufgc(&i->hash, r->a, wm);
+	ss_bufgc(&i->vlog, r->a, wm);
+	ss_bufgc(&i->expire, r->a, wm);
 }
 
-static inline void
-sd_read_next(ssiter*);
+int sd_buildindex_begin(sdbuildindex *i, int format)
+{
+	sdindexheader *h = &i->build;
+	h->crc         = 0;
+	h->size        = 0;
+	h->sizevmax    = 0;
+	h->count       = 0;
+	h->keys        = 0;
+	h->total       = 0;
+	h->totalorigin = 0;
+	h->lsnmin      = UINT64_MAX;
+	h->lsnmax      = 0;
+	h->tsmin       = UINT32_MAX;
+	h->offset      = 0;
+	h->dupkeys     = 0;
+	h->dupmin      = UINT64_MAX;
+	h->align       = 0;
+	sr_version_storage(&h->version);
+	/* page layout of the node */
+	h->version.c   = format;
+	return 0;
+}
 
-static inline int
-sd_read_open(ssiter *iptr, sdreadarg *arg, char *key)
+int sd_buildindex_end(sdbuildindex *i, sr *r, uint32_t align, uint64_t offset)
 {
-	sdread *i = (sdread*)iptr->priv;
-	i->reads = 0;
-	i->ra = *arg;
-	ss_iterinit(sd_indexiter, arg->index_iter);
-	ss_iteropen(sd_indexiter, arg->index_iter, arg->r, arg->index,
-	            arg->o, key);
-	i->ref = ss_iterof(sd_indexiter, arg->index_iter);
-	if (i->ref == NULL)
-		return 0;
-	if (arg->has) {
-		assert(arg->o == SS_GTE);
-		if (sslikely(i->ref->lsnmax <= arg->has_vlsn)) {
-			i->ref = NULL;
-			return 0;
-		}
-	}
-	int rc = sd_read_openpage(i, key);
-	if (ssunlikely(rc == -1)) {
-		i->ref = NULL;
-		return -1;
+	/* calculate index align for direct_io */
+	int size_meta  = sizeof(sdindexheader);
+	int size_align = 0;
+	if (align) {
+		size_align += align - ((offset +
+		                        ss_bufused(&i->v) +
+		                        size_meta +
+		                        ss_bufused(&i->m)) % align);
+		size_meta  += size_align;
 	}
-	if (ssunlikely(! ss_iterhas(sd_pageiter, i->ra.page_iter))) {
-		sd_read_next(iptr);
-		rc = 0;
+	int rc = ss_bufensure(&i->m, r->a, size_meta);
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+	/* align */
+	sdindexheader *h = &i->build;
+	if (size_align) {
+		h->align = size_align;
+		memset(i->m.p, 0, size_align);
+		ss_bufadvance(&i->m, size_align);
 	}
-	return rc;
+	/* header */
+	h->offset = offset;
+	h->crc = ss_crcs(r->crc, h, sizeof(sdindexheader), 0);
+	memcpy(i->m.p, &i->build, sizeof(sdindexheader));
+	ss_bufadvance(&i->m, sizeof(sdindexheader));
+	return 0;
 }
 
-static inline void
-sd_read_close(ssiter *iptr)
+int sd_buildindex_addhash(sdbuildindex *i, sr *r, char *v)
 {
-	sdread *i = (sdread*)iptr->priv;
-	i->ref = NULL;
+	uint32_t hash = sd_indexbloom_hash(r, v);
+	int rc = ss_bufadd(&i->hash, r->a, &hash, sizeof(hash));
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+	return 0;
 }
 
-static inline int
-sd_read_has(ssiter *iptr)
+int sd_buildindex_bloom(sdbuildindex *i, sr *r, uint32_t bits_per_key)
 {
-	sdread *i = (sdread*)iptr->priv;
-	if (ssunlikely(i->ref == NULL))
+	uint32_t keys = ss_bufused(&i->hash) / sizeof(uint32_t);
+	if (keys == 0 || bits_per_key == 0)
 		return 0;
-	return ss_iterhas(sd_pageiter, i->ra.page_iter);
+	/* k = ln(2) * bits per key minimizes the false positive rate */
+	uint32_t probes = (bits_per_key * 69) / 100;
+	if (probes < 1)
+		probes = 1;
+	if (probes > 30)
+		probes = 30;
+	uint64_t nbits = (uint64_t)keys * bits_per_key;
+	if (nbits < 64)
+		nbits = 64;
+	uint32_t size = (nbits + 7) / 8;
+	int rc = ss_bufensure(&i->v, r->a, size + sizeof(sdindexbloom));
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+	uint8_t *bits = (uint8_t*)i->v.p;
+	memset(bits, 0, size);
+	nbits = size * 8;
+	uint32_t *hash = (uint32_t*)i->hash.s;
+	uint32_t n = 0;
+	while (n < keys) {
+		uint32_t h = hash[n];
+		uint32_t delta = (h >> 17) | (h << 15);
+		uint32_t j = 0;
+		while (j < probes) {
+			uint32_t pos = h % nbits;
+			bits[pos / 8] |= (1 << (pos % 8));
+			h += delta;
+			j++;
+		}
+		n++;
+	}
+	ss_bufadvance(&i->v, size);
+	sdindexbloom *b = (sdindexbloom*)i->v.p;
+	b->magic  = SD_INDEXBLOOM_MAGIC;
+	b->size   = size;
+	b->keys   = keys;
+	b->probes = probes;
+	ss_bufadvance(&i->v, sizeof(sdindexbloom));
+	i->build.size += size + sizeof(sdindexbloom);
+	return 0;
 }
 
-static inline void*
-sd_read_of(ssiter *iptr)
+int sd_buildindex_vlog(sdbuildindex *i, sr *r)
 {
-	sdread *i = (sdread*)iptr->priv;
-	if (ssunlikely(i->ref == NULL))
-		return NULL;
-	return ss_iterof(sd_pageiter, i->ra.page_iter);
+	/* value log files referenced by the node,
+	 * see sd_vlog.c */
+	uint32_t count = ss_bufused(&i->vlog) / sizeof(sdindexvlogref);
+	if (count == 0)
+		return 0;
+	uint32_t size = ss_bufused(&i->vlog) + sizeof(sdindexvlog);
+	int rc = ss_bufensure(&i->v, r->a, size);
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+	memcpy(i->v.p, i->vlog.s, ss_bufused(&i->vlog));
+	ss_bufadvance(&i->v, ss_bufused(&i->vlog));
+	sdindexvlog *v = (sdindexvlog*)i->v.p;
+	v->magic = SD_INDEXVLOG_MAGIC;
+	v->count = count;
+	v->size  = 0;
+	sdindexvlogref *ref = (sdindexvlogref*)i->vlog.s;
+	sdindexvlogref *end = (sdindexvlogref*)i->vlog.p;
+	for (; ref < end; ref++)
+		v->size += ref->size;
+	ss_bufadvance(&i->v, sizeof(sdindexvlog));
+	i->build.size += size;
+	return 0;
 }
 
-static inline void
-sd_read_next(ssiter *iptr)
+int sd_buildindex_expire(sdbuildindex *i, sr *r)
 {
-	sdread *i = (sdread*)iptr->priv;
-	if (ssunlikely(i->ref == NULL))
-		return;
-	ss_iternext(sd_pageiter, i->ra.page_iter);
-retry:
-	if (sslikely(ss_iterhas(sd_pageiter, i->ra.page_iter)))
-		return;
-	ss_iternext(sd_indexiter, i->ra.index_iter);
-	i->ref = ss_iterof(sd_indexiter, i->ra.index_iter);
-	if (i->ref == NULL)
-		return;
-	int rc = sd_read_openpage(i, NULL);
-	if (ssunlikely(rc == -1)) {
-		i->ref = NULL;
-		return;
-	}
-	goto retry;
+	/* newest timestamp of each page, used to drop
+	 * expired nodes without reading them */
+	uint32_t count = ss_bufused(&i->expire) / sizeof(uint32_t);
+	if (count == 0 || count != i->build.count)
+		return 0;
+	uint32_t size = ss_bufused(&i->expire) + sizeof(sdindexexpire);
+	int rc = ss_bufensure(&i->v, r->a, size);
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+	memcpy(i->v.p, i->expire.s, ss_bufused(&i->expire));
+	ss_bufadvance(&i->v, ss_bufused(&i->expire));
+	sdindexexpire *e = (sdindexexpire*)i->v.p;
+	e->magic = SD_INDEXEXPIRE_MAGIC;
+	e->count = count;
+	e->tsmax = 0;
+	uint32_t *tsmax = (uint32_t*)i->expire.s;
+	uint32_t n = 0;
+	for (; n < count; n++)
+		if (tsmax[n] > e->tsmax)
+			e->tsmax = tsmax[n];
+	ss_bufadvance(&i->v, sizeof(sdindexexpire));
+	i->build.size += size;
+	return 0;
 }
 
-static inline int
-sd_read_stat(ssiter *iptr)
+int sd_buildindex_add(sdbuildindex *i, sr *r, sdbuild *b, uint64_t offset)
 {
-	sdread *i = (sdread*)iptr->priv;
-	return i->reads;
-}
+	int rc = ss_bufensure(&i->m, r->a, sizeof(sdindexpage));
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+	sdpageheader *ph = sd_buildheader(b);
 
-extern ssiterif sd_read;
+	int size = ph->size + sizeof(sdpageheader);
+	int sizeorigin = ph->sizeorigin + sizeof(sdpageheader);
 
-#endif
-#line 1 "sophia/database/sd_write.h"
-#ifndef SD_WRITE_H_
-#define SD_WRITE_H_
+	/* prepare page header */
+	sdindexpage *p = (sdindexpage*)i->m.p;
+	p->offset      = offset;
+	p->offsetindex = ss_bufused(&i->v);
+	p->lsnmin      = ph->lsnmin;
+	p->lsnmax      = ph->lsnmax;
+	p->size        = size;
+	p->sizeorigin  = sizeorigin;
+	p->sizemin     = 0;
+	p->sizemax     = 0;
+
+	/* copy keys */
+	if (ssunlikely(ph->count > 0)) {
+		char *min = sd_buildmin(b, r);
+		char *max = sd_buildmax(b, r);
+		p->sizemin = sf_comparable_size(r->scheme, min);
+		p->sizemax = sf_comparable_size(r->scheme, max);
+		int rc = ss_bufensure(&i->v, r->a, p->sizemin + p->sizemax);
+		if (ssunlikely(rc == -1))
+			return sr_oom(r->e);
+		sf_comparable_write(r->scheme, min, i->v.p);
+		ss_bufadvance(&i->v, p->sizemin);
+		sf_comparable_write(r->scheme, max, i->v.p);
+		ss_bufadvance(&i->v, p->sizemax);
+	}
+
+	/* update index info */
+	sdindexheader *h = &i->build;
+	h->count++;
+	h->size  += sizeof(sdindexpage) + p->sizemin + p->sizemax;
+	h->keys  += ph->count;
+	h->total += size;
+	h->totalorigin += sizeorigin;
+	if (b->vmax > h->sizevmax)
+		h->sizevmax = b->vmax;
+	if (ph->lsnmin < h->lsnmin)
+		h->lsnmin = ph->lsnmin;
+	if (ph->lsnmax > h->lsnmax)
+		h->lsnmax = ph->lsnmax;
+	if (ph->tsmin < h->tsmin)
+		h->tsmin = ph->tsmin;
+	if (r->scheme->has_expire) {
+		rc = ss_bufadd(&i->expire, r->a, &b->tsmax, sizeof(b->tsmax));
+		if (ssunlikely(rc == -1))
+			return sr_oom(r->e);
+	}
+	h->dupkeys += ph->countdup;
+	if (ph->lsnmindup < h->dupmin)
+		h->dupmin = ph->lsnmindup;
+	ss_bufadvance(&i->m, sizeof(sdindexpage));
+	return 0;
+}
+#line 1 "sophia/database/sd_indexiter.c"
 
 /*
  * sophia database
@@ -20567,15 +25593,20 @@ extern ssiterif sd_read;
  * BSD License
 */
 
-int sd_commitpage(sdbuild*, sr*, ssbuf*);
 
-int sd_writepage(sr*, ssfile*, sdio*, sdbuild*);
-int sd_writeindex(sr*, ssfile*, sdio*, sdindex*);
 
-#endif
-#line 1 "sophia/database/sd_c.h"
-#ifndef SD_C_H_
-#define SD_C_H_
+
+
+
+
+ssiterif sd_indexiter =
+{
+	.close = sd_indexiter_close,
+	.has   = sd_indexiter_has,
+	.of    = sd_indexiter_of,
+	.next  = sd_indexiter_next
+};
+#line 1 "sophia/database/sd_io.c"
 
 /*
  * sophia database
@@ -20585,91 +25616,195 @@ int sd_writeindex(sr*, ssfile*, sdio*, sdindex*);
  * BSD License
 */
 
-typedef struct sdcbuf sdcbuf;
-typedef struct sdc sdc;
 
-struct sdcbuf {
-	ssbuf  a; /* decompression */
-	ssbuf  b; /* transformation */
-	ssiter index_iter;
-	ssiter page_iter;
-};
 
-struct sdc {
-	sdio io;
-	sdbuild build;
-	sdbuildindex build_index;
-	svupsert upsert;
-	ssbuf  a; /* result */
-	ssbuf  b; /* redistribute buffer */
-	ssbuf  c; /* file buffer */
-	ssbuf  d; /* page read buffer */
-	sdcbuf e; /* compression buffer list */
-};
 
-static inline void
-sd_cinit(sdc *sc)
+
+
+
+int sd_ioinit(sdio *s)
 {
-	sd_ioinit(&sc->io);
-	sv_upsertinit(&sc->upsert);
-	sd_buildinit(&sc->build);
-	sd_buildindex_init(&sc->build_index);
-	ss_bufinit(&sc->a);
-	ss_bufinit(&sc->b);
-	ss_bufinit(&sc->c);
-	ss_bufinit(&sc->d);
-	ss_bufinit(&sc->e.a);
-	ss_bufinit(&sc->e.b);
-	memset(&sc->e.index_iter, 0, sizeof(sc->e.index_iter));
-	memset(&sc->e.page_iter, 0, sizeof(sc->e.page_iter));
+	ss_bufinit(&s->buf);
+	s->size_page  = 0;
+	s->size_align = 0;
+	s->direct     = 0;
+	return 0;
+}
+
+int sd_ioprepare(sdio *s, sr *r,
+                 int direct,
+                 uint32_t size_page,
+                 uint32_t size_buffer)
+{
+	if (ssunlikely(s->buf.s))
+		return 0;
+	s->direct = direct;
+	s->size_page = size_page;
+	ss_bufinit(&s->buf);
+	int rc = ss_bufensure(&s->buf, r->a, size_buffer);
+	if (ssunlikely(rc == -1))
+		return -1;
+	char *start =
+		(char*)((((intptr_t)s->buf.s + s->size_page - 1) / s->size_page) *
+		        s->size_page);
+	s->size_align = start - s->buf.s;
+	ss_bufadvance(&s->buf, s->size_align);
+	return 0;
+}
+
+int sd_iofree(sdio *s, sr *r)
+{
+	ss_buffree(&s->buf, r->a);
+	return 0;
+}
+
+int sd_ioreset(sdio *s)
+{
+	ss_bufreset(&s->buf);
+	ss_bufadvance(&s->buf, s->size_align);
+	return 0;
+}
+
+static inline int
+sd_ioflush_direct(sdio *s, sr *r, ssfile *f)
+{
+	/* write full pages only */
+	uint32_t total = ss_bufused(&s->buf) - s->size_align;
+	uint32_t count = total / s->size_page;
+	if (count == 0)
+		return 0;
+	uint32_t size  = count * s->size_page;
+	int rc = ss_filewrite(f, s->buf.s + s->size_align, size);
+	if (ssunlikely(rc == -1)) {
+		sr_malfunction(r->e, "file '%s' write error: %s",
+		               ss_pathof(&f->path),
+		               strerror(errno));
+		return -1;
+	}
+	/* copy unaligned part to the beginning
+	 * of the buffer */
+	uint32_t leftover = total % s->size_page;
+	s->buf.p = s->buf.s + s->size_align;
+	if (leftover)
+		memmove(s->buf.p, s->buf.s + s->size_align + size, leftover);
+	ss_bufadvance(&s->buf, leftover);
+	return 0;
+}
+
+int sd_ioflush(sdio *s, sr *r, ssfile *f)
+{
+	if (! s->direct) {
+		/* unused */
+		return 0;
+	}
+	return sd_ioflush_direct(s, r, f);
+}
+
+static inline int
+sd_iowrite_direct(sdio *s, sr *r, ssfile *f, char *buf, int size)
+{
+	int rc;
+	if ((ss_bufused(&s->buf) + size) > ss_bufsize(&s->buf)) {
+		rc = sd_ioflush(s, r, f);
+		if (ssunlikely(rc == -1))
+			return -1;
+	}
+	rc = ss_bufadd(&s->buf, r->a, buf, size);
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+	return 0;
 }
 
-static inline void
-sd_cfree(sdc *sc, sr *r)
+int sd_iowrite(sdio *s, sr *r, ssfile *f, char *buf, int size)
 {
-	sd_iofree(&sc->io, r);
-	sd_buildfree(&sc->build, r);
-	sd_buildindex_free(&sc->build_index, r);
-	sv_upsertfree(&sc->upsert, r);
-	ss_buffree(&sc->a, r->a);
-	ss_buffree(&sc->b, r->a);
-	ss_buffree(&sc->c, r->a);
-	ss_buffree(&sc->d, r->a);
-	ss_buffree(&sc->e.a, r->a);
-	ss_buffree(&sc->e.b, r->a);
+	if (s->direct)
+		return sd_iowrite_direct(s, r, f, buf, size);
+	int rc;
+	rc = ss_filewrite(f, buf, size);
+	if (ssunlikely(rc == -1)) {
+		sr_malfunction(r->e, "file '%s' write error: %s",
+		               ss_pathof(&f->path),
+		               strerror(errno));
+		return -1;
+	}
+	return 0;
 }
 
-static inline void
-sd_cgc(sdc *sc, sr *r, int wm)
+static inline int
+sd_ioread_direct(sdio *s, sr *r, ssfile *f, uint64_t offset,
+                 char *buf, int size, int from_compaction,
+                 char **buf_align)
 {
-	sd_buildgc(&sc->build, r, wm);
-	sd_buildindex_gc(&sc->build_index, r, wm);
-	sv_upsertgc(&sc->upsert, r, 600, 512);
-	ss_bufgc(&sc->a, r->a, wm);
-	ss_bufgc(&sc->b, r->a, wm);
-	ss_bufgc(&sc->c, r->a, wm);
-	ss_bufgc(&sc->d, r->a, wm);
-	ss_bufgc(&sc->e.a, r->a, wm);
-	ss_bufgc(&sc->e.b, r->a, wm);
+	uint32_t page_size = s->size_page;
+
+	/* align buffer */
+	char *buf_aligned =
+		(char*)((((intptr_t)buf + page_size - 1) / page_size) * page_size);
+
+	/* calculate aligned offset and size */
+	uint64_t offset_align = offset % page_size;
+	offset -= offset_align;
+	size   += offset_align;
+	uint64_t size_align   = size % page_size;
+	if (size_align > 0) {
+		size += page_size - size % page_size;
+	}
+
+	/* read */
+	uint64_t start = ss_utime();
+	int rc;
+	rc = ss_filepread(f, offset, buf_aligned, size);
+	if (ssunlikely(rc == -1)) {
+		sr_error(r->e, "db file '%s' read error: %s",
+		         ss_pathof(&f->path),
+		         strerror(errno));
+		return -1;
+	}
+	sr_statpread(r->stat, start, from_compaction);
+	*buf_align = buf_aligned + offset_align;
+	return 0;
 }
 
-static inline void
-sd_creset(sdc *sc, sr *r ssunused)
+static inline int
+sd_ioread_std(sdio *s ssunused, sr *r, ssfile *f, uint64_t offset,
+              char *buf, int size, int from_compaction,
+              char **buf_align)
 {
-	sd_ioreset(&sc->io);
-	sd_buildreset(&sc->build);
-	sd_buildindex_reset(&sc->build_index);
-	sv_upsertreset(&sc->upsert);
-	ss_bufreset(&sc->a);
-	ss_bufreset(&sc->b);
-	ss_bufreset(&sc->c);
-	ss_bufreset(&sc->d);
-	ss_bufreset(&sc->e.a);
-	ss_bufreset(&sc->e.b);
+	uint64_t start = ss_utime();
+	int rc;
+	rc = ss_filepread(f, offset, buf, size);
+	if (ssunlikely(rc == -1)) {
+		sr_error(r->e, "db file '%s' read error: %s",
+		         ss_pathof(&f->path),
+		         strerror(errno));
+		return -1;
+	}
+	sr_statpread(r->stat, start, from_compaction);
+	*buf_align = buf;
+	return 0;
 }
 
-#endif
-#line 1 "sophia/database/sd_build.c"
+int sd_ioread(sdio *s, sr *r, ssfile *f, uint64_t offset,
+              char *buf, int size, int from_compaction,
+              char **buf_align)
+{
+	/* background writers yield to pending foreground reads */
+	if (! from_compaction)
+		sr_rateread_begin(r->rate);
+	int rc;
+	if (s->direct)
+		rc = sd_ioread_direct(s, r, f, offset, buf, size,
+		                      from_compaction,
+		                      buf_align);
+	else
+		rc = sd_ioread_std(s, r, f, offset, buf, size,
+		                   from_compaction,
+		                   buf_align);
+	if (! from_compaction)
+		sr_rateread_end(r->rate);
+	return rc;
+}
+#line 1 "sophia/database/sd_iter.c"
 
 /*
  * sophia database
@@ -20685,180 +25820,158 @@ sd_creset(sdc *sc, sr *r ssunused)
 
 
 
-void sd_buildinit(sdbuild *b)
+typedef struct sditer sditer;
+
+struct sditer {
+	ssfile        *file;
+	int            corrupt;
+	sdindexheader *v;
+	ssmmap         map;
+	sr            *r;
+} sspacked;
+
+static int
+sd_iternext_of(sditer *i, sdindexheader *index)
 {
-	ss_bufinit(&b->m);
-	ss_bufinit(&b->v);
-	ss_bufinit(&b->c);
-	b->compress = 0;
-	b->compress_if = NULL;
-	b->crc = 0;
-	b->vmax = 0;
+	if (ssunlikely(index == NULL))
+		return 0;
+
+	char *start = i->map.p + index->offset;
+
+	int sanity_check = 0;
+	sanity_check += (start >= (char*)index);
+	sanity_check +=
+		((char*)index - start) != index->align + index->size;
+
+	/* validate index header */
+	if (ssunlikely(sanity_check > 0)) {
+		sr_malfunction(i->r->e, "corrupted db file '%s': bad index header",
+		               ss_pathof(&i->file->path));
+		i->corrupt = 1;
+		i->v = NULL;
+		return -1;
+	}
+
+	/* validate index crc */
+	uint32_t crc = ss_crcs(i->r->crc, index, sizeof(sdindexheader), 0);
+	if (index->crc != crc) {
+		sr_malfunction(i->r->e, "corrupted db file '%s': bad index crc",
+		               ss_pathof(&i->file->path));
+		i->corrupt = 1;
+		i->v = NULL;
+		return -1;
+	}
+
+	i->v = index;
+	return 1;
 }
 
-void sd_buildfree(sdbuild *b, sr *r)
+int sd_iter_open(ssiter *i, sr *r, ssfile *file)
 {
-	ss_buffree(&b->m, r->a);
-	ss_buffree(&b->v, r->a);
-	ss_buffree(&b->c, r->a);
+	sditer *ri = (sditer*)i->priv;
+	memset(ri, 0, sizeof(*ri));
+	ri->r = r;
+	ri->file = file;
+	if (ssunlikely(ri->file->size < sizeof(sdindexheader))) {
+		sr_malfunction(ri->r->e, "corrupted db file '%s': bad size",
+		               ss_pathof(&ri->file->path));
+		ri->corrupt = 1;
+		return -1;
+	}
+	int rc = ss_vfsmmap(r->vfs, &ri->map, ri->file->fd, ri->file->size, 1);
+	if (ssunlikely(rc == -1)) {
+		sr_malfunction(ri->r->e, "failed to mmap db file '%s': %s",
+		               ss_pathof(&ri->file->path),
+		               strerror(errno));
+		return -1;
+	}
+	sdindexheader *header =
+		(sdindexheader*)((char*)ri->map.p +
+		          (ri->file->size - sizeof(sdindexheader)));
+	rc = sd_iternext_of(ri, header);
+	if (ssunlikely(rc == -1))
+		ss_vfsmunmap(r->vfs, &ri->map);
+	return rc;
 }
 
-void sd_buildreset(sdbuild *b)
+static void
+sd_iterclose(ssiter *i)
 {
-	ss_bufreset(&b->m);
-	ss_bufreset(&b->v);
-	ss_bufreset(&b->c);
-	b->vmax = 0;
+	sditer *ri = (sditer*)i->priv;
+	ss_vfsmunmap(ri->r->vfs, &ri->map);
 }
 
-void sd_buildgc(sdbuild *b, sr *r, int wm)
+static int
+sd_iterhas(ssiter *i)
 {
-	ss_bufgc(&b->m, r->a, wm);
-	ss_bufgc(&b->v, r->a, wm);
-	ss_bufgc(&b->c, r->a, wm);
-	b->vmax = 0;
+	sditer *ri = (sditer*)i->priv;
+	return ri->v != NULL;
 }
 
-int sd_buildbegin(sdbuild *b, sr *r, int crc,
-                  int compress,
-                  ssfilterif *compress_if)
+static void*
+sd_iterof(ssiter *i)
 {
-	b->crc = crc;
-	b->compress = compress;
-	b->compress_if = compress_if;
-	int rc;
-	rc = ss_bufensure(&b->m, r->a, sizeof(sdpageheader));
-	if (ssunlikely(rc == -1))
-		return sr_oom(r->e);
-	sdpageheader *h = sd_buildheader(b);
-	memset(h, 0, sizeof(*h));
-	h->lsnmin    = UINT64_MAX;
-	h->lsnmindup = UINT64_MAX;
-	h->tsmin     = UINT32_MAX;
-	h->reserve   = 0;
-	ss_bufadvance(&b->m, sizeof(sdpageheader));
-	return 0;
+	sditer *ri = (sditer*)i->priv;
+	return ri->v;
 }
 
-static inline int
-sd_buildadd_raw(sdbuild *b, sr *r, char *v, uint8_t flags)
+static void
+sd_iternext(ssiter *i)
 {
-	uint32_t size = sf_size(r->scheme, v);
-	int rc = ss_bufensure(&b->v, r->a, size);
-	if (ssunlikely(rc == -1))
-		return sr_oom(r->e);
-	memcpy(b->v.p, v, size);
-	sf_flagsset(r->scheme, b->v.p, flags);
-	ss_bufadvance(&b->v, size);
-	return 0;
+	sditer *ri = (sditer*)i->priv;
+	if (ssunlikely(ri->v == NULL))
+		return;
+	char *next =
+		((char*)ri->v -
+		        ri->v->align -
+		        ri->v->size - ri->v->total);
+	if (next == ri->map.p) {
+		ri->v = NULL;
+		return;
+	}
+	next = next - sizeof(sdindexheader);
+	sd_iternext_of(ri, (sdindexheader*)next);
 }
 
-int sd_buildadd(sdbuild *b, sr *r, char *v, uint8_t flags)
+ssiterif sd_iter =
 {
-	uint32_t size = sf_size(r->scheme, v);
-
-	/* store document offset */
-	int rc;
-	if (! sf_schemefixed(r->scheme)) {
-		uint32_t offset = ss_bufused(&b->v);
-		rc = ss_bufadd(&b->m, r->a, &offset, sizeof(offset));
-		if (ssunlikely(rc == -1))
-			return sr_oom(r->e);
-		size += sizeof(offset);
-	}
+	.close = sd_iterclose,
+	.has   = sd_iterhas,
+	.of    = sd_iterof,
+	.next  = sd_iternext
+};
 
-	/* copy document */
-	rc = sd_buildadd_raw(b, r, v, flags);
+#if 0
+	/* truncate file to the end of a latest actual
+	 * index */
+	char *eof =
+		(char*)ri->map.p +
+		       ri->actual->offset + sizeof(sdindexheader) +
+		       ri->actual->size;
+	uint64_t file_size = eof - ri->map.p;
+	int rc = ss_fileresize(ri->file, file_size);
 	if (ssunlikely(rc == -1))
 		return -1;
+	sr_errorreset(ri->r->e);
+#endif
 
-	/* update page header */
-	sdpageheader *h = sd_buildheader(b);
-	h->count++;
-	if (size > b->vmax)
-		b->vmax = size;
-	uint64_t lsn = sf_lsn(r->scheme, v);
-	if (lsn > h->lsnmax)
-		h->lsnmax = lsn;
-	if (lsn < h->lsnmin)
-		h->lsnmin = lsn;
-	if (flags & SVDUP) {
-		h->countdup++;
-		if (lsn < h->lsnmindup)
-			h->lsnmindup = lsn;
-	}
-	if (r->scheme->has_expire) {
-		uint32_t timestamp = sf_ttl(r->scheme, v);
-		if (timestamp < h->tsmin)
-			h->tsmin = timestamp;
-	}
-	return 0;
-}
-
-static inline int
-sd_buildcompress(sdbuild *b, sr *r)
+int sd_iter_iserror(ssiter *i)
 {
-	assert(b->compress_if != &ss_nonefilter);
-	/* reserve header */
-	int rc = ss_bufensure(&b->c, r->a, sizeof(sdpageheader));
-	if (ssunlikely(rc == -1))
-		return -1;
-	ss_bufadvance(&b->c, sizeof(sdpageheader));
-	/* compression (including meta-data) */
-	ssfilter f;
-	rc = ss_filterinit(&f, b->compress_if, r->a, SS_FINPUT);
-	if (ssunlikely(rc == -1))
-		return -1;
-	rc = ss_filterstart(&f, &b->c);
-	if (ssunlikely(rc == -1))
-		goto error;
-	rc = ss_filternext(&f, &b->c, b->m.s + sizeof(sdpageheader),
-	                   ss_bufused(&b->m) - sizeof(sdpageheader));
-	if (ssunlikely(rc == -1))
-		goto error;
-	rc = ss_filternext(&f, &b->c, b->v.s, ss_bufused(&b->v));
-	if (ssunlikely(rc == -1))
-		goto error;
-	rc = ss_filtercomplete(&f, &b->c);
-	if (ssunlikely(rc == -1))
-		goto error;
-	ss_filterfree(&f);
-	return 0;
-error:
-	ss_filterfree(&f);
-	return -1;
+	sditer *ri = (sditer*)i->priv;
+	return ri->corrupt;
 }
 
-int sd_buildend(sdbuild *b, sr *r)
+int sd_iter_isroot(ssiter *i)
 {
-	/* calculate data crc (non-compressed) */
-	sdpageheader *h = sd_buildheader(b);
-	uint32_t crc = 0;
-	if (sslikely(b->crc)) {
-		crc = ss_crcp(r->crc, b->m.s, ss_bufused(&b->m), 0);
-		crc = ss_crcp(r->crc, b->v.s, ss_bufused(&b->v), crc);
-	}
-	h->crcdata = crc;
-	/* compression */
-	if (b->compress) {
-		int rc = sd_buildcompress(b, r);
-		if (ssunlikely(rc == -1))
-			return -1;
-	}
-	/* update page header */
-	int total = ss_bufused(&b->m) + ss_bufused(&b->v);
-	h->sizeorigin = total - sizeof(sdpageheader);
-	h->size = h->sizeorigin;
-	if (b->compress)
-		h->size = ss_bufused(&b->c) - sizeof(sdpageheader);
-	else
-		h->size = h->sizeorigin;
-	h->crc = ss_crcs(r->crc, h, sizeof(sdpageheader), 0);
-	if (b->compress)
-		memcpy(b->c.s, h, sizeof(sdpageheader));
-	return 0;
+	sditer *ri = (sditer*)i->priv;
+	assert(ri->v != NULL);
+	char *next =
+		((char*)ri->v -
+		        ri->v->align -
+		        ri->v->size - ri->v->total);
+	return next == ri->map.p;
 }
-#line 1 "sophia/database/sd_buildindex.c"
+#line 1 "sophia/database/sd_merge.c"
 
 /*
  * sophia database
@@ -20874,139 +25987,262 @@ int sd_buildend(sdbuild *b, sr *r)
 
 
 
-void sd_buildindex_init(sdbuildindex *i)
+int sd_mergeinit(sdmerge *m, sr *r, ssiter *i,
+                 sdbuild *build,
+                 sdbuildindex *build_index,
+                 svupsert *upsert, sdmergeconf *conf)
 {
-	ss_bufinit(&i->v);
-	ss_bufinit(&i->m);
+	m->conf        = conf;
+	m->build       = build;
+	m->build_index = build_index;
+	m->r           = r;
+	m->merge       = i;
+	m->processed   = 0;
+	m->current     = 0;
+	m->limit       = 0;
+	m->resume      = 0;
+	uint32_t sizev = 0;
+	if (! sf_schemefixed(r->scheme))
+		sizev += sizeof(uint32_t);
+	sd_indexinit(&m->index);
+	ss_iterinit(sv_writeiter, &m->i);
+	ss_iteropen(sv_writeiter, &m->i, r, i, upsert,
+	            conf->ranges,
+	            (uint64_t)conf->size_page, sizev,
+	            conf->expire,
+	            conf->timestamp,
+	            conf->vlsn);
+	return 0;
 }
 
-void sd_buildindex_free(sdbuildindex *i, sr *r)
+int sd_mergefree(sdmerge *m)
 {
-	ss_buffree(&i->v, r->a);
-	ss_buffree(&i->m, r->a);
+	sd_indexfree(&m->index, m->r);
+	return 0;
 }
 
-void sd_buildindex_reset(sdbuildindex *i)
+static inline int
+sd_mergehas(sdmerge *m)
 {
-	ss_bufreset(&i->v);
-	ss_bufreset(&i->m);
+	if (! ss_iterhas(sv_writeiter, &m->i))
+		return 0;
+	if (m->current > m->limit)
+		return 0;
+	return 1;
 }
 
-void sd_buildindex_gc(sdbuildindex *i, sr *r, int wm)
+int sd_merge(sdmerge *m)
 {
-	ss_bufgc(&i->v, r->a, wm);
-	ss_bufgc(&i->m, r->a, wm);
+	if (ssunlikely(! ss_iterhas(sv_writeiter, &m->i)))
+		return 0;
+	sdmergeconf *conf = m->conf;
+	sd_indexinit(&m->index);
+	sd_buildindex_reset(m->build_index);
+	int rc = sd_buildindex_begin(m->build_index,
+	                             conf->prefix ? SD_PAGEPREFIX : SD_PAGEPLAIN);
+	if (ssunlikely(rc == -1))
+		return -1;
+	m->current = 0;
+	m->limit   = 0;
+	uint64_t processed = m->processed;
+	uint64_t left = (conf->size_stream - processed);
+	if (left >= (conf->size_node * 2)) {
+		m->limit = conf->size_node;
+	} else
+	if (left > (conf->size_node)) {
+		m->limit = conf->size_node * 2;
+	} else {
+		m->limit = UINT64_MAX;
+	}
+	return sd_mergehas(m);
 }
 
-int sd_buildindex_begin(sdbuildindex *i)
+static inline int
+sd_mergevlog(sdmerge *m, char **v, uint8_t *flags)
 {
-	sdindexheader *h = &i->build;
-	h->crc         = 0;
-	h->size        = 0;
-	h->sizevmax    = 0;
-	h->count       = 0;
-	h->keys        = 0;
-	h->total       = 0;
-	h->totalorigin = 0;
-	h->lsnmin      = UINT64_MAX;
-	h->lsnmax      = 0;
-	h->tsmin       = UINT32_MAX;
-	h->offset      = 0;
-	h->dupkeys     = 0;
-	h->dupmin      = UINT64_MAX;
-	h->align       = 0;
-	sr_version_storage(&h->version);
+	sdmergeconf *conf = m->conf;
+	sr *r = m->r;
+	int rc;
+	if (*flags & SVVLOG) {
+		/* move values out of a file marked for gc */
+		if (sslikely(! sd_vloggc(conf->vlog, r, *v)))
+			return sd_vlogtrack(conf->vlog, r, *v, &m->build_index->vlog);
+		rc = sd_vlogread(conf->vlog, r, *v, conf->vlog_buf_read);
+		if (ssunlikely(rc == -1))
+			return -1;
+		*v = conf->vlog_buf_read->s;
+	} else {
+		if (conf->vlog_threshold == 0 || (*flags & SVDELETE))
+			return 0;
+		if (sd_vlogsize(r->scheme, *v) < conf->vlog_threshold)
+			return 0;
+	}
+	rc = sd_vlogwrite(conf->vlog, r, *v, conf->vlog_buf,
+	                  &m->build_index->vlog);
+	if (ssunlikely(rc == -1))
+		return -1;
+	*v = conf->vlog_buf->s;
+	*flags |= SVVLOG;
 	return 0;
 }
 
-int sd_buildindex_end(sdbuildindex *i, sr *r, uint32_t align, uint64_t offset)
+static inline int
+sd_mergebuild(sdmerge *m, sdbuild *b)
 {
-	/* calculate index align for direct_io */
-	int size_meta  = sizeof(sdindexheader);
-	int size_align = 0;
-	if (align) {
-		size_align += align - ((offset +
-		                        ss_bufused(&i->v) +
-		                        size_meta +
-		                        ss_bufused(&i->m)) % align);
-		size_meta  += size_align;
+	sdmergeconf *conf = m->conf;
+	sd_buildreset(b);
+	if (m->resume) {
+		m->resume = 0;
+		if (ssunlikely(! sv_writeiter_resume(&m->i)))
+			return 0;
 	}
-	int rc = ss_bufensure(&i->m, r->a, size_meta);
+	if (! sd_mergehas(m))
+		return 0;
+	int rc;
+	rc = sd_buildbegin(b, m->r, conf->checksum,
+	                   conf->prefix,
+	                   conf->compression,
+	                   conf->compression_if,
+	                   conf->compression_dict);
 	if (ssunlikely(rc == -1))
-		return sr_oom(r->e);
-	/* align */
-	sdindexheader *h = &i->build;
-	if (size_align) {
-		h->align = size_align;
-		memset(i->m.p, 0, size_align);
-		ss_bufadvance(&i->m, size_align);
+		return -1;
+	while (ss_iterhas(sv_writeiter, &m->i))
+	{
+		char *v = ss_iterof(sv_writeiter, &m->i);
+		uint8_t flags = sf_flags(m->r->scheme, v);
+		if (sv_writeiter_is_duplicate(&m->i))
+			flags |= SVDUP;
+		if (conf->vlog) {
+			rc = sd_mergevlog(m, &v, &flags);
+			if (ssunlikely(rc == -1))
+				return -1;
+		}
+		rc = sd_buildadd(b, m->r, v, flags);
+		if (ssunlikely(rc == -1))
+			return -1;
+		/* prefix-compressed pages and pages of separated
+		 * documents are limited by their encoded size */
+		if (conf->prefix || conf->vlog_threshold)
+			sv_writeiter_setsize(&m->i, sd_buildsize(b));
+		if (conf->bloom_bits_per_key && !(flags & SVDUP)) {
+			rc = sd_buildindex_addhash(m->build_index, m->r, v);
+			if (ssunlikely(rc == -1))
+				return -1;
+		}
+		ss_iternext(sv_writeiter, &m->i);
 	}
-	/* header */
-	h->offset = offset;
-	h->crc = ss_crcs(r->crc, h, sizeof(sdindexheader), 0);
-	memcpy(i->m.p, &i->build, sizeof(sdindexheader));
-	ss_bufadvance(&i->m, sizeof(sdindexheader));
-	return 0;
+	m->resume = 1;
+	return 1;
 }
 
-int sd_buildindex_add(sdbuildindex *i, sr *r, sdbuild *b, uint64_t offset)
+static int
+sd_mergejob(ssjob *j)
 {
-	int rc = ss_bufensure(&i->m, r->a, sizeof(sdindexpage));
-	if (ssunlikely(rc == -1))
-		return sr_oom(r->e);
-	sdpageheader *ph = sd_buildheader(b);
+	sdmergepage *p = j->arg;
+	return sd_buildend(&p->build, p->r);
+}
 
-	int size = ph->size + sizeof(sdpageheader);
-	int sizeorigin = ph->sizeorigin + sizeof(sdpageheader);
+static inline uint64_t
+sd_mergebound(sdmerge *m, sdbuild *b)
+{
+	/* upper bound of the page size on disk */
+	uint64_t size = sizeof(sdpageheader) + sd_buildsize(b);
+	if (m->conf->compression)
+		size += size / 64 + 64;
+	return size;
+}
 
-	/* prepare page header */
-	sdindexpage *p = (sdindexpage*)i->m.p;
-	p->offset      = offset;
-	p->offsetindex = ss_bufused(&i->v);
-	p->lsnmin      = ph->lsnmin;
-	p->lsnmax      = ph->lsnmax;
-	p->size        = size;
-	p->sizeorigin  = sizeorigin;
-	p->sizemin     = 0;
-	p->sizemax     = 0;
+int sd_mergepage(sdmerge *m)
+{
+	sdmergeconf *conf = m->conf;
+	int rc;
+	if (conf->batch_size <= 1) {
+		rc = sd_mergebuild(m, m->build);
+		if (ssunlikely(rc <= 0))
+			return rc;
+		rc = sd_buildend(m->build, m->r);
+		if (ssunlikely(rc == -1))
+			return -1;
+		return 1;
+	}
 
-	/* copy keys */
-	if (ssunlikely(ph->count > 0)) {
-		char *min = sd_buildmin(b, r);
-		char *max = sd_buildmax(b, r);
-		p->sizemin = sf_comparable_size(r->scheme, min);
-		p->sizemax = sf_comparable_size(r->scheme, max);
-		int rc = ss_bufensure(&i->v, r->a, p->sizemin + p->sizemax);
+	/* build a batch of pages and compress them in
+	 * parallel. a page joins the batch only if the
+	 * node would still be under its limit with every
+	 * page of the batch at its largest size, so that
+	 * nodes are split the same way as one page at a
+	 * time */
+	ssjobgroup group;
+	ss_jobgroupinit(&group);
+	uint64_t size = m->current;
+	uint32_t count = 0;
+	while (count < conf->batch_size) {
+		if (count > 0 && size > m->limit)
+			break;
+		sdmergepage *p = &conf->batch[count];
+		rc = sd_mergebuild(m, &p->build);
 		if (ssunlikely(rc == -1))
-			return sr_oom(r->e);
-		sf_comparable_write(r->scheme, min, i->v.p);
-		ss_bufadvance(&i->v, p->sizemin);
-		sf_comparable_write(r->scheme, max, i->v.p);
-		ss_bufadvance(&i->v, p->sizemax);
+			break;
+		if (rc == 0)
+			break;
+		size += sd_mergebound(m, &p->build);
+		p->r = m->r;
+		ss_jobinit(&p->job, sd_mergejob, p, &group);
+		ss_jobqpush(conf->jobq, &p->job);
+		count++;
 	}
+	int rcjob = ss_jobqwait(conf->jobq, &group);
+	if (ssunlikely(rc == -1 || rcjob == -1))
+		return -1;
+	return count;
+}
 
-	/* update index info */
-	sdindexheader *h = &i->build;
-	h->count++;
-	h->size  += sizeof(sdindexpage) + p->sizemin + p->sizemax;
-	h->keys  += ph->count;
-	h->total += size;
-	h->totalorigin += sizeorigin;
-	if (b->vmax > h->sizevmax)
-		h->sizevmax = b->vmax;
-	if (ph->lsnmin < h->lsnmin)
-		h->lsnmin = ph->lsnmin;
-	if (ph->lsnmax > h->lsnmax)
-		h->lsnmax = ph->lsnmax;
-	if (ph->tsmin < h->tsmin)
-		h->tsmin = ph->tsmin;
-	h->dupkeys += ph->countdup;
-	if (ph->lsnmindup < h->dupmin)
-		h->dupmin = ph->lsnmindup;
-	ss_bufadvance(&i->m, sizeof(sdindexpage));
+sdbuild *sd_mergepageof(sdmerge *m, int pos)
+{
+	if (m->conf->batch_size <= 1) {
+		assert(pos == 0);
+		return m->build;
+	}
+	assert(pos < (int)m->conf->batch_size);
+	return &m->conf->batch[pos].build;
+}
+
+int sd_mergecommit(sdmerge *m, sdbuild *b, uint64_t offset)
+{
+	int rc = sd_buildindex_add(m->build_index, m->r, b, offset);
+	if (ssunlikely(rc == -1))
+		return -1;
+	m->current = m->build_index->build.total;
 	return 0;
 }
-#line 1 "sophia/database/sd_indexiter.c"
+
+int sd_mergeend(sdmerge *m, uint64_t offset)
+{
+	m->processed += m->build_index->build.total;
+	uint32_t align = 0;
+	if (m->conf->direct_io)
+		align = m->conf->direct_io_page_size;
+	int rc = sd_buildindex_expire(m->build_index, m->r);
+	if (ssunlikely(rc == -1))
+		return -1;
+	rc = sd_buildindex_vlog(m->build_index, m->r);
+	if (ssunlikely(rc == -1))
+		return -1;
+	rc = sd_buildindex_bloom(m->build_index, m->r,
+	                         m->conf->bloom_bits_per_key);
+	if (ssunlikely(rc == -1))
+		return -1;
+	rc = sd_buildindex_end(m->build_index, m->r, align, offset);
+	if (ssunlikely(rc == -1))
+		return -1;
+	rc = sd_indexcopy_buf(&m->index, m->r,
+	                      &m->build_index->v,
+	                      &m->build_index->m);
+	if (ssunlikely(rc == -1))
+		return -1;
+	return 0;
+}
+#line 1 "sophia/database/sd_pagecache.c"
 
 /*
  * sophia database
@@ -21022,194 +26258,349 @@ int sd_buildindex_add(sdbuildindex *i, sr *r, sdbuild *b, uint64_t offset)
 
 
 
-ssiterif sd_indexiter =
+static inline uint32_t
+sd_pagecache_hash(uint32_t id, uint64_t node, uint64_t offset)
 {
-	.close = sd_indexiter_close,
-	.has   = sd_indexiter_has,
-	.of    = sd_indexiter_of,
-	.next  = sd_indexiter_next
-};
-#line 1 "sophia/database/sd_io.c"
-
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
-
-
-
-
-
+	uint64_t key[3] = { id, node, offset };
+	return ss_fnv((char*)key, sizeof(key));
+}
 
+static inline sdpagecacheshard*
+sd_pagecache_shard(sdpagecache *c, uint32_t hash) {
+	return &c->shard[(hash >> 16) % SD_PAGECACHE_SHARDS];
+}
 
-int sd_ioinit(sdio *s)
+void sd_pagecache_init(sdpagecache *c, ssa *a)
 {
-	ss_bufinit(&s->buf);
-	s->size_page  = 0;
-	s->size_align = 0;
-	s->direct     = 0;
-	return 0;
+	c->limit = 0;
+	c->a     = a;
+	int j = 0;
+	while (j < SD_PAGECACHE_SHARDS) {
+		sdpagecacheshard *s = &c->shard[j];
+		ss_spinlockinit(&s->lock);
+		s->i     = NULL;
+		s->size  = 0;
+		s->count = 0;
+		s->used  = 0;
+		ss_listinit(&s->lru);
+		j++;
+	}
 }
 
-int sd_ioprepare(sdio *s, sr *r,
-                 int direct,
-                 uint32_t size_page,
-                 uint32_t size_buffer)
+void sd_pagecache_free(sdpagecache *c)
 {
-	if (ssunlikely(s->buf.s))
-		return 0;
-	s->direct = direct;
-	s->size_page = size_page;
-	ss_bufinit(&s->buf);
-	int rc = ss_bufensure(&s->buf, r->a, size_buffer);
-	if (ssunlikely(rc == -1))
-		return -1;
-	char *start =
-		(char*)((((intptr_t)s->buf.s + s->size_page - 1) / s->size_page) *
-		        s->size_page);
-	s->size_align = start - s->buf.s;
-	ss_bufadvance(&s->buf, s->size_align);
-	return 0;
+	int j = 0;
+	while (j < SD_PAGECACHE_SHARDS) {
+		sdpagecacheshard *s = &c->shard[j];
+		sslist *i, *n;
+		ss_listforeach_safe(&s->lru, i, n) {
+			sdcachepage *p = sscast(i, sdcachepage, link);
+			ss_free(c->a, p);
+		}
+		if (s->i)
+			ss_free(c->a, s->i);
+		ss_spinlockfree(&s->lock);
+		j++;
+	}
+	sd_pagecache_init(c, c->a);
 }
 
-int sd_iofree(sdio *s, sr *r)
+uint64_t sd_pagecache_used(sdpagecache *c)
 {
-	ss_buffree(&s->buf, r->a);
-	return 0;
+	uint64_t used = 0;
+	int j = 0;
+	while (j < SD_PAGECACHE_SHARDS) {
+		sdpagecacheshard *s = &c->shard[j];
+		ss_spinlock(&s->lock);
+		used += s->used;
+		ss_spinunlock(&s->lock);
+		j++;
+	}
+	return used;
 }
 
-int sd_ioreset(sdio *s)
+static inline sdcachepage**
+sd_pagecache_find(sdpagecacheshard *s, uint32_t hash,
+                  uint32_t id, uint64_t node, uint64_t offset)
 {
-	ss_bufreset(&s->buf);
-	ss_bufadvance(&s->buf, s->size_align);
-	return 0;
+	sdcachepage **p = &s->i[hash % s->size];
+	while (*p) {
+		sdcachepage *v = *p;
+		if (v->hash == hash && v->offset == offset &&
+		    v->node == node && v->id == id)
+			break;
+		p = &v->next;
+	}
+	return p;
 }
 
 static inline int
-sd_ioflush_direct(sdio *s, sr *r, ssfile *f)
+sd_pagecache_resize(sdpagecache *c, sdpagecacheshard *s)
 {
-	/* write full pages only */
-	uint32_t total = ss_bufused(&s->buf) - s->size_align;
-	uint32_t count = total / s->size_page;
-	if (count == 0)
-		return 0;
-	uint32_t size  = count * s->size_page;
-	int rc = ss_filewrite(f, s->buf.s + s->size_align, size);
-	if (ssunlikely(rc == -1)) {
-		sr_malfunction(r->e, "file '%s' write error: %s",
-		               ss_pathof(&f->path),
-		               strerror(errno));
+	uint32_t size = (s->size == 0) ? 256 : s->size * 2;
+	sdcachepage **i = ss_malloc(c->a, size * sizeof(sdcachepage*));
+	if (ssunlikely(i == NULL))
 		return -1;
+	memset(i, 0, size * sizeof(sdcachepage*));
+	uint32_t j = 0;
+	while (j < s->size) {
+		sdcachepage *p = s->i[j];
+		while (p) {
+			sdcachepage *next = p->next;
+			uint32_t pos = p->hash % size;
+			p->next = i[pos];
+			i[pos] = p;
+			p = next;
+		}
+		j++;
 	}
-	/* copy unaligned part to the beginning
-	 * of the buffer */
-	uint32_t leftover = total % s->size_page;
-	s->buf.p = s->buf.s + s->size_align;
-	if (leftover)
-		memmove(s->buf.p, s->buf.s + s->size_align + size, leftover);
-	ss_bufadvance(&s->buf, leftover);
+	if (s->i)
+		ss_free(c->a, s->i);
+	s->i = i;
+	s->size = size;
 	return 0;
 }
 
-int sd_ioflush(sdio *s, sr *r, ssfile *f)
-{
-	if (! s->direct) {
-		/* unused */
-		return 0;
+static inline void
+sd_pagecache_evict(sdpagecache *c, sdpagecacheshard *s, uint64_t limit)
+{
+	/* drop least recently used pages which are not
+	 * pinned by a reader */
+	sslist *i = s->lru.prev;
+	while (s->used > limit && i != &s->lru) {
+		sdcachepage *p = sscast(i, sdcachepage, link);
+		i = i->prev;
+		if (p->refs > 0)
+			continue;
+		sdcachepage **pp;
+		pp = sd_pagecache_find(s, p->hash, p->id, p->node, p->offset);
+		assert(*pp == p);
+		*pp = p->next;
+		ss_listunlink(&p->link);
+		s->count--;
+		s->used -= p->size;
+		ss_free(c->a, p);
 	}
-	return sd_ioflush_direct(s, r, f);
 }
 
-static inline int
-sd_iowrite_direct(sdio *s, sr *r, ssfile *f, char *buf, int size)
+sdcachepage*
+sd_pagecache_get(sdpagecache *c, uint32_t id, uint64_t node, uint64_t offset)
 {
-	int rc;
-	if ((ss_bufused(&s->buf) + size) > ss_bufsize(&s->buf)) {
-		rc = sd_ioflush(s, r, f);
-		if (ssunlikely(rc == -1))
-			return -1;
+	uint32_t hash = sd_pagecache_hash(id, node, offset);
+	sdpagecacheshard *s = sd_pagecache_shard(c, hash);
+	ss_spinlock(&s->lock);
+	if (ssunlikely(s->count == 0)) {
+		ss_spinunlock(&s->lock);
+		return NULL;
 	}
-	rc = ss_bufadd(&s->buf, r->a, buf, size);
-	if (ssunlikely(rc == -1))
-		return sr_oom(r->e);
-	return 0;
+	sdcachepage *p = *sd_pagecache_find(s, hash, id, node, offset);
+	if (p) {
+		p->refs++;
+		ss_listunlink(&p->link);
+		ss_listpush(&s->lru, &p->link);
+	}
+	ss_spinunlock(&s->lock);
+	return p;
 }
 
-int sd_iowrite(sdio *s, sr *r, ssfile *f, char *buf, int size)
+sdcachepage*
+sd_pagecache_add(sdpagecache *c, uint32_t id, uint64_t node, uint64_t offset,
+                 char *data, uint32_t size)
 {
-	if (s->direct)
-		return sd_iowrite_direct(s, r, f, buf, size);
-	int rc;
-	rc = ss_filewrite(f, buf, size);
-	if (ssunlikely(rc == -1)) {
-		sr_malfunction(r->e, "file '%s' write error: %s",
-		               ss_pathof(&f->path),
-		               strerror(errno));
-		return -1;
+	uint32_t hash = sd_pagecache_hash(id, node, offset);
+	sdpagecacheshard *s = sd_pagecache_shard(c, hash);
+	sdcachepage *p = ss_malloc(c->a, sizeof(sdcachepage) + size);
+	if (ssunlikely(p == NULL))
+		return NULL;
+	p->node   = node;
+	p->offset = offset;
+	p->id     = id;
+	p->hash   = hash;
+	p->size   = size;
+	p->refs   = 1;
+	p->next   = NULL;
+	ss_listinit(&p->link);
+	memcpy(sd_cachepage_data(p), data, size);
+
+	ss_spinlock(&s->lock);
+	if (ssunlikely(s->count >= s->size)) {
+		if (ssunlikely(sd_pagecache_resize(c, s) == -1)) {
+			ss_spinunlock(&s->lock);
+			ss_free(c->a, p);
+			return NULL;
+		}
 	}
-	return 0;
+	/* page might be added by a concurrent reader */
+	sdcachepage **pp = sd_pagecache_find(s, hash, id, node, offset);
+	if (ssunlikely(*pp)) {
+		sdcachepage *v = *pp;
+		v->refs++;
+		ss_spinunlock(&s->lock);
+		ss_free(c->a, p);
+		return v;
+	}
+	uint64_t limit = c->limit / SD_PAGECACHE_SHARDS;
+	if (s->used + size > limit)
+		sd_pagecache_evict(c, s, (limit > size) ? limit - size : 0);
+	pp = &s->i[hash % s->size];
+	p->next = *pp;
+	*pp = p;
+	ss_listpush(&s->lru, &p->link);
+	s->count++;
+	s->used += size;
+	ss_spinunlock(&s->lock);
+	return p;
+}
+
+void sd_pagecache_unpin(sdpagecache *c, sdcachepage *p)
+{
+	sdpagecacheshard *s = sd_pagecache_shard(c, p->hash);
+	ss_spinlock(&s->lock);
+	assert(p->refs > 0);
+	p->refs--;
+	ss_spinunlock(&s->lock);
 }
+#line 1 "sophia/database/sd_pageiter.c"
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+
+
 
-static inline int
-sd_ioread_direct(sdio *s, sr *r, ssfile *f, uint64_t offset,
-                 char *buf, int size, int from_compaction,
-                 char **buf_align)
+
+
+
+ssiterif sd_pageiter =
 {
-	uint32_t page_size = s->size_page;
+	.close   = sd_pageiter_close,
+	.has     = sd_pageiter_has,
+	.of      = sd_pageiter_of,
+	.next    = sd_pageiter_next
+};
+#line 1 "sophia/database/sd_pageprefix.c"
 
-	/* align buffer */
-	char *buf_aligned =
-		(char*)((((intptr_t)buf + page_size - 1) / page_size) * page_size);
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
 
-	/* calculate aligned offset and size */
-	uint64_t offset_align = offset % page_size;
-	offset -= offset_align;
-	size   += offset_align;
-	uint64_t size_align   = size % page_size;
-	if (size_align > 0) {
-		size += page_size - size % page_size;
-	}
 
-	/* read */
-	uint64_t start = ss_utime();
-	int rc;
-	rc = ss_filepread(f, offset, buf_aligned, size);
-	if (ssunlikely(rc == -1)) {
-		sr_error(r->e, "db file '%s' read error: %s",
-		         ss_pathof(&f->path),
-		         strerror(errno));
-		return -1;
-	}
-	sr_statpread(r->stat, start, from_compaction);
-	*buf_align = buf_aligned + offset_align;
-	return 0;
-}
 
-int sd_ioread(sdio *s, sr *r, ssfile *f, uint64_t offset,
-              char *buf, int size, int from_compaction,
-              char **buf_align)
+
+
+
+
+int sd_pageprefix_decode(sr *r, sdpageheader *h, char *src, uint32_t size,
+                         char *dest, char *key)
 {
-	if (s->direct)
-		return sd_ioread_direct(s, r, f, offset, buf, size,
-		                        from_compaction,
-		                        buf_align);
-	uint64_t start = ss_utime();
-	int rc;
-	rc = ss_filepread(f, offset, buf, size);
-	if (ssunlikely(rc == -1)) {
-		sr_error(r->e, "db file '%s' read error: %s",
-		         ss_pathof(&f->path),
-		         strerror(errno));
+	/* decode page into the plain layout, key is a scratch
+	 * buffer of at least h->sizeorigin bytes */
+	sfscheme *s = r->scheme;
+	char *end = src + size;
+	uint32_t size_keys;
+	if (ssunlikely(size < sizeof(uint32_t)))
+		return -1;
+	memcpy(&size_keys, src, sizeof(uint32_t));
+	char *keys = src + sizeof(uint32_t);
+	if (ssunlikely(size_keys > (uint32_t)(end - keys)))
 		return -1;
+	char *k = keys;
+	char *k_end = keys + size_keys;
+	char *v = keys + size_keys;
+
+	int fixed = sf_schemefixed(s);
+	uint32_t *offset = (uint32_t*)dest;
+	char *start = dest;
+	if (! fixed)
+		start += sizeof(uint32_t) * h->count;
+	char *p = start;
+	char *p_end = dest + h->sizeorigin;
+	if (ssunlikely(p > p_end))
+		return -1;
+	uint32_t size_key = 0;
+	uint32_t pos = 0;
+	while (pos < h->count)
+	{
+		uint32_t shared, unshared;
+		k = sd_pageprefix_varintread(k, k_end, &shared);
+		if (ssunlikely(k == NULL))
+			return -1;
+		k = sd_pageprefix_varintread(k, k_end, &unshared);
+		if (ssunlikely(k == NULL))
+			return -1;
+		if (ssunlikely(shared > size_key ||
+		               unshared > (uint32_t)(k_end - k) ||
+		               unshared > h->sizeorigin - shared))
+			return -1;
+		memcpy(key + shared, k, unshared);
+		k += unshared;
+		size_key = shared + unshared;
+
+		/* variable fields size */
+		uint32_t size_doc = s->var_offset + (sizeof(sfvar) * s->var_count);
+		if (ssunlikely(size_doc > (uint32_t)(p_end - p)))
+			return -1;
+		int i = 0;
+		while (i < s->var_count) {
+			uint32_t size_field;
+			k = sd_pageprefix_varintread(k, k_end, &size_field);
+			if (ssunlikely(k == NULL))
+				return -1;
+			if (ssunlikely(size_field > (uint32_t)(p_end - p) - size_doc))
+				return -1;
+			sf_var(s, i, p)->size = size_field;
+			size_doc += size_field;
+			i++;
+		}
+
+		/* key fields */
+		uint32_t size_copied = 0;
+		i = 0;
+		while (i < s->keys_count) {
+			uint32_t size_field;
+			char *ptr = sf_fieldptr(s, s->keys[i], p, &size_field);
+			if (ssunlikely(size_field > size_key - size_copied))
+				return -1;
+			memcpy(ptr, key + size_copied, size_field);
+			size_copied += size_field;
+			i++;
+		}
+		if (ssunlikely(size_copied != size_key))
+			return -1;
+
+		/* other fields */
+		i = 0;
+		while (i < s->fields_count) {
+			sffield *f = s->fields[i];
+			i++;
+			if (f->key)
+				continue;
+			uint32_t size_field;
+			char *ptr = sf_fieldptr(s, f, p, &size_field);
+			if (ssunlikely(size_field > (uint32_t)(end - v)))
+				return -1;
+			memcpy(ptr, v, size_field);
+			v += size_field;
+		}
+		if (! fixed)
+			offset[pos] = p - start;
+		p += size_doc;
+		pos++;
 	}
-	sr_statpread(r->stat, start, from_compaction);
-	*buf_align = buf;
+	if (ssunlikely(k != k_end || v != end || p != p_end))
+		return -1;
 	return 0;
 }
-#line 1 "sophia/database/sd_iter.c"
+#line 1 "sophia/database/sd_read.c"
 
 /*
  * sophia database
@@ -21225,158 +26616,152 @@ int sd_ioread(sdio *s, sr *r, ssfile *f, uint64_t offset,
 
 
 
-typedef struct sditer sditer;
+ssiterif sd_read =
+{
+	.close = sd_read_close,
+	.has   = sd_read_has,
+	.of    = sd_read_of,
+	.next  = sd_read_next
+};
+#line 1 "sophia/database/sd_scheme.c"
 
-struct sditer {
-	ssfile        *file;
-	int            corrupt;
-	sdindexheader *v;
-	ssmmap         map;
-	sr            *r;
-} sspacked;
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
 
-static int
-sd_iternext_of(sditer *i, sdindexheader *index)
-{
-	if (ssunlikely(index == NULL))
-		return 0;
 
-	char *start = i->map.p + index->offset;
 
-	int sanity_check = 0;
-	sanity_check += (start >= (char*)index);
-	sanity_check +=
-		((char*)index - start) != index->align + index->size;
 
-	/* validate index header */
-	if (ssunlikely(sanity_check > 0)) {
-		sr_malfunction(i->r->e, "corrupted db file '%s': bad index header",
-		               ss_pathof(&i->file->path));
-		i->corrupt = 1;
-		i->v = NULL;
-		return -1;
-	}
 
-	/* validate index crc */
-	uint32_t crc = ss_crcs(i->r->crc, index, sizeof(sdindexheader), 0);
-	if (index->crc != crc) {
-		sr_malfunction(i->r->e, "corrupted db file '%s': bad index crc",
-		               ss_pathof(&i->file->path));
-		i->corrupt = 1;
-		i->v = NULL;
-		return -1;
-	}
 
-	i->v = index;
-	return 1;
+
+int sd_schemebegin(sdscheme *c, sr *r)
+{
+	int rc = ss_bufensure(&c->buf, r->a, sizeof(sdschemeheader));
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+	sdschemeheader *h = (sdschemeheader*)c->buf.s;
+	memset(h, 0, sizeof(sdschemeheader));
+	ss_bufadvance(&c->buf, sizeof(sdschemeheader));
+	return 0;
 }
 
-int sd_iter_open(ssiter *i, sr *r, ssfile *file)
+int sd_schemeadd(sdscheme *c, sr *r, uint8_t id, sstype type,
+                 void *value, uint32_t size)
 {
-	sditer *ri = (sditer*)i->priv;
-	memset(ri, 0, sizeof(*ri));
-	ri->r = r;
-	ri->file = file;
-	if (ssunlikely(ri->file->size < sizeof(sdindexheader))) {
-		sr_malfunction(ri->r->e, "corrupted db file '%s': bad size",
-		               ss_pathof(&ri->file->path));
-		ri->corrupt = 1;
-		return -1;
+	sdschemeopt opt = {
+		.type = type,
+		.id   = id,
+		.size = size
+	};
+	int rc = ss_bufadd(&c->buf, r->a, &opt, sizeof(opt));
+	if (ssunlikely(rc == -1))
+		goto error;
+	rc = ss_bufadd(&c->buf, r->a, value, size);
+	if (ssunlikely(rc == -1))
+		goto error;
+	sdschemeheader *h = (sdschemeheader*)c->buf.s;
+	h->count++;
+	return 0;
+error:
+	return sr_oom(r->e);
+}
+
+int sd_schemecommit(sdscheme *c, sr *r)
+{
+	if (ssunlikely(ss_bufused(&c->buf) == 0))
+		return 0;
+	sdschemeheader *h = (sdschemeheader*)c->buf.s;
+	h->size = ss_bufused(&c->buf) - sizeof(sdschemeheader);
+	h->crc  = ss_crcs(r->crc, (char*)h, ss_bufused(&c->buf), 0);
+	return 0;
+}
+
+int sd_schemewrite(sdscheme *c, sr *r, char *path, int sync)
+{
+	ssfile meta;
+	ss_fileinit(&meta, r->vfs);
+	int rc = ss_filenew(&meta, path, 0);
+	if (ssunlikely(rc == -1))
+		goto error;
+	rc = ss_filewrite(&meta, c->buf.s, ss_bufused(&c->buf));
+	if (ssunlikely(rc == -1))
+		goto error;
+	if (sync) {
+		rc = ss_filesync(&meta);
+		if (ssunlikely(rc == -1))
+			goto error;
 	}
-	int rc = ss_vfsmmap(r->vfs, &ri->map, ri->file->fd, ri->file->size, 1);
-	if (ssunlikely(rc == -1)) {
-		sr_malfunction(ri->r->e, "failed to mmap db file '%s': %s",
-		               ss_pathof(&ri->file->path),
-		               strerror(errno));
+	ss_fileadvise(&meta, SS_ADVISE_DONTNEED, 0, meta.size);
+	rc = ss_fileclose(&meta);
+	if (ssunlikely(rc == -1))
+		goto error;
+	return 0;
+error:
+	sr_error(r->e, "scheme file '%s' error: %s",
+	         path, strerror(errno));
+	ss_fileclose(&meta);
+	return -1;
+}
+
+int sd_schemerecover(sdscheme *c, sr *r, char *path)
+{
+	ssize_t size = ss_vfssize(r->vfs, path);
+	if (ssunlikely(size == -1))
+		goto error;
+	if (ssunlikely((unsigned int)size < sizeof(sdschemeheader))) {
+		sr_error(r->e, "scheme file '%s' is corrupted", path);
 		return -1;
 	}
-	sdindexheader *header =
-		(sdindexheader*)((char*)ri->map.p +
-		          (ri->file->size - sizeof(sdindexheader)));
-	rc = sd_iternext_of(ri, header);
+	int rc = ss_bufensure(&c->buf, r->a, size);
 	if (ssunlikely(rc == -1))
-		ss_vfsmunmap(r->vfs, &ri->map);
-	return rc;
+		return sr_oom(r->e);
+	ssfile meta;
+	ss_fileinit(&meta, r->vfs);
+	rc = ss_fileopen(&meta, path, 0);
+	if (ssunlikely(rc == -1))
+		goto error;
+	rc = ss_filepread(&meta, 0, c->buf.s, size);
+	if (ssunlikely(rc == -1))
+		goto error;
+	rc = ss_fileclose(&meta);
+	if (ssunlikely(rc == -1))
+		goto error;
+	ss_bufadvance(&c->buf, size);
+	return 0;
+error:
+	sr_error(r->e, "scheme file '%s' error: %s",
+	         path, strerror(errno));
+	return -1;
 }
+#line 1 "sophia/database/sd_schemeiter.c"
 
-static void
-sd_iterclose(ssiter *i)
-{
-	sditer *ri = (sditer*)i->priv;
-	ss_vfsmunmap(ri->r->vfs, &ri->map);
-}
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
 
-static int
-sd_iterhas(ssiter *i)
-{
-	sditer *ri = (sditer*)i->priv;
-	return ri->v != NULL;
-}
 
-static void*
-sd_iterof(ssiter *i)
-{
-	sditer *ri = (sditer*)i->priv;
-	return ri->v;
-}
 
-static void
-sd_iternext(ssiter *i)
-{
-	sditer *ri = (sditer*)i->priv;
-	if (ssunlikely(ri->v == NULL))
-		return;
-	char *next =
-		((char*)ri->v -
-		        ri->v->align -
-		        ri->v->size - ri->v->total);
-	if (next == ri->map.p) {
-		ri->v = NULL;
-		return;
-	}
-	next = next - sizeof(sdindexheader);
-	sd_iternext_of(ri, (sdindexheader*)next);
-}
 
-ssiterif sd_iter =
-{
-	.close = sd_iterclose,
-	.has   = sd_iterhas,
-	.of    = sd_iterof,
-	.next  = sd_iternext
-};
 
-#if 0
-	/* truncate file to the end of a latest actual
-	 * index */
-	char *eof =
-		(char*)ri->map.p +
-		       ri->actual->offset + sizeof(sdindexheader) +
-		       ri->actual->size;
-	uint64_t file_size = eof - ri->map.p;
-	int rc = ss_fileresize(ri->file, file_size);
-	if (ssunlikely(rc == -1))
-		return -1;
-	sr_errorreset(ri->r->e);
-#endif
 
-int sd_iter_iserror(ssiter *i)
-{
-	sditer *ri = (sditer*)i->priv;
-	return ri->corrupt;
-}
 
-int sd_iter_isroot(ssiter *i)
+ssiterif sd_schemeiter =
 {
-	sditer *ri = (sditer*)i->priv;
-	assert(ri->v != NULL);
-	char *next =
-		((char*)ri->v -
-		        ri->v->align -
-		        ri->v->size - ri->v->total);
-	return next == ri->map.p;
-}
-#line 1 "sophia/database/sd_merge.c"
+	.close   = sd_schemeiter_close,
+	.has     = sd_schemeiter_has,
+	.of      = sd_schemeiter_of,
+	.next    = sd_schemeiter_next
+};
+#line 1 "sophia/database/sd_vlog.c"
 
 /*
  * sophia database
@@ -21386,319 +26771,788 @@ int sd_iter_isroot(ssiter *i)
  * BSD License
 */
 
+/*
+	value log
 
+	Values of documents bigger than value_log_threshold are
+	written by the node builder to append-only value log files
+	(<db path>/<id>.vlog) and the document is stored in the
+	node with its value fields replaced by sdvlogref.
 
+	Every node keeps a list of value log files it references
+	together with the number of referenced bytes (sdindexvlog),
+	the sum of these across the nodes is the live size of the
+	file. A file is removed when nothing references it anymore,
+	files with too much garbage are marked for gc and nodes
+	referencing them are recompacted, which moves still
+	referenced values to the current file.
 
+	Files are pinned by readers and by the node builder, until
+	the new node is referenced.
 
+	The file size is the reserved size: builders reserve space
+	for the values of a document under the lock and write them
+	outside of it, so that value reads and other builders are
+	not blocked by the write. A node syncs the files it
+	references before it is sealed.
+*/
 
 
-int sd_mergeinit(sdmerge *m, sr *r, ssiter *i,
-                 sdbuild *build,
-                 sdbuildindex *build_index,
-                 svupsert *upsert, sdmergeconf *conf)
+
+
+
+
+
+
+
+void sd_vloginit(sdvlog *l)
 {
-	m->conf        = conf;
-	m->build       = build;
-	m->build_index = build_index;
-	m->r           = r;
-	m->merge       = i;
-	m->processed   = 0;
-	m->current     = 0;
-	m->limit       = 0;
-	m->resume      = 0;
-	uint32_t sizev = 0;
-	if (! sf_schemefixed(r->scheme))
-		sizev += sizeof(uint32_t);
-	sd_indexinit(&m->index);
-	ss_iterinit(sv_writeiter, &m->i);
-	ss_iteropen(sv_writeiter, &m->i, r, i, upsert,
-	            (uint64_t)conf->size_page, sizev,
-	            conf->expire,
-	            conf->timestamp,
-	            conf->vlsn);
-	return 0;
+	ss_mutexinit(&l->lock);
+	ss_listinit(&l->list);
+	l->count     = 0;
+	l->gc_count  = 0;
+	l->seq       = 0;
+	l->online    = 0;
+	l->sync      = 0;
+	l->size_file = 0;
+	l->current   = NULL;
+	l->path      = NULL;
 }
 
-int sd_mergefree(sdmerge *m)
+static inline sdvlogfile*
+sd_vlogfind(sdvlog *l, uint32_t id)
 {
-	sd_indexfree(&m->index, m->r);
-	return 0;
+	sslist *i;
+	ss_listforeach(&l->list, i) {
+		sdvlogfile *f = sscast(i, sdvlogfile, link);
+		if (f->id == id)
+			return f;
+	}
+	return NULL;
 }
 
-static inline int
-sd_mergehas(sdmerge *m)
+static inline sdvlogfile*
+sd_vlogfile_new(sdvlog *l, sr *r, uint32_t id)
 {
-	if (! ss_iterhas(sv_writeiter, &m->i))
-		return 0;
-	if (m->current > m->limit)
-		return 0;
-	return 1;
+	sdvlogfile *f = ss_malloc(r->a, sizeof(sdvlogfile));
+	if (ssunlikely(f == NULL))
+		return NULL;
+	f->id          = id;
+	f->refs        = 0;
+	f->gc          = 0;
+	f->writers     = 0;
+	f->backup      = 0;
+	f->backup_size = 0;
+	f->synced      = 0;
+	f->live        = 0;
+	ss_fileinit(&f->file, r->vfs);
+	ss_listinit(&f->link);
+	ss_listappend(&l->list, &f->link);
+	l->count++;
+	if (id > l->seq)
+		l->seq = id;
+	return f;
 }
 
-int sd_merge(sdmerge *m)
+static inline void
+sd_vlogfile_free(sdvlog *l, sr *r, sdvlogfile *f)
 {
-	if (ssunlikely(! ss_iterhas(sv_writeiter, &m->i)))
+	ss_listunlink(&f->link);
+	l->count--;
+	if (f->gc)
+		l->gc_count--;
+	ss_fileclose(&f->file);
+	ss_free(r->a, f);
+}
+
+static inline int
+sd_vlogfile_gc(sdvlog *l, sr *r, sdvlogfile *f)
+{
+	/* remove the file once it is not referenced by any
+	 * node, reader or node builder */
+	if (! l->online || f->live > 0 || f->refs > 0 || f == l->current)
 		return 0;
-	sdmergeconf *conf = m->conf;
-	sd_indexinit(&m->index);
-	sd_buildindex_reset(m->build_index);
-	int rc = sd_buildindex_begin(m->build_index);
-	if (ssunlikely(rc == -1))
+	int rc = ss_vfsunlink(r->vfs, ss_pathof(&f->file.path));
+	if (ssunlikely(rc == -1)) {
+		sr_malfunction(r->e, "value log file '%s' unlink error: %s",
+		               ss_pathof(&f->file.path),
+		               strerror(errno));
 		return -1;
-	m->current = 0;
-	m->limit   = 0;
-	uint64_t processed = m->processed;
-	uint64_t left = (conf->size_stream - processed);
-	if (left >= (conf->size_node * 2)) {
-		m->limit = conf->size_node;
-	} else
-	if (left > (conf->size_node)) {
-		m->limit = conf->size_node * 2;
-	} else {
-		m->limit = UINT64_MAX;
 	}
-	return sd_mergehas(m);
+	sd_vlogfile_free(l, r, f);
+	return 0;
 }
 
-int sd_mergepage(sdmerge *m, uint64_t offset)
+static inline int
+sd_vlogrotate(sdvlog *l, sr *r)
 {
-	sdmergeconf *conf = m->conf;
-	sd_buildreset(m->build);
-	if (m->resume) {
-		m->resume = 0;
-		if (ssunlikely(! sv_writeiter_resume(&m->i)))
-			return 0;
-	}
-	if (! sd_mergehas(m))
+	sdvlogfile *prev = l->current;
+	if (sslikely(prev && prev->file.size < l->size_file))
 		return 0;
-	int rc;
-	rc = sd_buildbegin(m->build, m->r, conf->checksum,
-	                   conf->compression,
-	                   conf->compression_if);
-	if (ssunlikely(rc == -1))
+	sdvlogfile *f = sd_vlogfile_new(l, r, l->seq + 1);
+	if (ssunlikely(f == NULL))
+		return sr_oom_malfunction(r->e);
+	sspath path;
+	ss_path(&path, l->path, f->id, ".vlog");
+	int rc = ss_filenew(&f->file, path.path, 0);
+	if (ssunlikely(rc == -1)) {
+		sr_malfunction(r->e, "value log file '%s' create error: %s",
+		               path.path, strerror(errno));
+		sd_vlogfile_free(l, r, f);
 		return -1;
-	while (ss_iterhas(sv_writeiter, &m->i))
-	{
-		char *v = ss_iterof(sv_writeiter, &m->i);
-		uint8_t flags = sf_flags(m->r->scheme, v);
-		if (sv_writeiter_is_duplicate(&m->i))
-			flags |= SVDUP;
-		rc = sd_buildadd(m->build, m->r, v, flags);
-		if (ssunlikely(rc == -1))
-			return -1;
-		ss_iternext(sv_writeiter, &m->i);
 	}
-	rc = sd_buildend(m->build, m->r);
-	if (ssunlikely(rc == -1))
-		return -1;
-	rc = sd_buildindex_add(m->build_index, m->r, m->build, offset);
-	if (ssunlikely(rc == -1))
-		return -1;
-	m->current = m->build_index->build.total;
-	m->resume  = 1;
-	return 1;
+	l->current = f;
+	if (prev == NULL)
+		return 0;
+	return sd_vlogfile_gc(l, r, prev);
 }
 
-int sd_mergeend(sdmerge *m, uint64_t offset)
+static inline int
+sd_vlogprocess(char *name, uint32_t *id)
 {
-	m->processed += m->build_index->build.total;
-	uint32_t align = 0;
-	if (m->conf->direct_io)
-		align = m->conf->direct_io_page_size;
-	int rc = sd_buildindex_end(m->build_index, m->r, align, offset);
-	if (ssunlikely(rc == -1))
+	/* id.vlog */
+	char *s = name;
+	uint64_t v = 0;
+	while (isdigit(*s)) {
+		v = (v * 10) + *s - '0';
+		s++;
+	}
+	if (ssunlikely(s == name || v == 0 || v > UINT32_MAX))
 		return -1;
-	rc = sd_indexcopy_buf(&m->index, m->r,
-	                      &m->build_index->v,
-	                      &m->build_index->m);
-	if (ssunlikely(rc == -1))
+	if (strcmp(s, ".vlog") != 0)
 		return -1;
+	*id = v;
 	return 0;
 }
-#line 1 "sophia/database/sd_pageiter.c"
-
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
-
 
-
-
-
-
-
-ssiterif sd_pageiter =
+int sd_vlogopen(sdvlog *l, sr *r, char *path, uint64_t size_file, int sync)
 {
-	.close   = sd_pageiter_close,
-	.has     = sd_pageiter_has,
-	.of      = sd_pageiter_of,
-	.next    = sd_pageiter_next
-};
-#line 1 "sophia/database/sd_read.c"
+	l->path      = path;
+	l->size_file = size_file;
+	l->sync      = sync;
+	DIR *dir = opendir(path);
+	if (ssunlikely(dir == NULL)) {
+		sr_malfunction(r->e, "directory '%s' open error: %s",
+		               path, strerror(errno));
+		return -1;
+	}
+	/* new documents are always written to a new file */
+	struct dirent *de;
+	while ((de = readdir(dir))) {
+		uint32_t id;
+		if (sd_vlogprocess(de->d_name, &id) == -1)
+			continue;
+		sdvlogfile *f = sd_vlogfile_new(l, r, id);
+		if (ssunlikely(f == NULL)) {
+			closedir(dir);
+			return sr_oom_malfunction(r->e);
+		}
+		sspath file;
+		ss_path(&file, path, id, ".vlog");
+		int rc = ss_fileopen(&f->file, file.path, 0);
+		if (ssunlikely(rc == -1)) {
+			sr_malfunction(r->e, "value log file '%s' open error: %s",
+			               file.path, strerror(errno));
+			closedir(dir);
+			return -1;
+		}
+		f->synced = f->file.size;
+	}
+	closedir(dir);
+	return 0;
+}
 
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
+int sd_vlogonline(sdvlog *l, sr *r)
+{
+	/* remove files left unreferenced by the recovered
+	 * nodes */
+	ss_mutexlock(&l->lock);
+	l->online = 1;
+	int rc = 0;
+	sslist *i, *n;
+	ss_listforeach_safe(&l->list, i, n) {
+		sdvlogfile *f = sscast(i, sdvlogfile, link);
+		rc = sd_vlogfile_gc(l, r, f);
+		if (ssunlikely(rc == -1))
+			break;
+	}
+	ss_mutexunlock(&l->lock);
+	return rc;
+}
 
+void sd_vlogfree(sdvlog *l, sr *r)
+{
+	sslist *i, *n;
+	ss_listforeach_safe(&l->list, i, n) {
+		sdvlogfile *f = sscast(i, sdvlogfile, link);
+		sd_vlogfile_free(l, r, f);
+	}
+	l->current = NULL;
+	l->online  = 0;
+	ss_mutexfree(&l->lock);
+}
 
+int sd_vlogref(sdvlog *l, sr *r, sdindex *i)
+{
+	sdindexvlog *v = sd_indexvlog(i);
+	if (sslikely(v == NULL))
+		return 0;
+	ss_mutexlock(&l->lock);
+	uint32_t pos = 0;
+	for (; pos < v->count; pos++) {
+		sdindexvlogref *ref = sd_indexvlog_ref(v, pos);
+		sdvlogfile *f = sd_vlogfind(l, ref->id);
+		if (ssunlikely(f == NULL)) {
+			ss_mutexunlock(&l->lock);
+			sr_malfunction(r->e, "value log file '%s/%020" PRIu32 ".vlog' "
+			               "is missing", l->path, ref->id);
+			return -1;
+		}
+		f->live += ref->size;
+	}
+	ss_mutexunlock(&l->lock);
+	return 0;
+}
 
+int sd_vlogunref(sdvlog *l, sr *r, sdindex *i)
+{
+	sdindexvlog *v = sd_indexvlog(i);
+	if (sslikely(v == NULL))
+		return 0;
+	int rc = 0;
+	ss_mutexlock(&l->lock);
+	uint32_t pos = 0;
+	for (; pos < v->count; pos++) {
+		sdindexvlogref *ref = sd_indexvlog_ref(v, pos);
+		sdvlogfile *f = sd_vlogfind(l, ref->id);
+		if (ssunlikely(f == NULL))
+			continue;
+		assert(f->live >= ref->size);
+		f->live -= ref->size;
+		if (sd_vlogfile_gc(l, r, f) == -1)
+			rc = -1;
+	}
+	ss_mutexunlock(&l->lock);
+	return rc;
+}
 
+int sd_vlogunpin(sdvlog *l, sr *r, ssbuf *entries)
+{
+	int rc = 0;
+	ss_mutexlock(&l->lock);
+	sdindexvlogref *ref = (sdindexvlogref*)entries->s;
+	sdindexvlogref *end = (sdindexvlogref*)entries->p;
+	for (; ref < end; ref++) {
+		sdvlogfile *f = sd_vlogfind(l, ref->id);
+		assert(f != NULL && f->refs > 0);
+		f->refs--;
+		if (sd_vlogfile_gc(l, r, f) == -1)
+			rc = -1;
+	}
+	ss_mutexunlock(&l->lock);
+	ss_bufreset(entries);
+	return rc;
+}
 
+static inline sdindexvlogref*
+sd_vlogentry(ssbuf *entries, uint32_t id)
+{
+	sdindexvlogref *ref = (sdindexvlogref*)entries->s;
+	sdindexvlogref *end = (sdindexvlogref*)entries->p;
+	for (; ref < end; ref++)
+		if (ref->id == id)
+			return ref;
+	return NULL;
+}
 
+static inline int
+sd_vlogentry_add(sr *r, ssbuf *entries, sdvlogfile *f,
+                 uint64_t size, uint64_t end)
+{
+	/* the file stays pinned until the node which
+	 * references it is complete */
+	sdindexvlogref ref = {
+		.id   = f->id,
+		.size = size,
+		.end  = end
+	};
+	int rc = ss_bufadd(entries, r->a, &ref, sizeof(ref));
+	if (ssunlikely(rc == -1))
+		return sr_oom_malfunction(r->e);
+	f->refs++;
+	return 0;
+}
 
-ssiterif sd_read =
+static inline void
+sd_vlogentry_update(sdindexvlogref *ref, uint64_t size, uint64_t end)
 {
-	.close = sd_read_close,
-	.has   = sd_read_has,
-	.of    = sd_read_of,
-	.next  = sd_read_next
-};
-#line 1 "sophia/database/sd_scheme.c"
+	ref->size += size;
+	if (end > ref->end)
+		ref->end = end;
+}
 
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
+int sd_vlogwrite(sdvlog *l, sr *r, char *v, ssbuf *dest, ssbuf *entries)
+{
+	sfscheme *s = r->scheme;
+	uint32_t size = s->var_offset + sizeof(sfvar) * s->var_count;
+	int i = 0;
+	while (i < s->fields_count) {
+		sffield *f = s->fields[i];
+		i++;
+		if (f->fixed_size)
+			continue;
+		if (sd_vlogfield(f))
+			size += sizeof(sdvlogref);
+		else
+			size += sf_var(s, f->position_ref, v)->size;
+	}
+	ss_bufreset(dest);
+	int rc = ss_bufensure(dest, r->a, size);
+	if (ssunlikely(rc == -1))
+		return sr_oom_malfunction(r->e);
+	memcpy(dest->s, v, s->var_offset);
+	char *p = dest->s + s->var_offset + sizeof(sfvar) * s->var_count;
 
+	/* reserve space in the current file and pin it */
+	uint32_t written = sd_vlogsize(s, v);
+	ss_mutexlock(&l->lock);
+	rc = sd_vlogrotate(l, r);
+	if (ssunlikely(rc == -1)) {
+		ss_mutexunlock(&l->lock);
+		return -1;
+	}
+	sdvlogfile *file = l->current;
+	uint64_t offset = file->file.size;
+	sdindexvlogref *entry = sd_vlogentry(entries, file->id);
+	if (entry) {
+		sd_vlogentry_update(entry, written, offset + written);
+	} else {
+		rc = sd_vlogentry_add(r, entries, file, written, offset + written);
+		if (ssunlikely(rc == -1)) {
+			ss_mutexunlock(&l->lock);
+			return -1;
+		}
+	}
+	file->file.size += written;
+	file->writers++;
+	ss_mutexunlock(&l->lock);
 
+	/* write values outside of the lock */
+	i = 0;
+	while (i < s->fields_count) {
+		sffield *f = s->fields[i];
+		i++;
+		if (f->fixed_size)
+			continue;
+		sfvar *var = sf_var(s, f->position_ref, dest->s);
+		uint32_t fsize;
+		char *ptr = sf_fieldptr(s, f, v, &fsize);
+		if (! sd_vlogfield(f)) {
+			memcpy(p, ptr, fsize);
+			var->size = fsize;
+			p += fsize;
+			continue;
+		}
+		sdvlogref ref = {
+			.id     = file->id,
+			.size   = fsize,
+			.offset = offset
+		};
+		if (fsize > 0) {
+			rc = ss_filepwrite(&file->file, offset, ptr, fsize);
+			if (ssunlikely(rc == -1)) {
+				sr_malfunction(r->e, "value log file '%s' write error: %s",
+				               ss_pathof(&file->file.path),
+				               strerror(errno));
+				break;
+			}
+		}
+		offset += fsize;
+		memcpy(p, &ref, sizeof(ref));
+		var->size = sizeof(ref);
+		p += sizeof(ref);
+	}
+	ss_mutexlock(&l->lock);
+	file->writers--;
+	ss_mutexunlock(&l->lock);
+	if (ssunlikely(rc == -1))
+		return -1;
+	ss_bufadvance(dest, size);
+	return 0;
+}
 
+int sd_vlogtrack(sdvlog *l, sr *r, char *v, ssbuf *entries)
+{
+	/* account references of a document which is
+	 * already separated */
+	sfscheme *s = r->scheme;
+	int i = 0;
+	while (i < s->fields_count) {
+		sffield *f = s->fields[i];
+		i++;
+		if (! sd_vlogfield(f))
+			continue;
+		uint32_t fsize;
+		sdvlogref ref;
+		memcpy(&ref, sf_fieldptr(s, f, v, &fsize), sizeof(ref));
+		sdindexvlogref *entry = sd_vlogentry(entries, ref.id);
+		if (sslikely(entry)) {
+			sd_vlogentry_update(entry, ref.size, ref.offset + ref.size);
+			continue;
+		}
+		ss_mutexlock(&l->lock);
+		sdvlogfile *file = sd_vlogfind(l, ref.id);
+		if (ssunlikely(file == NULL)) {
+			ss_mutexunlock(&l->lock);
+			sr_malfunction(r->e, "value log file '%s/%020" PRIu32 ".vlog' "
+			               "is missing", l->path, ref.id);
+			return -1;
+		}
+		int rc = sd_vlogentry_add(r, entries, file, ref.size,
+		                          ref.offset + ref.size);
+		ss_mutexunlock(&l->lock);
+		if (ssunlikely(rc == -1))
+			return -1;
+	}
+	return 0;
+}
 
+static inline int
+sd_vlogpread(sdvlog *l, sr *r, sdvlogref *ref, char *dest)
+{
+	ss_mutexlock(&l->lock);
+	sdvlogfile *f = sd_vlogfind(l, ref->id);
+	if (ssunlikely(f == NULL)) {
+		ss_mutexunlock(&l->lock);
+		sr_malfunction(r->e, "value log file '%s/%020" PRIu32 ".vlog' "
+		               "is missing", l->path, ref->id);
+		return -1;
+	}
+	f->refs++;
+	ss_mutexunlock(&l->lock);
 
+	uint64_t start = ss_utime();
+	int rc = ss_filepread(&f->file, ref->offset, dest, ref->size);
+	if (ssunlikely(rc == -1))
+		sr_error(r->e, "value log file '%s' read error: %s",
+		         ss_pathof(&f->file.path),
+		         strerror(errno));
+	else
+		sr_statpread(r->stat, start, 0);
 
+	ss_mutexlock(&l->lock);
+	f->refs--;
+	if (sd_vlogfile_gc(l, r, f) == -1)
+		rc = -1;
+	ss_mutexunlock(&l->lock);
+	return rc == -1 ? -1 : 0;
+}
 
-int sd_schemebegin(sdscheme *c, sr *r)
+static inline int
+sd_vlogbuild(sdvlog *l, sr *r, char *v, ssbuf *dest)
 {
-	int rc = ss_bufensure(&c->buf, r->a, sizeof(sdschemeheader));
+	/* rebuild the document with its values read from the
+	 * value log, or left empty */
+	sfscheme *s = r->scheme;
+	uint32_t size = s->var_offset + sizeof(sfvar) * s->var_count;
+	int i = 0;
+	while (i < s->fields_count) {
+		sffield *f = s->fields[i];
+		i++;
+		if (f->fixed_size)
+			continue;
+		if (! sd_vlogfield(f)) {
+			size += sf_var(s, f->position_ref, v)->size;
+			continue;
+		}
+		if (l) {
+			sdvlogref ref;
+			uint32_t fsize;
+			memcpy(&ref, sf_fieldptr(s, f, v, &fsize), sizeof(ref));
+			size += ref.size;
+		}
+	}
+	ss_bufreset(dest);
+	int rc = ss_bufensure(dest, r->a, size);
 	if (ssunlikely(rc == -1))
 		return sr_oom(r->e);
-	sdschemeheader *h = (sdschemeheader*)c->buf.s;
-	memset(h, 0, sizeof(sdschemeheader));
-	ss_bufadvance(&c->buf, sizeof(sdschemeheader));
+	memcpy(dest->s, v, s->var_offset);
+	sf_flagsset(s, dest->s, sf_flags(s, v) & ~SVVLOG);
+	char *p = dest->s + s->var_offset + sizeof(sfvar) * s->var_count;
+	i = 0;
+	while (i < s->fields_count) {
+		sffield *f = s->fields[i];
+		i++;
+		if (f->fixed_size)
+			continue;
+		sfvar *var = sf_var(s, f->position_ref, dest->s);
+		uint32_t fsize;
+		char *ptr = sf_fieldptr(s, f, v, &fsize);
+		if (! sd_vlogfield(f)) {
+			memcpy(p, ptr, fsize);
+			var->size = fsize;
+			p += fsize;
+			continue;
+		}
+		var->size = 0;
+		if (l == NULL)
+			continue;
+		sdvlogref ref;
+		memcpy(&ref, ptr, sizeof(ref));
+		if (ref.size > 0) {
+			rc = sd_vlogpread(l, r, &ref, p);
+			if (ssunlikely(rc == -1))
+				return -1;
+		}
+		var->size = ref.size;
+		p += ref.size;
+	}
+	ss_bufadvance(dest, size);
 	return 0;
 }
 
-int sd_schemeadd(sdscheme *c, sr *r, uint8_t id, sstype type,
-                 void *value, uint32_t size)
+int sd_vlogread(sdvlog *l, sr *r, char *v, ssbuf *dest)
 {
-	sdschemeopt opt = {
-		.type = type,
-		.id   = id,
-		.size = size
-	};
-	int rc = ss_bufadd(&c->buf, r->a, &opt, sizeof(opt));
-	if (ssunlikely(rc == -1))
-		goto error;
-	rc = ss_bufadd(&c->buf, r->a, value, size);
-	if (ssunlikely(rc == -1))
-		goto error;
-	sdschemeheader *h = (sdschemeheader*)c->buf.s;
-	h->count++;
-	return 0;
-error:
-	return sr_oom(r->e);
+	return sd_vlogbuild(l, r, v, dest);
 }
 
-int sd_schemecommit(sdscheme *c, sr *r)
+int sd_vlogkeys(sr *r, char *v, ssbuf *dest)
 {
-	if (ssunlikely(ss_bufused(&c->buf) == 0))
-		return 0;
-	sdschemeheader *h = (sdschemeheader*)c->buf.s;
-	h->size = ss_bufused(&c->buf) - sizeof(sdschemeheader);
-	h->crc  = ss_crcs(r->crc, (char*)h, ss_bufused(&c->buf), 0);
-	return 0;
+	return sd_vlogbuild(NULL, r, v, dest);
 }
 
-int sd_schemewrite(sdscheme *c, sr *r, char *path, int sync)
+int sd_vlogsync(sdvlog *l, sr *r, sdindex *i)
 {
-	ssfile meta;
-	ss_fileinit(&meta, r->vfs);
-	int rc = ss_filenew(&meta, path, 0);
-	if (ssunlikely(rc == -1))
-		goto error;
-	rc = ss_filewrite(&meta, c->buf.s, ss_bufused(&c->buf));
-	if (ssunlikely(rc == -1))
-		goto error;
-	if (sync) {
-		rc = ss_filesync(&meta);
+	/* sync values referenced by the node, unless they
+	 * were already synced for another node */
+	sdindexvlog *v = sd_indexvlog(i);
+	if (! l->sync || sslikely(v == NULL))
+		return 0;
+	uint32_t pos = 0;
+	for (; pos < v->count; pos++) {
+		sdindexvlogref *ref = sd_indexvlog_ref(v, pos);
+		ss_mutexlock(&l->lock);
+		sdvlogfile *f = sd_vlogfind(l, ref->id);
+		if (ssunlikely(f == NULL)) {
+			ss_mutexunlock(&l->lock);
+			sr_malfunction(r->e, "value log file '%s/%020" PRIu32 ".vlog' "
+			               "is missing", l->path, ref->id);
+			return -1;
+		}
+		if (f->synced >= ref->end) {
+			ss_mutexunlock(&l->lock);
+			continue;
+		}
+		f->refs++;
+		ss_mutexunlock(&l->lock);
+		int rc = ss_filesync(&f->file);
 		if (ssunlikely(rc == -1))
-			goto error;
+			sr_malfunction(r->e, "value log file '%s' sync error: %s",
+			               ss_pathof(&f->file.path),
+			               strerror(errno));
+		ss_mutexlock(&l->lock);
+		if (sslikely(rc == 0) && ref->end > f->synced)
+			f->synced = ref->end;
+		f->refs--;
+		if (sd_vlogfile_gc(l, r, f) == -1)
+			rc = -1;
+		ss_mutexunlock(&l->lock);
+		if (ssunlikely(rc == -1))
+			return -1;
 	}
-	ss_fileadvise(&meta, 0, 0, meta.size);
-	rc = ss_fileclose(&meta);
-	if (ssunlikely(rc == -1))
-		goto error;
 	return 0;
-error:
-	sr_error(r->e, "scheme file '%s' error: %s",
-	         path, strerror(errno));
-	ss_fileclose(&meta);
-	return -1;
 }
 
-int sd_schemerecover(sdscheme *c, sr *r, char *path)
+int sd_vlogmark(sdvlog *l, uint32_t wm)
 {
-	ssize_t size = ss_vfssize(r->vfs, path);
-	if (ssunlikely(size == -1))
-		goto error;
-	if (ssunlikely((unsigned int)size < sizeof(sdschemeheader))) {
-		sr_error(r->e, "scheme file '%s' is corrupted", path);
-		return -1;
+	/* mark files which have wm percent of garbage or
+	 * more for gc */
+	ss_mutexlock(&l->lock);
+	sslist *i;
+	ss_listforeach(&l->list, i) {
+		sdvlogfile *f = sscast(i, sdvlogfile, link);
+		if (f->gc || f == l->current || f->file.size == 0)
+			continue;
+		uint64_t garbage = 0;
+		if (f->live < f->file.size)
+			garbage = f->file.size - f->live;
+		if ((garbage * 100) / f->file.size >= wm) {
+			f->gc = 1;
+			l->gc_count++;
+		}
 	}
-	int rc = ss_bufensure(&c->buf, r->a, size);
+	uint32_t count = l->gc_count;
+	ss_mutexunlock(&l->lock);
+	return count;
+}
+
+int sd_vloggc(sdvlog *l, sr *r, char *v)
+{
+	/* document references a file marked for gc */
+	if (sslikely(l->gc_count == 0))
+		return 0;
+	sfscheme *s = r->scheme;
+	int match = 0;
+	ss_mutexlock(&l->lock);
+	int i = 0;
+	while (i < s->fields_count && !match) {
+		sffield *f = s->fields[i];
+		i++;
+		if (! sd_vlogfield(f))
+			continue;
+		uint32_t fsize;
+		sdvlogref ref;
+		memcpy(&ref, sf_fieldptr(s, f, v, &fsize), sizeof(ref));
+		sdvlogfile *file = sd_vlogfind(l, ref.id);
+		match = file && file->gc;
+	}
+	ss_mutexunlock(&l->lock);
+	return match;
+}
+
+int sd_vloggc_index(sdvlog *l, sdindex *i)
+{
+	/* node references a file marked for gc */
+	sdindexvlog *v = sd_indexvlog(i);
+	if (sslikely(v == NULL))
+		return 0;
+	int match = 0;
+	ss_mutexlock(&l->lock);
+	uint32_t pos = 0;
+	for (; pos < v->count && !match; pos++) {
+		sdindexvlogref *ref = sd_indexvlog_ref(v, pos);
+		sdvlogfile *f = sd_vlogfind(l, ref->id);
+		match = f && f->gc;
+	}
+	ss_mutexunlock(&l->lock);
+	return match;
+}
+
+static inline int
+sd_vlogcopy_file(sdvlogfile *f, sr *r, char *path, uint64_t size, ssbuf *buf)
+{
+	ss_bufreset(buf);
+	int rc = ss_bufensure(buf, r->a, SR_RATE_CHUNK);
 	if (ssunlikely(rc == -1))
 		return sr_oom(r->e);
-	ssfile meta;
-	ss_fileinit(&meta, r->vfs);
-	rc = ss_fileopen(&meta, path, 0);
-	if (ssunlikely(rc == -1))
-		goto error;
-	rc = ss_filepread(&meta, 0, c->buf.s, size);
-	if (ssunlikely(rc == -1))
-		goto error;
-	rc = ss_fileclose(&meta);
-	if (ssunlikely(rc == -1))
-		goto error;
-	ss_bufadvance(&c->buf, size);
+	ssfile file;
+	ss_fileinit(&file, r->vfs);
+	rc = ss_filenew(&file, path, 0);
+	if (ssunlikely(rc == -1)) {
+		sr_error(r->e, "backup value log file '%s' create error: %s",
+		         path, strerror(errno));
+		return -1;
+	}
+	uint64_t pos = 0;
+	while (pos < size) {
+		uint64_t chunk = size - pos;
+		if (chunk > SR_RATE_CHUNK)
+			chunk = SR_RATE_CHUNK;
+		rc = ss_filepread(&f->file, pos, buf->s, chunk);
+		if (ssunlikely(rc == -1)) {
+			sr_error(r->e, "backup value log file '%s' read error: %s",
+			         ss_pathof(&f->file.path), strerror(errno));
+			ss_fileclose(&file);
+			return -1;
+		}
+		rc = ss_filewrite(&file, buf->s, chunk);
+		if (ssunlikely(rc == -1)) {
+			sr_error(r->e, "backup value log file '%s' write error: %s",
+			         path, strerror(errno));
+			ss_fileclose(&file);
+			return -1;
+		}
+		sr_ratewait(r->rate, chunk);
+		pos += chunk;
+	}
+	ss_fileadvise(&file, SS_ADVISE_DONTNEED, 0, file.size);
+	rc = ss_fileclose(&file);
+	if (ssunlikely(rc == -1)) {
+		sr_error(r->e, "backup value log file '%s' close error: %s",
+		         path, strerror(errno));
+		return -1;
+	}
 	return 0;
-error:
-	sr_error(r->e, "scheme file '%s' error: %s",
-	         path, strerror(errno));
-	return -1;
 }
-#line 1 "sophia/database/sd_schemeiter.c"
-
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
-
-
-
 
+int sd_vlogcopy(sdvlog *l, sr *r, sdindex *i, char *dir, char *name,
+                uint32_t bsn, ssbuf *buf)
+{
+	/* copy files referenced by the node, unless they were
+	 * already copied far enough by this backup. Files
+	 * which are not written anymore are linked by an
+	 * incremental backup */
+	sdindexvlog *v = sd_indexvlog(i);
+	if (sslikely(v == NULL))
+		return 0;
+	uint32_t pos = 0;
+	for (; pos < v->count; pos++) {
+		sdindexvlogref *ref = sd_indexvlog_ref(v, pos);
+		ss_mutexlock(&l->lock);
+		sdvlogfile *f = sd_vlogfind(l, ref->id);
+		if (ssunlikely(f == NULL)) {
+			ss_mutexunlock(&l->lock);
+			sr_malfunction(r->e, "value log file '%s/%020" PRIu32 ".vlog' "
+			               "is missing", l->path, ref->id);
+			return -1;
+		}
+		if (f->backup == bsn && f->backup_size >= ref->end) {
+			ss_mutexunlock(&l->lock);
+			continue;
+		}
+		/* values of a reserved range can still be written
+		 * by a builder */
+		uint64_t size = f->file.size;
+		if (f->writers > 0)
+			size = ref->end;
+		int sealed = f != l->current;
+		f->refs++;
+		ss_mutexunlock(&l->lock);
 
+		sspath path;
+		ss_path(&path, dir, f->id, ".vlog");
+		int linked = sealed &&
+		             sr_backuplink(r->backup, r->vfs,
+		                           ss_pathof(&f->file.path), path.path);
+		int rc = 0;
+		if (! linked)
+			rc = sd_vlogcopy_file(f, r, path.path, size, buf);
+		if (sslikely(rc == 0)) {
+			rc = sr_backupadd(r->backup, r->a, name, path.path, size, linked);
+			if (ssunlikely(rc == -1))
+				sr_oom(r->e);
+		}
 
+		ss_mutexlock(&l->lock);
+		if (sslikely(rc == 0)) {
+			f->backup = bsn;
+			f->backup_size = size;
+		}
+		f->refs--;
+		if (sd_vlogfile_gc(l, r, f) == -1)
+			rc = -1;
+		ss_mutexunlock(&l->lock);
+		if (ssunlikely(rc == -1))
+			return -1;
+	}
+	return 0;
+}
 
-ssiterif sd_schemeiter =
+void sd_vlogstat(sdvlog *l, uint32_t *count, uint64_t *size, uint64_t *live)
 {
-	.close   = sd_schemeiter_close,
-	.has     = sd_schemeiter_has,
-	.of      = sd_schemeiter_of,
-	.next    = sd_schemeiter_next
-};
+	*count = 0;
+	*size  = 0;
+	*live  = 0;
+	ss_mutexlock(&l->lock);
+	sslist *i;
+	ss_listforeach(&l->list, i) {
+		sdvlogfile *f = sscast(i, sdvlogfile, link);
+		*size += f->file.size;
+		*live += f->live;
+	}
+	*count = l->count;
+	ss_mutexunlock(&l->lock);
+}
 #line 1 "sophia/database/sd_write.c"
 
 /*
@@ -21814,11 +27668,16 @@ struct sicompaction {
 	uint64_t node_size;
 	uint32_t node_page_size;
 	uint32_t node_page_checksum;
+	uint32_t node_page_prefix;
+	uint32_t bloom_bits_per_key;
 	uint32_t expire_period;
 	uint64_t expire_period_us;
+	uint32_t expire_wm;
 	uint32_t gc_period;
 	uint64_t gc_period_us;
 	uint32_t gc_wm;
+	uint32_t weight;
+	uint32_t workers;
 };
 
 struct sischeme {
@@ -21836,8 +27695,14 @@ struct sischeme {
 	uint32_t      compression;
 	char         *compression_sz;
 	ssfilterif   *compression_if;
+	ssdictset     compression_dict;
+	uint32_t      compression_dict_size;
+	uint32_t      value_log_threshold;
 	uint32_t      buf_gc_wm;
+	uint32_t      memtable;
+	char         *memtable_sz;
 	sfupsert      upsert;
+	char         *upsert_sz;
 	sfscheme      scheme;
 	srversion     version;
 	srversion     version_storage;
@@ -21881,9 +27746,11 @@ struct sinode {
 	uint16_t   flags;
 	uint64_t   used;
 	uint32_t   backup;
+	uint64_t   rangelsn;
 	uint16_t   refs;
 	ssspinlock reflock;
 	sdindex    index;
+	sdvlog    *vlog;
 	svindex    i0, i1;
 	ssfile     file;
 	ssmmap     map, map_swap;
@@ -21893,7 +27760,7 @@ struct sinode {
 	sslist     commit;
 } sspacked;
 
-sinode *si_nodenew(sr*, uint64_t, uint64_t);
+sinode *si_nodenew(sr*, sischeme*, uint64_t, uint64_t);
 int si_nodeopen(sinode*, sr*, sischeme*, sspath*);
 int si_nodecreate(sinode*, sr*, sischeme*);
 int si_nodefree(sinode*, sr*, int);
@@ -21959,7 +27826,7 @@ si_nodeunrotate(sinode *node) {
 	assert((node->flags & SI_ROTATE) > 0);
 	node->flags &= ~SI_ROTATE;
 	node->i0 = node->i1;
-	sv_indexinit(&node->i1);
+	sv_indexinit(&node->i1, node->i0.type);
 }
 
 static inline svindex*
@@ -22079,6 +27946,7 @@ struct siplanner {
 #define SI_NODEGC     16
 #define SI_BACKUP     32
 #define SI_BACKUPEND  64
+#define SI_RANGE      128
 
 struct siplan {
 	int plan;
@@ -22089,9 +27957,13 @@ struct siplan {
 	 *   b: percent
 	 * expire:
 	 *   a: ttl
+	 *   b: drop node
 	 * nodegc:
 	 * backup:
 	 *   a: bsn
+	 * range:
+	 *   a: lsn
+	 *   b: drop node
 	 */
 	uint64_t a, b, c;
 	sinode *node;
@@ -22103,6 +27975,7 @@ int si_plannerfree(siplanner*, ssa*);
 int si_plannertrace(siplan*, uint32_t, sstrace*);
 int si_plannerupdate(siplanner*, sinode*);
 int si_plannerremove(siplanner*, sinode*);
+uint32_t si_plannerbacklog(siplanner*);
 siplannerrc
 si_planner(siplanner*, siplan*);
 
@@ -22129,8 +28002,12 @@ struct si {
 	uint32_t   backup;
 	uint64_t   read_disk;
 	uint64_t   read_cache;
+	uint64_t   bloom_skip;
+	uint64_t   bloom_false_positive;
 	uint32_t   gc_count;
 	sslist     gc;
+	sdvlog     vlog;
+	svrangeset *ranges;
 	sdc        rdc;
 	sischeme   scheme;
 	so        *object;
@@ -22159,7 +28036,7 @@ si_scheme(si *i) {
 }
 
 si *si_init(sr*, so*);
-int si_open(si*);
+int si_open(si*, ssjobq*);
 int si_close(si*);
 int si_insert(si*, sinode*);
 int si_remove(si*, sinode*);
@@ -22167,6 +28044,7 @@ int si_replace(si*, sinode*, sinode*);
 int si_execute(si*, sdc*, siplan*, uint64_t);
 siplannerrc
 si_plan(si*, siplan*);
+uint32_t si_planbacklog(si*);
 
 #endif
 #line 1 "sophia/index/si_gc.h"
@@ -22193,6 +28071,41 @@ si_gcvall(sr *r, svv *v)
 	}
 }
 
+#endif
+#line 1 "sophia/index/si_range.h"
+#ifndef SI_RANGE_H_
+#define SI_RANGE_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+int si_rangeadd(si*, svv*, svv*);
+int si_rangeretire(si*, uint64_t*, int);
+void si_rangefree(si*);
+
+static inline svrangeset*
+si_rangeref(si *i)
+{
+	/* called under index lock */
+	svrangeset *s = i->ranges;
+	if (s)
+		s->refs++;
+	return s;
+}
+
+void si_rangeunref(si*, svrangeset*);
+
+static inline uint32_t
+si_rangecount(si *i)
+{
+	return i->ranges ? i->ranges->count : 0;
+}
+
 #endif
 #line 1 "sophia/index/si_cache.h"
 #ifndef SI_CACHE_H_
@@ -22212,6 +28125,10 @@ typedef struct sicachepool sicachepool;
 struct sicache {
 	uint64_t     nsn;
 	int          open;
+	int          readahead;
+	int          keys_only;
+	int          reads;
+	int          reads_cache;
 	sinode      *node;
 	sdindexpage *ref;
 	sdpage       page;
@@ -22227,6 +28144,7 @@ struct sicache {
 struct sicachepool {
 	sicache *head;
 	int n;
+	sdpagecache *page_cache;
 	sr *r;
 };
 
@@ -22238,6 +28156,10 @@ si_cacheinit(sicache *c, sicachepool *pool)
 	c->next = NULL;
 	c->pool = pool;
 	c->open = 0;
+	c->readahead = 0;
+	c->keys_only = 0;
+	c->reads = 0;
+	c->reads_cache = 0;
 	memset(&c->i, 0, sizeof(c->i));
 	ss_iterinit(sd_read, &c->i);
 	ss_bufinit(&c->buf_a);
@@ -22261,6 +28183,10 @@ si_cachereset(sicache *c)
 	c->open   = 0;
 	c->node   = NULL;
 	c->nsn    = 0;
+	c->readahead   = 0;
+	c->keys_only   = 0;
+	c->reads       = 0;
+	c->reads_cache = 0;
 }
 
 static inline int
@@ -22275,14 +28201,17 @@ si_cachevalidate(sicache *c, sinode *n)
 	c->open = 0;
 	c->node = n;
 	c->nsn  = n->id;
+	c->reads = 0;
+	c->reads_cache = 0;
 	return 0;
 }
 
 static inline void
-si_cachepool_init(sicachepool *p, sr *r)
+si_cachepool_init(sicachepool *p, sr *r, sdpagecache *page_cache)
 {
 	p->head = NULL;
 	p->n    = 0;
+	p->page_cache = page_cache;
 	p->r    = r;
 }
 
@@ -22322,6 +28251,8 @@ static inline void
 si_cachepool_push(sicache *c)
 {
 	sicachepool *p = c->pool;
+	/* release page cache pin */
+	ss_iterclose(sd_read, &c->i);
 	c->next = p->head;
 	p->head = c;
 	p->n++;
@@ -22371,6 +28302,7 @@ si_txtrack(sitx *x, sinode *n) {
 */
 
 void si_write(sitx*, svlog*, svlogindex*, int);
+void si_writerecover(sitx*, svv*);
 
 #endif
 #line 1 "sophia/index/si_read.h"
@@ -22395,9 +28327,11 @@ struct siread {
 	char     *prefix;
 	uint32_t  prefix_size;
 	int       has;
+	int       cache_only;
 	uint64_t  vlsn;
+	svrangeset *ranges;
 	svmerge   merge;
-	int       read_start;
+	uint64_t  read_start;
 	int       read_disk;
 	int       read_cache;
 	svv      *result;
@@ -22409,11 +28343,32 @@ struct siread {
 int  si_readopen(siread*, si*, sicache*, ssorder,
                  uint64_t,
                  char*, char*,
-                 char*, uint32_t, int, int);
+                 char*, uint32_t, int, uint64_t);
 int  si_readclose(siread*);
 int  si_read(siread*);
 int  si_readcommited(si*, sr*, svv*);
 
+typedef struct sireadahead sireadahead;
+
+#define SI_READAHEAD 32
+
+struct sireadahead {
+	sinodeview view[SI_READAHEAD];
+	ssvfsio    io[SI_READAHEAD];
+	ssvfs     *vfs;
+	int        n;
+};
+
+static inline void
+si_readahead_init(sireadahead *ra)
+{
+	ra->vfs = NULL;
+	ra->n   = 0;
+}
+
+void si_readahead_add(sireadahead*, si*, sr*, char*);
+void si_readahead_submit(sireadahead*);
+
 #endif
 #line 1 "sophia/index/si_iter.h"
 #ifndef SI_ITER_H_
@@ -22545,6 +28500,27 @@ extern ssiterif si_iter;
 
 int si_backup(si*, sdc*, siplan*);
 
+#endif
+#line 1 "sophia/index/si_dict.h"
+#ifndef SI_DICT_H_
+#define SI_DICT_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+static inline int
+si_dictrequired(si *index) {
+	return index->scheme.compression_if == &ss_lz4dictfilter &&
+	       index->scheme.compression_dict.count == 0;
+}
+
+int si_dicttrain(si*, svindex*);
+
 #endif
 #line 1 "sophia/index/si_compaction.h"
 #ifndef SI_COMPACTION_H_
@@ -22559,6 +28535,42 @@ int si_backup(si*, sdc*, siplan*);
 */
 
 int si_compaction(si*, sdc*, siplan*, uint64_t);
+int si_drop(si*, sdc*, siplan*, uint64_t);
+int si_split(si*, sdc*, ssbuf*, sinode*, ssiter*, uint64_t, uint64_t,
+             uint32_t, uint64_t, svrangeset*);
+int si_splitfree(ssbuf*, sr*);
+int si_redistribute_index(si*, sr*, sdc*, sinode*);
+
+#endif
+#line 1 "sophia/index/si_load.h"
+#ifndef SI_LOAD_H_
+#define SI_LOAD_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct siload siload;
+
+struct siload {
+	si      *index;
+	sinode  *node;
+	sdc      c;
+	svindex  i;
+	svv     *last;
+	ssbuf    nodes;
+	uint64_t lsn;
+	uint64_t count;
+};
+
+int si_loadbegin(siload*, si*, uint64_t);
+int si_loadadd(siload*, svv*);
+int si_loadcommit(siload*);
+int si_loadrollback(siload*);
 
 #endif
 #line 1 "sophia/index/si_track.h"
@@ -22670,7 +28682,7 @@ si_trackremove(sitrack *t, sinode *n)
 */
 
 sinode *si_bootstrap(si*, uint64_t);
-int si_recover(si*);
+int si_recover(si*, ssjobq*);
 
 #endif
 #line 1 "sophia/index/si_profiler.h"
@@ -22697,6 +28709,13 @@ struct siprofiler {
 	uint64_t  count_dup;
 	uint64_t  read_disk;
 	uint64_t  read_cache;
+	uint64_t  bloom_skip;
+	uint64_t  bloom_false_positive;
+	uint32_t  compression_dict;
+	uint32_t  value_log_files;
+	uint64_t  value_log_size;
+	uint64_t  value_log_live;
+	uint32_t  range_deletes;
 	si       *i;
 } sspacked;
 
@@ -22781,13 +28800,18 @@ si_backupend(si *index, sdc *c, siplan *plan)
 		ss_fileclose(&file);
 		return -1;
 	}
-	ss_fileadvise(&file, 0, 0, file.size);
+	ss_fileadvise(&file, SS_ADVISE_DONTNEED, 0, file.size);
 	rc = ss_fileclose(&file);
 	if (ssunlikely(rc == -1)) {
 		sr_error(r->e, "backup db file '%s' close error: %s",
 		         dst, strerror(errno));
 		return -1;
 	}
+	/* scheme file is rewritten in place, it is always
+	 * copied */
+	rc = sr_backupadd(r->backup, r->a, index->scheme.name, dst, size, 0);
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
 
 	/* finish index backup */
 	si_lock(index);
@@ -22809,14 +28833,23 @@ int si_backup(si *index, sdc *c, siplan *plan)
 	         (uint32_t)plan->a,
 	         index->scheme.name);
 
+	/* node files are immutable, an incremental backup
+	 * links them */
+	sspath path;
+	ss_path(&path, dst, node->id, ".db");
+	int linked = sr_backuplink(r->backup, r->vfs,
+	                           ss_pathof(&node->file.path),
+	                           path.path);
+	int rc;
+	if (linked)
+		goto done;
+
 	/* read origin file */
-	int rc = si_noderead(node, r, &c->c);
+	rc = si_noderead(node, r, &c->c);
 	if (ssunlikely(rc == -1))
 		return -1;
 
 	/* copy */
-	sspath path;
-	ss_path(&path, dst, node->id, ".db");
 	ssfile file;
 	ss_fileinit(&file, r->vfs);
 	rc = ss_filenew(&file, path.path, 0);
@@ -22825,14 +28858,24 @@ int si_backup(si *index, sdc *c, siplan *plan)
 		         path.path, strerror(errno));
 		return -1;
 	}
-	rc = ss_filewrite(&file, c->c.s, node->file.size);
-	if (ssunlikely(rc == -1)) {
-		sr_error(r->e, "backup db file '%s' write error: %s",
-				 path.path, strerror(errno));
-		ss_fileclose(&file);
-		return -1;
+	/* write in chunks to let the rate limiter pace
+	 * the copy */
+	uint64_t pos = 0;
+	while (pos < node->file.size) {
+		uint64_t size = node->file.size - pos;
+		if (size > SR_RATE_CHUNK)
+			size = SR_RATE_CHUNK;
+		rc = ss_filewrite(&file, c->c.s + pos, size);
+		if (ssunlikely(rc == -1)) {
+			sr_error(r->e, "backup db file '%s' write error: %s",
+					 path.path, strerror(errno));
+			ss_fileclose(&file);
+			return -1;
+		}
+		sr_ratewait(r->rate, size);
+		pos += size;
 	}
-	ss_fileadvise(&file, 0, 0, file.size);
+	ss_fileadvise(&file, SS_ADVISE_DONTNEED, 0, file.size);
 	rc = ss_fileclose(&file);
 	if (ssunlikely(rc == -1)) {
 		sr_error(r->e, "backup db file '%s' close error: %s",
@@ -22840,6 +28883,18 @@ int si_backup(si *index, sdc *c, siplan *plan)
 		return -1;
 	}
 
+done:
+	rc = sr_backupadd(r->backup, r->a, index->scheme.name, path.path,
+	                  node->file.size, linked);
+	if (ssunlikely(rc == -1))
+		return sr_oom(r->e);
+
+	/* copy value log files referenced by the node */
+	rc = sd_vlogcopy(&index->vlog, r, &node->index, dst,
+	                 index->scheme.name, plan->a, &c->c);
+	if (ssunlikely(rc == -1))
+		return -1;
+
 	si_lock(index);
 	node->backup = plan->a;
 	si_nodeunlock(node);
@@ -22881,18 +28936,22 @@ si *si_init(sr *r, so *object)
 	si_schemeinit(&i->scheme);
 	ss_listinit(&i->link);
 	ss_listinit(&i->gc);
+	sd_vloginit(&i->vlog);
+	i->ranges     = NULL;
 	i->gc_count   = 0;
 	i->read_disk  = 0;
 	i->read_cache = 0;
+	i->bloom_skip = 0;
+	i->bloom_false_positive = 0;
 	i->backup     = 0;
 	i->n          = 0;
 	i->object     = object;
 	return i;
 }
 
-int si_open(si *i)
+int si_open(si *i, ssjobq *q)
 {
-	return si_recover(i);
+	return si_recover(i, q);
 }
 
 ss_rbtruncate(si_truncate,
@@ -22915,6 +28974,8 @@ int si_close(si *i)
 		si_truncate(i->i.root, &i->r);
 	i->i.root = NULL;
 	sd_cfree(&i->rdc, &i->r);
+	sd_vlogfree(&i->vlog, &i->r);
+	si_rangefree(i);
 	si_plannerfree(&i->p, i->r.a);
 	ss_mutexfree(&i->lock);
 	si_schemefree(&i->scheme, &i->r);
@@ -22963,6 +29024,14 @@ si_plan(si *i, siplan *plan)
 	return rc;
 }
 
+uint32_t si_planbacklog(si *i)
+{
+	si_lock(i);
+	uint32_t backlog = si_plannerbacklog(&i->p);
+	si_unlock(i);
+	return backlog;
+}
+
 int
 si_execute(si *i, sdc *c, siplan *plan, uint64_t vlsn)
 {
@@ -22971,9 +29040,15 @@ si_execute(si *i, sdc *c, siplan *plan, uint64_t vlsn)
 	case SI_CHECKPOINT:
 	case SI_COMPACTION:
 	case SI_GC:
-	case SI_EXPIRE:
 		rc = si_compaction(i, c, plan, vlsn);
 		break;
+	case SI_EXPIRE:
+	case SI_RANGE:
+		if (plan->b)
+			rc = si_drop(i, c, plan, vlsn);
+		else
+			rc = si_compaction(i, c, plan, vlsn);
+		break;
 	case SI_BACKUP:
 	case SI_BACKUPEND:
 		rc = si_backup(i, c, plan);
@@ -22989,6 +29064,126 @@ si_execute(si *i, sdc *c, siplan *plan, uint64_t vlsn)
 	sd_cgc(c, &i->r, i->scheme.buf_gc_wm);
 	return rc;
 }
+#line 1 "sophia/index/si_dict.c"
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+
+
+
+
+
+
+
+
+#define SI_DICTSAMPLES_MIN 16
+
+static inline int
+si_dictsample(si *index, svindex *vindex, ssbuf *samples, ssbuf *sizes,
+              uint64_t limit)
+{
+	sr *r = &index->r;
+	/* spread the sample over the whole index */
+	uint64_t step = 1;
+	if (vindex->used > limit)
+		step = vindex->used / limit + 1;
+	uint64_t n = 0;
+	ssiter i;
+	ss_iterinit(sv_indexiter, &i);
+	ss_iteropen(sv_indexiter, &i, r, vindex, SS_GTE, NULL);
+	while ((uint64_t)ss_bufused(samples) < limit &&
+	       ss_iterhas(sv_indexiter, &i))
+	{
+		if ((n++ % step) == 0) {
+			char *v = ss_iterof(sv_indexiter, &i);
+			uint32_t size = sf_size(r->scheme, v);
+			int rc = ss_bufadd(samples, r->a, v, size);
+			if (ssunlikely(rc == -1))
+				return sr_oom(r->e);
+			rc = ss_bufadd(sizes, r->a, &size, sizeof(size));
+			if (ssunlikely(rc == -1))
+				return sr_oom(r->e);
+		}
+		ss_iternext(sv_indexiter, &i);
+	}
+	return 0;
+}
+
+int si_dicttrain(si *index, svindex *vindex)
+{
+	sr *r = &index->r;
+	sischeme *scheme = &index->scheme;
+	uint64_t limit = (uint64_t)scheme->compression_dict_size * 64;
+	ssbuf samples, sizes, dict;
+	ss_bufinit(&samples);
+	ss_bufinit(&sizes);
+	ss_bufinit(&dict);
+
+	/* sample the index being checkpointed, or the
+	 * in-memory indexes of every node */
+	int rc = 0;
+	if (vindex) {
+		rc = si_dictsample(index, vindex, &samples, &sizes, limit);
+	} else {
+		si_lock(index);
+		ssrbnode *p = ss_rbmin(&index->i);
+		while (p && rc == 0) {
+			sinode *n = sscast(p, sinode, node);
+			rc = si_dictsample(index, &n->i0, &samples, &sizes, limit);
+			if (rc == 0)
+				rc = si_dictsample(index, &n->i1, &samples, &sizes, limit);
+			p = ss_rbnext(&index->i, p);
+		}
+		si_unlock(index);
+	}
+	if (ssunlikely(rc == -1))
+		goto done;
+	int count = ss_bufused(&sizes) / sizeof(uint32_t);
+	if (count < SI_DICTSAMPLES_MIN) {
+		rc = 1;
+		goto done;
+	}
+	rc = ss_dicttrain(r->a, &dict, samples.s, (uint32_t*)sizes.s, count,
+	                  scheme->compression_dict_size);
+	if (ssunlikely(rc == -1)) {
+		sr_oom(r->e);
+		goto done;
+	}
+
+	/* register the new version and rewrite the scheme
+	 * before any page is compressed with it */
+	ss_mutexlock(&scheme->compression_dict.lock);
+	ssdict *last = ss_dictsetlast(&scheme->compression_dict);
+	if (vindex && last) {
+		/* trained by a concurrent checkpoint */
+		ss_mutexunlock(&scheme->compression_dict.lock);
+		rc = 0;
+		goto done;
+	}
+	uint32_t id = last ? last->id + 1 : 1;
+	rc = ss_dictsetadd(&scheme->compression_dict, r->a, id,
+	                   dict.s, ss_bufused(&dict));
+	if (ssunlikely(rc == -1)) {
+		ss_mutexunlock(&scheme->compression_dict.lock);
+		sr_error(r->e, "%s", "compression dictionary limit reached");
+		goto done;
+	}
+	rc = si_schemedeploy(scheme, r);
+	ss_mutexunlock(&scheme->compression_dict.lock);
+	if (ssunlikely(rc == -1))
+		sr_malfunction_set(r->e);
+done:
+	ss_buffree(&samples, r->a);
+	ss_buffree(&sizes, r->a);
+	ss_buffree(&dict, r->a);
+	return rc;
+}
 #line 1 "sophia/index/si_compaction.c"
 
 /*
@@ -23007,12 +29202,33 @@ si_execute(si *i, sdc *c, siplan *plan, uint64_t vlsn)
 
 
 
+static inline sinode*
+si_redistribute_left(si *index, sr *r, sinode *node, sinode *n, svindex *vindex)
+{
+	/* versions written while the node was compacted can
+	 * be below the min key of its first new node, once
+	 * older keys were dropped. following writes of these
+	 * keys are routed to the node on the left, which must
+	 * also own the versions already in memory */
+	ssrbnode *p = ss_rbprev(&index->i, &node->node);
+	if (p == NULL || vindex->count == 0)
+		return NULL;
+	ssiter i;
+	ss_iterinit(sv_indexiter, &i);
+	ss_iteropen(sv_indexiter, &i, r, vindex, SS_GTE, NULL);
+	char *min = sd_indexpage_min(&n->index, sd_indexmin(&n->index));
+	if (sf_compare(r->scheme, ss_iterof(sv_indexiter, &i), min) >= 0)
+		return NULL;
+	return sscast(p, sinode, node);
+}
+
 static int
 si_redistribute(si *index, sr *r, sdc *c, sinode *node, ssbuf *result)
 {
-	(void)index;
 	int rc;
 	svindex *vindex = si_nodeindex(node);
+	sinode *left;
+	left = si_redistribute_left(index, r, node, *(sinode**)result->s, vindex);
 	ssiter i;
 	ss_iterinit(sv_indexiter, &i);
 	ss_iteropen(sv_indexiter, &i, r, vindex, SS_GTE, NULL);
@@ -23024,6 +29240,7 @@ si_redistribute(si *index, sr *r, sdc *c, sinode *node, ssbuf *result)
 			return sr_oom_malfunction(r->e);
 		ss_iternext(sv_indexiter, &i);
 	}
+	sv_indexreset(vindex, r);
 	if (ssunlikely(ss_bufused(&c->b) == 0))
 		return 0;
 	ss_iterinit(ss_bufiterref, &i);
@@ -23032,6 +29249,24 @@ si_redistribute(si *index, sr *r, sdc *c, sinode *node, ssbuf *result)
 	ss_iterinit(ss_bufiterref, &j);
 	ss_iteropen(ss_bufiterref, &j, result, sizeof(sinode*));
 	sinode *prev = ss_iterof(ss_bufiterref, &j);
+	if (left) {
+		sdindexpage *page = sd_indexmin(&prev->index);
+		while (ss_iterhas(ss_bufiterref, &i))
+		{
+			svv *v = ss_iterof(ss_bufiterref, &i);
+			v->next = NULL;
+			rc = sf_compare(r->scheme, sv_vpointer(v),
+			                sd_indexpage_min(&prev->index, page));
+			if (rc >= 0)
+				break;
+			rc = sv_indexset(si_nodeindex(left), r, v);
+			if (ssunlikely(rc == -1))
+				return sr_oom_malfunction(r->e);
+			left->used += sv_vsize(v, r);
+			ss_iternext(ss_bufiterref, &i);
+		}
+		si_plannerupdate(&index->p, left);
+	}
 	ss_iternext(ss_bufiterref, &j);
 	while (1)
 	{
@@ -23041,7 +29276,9 @@ si_redistribute(si *index, sr *r, sdc *c, sinode *node, ssbuf *result)
 			while (ss_iterhas(ss_bufiterref, &i)) {
 				svv *v = ss_iterof(ss_bufiterref, &i);
 				v->next = NULL;
-				sv_indexset(&prev->i0, r, v);
+				rc = sv_indexset(&prev->i0, r, v);
+				if (ssunlikely(rc == -1))
+					return sr_oom_malfunction(r->e);
 				ss_iternext(ss_bufiterref, &i);
 			}
 			break;
@@ -23055,7 +29292,9 @@ si_redistribute(si *index, sr *r, sdc *c, sinode *node, ssbuf *result)
 			                sd_indexpage_min(&p->index, page));
 			if (ssunlikely(rc >= 0))
 				break;
-			sv_indexset(&prev->i0, r, v);
+			rc = sv_indexset(&prev->i0, r, v);
+			if (ssunlikely(rc == -1))
+				return sr_oom_malfunction(r->e);
 			ss_iternext(ss_bufiterref, &i);
 		}
 		if (ssunlikely(! ss_iterhas(ss_bufiterref, &i)))
@@ -23067,7 +29306,7 @@ si_redistribute(si *index, sr *r, sdc *c, sinode *node, ssbuf *result)
 	return 0;
 }
 
-static inline void
+static inline int
 si_redistribute_set(si *index, sr *r, svv *v)
 {
 	/* match node */
@@ -23078,14 +29317,16 @@ si_redistribute_set(si *index, sr *r, svv *v)
 	assert(node != NULL);
 	/* update node */
 	svindex *vindex = si_nodeindex(node);
-	sv_indexset(vindex, r, v);
+	int rc = sv_indexset(vindex, r, v);
+	if (ssunlikely(rc == -1))
+		return sr_oom_malfunction(r->e);
 	node->used += sv_vsize(v, &index->r);
 	/* schedule node */
 	si_plannerupdate(&index->p, node);
+	return 0;
 }
 
-static int
-si_redistribute_index(si *index, sr *r, sdc *c, sinode *node)
+int si_redistribute_index(si *index, sr *r, sdc *c, sinode *node)
 {
 	svindex *vindex = si_nodeindex(node);
 	ssiter i;
@@ -23098,6 +29339,7 @@ si_redistribute_index(si *index, sr *r, sdc *c, sinode *node)
 			return sr_oom_malfunction(r->e);
 		ss_iternext(sv_indexiter, &i);
 	}
+	sv_indexreset(vindex, r);
 	if (ssunlikely(ss_bufused(&c->b) == 0))
 		return 0;
 	ss_iterinit(ss_bufiterref, &i);
@@ -23105,14 +29347,15 @@ si_redistribute_index(si *index, sr *r, sdc *c, sinode *node)
 	while (ss_iterhas(ss_bufiterref, &i)) {
 		svv *v = ss_iterof(ss_bufiterref, &i);
 		v->next = NULL;
-		si_redistribute_set(index, r, v);
+		int rc = si_redistribute_set(index, r, v);
+		if (ssunlikely(rc == -1))
+			return -1;
 		ss_iternext(ss_bufiterref, &i);
 	}
 	return 0;
 }
 
-static int
-si_splitfree(ssbuf *result, sr *r)
+int si_splitfree(ssbuf *result, sr *r)
 {
 	ssiter i;
 	ss_iterinit(ss_bufiterref, &i);
@@ -23120,20 +29363,23 @@ si_splitfree(ssbuf *result, sr *r)
 	while (ss_iterhas(ss_bufiterref, &i))
 	{
 		sinode *p = ss_iterof(ss_bufiterref, &i);
+		/* release values referenced by the new node */
+		if (p->vlog)
+			sd_vlogunref(p->vlog, r, &p->index);
 		si_nodefree(p, r, 0);
 		ss_iternext(ss_bufiterref, &i);
 	}
 	return 0;
 }
 
-static inline int
-si_split(si *index, sdc *c, ssbuf *result,
-         sinode   *parent,
-         ssiter   *i,
-         uint64_t  size_node,
-         uint64_t  size_stream,
-         uint32_t  stream,
-         uint64_t  vlsn)
+int si_split(si *index, sdc *c, ssbuf *result,
+             sinode   *parent,
+             ssiter   *i,
+             uint64_t  size_node,
+             uint64_t  size_stream,
+             uint32_t  stream,
+             uint64_t  vlsn,
+             svrangeset *ranges)
 {
 	sr *r = &index->r;
 	uint32_t timestamp = ss_timestamp();
@@ -23144,14 +29390,36 @@ si_split(si *index, sdc *c, ssbuf *result,
 		.size_node           = size_node,
 		.size_page           = index->scheme.compaction.node_page_size,
 		.checksum            = index->scheme.compaction.node_page_checksum,
+		.prefix              = index->scheme.compaction.node_page_prefix,
 		.expire              = index->scheme.expire,
 		.timestamp           = timestamp,
 		.compression         = index->scheme.compression,
 		.compression_if      = index->scheme.compression_if,
+		.compression_dict    = &index->scheme.compression_dict,
 		.direct_io           = index->scheme.direct_io,
 		.direct_io_page_size = index->scheme.direct_io_page_size,
-		.vlsn                = vlsn
+		.bloom_bits_per_key  = index->scheme.compaction.bloom_bits_per_key,
+		.vlog                = &index->vlog,
+		.vlog_threshold      = index->scheme.value_log_threshold,
+		.vlog_buf            = &c->f,
+		.vlog_buf_read       = &c->g,
+		.ranges              = ranges,
+		.vlsn                = vlsn,
+		.jobq                = r->jobq,
+		.batch               = c->batch,
+		.batch_size          = 1
 	};
+	/* compress pages of the node in parallel, using
+	 * the compression threads and this worker */
+	if (index->scheme.compression && r->jobq && r->jobq->tp.n > 0) {
+		mergeconf.batch_size = r->jobq->tp.n + 1;
+		if (mergeconf.batch_size > SD_MERGEBATCH)
+			mergeconf.batch_size = SD_MERGEBATCH;
+	}
+	/* range deletes applied to the new nodes */
+	uint64_t rangelsn = sv_rangeapplied(ranges, vlsn);
+	if (parent->rangelsn > rangelsn)
+		rangelsn = parent->rangelsn;
 	sinode *n = NULL;
 	sdmerge merge;
 	rc = sd_mergeinit(&merge, r, i, &c->build, &c->build_index,
@@ -23162,23 +29430,33 @@ si_split(si *index, sdc *c, ssbuf *result,
 	{
 		/* create new node */
 		uint64_t id = sr_seq(index->r.seq, SR_NSNNEXT);
-		n = si_nodenew(r, id, parent->id);
+		n = si_nodenew(r, &index->scheme, id, parent->id);
 		if (ssunlikely(n == NULL))
 			goto error;
 		rc = si_nodecreate(n, r, &index->scheme);
 		if (ssunlikely(rc == -1))
 			goto error;
 
-		/* write pages */
+		/* write pages in order */
 		uint64_t offset;
 		offset = sd_iosize(&c->io, &n->file);
-		while ((rc = sd_mergepage(&merge, offset)) == 1) {
-			rc = sd_writepage(r, &n->file, &c->io, merge.build);
-			if (ssunlikely(rc == -1))
-				goto error;
-			offset = sd_iosize(&c->io, &n->file);
+		int count;
+		while ((count = sd_mergepage(&merge)) > 0) {
+			int pos = 0;
+			for (; pos < count; pos++) {
+				sdbuild *page = sd_mergepageof(&merge, pos);
+				rc = sd_mergecommit(&merge, page, offset);
+				if (ssunlikely(rc == -1))
+					goto error;
+				rc = sd_writepage(r, &n->file, &c->io, page);
+				if (ssunlikely(rc == -1))
+					goto error;
+				uint64_t end = sd_iosize(&c->io, &n->file);
+				sr_ratewait(r->rate, end - offset);
+				offset = end;
+			}
 		}
-		if (ssunlikely(rc == -1))
+		if (ssunlikely(count == -1))
 			goto error;
 
 		offset = sd_iosize(&c->io, &n->file);
@@ -23190,6 +29468,7 @@ si_split(si *index, sdc *c, ssbuf *result,
 		rc = sd_writeindex(r, &n->file, &c->io, &merge.index);
 		if (ssunlikely(rc == -1))
 			goto error;
+		sr_ratewait(r->rate, ss_bufused(&merge.index.i));
 
 		/* mmap mode */
 		if (index->scheme.mmap) {
@@ -23198,14 +29477,29 @@ si_split(si *index, sdc *c, ssbuf *result,
 				goto error;
 		}
 
+		/* reference value log files and release the
+		 * builder pins */
+		rc = sd_vlogref(&index->vlog, r, &merge.index);
+		if (ssunlikely(rc == -1))
+			goto error;
+		rc = sd_vlogunpin(&index->vlog, r, &c->build_index.vlog);
+		if (ssunlikely(rc == -1)) {
+			sd_vlogunref(&index->vlog, r, &merge.index);
+			goto error;
+		}
+
 		/* add node to the list */
 		rc = ss_bufadd(result, index->r.a, &n, sizeof(sinode*));
 		if (ssunlikely(rc == -1)) {
+			sd_vlogunref(&index->vlog, r, &merge.index);
 			sr_oom_malfunction(index->r.e);
 			goto error;
 		}
 
-		n->index = merge.index;
+		n->index    = merge.index;
+		n->vlog     = &index->vlog;
+		n->rangelsn = rangelsn;
+		n = NULL;
 	}
 	if (ssunlikely(rc == -1))
 		goto error;
@@ -23213,6 +29507,7 @@ si_split(si *index, sdc *c, ssbuf *result,
 error:
 	if (n)
 		si_nodefree(n, r, 0);
+	sd_vlogunpin(&index->vlog, r, &c->build_index.vlog);
 	sd_mergefree(&merge);
 	si_splitfree(result, r);
 	return -1;
@@ -23221,6 +29516,7 @@ error:
 static int
 si_merge(si *index, sdc *c, sinode *node,
          uint64_t vlsn,
+         svrangeset *ranges,
          ssiter *stream,
          uint64_t size_stream,
          uint32_t n_stream)
@@ -23240,7 +29536,7 @@ si_merge(si *index, sdc *c, sinode *node,
 	              index->scheme.compaction.node_size,
 	              size_stream,
 	              n_stream,
-	              vlsn);
+	              vlsn, ranges);
 	if (ssunlikely(rc == -1))
 		return -1;
 
@@ -23264,6 +29560,7 @@ si_merge(si *index, sdc *c, sinode *node,
 		n = si_bootstrap(index, node->id);
 		if (ssunlikely(n == NULL))
 			return -1;
+		n->rangelsn = sv_rangeapplied(ranges, vlsn);
 		rc = ss_bufadd(result, r->a, &n, sizeof(sinode*));
 		if (ssunlikely(rc == -1)) {
 			sr_oom_malfunction(r->e);
@@ -23285,8 +29582,18 @@ si_merge(si *index, sdc *c, sinode *node,
 		break;
 	case 1: /* self update */
 		n = *(sinode**)result->s;
-		n->i0 = *j;
-		n->used = j->used;
+		if (ssunlikely(si_redistribute_left(index, r, node, n, j))) {
+			rc = si_redistribute(index, r, c, node, result);
+			if (ssunlikely(rc == -1)) {
+				si_unlock(index);
+				si_splitfree(result, r);
+				return -1;
+			}
+			n->used = n->i0.used;
+		} else {
+			n->i0 = *j;
+			n->used = j->used;
+		}
 		si_nodelock(n);
 		si_replace(index, node, n);
 		si_plannerupdate(&index->p, n);
@@ -23315,7 +29622,7 @@ si_merge(si *index, sdc *c, sinode *node,
 		}
 		break;
 	}
-	sv_indexinit(j);
+	sv_indexinit(j, j->type);
 	si_unlock(index);
 
 	/* compaction completion */
@@ -23326,6 +29633,13 @@ si_merge(si *index, sdc *c, sinode *node,
 	while (ss_iterhas(ss_bufiterref, &i))
 	{
 		n  = ss_iterof(ss_bufiterref, &i);
+		/* values must be durable before the nodes which
+		 * reference them */
+		rc = sd_vlogsync(&index->vlog, r, &n->index);
+		if (ssunlikely(rc == -1)) {
+			si_nodefree(node, r, 0);
+			return -1;
+		}
 		if (index->scheme.sync) {
 			rc = ss_filesync(&n->file);
 			if (ssunlikely(rc == -1)) {
@@ -23412,13 +29726,21 @@ int si_compaction(si *index, sdc *c, siplan *plan, uint64_t vlsn)
 	vindex = si_noderotate(node);
 	si_unlock(index);
 
+	/* train the compression dictionary on the first
+	 * checkpoint */
+	int rc;
+	if (ssunlikely(si_dictrequired(index))) {
+		rc = si_dicttrain(index, vindex);
+		if (ssunlikely(rc == -1))
+			return -1;
+	}
+
 	uint64_t size_stream = vindex->used;
 	ssiter vindex_iter;
 	ss_iterinit(sv_indexiter, &vindex_iter);
 	ss_iteropen(sv_indexiter, &vindex_iter, &index->r, vindex, SS_GTE, NULL);
 
 	/* prepare direct_io stream */
-	int rc;
 	if (index->scheme.direct_io) {
 		rc = sd_ioprepare(&c->io, r,
 		                  index->scheme.direct_io,
@@ -23453,6 +29775,7 @@ int si_compaction(si *index, sdc *c, siplan *plan, uint64_t vlsn)
 		.use_direct_io       = index->scheme.direct_io,
 		.direct_io_page_size = index->scheme.direct_io_page_size,
 		.compression_if      = index->scheme.compression_if,
+		.compression_dict    = &index->scheme.compression_dict,
 		.has                 = 0,
 		.has_vlsn            = 0,
 		.o                   = SS_GTE,
@@ -23466,14 +29789,55 @@ int si_compaction(si *index, sdc *c, siplan *plan, uint64_t vlsn)
 		return -1;
 	size_stream += sd_indextotal(&node->index);
 
+	/* range deletes visible to every reader are
+	 * applied by the merge */
+	si_lock(index);
+	svrangeset *ranges = si_rangeref(index);
+	si_unlock(index);
+
 	ssiter i;
 	ss_iterinit(sv_mergeiter, &i);
 	ss_iteropen(sv_mergeiter, &i, r, &merge, SS_GTE);
-	rc = si_merge(index, c, node, vlsn, &i, size_stream,
+	rc = si_merge(index, c, node, vlsn, ranges, &i, size_stream,
 	              sd_indexkeys(&node->index));
 	sv_mergefree(&merge, r->a);
+	si_lock(index);
+	si_rangeunref(index, ranges);
+	si_unlock(index);
 	return rc;
 }
+
+int si_drop(si *index, sdc *c, siplan *plan, uint64_t vlsn)
+{
+	/* remove a node which keys are all deleted by a
+	 * range delete or expired, without rewriting it */
+	sr *r = &index->r;
+	sinode *node = plan->node;
+	assert(node->flags & SI_LOCK);
+	si_lock(index);
+	if (ssunlikely(index->n == 1)) {
+		si_unlock(index);
+		return si_compaction(index, c, plan, vlsn);
+	}
+	si_plannerremove(&index->p, node);
+	si_remove(index, node);
+	/* statements written since the plan */
+	int rc = si_redistribute_index(index, r, c, node);
+	si_unlock(index);
+	if (ssunlikely(rc == -1))
+		return -1;
+
+	/* gc node */
+	uint16_t refs = si_noderefof(node);
+	if (sslikely(refs == 0))
+		return si_nodefree(node, r, 1);
+	si_nodegc(node, r, &index->scheme);
+	si_lock(index);
+	ss_listappend(&index->gc, &node->gc);
+	index->gc_count++;
+	si_unlock(index);
+	return 0;
+}
 #line 1 "sophia/index/si_gc.c"
 
 /*
@@ -23493,39 +29857,472 @@ int si_compaction(si *index, sdc *c, siplan *plan, uint64_t vlsn)
 
 
 
-void si_gcv(sr *r, svv *v)
-{
-	sw *log = (sw*)v->log;
-	if (sv_vunref(r, v)) {
-		if (log)
-			ss_gcsweep(&log->gc, 1);
+void si_gcv(sr *r, svv *v)
+{
+	sw *log = (sw*)v->log;
+	if (sv_vunref(r, v)) {
+		if (log)
+			ss_gcsweep(&log->gc, 1);
+	}
+}
+#line 1 "sophia/index/si_range.c"
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+
+
+
+
+
+
+
+
+
+/*
+	Range deletes.
+
+	A range delete is written to the log once, as a pair of
+	start and stop records, and kept by the index as a set
+	shared by readers and compaction. Every change creates a
+	new set, a set is released by its last user. Set references
+	are taken and released under the index lock.
+
+	The records are kept until the range delete is applied to
+	every node it covers, which also keeps their log file.
+*/
+
+static inline svrangeset*
+si_rangeset(si *i, uint32_t count)
+{
+	svrangeset *s =
+		ss_malloc(i->r.a, sizeof(svrangeset) + sizeof(svrange) * count);
+	if (ssunlikely(s == NULL))
+		return NULL;
+	s->refs  = 1;
+	s->count = 0;
+	return s;
+}
+
+static inline void
+si_rangesetfree(si *i, svrangeset *s, int gc)
+{
+	uint32_t k = 0;
+	for (; k < s->count; k++) {
+		svrange *range = &s->r[k];
+		if (gc) {
+			si_gcv(&i->r, range->start);
+			si_gcv(&i->r, range->stop);
+		} else {
+			sv_vunref(&i->r, range->start);
+			sv_vunref(&i->r, range->stop);
+		}
+	}
+	ss_free(i->r.a, s);
+}
+
+void si_rangeunref(si *i, svrangeset *s)
+{
+	if (s == NULL)
+		return;
+	assert(s->refs > 0);
+	if (--s->refs == 0)
+		si_rangesetfree(i, s, 1);
+}
+
+int si_rangeadd(si *i, svv *start, svv *stop)
+{
+	/* the set takes over the references of the
+	 * start and stop records */
+	si_lock(i);
+	svrangeset *prev = i->ranges;
+	uint32_t count = prev ? prev->count : 0;
+	svrangeset *s = si_rangeset(i, count + 1);
+	if (ssunlikely(s == NULL)) {
+		si_unlock(i);
+		return sr_oom_malfunction(i->r.e);
+	}
+	uint32_t k = 0;
+	for (; k < count; k++) {
+		s->r[k] = prev->r[k];
+		sv_vref(s->r[k].start);
+		sv_vref(s->r[k].stop);
+	}
+	svrange *range = &s->r[count];
+	range->start = start;
+	range->stop  = stop;
+	range->lsn   = sv_vlsn(start, &i->r);
+	s->count = count + 1;
+	i->ranges = s;
+	si_rangeunref(i, prev);
+	si_unlock(i);
+	return 0;
+}
+
+int si_rangeretire(si *i, uint64_t *lsn, int count)
+{
+	/* remove applied range deletes, called
+	 * under index lock */
+	svrangeset *prev = i->ranges;
+	assert(prev != NULL);
+	svrangeset *s = NULL;
+	if (prev->count > (uint32_t)count) {
+		s = si_rangeset(i, prev->count - count);
+		if (ssunlikely(s == NULL))
+			return sr_oom_malfunction(i->r.e);
+	}
+	uint32_t k = 0;
+	for (; k < prev->count; k++) {
+		svrange *range = &prev->r[k];
+		int j = 0;
+		while (j < count && lsn[j] != range->lsn)
+			j++;
+		if (j < count)
+			continue;
+		s->r[s->count++] = *range;
+		sv_vref(range->start);
+		sv_vref(range->stop);
+	}
+	i->ranges = s;
+	si_rangeunref(i, prev);
+	return 0;
+}
+
+void si_rangefree(si *i)
+{
+	/* shutdown, log files are not collected */
+	svrangeset *s = i->ranges;
+	i->ranges = NULL;
+	if (s && --s->refs == 0)
+		si_rangesetfree(i, s, 0);
+}
+#line 1 "sophia/index/si_iter.c"
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+
+
+
+
+
+
+
+
+ssiterif si_iter =
+{
+	.close = si_iter_close,
+	.has   = si_iter_has,
+	.of    = si_iter_of,
+	.next  = si_iter_next
+};
+#line 1 "sophia/index/si_load.c"
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+/*
+	bulk load
+
+	Sorted documents are accumulated in a private in-memory
+	index and written as complete node files once the index
+	reaches node_size, bypassing the log and the database
+	in-memory index.
+
+	New nodes are created as children of the (empty) bootstrap
+	node, so they stay in the incomplete state until the load
+	is committed. Commit follows the compaction protocol:
+	nodes are sealed, the bootstrap node is removed and the
+	seals are completed. A crash at any point either drops the
+	whole load or lets recovery complete it.
+
+	see: si_recover.c
+*/
+
+
+
+
+
+
+
+
+
+
+
+static inline void
+si_loadfree(siload *l)
+{
+	sr *r = &l->index->r;
+	if (l->last)
+		sv_vunref(r, l->last);
+	sv_indexfree(&l->i, r);
+	ss_buffree(&l->nodes, r->a);
+	sd_cfree(&l->c, r);
+}
+
+int si_loadbegin(siload *l, si *index, uint64_t lsn)
+{
+	sr *r = &index->r;
+	l->index = index;
+	l->node  = NULL;
+	l->last  = NULL;
+	l->lsn   = lsn;
+	l->count = 0;
+	sd_cinit(&l->c);
+	sv_indexinit(&l->i, index->scheme.memtable);
+	ss_bufinit(&l->nodes);
+	int rc;
+	if (index->scheme.direct_io) {
+		rc = sd_ioprepare(&l->c.io, r,
+		                  index->scheme.direct_io,
+		                  index->scheme.direct_io_page_size,
+		                  index->scheme.direct_io_buffer_size);
+		if (ssunlikely(rc == -1)) {
+			sd_cfree(&l->c, r);
+			return sr_oom(r->e);
+		}
+	}
+	/* only an empty database can be loaded */
+	si_lock(index);
+	sinode *node = NULL;
+	if (index->n == 1)
+		node = si_nodeof(ss_rbmin(&index->i));
+	if (ssunlikely(node == NULL ||
+	               node->i0.count > 0 ||
+	               node->i1.count > 0 ||
+	               sd_indexkeys(&node->index) > 0)) {
+		si_unlock(index);
+		sd_cfree(&l->c, r);
+		return sr_error(r->e, "%s", "bulk load requires an empty database");
+	}
+	if (ssunlikely(node->flags & SI_LOCK)) {
+		si_unlock(index);
+		sd_cfree(&l->c, r);
+		return sr_error(r->e, "%s", "database is busy");
+	}
+	si_nodelock(node);
+	si_unlock(index);
+	l->node = node;
+	return 0;
+}
+
+static int
+si_loadflush(siload *l)
+{
+	si *index = l->index;
+	sr *r = &index->r;
+	sdc *c = &l->c;
+	if (l->i.count == 0)
+		return 0;
+	ssiter vindex_iter;
+	ss_iterinit(sv_indexiter, &vindex_iter);
+	ss_iteropen(sv_indexiter, &vindex_iter, r, &l->i, SS_GTE, NULL);
+	svmerge merge;
+	sv_mergeinit(&merge);
+	int rc;
+	rc = sv_mergeprepare(&merge, r, 1);
+	if (ssunlikely(rc == -1))
+		return -1;
+	sv_mergeadd(&merge, &vindex_iter);
+	ssiter i;
+	ss_iterinit(sv_mergeiter, &i);
+	ss_iteropen(sv_mergeiter, &i, r, &merge, SS_GTE);
+	ss_bufreset(&c->a);
+	rc = si_split(index, c, &c->a, l->node, &i,
+	              index->scheme.compaction.node_size,
+	              l->i.used,
+	              l->i.count,
+	              l->lsn, NULL);
+	sv_mergefree(&merge, r->a);
+	if (ssunlikely(rc == -1))
+		return -1;
+	rc = ss_bufadd(&l->nodes, r->a, c->a.s, ss_bufused(&c->a));
+	if (ssunlikely(rc == -1)) {
+		si_splitfree(&c->a, r);
+		return sr_oom_malfunction(r->e);
+	}
+	ss_bufreset(&c->a);
+	sv_indexfree(&l->i, r);
+	sv_indexinit(&l->i, l->index->scheme.memtable);
+	sd_cgc(c, r, index->scheme.buf_gc_wm);
+	return 0;
+}
+
+int si_loadadd(siload *l, svv *v)
+{
+	sr *r = &l->index->r;
+	if (l->last) {
+		int rc = sf_compare(r->scheme, sv_vpointer(l->last),
+		                    sv_vpointer(v));
+		if (ssunlikely(rc >= 0)) {
+			sv_vunref(r, v);
+			return sr_error(r->e, "%s", "bulk load keys must be unique "
+			                "and in ascending order");
+		}
+		sv_vunref(r, l->last);
+	}
+	sf_lsnset(r->scheme, sv_vpointer(v), l->lsn);
+	int rc = sv_indexset(&l->i, r, v);
+	if (ssunlikely(rc == -1)) {
+		sv_vunref(r, v);
+		return sr_oom(r->e);
+	}
+	sv_vref(v);
+	l->last = v;
+	l->count++;
+	if (l->i.used < l->index->scheme.compaction.node_size)
+		return 0;
+	return si_loadflush(l);
+}
+
+int si_loadrollback(siload *l)
+{
+	si *index = l->index;
+	sr *r = &index->r;
+	int rcret = 0;
+	ssiter i;
+	ss_iterinit(ss_bufiterref, &i);
+	ss_iteropen(ss_bufiterref, &i, &l->nodes, sizeof(sinode*));
+	while (ss_iterhas(ss_bufiterref, &i)) {
+		sinode *n = ss_iterof(ss_bufiterref, &i);
+		int rc = si_nodefree(n, r, 1);
+		if (ssunlikely(rc == -1))
+			rcret = -1;
+		ss_iternext(ss_bufiterref, &i);
+	}
+	si_lock(index);
+	si_nodeunlock(l->node);
+	si_unlock(index);
+	si_loadfree(l);
+	return rcret;
+}
+
+int si_loadcommit(siload *l)
+{
+	si *index = l->index;
+	sr *r = &index->r;
+	sinode *node = l->node;
+	int rc;
+	rc = si_loadflush(l);
+	if (ssunlikely(rc == -1)) {
+		si_loadrollback(l);
+		return -1;
+	}
+	if (ssunlikely(ss_bufused(&l->nodes) == 0))
+		return si_loadrollback(l);
+
+	/* replace bootstrap node and move any updates made
+	 * during the load to the new nodes */
+	si_lock(index);
+	svindex *j = si_nodeindex(node);
+	si_plannerremove(&index->p, node);
+	si_nodesplit(node);
+	sinode *n;
+	ssiter i;
+	ss_iterinit(ss_bufiterref, &i);
+	ss_iteropen(ss_bufiterref, &i, &l->nodes, sizeof(sinode*));
+	n = ss_iterof(ss_bufiterref, &i);
+	si_nodelock(n);
+	si_replace(index, node, n);
+	si_plannerupdate(&index->p, n);
+	for (ss_iternext(ss_bufiterref, &i); ss_iterhas(ss_bufiterref, &i);
+	     ss_iternext(ss_bufiterref, &i)) {
+		n = ss_iterof(ss_bufiterref, &i);
+		si_nodelock(n);
+		si_insert(index, n);
+		si_plannerupdate(&index->p, n);
+	}
+	ss_bufreset(&l->c.b);
+	rc = si_redistribute_index(index, r, &l->c, node);
+	sv_indexinit(j, j->type);
+	si_unlock(index);
+	if (ssunlikely(rc == -1))
+		goto error;
+
+	/* seal nodes */
+	ss_iterinit(ss_bufiterref, &i);
+	ss_iteropen(ss_bufiterref, &i, &l->nodes, sizeof(sinode*));
+	while (ss_iterhas(ss_bufiterref, &i))
+	{
+		n = ss_iterof(ss_bufiterref, &i);
+		rc = sd_vlogsync(&index->vlog, r, &n->index);
+		if (ssunlikely(rc == -1))
+			goto error;
+		if (index->scheme.sync) {
+			rc = ss_filesync(&n->file);
+			if (ssunlikely(rc == -1)) {
+				sr_malfunction(r->e, "db file '%s' sync error: %s",
+				               ss_pathof(&n->file.path),
+				               strerror(errno));
+				goto error;
+			}
+		}
+		rc = si_noderename_seal(n, r, &index->scheme);
+		if (ssunlikely(rc == -1))
+			goto error;
+		ss_iternext(ss_bufiterref, &i);
+	}
+
+	/* gc bootstrap node */
+	uint16_t refs = si_noderefof(node);
+	if (sslikely(refs == 0)) {
+		rc = si_nodefree(node, r, 1);
+		if (ssunlikely(rc == -1))
+			goto error;
+	} else {
+		si_nodegc(node, r, &index->scheme);
+		si_lock(index);
+		ss_listappend(&index->gc, &node->gc);
+		index->gc_count++;
+		si_unlock(index);
+	}
+
+	/* complete new nodes */
+	ss_iterinit(ss_bufiterref, &i);
+	ss_iteropen(ss_bufiterref, &i, &l->nodes, sizeof(sinode*));
+	while (ss_iterhas(ss_bufiterref, &i))
+	{
+		n = ss_iterof(ss_bufiterref, &i);
+		rc = si_noderename_complete(n, r, &index->scheme);
+		if (ssunlikely(rc == -1))
+			goto error;
+		ss_iternext(ss_bufiterref, &i);
+	}
+
+	/* unlock */
+	si_lock(index);
+	ss_iterinit(ss_bufiterref, &i);
+	ss_iteropen(ss_bufiterref, &i, &l->nodes, sizeof(sinode*));
+	while (ss_iterhas(ss_bufiterref, &i))
+	{
+		n = ss_iterof(ss_bufiterref, &i);
+		si_nodeunlock(n);
+		ss_iternext(ss_bufiterref, &i);
 	}
+	si_unlock(index);
+	si_loadfree(l);
+	return 0;
+error:
+	/* nodes are part of the index at this point, leave
+	 * them locked and let recovery finish the job */
+	si_loadfree(l);
+	return -1;
 }
-#line 1 "sophia/index/si_iter.c"
-
-/*
- * sophia database
- * sphia.org
- *
- * Copyright (c) Dmitry Simonenko
- * BSD License
-*/
-
-
-
-
-
-
-
-
-
-ssiterif si_iter =
-{
-	.close = si_iter_close,
-	.has   = si_iter_has,
-	.of    = si_iter_of,
-	.next  = si_iter_next
-};
 #line 1 "sophia/index/si_merge.c"
 
 /*
@@ -23578,7 +30375,7 @@ ssiterif si_iter =
 
 
 
-sinode *si_nodenew(sr *r, uint64_t id, uint64_t id_parent)
+sinode *si_nodenew(sr *r, sischeme *scheme, uint64_t id, uint64_t id_parent)
 {
 	sinode *n = (sinode*)ss_malloc(r->a, sizeof(sinode));
 	if (ssunlikely(n == NULL)) {
@@ -23589,16 +30386,18 @@ sinode *si_nodenew(sr *r, uint64_t id, uint64_t id_parent)
 	n->id_parent = id_parent;
 	n->recover   = 0;
 	n->backup    = 0;
+	n->rangelsn  = 0;
 	n->flags     = 0;
 	n->used      = 0;
 	n->refs      = 0;
 	ss_spinlockinit(&n->reflock);
 	sd_indexinit(&n->index);
+	n->vlog      = NULL;
 	ss_fileinit(&n->file, r->vfs);
 	ss_mmapinit(&n->map);
 	ss_mmapinit(&n->map_swap);
-	sv_indexinit(&n->i0);
-	sv_indexinit(&n->i1);
+	sv_indexinit(&n->i0, scheme->memtable);
+	sv_indexinit(&n->i1, scheme->memtable);
 	ss_rbinitnode(&n->node);
 	ss_rqinitnode(&n->nodememory);
 	ss_listinit(&n->gc);
@@ -23611,9 +30410,12 @@ ss_rbtruncate(si_nodegc_indexgc,
 
 int si_nodegc_index(sr *r, svindex *i)
 {
+	if (i->type == SV_INDEXBTREE)
+		sv_indexgc(i, r, si_gcvall);
+	else
 	if (i->i.root)
 		si_nodegc_indexgc(i->i.root, r);
-	sv_indexinit(i);
+	sv_indexinit(i, i->type);
 	return 0;
 }
 
@@ -23739,8 +30541,14 @@ int si_nodefree(sinode *n, sr *r, int gc)
 {
 	int rcret = 0;
 	int rc;
+	/* values of a removed node are garbage */
+	if (gc && n->vlog) {
+		rc = sd_vlogunref(n->vlog, r, &n->index);
+		if (ssunlikely(rc == -1))
+			rcret = -1;
+	}
 	if (gc && ss_pathis_set(&n->file.path)) {
-		ss_fileadvise(&n->file, 0, 0, n->file.size);
+		ss_fileadvise(&n->file, SS_ADVISE_DONTNEED, 0, n->file.size);
 		rc = ss_vfsunlink(r->vfs, ss_pathof(&n->file.path));
 		if (ssunlikely(rc == -1)) {
 			sr_malfunction(r->e, "db file '%s' unlink error: %s",
@@ -23869,13 +30677,15 @@ int si_plannertrace(siplan *p, uint32_t id, sstrace *t)
 		break;
 	case SI_GC: plan = "gc";
 		break;
-	case SI_EXPIRE: plan = "expire";
+	case SI_EXPIRE: plan = p->b ? "expire drop" : "expire";
 		break;
 	case SI_NODEGC: plan = "node gc";
 		break;
 	case SI_BACKUP:
 	case SI_BACKUPEND: plan = "backup";
 		break;
+	case SI_RANGE: plan = p->b ? "range drop" : "range";
+		break;
 	}
 	if (p->node) {
 		ss_trace(t, "%s <%" PRIu32 ":%020" PRIu64 ".db>",
@@ -23959,18 +30769,25 @@ match:
 	return SI_PMATCH;
 }
 
-static inline siplannerrc
-si_plannerpeek_memory(siplanner *p, siplan *plan)
+static inline double
+si_plannerwm_memory(siplanner *p)
 {
-	/* try to peek a node with a biggest in-memory index */
-
-	/* calculate peek wm */
 	si *index = (si*)p->i;
 	double cache_per_node =
 		(double)index->scheme.compaction.cache /
 		(double)index->n;
 	if (cache_per_node >= index->scheme.compaction.node_size)
 		cache_per_node = index->scheme.compaction.node_size;
+	return cache_per_node;
+}
+
+static inline siplannerrc
+si_plannerpeek_memory(siplanner *p, siplan *plan)
+{
+	/* try to peek a node with a biggest in-memory index */
+
+	/* calculate peek wm */
+	double cache_per_node = si_plannerwm_memory(p);
 	sinode *n;
 	ssrqnode *pn = NULL;
 	while ((pn = ss_rqprev(&p->memory, pn))) {
@@ -24010,6 +30827,24 @@ si_plannerpeek_gc(siplanner *p, siplan *plan)
 			goto match;
 		}
 	}
+	if (rc)
+		return rc;
+	/* value log files with wm percent of garbage or more
+	 * are compacted out of the nodes which reference them */
+	si *index = p->i;
+	if (sslikely(sd_vlogmark(&index->vlog, plan->b) == 0))
+		return SI_PNONE;
+	pn = NULL;
+	while ((pn = ss_rqprev(&p->memory, pn))) {
+		n = sscast(pn, sinode, nodememory);
+		if (! sd_vloggc_index(&index->vlog, &n->index))
+			continue;
+		if (n->flags & SI_LOCK) {
+			rc = SI_PRETRY;
+			continue;
+		}
+		goto match;
+	}
 	return rc;
 match:
 	si_nodelock(n);
@@ -24017,6 +30852,39 @@ match:
 	return SI_PMATCH;
 }
 
+static inline int
+si_plannerexpire_node(si *index, sinode *n, uint32_t now, uint64_t ttl,
+                      int *drop)
+{
+	/* node has expired rows. it is dropped once its newest
+	 * row has expired, otherwise it is rewritten when the
+	 * expired pages reach expire_wm percent of the node */
+	sdindexheader *h = n->index.h;
+	if (h->tsmin == UINT32_MAX)
+		return 0;
+	uint32_t diff = now - h->tsmin;
+	if (sslikely(diff < ttl))
+		return 0;
+	sdindexexpire *e = sd_indexexpire(&n->index);
+	if (e == NULL)
+		return 1;
+	if (e->tsmax <= now && (now - e->tsmax) >= ttl) {
+		*drop = index->n > 1;
+		return 1;
+	}
+	uint32_t wm = index->scheme.compaction.expire_wm;
+	if (wm == 0)
+		return 1;
+	uint64_t expired = 0;
+	uint32_t pos = 0;
+	for (; pos < e->count; pos++) {
+		uint32_t tsmax = sd_indexexpire_page(e, pos);
+		if (tsmax <= now && (now - tsmax) >= ttl)
+			expired += sd_indexpage(&n->index, pos)->sizeorigin;
+	}
+	return (expired * 100) >= (wm * h->totalorigin);
+}
+
 static inline siplannerrc
 si_plannerpeek_expire(siplanner *p, siplan *plan)
 {
@@ -24025,24 +30893,23 @@ si_plannerpeek_expire(siplanner *p, siplan *plan)
 	uint32_t now = ss_timestamp();
 	sinode *n = NULL;
 	ssrqnode *pn = NULL;
+	int drop = 0;
 	while ((pn = ss_rqprev(&p->memory, pn))) {
 		n = sscast(pn, sinode, nodememory);
-		sdindexheader *h = n->index.h;
-		if (h->tsmin == UINT32_MAX)
+		drop = 0;
+		if (! si_plannerexpire_node(p->i, n, now, plan->a, &drop))
+			continue;
+		if (n->flags & SI_LOCK) {
+			rc = SI_PRETRY;
 			continue;
-		uint32_t diff = now - h->tsmin;
-		if (sslikely(diff >= plan->a)) {
-			if (n->flags & SI_LOCK) {
-				rc = SI_PRETRY;
-				continue;
-			}
-			goto match;
 		}
+		goto match;
 	}
 	return rc;
 match:
 	si_nodelock(n);
 	plan->node = n;
+	plan->b = drop;
 	return SI_PMATCH;
 }
 
@@ -24067,6 +30934,121 @@ si_plannerpeek_nodegc(siplanner *p, siplan *plan)
 	return rc;
 }
 
+static inline int
+si_plannerrange_memory(si *index, svindex *vindex, svrange *range)
+{
+	/* in-memory versions of the range older than
+	 * the range delete */
+	if (vindex->count == 0 || vindex->lsnmin >= range->lsn)
+		return 0;
+	sr *r = &index->r;
+	ssiter i;
+	ss_iterinit(sv_indexiter, &i);
+	ss_iteropen(sv_indexiter, &i, r, vindex, SS_GTE,
+	            sv_vpointer(range->start));
+	for (; ss_iterhas(sv_indexiter, &i); ss_iternext(sv_indexiter, &i)) {
+		char *v = ss_iterof(sv_indexiter, &i);
+		if (sf_compare(r->scheme, v, sv_vpointer(range->stop)) >= 0)
+			break;
+		svv *p = sv_vv(v);
+		for (; p; p = p->next)
+			if (sv_vlsn(p, r) < range->lsn)
+				return 1;
+	}
+	return 0;
+}
+
+static inline int
+si_plannerrange_node(si *index, sinode *n, svrange *range, int *drop)
+{
+	/* node has versions to be deleted by the range, it
+	 * is dropped when the range covers all of its keys */
+	sr *r = &index->r;
+	int memory = si_plannerrange_memory(index, &n->i0, range);
+	sdindexheader *h = n->index.h;
+	if (n->rangelsn >= range->lsn || h->count == 0 ||
+	    h->lsnmin >= range->lsn)
+		return memory;
+	char *min = sd_indexpage_min(&n->index, sd_indexmin(&n->index));
+	char *max = sd_indexpage_max(&n->index, sd_indexmax(&n->index));
+	if (sf_compare(r->scheme, max, sv_vpointer(range->start)) < 0 ||
+	    sf_compare(r->scheme, min, sv_vpointer(range->stop)) >= 0)
+		return memory;
+	*drop = !memory && h->lsnmax < range->lsn &&
+	        sv_rangehas(range, r, min) &&
+	        sv_rangehas(range, r, max);
+	return 1;
+}
+
+static inline siplannerrc
+si_plannerpeek_range(siplanner *p, siplan *plan)
+{
+	/* find a node which has versions deleted by a
+	 * range delete visible to every reader, range
+	 * deletes applied to every node are retired */
+	si *index = p->i;
+	svrangeset *s = index->ranges;
+	if (sslikely(s == NULL))
+		return SI_PNONE;
+	siplannerrc rc = SI_PNONE;
+	uint64_t retire[16];
+	int retire_count = 0;
+	uint32_t k = 0;
+	for (; k < s->count; k++) {
+		svrange *range = &s->r[k];
+		if (range->lsn > plan->a)
+			continue;
+		int pending = 0;
+		ssrbnode *pn = ss_rbmin(&index->i);
+		for (; pn; pn = ss_rbnext(&index->i, pn)) {
+			sinode *n = sscast(pn, sinode, node);
+			int drop = 0;
+			if (n->flags & SI_LOCK) {
+				/* node is being compacted */
+				pending = 1;
+				if (si_plannerrange_node(index, n, range, &drop))
+					rc = SI_PRETRY;
+				continue;
+			}
+			if (! si_plannerrange_node(index, n, range, &drop))
+				continue;
+			si_nodelock(n);
+			plan->node = n;
+			plan->b = drop && index->n > 1;
+			return SI_PMATCH;
+		}
+		if (! pending && retire_count < (int)(sizeof(retire) / sizeof(uint64_t)))
+			retire[retire_count++] = range->lsn;
+	}
+	if (retire_count > 0)
+		si_rangeretire(index, retire, retire_count);
+	return rc;
+}
+
+uint32_t si_plannerbacklog(siplanner *p)
+{
+	/* biggest unlocked in-memory index in percent
+	 * of the memory compaction watermark */
+	si *index = (si*)p->i;
+	if (ssunlikely(index->n == 0))
+		return 0;
+	double cache_per_node = si_plannerwm_memory(p);
+	if (ssunlikely(cache_per_node < 1.0))
+		cache_per_node = 1.0;
+	sinode *n;
+	ssrqnode *pn = NULL;
+	while ((pn = ss_rqprev(&p->memory, pn))) {
+		n = sscast(pn, sinode, nodememory);
+		if (n->flags & SI_LOCK)
+			continue;
+		double backlog = (n->used * 100.0) / cache_per_node;
+		if (backlog >= UINT32_MAX)
+			return UINT32_MAX;
+		return (uint32_t)backlog;
+	}
+	return 0;
+}
+
 siplannerrc
 si_planner(siplanner *p, siplan *plan)
 {
@@ -24083,6 +31065,8 @@ si_planner(siplanner *p, siplan *plan)
 		return si_plannerpeek_expire(p, plan);
 	case SI_BACKUP:
 		return si_plannerpeek_backup(p, plan);
+	case SI_RANGE:
+		return si_plannerpeek_range(p, plan);
 	}
 	return -1;
 }
@@ -24144,6 +31128,17 @@ int si_profiler(siprofiler *p)
 	p->memory_used = memory_used;
 	p->read_disk  = p->i->read_disk;
 	p->read_cache = p->i->read_cache;
+	p->bloom_skip = p->i->bloom_skip;
+	p->bloom_false_positive = p->i->bloom_false_positive;
+	ssdict *dict = ss_dictsetlast(&p->i->scheme.compression_dict);
+	p->compression_dict = dict ? dict->id : 0;
+	uint32_t files;
+	uint64_t size, live;
+	sd_vlogstat(&p->i->vlog, &files, &size, &live);
+	p->value_log_files = files;
+	p->value_log_size  = size;
+	p->value_log_live  = live;
+	p->range_deletes   = si_rangecount(p->i);
 	return 0;
 }
 #line 1 "sophia/index/si_read.c"
@@ -24170,7 +31165,7 @@ int si_readopen(siread *q, si *i, sicache *c, ssorder o,
                 char *upsert,
                 char *prefix, uint32_t prefix_size,
                 int has,
-                int read_start)
+                uint64_t read_start)
 {
 	q->order       = o;
 	q->key         = key;
@@ -24181,6 +31176,7 @@ int si_readopen(siread *q, si *i, sicache *c, ssorder o,
 	q->prefix      = prefix;
 	q->prefix_size = prefix_size;
 	q->has         = has;
+	q->cache_only  = 0;
 	q->read_start  = read_start;
 	q->read_disk   = 0;
 	q->read_cache  = 0;
@@ -24195,11 +31191,13 @@ int si_readopen(siread *q, si *i, sicache *c, ssorder o,
 	}
 	sv_mergeinit(&q->merge);
 	si_lock(i);
+	q->ranges = si_rangeref(i);
 	return 0;
 }
 
 int si_readclose(siread *q)
 {
+	si_rangeunref(q->index, q->ranges);
 	si_unlock(q->index);
 	sv_mergefree(&q->merge, q->r->a);
 	return 0;
@@ -24208,6 +31206,19 @@ int si_readclose(siread *q)
 static inline int
 si_readdup(siread *q, char *result)
 {
+	/* fetch separated values, unless only keys
+	 * are requested */
+	if (ssunlikely(sf_is(q->r->scheme, result, SVVLOG))) {
+		ssbuf *buf = &q->cache->buf_b;
+		int rc;
+		if (q->has || q->cache->keys_only)
+			rc = sd_vlogkeys(q->r, result, buf);
+		else
+			rc = sd_vlogread(&q->index->vlog, q->r, result, buf);
+		if (ssunlikely(rc == -1))
+			return -1;
+		result = buf->s;
+	}
 	q->result = sv_vbuildraw(q->r, result);
 	if (ssunlikely(q->result == NULL))
 		return sr_oom(q->r->e);
@@ -24247,6 +31258,11 @@ si_getresult(siread *q, char *v, int compare)
 		return sf_lsn(q->r->scheme, v) > q->vlsn;
 	if (ssunlikely(sf_is(q->r->scheme, v, SVDELETE)))
 		return 2;
+	if (ssunlikely(q->ranges)) {
+		uint64_t cover = sv_rangecover(q->ranges, q->r, v, q->vlsn);
+		if (sf_lsn(q->r->scheme, v) < cover)
+			return 2;
+	}
 	rc = si_readdup(q, v);
 	if (ssunlikely(rc == -1))
 		return -1;
@@ -24307,6 +31323,11 @@ si_getfile(siread *q, sinode *n, sicache *c)
 		.use_direct_io       = scheme->direct_io,
 		.direct_io_page_size = scheme->direct_io_page_size,
 		.compression_if      = scheme->compression_if,
+		.compression_dict    = &scheme->compression_dict,
+		.page_cache          = c->pool->page_cache,
+		.page_cache_node     = n->id,
+		.page_cache_id       = scheme->id,
+		.page_reuse          = 1,
 		.has                 = q->has,
 		.has_vlsn            = q->vlsn,
 		.o                   = SS_GTE,
@@ -24314,10 +31335,14 @@ si_getfile(siread *q, sinode *n, sicache *c)
 		.file                = &n->file,
 		.r                   = q->r
 	};
+	uint64_t start = ss_utime();
 	ss_iterinit(sd_read, &c->i);
 	rc = ss_iteropen(sd_read, &c->i, &arg, q->key);
+	sr_stathist(q->r->stat, SR_HGET_DISK, ss_utime() - start);
 	int reads = sd_read_stat(&c->i);
 	si_readstat(q, 0, reads);
+	reads = sd_read_statcache(&c->i);
+	si_readstat(q, 1, reads);
 	if (ssunlikely(rc <= 0))
 		return rc;
 	/* prepare sources */
@@ -24331,7 +31356,8 @@ si_getfile(siread *q, sinode *n, sicache *c)
 		vlsn = UINT64_MAX;
 	ssiter j;
 	ss_iterinit(sv_readiter, &j);
-	ss_iteropen(sv_readiter, &j, q->r, &i, &q->index->rdc.upsert, vlsn, 1);
+	ss_iteropen(sv_readiter, &j, q->r, &i, &q->index->rdc.upsert,
+	            q->ranges, vlsn, 1);
 	char *v = ss_iterof(sv_readiter, &j);
 	if (ssunlikely(v == NULL))
 		return 0;
@@ -24350,10 +31376,29 @@ si_get(siread *q)
 	assert(node != NULL);
 
 	/* search in memory */
+	uint64_t start = ss_utime();
 	int rc;
 	rc = si_getindex(q, node);
+	sr_stathist(q->r->stat, SR_HGET_MEMORY, ss_utime() - start);
 	if (rc != 0)
 		return rc;
+
+	/* skip the node file if its bloom filter rules the key out */
+	sdindexbloom *bloom = sd_indexbloom(&node->index);
+	if (bloom) {
+		uint32_t hash = sd_indexbloom_hash(q->r, q->key);
+		if (! sd_indexbloom_has(bloom, hash)) {
+			q->index->bloom_skip++;
+			return 0;
+		}
+	}
+	/* the caller asked not to wait for a node file read,
+	 * 3 tells the key may only be found on disk */
+	if (ssunlikely(q->cache_only)) {
+		if (node->index.h == NULL || sd_indexkeys(&node->index) == 0)
+			return 0;
+		return 3;
+	}
 	sinodeview view;
 	si_nodeview_open(&view, node);
 	rc = si_cachevalidate(q->cache, node);
@@ -24372,9 +31417,41 @@ si_get(siread *q)
 
 	si_lock(q->index);
 	si_nodeview_close(&view);
+	if (bloom && rc == 0 && !q->has)
+		q->index->bloom_false_positive++;
 	return rc;
 }
 
+static inline void
+si_rangestat(siread *q, sicache *c)
+{
+	/* account pages read by the cached iterator since
+	 * the previous lookup */
+	int reads = sd_read_stat(&c->i);
+	si_readstat(q, 0, reads - c->reads);
+	c->reads = reads;
+	reads = sd_read_statcache(&c->i);
+	si_readstat(q, 1, reads - c->reads_cache);
+	c->reads_cache = reads;
+}
+
+static inline void
+si_rangeahead(siread *q, sinode *n)
+{
+	/* start reading first pages of the node which follows
+	 * the current one in scan order */
+	ssrbnode *p;
+	if (q->order == SS_LT || q->order == SS_LTE)
+		p = ss_rbprev(&q->index->i, &n->node);
+	else
+		p = ss_rbnext(&q->index->i, &n->node);
+	if (p == NULL)
+		return;
+	sinode *next = sscast(p, sinode, node);
+	sd_read_aheadnode(&next->index, &next->file, q->order,
+	                  q->cache->readahead);
+}
+
 static inline int
 si_rangefile(siread *q, sinode *n, svmerge *m)
 {
@@ -24384,6 +31461,7 @@ si_rangefile(siread *q, sinode *n, svmerge *m)
 	if (ss_iterhas(sd_read, &c->i)) {
 		svmergesrc *s = sv_mergeadd(m, &c->i);
 		si_readstat(q, 1, 1);
+		si_rangestat(q, c);
 		s->ptr = c;
 		return 1;
 	}
@@ -24407,6 +31485,11 @@ si_rangefile(siread *q, sinode *n, svmerge *m)
 		.use_direct_io       = scheme->direct_io,
 		.direct_io_page_size = scheme->direct_io_page_size,
 		.compression_if      = scheme->compression_if,
+		.compression_dict    = &scheme->compression_dict,
+		.page_cache          = c->pool->page_cache,
+		.page_cache_node     = n->id,
+		.page_cache_id       = scheme->id,
+		.readahead           = c->readahead,
 		.has                 = 0,
 		.has_vlsn            = 0,
 		.o                   = q->order,
@@ -24414,10 +31497,13 @@ si_rangefile(siread *q, sinode *n, svmerge *m)
 		.file                = &n->file,
 		.r                   = q->r
 	};
+	if (c->readahead && !scheme->direct_io)
+		si_rangeahead(q, n);
 	ss_iterinit(sd_read, &c->i);
 	int rc = ss_iteropen(sd_read, &c->i, &arg, q->key);
-	int reads = sd_read_stat(&c->i);
-	si_readstat(q, 0, reads);
+	c->reads = 0;
+	c->reads_cache = 0;
+	si_rangestat(q, c);
 	if (ssunlikely(rc == -1))
 		return -1;
 	if (ssunlikely(! ss_iterhas(sd_read, &c->i)))
@@ -24464,6 +31550,7 @@ next_node:
 	}
 
 	/* in-memory indexes */
+	uint64_t start = ss_utime();
 	svindex *second;
 	svindex *first = si_nodeindex_priority(node, &second);
 	if (first->count) {
@@ -24478,6 +31565,14 @@ next_node:
 		ss_iteropen(sv_indexiter, &s->src, q->r, second, q->order,
 		            q->key);
 	}
+	/* stages are traced for point reads of upsert
+	 * databases, which are served here */
+	uint64_t now;
+	if (q->upsert_eq) {
+		now = ss_utime();
+		sr_stathist(q->r->stat, SR_HGET_MEMORY, now - start);
+		start = now;
+	}
 
 	/* read from file */
 	rc = si_cachevalidate(q->cache, node);
@@ -24488,6 +31583,11 @@ next_node:
 	rc = si_rangefile(q, node, m);
 	if (ssunlikely(rc == -1 || rc == 2))
 		return rc;
+	if (q->upsert_eq) {
+		now = ss_utime();
+		sr_stathist(q->r->stat, SR_HGET_DISK, now - start);
+		start = now;
+	}
 
 	/* merge and filter data stream */
 	ssiter j;
@@ -24495,7 +31595,10 @@ next_node:
 	ss_iteropen(sv_mergeiter, &j, q->r, m, q->order);
 	ssiter k;
 	ss_iterinit(sv_readiter, &k);
-	ss_iteropen(sv_readiter, &k, q->r, &j, &q->index->rdc.upsert, q->vlsn, 0);
+	ss_iteropen(sv_readiter, &k, q->r, &j, &q->index->rdc.upsert,
+	            q->ranges, q->vlsn, 0);
+	if (q->upsert_eq)
+		sr_stathist(q->r->stat, SR_HGET_UPSERT, ss_utime() - start);
 	char *v = ss_iterof(sv_readiter, &k);
 	if (ssunlikely(v == NULL)) {
 		sv_mergereset(&q->merge);
@@ -24542,6 +31645,9 @@ int si_read(siread *q)
 	case SS_LTE:
 	case SS_GT:
 	case SS_GTE:
+		/* point lookups merged with upserts are ranges */
+		if (ssunlikely(q->cache_only))
+			return 3;
 		return si_range(q);
 	default:
 		break;
@@ -24572,6 +31678,60 @@ int si_readcommited(si *index, sr *r, svv *v)
 		return 1;
 	return 0;
 }
+
+void si_readahead_add(sireadahead *ra, si *index, sr *r, char *key)
+{
+	/* mmap and direct_io reads do not go through
+	 * the page cache */
+	if (index->scheme.mmap || index->scheme.direct_io)
+		return;
+	if (ra->n == SI_READAHEAD)
+		si_readahead_submit(ra);
+	si_lock(index);
+	ssiter i;
+	ss_iterinit(si_iter, &i);
+	ss_iteropen(si_iter, &i, r, index, SS_GTE, key);
+	sinode *node;
+	node = ss_iterof(si_iter, &i);
+	assert(node != NULL);
+	if (node->index.h == NULL || sd_indexkeys(&node->index) == 0)
+		goto done;
+	sdindexbloom *bloom = sd_indexbloom(&node->index);
+	if (bloom && !sd_indexbloom_has(bloom, sd_indexbloom_hash(r, key)))
+		goto done;
+	ss_iterinit(sd_indexiter, &i);
+	ss_iteropen(sd_indexiter, &i, r, &node->index, SS_GTE, key);
+	sdindexpage *page = ss_iterof(sd_indexiter, &i);
+	if (page == NULL)
+		goto done;
+	/* sorted keys often land on the same page */
+	if (ra->n > 0 && ra->view[ra->n - 1].node == node &&
+	    ra->io[ra->n - 1].offset == page->offset)
+		goto done;
+	si_nodeview_open(&ra->view[ra->n], node);
+	ssvfsio *io = &ra->io[ra->n];
+	io->fd     = node->file.fd;
+	io->offset = page->offset;
+	io->size   = page->size;
+	ra->vfs    = r->vfs;
+	ra->n++;
+done:
+	si_unlock(index);
+}
+
+void si_readahead_submit(sireadahead *ra)
+{
+	if (ra->n == 0)
+		return;
+	/* read-ahead is a hint, errors are ignored */
+	ss_vfsadvisev(ra->vfs, SS_ADVISE_WILLNEED, ra->io, ra->n);
+	int i = 0;
+	while (i < ra->n) {
+		si_nodeview_close(&ra->view[i]);
+		i++;
+	}
+	ra->n = 0;
+}
 #line 1 "sophia/index/si_recover.c"
 
 /*
@@ -24622,7 +31782,7 @@ sinode *si_bootstrap(si *i, uint64_t parent)
 	sr *r = &i->r;
 	/* create node */
 	uint64_t id = sr_seq(r->seq, SR_NSNNEXT);
-	sinode *n = si_nodenew(r, id, parent);
+	sinode *n = si_nodenew(r, &i->scheme, id, parent);
 	if (ssunlikely(n == NULL))
 		return NULL;
 	int rc;
@@ -24638,7 +31798,9 @@ sinode *si_bootstrap(si *i, uint64_t parent)
 	sdbuildindex build_index;
 	sd_buildindex_init(&build_index);
 
-	rc = sd_buildindex_begin(&build_index);
+	rc = sd_buildindex_begin(&build_index,
+	                         i->scheme.compaction.node_page_prefix ?
+	                         SD_PAGEPREFIX : SD_PAGEPLAIN);
 	if (ssunlikely(rc == -1))
 		goto e0;
 
@@ -24654,8 +31816,10 @@ sinode *si_bootstrap(si *i, uint64_t parent)
 	}
 	rc = sd_buildbegin(&build, r,
 	                   i->scheme.compaction.node_page_checksum,
+	                   i->scheme.compaction.node_page_prefix,
 	                   i->scheme.compression,
-	                   i->scheme.compression_if);
+	                   i->scheme.compression_if,
+	                   &i->scheme.compression_dict);
 	if (ssunlikely(rc == -1))
 		goto e1;
 	sd_buildend(&build, r);
@@ -24778,18 +31942,124 @@ si_process(char *name, uint64_t *nsn, uint64_t *parent)
 	id = si_processid(&token);
 	if (ssunlikely(id == -1))
 		return -1;
-	*nsn = id;
-	if (strcmp(token, ".db.incomplete") == 0)
-		return SI_RDB_DBI;
-	else
-	if (strcmp(token, ".db.seal") == 0)
-		return SI_RDB_DBSEAL;
-	return -1;
+	*nsn = id;
+	if (strcmp(token, ".db.incomplete") == 0)
+		return SI_RDB_DBI;
+	else
+	if (strcmp(token, ".db.seal") == 0)
+		return SI_RDB_DBSEAL;
+	return -1;
+}
+
+typedef struct sitrackfile sitrackfile;
+
+struct sitrackfile {
+	ssjob     job;
+	sinode   *node;
+	sr       *r;
+	sischeme *scheme;
+};
+
+static inline int
+si_trackopenadd(ssbuf *open, sr *r, sinode *node)
+{
+	sitrackfile f;
+	memset(&f, 0, sizeof(f));
+	f.node = node;
+	int rc = ss_bufadd(open, r->a, &f, sizeof(f));
+	if (ssunlikely(rc == -1)) {
+		si_nodefree(node, r, 0);
+		return sr_oom_malfunction(r->e);
+	}
+	return 0;
+}
+
+static inline void
+si_trackopenfree(ssbuf *open, sr *r)
+{
+	sitrackfile *f   = (sitrackfile*)open->s;
+	sitrackfile *end = (sitrackfile*)open->p;
+	for (; f < end; f++)
+		si_nodefree(f->node, r, 0);
+	ss_buffree(open, r->a);
+}
+
+static int
+si_trackopenjob(ssjob *job)
+{
+	sitrackfile *f = job->arg;
+	sinode *node = f->node;
+	sspath path;
+	if (node->recover == SI_RDB_DBSEAL) {
+		ss_pathcompound(&path, f->scheme->path, node->id_parent, node->id,
+		                ".db.seal");
+	} else {
+		ss_path(&path, f->scheme->path, node->id, ".db");
+	}
+	return si_nodeopen(node, f->r, f->scheme, &path);
+}
+
+static inline int
+si_trackopen(sitrack *track, sr *r, si *i, ssjobq *q, ssbuf *open)
+{
+	sitrackfile *f   = (sitrackfile*)open->s;
+	sitrackfile *end = (sitrackfile*)open->p;
+	sitrackfile *p;
+
+	/* node files are opened and their indexes read by the
+	 * recovery thread pool, if there is one */
+	ssjobgroup group;
+	ss_jobgroupinit(&group);
+	int rc = 0;
+	for (p = f; p < end; p++) {
+		p->r = r;
+		p->scheme = &i->scheme;
+		ss_jobinit(&p->job, si_trackopenjob, p, &group);
+		if (q) {
+			ss_jobqpush(q, &p->job);
+			continue;
+		}
+		rc = si_trackopenjob(&p->job);
+		if (ssunlikely(rc == -1))
+			break;
+	}
+	if (q)
+		rc = ss_jobqwait(q, &group);
+	if (ssunlikely(rc == -1)) {
+		for (p = f; p < end; p++)
+			si_nodefree(p->node, r, 0);
+		return -1;
+	}
+
+	/* track nodes, the order of files in the directory
+	 * does not matter here */
+	for (p = f; p < end; p++) {
+		sinode *node = p->node;
+		si_trackmetrics(track, node);
+		if (node->recover == SI_RDB_DBSEAL) {
+			si_trackset(track, node);
+			continue;
+		}
+		sinode *head = si_trackget(track, node->id);
+		if (sslikely(head == NULL)) {
+			si_trackset(track, node);
+		} else {
+			/* replace a node previously created by a
+			 * incomplete compaction */
+			si_trackreplace(track, head, node);
+			head->recover &= ~SI_RDB_UNDEF;
+			node->recover |= head->recover;
+			si_nodefree(head, r, 0);
+		}
+	}
+	return 0;
 }
 
 static inline int
-si_trackdir(sitrack *track, sr *r, si *i)
+si_trackdir(sitrack *track, sr *r, si *i, ssjobq *q)
 {
+	ssbuf open;
+	ss_bufinit(&open);
 	DIR *dir = opendir(i->scheme.path);
 	if (ssunlikely(dir == NULL)) {
 		sr_malfunction(r->e, "directory '%s' open error: %s",
@@ -24817,7 +32087,7 @@ si_trackdir(sitrack *track, sr *r, si *i)
 			 * incomplete compaction process */
 			head = si_trackget(track, id_parent);
 			if (sslikely(head == NULL)) {
-				head = si_nodenew(r, id_parent, UINT64_MAX);
+				head = si_nodenew(r, &i->scheme, id_parent, UINT64_MAX);
 				if (ssunlikely(head == NULL))
 					goto error;
 				head->recover = SI_RDB_UNDEF;
@@ -24838,19 +32108,13 @@ si_trackdir(sitrack *track, sr *r, si *i)
 			}
 			assert(rc == SI_RDB_DBSEAL);
 			/* recover 'sealed' node */
-			node = si_nodenew(r, id, id_parent);
+			node = si_nodenew(r, &i->scheme, id, id_parent);
 			if (ssunlikely(node == NULL))
 				goto error;
 			node->recover = SI_RDB_DBSEAL;
-			ss_pathcompound(&path, i->scheme.path, id_parent, id,
-			                ".db.seal");
-			rc = si_nodeopen(node, r, &i->scheme, &path);
-			if (ssunlikely(rc == -1)) {
-				si_nodefree(node, r, 0);
+			rc = si_trackopenadd(&open, r, node);
+			if (ssunlikely(rc == -1))
 				goto error;
-			}
-			si_trackset(track, node);
-			si_trackmetrics(track, node);
 			continue;
 		}
 		case SI_RDB_REMOVE:
@@ -24867,35 +32131,23 @@ si_trackdir(sitrack *track, sr *r, si *i)
 
 
 		/* recover node */
-		node = si_nodenew(r, id, id_parent);
+		node = si_nodenew(r, &i->scheme, id, id_parent);
 		if (ssunlikely(node == NULL))
 			goto error;
 		node->recover = SI_RDB;
-		ss_path(&path, i->scheme.path, id, ".db");
-		rc = si_nodeopen(node, r, &i->scheme, &path);
-		if (ssunlikely(rc == -1)) {
-			si_nodefree(node, r, 0);
+		rc = si_trackopenadd(&open, r, node);
+		if (ssunlikely(rc == -1))
 			goto error;
-		}
-		si_trackmetrics(track, node);
-
-		/* track node */
-		head = si_trackget(track, id);
-		if (sslikely(head == NULL)) {
-			si_trackset(track, node);
-		} else {
-			/* replace a node previously created by a
-			 * incomplete compaction */
-			si_trackreplace(track, head, node);
-			head->recover &= ~SI_RDB_UNDEF;
-			node->recover |= head->recover;
-			si_nodefree(head, r, 0);
-		}
 	}
 	closedir(dir);
-	return 0;
+
+	/* open and track node files */
+	int rc = si_trackopen(track, r, i, q, &open);
+	ss_buffree(&open, r->a);
+	return rc;
 error:
 	closedir(dir);
+	si_trackopenfree(&open, r);
 	return -1;
 }
 
@@ -24977,6 +32229,10 @@ si_recovercomplete(sitrack *track, sr *r, si *index, ssbuf *buf)
 			ss_iternext(ss_bufiterref, &i);
 			continue;
 		}
+		int rc = sd_vlogref(&index->vlog, r, &n->index);
+		if (ssunlikely(rc == -1))
+			return -1;
+		n->vlog = &index->vlog;
 		n->recover = SI_RDB;
 		si_insert(index, n);
 		si_plannerupdate(&index->p, n);
@@ -24986,14 +32242,14 @@ si_recovercomplete(sitrack *track, sr *r, si *index, ssbuf *buf)
 }
 
 static inline int
-si_recoverindex(si *i, sr *r)
+si_recoverindex(si *i, sr *r, ssjobq *q)
 {
 	sitrack track;
 	si_trackinit(&track);
 	ssbuf buf;
 	ss_bufinit(&buf);
 	int rc;
-	rc = si_trackdir(&track, r, i);
+	rc = si_trackdir(&track, r, i, q);
 	if (ssunlikely(rc == -1))
 		goto error;
 	if (ssunlikely(track.count == 0))
@@ -25004,11 +32260,14 @@ si_recoverindex(si *i, sr *r)
 	rc = si_recovercomplete(&track, r, i, &buf);
 	if (ssunlikely(rc == -1))
 		goto error;
-	/* set actual metrics */
+	/* set actual metrics, indexes may be recovered
+	 * in parallel */
+	sr_seqlock(r->seq);
 	if (track.nsn > r->seq->nsn)
 		r->seq->nsn = track.nsn;
 	if (track.lsn > r->seq->lsn)
 		r->seq->lsn = track.lsn;
+	sr_sequnlock(r->seq);
 	ss_buffree(&buf, r->a);
 	return 0;
 error:
@@ -25017,7 +32276,7 @@ error:
 	return -1;
 }
 
-int si_recover(si *i)
+int si_recover(si *i, ssjobq *q)
 {
 	sr *r = &i->r;
 	int exist = ss_vfsexists(r->vfs, i->scheme.path);
@@ -25028,11 +32287,31 @@ int si_recover(si *i)
 	if (ssunlikely(rc == -1))
 		return -1;
 	r->scheme = &i->scheme.scheme;
-	rc = si_recoverindex(i, r);
-	if (sslikely(rc <= 0))
-		return rc;
+	rc = sd_vlogopen(&i->vlog, r, i->scheme.path,
+	                 i->scheme.compaction.node_size,
+	                 i->scheme.sync);
+	if (ssunlikely(rc == -1))
+		return -1;
+	rc = si_recoverindex(i, r, q);
+	if (ssunlikely(rc == -1))
+		return -1;
+	if (sslikely(rc == 0))
+		return sd_vlogonline(&i->vlog, r);
 deploy:
-	return si_deploy(i, r, !exist);
+	rc = si_deploy(i, r, !exist);
+	if (ssunlikely(rc == -1))
+		return -1;
+	if (! exist) {
+		rc = sd_vlogopen(&i->vlog, r, i->scheme.path,
+		                 i->scheme.compaction.node_size,
+		                 i->scheme.sync);
+		if (ssunlikely(rc == -1))
+			return -1;
+	}
+	rc = sd_vlogonline(&i->vlog, r);
+	if (ssunlikely(rc == -1))
+		return -1;
+	return 1;
 }
 #line 1 "sophia/index/si_scheme.c"
 
@@ -25062,7 +32341,12 @@ enum {
 	SI_SCHEME_NODE_PAGE_SIZE,
 	SI_SCHEME_NODE_PAGE_CHECKSUM,
 	SI_SCHEME_COMPRESSION,
-	SI_SCHEME_EXPIRE
+	SI_SCHEME_EXPIRE,
+	SI_SCHEME_UPSERT,
+	SI_SCHEME_UPSERT_LIMIT,
+	SI_SCHEME_COMPRESSION_DICT,
+	SI_SCHEME_NODE_PAGE_PREFIX,
+	SI_SCHEME_VALUE_LOG_THRESHOLD
 };
 
 static inline void
@@ -25070,11 +32354,16 @@ si_schemecompaction_init(sicompaction *c)
 {
 	c->cache              = 4ULL * 1024 * 1024 * 1024;
 	c->expire_period      = 0;
+	c->expire_wm          = 0;
 	c->gc_period          = 60;
 	c->gc_wm              = 30;
+	c->weight             = 1;
+	c->workers            = 0;
 	c->node_size          = 64 * 1024 * 1024;
 	c->node_page_size     = 128 * 1024;
 	c->node_page_checksum = 1;
+	c->node_page_prefix   = 0;
+	c->bloom_bits_per_key = 0;
 }
 
 void si_schemeinit(sischeme *s)
@@ -25083,6 +32372,8 @@ void si_schemeinit(sischeme *s)
 	sr_version(&s->version);
 	sr_version_storage(&s->version_storage);
 	si_schemecompaction_init(&s->compaction);
+	ss_dictsetinit(&s->compression_dict);
+	s->compression_dict_size = 16 * 1024;
 }
 
 void si_schemefree(sischeme *s, sr *r)
@@ -25103,6 +32394,15 @@ void si_schemefree(sischeme *s, sr *r)
 		ss_free(r->a, s->compression_sz);
 		s->compression_sz = NULL;
 	}
+	if (s->upsert_sz) {
+		ss_free(r->a, s->upsert_sz);
+		s->upsert_sz = NULL;
+	}
+	if (s->memtable_sz) {
+		ss_free(r->a, s->memtable_sz);
+		s->memtable_sz = NULL;
+	}
+	ss_dictsetfree(&s->compression_dict, r->a);
 	sf_schemefree(&s->scheme, r->a);
 }
 
@@ -25151,6 +32451,16 @@ int si_schemedeploy(sischeme *s, sr *r)
 	                  sizeof(s->compaction.node_page_checksum));
 	if (ssunlikely(rc == -1))
 		goto error;
+	rc = sd_schemeadd(&c, r, SI_SCHEME_NODE_PAGE_PREFIX, SS_U32,
+	                  &s->compaction.node_page_prefix,
+	                  sizeof(s->compaction.node_page_prefix));
+	if (ssunlikely(rc == -1))
+		goto error;
+	rc = sd_schemeadd(&c, r, SI_SCHEME_VALUE_LOG_THRESHOLD, SS_U32,
+	                  &s->value_log_threshold,
+	                  sizeof(s->value_log_threshold));
+	if (ssunlikely(rc == -1))
+		goto error;
 	rc = sd_schemeadd(&c, r, SI_SCHEME_COMPRESSION, SS_STRING,
 	                  s->compression_if->name,
 	                  strlen(s->compression_if->name) + 1);
@@ -25160,14 +32470,54 @@ int si_schemedeploy(sischeme *s, sr *r)
 	                  &s->expire, sizeof(s->expire));
 	if (ssunlikely(rc == -1))
 		goto error;
+	char *upsert = sf_upsertname(&s->upsert);
+	rc = sd_schemeadd(&c, r, SI_SCHEME_UPSERT, SS_STRING,
+	                  upsert, strlen(upsert) + 1);
+	if (ssunlikely(rc == -1))
+		goto error;
+	rc = sd_schemeadd(&c, r, SI_SCHEME_UPSERT_LIMIT, SS_U32,
+	                  &s->upsert.limit, sizeof(s->upsert.limit));
+	if (ssunlikely(rc == -1))
+		goto error;
+	/* every dictionary version: u32 id, data */
+	int i = 0;
+	while (i < s->compression_dict.count) {
+		ssdict *dict = &s->compression_dict.dict[i];
+		rc = ss_bufadd(&buf, r->a, &dict->id, sizeof(dict->id));
+		if (ssunlikely(rc == -1))
+			goto error;
+		rc = ss_bufadd(&buf, r->a, dict->data, dict->size);
+		if (ssunlikely(rc == -1))
+			goto error;
+		rc = sd_schemeadd(&c, r, SI_SCHEME_COMPRESSION_DICT, SS_STRING,
+		                  buf.s, ss_bufused(&buf));
+		if (ssunlikely(rc == -1))
+			goto error;
+		ss_bufreset(&buf);
+		i++;
+	}
+	ss_buffree(&buf, r->a);
 	rc = sd_schemecommit(&c, r);
 	if (ssunlikely(rc == -1))
 		return -1;
+	/* the scheme is rewritten when a dictionary is added,
+	 * replace it atomically */
 	char path[PATH_MAX];
+	char path_incomplete[PATH_MAX];
 	snprintf(path, sizeof(path), "%s/scheme", s->path);
-	rc = sd_schemewrite(&c, r, path, 0);
+	snprintf(path_incomplete, sizeof(path_incomplete), "%s/scheme.incomplete",
+	         s->path);
+	rc = sd_schemewrite(&c, r, path_incomplete, s->compression_dict.count > 0);
 	sd_schemefree(&c, r);
-	return rc;
+	if (ssunlikely(rc == -1))
+		return -1;
+	rc = ss_vfsrename(r->vfs, path_incomplete, path);
+	if (ssunlikely(rc == -1)) {
+		sr_error(r->e, "scheme file '%s' rename error: %s",
+		         path, strerror(errno));
+		return -1;
+	}
+	return 0;
 error:
 	ss_buffree(&buf, r->a);
 	sd_schemefree(&c, r);
@@ -25206,8 +32556,14 @@ int si_schemerecover(sischeme *s, sr *r)
 			break;
 		}
 		case SI_SCHEME_SCHEME: {
+			/* the user comparator is not part of the
+			 * stored scheme */
+			sfcmpf cmp = s->scheme.cmp;
+			void *cmparg = s->scheme.cmparg;
 			sf_schemefree(&s->scheme, r->a);
 			sf_schemeinit(&s->scheme);
+			sf_schemeset_comparator(&s->scheme, cmp);
+			sf_schemeset_comparatorarg(&s->scheme, cmparg);
 			ssbuf buf;
 			ss_bufinit(&buf);
 			rc = sf_schemeload(&s->scheme, r->a, sd_schemesz(opt), opt->size);
@@ -25225,6 +32581,12 @@ int si_schemerecover(sischeme *s, sr *r)
 		case SI_SCHEME_NODE_PAGE_SIZE:
 			s->compaction.node_page_size = sd_schemeu32(opt);
 			break;
+		case SI_SCHEME_NODE_PAGE_PREFIX:
+			s->compaction.node_page_prefix = sd_schemeu32(opt);
+			break;
+		case SI_SCHEME_VALUE_LOG_THRESHOLD:
+			s->value_log_threshold = sd_schemeu32(opt);
+			break;
 		case SI_SCHEME_COMPRESSION: {
 			char *name = sd_schemesz(opt);
 			ssfilterif *cif = ss_filterof(name);
@@ -25241,6 +32603,36 @@ int si_schemerecover(sischeme *s, sr *r)
 		case SI_SCHEME_EXPIRE:
 			s->expire = sd_schemeu32(opt);
 			break;
+		case SI_SCHEME_UPSERT: {
+			/* upsert statements stored on disk must be applied by
+			 * the operator they were written with */
+			char *name = sd_schemesz(opt);
+			if (strcmp(name, "none") == 0)
+				break;
+			rc = sf_upsertop(&s->upsert, &s->scheme, name);
+			if (ssunlikely(rc == -1))
+				goto error;
+			ss_free(r->a, s->upsert_sz);
+			s->upsert_sz = ss_strdup(r->a, name);
+			if (ssunlikely(s->upsert_sz == NULL))
+				goto error;
+			break;
+		}
+		case SI_SCHEME_UPSERT_LIMIT:
+			s->upsert.limit = sd_schemeu32(opt);
+			break;
+		case SI_SCHEME_COMPRESSION_DICT: {
+			if (ssunlikely(opt->size <= sizeof(uint32_t)))
+				goto error;
+			char *p = sd_schemesz(opt);
+			uint32_t id;
+			memcpy(&id, p, sizeof(id));
+			rc = ss_dictsetadd(&s->compression_dict, r->a, id,
+			                   p + sizeof(id), opt->size - sizeof(id));
+			if (ssunlikely(rc == -1))
+				goto error;
+			break;
+		}
 		default: /* skip unknown */
 			break;
 		}
@@ -25326,7 +32718,13 @@ static inline int si_set(sitx *x, svv *v)
 	svindex *vindex = si_nodeindex(node);
 	svindexpos pos;
 	sv_indexget(vindex, &index->r, &pos, v);
-	sv_indexupdate(vindex, &index->r, &pos, v);
+	int rc = sv_indexupdate(vindex, &index->r, &pos, v);
+	if (ssunlikely(rc == -1)) {
+		/* the statement is already in the log, it
+		 * is recovered on the next open */
+		si_gcv(&index->r, v);
+		return sr_oom_malfunction(index->r.e);
+	}
 	/* update node */
 	node->used += sv_vsize(v, &index->r);
 	si_txtrack(x, node);
@@ -25358,6 +32756,16 @@ next:
 	}
 	return;
 }
+
+void si_writerecover(sitx *x, svv *v)
+{
+	sr *r = &x->index->r;
+	if (si_readcommited(x->index, r, v)) {
+		si_gcv(r, v);
+		return;
+	}
+	si_set(x, v);
+}
 #line 1 "sophia/repository/sy_conf.h"
 #ifndef SY_CONF_H_
 #define SY_CONF_H_
@@ -25656,11 +33064,18 @@ enum {
 };
 
 struct scdb {
+	ssmutex   lock;
 	uint32_t  workers[SC_QMAX];
 	si       *index;
+	/* zone */
+	uint32_t  active;
+	uint32_t  backlog;
+	uint64_t  score;
 	/* state */
 	uint32_t  expire;
 	uint64_t  expire_time;
+	uint64_t  expire_drop;
+	uint64_t  expire_rewrite;
 	uint64_t  gc_time;
 	uint32_t  gc;
 	uint32_t  backup;
@@ -25682,6 +33097,7 @@ struct sctask {
 
 struct sc {
 	ssmutex       lock;
+	ssmutex       range_lock;
 	uint32_t      prio[SC_QMAX];
 	/* backup state */
 	uint32_t      backup_bsn;
@@ -25692,7 +33108,7 @@ struct sc {
 	char         *backup_path;
 	/* index */
 	int           rotate;
-	int           rr;
+	uint32_t      rr;
 	int           count;
 	scdb         *i;
 	/* pools */
@@ -25750,10 +33166,10 @@ sc_profiler(sc *s, scprofiler *p, si *index)
 		memset(&p->state, 0, sizeof(p->state));
 		return;
 	}
-	ss_mutexlock(&s->lock);
 	scdb *db = sc_of(s, index);
+	ss_mutexlock(&db->lock);
 	p->state = *db;
-	ss_mutexunlock(&s->lock);
+	ss_mutexunlock(&db->lock);
 }
 
 #endif
@@ -25770,6 +33186,7 @@ sc_profiler(sc *s, scprofiler *p, si *index)
 */
 
 int sc_commit(sc*, svlog*, uint64_t, int);
+int sc_commitrange(sc*, svlog*, si*);
 
 #endif
 #line 1 "sophia/scheduler/sc_step.h"
@@ -25786,18 +33203,6 @@ int sc_commit(sc*, svlog*, uint64_t, int);
 
 int sc_step(sc*, scworker*, uint64_t);
 
-static inline scdb*
-sc_current(sc *s) {
-	return &s->i[s->rr];
-}
-
-static inline void
-sc_next(sc *s) {
-	s->rr++;
-	if (s->rr >= s->count)
-		s->rr = 0;
-}
-
 static inline void
 sc_task_checkpoint(scdb *db, uint64_t vlsn)
 {
@@ -25940,6 +33345,7 @@ int sc_backupbegin(sc *s)
 	 * b. create database directories
 	 * c. create log directory
 	*/
+	sr_backupreset(s->r->backup);
 	char path[1024];
 	snprintf(path, sizeof(path), "%s/%" PRIu32 ".incomplete",
 	         s->backup_path, s->backup_bsn);
@@ -25977,21 +33383,70 @@ int sc_backupbegin(sc *s)
 	s->backup_in_progress = s->count;
 	i = 0;
 	while (i < s->count) {
-		sc_task_backup(&s->i[i]);
+		scdb *db = &s->i[i];
+		ss_mutexlock(&db->lock);
+		sc_task_backup(db);
+		ss_mutexunlock(&db->lock);
 		i++;
 	}
 	ss_mutexunlock(&s->lock);
 	return 0;
 }
 
+static inline int
+sc_backupmanifest(sc *s)
+{
+	/* list of files in the backup, with the way they
+	 * were made: copied, or hard-linked to the live files
+	 * by an incremental backup */
+	srbackup *b = s->r->backup;
+	char path[1024];
+	snprintf(path, sizeof(path), "%s/%" PRIu32 ".incomplete/manifest",
+	         s->backup_path, s->backup_bsn);
+	char header[128];
+	int len = snprintf(header, sizeof(header),
+	                   "# sophia backup %" PRIu32 " %s\n",
+	                   s->backup_bsn,
+	                   b->incremental ? "incremental" : "full");
+	ssfile file;
+	ss_fileinit(&file, s->r->vfs);
+	int rc = ss_filenew(&file, path, 0);
+	if (ssunlikely(rc == -1)) {
+		sr_error(s->r->e, "backup manifest '%s' create error: %s",
+		         path, strerror(errno));
+		return -1;
+	}
+	ss_mutexlock(&b->lock);
+	rc = ss_filewrite(&file, header, len);
+	if (sslikely(rc != -1))
+		rc = ss_filewrite(&file, b->manifest.s, ss_bufused(&b->manifest));
+	ss_mutexunlock(&b->lock);
+	if (sslikely(rc != -1))
+		rc = ss_filesync(&file);
+	if (ssunlikely(rc == -1)) {
+		sr_error(s->r->e, "backup manifest '%s' write error: %s",
+		         path, strerror(errno));
+		ss_fileclose(&file);
+		return -1;
+	}
+	rc = ss_fileclose(&file);
+	if (ssunlikely(rc == -1)) {
+		sr_error(s->r->e, "backup manifest '%s' close error: %s",
+		         path, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
 int sc_backupend(sc *s, scworker *w)
 {
 	/*
 	 * a. rotate log file
 	 * b. copy log files
-	 * c. enable log gc
-	 * d. rename <bsn.incomplete> into <bsn>
-	 * e. set last backup, set COMPLETE
+	 * c. write manifest
+	 * d. enable log gc
+	 * e. rename <bsn.incomplete> into <bsn>
+	 * f. set last backup, set COMPLETE
 	 */
 
 	/* force log rotation */
@@ -26010,6 +33465,12 @@ int sc_backupend(sc *s, scworker *w)
 	if (ssunlikely(rc == -1))
 		return -1;
 
+	/* write manifest */
+	ss_trace(&w->trace, "%s", "backup manifest");
+	rc = sc_backupmanifest(s);
+	if (ssunlikely(rc == -1))
+		return -1;
+
 	/* complete backup */
 	snprintf(path, sizeof(path), "%s/%" PRIu32 ".incomplete",
 	         s->backup_path, s->backup_bsn);
@@ -26070,6 +33531,7 @@ int sc_backupstop(sc *s)
 int sc_init(sc *s, sr *r, swmanager *wm)
 {
 	ss_mutexinit(&s->lock);
+	ss_mutexinit(&s->range_lock);
 	/* task priorities */
 	s->prio[SC_QGC]             = 1;
 	s->prio[SC_QEXPIRE]         = 1;
@@ -26117,6 +33579,7 @@ int sc_set(sc *s, uint32_t count)
 	memset(list, 0, size);
 	uint32_t i = 0;
 	while (i < count) {
+		ss_mutexinit(&list[i].lock);
 		sc_prepare(&list[i]);
 		i++;
 	}
@@ -26147,10 +33610,16 @@ int sc_shutdown(sc *s)
 	if (ssunlikely(rc == -1))
 		rcret = -1;
 	if (s->i) {
+		int i = 0;
+		while (i < s->count) {
+			ss_mutexfree(&s->i[i].lock);
+			i++;
+		}
 		ss_free(r->a, s->i);
 		s->i = NULL;
 	}
 	ss_mutexfree(&s->lock);
+	ss_mutexfree(&s->range_lock);
 	return rcret;
 }
 #line 1 "sophia/scheduler/sc_commit.c"
@@ -26200,6 +33669,28 @@ int sc_commit(sc *s, svlog *log, uint64_t lsn, int recover)
 	}
 	return 0;
 }
+
+int sc_commitrange(sc *s, svlog *log, si *index)
+{
+	/* range delete start and stop records are written to
+	 * the log and kept by the index. Range deletes are
+	 * registered in lsn order */
+	ss_mutexlock(&s->range_lock);
+	swtx tl;
+	sw_begin(s->wm, &tl, 0, 0);
+	int rc = sw_write(&tl, log);
+	if (ssunlikely(rc == -1)) {
+		sw_rollback(&tl);
+		ss_mutexunlock(&s->range_lock);
+		return -1;
+	}
+	sw_commit(&tl);
+	svlogv *start = sv_logat(log, 0);
+	svlogv *stop  = sv_logat(log, 1);
+	rc = si_rangeadd(index, start->v, stop->v);
+	ss_mutexunlock(&s->range_lock);
+	return rc;
+}
 #line 1 "sophia/scheduler/sc_ctl.c"
 
 /*
@@ -26256,28 +33747,28 @@ int sc_ctl_compaction(sc *s, uint64_t vlsn, si *index)
 
 int sc_ctl_expire(sc *s, si *index)
 {
-	ss_mutexlock(&s->lock);
 	scdb *db = sc_of(s, index);
+	ss_mutexlock(&db->lock);
 	sc_task_expire(db);
-	ss_mutexunlock(&s->lock);
+	ss_mutexunlock(&db->lock);
 	return 0;
 }
 
 int sc_ctl_gc(sc *s, si *index)
 {
-	ss_mutexlock(&s->lock);
 	scdb *db = sc_of(s, index);
+	ss_mutexlock(&db->lock);
 	sc_task_gc(db);
-	ss_mutexunlock(&s->lock);
+	ss_mutexunlock(&db->lock);
 	return 0;
 }
 
 int sc_ctl_checkpoint(sc *s, uint64_t vlsn, si *index)
 {
-	ss_mutexlock(&s->lock);
 	scdb *db = sc_of(s, index);
+	ss_mutexlock(&db->lock);
 	sc_task_checkpoint(db, vlsn);
-	ss_mutexunlock(&s->lock);
+	ss_mutexunlock(&db->lock);
 	return 0;
 }
 
@@ -26348,7 +33839,7 @@ sc_execute(sctask *t, scworker *w, uint64_t vlsn)
 static inline int
 sc_plan(sc *s, sctask *task, int id)
 {
-	scdb *db = sc_current(s);
+	scdb *db = task->db;
 	uint32_t prio = s->prio[id];
 	if (db->workers[id] >= prio)
 		return SI_PRETRY;
@@ -26371,8 +33862,14 @@ sc_taskbegin(sctask *task, scworker *w, uint64_t vlsn)
 static inline int
 sc_taskend(sc *s, sctask *t)
 {
-	ss_mutexlock(&s->lock);
+	if (t->rotate == 1)
+		s->rotate = 0;
 	scdb *db = t->db;
+	if (db == NULL)
+		return 0;
+	ss_mutexlock(&db->lock);
+	assert(db->active > 0);
+	db->active--;
 	switch (t->plan.plan) {
 	case SI_CHECKPOINT:
 	case SI_COMPACTION:
@@ -26384,16 +33881,21 @@ sc_taskend(sc *s, sctask *t)
 		break;
 	case SI_EXPIRE:
 		db->workers[SC_QEXPIRE]--;
+		if (t->plan.b)
+			db->expire_drop++;
+		else
+			db->expire_rewrite++;
 		t->gc = 1;
 		break;
 	case SI_GC:
 		db->workers[SC_QGC]--;
 		t->gc = 1;
 		break;
+	case SI_RANGE:
+		t->gc = 1;
+		break;
 	}
-	if (t->rotate == 1)
-		s->rotate = 0;
-	ss_mutexunlock(&s->lock);
+	ss_mutexunlock(&db->lock);
 	return 0;
 }
 
@@ -26458,9 +33960,10 @@ sc_do(sc *s, sctask *task)
 		 *
 		 * a. rotate log file
 		 * b. copy log files
-		 * c. enable log gc, schedule gc
-		 * d. rename <bsn.incomplete> into <bsn>
-		 * e. set last backup, set COMPLETE
+		 * c. write manifest
+		 * d. enable log gc, schedule gc
+		 * e. rename <bsn.incomplete> into <bsn>
+		 * f. set last backup, set COMPLETE
 		 *
 		*/
 
@@ -26471,14 +33974,12 @@ sc_do(sc *s, sctask *task)
 		switch (rc) {
 		case SI_PMATCH:
 			db->workers[SC_QBACKUP]++;
-			task->db = db;
 			return SI_PMATCH;
 		case SI_PNONE:
-			sc_task_backup_done(task->db);
+			sc_task_backup_done(db);
 			assert(s->backup_in_progress > 0);
-			s->backup_in_progress--;
 			/* state 3 */
-			if (s->backup_in_progress == 0)
+			if (__sync_sub_and_fetch(&s->backup_in_progress, 1) == 0)
 				task->backup = 1;
 			break;
 		case SI_PRETRY:
@@ -26521,6 +34022,13 @@ sc_do(sc *s, sctask *task)
 		}
 	}
 
+	/* range deletes */
+	task->plan.plan = SI_RANGE;
+	task->plan.a = task->vlsn;
+	rc = si_plan(db->index, &task->plan);
+	if (rc == SI_PMATCH)
+		return SI_PMATCH;
+
 	/* compaction */
 	task->plan.plan = SI_COMPACTION;
 	rc = si_plan(db->index, &task->plan);
@@ -26532,15 +34040,8 @@ sc_do(sc *s, sctask *task)
 }
 
 static inline void
-sc_periodic(sc *s, sctask *task)
+sc_periodic(scdb *db, sctask *task)
 {
-	/* log rotation */
-	if (s->rotate == 0) {
-		task->rotate = 1;
-		s->rotate = 1;
-	}
-
-	scdb *db = task->db;
 	sicompaction *c = &db->index->scheme.compaction;
 
 	/* expire */
@@ -26555,17 +34056,98 @@ sc_periodic(sc *s, sctask *task)
 	}
 }
 
+static inline int
+sc_zonefull(scdb *db)
+{
+	uint32_t workers = db->index->scheme.compaction.workers;
+	return workers > 0 && db->active >= workers;
+}
+
+static inline void
+sc_score(scdb *db, sctask *task)
+{
+	/* weighted backlog of a zone: the biggest in-memory
+	 * index relative to its compaction watermark, plus
+	 * pending tasks, split between running workers */
+	uint32_t backlog = si_planbacklog(db->index);
+	sicompaction *c = &db->index->scheme.compaction;
+	ss_mutexlock(&db->lock);
+	sc_periodic(db, task);
+	db->backlog = backlog;
+	db->score = 0;
+	if (! sc_zonefull(db)) {
+		uint64_t pending = db->checkpoint + db->backup +
+		                   db->expire + db->gc +
+		                   (db->index->gc_count > 0) +
+		                   (db->index->ranges != NULL);
+		if (backlog < 100)
+			backlog = 0;
+		uint64_t score = backlog + pending * 100;
+		uint32_t weight = c->weight;
+		if (ssunlikely(weight == 0))
+			weight = 1;
+		db->score = (score * weight) / (1 + db->active);
+	}
+	ss_mutexunlock(&db->lock);
+}
+
+static inline siplannerrc
+sc_zone(sc *s, scdb *db, sctask *task)
+{
+	siplannerrc rc = SI_PNONE;
+	ss_mutexlock(&db->lock);
+	if (! sc_zonefull(db)) {
+		task->db = db;
+		rc = sc_do(s, task);
+		if (rc == SI_PMATCH)
+			db->active++;
+		else
+			task->db = NULL;
+	}
+	ss_mutexunlock(&db->lock);
+	return rc;
+}
+
 static int
 sc_schedule(sc *s, sctask *task)
 {
-	int rc;
-	ss_mutexlock(&s->lock);
-	task->db = sc_current(s);
-	sc_periodic(s, task);
-	rc = sc_do(s, task);
-	sc_next(s);
-	ss_mutexunlock(&s->lock);
-	return rc;
+	/* log rotation */
+	if (s->rotate == 0 && __sync_bool_compare_and_swap(&s->rotate, 0, 1))
+		task->rotate = 1;
+	if (ssunlikely(s->count == 0))
+		return SI_PNONE;
+
+	/* pick a zone with the highest score, each zone is
+	 * guarded by its own lock */
+	uint32_t start = __sync_fetch_and_add(&s->rr, 1);
+	scdb *match = NULL;
+	int i = 0;
+	while (i < s->count) {
+		scdb *db = &s->i[(start + i) % s->count];
+		sc_score(db, task);
+		if (db->score > 0 && (match == NULL || db->score > match->score))
+			match = db;
+		i++;
+	}
+	if (match == NULL)
+		return SI_PNONE;
+	int rc = sc_zone(s, match, task);
+	if (rc == SI_PMATCH)
+		return rc;
+
+	/* nothing to do right now (nodes are locked by other
+	 * workers), try the rest in turn */
+	i = 0;
+	while (i < s->count) {
+		scdb *db = &s->i[(start + i) % s->count];
+		if (db != match && db->score > 0) {
+			rc = sc_zone(s, db, task);
+			if (rc == SI_PMATCH)
+				return rc;
+		}
+		i++;
+	}
+	return SI_PNONE;
 }
 
 int sc_step(sc *s, scworker *w, uint64_t vlsn)
@@ -26708,7 +34290,9 @@ enum {
 	SEDOCUMENT,
 	SEDB,
 	SETX,
-	SECURSOR
+	SECURSOR,
+	SELOADER,
+	SESNAPSHOT
 };
 
 extern sotype se_o[];
@@ -26720,7 +34304,7 @@ se_cast_validate(void *ptr)
 {
 	so *o = ptr;
 	if ((char*)o->type >= (char*)&se_o[0] &&
-	    (char*)o->type <= (char*)&se_o[SECURSOR])
+	    (char*)o->type <= (char*)&se_o[SESNAPSHOT])
 		return ptr;
 	return NULL;
 }
@@ -26752,8 +34336,17 @@ struct seconfrt {
 	uint32_t backup_active;
 	uint32_t backup_last;
 	uint32_t backup_last_complete;
+	uint32_t backup_databases;
+	uint32_t backup_files_copied;
+	uint32_t backup_files_linked;
+	uint64_t backup_bytes_copied;
+	uint64_t backup_bytes_linked;
+	uint32_t compaction_rate;
+	uint64_t compaction_wait;
 	/* log */
 	uint32_t log_files;
+	char     log_write_hist[128];
+	char     log_sync_hist[128];
 	/* metric */
 	srseq    seq;
 	/* transaction */
@@ -26762,10 +34355,21 @@ struct seconfrt {
 	uint32_t tx_rw;
 	uint32_t tx_gc;
 	uint64_t tx_vlsn;
+	char     tx_commit_hist[128];
+	/* memory */
+	uint64_t page_cache_used;
+	uint64_t allocator_footprint;
+	uint64_t allocator_used;
+	uint64_t allocator_slabs;
 };
 
 struct seconf {
 	uint32_t  threads;
+	uint32_t  recover_threads;
+	uint32_t  compression_threads;
+	uint32_t  io_uring;
+	char     *allocator;
+	ssaif    *allocator_if;
 	sfscheme  scheme;
 	int       confmax;
 	srconf   *conf;
@@ -26826,8 +34430,17 @@ so *se_confcursor_new(so*);
  * BSD License
 */
 
+typedef struct serecoverstat serecoverstat;
 typedef struct se se;
 
+/* time spent in each recovery phase, in microseconds */
+struct serecoverstat {
+	uint64_t repository;
+	uint64_t databases;
+	uint64_t log;
+	uint64_t log_records;
+};
+
 struct se {
 	so           o;
 	srstatus     status;
@@ -26835,6 +34448,8 @@ struct se {
 	sopool       document;
 	sopool       cursor;
 	sopool       tx;
+	sopool       loader;
+	sopool       snapshot;
 	sopool       confcursor;
 	sopool       confcursor_kv;
 	solist       db;
@@ -26843,6 +34458,8 @@ struct se {
 	ssvfs        vfs;
 	ssa          a_oom;
 	ssa          a;
+	ssa          av;
+	sdpagecache  pagecache;
 	sicachepool  cachepool;
 	syconf      *rep_conf;
 	sy           rep;
@@ -26854,7 +34471,12 @@ struct se {
 	srlog        log;
 	srerror      error;
 	ssinjection  ei;
+	srrate       rate;
+	srbackup     backup;
+	ssjobq       compress;
+	sshist       hist_commit;
 	sr           r;
+	serecoverstat recover;
 };
 
 static inline int
@@ -26872,6 +34494,26 @@ se_apiunlock(so *o) {
 	ss_mutexunlock(&((se*)o)->apilock);
 }
 
+/* with group commit a transaction is written to the log
+ * under the api lock, but its sync is waited for after
+ * the lock is released, so concurrent committers can
+ * share one sync */
+static inline uint64_t
+se_apilock_write(so *o) {
+	se_apilock(o);
+	return sw_managerwsn(&((se*)o)->wm);
+}
+
+static inline int
+se_apiunlock_write(so *o, uint64_t wsn) {
+	swmanager *wm = &((se*)o)->wm;
+	uint64_t wsn_commit = sw_managerwsn(wm);
+	se_apiunlock(o);
+	if (sslikely(wsn_commit == wsn))
+		return 0;
+	return sw_managersync(wm, wsn_commit);
+}
+
 static inline se *se_of(so *o) {
 	return (se*)o->env;
 }
@@ -26910,6 +34552,11 @@ struct sedocument {
 	/* recover */
 	void     *raw;
 	void     *log;
+	/* point lookup without node file reads */
+	int       cache_only;
+	int       cache_miss;
+	/* range delete */
+	sedocument *range_stop;
 	/* stats */
 	int       read_disk;
 	int       read_cache;
@@ -26963,14 +34610,14 @@ struct sedb {
 	sischeme  *scheme;
 	si        *index;
 	sr        *r;
-	ssa        a;
 	sxindex    coindex;
 	sflimit    limit;
 	srstat     stat;
 	srstat     statrt;
+	sshist     hist[SR_HMAX];
 };
 
-int  se_dbopen(so*);
+int  se_dbopen(so*, ssjobq*);
 int  se_dbdestroy(so*);
 so  *se_dbnew(se*, char*, int);
 so  *se_dbmatch(se*, char*);
@@ -27014,8 +34661,14 @@ so *se_txnew(se*);
  * BSD License
 */
 
+typedef struct secursorcache secursorcache;
 typedef struct secursor secursor;
 
+struct secursorcache {
+	sedb    *db;
+	sicache *cache;
+};
+
 struct secursor {
 	so       o;
 	svlog    log;
@@ -27026,10 +34679,59 @@ struct secursor {
 	int      read_cache;
 	sedb    *read_db;
 	sicache *cache;
+	/* node caches of other databases read by the
+	 * cursor (secursorcache) */
+	ssbuf    caches;
 };
 
 so *se_cursornew(se*, uint64_t);
 
+#endif
+#line 1 "sophia/environment/se_loader.h"
+#ifndef SE_LOADER_H_
+#define SE_LOADER_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct seloader seloader;
+
+struct seloader {
+	so      o;
+	sedb   *db;
+	siload  l;
+};
+
+so *se_loadernew(sedb*);
+
+#endif
+#line 1 "sophia/environment/se_snapshot.h"
+#ifndef SE_SNAPSHOT_H_
+#define SE_SNAPSHOT_H_
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+typedef struct sesnapshot sesnapshot;
+
+struct sesnapshot {
+	so    o;
+	svlog log;
+	sx    t;
+};
+
+so *se_snapshotnew(se*);
+
 #endif
 #line 1 "sophia/environment/se_read.h"
 #ifndef SE_READ_H_
@@ -27044,6 +34746,7 @@ so *se_cursornew(se*, uint64_t);
 */
 
 so *se_read(sedb*, sedocument*, sx*, uint64_t, sicache*);
+int se_readv(se*, sedocument**, int, sx*, uint64_t);
 
 #endif
 #line 1 "sophia/environment/se_recover.h"
@@ -27058,6 +34761,7 @@ so *se_read(sedb*, sedocument*, sx*, uint64_t, sicache*);
  * BSD License
 */
 
+int se_recoverdb(se*);
 int se_recover(se*);
 
 #endif
@@ -27139,21 +34843,44 @@ se_open(so *o)
 	if (ssunlikely(rc == -1))
 		return -1;
 
+	/* switch to io_uring vfs, keep the regular one on
+	 * kernels without io_uring support */
+	if (e->conf.io_uring) {
+		rc = -1;
+		if (e->ei.io == 0) {
+			ss_vfsfree(&e->vfs);
+			rc = ss_vfsinit(&e->vfs, &ss_uringvfs);
+			if (ssunlikely(rc == -1))
+				ss_vfsinit(&e->vfs, &ss_stdvfs);
+		}
+		if (ssunlikely(rc == -1)) {
+			sr_log(&e->log, "io_uring is not available, using regular io");
+			e->conf.io_uring = 0;
+		}
+	}
+
+	/* prepare versions allocator */
+	if (e->conf.allocator_if) {
+		rc = ss_aopen(&e->av, e->conf.allocator_if, &e->a);
+		if (ssunlikely(rc == -1))
+			return sr_oom(&e->error);
+	} else {
+		e->av = e->a;
+	}
+
 	/* repository recover */
 	sr_log(&e->log, "recovering repository '%s'",
 	       e->rep_conf->path);
+	uint64_t start = ss_utime();
 	rc = sy_open(&e->rep, &e->r);
 	if (ssunlikely(rc == -1))
 		return -1;
+	e->recover.repository = ss_utime() - start;
 
 	/* databases recover */
-	sslist *i;
-	ss_listforeach(&e->db.list, i) {
-		so *o = sscast(i, so, link);
-		rc = se_dbopen(o);
-		if (ssunlikely(rc == -1))
-			return -1;
-	}
+	rc = se_recoverdb(e);
+	if (ssunlikely(rc == -1))
+		return -1;
 
 	/* recover logpool */
 	rc = se_recover(e);
@@ -27162,6 +34889,11 @@ se_open(so *o)
 
 	sr_statusset(&e->status, SR_ONLINE);
 
+	/* run compression pool */
+	rc = ss_jobqstart(&e->compress, &e->a, e->conf.compression_threads);
+	if (ssunlikely(rc == -1))
+		return -1;
+
 	/* run thread-pool and scheduler */
 	rc = sc_run(&e->scheduler, se_worker, e, e->conf.threads);
 	if (ssunlikely(rc == -1))
@@ -27180,9 +34912,15 @@ se_destroy(so *o)
 	if (ssunlikely(rc == -1))
 		rcret = -1;
 	rc = so_pooldestroy(&e->cursor);
+	if (ssunlikely(rc == -1))
+		rcret = -1;
+	rc = so_pooldestroy(&e->snapshot);
 	if (ssunlikely(rc == -1))
 		rcret = -1;
 	rc = so_pooldestroy(&e->tx);
+	if (ssunlikely(rc == -1))
+		rcret = -1;
+	rc = so_pooldestroy(&e->loader);
 	if (ssunlikely(rc == -1))
 		rcret = -1;
 	rc = so_pooldestroy(&e->confcursor_kv);
@@ -27202,18 +34940,28 @@ se_destroy(so *o)
 	if (ssunlikely(rc == -1))
 		rcret = -1;
 	rc = sw_managershutdown(&e->wm);
+	if (ssunlikely(rc == -1))
+		rcret = -1;
+	rc = ss_jobqshutdown(&e->compress, &e->a);
 	if (ssunlikely(rc == -1))
 		rcret = -1;
 	rc = sy_close(&e->rep, &e->r);
 	if (ssunlikely(rc == -1))
 		rcret = -1;
 	sx_managerfree(&e->xm);
+	/* versions allocator is a copy of the common one,
+	 * unless it has been opened on its own */
+	if (e->av.i != e->a.i)
+		ss_aclose(&e->av);
 	ss_vfsfree(&e->vfs);
 	si_cachepool_free(&e->cachepool);
+	sd_pagecache_free(&e->pagecache);
 	se_conffree(&e->conf);
 	ss_mutexfree(&e->apilock);
 
 	sr_seqfree(&e->seq);
+	sr_ratefree(&e->rate);
+	sr_backupfree(&e->backup, &e->a);
 	sr_statusfree(&e->status);
 	so_mark_destroyed(&e->o);
 	free(e);
@@ -27234,6 +34982,15 @@ se_cursor(so *o)
 	return se_cursornew(e, UINT64_MAX);
 }
 
+static void*
+se_getobject(so *o, const char *path)
+{
+	se *e = se_cast(o, se*, SE);
+	if (path && strcmp(path, "snapshot") == 0)
+		return se_snapshotnew(e);
+	return se_confget_object(o, path);
+}
+
 static soif seif =
 {
 	.open         = se_open,
@@ -27242,13 +34999,18 @@ static soif seif =
 	.document     = NULL,
 	.setstring    = se_confset_string,
 	.setint       = se_confset_int,
-	.getobject    = se_confget_object,
+	.getobject    = se_getobject,
 	.getstring    = se_confget_string,
 	.getint       = se_confget_int,
+	.setfield     = NULL,
+	.setfieldint  = NULL,
+	.getfield     = NULL,
+	.getfieldint  = NULL,
 	.set          = NULL,
 	.upsert       = NULL,
 	.del          = NULL,
 	.get          = NULL,
+	.getv         = NULL,
 	.begin        = se_begin,
 	.prepare      = NULL,
 	.commit       = NULL,
@@ -27266,6 +35028,7 @@ so *se_new(void)
 	sr_statusset(&e->status, SR_OFFLINE);
 	ss_vfsinit(&e->vfs, &ss_stdvfs);
 	ss_aopen(&e->a, &ss_stda);
+	e->av = e->a;
 	int rc;
 	rc = se_confinit(&e->conf, &e->o);
 	if (ssunlikely(rc == -1))
@@ -27273,6 +35036,8 @@ so *se_new(void)
 	so_poolinit(&e->document, 1024);
 	so_poolinit(&e->cursor, 512);
 	so_poolinit(&e->tx, 512);
+	so_poolinit(&e->loader, 0);
+	so_poolinit(&e->snapshot, 64);
 	so_poolinit(&e->confcursor, 2);
 	so_poolinit(&e->confcursor_kv, 1);
 	so_listinit(&e->db);
@@ -27280,17 +35045,22 @@ so *se_new(void)
 	sr_seqinit(&e->seq);
 	sr_loginit(&e->log);
 	sr_errorinit(&e->error, &e->log);
+	sr_rateinit(&e->rate);
+	sr_backupinit(&e->backup);
+	ss_jobqinit(&e->compress);
+	ss_histinit(&e->hist_commit);
 	sscrcf crc = ss_crc32c_function();
-	sr_init(&e->r, &e->status, &e->log, &e->error, &e->a, NULL,
+	sr_init(&e->r, &e->status, &e->log, &e->error, &e->a, &e->av,
 	        &e->vfs, &e->seq, NULL, NULL,
-	        &e->ei, NULL, crc, NULL);
+	        &e->ei, NULL, &e->rate, &e->backup, &e->compress, crc, NULL);
 	sy_init(&e->rep);
 	e->rep_conf = sy_conf(&e->rep);
 	sw_managerinit(&e->wm, &e->r);
 	e->wm_conf = sw_conf(&e->wm);
 	sr_statxm_init(&e->xm_stat);
-	sx_managerinit(&e->xm, &e->seq, &e->a);
-	si_cachepool_init(&e->cachepool, &e->r);
+	sx_managerinit(&e->xm, &e->seq, &e->av);
+	sd_pagecache_init(&e->pagecache, &e->a);
+	si_cachepool_init(&e->cachepool, &e->r, &e->pagecache);
 	sc_init(&e->scheduler, &e->r, &e->wm);
 	return &e->o;
 error:
@@ -27427,6 +35197,7 @@ se_confsophia(se *e, seconfrt *rt, srconf **pc)
 	sr_C(&p, pc, se_confv, "errors", SS_U64, &rt->errors, SR_RO, NULL);
 	sr_C(&p, pc, se_confsophia_error, "error", SS_STRING, NULL, SR_RO, NULL);
 	sr_c(&p, pc, se_confv_offline, "path", SS_STRINGPTR, &e->rep_conf->path);
+	sr_c(&p, pc, se_confv_offline, "io_uring", SS_U32, &e->conf.io_uring);
 	sr_c(&p, pc, se_confsophia_on_log, "on_log", SS_STRING, NULL);
 	sr_c(&p, pc, se_confsophia_on_log_arg, "on_log_arg", SS_STRING, NULL);
 	return sr_C(NULL, pc, NULL, "sophia", SS_UNDEF, sophia, SR_NS, NULL);
@@ -27466,12 +35237,18 @@ se_confscheduler_run(srconf *c, srconfstmt *s)
 }
 
 static inline srconf*
-se_confscheduler(se *e, srconf **pc, int serialize)
+se_confscheduler(se *e, seconfrt *rt, srconf **pc, int serialize)
 {
 	srconf *scheduler = *pc;
 	srconf *prev;
 	srconf *p = NULL;
 	sr_c(&p, pc, se_confv_offline, "threads", SS_U32, &e->conf.threads);
+	sr_c(&p, pc, se_confv_offline, "recover_threads", SS_U32, &e->conf.recover_threads);
+	sr_c(&p, pc, se_confv_offline, "compression_threads", SS_U32, &e->conf.compression_threads);
+	sr_c(&p, pc, se_confv, "compaction_rate_mb", SS_U32, &e->rate.limit_mb);
+	sr_c(&p, pc, se_confv, "compaction_latency_us", SS_U32, &e->rate.latency);
+	sr_C(&p, pc, se_confv, "compaction_rate", SS_U32, &rt->compaction_rate, SR_RO, NULL);
+	sr_C(&p, pc, se_confv, "compaction_wait_us", SS_U64, &rt->compaction_wait, SR_RO, NULL);
 	if (! serialize)
 		sr_c(&p, pc, se_confscheduler_run, "run", SS_FUNCTION, NULL);
 	prev = p;
@@ -27514,9 +35291,13 @@ se_conflog(se *e, seconfrt *rt, srconf **pc)
 	sr_c(&p, pc, se_confv_offline, "sync", SS_U32, &e->wm_conf->sync_on_write);
 	sr_c(&p, pc, se_confv_offline, "rotate_wm", SS_U32, &e->wm_conf->rotatewm);
 	sr_c(&p, pc, se_confv_offline, "rotate_sync", SS_U32, &e->wm_conf->sync_on_rotate);
+	sr_c(&p, pc, se_confv_offline, "group_commit_max_batch", SS_U32, &e->wm_conf->group_commit_max_batch);
+	sr_c(&p, pc, se_confv_offline, "group_commit_max_wait_us", SS_U32, &e->wm_conf->group_commit_max_wait_us);
 	sr_c(&p, pc, se_conflog_rotate, "rotate", SS_FUNCTION, NULL);
 	sr_c(&p, pc, se_conflog_gc, "gc", SS_FUNCTION, NULL);
 	sr_C(&p, pc, se_confv, "files", SS_U32, &rt->log_files, SR_RO, NULL);
+	sr_C(&p, pc, se_confv, "write_hist", SS_STRING, rt->log_write_hist, SR_RO, NULL);
+	sr_C(&p, pc, se_confv, "sync_hist", SS_STRING, rt->log_sync_hist, SR_RO, NULL);
 	return sr_C(NULL, pc, NULL, "log", SS_UNDEF, log, SR_NS, NULL);
 }
 
@@ -27533,13 +35314,14 @@ se_conftransaction(se *e ssunused, seconfrt *rt, srconf **pc)
 	sr_C(&p, pc, se_confv, "lock", SS_U64, &rt->tx_stat.tx_lock, SR_RO, NULL);
 	sr_C(&p, pc, se_confv, "latency", SS_STRING, rt->tx_stat.tx_latency.sz, SR_RO, NULL);
 	sr_C(&p, pc, se_confv, "log", SS_STRING, rt->tx_stat.tx_stmts.sz, SR_RO, NULL);
+	sr_C(&p, pc, se_confv, "commit_hist", SS_STRING, rt->tx_commit_hist, SR_RO, NULL);
 	sr_C(&p, pc, se_confv, "vlsn", SS_U64, &rt->tx_vlsn, SR_RO, NULL);
 	sr_C(&p, pc, se_confv, "gc", SS_U32, &rt->tx_gc, SR_RO, NULL);
 	return sr_C(NULL, pc, NULL, "transaction", SS_UNDEF, xm, SR_NS, NULL);
 }
 
 static inline srconf*
-se_confmetric(se *e ssunused, seconfrt *rt, srconf **pc)
+se_confmetric(se *e, seconfrt *rt, srconf **pc)
 {
 	srconf *metric = *pc;
 	srconf *p = NULL;
@@ -27549,9 +35331,27 @@ se_confmetric(se *e ssunused, seconfrt *rt, srconf **pc)
 	sr_C(&p, pc, se_confv, "dsn",  SS_U32, &rt->seq.dsn, SR_RO, NULL);
 	sr_C(&p, pc, se_confv, "bsn",  SS_U32, &rt->seq.bsn, SR_RO, NULL);
 	sr_C(&p, pc, se_confv, "lfsn", SS_U64, &rt->seq.lfsn, SR_RO, NULL);
+	sr_C(&p, pc, se_confv, "recover_repository_us", SS_U64, &e->recover.repository, SR_RO, NULL);
+	sr_C(&p, pc, se_confv, "recover_databases_us", SS_U64, &e->recover.databases, SR_RO, NULL);
+	sr_C(&p, pc, se_confv, "recover_log_us", SS_U64, &e->recover.log, SR_RO, NULL);
+	sr_C(&p, pc, se_confv, "recover_log_records", SS_U64, &e->recover.log_records, SR_RO, NULL);
 	return sr_C(NULL, pc, NULL, "metric", SS_UNDEF, metric, SR_NS, NULL);
 }
 
+static inline srconf*
+se_confmemory(se *e, seconfrt *rt, srconf **pc)
+{
+	srconf *memory = *pc;
+	srconf *p = NULL;
+	sr_c(&p, pc, se_confv_offline, "page_cache_limit", SS_U64, &e->pagecache.limit);
+	sr_C(&p, pc, se_confv, "page_cache_used", SS_U64, &rt->page_cache_used, SR_RO, NULL);
+	sr_c(&p, pc, se_confv_offline, "allocator", SS_STRINGPTR, &e->conf.allocator);
+	sr_C(&p, pc, se_confv, "allocator_footprint", SS_U64, &rt->allocator_footprint, SR_RO, NULL);
+	sr_C(&p, pc, se_confv, "allocator_used", SS_U64, &rt->allocator_used, SR_RO, NULL);
+	sr_C(&p, pc, se_confv, "allocator_slabs", SS_U64, &rt->allocator_slabs, SR_RO, NULL);
+	return sr_C(NULL, pc, NULL, "memory", SS_UNDEF, memory, SR_NS, NULL);
+}
+
 static inline int
 se_confdb_set(srconf *c ssunused, srconfstmt *s)
 {
@@ -27671,6 +35471,29 @@ se_confdb_compaction(srconf *c, srconfstmt *s)
 	return sc_ctl_compaction(&e->scheduler, vlsn, db->index);
 }
 
+static inline int
+se_confdb_compression_train(srconf *c, srconfstmt *s)
+{
+	if (s->op != SR_WRITE)
+		return se_confv(c, s);
+	sedb *db = c->value;
+	se *e = se_of(&db->o);
+	if (ssunlikely(! sr_online(&e->status))) {
+		sr_error(&e->error, "%s", "database must be online to train compression");
+		return -1;
+	}
+	if (ssunlikely(db->index->scheme.compression_if != &ss_lz4dictfilter)) {
+		sr_error(&e->error, "%s", "compression is not lz4_dict");
+		return -1;
+	}
+	int rc = si_dicttrain(db->index, NULL);
+	if (ssunlikely(rc == 1)) {
+		sr_error(&e->error, "%s", "not enough in-memory data to train compression");
+		return -1;
+	}
+	return rc;
+}
+
 static inline int
 se_confdb_gc(srconf *c, srconfstmt *s)
 {
@@ -27800,7 +35623,10 @@ se_confdb(se *e, seconfrt *rt ssunused, srconf **pc, int serialize)
 		sr_C(&p, pc, se_confv_dboffline, "node_size", SS_U64, &o->scheme->compaction.node_size, 0, o);
 		sr_C(&p, pc, se_confv_dboffline, "page_size", SS_U32, &o->scheme->compaction.node_page_size, 0, o);
 		sr_C(&p, pc, se_confv_dboffline, "page_checksum", SS_U32, &o->scheme->compaction.node_page_checksum, 0, o);
+		sr_C(&p, pc, se_confv_dboffline, "page_prefix", SS_U32, &o->scheme->compaction.node_page_prefix, 0, o);
+		sr_C(&p, pc, se_confv_dboffline, "bloom_bits_per_key", SS_U32, &o->scheme->compaction.bloom_bits_per_key, 0, o);
 		sr_C(&p, pc, se_confv_dboffline, "expire_period", SS_U32, &o->scheme->compaction.expire_period, 0, o);
+		sr_C(&p, pc, se_confv_dboffline, "expire_wm", SS_U32, &o->scheme->compaction.expire_wm, 0, o);
 		sr_C(&p, pc, se_confv_dboffline, "gc_wm", SS_U32, &o->scheme->compaction.gc_wm, 0, o);
 		sr_C(&p, pc, se_confv_dboffline, "gc_period", SS_U32, &o->scheme->compaction.gc_period, 0, o);
 		if (! serialize) {
@@ -27839,6 +35665,16 @@ se_confdb(se *e, seconfrt *rt ssunused, srconf **pc, int serialize)
 		sr_C(&p, pc, se_confv, "cursor_read_disk", SS_STRING, o->statrt.cursor_read_disk.sz, SR_RO, NULL);
 		sr_C(&p, pc, se_confv, "cursor_read_cache", SS_STRING, o->statrt.cursor_read_cache.sz, SR_RO, NULL);
 		sr_C(&p, pc, se_confv, "cursor_ops", SS_STRING, o->statrt.cursor_ops.sz, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "get_hist", SS_STRING, o->hist[SR_HGET].sz, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "get_memory_hist", SS_STRING, o->hist[SR_HGET_MEMORY].sz, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "get_disk_hist", SS_STRING, o->hist[SR_HGET_DISK].sz, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "get_upsert_hist", SS_STRING, o->hist[SR_HGET_UPSERT].sz, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "set_hist", SS_STRING, o->hist[SR_HSET].sz, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "delete_hist", SS_STRING, o->hist[SR_HDELETE].sz, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "upsert_hist", SS_STRING, o->hist[SR_HUPSERT].sz, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "cursor_hist", SS_STRING, o->hist[SR_HCURSOR].sz, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "pread_hist", SS_STRING, o->hist[SR_HPREAD].sz, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "decompress_hist", SS_STRING, o->hist[SR_HDECOMPRESS].sz, SR_RO, NULL);
 
 		/* scheduler */
 		srconf *scheduler = *pc;
@@ -27846,7 +35682,13 @@ se_confdb(se *e, seconfrt *rt ssunused, srconf **pc, int serialize)
 		sr_C(&p, pc, se_confv, "checkpoint", SS_U32, &o->scp.state.checkpoint, SR_RO, NULL);
 		sr_C(&p, pc, se_confv, "gc", SS_U32, &o->scp.state.gc, SR_RO, NULL);
 		sr_C(&p, pc, se_confv, "expire", SS_U32, &o->scp.state.expire, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "expire_drop", SS_U64, &o->scp.state.expire_drop, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "expire_rewrite", SS_U64, &o->scp.state.expire_rewrite, SR_RO, NULL);
 		sr_C(&p, pc, se_confv, "backup", SS_U32, &o->scp.state.backup, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "weight", SS_U32, &o->scheme->compaction.weight, 0, o);
+		sr_C(&p, pc, se_confv, "workers", SS_U32, &o->scheme->compaction.workers, 0, o);
+		sr_C(&p, pc, se_confv, "active", SS_U32, &o->scp.state.active, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "backlog", SS_U32, &o->scp.state.backlog, SR_RO, NULL);
 
 		/* index */
 		srconf *index = *pc;
@@ -27858,8 +35700,14 @@ se_confdb(se *e, seconfrt *rt ssunused, srconf **pc, int serialize)
 		sr_C(&p, pc, se_confv, "count_dup", SS_U64, &o->rtp.count_dup, SR_RO, NULL);
 		sr_C(&p, pc, se_confv, "read_disk", SS_U64, &o->rtp.read_disk, SR_RO, NULL);
 		sr_C(&p, pc, se_confv, "read_cache", SS_U64, &o->rtp.read_cache, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "bloom_skip", SS_U64, &o->rtp.bloom_skip, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "bloom_false_positive", SS_U64, &o->rtp.bloom_false_positive, SR_RO, NULL);
 		sr_C(&p, pc, se_confv, "node_count", SS_U32, &o->rtp.total_node_count, SR_RO, NULL);
 		sr_C(&p, pc, se_confv, "page_count", SS_U32, &o->rtp.total_page_count, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "value_log_files", SS_U32, &o->rtp.value_log_files, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "value_log_size", SS_U64, &o->rtp.value_log_size, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "value_log_live", SS_U64, &o->rtp.value_log_live, SR_RO, NULL);
+		sr_C(&p, pc, se_confv, "range_deletes", SS_U32, &o->rtp.range_deletes, SR_RO, NULL);
 
 		/* scheme */
 		srconf *scheme = *pc;
@@ -27882,10 +35730,18 @@ se_confdb(se *e, seconfrt *rt ssunused, srconf **pc, int serialize)
 		sr_C(&p, pc, se_confv_dboffline, "sync", SS_U32, &o->scheme->sync, 0, o);
 		sr_C(&p, pc, se_confv_dboffline, "expire", SS_U32, &o->scheme->expire, 0, o);
 		sr_C(&p, pc, se_confv_dboffline, "compression", SS_STRINGPTR, &o->scheme->compression_sz, 0, o);
-		sr_C(&p, pc, se_confdb_upsert, "comparator", SS_STRING, NULL, 0, o);
-		sr_C(&p, pc, se_confdb_upsertarg, "comparator_arg", SS_STRING, NULL, 0, o);
+		sr_C(&p, pc, se_confv_dboffline, "compression_dict_size", SS_U32, &o->scheme->compression_dict_size, 0, o);
+		sr_C(&p, pc, se_confv_dboffline, "value_log_threshold", SS_U32, &o->scheme->value_log_threshold, 0, o);
+		sr_C(&p, pc, se_confv, "compression_dict", SS_U32, &o->rtp.compression_dict, SR_RO, NULL);
+		if (! serialize)
+			sr_c(&p, pc, se_confdb_compression_train, "compression_train", SS_FUNCTION, o);
+		sr_C(&p, pc, se_confv_dboffline, "memtable", SS_STRINGPTR, &o->scheme->memtable_sz, 0, o);
+		sr_C(&p, pc, se_confdb_comparator, "comparator", SS_STRING, NULL, 0, o);
+		sr_C(&p, pc, se_confdb_comparatorarg, "comparator_arg", SS_STRING, NULL, 0, o);
 		sr_C(&p, pc, se_confdb_upsert, "upsert", SS_STRING, NULL, 0, o);
 		sr_C(&p, pc, se_confdb_upsertarg, "upsert_arg", SS_STRING, NULL, 0, o);
+		sr_C(&p, pc, se_confv_dboffline, "upsert_operator", SS_STRINGPTR, &o->scheme->upsert_sz, 0, o);
+		sr_C(&p, pc, se_confv_dboffline, "upsert_limit", SS_U32, &o->scheme->upsert.limit, 0, o);
 
 		/* .. */
 		sr_C(&p, pc, NULL, "compaction", SS_UNDEF, compaction, SR_NS, o);
@@ -27921,9 +35777,15 @@ se_confbackup(se *e, seconfrt *rt, srconf **pc)
 	srconf *p = NULL;
 	sr_c(&p, pc, se_confv_offline, "path", SS_STRINGPTR, &e->rep_conf->path_backup);
 	sr_c(&p, pc, se_confbackup_run, "run", SS_FUNCTION, NULL);
+	sr_c(&p, pc, se_confv, "incremental", SS_U32, &e->backup.incremental);
 	sr_C(&p, pc, se_confv, "active", SS_U32, &rt->backup_active, SR_RO, NULL);
 	sr_c(&p, pc, se_confv, "last", SS_U32, &rt->backup_last);
 	sr_c(&p, pc, se_confv, "last_complete", SS_U32, &rt->backup_last_complete);
+	sr_C(&p, pc, se_confv, "databases", SS_U32, &rt->backup_databases, SR_RO, NULL);
+	sr_C(&p, pc, se_confv, "files_copied", SS_U32, &rt->backup_files_copied, SR_RO, NULL);
+	sr_C(&p, pc, se_confv, "files_linked", SS_U32, &rt->backup_files_linked, SR_RO, NULL);
+	sr_C(&p, pc, se_confv, "bytes_copied", SS_U64, &rt->backup_bytes_copied, SR_RO, NULL);
+	sr_C(&p, pc, se_confv, "bytes_linked", SS_U64, &rt->backup_bytes_linked, SR_RO, NULL);
 	return sr_C(NULL, pc, NULL, "backup", 0, backup, SR_NS, NULL);
 }
 
@@ -27981,9 +35843,10 @@ se_confprepare(se *e, seconfrt *rt, srconf *c, int serialize)
 	srconf *pc = c;
 	srconf *sophia      = se_confsophia(e, rt, &pc);
 	srconf *backup      = se_confbackup(e, rt, &pc);
-	srconf *scheduler   = se_confscheduler(e, &pc, serialize);
+	srconf *scheduler   = se_confscheduler(e, rt, &pc, serialize);
 	srconf *transaction = se_conftransaction(e, rt, &pc);
 	srconf *metric      = se_confmetric(e, rt, &pc);
+	srconf *memory      = se_confmemory(e, rt, &pc);
 	srconf *log         = se_conflog(e, rt, &pc);
 	srconf *db          = se_confdb(e, rt, &pc, serialize);
 	srconf *debug       = se_confdebug(e, rt, &pc);
@@ -27992,7 +35855,8 @@ se_confprepare(se *e, seconfrt *rt, srconf *c, int serialize)
 	backup->next      = scheduler;
 	scheduler->next   = transaction;
 	transaction->next = metric;
-	metric->next      = log;
+	metric->next      = memory;
+	memory->next      = log;
 	log->next         = db;
 	if (! serialize)
 		db->next = debug;
@@ -28021,13 +35885,31 @@ se_confrt(se *e, seconfrt *rt)
 
 	/* log */
 	rt->log_files = sw_managerfiles(&e->wm);
+	ss_histprepare(&e->wm.hist_write);
+	ss_histprepare(&e->wm.hist_sync);
+	memcpy(rt->log_write_hist, e->wm.hist_write.sz, sizeof(rt->log_write_hist));
+	memcpy(rt->log_sync_hist, e->wm.hist_sync.sz, sizeof(rt->log_sync_hist));
 
 	/* backup */
 	ss_mutexlock(&e->scheduler.lock);
 	rt->backup_active        = e->scheduler.backup;
 	rt->backup_last          = e->scheduler.backup_bsn_last;
 	rt->backup_last_complete = e->scheduler.backup_bsn_last_complete;
+	rt->backup_databases     = e->scheduler.backup_in_progress;
 	ss_mutexunlock(&e->scheduler.lock);
+	ss_mutexlock(&e->backup.lock);
+	rt->backup_files_copied  = e->backup.files_copied;
+	rt->backup_files_linked  = e->backup.files_linked;
+	rt->backup_bytes_copied  = e->backup.bytes_copied;
+	rt->backup_bytes_linked  = e->backup.bytes_linked;
+	ss_mutexunlock(&e->backup.lock);
+
+	/* compaction rate */
+	ss_spinlock(&e->rate.lock);
+	sr_ratesync(&e->rate, ss_utime());
+	rt->compaction_rate     = e->rate.rate_mb;
+	rt->compaction_wait     = e->rate.throttle;
+	ss_spinunlock(&e->rate.lock);
 
 	/* metric */
 	sr_seqlock(&e->seq);
@@ -28041,6 +35923,21 @@ se_confrt(se *e, seconfrt *rt)
 	rt->tx_rw   = e->xm.count_rw;
 	rt->tx_gc   = e->xm.count_gc;
 	rt->tx_vlsn = sx_vlsn(&e->xm);
+	ss_histprepare(&e->hist_commit);
+	memcpy(rt->tx_commit_hist, e->hist_commit.sz, sizeof(rt->tx_commit_hist));
+
+	/* memory */
+	rt->page_cache_used = sd_pagecache_used(&e->pagecache);
+	rt->allocator_footprint = 0;
+	rt->allocator_used = 0;
+	rt->allocator_slabs = 0;
+	if (e->av.i == &ss_slaba) {
+		ssslabastat stat;
+		ss_slabastat(&e->av, &stat);
+		rt->allocator_footprint = stat.footprint;
+		rt->allocator_used = stat.used;
+		rt->allocator_slabs = stat.slabs;
+	}
 	return 0;
 }
 
@@ -28048,7 +35945,7 @@ static inline int
 se_confensure(seconf *c)
 {
 	se *e = (se*)c->env;
-	int confmax = 2048 + (e->db.n * 100) + c->threads;
+	int confmax = 2048 + (e->db.n * 150) + c->threads;
 	confmax *= sizeof(srconf);
 	if (sslikely(confmax <= c->confmax))
 		return 0;
@@ -28177,6 +36074,13 @@ int se_confinit(seconf *c, so *e)
 	sf_schemeinit(&c->scheme);
 	c->env     = e;
 	c->threads = 6;
+	c->recover_threads = 1;
+	c->compression_threads = 0;
+	c->io_uring = 0;
+	c->allocator_if = NULL;
+	c->allocator = ss_strdup(&o->a, "malloc");
+	if (ssunlikely(c->allocator == NULL))
+		return -1;
 	return 0;
 }
 
@@ -28187,6 +36091,10 @@ void se_conffree(seconf *c)
 		ss_free(&e->a, c->conf);
 		c->conf = NULL;
 	}
+	if (c->allocator) {
+		ss_free(&e->a, c->allocator);
+		c->allocator = NULL;
+	}
 	sf_schemefree(&c->scheme, &e->a);
 }
 
@@ -28208,6 +36116,15 @@ int se_confvalidate(seconf *c)
 		sr_error(&e->error, "%s", "no databases are defined");
 		return -1;
 	}
+	if (strcmp(c->allocator, "malloc") == 0) {
+		c->allocator_if = NULL;
+	} else
+	if (strcmp(c->allocator, "slab") == 0) {
+		c->allocator_if = &ss_slaba;
+	} else {
+		sr_error(&e->error, "unknown memory allocator '%s'", c->allocator);
+		return -1;
+	}
 	return 0;
 }
 #line 1 "sophia/environment/se_confcursor.c"
@@ -28287,10 +36204,15 @@ static soif seconfkvif =
 	.getobject    = NULL,
 	.getstring    = se_confkv_getstring,
 	.getint       = NULL,
+	.setfield     = NULL,
+	.setfieldint  = NULL,
+	.getfield     = NULL,
+	.getfieldint  = NULL,
 	.set          = NULL,
 	.upsert       = NULL,
 	.del          = NULL,
 	.get          = NULL,
+	.getv         = NULL,
 	.begin        = NULL,
 	.prepare      = NULL,
 	.commit       = NULL,
@@ -28394,10 +36316,15 @@ static soif seconfcursorif =
 	.getobject    = NULL,
 	.getstring    = NULL,
 	.getint       = NULL,
+	.setfield     = NULL,
+	.setfieldint  = NULL,
+	.getfield     = NULL,
+	.getfieldint  = NULL,
 	.set          = NULL,
 	.upsert       = NULL,
 	.del          = NULL,
 	.get          = se_confcursor_get,
+	.getv         = NULL,
 	.begin        = NULL,
 	.prepare      = NULL,
 	.commit       = NULL,
@@ -28473,6 +36400,10 @@ se_cursordestroy(so *o)
 	sx_rollback(&c->t);
 	if (c->cache)
 		si_cachepool_push(c->cache);
+	secursorcache *p = (secursorcache*)c->caches.s;
+	for (; p < (secursorcache*)c->caches.p; p++)
+		si_cachepool_push(p->cache);
+	ss_buffree(&c->caches, &e->a);
 	if (c->read_db) {
 		sr_statcursor(&c->read_db->stat, c->start,
 		              c->read_disk,
@@ -28484,6 +36415,38 @@ se_cursordestroy(so *o)
 	return 0;
 }
 
+static inline sicache*
+se_cursorcache(secursor *c, sedb *db)
+{
+	if (sslikely(c->read_db == db))
+		return c->cache;
+	/* a cursor may read several databases under its
+	 * snapshot (a merge over sharded databases), each one
+	 * keeps its own node cache and read-ahead state */
+	secursorcache *p = (secursorcache*)c->caches.s;
+	for (; p < (secursorcache*)c->caches.p; p++)
+		if (p->db == db)
+			return p->cache;
+	se *e = se_of(&c->o);
+	int rc = ss_bufensure(&c->caches, &e->a, sizeof(secursorcache));
+	if (ssunlikely(rc == -1)) {
+		sr_oom(&e->error);
+		return NULL;
+	}
+	sicache *cache = si_cachepool_pop(&e->cachepool);
+	if (ssunlikely(cache == NULL)) {
+		sr_oom(&e->error);
+		return NULL;
+	}
+	cache->readahead = c->cache->readahead;
+	cache->keys_only = c->cache->keys_only;
+	p = (secursorcache*)c->caches.p;
+	p->db = db;
+	p->cache = cache;
+	ss_bufadvance(&c->caches, sizeof(secursorcache));
+	return cache;
+}
+
 static void*
 se_cursorget(so *o, so *v)
 {
@@ -28492,10 +36455,15 @@ se_cursorget(so *o, so *v)
 	sedb *db = se_cast(v->parent, sedb*, SEDB);
 	if (ssunlikely(c->read_db == NULL))
 		c->read_db = db;
+	sicache *cache = se_cursorcache(c, db);
+	if (ssunlikely(cache == NULL)) {
+		so_destroy(&key->o);
+		return NULL;
+	}
 	if (ssunlikely(! key->orderset))
 		key->order = SS_GTE;
 	sedocument *ret =
-		(sedocument*)se_read(db, key, NULL, c->t.vlsn, c->cache);
+		(sedocument*)se_read(db, key, NULL, c->t.vlsn, cache);
 	if (ret == NULL)
 		return NULL;
 	c->read_disk  += ret->read_disk;
@@ -28504,6 +36472,59 @@ se_cursorget(so *o, so *v)
 	return ret;
 }
 
+static inline void
+se_cursorcache_set(secursor *c, int readahead, int keys_only)
+{
+	secursorcache *p = (secursorcache*)c->caches.s;
+	for (; p < (secursorcache*)c->caches.p; p++) {
+		if (readahead >= 0)
+			p->cache->readahead = readahead;
+		if (keys_only >= 0)
+			p->cache->keys_only = keys_only;
+	}
+}
+
+static int
+se_cursorset_int(so *o, const char *path, int64_t v)
+{
+	secursor *c = se_cast(o, secursor*, SECURSOR);
+	se *e = se_of(o);
+	if (strcmp(path, "readahead") == 0) {
+		if (ssunlikely(v < 0 || v > INT32_MAX)) {
+			sr_error(&e->error, "%s", "bad readahead value");
+			return -1;
+		}
+		c->cache->readahead = v;
+		se_cursorcache_set(c, v, -1);
+		return 0;
+	}
+	if (strcmp(path, "keys_only") == 0) {
+		if (ssunlikely(v != 0 && v != 1)) {
+			sr_error(&e->error, "%s", "bad keys_only value");
+			return -1;
+		}
+		c->cache->keys_only = v;
+		se_cursorcache_set(c, -1, v);
+		return 0;
+	}
+	return -1;
+}
+
+static int64_t
+se_cursorget_int(so *o, const char *path)
+{
+	secursor *c = se_cast(o, secursor*, SECURSOR);
+	if (strcmp(path, "readahead") == 0)
+		return c->cache->readahead;
+	if (strcmp(path, "keys_only") == 0)
+		return c->cache->keys_only;
+	if (strcmp(path, "read_disk") == 0)
+		return c->read_disk;
+	if (strcmp(path, "read_cache") == 0)
+		return c->read_cache;
+	return -1;
+}
+
 static soif secursorif =
 {
 	.open         = NULL,
@@ -28511,14 +36532,19 @@ static soif secursorif =
 	.free         = se_cursorfree,
 	.document     = NULL,
 	.setstring    = NULL,
-	.setint       = NULL,
+	.setint       = se_cursorset_int,
 	.getobject    = NULL,
 	.getstring    = NULL,
-	.getint       = NULL,
+	.getint       = se_cursorget_int,
+	.setfield     = NULL,
+	.setfieldint  = NULL,
+	.getfield     = NULL,
+	.getfieldint  = NULL,
 	.set          = NULL,
 	.upsert       = NULL,
 	.del          = NULL,
 	.get          = se_cursorget,
+	.getv         = NULL,
 	.begin        = NULL,
 	.prepare      = NULL,
 	.commit       = NULL,
@@ -28542,6 +36568,7 @@ so *se_cursornew(se *e, uint64_t vlsn)
 	c->read_disk = 0;
 	c->read_cache = 0;
 	c->read_db = NULL;
+	ss_bufinit(&c->caches);
 	c->t.state = SX_UNDEF;
 	c->cache = si_cachepool_pop(&e->cachepool);
 	if (ssunlikely(c->cache == NULL)) {
@@ -28608,6 +36635,13 @@ se_dbscheme_init(sedb *db, char *name, int size)
 	if (ssunlikely(scheme->compression_sz == NULL))
 		goto error;
 	sf_upsertinit(&scheme->upsert);
+	scheme->upsert_sz = ss_strdup(&e->a, "none");
+	if (ssunlikely(scheme->upsert_sz == NULL))
+		goto error;
+	scheme->memtable = SV_INDEXRB;
+	scheme->memtable_sz = ss_strdup(&e->a, "rbtree");
+	if (ssunlikely(scheme->memtable_sz == NULL))
+		goto error;
 	sf_schemeinit(&scheme->scheme);
 	return 0;
 error:
@@ -28670,6 +36704,40 @@ se_dbscheme_set(sedb *db)
 		return -1;
 	}
 	s->compression = s->compression_if != &ss_nonefilter;
+	if (ssunlikely(s->compression_dict_size < 1024 ||
+	               s->compression_dict_size > SS_DICTSIZEMAX)) {
+		sr_error(&e->error, "%s", "bad compression_dict_size");
+		return -1;
+	}
+	/* upsert operator */
+	rc = sf_upsertop(&s->upsert, &s->scheme, s->upsert_sz);
+	if (ssunlikely(rc == -1)) {
+		sr_error(&e->error, "unknown upsert operator '%s'",
+		         s->upsert_sz);
+		return -1;
+	}
+	sffield *field = sf_upsertvalidate(&s->upsert, &s->scheme);
+	if (ssunlikely(field)) {
+		sr_error(&e->error, "upsert operator '%s' does not support "
+		         "field '%s'", s->upsert_sz, field->name);
+		return -1;
+	}
+	/* value log */
+	if (s->value_log_threshold && sf_upserthas(&s->upsert)) {
+		sr_error(&e->error, "%s", "incompatible options: "
+		         "value_log_threshold and upsert");
+		return -1;
+	}
+	/* in-memory index */
+	if (strcmp(s->memtable_sz, "rbtree") == 0) {
+		s->memtable = SV_INDEXRB;
+	} else
+	if (strcmp(s->memtable_sz, "btree") == 0) {
+		s->memtable = SV_INDEXBTREE;
+	} else {
+		sr_error(&e->error, "unknown memtable '%s'", s->memtable_sz);
+		return -1;
+	}
 	/* path */
 	if (s->path == NULL) {
 		char path[1024];
@@ -28695,12 +36763,12 @@ se_dbscheme_set(sedb *db)
 	db->r->scheme = &s->scheme;
 	db->r->upsert = &s->upsert;
 	db->r->stat   = &db->stat;
-	db->r->av     = &db->a;
+	db->r->av     = &e->av;
 	db->r->ptr    = db->index;
 	return 0;
 }
 
-int se_dbopen(so *o)
+int se_dbopen(so *o, ssjobq *q)
 {
 	sedb *db = se_cast(o, sedb*, SEDB);
 	se *e = se_of(&db->o);
@@ -28711,7 +36779,7 @@ int se_dbopen(so *o)
 		return -1;
 	sx_indexset(&db->coindex, db->scheme->id);
 	sr_log(&e->log, "loading database '%s'", db->scheme->path);
-	rc = si_open(db->index);
+	rc = si_open(db->index, q);
 	if (ssunlikely(rc == -1)) {
 		sr_statusset(&e->status, SR_MALFUNCTION);
 		return -1;
@@ -28733,7 +36801,6 @@ se_dbfree(sedb *db)
 	sf_limitfree(&db->limit, &e->a);
 	sr_statfree(&db->stat);
 	sx_indexfree(&db->coindex, &e->xm);
-	ss_aclose(&db->a);
 	so_mark_destroyed(&db->o);
 	ss_free(&e->a, db);
 	return rcret;
@@ -28831,13 +36898,91 @@ se_dbupsert(so *o, so *v)
 	return rc;
 }
 
+static int
+se_dbrange(sedb *db, sedocument *o)
+{
+	se *e = se_of(&db->o);
+	sedocument *stop = o->range_stop;
+	o->range_stop = NULL;
+	if (ssunlikely(! se_active(e)))
+		goto error;
+
+	/* create start and stop documents */
+	int rc;
+	rc = se_document_validate(o, &db->o);
+	if (ssunlikely(rc == -1))
+		goto error;
+	rc = se_document_validate(stop, &db->o);
+	if (ssunlikely(rc == -1))
+		goto error;
+	rc = se_document_create(o, SVRANGE);
+	if (ssunlikely(rc == -1))
+		goto error;
+	rc = se_document_create(stop, SVRANGE);
+	if (ssunlikely(rc == -1))
+		goto error;
+
+	svv *start_v = o->v;
+	svv *stop_v  = stop->v;
+	sv_vref(start_v);
+	sv_vref(stop_v);
+	so_destroy(&o->o);
+	so_destroy(&stop->o);
+
+	/* empty range */
+	if (sf_compare(db->r->scheme, sv_vpointer(start_v),
+	               sv_vpointer(stop_v)) >= 0) {
+		sv_vunref(db->r, start_v);
+		sv_vunref(db->r, stop_v);
+		return 0;
+	}
+
+	/* write wal and register the range delete */
+	svlog log;
+	rc = sv_loginit(&log, db->r, e->db.n);
+	if (ssunlikely(rc == -1)) {
+		sv_vunref(db->r, start_v);
+		sv_vunref(db->r, stop_v);
+		return sr_oom(&e->error);
+	}
+	sv_loginit_index(&log, db->index->scheme.id, db->r);
+	svlogv lv;
+	sv_logvinit(&lv, db->index->scheme.id);
+	lv.v = start_v;
+	rc = sv_logadd(&log, db->r, &lv);
+	if (sslikely(rc == 0)) {
+		lv.v = stop_v;
+		rc = sv_logadd(&log, db->r, &lv);
+	}
+	if (sslikely(rc == 0))
+		rc = sc_commitrange(&e->scheduler, &log, db->index);
+	else
+		sr_oom(&e->error);
+	if (ssunlikely(rc == -1)) {
+		sv_vunref(db->r, start_v);
+		sv_vunref(db->r, stop_v);
+	}
+	sv_logfree(&log, db->r);
+	return rc;
+
+error:
+	so_destroy(&o->o);
+	if (stop)
+		so_destroy(&stop->o);
+	return -1;
+}
+
 static int
 se_dbdel(so *o, so *v)
 {
 	sedb *db = se_cast(o, sedb*, SEDB);
 	sedocument *key = se_cast(v, sedocument*, SEDOCUMENT);
 	uint64_t start = ss_utime();
-	int rc = se_dbwrite(db, key, SVDELETE);
+	int rc;
+	if (ssunlikely(key->range_stop))
+		rc = se_dbrange(db, key);
+	else
+		rc = se_dbwrite(db, key, SVDELETE);
 	sr_statdelete(&db->stat, start);
 	return rc;
 }
@@ -28851,6 +36996,27 @@ se_dbget(so *o, so *v)
 	return se_read(db, key, NULL, vlsn, NULL);
 }
 
+static int
+se_dbgetv(so *o, so **v, int count)
+{
+	sedb *db = se_cast(o, sedb*, SEDB);
+	se *e = se_of(&db->o);
+	int i = 0;
+	while (i < count) {
+		se_cast(v[i], sedocument*, SEDOCUMENT);
+		i++;
+	}
+	uint64_t vlsn = sr_seq(db->r->seq, SR_LSN);
+	return se_readv(e, (sedocument**)v, count, NULL, vlsn);
+}
+
+static void*
+se_dbbegin(so *o)
+{
+	sedb *db = se_cast(o, sedb*, SEDB);
+	return se_loadernew(db);
+}
+
 static void*
 se_dbdocument(so *o)
 {
@@ -28870,11 +37036,16 @@ static soif sedbif =
 	.getobject    = NULL,
 	.getstring    = NULL,
 	.getint       = NULL,
+	.setfield     = NULL,
+	.setfieldint  = NULL,
+	.getfield     = NULL,
+	.getfieldint  = NULL,
 	.set          = se_dbset,
 	.upsert       = se_dbupsert,
 	.del          = se_dbdel,
 	.get          = se_dbget,
-	.begin        = NULL,
+	.getv         = se_dbgetv,
+	.begin        = se_dbbegin,
 	.prepare      = NULL,
 	.commit       = NULL,
 	.cursor       = NULL,
@@ -28890,13 +37061,18 @@ so *se_dbnew(se *e, char *name, int size)
 	memset(o, 0, sizeof(*o));
 	so_init(&o->o, &se_o[SEDB], &sedbif, &e->o, &e->o);
 	sr_statinit(&o->stat);
+	int i = 0;
+	while (i < SR_HMAX) {
+		ss_histinit(&o->hist[i]);
+		i++;
+	}
+	o->stat.hist = o->hist;
 	int rc;
 	rc = sf_limitinit(&o->limit, &e->a);
 	if (ssunlikely(rc == -1)) {
 		ss_free(&e->a, o);
 		return NULL;
 	}
-	o->a = e->a;
 	o->index = si_init(&e->r, &o->o);
 	if (ssunlikely(o->index == NULL)) {
 		sf_limitfree(&o->limit, &e->a);
@@ -28977,6 +37153,9 @@ enum {
 	SE_DOCUMENT_PREFIX,
 	SE_DOCUMENT_LOG,
 	SE_DOCUMENT_RAW,
+	SE_DOCUMENT_RANGE_STOP,
+	SE_DOCUMENT_CACHE_ONLY,
+	SE_DOCUMENT_CACHE_MISS,
 	SE_DOCUMENT_UNKNOWN
 };
 
@@ -29001,6 +37180,14 @@ se_document_opt(const char *path)
 	case 'r':
 		if (sslikely(strcmp(path, "raw") == 0))
 			return SE_DOCUMENT_RAW;
+		if (strcmp(path, "range_stop") == 0)
+			return SE_DOCUMENT_RANGE_STOP;
+		break;
+	case 'c':
+		if (strcmp(path, "cache_only") == 0)
+			return SE_DOCUMENT_CACHE_ONLY;
+		if (strcmp(path, "cache_miss") == 0)
+			return SE_DOCUMENT_CACHE_MISS;
 		break;
 	}
 	return SE_DOCUMENT_FIELD;
@@ -29107,6 +37294,9 @@ se_document_destroy(so *o)
 		ss_free(&e->a, v->prefix_copy);
 	v->prefix_copy = NULL;
 	v->prefix = NULL;
+	if (v->range_stop)
+		so_destroy(&v->range_stop->o);
+	v->range_stop = NULL;
 	v->created = 0;
 	so_mark_destroyed(&v->o);
 	so_poolgc(&e->document, &v->o);
@@ -29231,6 +37421,27 @@ se_document_getfield(sedocument *v, int pos, int *size)
 	return fv->pointer;
 }
 
+static inline int64_t
+se_document_getfield_numeric(sedocument *v, sffield *field)
+{
+	if (ssunlikely(field->fixed_size == 0))
+		return -1;
+	void *pointer = se_document_getfield(v, field->position, NULL);
+	if (ssunlikely(pointer == NULL))
+		return -1;
+	switch (field->type) {
+	case SS_U8:
+	case SS_U8REV:  return *(uint8_t*)pointer;
+	case SS_U16:
+	case SS_U16REV: return *(uint16_t*)pointer;
+	case SS_U32:
+	case SS_U32REV: return *(uint32_t*)pointer;
+	case SS_U64:
+	case SS_U64REV: return *(uint64_t*)pointer;
+	default:        return -1;
+	}
+}
+
 static int
 se_document_setstring(so *o, const char *path, void *pointer, int size)
 {
@@ -29279,6 +37490,16 @@ se_document_setstring(so *o, const char *path, void *pointer, int size)
 	case SE_DOCUMENT_RAW:
 		v->raw = pointer;
 		break;
+	case SE_DOCUMENT_RANGE_STOP: {
+		/* the stop key document is owned by the
+		 * start key document */
+		so *stop = pointer;
+		if (ssunlikely(stop->parent != v->o.parent || stop == &v->o ||
+		               v->range_stop))
+			return sr_error(&e->error, "%s", "bad range stop document");
+		v->range_stop = se_cast(stop, sedocument*, SEDOCUMENT);
+		break;
+	}
 	default:
 		return -1;
 	}
@@ -29301,6 +37522,9 @@ se_document_setint(so *o, const char *path, int64_t num)
 			return -1;
 		return se_document_setfield_numeric(v, field->position, num);
 	}
+	case SE_DOCUMENT_CACHE_ONLY:
+		v->cache_only = num > 0;
+		break;
 	default:
 		return -1;
 	}
@@ -29362,25 +37586,63 @@ se_document_getint(so *o, const char *path)
 		sffield *field = sf_schemefind(&db->scheme->scheme, (char*)path);
 		if (ssunlikely(field == NULL))
 			return -1;
-		if (ssunlikely(field->fixed_size == 0))
-			return -1;
-		void *pointer = se_document_getfield(v, field->position, NULL);
-		switch (field->type) {
-		case SS_U8:
-		case SS_U8REV:  return *(uint8_t*)pointer;
-		case SS_U16:
-		case SS_U16REV: return *(uint16_t*)pointer;
-		case SS_U32:
-		case SS_U32REV: return *(uint32_t*)pointer;
-		case SS_U64:
-		case SS_U64REV: return *(uint64_t*)pointer;
-		default:        return -1;
-		}
+		return se_document_getfield_numeric(v, field);
 	}
+	case SE_DOCUMENT_CACHE_ONLY:
+		return v->cache_only;
+	case SE_DOCUMENT_CACHE_MISS:
+		return v->cache_miss;
 	}
 	return -1;
 }
 
+/* positional field access, used by bindings which resolve
+ * field names to positions once per scheme */
+
+static int
+se_document_setfieldpos(so *o, int pos, void *pointer, int size)
+{
+	sedocument *v = se_cast(o, sedocument*, SEDOCUMENT);
+	se *e = se_of(o);
+	if (ssunlikely(v->v))
+		return sr_error(&e->error, "%s", "document is read-only");
+	if (ssunlikely(pos < 0))
+		return sr_error(&e->error, "%s", "incorrect field position");
+	return se_document_setfield(v, pos, pointer, size);
+}
+
+static int
+se_document_setfieldint(so *o, int pos, int64_t num)
+{
+	sedocument *v = se_cast(o, sedocument*, SEDOCUMENT);
+	se *e = se_of(o);
+	if (ssunlikely(v->v))
+		return sr_error(&e->error, "%s", "document is read-only");
+	if (ssunlikely(pos < 0))
+		return sr_error(&e->error, "%s", "incorrect field position");
+	return se_document_setfield_numeric(v, pos, num);
+}
+
+static void*
+se_document_getfieldpos(so *o, int pos, int *size)
+{
+	sedocument *v = se_cast(o, sedocument*, SEDOCUMENT);
+	if (ssunlikely(pos < 0))
+		return NULL;
+	return se_document_getfield(v, pos, size);
+}
+
+static int64_t
+se_document_getfieldint(so *o, int pos)
+{
+	sedocument *v = se_cast(o, sedocument*, SEDOCUMENT);
+	sedb *db = (sedb*)o->parent;
+	if (ssunlikely(pos < 0 || pos >= db->scheme->scheme.fields_count))
+		return -1;
+	sffield *field = sf_schemeof(&db->scheme->scheme, pos);
+	return se_document_getfield_numeric(v, field);
+}
+
 static soif sedocumentif =
 {
 	.open         = NULL,
@@ -29392,10 +37654,15 @@ static soif sedocumentif =
 	.getobject    = NULL,
 	.getstring    = se_document_getstring,
 	.getint       = se_document_getint,
+	.setfield     = se_document_setfieldpos,
+	.setfieldint  = se_document_setfieldint,
+	.getfield     = se_document_getfieldpos,
+	.getfieldint  = se_document_getfieldint,
 	.set          = NULL,
 	.upsert       = NULL,
 	.del          = NULL,
 	.get          = NULL,
+	.getv         = NULL,
 	.begin        = NULL,
 	.prepare      = NULL,
 	.commit       = NULL,
@@ -29422,6 +37689,287 @@ so *se_document_new(se *e, so *parent, svv *vp)
 	so_pooladd(&e->document, &v->o);
 	return &v->o;
 }
+#line 1 "sophia/environment/se_loader.c"
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+static void
+se_loaderfree(so *o)
+{
+	assert(o->destroyed);
+	se *e = se_of(o);
+	ss_free(&e->a, o);
+}
+
+static inline void
+se_loaderend(seloader *l)
+{
+	se *e = se_of(&l->o);
+	so_mark_destroyed(&l->o);
+	so_poolgc(&e->loader, &l->o);
+}
+
+static int
+se_loaderdestroy(so *o)
+{
+	seloader *l = se_cast(o, seloader*, SELOADER);
+	int rc = si_loadrollback(&l->l);
+	se_loaderend(l);
+	return rc;
+}
+
+static int
+se_loaderset(so *o, so *v)
+{
+	seloader *l = se_cast(o, seloader*, SELOADER);
+	sedocument *key = se_cast(v, sedocument*, SEDOCUMENT);
+	se *e = se_of(&l->o);
+	if (ssunlikely(! se_active(e)))
+		goto error;
+	int rc;
+	rc = se_document_validate(key, &l->db->o);
+	if (ssunlikely(rc == -1))
+		goto error;
+	rc = se_document_create(key, 0);
+	if (ssunlikely(rc == -1))
+		goto error;
+	svv *vv = key->v;
+	sv_vref(vv);
+	so_destroy(&key->o);
+	return si_loadadd(&l->l, vv);
+error:
+	so_destroy(&key->o);
+	return -1;
+}
+
+static int
+se_loadercommit(so *o)
+{
+	seloader *l = se_cast(o, seloader*, SELOADER);
+	se *e = se_of(&l->o);
+	int rc;
+	if (ssunlikely(! se_active(e))) {
+		si_loadrollback(&l->l);
+		rc = -1;
+	} else
+	if (ssunlikely(sx_vlsn_since(&e->xm, l->l.lsn))) {
+		/* a read view opened during the load would see the
+		 * loaded rows appear, refuse rather than break it */
+		si_loadrollback(&l->l);
+		rc = sr_error(&e->error, "%s", "bulk load conflicts with a "
+		              "read view opened during the load");
+	} else {
+		rc = si_loadcommit(&l->l);
+	}
+	se_loaderend(l);
+	return rc;
+}
+
+static int64_t
+se_loaderget_int(so *o, const char *path)
+{
+	seloader *l = se_cast(o, seloader*, SELOADER);
+	if (strcmp(path, "count") == 0)
+		return l->l.count;
+	return -1;
+}
+
+static soif seloaderif =
+{
+	.open         = NULL,
+	.destroy      = se_loaderdestroy,
+	.free         = se_loaderfree,
+	.document     = NULL,
+	.setstring    = NULL,
+	.setint       = NULL,
+	.getobject    = NULL,
+	.getstring    = NULL,
+	.getint       = se_loaderget_int,
+	.setfield     = NULL,
+	.setfieldint  = NULL,
+	.getfield     = NULL,
+	.getfieldint  = NULL,
+	.set          = se_loaderset,
+	.upsert       = NULL,
+	.del          = NULL,
+	.get          = NULL,
+	.getv         = NULL,
+	.begin        = NULL,
+	.prepare      = NULL,
+	.commit       = se_loadercommit,
+	.cursor       = NULL
+};
+
+so *se_loadernew(sedb *db)
+{
+	se *e = se_of(&db->o);
+	if (ssunlikely(! se_active(e)))
+		return NULL;
+	seloader *l = ss_malloc(&e->a, sizeof(seloader));
+	if (ssunlikely(l == NULL)) {
+		sr_oom(&e->error);
+		return NULL;
+	}
+	so_init(&l->o, &se_o[SELOADER], &seloaderif, &db->o, &e->o);
+	l->db = db;
+	/* loaded documents share a single lsn, which is older
+	 * than any update made while the load is in progress */
+	uint64_t lsn = sr_seq(&e->seq, SR_LSNNEXT);
+	int rc = si_loadbegin(&l->l, db->index, lsn);
+	if (ssunlikely(rc == -1)) {
+		ss_free(&e->a, l);
+		return NULL;
+	}
+	so_pooladd(&e->loader, &l->o);
+	return &l->o;
+}
+#line 1 "sophia/environment/se_snapshot.c"
+
+/*
+ * sophia database
+ * sphia.org
+ *
+ * Copyright (c) Dmitry Simonenko
+ * BSD License
+*/
+
+
+
+
+
+
+
+
+
+
+
+
+
+
+/* a snapshot pins its vlsn as a read-only transaction
+ * which never tracks reads, so neither the conflict
+ * index nor commit of concurrent transactions see it */
+
+static void
+se_snapshotfree(so *o)
+{
+	assert(o->destroyed);
+	se *e = se_of(o);
+	ss_free(&e->a, o);
+}
+
+static int
+se_snapshotdestroy(so *o)
+{
+	sesnapshot *s = se_cast(o, sesnapshot*, SESNAPSHOT);
+	se *e = se_of(&s->o);
+	sx_rollback(&s->t);
+	so_mark_destroyed(&s->o);
+	so_poolgc(&e->snapshot, &s->o);
+	return 0;
+}
+
+static void*
+se_snapshotget(so *o, so *v)
+{
+	sesnapshot *s = se_cast(o, sesnapshot*, SESNAPSHOT);
+	sedocument *key = se_cast(v, sedocument*, SEDOCUMENT);
+	sedb *db = se_cast(key->o.parent, sedb*, SEDB);
+	return se_read(db, key, NULL, s->t.vlsn, NULL);
+}
+
+static int
+se_snapshotgetv(so *o, so **v, int count)
+{
+	sesnapshot *s = se_cast(o, sesnapshot*, SESNAPSHOT);
+	se *e = se_of(&s->o);
+	int i = 0;
+	while (i < count) {
+		se_cast(v[i], sedocument*, SEDOCUMENT);
+		i++;
+	}
+	return se_readv(e, (sedocument**)v, count, NULL, s->t.vlsn);
+}
+
+static void*
+se_snapshotcursor(so *o)
+{
+	sesnapshot *s = se_cast(o, sesnapshot*, SESNAPSHOT);
+	se *e = se_of(&s->o);
+	return se_cursornew(e, s->t.vlsn);
+}
+
+static int64_t
+se_snapshotget_int(so *o, const char *path)
+{
+	sesnapshot *s = se_cast(o, sesnapshot*, SESNAPSHOT);
+	if (strcmp(path, "lsn") == 0)
+		return s->t.vlsn;
+	return -1;
+}
+
+static soif sesnapshotif =
+{
+	.open         = NULL,
+	.destroy      = se_snapshotdestroy,
+	.free         = se_snapshotfree,
+	.document     = NULL,
+	.setstring    = NULL,
+	.setint       = NULL,
+	.getobject    = NULL,
+	.getstring    = NULL,
+	.getint       = se_snapshotget_int,
+	.setfield     = NULL,
+	.setfieldint  = NULL,
+	.getfield     = NULL,
+	.getfieldint  = NULL,
+	.set          = NULL,
+	.upsert       = NULL,
+	.del          = NULL,
+	.get          = se_snapshotget,
+	.getv         = se_snapshotgetv,
+	.begin        = NULL,
+	.prepare      = NULL,
+	.commit       = NULL,
+	.cursor       = se_snapshotcursor
+};
+
+so *se_snapshotnew(se *e)
+{
+	if (ssunlikely(! se_active(e)))
+		return NULL;
+	sesnapshot *s = (sesnapshot*)so_poolpop(&e->snapshot);
+	if (s == NULL)
+		s = ss_malloc(&e->a, sizeof(sesnapshot));
+	if (ssunlikely(s == NULL)) {
+		sr_oom(&e->error);
+		return NULL;
+	}
+	so_init(&s->o, &se_o[SESNAPSHOT], &sesnapshotif, &e->o, &e->o);
+	sv_loginit(&s->log, &e->r, 0);
+	sx_begin(&e->xm, &s->t, SX_RO, &s->log, UINT64_MAX);
+	so_pooladd(&e->snapshot, &s->o);
+	return &s->o;
+}
 #line 1 "sophia/environment/se_o.c"
 
 /*
@@ -29456,7 +38004,9 @@ sotype se_o[] =
 	{ 0x2FABCDE2L, "document"        },
 	{ 0x34591111L, "database"        },
 	{ 0x13491FABL, "transaction"     },
-	{ 0x45ABCDFAL, "cursor"          }
+	{ 0x45ABCDFAL, "cursor"          },
+	{ 0x5C0AD3E1L, "loader"          },
+	{ 0x3E5A9D17L, "snapshot"        }
 };
 #line 1 "sophia/environment/se_read.c"
 
@@ -29497,6 +38047,7 @@ se_readresult(se *e, sedb *db, siread *r)
 		           v->read_latency,
 		           v->read_disk,
 		           v->read_cache);
+		sr_ratefeed(&e->rate, v->read_latency);
 	}
 
 	/* propagate current document settings to
@@ -29588,6 +38139,8 @@ so *se_read(sedb *db, sedocument *o, sx *x, uint64_t vlsn,
 	            o->prefix_size,
 	            0,
 	            start);
+	rq.cache_only = o->cache_only && o->order == SS_EQ;
+	o->cache_miss = 0;
 	rc = si_read(&rq);
 	si_readclose(&rq);
 
@@ -29608,6 +38161,13 @@ so *se_read(sedb *db, sedocument *o, sx *x, uint64_t vlsn,
 	if (cachegc && cache)
 		si_cachepool_push(cache);
 
+	/* the key needs a node file read: hand the key document
+	 * back, passing it again performs the full lookup */
+	if (rc == 3) {
+		o->cache_only = 0;
+		o->cache_miss = 1;
+		return &o->o;
+	}
 	so_destroy(&o->o);
 	return &ret->o;
 error:
@@ -29615,6 +38175,122 @@ error:
 	return NULL;
 }
 
+typedef struct {
+	sedocument *o;
+	int pos;
+} sereadv;
+
+static inline int
+se_readv_cmp(sereadv *a, sereadv *b)
+{
+	sedb *a_db = (sedb*)a->o->o.parent;
+	sedb *b_db = (sedb*)b->o->o.parent;
+	if (a_db != b_db)
+		return (a_db->scheme->id < b_db->scheme->id) ? -1 : 1;
+	/* keys which failed to build are read (and fail) first */
+	if (ssunlikely(a->o->v == NULL || b->o->v == NULL))
+		return (a->o->v != NULL) - (b->o->v != NULL);
+	return sf_compare(a_db->r->scheme, sv_vpointer(a->o->v),
+	                  sv_vpointer(b->o->v));
+}
+
+static void
+se_readv_sort(sereadv *v, sereadv *tmp, int count)
+{
+	if (count < 2)
+		return;
+	int half = count / 2;
+	se_readv_sort(v, tmp, half);
+	se_readv_sort(v + half, tmp, count - half);
+	int a = 0;
+	int b = half;
+	int n = 0;
+	while (a < half && b < count) {
+		if (se_readv_cmp(&v[b], &v[a]) < 0)
+			tmp[n++] = v[b++];
+		else
+			tmp[n++] = v[a++];
+	}
+	while (a < half)
+		tmp[n++] = v[a++];
+	while (b < count)
+		tmp[n++] = v[b++];
+	memcpy(v, tmp, sizeof(sereadv) * count);
+}
+
+static void
+se_readv_ahead(sereadv *v, int count)
+{
+	sireadahead ra;
+	si_readahead_init(&ra);
+	int i = 0;
+	while (i < count) {
+		sedocument *o = v[i].o;
+		sedb *db = (sedb*)o->o.parent;
+		if (o->v && o->order == SS_EQ && !o->cache_only)
+			si_readahead_add(&ra, db->index, db->r, sv_vpointer(o->v));
+		i++;
+	}
+	si_readahead_submit(&ra);
+}
+
+int se_readv(se *e, sedocument **keys, int count, sx *x, uint64_t vlsn)
+{
+	/* keys are looked up in index order with a single
+	 * read cache, so that lookups which land on the same
+	 * node and page reuse it. Each key is replaced by its
+	 * result document or NULL */
+	sereadv *v = NULL;
+	sicache *cache = NULL;
+	int i;
+	if (ssunlikely(! se_active(e)))
+		goto error;
+	v = ss_malloc(&e->a, sizeof(sereadv) * count * 2);
+	if (ssunlikely(v == NULL)) {
+		sr_oom(&e->error);
+		goto error;
+	}
+	cache = si_cachepool_pop(&e->cachepool);
+	if (ssunlikely(cache == NULL)) {
+		sr_oom(&e->error);
+		goto error;
+	}
+	i = 0;
+	while (i < count) {
+		sedocument *o = keys[i];
+		v[i].o   = o;
+		v[i].pos = i;
+		if (se_document_validate_ro(o, o->o.parent) == 0)
+			se_document_createkey(o);
+		i++;
+	}
+	se_readv_sort(v, v + count, count);
+	/* hint the pages of all keys in one submission when
+	 * the vfs can batch them */
+	if (count > 1 && e->vfs.i->advisev)
+		se_readv_ahead(v, count);
+	i = 0;
+	while (i < count) {
+		sedocument *o = v[i].o;
+		sedb *db = (sedb*)o->o.parent;
+		keys[v[i].pos] = (sedocument*)se_read(db, o, x, vlsn, cache);
+		i++;
+	}
+	si_cachepool_push(cache);
+	ss_free(&e->a, v);
+	return 0;
+error:
+	if (v)
+		ss_free(&e->a, v);
+	i = 0;
+	while (i < count) {
+		so_destroy(&keys[i]->o);
+		keys[i] = NULL;
+		i++;
+	}
+	return -1;
+}
+
 #line 1 "sophia/environment/se_recover.c"
 
 /*
@@ -29638,11 +38314,103 @@ error:
 
 
 
+typedef struct serecoverdb serecoverdb;
+typedef struct serecoverv serecoverv;
+typedef struct serecoverq serecoverq;
+typedef struct serecoverpool serecoverpool;
+
+struct serecoverdb {
+	ssjob   job;
+	so     *db;
+	ssjobq *q;
+};
+
+static int
+se_recoverdb_job(ssjob *job)
+{
+	serecoverdb *r = job->arg;
+	return se_dbopen(r->db, r->q);
+}
+
+int se_recoverdb(se *e)
+{
+	uint64_t start = ss_utime();
+	int threads = e->conf.recover_threads;
+	int rc;
+	sslist *i;
+	if (threads <= 1 || e->db.n == 0) {
+		ss_listforeach(&e->db.list, i) {
+			so *o = sscast(i, so, link);
+			rc = se_dbopen(o, NULL);
+			if (ssunlikely(rc == -1))
+				return -1;
+		}
+		e->recover.databases = ss_utime() - start;
+		return 0;
+	}
+
+	/* databases are recovered by a pool of threads, which
+	 * also open the node files of every database */
+	serecoverdb *jobs = ss_malloc(&e->a, sizeof(serecoverdb) * e->db.n);
+	if (ssunlikely(jobs == NULL))
+		return sr_oom_malfunction(&e->error);
+	ssjobq q;
+	ss_jobqinit(&q);
+	/* the calling thread runs jobs while waiting */
+	rc = ss_jobqstart(&q, &e->a, threads - 1);
+	if (ssunlikely(rc == -1)) {
+		ss_jobqshutdown(&q, &e->a);
+		ss_free(&e->a, jobs);
+		return sr_malfunction(&e->error, "%s",
+		                      "failed to start recovery threads");
+	}
+	ssjobgroup group;
+	ss_jobgroupinit(&group);
+	int n = 0;
+	ss_listforeach(&e->db.list, i) {
+		serecoverdb *r = &jobs[n++];
+		r->db = sscast(i, so, link);
+		r->q  = &q;
+		ss_jobinit(&r->job, se_recoverdb_job, r, &group);
+		ss_jobqpush(&q, &r->job);
+	}
+	rc = ss_jobqwait(&q, &group);
+	ss_jobqshutdown(&q, &e->a);
+	ss_free(&e->a, jobs);
+	if (ssunlikely(rc == -1))
+		return -1;
+	e->recover.databases = ss_utime() - start;
+	return 0;
+}
+
+static inline int
+se_recover_range(se *e, sedb *db, sw *log, char *data, svv **start)
+{
+	/* range delete is registered once both of its
+	 * records are read */
+	svv *v = sv_vbuildraw(db->r, data);
+	if (ssunlikely(v == NULL))
+		return sr_oom(&e->error);
+	v->log = log;
+	if (*start == NULL) {
+		*start = v;
+		return 0;
+	}
+	int rc = si_rangeadd(db->index, *start, v);
+	if (ssunlikely(rc == -1)) {
+		sv_vunref(db->r, *start);
+		sv_vunref(db->r, v);
+	}
+	*start = NULL;
+	return rc;
+}
+
 static int
 se_recover_log(se *e, sw *log)
 {
 	so *tx = NULL;
 	sedb *db = NULL;
+	svv *range = NULL;
 	ssiter i;
 	ss_iterinit(sw_iter, &i);
 	int processed = 0;
@@ -29674,13 +38442,19 @@ se_recover_log(se *e, sw *log)
 			}
 			char *data = sw_vpointer(v);
 			lsn = sf_lsn(db->r->scheme, data);
+			int flags = sf_flags(db->r->scheme, data);
+			if (ssunlikely(flags == SVRANGE)) {
+				rc = se_recover_range(e, db, log, data, &range);
+				if (ssunlikely(rc == -1))
+					goto rlb;
+				goto next;
+			}
 			so *o = so_document(&db->o);
 			if (ssunlikely(o == NULL))
 				goto rlb;
 			so_setstring(o, "raw", data, 0);
 			so_setstring(o, "log", log, 0);
 			
-			int flags = sf_flags(db->r->scheme, data);
 			if (flags == SVDELETE) {
 				rc = so_delete(tx, o);
 			} else
@@ -29692,7 +38466,9 @@ se_recover_log(se *e, sw *log)
 			}
 			if (ssunlikely(rc == -1))
 				goto rlb;
+next:
 			ss_gcmark(&log->gc, 1);
+			e->recover.log_records++;
 			processed++;
 			if ((processed % 100000) == 0)
 				sr_log(&e->log, " %.1fM processed", processed / 1000000.0);
@@ -29712,10 +38488,267 @@ se_recover_log(se *e, sw *log)
 			break;
 	}
 	ss_iteratorclose(&i);
+	assert(range == NULL);
 	return 0;
 rlb:
 	so_destroy(tx);
 error:
+	if (range)
+		sv_vunref(db->r, range);
+	ss_iteratorclose(&i);
+	return -1;
+}
+
+
+/*
+	Parallel log replay.
+
+	Log records are read by the calling thread and dispatched
+	by database id to a number of apply queues, each served by
+	a single thread, so records of a database are written to
+	its index in log order. Transactions are not rebuilt: the
+	records of a committed transaction are written directly,
+	as sc_commit() does during recovery.
+*/
+
+struct serecoverv {
+	sedb *db;
+	svv  *v;
+};
+
+struct serecoverq {
+	ssmutex lock;
+	sscond  cond;
+	ssbuf   list;
+	ssbuf   batch;
+	int     done;
+	ssa    *a;
+};
+
+struct serecoverpool {
+	serecoverq   *q;
+	int           n;
+	ssthreadpool  tp;
+};
+
+static inline void
+se_recover_apply(ssbuf *work)
+{
+	serecoverv *v   = (serecoverv*)work->s;
+	serecoverv *end = (serecoverv*)work->p;
+	while (v < end) {
+		si *index = v->db->index;
+		sitx x;
+		si_begin(&x, index);
+		for (; v < end && v->db->index == index; v++)
+			si_writerecover(&x, v->v);
+		si_commit(&x);
+	}
+}
+
+static void*
+se_recover_worker(void *arg)
+{
+	ssthread *self = arg;
+	serecoverq *q = self->arg;
+	ssbuf work;
+	ss_bufinit(&work);
+	ss_mutexlock(&q->lock);
+	for (;;) {
+		if (ss_bufused(&q->list) > 0) {
+			ssbuf tmp = q->list;
+			q->list = work;
+			work = tmp;
+			ss_mutexunlock(&q->lock);
+			se_recover_apply(&work);
+			ss_bufreset(&work);
+			ss_mutexlock(&q->lock);
+			continue;
+		}
+		if (q->done)
+			break;
+		ss_condwait(&q->cond, &q->lock);
+	}
+	ss_mutexunlock(&q->lock);
+	ss_buffree(&work, q->a);
+	return NULL;
+}
+
+static inline int
+se_recover_flush(se *e, serecoverq *q)
+{
+	int size = ss_bufused(&q->batch);
+	if (size == 0)
+		return 0;
+	ss_mutexlock(&q->lock);
+	int rc = ss_bufadd(&q->list, &e->a, q->batch.s, size);
+	ss_condsignal(&q->cond);
+	ss_mutexunlock(&q->lock);
+	if (ssunlikely(rc == -1))
+		return sr_oom_malfunction(&e->error);
+	ss_bufreset(&q->batch);
+	return 0;
+}
+
+static inline int
+se_recover_push(se *e, serecoverpool *p, sedb *db, svv *v)
+{
+	serecoverq *q = &p->q[db->scheme->id % p->n];
+	serecoverv rv = {
+		.db = db,
+		.v  = v
+	};
+	int rc = ss_bufadd(&q->batch, &e->a, &rv, sizeof(rv));
+	if (ssunlikely(rc == -1)) {
+		sv_vunref(db->r, v);
+		return sr_oom_malfunction(&e->error);
+	}
+	if (ss_bufused(&q->batch) >= (int)(1024 * sizeof(rv)))
+		return se_recover_flush(e, q);
+	return 0;
+}
+
+static int
+se_recover_poolstop(se *e, serecoverpool *p)
+{
+	int rcret = 0;
+	int rc;
+	int k;
+	for (k = 0; k < p->n; k++) {
+		serecoverq *q = &p->q[k];
+		rc = se_recover_flush(e, q);
+		if (ssunlikely(rc == -1))
+			rcret = -1;
+		ss_mutexlock(&q->lock);
+		q->done = 1;
+		ss_condsignal(&q->cond);
+		ss_mutexunlock(&q->lock);
+	}
+	rc = ss_threadpool_shutdown(&p->tp, &e->a);
+	if (ssunlikely(rc == -1))
+		rcret = -1;
+	for (k = 0; k < p->n; k++) {
+		serecoverq *q = &p->q[k];
+		ss_buffree(&q->list, &e->a);
+		ss_buffree(&q->batch, &e->a);
+		ss_condfree(&q->cond);
+		ss_mutexfree(&q->lock);
+	}
+	ss_free(&e->a, p->q);
+	return rcret;
+}
+
+static int
+se_recover_poolstart(se *e, serecoverpool *p, int n)
+{
+	p->q = ss_malloc(&e->a, sizeof(serecoverq) * n);
+	if (ssunlikely(p->q == NULL))
+		return sr_oom_malfunction(&e->error);
+	p->n = n;
+	ss_threadpool_init(&p->tp);
+	int k;
+	for (k = 0; k < n; k++) {
+		serecoverq *q = &p->q[k];
+		ss_mutexinit(&q->lock);
+		ss_condinit(&q->cond);
+		ss_bufinit(&q->list);
+		ss_bufinit(&q->batch);
+		q->done = 0;
+		q->a = &e->a;
+	}
+	for (k = 0; k < n; k++) {
+		int rc = ss_threadpool_add(&p->tp, &e->a, se_recover_worker,
+		                           &p->q[k]);
+		if (ssunlikely(rc == -1)) {
+			se_recover_poolstop(e, p);
+			return sr_malfunction(&e->error, "%s",
+			                      "failed to start recovery threads");
+		}
+	}
+	return 0;
+}
+
+static int
+se_recover_logparallel(se *e, sw *log, serecoverpool *p)
+{
+	sedb *db = NULL;
+	svv *range = NULL;
+	ssiter i;
+	ss_iterinit(sw_iter, &i);
+	int processed = 0;
+	int rc = ss_iteropen(sw_iter, &i, &e->r, &log->file, 1);
+	if (ssunlikely(rc == -1))
+		return -1;
+	for (;;)
+	{
+		swv *v = ss_iteratorof(&i);
+		if (ssunlikely(v == NULL))
+			break;
+		uint64_t lsn = 0;
+		while (ss_iteratorhas(&i)) {
+			v = ss_iteratorof(&i);
+			/* match a database */
+			uint32_t dsn = v->dsn;
+			if (db == NULL || db->scheme->id != dsn)
+				db = (sedb*)se_dbmatch_id(e, dsn);
+			if (ssunlikely(db == NULL)) {
+				sr_malfunction(&e->error, "database id %" PRIu32
+				               " is not declared", dsn);
+				goto error;
+			}
+			char *data = sw_vpointer(v);
+			lsn = sf_lsn(db->r->scheme, data);
+			int flags = sf_flags(db->r->scheme, data);
+			if (ssunlikely(flags == SVUPSERT &&
+			               !sf_upserthas(&db->scheme->upsert))) {
+				sr_error(&e->error, "%s", "upsert callback is not set");
+				goto error;
+			}
+			if (ssunlikely(flags == SVRANGE)) {
+				rc = se_recover_range(e, db, log, data, &range);
+				if (ssunlikely(rc == -1))
+					goto error;
+				goto next;
+			}
+			svv *version = sv_vbuildraw(db->r, data);
+			if (ssunlikely(version == NULL)) {
+				sr_oom(&e->error);
+				goto error;
+			}
+			version->log = log;
+			rc = se_recover_push(e, p, db, version);
+			if (ssunlikely(rc == -1))
+				goto error;
+next:
+			ss_gcmark(&log->gc, 1);
+			e->recover.log_records++;
+			processed++;
+			if ((processed % 100000) == 0)
+				sr_log(&e->log, " %.1fM processed", processed / 1000000.0);
+			ss_iteratornext(&i);
+		}
+		if (ssunlikely(sw_iter_error(&i)))
+			goto error;
+
+		/* keep the sequence ahead of replayed transactions,
+		 * as sw_begin() does */
+		sr_seqlock(&e->seq);
+		if (lsn > e->seq.lsn)
+			e->seq.lsn = lsn;
+		sr_sequnlock(&e->seq);
+
+		rc = sw_iter_continue(&i);
+		if (ssunlikely(rc == -1))
+			goto error;
+		if (rc == 0)
+			break;
+	}
+	ss_iteratorclose(&i);
+	assert(range == NULL);
+	return 0;
+error:
+	if (range)
+		sv_vunref(db->r, range);
 	ss_iteratorclose(&i);
 	return -1;
 }
@@ -29724,28 +38757,48 @@ static inline int
 se_recover_logpool(se *e)
 {
 	sr_log(&e->log, "loading journals '%s'", e->wm_conf->path);
+	serecoverpool pool;
+	serecoverpool *p = NULL;
+	int rc = 0;
+	if (e->conf.recover_threads > 1 && e->wm.n > 0) {
+		rc = se_recover_poolstart(e, &pool, e->conf.recover_threads);
+		if (ssunlikely(rc == -1))
+			return -1;
+		p = &pool;
+	}
 	uint32_t current = 1;
 	sslist *i;
 	ss_listforeach(&e->wm.list, i) {
 		sw *log = sscast(i, sw, link);
 		sr_log(&e->log, "(%" PRIu32 "/%" PRIu32 ") %020" PRIu64".log",
 		       current, e->wm.n, log->id);
-		int rc = se_recover_log(e, log);
+		if (p)
+			rc = se_recover_logparallel(e, log, p);
+		else
+			rc = se_recover_log(e, log);
 		if (ssunlikely(rc == -1))
-			return -1;
+			break;
 		current++;
 	}
-	return 0;
+	if (p) {
+		/* wait for the apply queues to drain */
+		int rcstop = se_recover_poolstop(e, p);
+		if (ssunlikely(rcstop == -1))
+			rc = -1;
+	}
+	return rc;
 }
 
 int se_recover(se *e)
 {
+	uint64_t start = ss_utime();
 	int rc = sw_manageropen(&e->wm);
 	if (ssunlikely(rc == -1))
 		goto error;
 	rc = se_recover_logpool(e);
 	if (ssunlikely(rc == -1))
 		goto error;
+	e->recover.log = ss_utime() - start;
 	return 0;
 error:
 	sr_statusset(&e->status, SR_MALFUNCTION);
@@ -29837,6 +38890,13 @@ se_txdelete(so *o, so *v)
 {
 	setx *t = se_cast(o, setx*, SETX);
 	sedocument *key = se_cast(v, sedocument*, SEDOCUMENT);
+	if (ssunlikely(key->range_stop)) {
+		se *e = se_of(&t->o);
+		so_destroy(v);
+		sr_error(&e->error, "%s", "range delete is not supported "
+		         "by transactions");
+		return -1;
+	}
 	return se_txwrite(t, key, SVDELETE);
 }
 
@@ -29858,6 +38918,19 @@ error:
 	return NULL;
 }
 
+static int
+se_txgetv(so *o, so **v, int count)
+{
+	setx *t = se_cast(o, setx*, SETX);
+	se *e = se_of(&t->o);
+	int i = 0;
+	while (i < count) {
+		se_cast(v[i], sedocument*, SEDOCUMENT);
+		i++;
+	}
+	return se_readv(e, (sedocument**)v, count, &t->t, t->t.vlsn);
+}
+
 static inline void
 se_txfree(so *o)
 {
@@ -29918,6 +38991,7 @@ se_txcommit(so *o)
 	if (ssunlikely(! sr_statusactive_is(status)))
 		return -1;
 	int recover = (status == SR_RECOVER);
+	uint64_t start = ss_utime();
 	int rc;
 
 	/* prepare transaction */
@@ -29965,6 +39039,7 @@ se_txcommit(so *o)
 			sv_vunref(db->r, lv->v);
 		}
 	}
+	ss_histadd(&e->hist_commit, ss_utime() - start);
 	se_txend(t, 0, 0);
 	return rc;
 }
@@ -30000,10 +39075,15 @@ static soif setxif =
 	.getobject    = NULL,
 	.getstring    = NULL,
 	.getint       = se_txget_int,
+	.setfield     = NULL,
+	.setfieldint  = NULL,
+	.getfield     = NULL,
+	.getfieldint  = NULL,
 	.set          = se_txset,
 	.upsert       = se_txupsert,
 	.del          = se_txdelete,
 	.get          = se_txget,
+	.getv         = se_txgetv,
 	.begin        = NULL,
 	.prepare      = NULL,
 	.commit       = se_txcommit,
@@ -30076,12 +39156,17 @@ SP_API int      sp_setint(void*, const char*, int64_t);
 SP_API void    *sp_getobject(void*, const char*);
 SP_API void    *sp_getstring(void*, const char*, int*);
 SP_API int64_t  sp_getint(void*, const char*);
+SP_API int      sp_setfield(void*, int, const void*, int);
+SP_API int      sp_setfieldint(void*, int, int64_t);
+SP_API void    *sp_getfield(void*, int, int*);
+SP_API int64_t  sp_getfieldint(void*, int);
 SP_API int      sp_open(void*);
 SP_API int      sp_destroy(void*);
 SP_API int      sp_set(void*, void*);
 SP_API int      sp_upsert(void*, void*);
 SP_API int      sp_delete(void*, void*);
 SP_API void    *sp_get(void*, void*);
+SP_API int      sp_getv(void*, void**, int);
 SP_API void    *sp_cursor(void*);
 SP_API void    *sp_begin(void*);
 SP_API int      sp_prepare(void*);
@@ -30262,6 +39347,62 @@ SP_API int64_t sp_getint(void *ptr, const char *path)
 	return rc;
 }
 
+SP_API int sp_setfield(void *ptr, int pos, const void *pointer, int size)
+{
+	so *o = sp_cast(ptr, __func__);
+	if (ssunlikely(o->i->setfield == NULL)) {
+		sp_unsupported(o, __func__);
+		return -1;
+	}
+	so *e = o->env;
+	se_apilock(e);
+	int rc = o->i->setfield(o, pos, (void*)pointer, size);
+	se_apiunlock(e);
+	return rc;
+}
+
+SP_API int sp_setfieldint(void *ptr, int pos, int64_t v)
+{
+	so *o = sp_cast(ptr, __func__);
+	if (ssunlikely(o->i->setfieldint == NULL)) {
+		sp_unsupported(o, __func__);
+		return -1;
+	}
+	so *e = o->env;
+	se_apilock(e);
+	int rc = o->i->setfieldint(o, pos, v);
+	se_apiunlock(e);
+	return rc;
+}
+
+SP_API void *sp_getfield(void *ptr, int pos, int *size)
+{
+	so *o = sp_cast(ptr, __func__);
+	if (ssunlikely(o->i->getfield == NULL)) {
+		sp_unsupported(o, __func__);
+		return NULL;
+	}
+	so *e = o->env;
+	se_apilock(e);
+	void *h = o->i->getfield(o, pos, size);
+	se_apiunlock(e);
+	return h;
+}
+
+SP_API int64_t sp_getfieldint(void *ptr, int pos)
+{
+	so *o = sp_cast(ptr, __func__);
+	if (ssunlikely(o->i->getfieldint == NULL)) {
+		sp_unsupported(o, __func__);
+		return -1;
+	}
+	so *e = o->env;
+	se_apilock(e);
+	int64_t rc = o->i->getfieldint(o, pos);
+	se_apiunlock(e);
+	return rc;
+}
+
 SP_API int sp_set(void *ptr, void *ptr_arg)
 {
 	so *o = sp_cast(ptr, __func__);
@@ -30271,9 +39412,10 @@ SP_API int sp_set(void *ptr, void *ptr_arg)
 		return -1;
 	}
 	so *e = o->env;
-	se_apilock(e);
+	uint64_t wsn = se_apilock_write(e);
 	int rc = o->i->set(o, v);
-	se_apiunlock(e);
+	if (ssunlikely(se_apiunlock_write(e, wsn) == -1))
+		rc = -1;
 	return rc;
 }
 
@@ -30286,9 +39428,10 @@ SP_API int sp_upsert(void *ptr, void *ptr_arg)
 		return -1;
 	}
 	so *e = o->env;
-	se_apilock(e);
+	uint64_t wsn = se_apilock_write(e);
 	int rc = o->i->upsert(o, v);
-	se_apiunlock(e);
+	if (ssunlikely(se_apiunlock_write(e, wsn) == -1))
+		rc = -1;
 	return rc;
 }
 
@@ -30301,9 +39444,10 @@ SP_API int sp_delete(void *ptr, void *ptr_arg)
 		return -1;
 	}
 	so *e = o->env;
-	se_apilock(e);
+	uint64_t wsn = se_apilock_write(e);
 	int rc = o->i->del(o, v);
-	se_apiunlock(e);
+	if (ssunlikely(se_apiunlock_write(e, wsn) == -1))
+		rc = -1;
 	return rc;
 }
 
@@ -30324,6 +39468,25 @@ SP_API void *sp_get(void *ptr, void *ptr_arg)
 	return h;
 }
 
+SP_API int sp_getv(void *ptr, void **ptr_arg, int count)
+{
+	so *o = sp_cast(ptr, __func__);
+	int i = 0;
+	while (i < count) {
+		sp_cast(ptr_arg[i], __func__);
+		i++;
+	}
+	if (ssunlikely(o->i->getv == NULL)) {
+		sp_unsupported(o, __func__);
+		return -1;
+	}
+	so *e = o->env;
+	se_apilock(e);
+	int rc = o->i->getv(o, (so**)ptr_arg, count);
+	se_apiunlock(e);
+	return rc;
+}
+
 SP_API void *sp_cursor(void *ptr)
 {
 	so *o = sp_cast(ptr, __func__);
@@ -30374,9 +39537,10 @@ SP_API int sp_commit(void *ptr)
 		return -1;
 	}
 	so *e = o->env;
-	se_apilock(e);
+	uint64_t wsn = se_apilock_write(e);
 	int rc = o->i->commit(o);
-	se_apiunlock(e);
+	if (ssunlikely(se_apiunlock_write(e, wsn) == -1))
+		rc = -1;
 	return rc;
 }
 /* vim: foldmethod=marker
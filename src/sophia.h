@@ -29,12 +29,17 @@ SP_API int      sp_setint(void*, const char*, int64_t);
 SP_API void    *sp_getobject(void*, const char*);
 SP_API void    *sp_getstring(void*, const char*, int*);
 SP_API int64_t  sp_getint(void*, const char*);
+SP_API int      sp_setfield(void*, int, const void*, int);
+SP_API int      sp_setfieldint(void*, int, int64_t);
+SP_API void    *sp_getfield(void*, int, int*);
+SP_API int64_t  sp_getfieldint(void*, int);
 SP_API int      sp_open(void*);
 SP_API int      sp_destroy(void*);
 SP_API int      sp_set(void*, void*);
 SP_API int      sp_upsert(void*, void*);
 SP_API int      sp_delete(void*, void*);
 SP_API void    *sp_get(void*, void*);
+SP_API int      sp_getv(void*, void**, int);
 SP_API void    *sp_cursor(void*);
 SP_API void    *sp_begin(void*);
 SP_API int      sp_prepare(void*);
@@ -1,9 +1,16 @@
 import os
 import pickle
+import random
 import shutil
 import sys
+import threading
+import time
 import unittest
 import uuid
+try:
+    import asyncio
+except ImportError:
+    asyncio = None
 
 from sophy import *
 
@@ -36,6 +43,14 @@ class BaseTestCase(unittest.TestCase):
     def create_env(self):
         return Sophia(TEST_DIR)
 
+    def checkpoint(self, db):
+        # Flush the in-memory index to node files.
+        db.compaction_checkpoint = 0
+        deadline = time.time() + 10
+        while db.index_memory_used and time.time() < deadline:
+            time.sleep(0.01)
+        self.assertEqual(db.index_memory_used, 0)
+
 
 class TestConfigurationStability(unittest.TestCase):
     def setUp(self):
@@ -105,6 +120,1091 @@ class TestConfiguration(BaseTestCase):
         self.assertEqual(self.env.status, 'online')
 
 
+class TestParallelRecovery(BaseTestCase):
+    databases = tuple(
+        ('db%s' % i, Schema([U64Index('key')], [StringIndex('value')]))
+        for i in range(6))
+
+    def test_parallel_recovery(self):
+        dbs = [self.env['db%s' % i] for i in range(6)]
+        for n, db in enumerate(dbs):
+            db.update(dict((i, 'v%s-%s' % (n, i)) for i in range(2000)))
+        self.checkpoint(dbs[0])
+        self.checkpoint(dbs[1])
+        for n, db in enumerate(dbs):
+            for i in range(0, 2000, 3):
+                db[i] = 'u%s-%s' % (n, i)
+            db.multi_delete(range(0, 2000, 5))
+        with self.env.transaction() as txn:
+            for db in dbs:
+                txn[db][5000] = 'txn'
+        expected = [list(db) for db in dbs]
+
+        for threads in (1, 4):
+            self.assertTrue(self.env.close())
+            self.env.scheduler_recover_threads = threads
+            self.assertTrue(self.env.open())
+            self.assertEqual(self.env.scheduler_recover_threads, threads)
+            self.assertEqual([list(db) for db in dbs], expected)
+            self.assertTrue(self.env.metric_recover_log_records > 0)
+            self.assertTrue(self.env.metric_recover_log_us > 0)
+
+        dbs[0][1] = 'after'
+        self.assertTrue(self.env.close())
+        self.assertTrue(self.env.open())
+        self.assertEqual(dbs[0][1], 'after')
+
+
+class TestCompressionThreads(BaseTestCase):
+    databases = ()
+
+    def create_env(self):
+        env = Sophia(TEST_DIR)
+        env.scheduler_compression_threads = 3
+        db = env.add_database('main', Schema([U64Index('key')],
+                                             [StringIndex('value')]))
+        db.compression = 'lz4'
+        db.compaction_node_size = 256 * 1024
+        db.compaction_page_size = 4096
+        return env
+
+    def test_compression_threads(self):
+        db = self.env['main']
+        self.assertEqual(self.env.scheduler_compression_threads, 3)
+        for i in range(20000):
+            db[i] = 'value-%s-%s' % (i, 'x' * (i % 64))
+        self.checkpoint(db)
+        self.assertTrue(db.index_node_count > 1)
+        self.assertTrue(db.index_size < db.index_size_uncompressed)
+        self.assertEqual(list(db.keys()), list(range(20000)))
+
+        self.assertTrue(self.env.close())
+        self.assertTrue(self.env.open())
+        for i in range(0, 20000, 7):
+            self.assertEqual(db[i], 'value-%s-%s' % (i, 'x' * (i % 64)))
+
+
+class TestIoUring(BaseTestCase):
+    def create_env(self):
+        env = Sophia(TEST_DIR)
+        env.io_uring = 1
+        env.log_sync = 1
+        env.log_group_commit_max_batch = 32
+        return env
+
+    def test_io_uring(self):
+        # Falls back to regular I/O on kernels without io_uring.
+        self.assertTrue(self.env.io_uring in (0, 1))
+        db = self.env['main']
+        db.update(dict(('k%05d' % i, 'v%s' % i) for i in range(5000)))
+        self.checkpoint(db)
+        keys = ['k%05d' % i for i in range(0, 5000, 3)]
+        self.assertEqual(db.multi_get(keys),
+                         ['v%s' % i for i in range(0, 5000, 3)])
+        self.assertEqual(len(list(db)), 5000)
+
+        self.assertTrue(self.env.close())
+        self.assertTrue(self.env.open())
+        self.assertEqual(db['k04999'], 'v4999')
+        self.assertEqual(len(list(db)), 5000)
+
+
+class TestCloseWhileBusy(BaseTestCase):
+    def test_close_while_busy(self):
+        db = self.env['main']
+        for i in range(100):
+            db['k%03d' % i] = 'v%03d' % i
+
+        errors = []
+        running = threading.Event()
+
+        def worker():
+            try:
+                while True:
+                    for i in range(100):
+                        db['k%03d' % i] = db['k%03d' % i]
+                    for _ in db.cursor():
+                        pass
+                    running.set()
+            except SophiaError:
+                pass
+            except Exception as exc:
+                errors.append(exc)
+
+        threads = [threading.Thread(target=worker) for _ in range(4)]
+        for t in threads: t.start()
+        running.wait()
+
+        # Calls already inside the engine finish before the environment is
+        # destroyed, later calls raise.
+        self.assertTrue(self.env.close())
+        for t in threads: t.join()
+        self.assertEqual(errors, [])
+
+        self.assertTrue(self.env.open())
+        self.assertEqual(len(db), 100)
+        self.assertEqual(db['k050'], 'v050')
+
+
+class TestGroupCommit(BaseTestCase):
+    def create_env(self):
+        env = Sophia(TEST_DIR)
+        env.log_sync = 1
+        env.log_group_commit_max_batch = 32
+        env.log_group_commit_max_wait_us = 100
+        return env
+
+    def test_group_commit(self):
+        self.assertEqual(self.env.log_group_commit_max_batch, 32)
+        self.assertEqual(self.env.log_group_commit_max_wait_us, 100)
+        db = self.env['main']
+
+        def writer(t):
+            for i in range(50):
+                db['k%s-%02d' % (t, i)] = 'v%s-%02d' % (t, i)
+
+        threads = [threading.Thread(target=writer, args=(t,))
+                   for t in range(4)]
+        for t in threads: t.start()
+        for t in threads: t.join()
+
+        with self.env.transaction() as txn:
+            txn[db].update(kx='vx', ky='vy')
+
+        # Concurrent commits share log syncs.
+        syncs = self.env.stats()['log']['sync']['count']
+        self.assertTrue(0 < syncs < 201)
+
+        # Data written by batched commits is recovered from the log.
+        self.assertTrue(self.env.close())
+        self.assertTrue(self.env.open())
+        self.assertEqual(len(db), 202)
+        for t in range(4):
+            for i in range(50):
+                self.assertEqual(db['k%s-%02d' % (t, i)], 'v%s-%02d' % (t, i))
+        self.assertEqual(db['kx'], 'vx')
+
+
+class TestCompactionRateLimit(BaseTestCase):
+    databases = (
+        ('main', Schema([U64Index('key')], [BytesIndex('value')])),
+    )
+
+    def create_env(self):
+        env = Sophia(TEST_DIR)
+        env.scheduler_compaction_rate_mb = 2
+        env.scheduler_compaction_latency_us = 1000
+        return env
+
+    def test_compaction_rate(self):
+        self.assertEqual(self.env.scheduler_compaction_rate_mb, 2)
+        self.assertEqual(self.env.scheduler_compaction_latency_us, 1000)
+        self.assertEqual(self.env.scheduler_compaction_rate, 2)
+        db = self.env['main']
+        value = b'x' * 1024
+        for i in range(2048):
+            db[i] = value
+
+        # Writing ~2MB of node files at 2MB/s is throttled.
+        self.checkpoint(db)
+        self.assertTrue(self.env.scheduler_compaction_wait_us > 0)
+        self.assertTrue(self.env.scheduler_compaction_rate <= 2)
+        self.assertEqual(db[1000], value)
+
+        # The limit can be lifted while the environment is online.
+        self.env.scheduler_compaction_rate_mb = 0
+        self.assertEqual(self.env.scheduler_compaction_rate_mb, 0)
+        throttle = self.env.scheduler_compaction_wait_us
+        for i in range(2048, 4096):
+            db[i] = value
+        self.checkpoint(db)
+        self.assertEqual(self.env.scheduler_compaction_wait_us, throttle)
+        self.assertEqual(len(db), 4096)
+
+
+class TestSchedulerZones(BaseTestCase):
+    databases = tuple(
+        ('db%s' % i, Schema([U64Index('key')], [StringIndex('value')]))
+        for i in range(8))
+
+    def setUp(self):
+        cleanup()
+        self.env = self.create_env()
+        for name, schema in self.databases:
+            db = self.env.add_database(name, schema)
+            db.compaction_cache = 1024 * 1024
+        self.env['db3'].scheduler_weight = 4
+        self.env['db3'].scheduler_workers = 1
+        assert self.env.open()
+
+    def test_zones(self):
+        hot = self.env['db3']
+        self.assertEqual(hot.scheduler_weight, 4)
+        self.assertEqual(hot.scheduler_workers, 1)
+        self.assertEqual(self.env['db0'].scheduler_weight, 1)
+        self.assertEqual(self.env['db0'].scheduler_workers, 0)
+
+        value = 'x' * 1024
+        active = 0
+        for i in range(8192):
+            hot[i] = value
+            if i % 512 == 0:
+                active = max(active, hot.scheduler_active)
+        self.assertTrue(active <= 1)
+
+        # Idle databases still get their checkpoints served.
+        cold = self.env['db6']
+        cold[1] = 'one'
+        self.checkpoint(cold)
+        self.checkpoint(hot)
+        self.assertEqual(hot[8191], value)
+        self.assertEqual(cold[1], 'one')
+
+        # Settings can be changed while online.
+        hot.scheduler_workers = 0
+        self.assertEqual(hot.scheduler_workers, 0)
+
+
+class TestBloomFilter(BaseTestCase):
+    def setUp(self):
+        cleanup()
+        self.env = self.create_env()
+        self.db = self.env.add_database('main', Schema([U64Index('key')],
+                                                       [StringIndex('value')]))
+        self.db.compaction_bloom_bits_per_key = 10
+        assert self.env.open()
+
+    def test_bloom_filter(self):
+        db = self.db
+        self.assertEqual(db.compaction_bloom_bits_per_key, 10)
+        for i in range(0, 2000, 2):
+            db[i] = 'v%s' % i
+        self.checkpoint(db)
+        self.assertEqual(db.index_bloom_skip, 0)
+
+        # Keys stored on disk are still found.
+        for i in range(0, 2000, 2):
+            self.assertEqual(db[i], 'v%s' % i)
+
+        # Most absent keys are ruled out without reading the node file.
+        for i in range(1, 2000, 2):
+            self.assertFalse(i in db)
+        skip = db.index_bloom_skip
+        self.assertTrue(skip > 900)
+        self.assertEqual(skip + db.index_bloom_false_positive, 1000)
+
+        # The filter is persisted with the node.
+        self.assertTrue(self.env.close())
+        self.assertTrue(self.env.open())
+        self.assertEqual(db[1000], 'v1000')
+        self.assertRaises(KeyError, lambda: db[1001])
+        self.assertEqual(
+            db.index_bloom_skip + db.index_bloom_false_positive, 1)
+
+
+class TestPageCache(BaseTestCase):
+    def setUp(self):
+        cleanup()
+        self.env = self.create_env()
+        self.env.memory_page_cache_limit = 16 * 1024 * 1024
+        self.db = self.env.add_database('main', Schema([U64Index('key')],
+                                                       [StringIndex('value')]))
+        self.db.mmap = 0
+        self.db.compression = 'lz4'
+        assert self.env.open()
+
+    def test_page_cache(self):
+        db = self.db
+        self.assertEqual(self.env.memory_page_cache_limit, 16 * 1024 * 1024)
+        for i in range(1000):
+            db[i] = 'v%s' % i
+        self.checkpoint(db)
+        self.assertEqual(self.env.memory_page_cache_used, 0)
+
+        for i in range(1000):
+            self.assertEqual(db[i], 'v%s' % i)
+        read_disk = db.index_read_disk
+        self.assertTrue(read_disk > 0)
+        self.assertTrue(self.env.memory_page_cache_used > 0)
+
+        # Decompressed pages are served from the shared cache.
+        read_cache = db.index_read_cache
+        for i in range(1000):
+            self.assertEqual(db[i], 'v%s' % i)
+        self.assertEqual(db.index_read_disk, read_disk)
+        self.assertTrue(db.index_read_cache >= read_cache + 1000)
+        self.assertEqual([k for k, _ in db[100:110]], list(range(100, 111)))
+
+
+class TestDictionaryCompression(BaseTestCase):
+    def setUp(self):
+        cleanup()
+        self.env = self.create_env()
+        self.db = self.env.add_database('main', Schema([U64Index('key')],
+                                                       [StringIndex('value')]))
+        self.db.compression = 'lz4_dict'
+        self.db.compression_dict_size = 4096
+        assert self.env.open()
+
+    def doc(self, i):
+        return ('{"id": %d, "name": "user-%d", "email": "user%d@example.com", '
+                '"tags": ["alpha", "beta"]}' % (i, i, i))
+
+    def test_dictionary_compression(self):
+        db = self.db
+        self.assertEqual(db.compression, 'lz4_dict')
+        self.assertEqual(db.compression_dict_size, 4096)
+        self.assertEqual(db.compression_dict, 0)
+        for i in range(1000):
+            db[i] = self.doc(i)
+
+        # The first checkpoint trains the dictionary.
+        self.checkpoint(db)
+        self.assertEqual(db.compression_dict, 1)
+        self.assertTrue(db.index_size < db.index_size_uncompressed)
+
+        # Retraining adds a version, older pages stay readable.
+        for i in range(1000, 2000):
+            db[i] = self.doc(i)
+        db.train_compression()
+        self.assertEqual(db.compression_dict, 2)
+        self.checkpoint(db)
+
+        self.assertTrue(self.env.close())
+        self.assertTrue(self.env.open())
+        self.assertEqual(db.compression_dict, 2)
+        for i in range(0, 2000, 7):
+            self.assertEqual(db[i], self.doc(i))
+
+    def test_train_errors(self):
+        # Nothing in memory to sample.
+        self.assertRaises(SophiaError, self.db.train_compression)
+
+        # Only lz4_dict databases have dictionaries.
+        self.assertTrue(self.env.close())
+        db = self.env.add_database('plain', Schema([U64Index('key')],
+                                                   [StringIndex('value')]))
+        self.assertTrue(self.env.open())
+        db[1] = 'v1'
+        self.assertRaises(SophiaError, db.train_compression)
+        self.assertEqual(db.compression_dict, 0)
+
+
+class TestPrefixPages(BaseTestCase):
+    def setUp(self):
+        cleanup()
+        self.env = self.create_env()
+        self.db = self.env.add_database('main', Schema(
+            [U64Index('tenant'), StringIndex('path')],
+            [StringIndex('value')]))
+        self.db.compaction_page_prefix = 1
+        assert self.env.open()
+
+    def path(self, i):
+        return '/srv/data/region-%02d/account-%06d.json' % (i % 7, i)
+
+    def test_prefix_pages(self):
+        db = self.db
+        self.assertEqual(db.compaction_page_prefix, 1)
+        for tenant in (1, 2):
+            for i in range(1000):
+                db[tenant, self.path(i)] = 'v%s-%s' % (tenant, i)
+        self.checkpoint(db)
+        self.assertTrue(db.index_size < db.index_size_uncompressed)
+
+        for i in range(0, 1000, 3):
+            del db[2, self.path(i)]
+        self.checkpoint(db)
+
+        self.assertTrue(self.env.close())
+        self.assertTrue(self.env.open())
+        for i in range(0, 1000, 7):
+            self.assertEqual(db[1, self.path(i)], 'v1-%s' % i)
+            if i % 3:
+                self.assertEqual(db[2, self.path(i)], 'v2-%s' % i)
+            else:
+                self.assertFalse((2, self.path(i)) in db)
+
+        keys = list(db.keys())
+        self.assertEqual(len(keys), 1000 + 666)
+        self.assertEqual(keys, sorted(keys))
+        self.assertEqual(list(db.cursor(order='<', values=False)), keys[::-1])
+
+
+class TestValueLog(BaseTestCase):
+    def setUp(self):
+        cleanup()
+        self.env = self.create_env()
+        self.db = self.env.add_database('main', Schema([U64Index('key')],
+                                                       [StringIndex('value')]))
+        self.db.value_log_threshold = 256
+        self.db.compaction_node_size = 256 * 1024
+        self.db.compaction_gc_period = 1
+        assert self.env.open()
+
+    def create_env(self):
+        env = Sophia(TEST_DIR)
+        env.scheduler_threads = 4
+        return env
+
+    def value(self, i, gen=0):
+        if i % 3 == 0:
+            return 'small-%s-%s' % (i, gen)
+        return ('%s-%s-' % (i, gen)) * 100
+
+    def test_value_log(self):
+        db = self.db
+        self.assertEqual(db.value_log_threshold, 256)
+        for i in range(2000):
+            db[i] = self.value(i)
+        self.checkpoint(db)
+        self.assertTrue(db.index_value_log_files > 0)
+        self.assertEqual(db.index_value_log_live, db.index_value_log_size)
+        self.assertTrue(db.index_size < db.index_value_log_size)
+
+        self.assertEqual(db[1], self.value(1))
+        self.assertEqual(db[3], self.value(3))
+        self.assertEqual(list(db.keys()), list(range(2000)))
+        self.assertEqual([v for _, v in db[10:20]],
+                         [self.value(i) for i in range(10, 21)])
+
+        # Rewritten values leave garbage, which gc moves out of the
+        # value log files.
+        for gen in (1, 2):
+            for i in range(0, 2000, 2):
+                db[i] = self.value(i, gen)
+            self.checkpoint(db)
+        self.assertTrue(db.index_value_log_live < db.index_value_log_size)
+        deadline = time.time() + 10
+        while (db.index_value_log_live < db.index_value_log_size and
+               time.time() < deadline):
+            time.sleep(0.05)
+        self.assertEqual(db.index_value_log_live, db.index_value_log_size)
+
+        self.assertTrue(self.env.close())
+        self.assertTrue(self.env.open())
+        for i in range(0, 2000, 7):
+            self.assertEqual(db[i], self.value(i, 2 if i % 2 == 0 else 0))
+
+    def test_concurrent_writers(self):
+        db = self.db
+        db.compaction_checkpoint = 0
+
+        # Writers rewrite and delete keys while nodes are
+        # compacted, so node ranges shift under the in-memory versions.
+        def writer(t):
+            for gen in range(1, 4):
+                for i in range(t, 2000, 4):
+                    if (i + gen) % 5 == 0:
+                        del db[i]
+                    else:
+                        db[i] = self.value(i, gen)
+
+        threads = [threading.Thread(target=writer, args=(t,))
+                   for t in range(4)]
+        for t in threads: t.start()
+        for t in threads: t.join()
+
+        expected = dict((i, self.value(i, 3)) for i in range(2000)
+                        if (i + 3) % 5 != 0)
+        self.checkpoint(db)
+        self.assertEqual(dict(db.items()), expected)
+        self.assertTrue(self.env.close())
+        self.assertTrue(self.env.open())
+        self.assertEqual(dict(db.items()), expected)
+
+    def test_upsert_incompatible(self):
+        self.assertTrue(self.env.close())
+        db = self.env.add_database('counter', Schema([U64Index('key')],
+                                                     [U64Index('value')]))
+        db.upsert_operator = 'add'
+        db.value_log_threshold = 256
+        self.assertRaises(SophiaError, self.env.open)
+
+
+class TestRangeDelete(BaseTestCase):
+    def setUp(self):
+        cleanup()
+        self.env = self.create_env()
+        self.db = self.env.add_database('main', Schema([U64Index('key')],
+                                                       [StringIndex('value')]))
+        self.db.compaction_node_size = 64 * 1024
+        assert self.env.open()
+
+    def test_delete_range(self):
+        db = self.db
+        for i in range(4000):
+            db[i] = 'v%s' % i
+        self.checkpoint(db)
+        nodes = db.index_node_count
+        db[1500] = 'v1500'  # Also covers versions still in memory.
+
+        db.delete_range(1000, 3000)
+        self.assertEqual(db.index_range_deletes, 1)
+        self.assertFalse(1000 in db)
+        self.assertFalse(2999 in db)
+        self.assertEqual(db[999], 'v999')
+        self.assertEqual(db[3000], 'v3000')
+        self.assertEqual(list(db.keys()),
+                         list(range(1000)) + list(range(3000, 4000)))
+
+        # Keys written after the delete are visible.
+        db[2000] = 'new'
+        self.assertEqual(db[2000], 'new')
+
+        # An empty range is a no-op.
+        db.delete_range(10, 10)
+        db.delete_range(20, 10)
+        self.assertEqual(db[10], 'v10')
+
+        with self.env.transaction() as txn:
+            tdb = txn[db]
+            self.assertRaises(SophiaError, tdb.delete_range, 0, 10)
+
+        # The tombstone survives recovery from the log.
+        self.assertTrue(self.env.close())
+        self.assertTrue(self.env.open())
+        self.assertEqual(list(db.keys()),
+                         list(range(1000)) + [2000] +
+                         list(range(3000, 4000)))
+
+        # The scheduler drops the covered nodes and retires the tombstone.
+        deadline = time.time() + 10
+        while db.index_range_deletes and time.time() < deadline:
+            time.sleep(0.05)
+        self.assertEqual(db.index_range_deletes, 0)
+        self.assertTrue(db.index_node_count < nodes)
+        self.assertEqual(db[2000], 'new')
+        self.assertFalse(1500 in db)
+
+    def test_delete_slice(self):
+        db = self.db
+        for i in range(100):
+            db[i] = 'v%s' % i
+
+        # Slices include the stop key, as with get_range().
+        del db[10:20]
+        self.assertEqual([k for k, _ in db[5:25]],
+                         list(range(5, 10)) + list(range(21, 26)))
+        del db[90:]
+        del db[:4]
+        self.assertEqual(list(db.keys()),
+                         list(range(5, 10)) + list(range(21, 90)))
+        self.assertRaises(ValueError, db.__delitem__, slice(0, 10, 2))
+
+
+class ExpireIndex(U32Index):
+    # Row timestamp the engine expires rows by, filled in on write when no
+    # value is given.
+    data_type = 'u32,timestamp,expire'
+
+
+class TestExpire(BaseTestCase):
+    ttl = 60
+
+    def setUp(self):
+        cleanup()
+        self.env = self.create_env()
+        for name, wm in (('drop', 0), ('plain', 0), ('gated', 50)):
+            db = self.env.add_database(name, Schema(
+                [U64Index('key')], [StringIndex('value'), ExpireIndex('ts')]))
+            db.expire = self.ttl
+            db.compaction_expire_period = 1
+            db.compaction_expire_wm = wm
+            db.compaction_node_size = 64 * 1024
+        assert self.env.open()
+
+    def rows(self, expired):
+        # Rows loaded with an old timestamp expire two seconds later, nodes
+        # are written while they are still live.
+        now = int(time.time())
+        for i in range(4000):
+            ts = now - self.ttl + 2 if expired(i) else now
+            yield (i, ('%0100d' % i, ts))
+
+    def wait(self, predicate):
+        deadline = time.time() + 10
+        while not predicate() and time.time() < deadline:
+            time.sleep(0.05)
+        self.assertTrue(predicate())
+
+    def test_expire_drop(self):
+        db = self.env['drop']
+        db.bulk_load(self.rows(lambda i: i < 2000))
+        nodes = db.index_node_count
+        self.assertTrue(nodes > 4)
+
+        # Written to a node which is dropped, moved to its neighbour.
+        now = int(time.time())
+        db[100] = ('kept', now)
+
+        self.wait(lambda: list(db.keys()) == [100] + list(range(2000, 4000)))
+        self.assertTrue(db.scheduler_expire_drop > 0)
+        self.assertTrue(db.index_node_count < nodes)
+        self.assertEqual(db[100], ('kept', now))
+
+        self.checkpoint(db)
+        self.assertTrue(self.env.close())
+        self.assertTrue(self.env.open())
+        db = self.env['drop']
+        self.assertEqual(db[100], ('kept', now))
+        self.assertEqual(list(db.keys()), [100] + list(range(2000, 4000)))
+
+    def test_expire_wm(self):
+        # Every page keeps live rows, so no page is made up only of expired
+        # rows and the gated database never rewrites a node.
+        plain, gated = self.env['plain'], self.env['gated']
+        plain.bulk_load(self.rows(lambda i: i % 2))
+        gated.bulk_load(self.rows(lambda i: i % 2))
+
+        self.wait(lambda: list(plain.keys()) == list(range(0, 4000, 2)))
+        self.assertTrue(plain.scheduler_expire_rewrite > 0)
+        self.assertEqual(plain.scheduler_expire_drop, 0)
+
+        time.sleep(1.5)
+        self.assertEqual(gated.scheduler_expire_rewrite, 0)
+        self.assertEqual(gated.scheduler_expire_drop, 0)
+        self.assertEqual(len(list(gated.keys())), 4000)
+
+
+class TestIncrementalBackup(BaseTestCase):
+    backup_dir = TEST_DIR + '-backup'
+
+    def setUp(self):
+        shutil.rmtree(self.backup_dir, ignore_errors=True)
+        cleanup()
+        self.env = self.create_env()
+        self.env.backup_path = self.backup_dir
+        self.db = self.env.add_database('main', Schema([U64Index('key')],
+                                                       [StringIndex('value')]))
+        assert self.env.open()
+
+    def tearDown(self):
+        super(TestIncrementalBackup, self).tearDown()
+        shutil.rmtree(self.backup_dir, ignore_errors=True)
+
+    def backup(self):
+        last = self.env.backup_last
+        self.env.backup_run()
+        deadline = time.time() + 10
+        while self.env.backup_last == last and time.time() < deadline:
+            time.sleep(0.01)
+        self.assertEqual(self.env.backup_last_complete, 1)
+        path = os.path.join(self.backup_dir, str(self.env.backup_last))
+        with open(os.path.join(path, 'manifest')) as fh:
+            return path, fh.read().splitlines()
+
+    def test_incremental_backup(self):
+        db = self.db
+        for i in range(1000):
+            db[i] = 'v%s' % i
+        self.checkpoint(db)
+        db[1000] = 'v1000'
+
+        path, manifest = self.backup()
+        self.assertEqual(manifest[0], '# sophia backup 1 full')
+        self.assertEqual(self.env.backup_files_linked, 0)
+        self.assertTrue(self.env.backup_bytes_copied > 0)
+
+        self.env.backup_incremental = 1
+        path, manifest = self.backup()
+        self.assertEqual(manifest[0], '# sophia backup 2 incremental')
+        entries = [line.split() for line in manifest[1:]]
+        nodes = [kind for kind, name, _ in entries if name.endswith('.db')]
+        self.assertTrue(nodes)
+        self.assertEqual(set(nodes), set(['link']))
+        self.assertTrue(self.env.backup_bytes_linked > 0)
+
+        # The backup is a complete environment.
+        self.assertTrue(self.env.close())
+        env = Sophia(path)
+        backup_db = env.add_database('main', Schema([U64Index('key')],
+                                                    [StringIndex('value')]))
+        self.assertTrue(env.open())
+        self.assertEqual(backup_db[1], 'v1')
+        self.assertEqual(backup_db[1000], 'v1000')
+        self.assertEqual(len(backup_db), 1001)
+        self.assertTrue(env.close())
+        self.assertTrue(self.env.open())
+
+
+class TestSlabAllocator(BaseTestCase):
+    def setUp(self):
+        cleanup()
+        self.env = self.create_env()
+        self.env.memory_allocator = 'slab'
+        self.db = self.env.add_database('main', Schema([U64Index('key')],
+                                                       [StringIndex('value')]))
+        assert self.env.open()
+
+    def test_slab_allocator(self):
+        db = self.db
+        self.assertEqual(self.env.memory_allocator, 'slab')
+        for i in range(2000):
+            db[i] = 'v%s' % ('x' * (i % 500))
+        with self.env.transaction() as txn:
+            tdb = txn[db]
+            for i in range(0, 2000, 2):
+                del tdb[i]
+
+        footprint = self.env.memory_allocator_footprint
+        self.assertTrue(self.env.memory_allocator_used > 0)
+        self.assertTrue(footprint >= self.env.memory_allocator_used)
+        self.assertTrue(self.env.memory_allocator_slabs > 0)
+
+        # Slabs emptied by the checkpoint are released.
+        self.checkpoint(db)
+        self.assertTrue(self.env.memory_allocator_footprint < footprint)
+        self.assertEqual(len(db), 1000)
+        self.assertEqual(db[1], 'v' + 'x')
+        self.assertEqual(db[499], 'v' + 'x' * 499)
+        self.assertRaises(KeyError, lambda: db[2])
+
+        self.assertTrue(self.env.close())
+        self.assertTrue(self.env.open())
+        self.assertEqual(len(db), 1000)
+        self.assertEqual(db[1999], 'v' + 'x' * 499)
+
+    def test_allocator_setting(self):
+        self.assertTrue(self.env.close())
+        self.env.memory_allocator = 'unknown'
+        self.assertRaises(SophiaError, self.env.open)
+
+        self.env.memory_allocator = 'malloc'
+        self.assertTrue(self.env.open())
+        self.assertEqual(self.env.memory_allocator, 'malloc')
+        self.db[1] = 'v1'
+        self.assertEqual(self.db[1], 'v1')
+        self.assertEqual(self.env.memory_allocator_footprint, 0)
+
+
+class TestBTreeMemtable(BaseTestCase):
+    def setUp(self):
+        cleanup()
+        self.env = self.create_env()
+        self.db = self.env.add_database('main', Schema([U64Index('key')],
+                                                       [StringIndex('value')]))
+        self.db.memtable = 'btree'
+        self.sdb = self.env.add_database('str', Schema([StringIndex('key')],
+                                                       [StringIndex('value')]))
+        self.sdb.memtable = 'btree'
+        assert self.env.open()
+
+    def test_btree_memtable(self):
+        db = self.db
+        self.assertEqual(db.memtable, 'btree')
+        keys = list(range(2000))
+        random.shuffle(keys)
+        for i in keys:
+            db[i] = 'v%s' % i
+        for i in range(0, 2000, 3):
+            db[i] = 'u%s' % i
+        for i in range(0, 2000, 5):
+            del db[i]
+
+        def expected(i):
+            return ('u%s' if i % 3 == 0 else 'v%s') % i
+        live = [i for i in range(2000) if i % 5]
+        self.assertEqual([k for k, _ in db], live)
+        self.assertEqual([k for k, _ in db[::True]], live[::-1])
+        self.assertEqual(list(db[10:14]), [(i, expected(i)) for i in
+                                           (11, 12, 13, 14)])
+        self.assertEqual([k for k, _ in db[14:10:True]], [14, 13, 12, 11])
+        self.assertEqual([k for k, _ in db.cursor(order='>', key=10)][:2],
+                         [11, 12])
+        self.assertEqual([k for k, _ in db.cursor(order='<', key=10)][:2],
+                         [9, 8])
+        self.assertEqual(db[3], 'u3')
+        self.assertRaises(KeyError, lambda: db[5])
+
+        # Older versions remain visible to a transaction started earlier.
+        txn = self.env.transaction()
+        txn.begin()
+        db[1] = 'new'
+        self.assertEqual(txn[db][1], 'v1')
+        txn.rollback(False)
+        self.assertEqual(db[1], 'new')
+
+        self.checkpoint(db)
+        self.assertEqual(len(db), len(live))
+        self.assertEqual(db[1], 'new')
+        self.assertTrue(self.env.close())
+        self.assertTrue(self.env.open())
+        self.assertEqual([k for k, _ in db][:3], [1, 2, 3])
+        self.assertEqual(db[1999], 'v1999')
+
+    def test_btree_memtable_strings(self):
+        sdb = self.sdb
+        keys = ['k%04d' % i for i in range(500)] + ['k', 'k0', 'a' * 40]
+        random.shuffle(keys)
+        for key in keys:
+            sdb[key] = key
+        self.assertEqual([k for k, _ in sdb], sorted(keys))
+        self.assertEqual([k for k, _ in sdb['k0':'k0001']],
+                         ['k0', 'k0000', 'k0001'])
+        self.assertEqual(sdb['a' * 40], 'a' * 40)
+
+    def test_memtable_setting(self):
+        self.assertTrue(self.env.close())
+        self.db.memtable = 'skiplist'
+        self.assertRaises(SophiaError, self.env.open)
+        self.db.memtable = 'rbtree'
+        self.assertTrue(self.env.open())
+        self.assertEqual(self.db.memtable, 'rbtree')
+
+
+@unittest.skipIf(asyncio is None, 'asyncio is not available')
+class TestAsyncSophia(BaseTestCase):
+    databases = (
+        ('main', Schema([U64Index('key')], [StringIndex('value')])),
+    )
+
+    def setUp(self):
+        super(TestAsyncSophia, self).setUp()
+        self.loop = asyncio.new_event_loop()
+        self.aenv = AsyncSophia(self.env, workers=2, loop=self.loop)
+        self.run(self.aenv.open())
+        self.db = self.aenv['main']
+
+    def tearDown(self):
+        self.loop.close()
+        super(TestAsyncSophia, self).tearDown()
+
+    def run(self, awaitable):
+        return self.loop.run_until_complete(awaitable)
+
+    def test_async_crud(self):
+        db = self.db
+        self.assertTrue(self.aenv.inline_writes)
+        for i in range(100):
+            self.run(db.set(i, 'v%s' % i))
+
+        # Keys in the in-memory index are returned without a thread hop.
+        fut = db.get(1)
+        self.assertTrue(fut.done())
+        self.assertEqual(self.run(fut), 'v1')
+        self.assertEqual(self.run(db.get(1000, 'default')), 'default')
+
+        # Keys stored in node files are looked up by the workers, in batches.
+        self.checkpoint(self.env['main'])
+        futs = [db.get(i) for i in range(0, 100, 7)]
+        self.assertFalse(futs[0].done())
+        self.assertEqual(self.run(asyncio.gather(*futs)),
+                         ['v%s' % i for i in range(0, 100, 7)])
+        self.assertEqual(self.run(db.multi_get([3, 1000, 4])),
+                         ['v3', None, 'v4'])
+
+        self.run(db.delete(3))
+        self.assertEqual(self.run(db.get(3)), None)
+        self.assertEqual(self.run(db.get(4)), 'v4')
+
+    def test_async_cursor(self):
+        db = self.db
+        for i in range(50):
+            self.run(db.set(i, 'v%s' % i))
+
+        def collect(cursor):
+            rows = []
+            it = cursor.__aiter__()
+            while True:
+                try:
+                    rows.append(self.run(it.__anext__()))
+                except StopAsyncIteration:
+                    return rows
+        self.assertEqual(collect(db.cursor(chunk_size=8)),
+                         [(i, 'v%s' % i) for i in range(50)])
+        self.assertEqual(collect(db.cursor(order='<', key=5, keys=False)),
+                         ['v4', 'v3', 'v2', 'v1', 'v0'])
+
+    def test_async_transaction(self):
+        db = self.db
+        self.run(db.set(1, 'v1'))
+        txn = self.aenv.transaction()
+        self.run(txn.__aenter__())
+        tdb = txn[db]
+        self.run(tdb.set(2, 'v2'))
+        self.assertEqual(self.run(tdb.get(2)), 'v2')
+        self.assertEqual(self.run(db.get(2)), None)
+        self.run(txn.__aexit__(None, None, None))
+        self.assertEqual(self.run(db.get(2)), 'v2')
+
+        txn = self.aenv.transaction().begin()
+        self.run(txn[db].delete(1))
+        self.run(txn.rollback())
+        self.assertEqual(self.run(db.get(1)), 'v1')
+
+    def test_async_open_close(self):
+        self.assertTrue(self.run(self.aenv.close()))
+        self.assertFalse(self.env.is_open)
+        self.assertTrue(self.run(self.aenv.open()))
+        self.assertEqual(self.run(self.db.get(1, 'missing')), 'missing')
+
+
+class TestBulkLoad(BaseTestCase):
+    def setUp(self):
+        cleanup()
+        self.env = self.create_env()
+        self.db = self.env.add_database('main', Schema([U64Index('key')],
+                                                       [StringIndex('value')]))
+        self.db.compaction_node_size = 1024 * 1024
+        assert self.env.open()
+
+    def test_bulk_load(self):
+        db = self.db
+        n = db.bulk_load((i, 'value-%08d' % i) for i in range(50000))
+        self.assertEqual(n, 50000)
+        self.assertEqual(db.index_memory_used, 0)
+        self.assertTrue(db.index_node_count > 1)
+        self.assertEqual(db[0], 'value-00000000')
+        self.assertEqual(db[49999], 'value-00049999')
+        self.assertEqual([k for k, _ in db[100:102]], [100, 101, 102])
+
+        db[50000] = 'x'
+        self.assertRaises(SophiaError, db.bulk_load, [(50001, 'y')])
+
+        self.assertTrue(self.env.close())
+        self.assertTrue(self.env.open())
+        db = self.env['main']
+        self.assertEqual(db[25000], 'value-00025000')
+        self.assertEqual(db[50000], 'x')
+        self.assertEqual(len(list(db.keys())), 50001)
+
+    def test_bulk_load_order(self):
+        db = self.db
+        self.assertRaises(SophiaError, db.bulk_load, [(2, 'b'), (1, 'a')])
+        self.assertFalse(2 in db)
+
+        self.assertEqual(db.bulk_load({3: 'c', 1: 'a', 2: 'b'}, sort=True), 3)
+        self.assertEqual(list(db), [(1, 'a'), (2, 'b'), (3, 'c')])
+
+    def test_bulk_load_sort_engine_order(self):
+        self.env.close()
+        rev = self.env.add_database('rev', Schema([U32RevIndex('key')],
+                                                  [StringIndex('value')]))
+        js = self.env.add_database('js', Schema([JsonIndex('key')],
+                                                [StringIndex('value')]))
+        self.assertTrue(self.env.open())
+
+        # Reverse-ordered keys are stored descending.
+        self.assertEqual(rev.bulk_load({1: 'a', 3: 'c', 2: 'b'}, sort=True), 3)
+        self.assertEqual(list(rev), [(3, 'c'), (2, 'b'), (1, 'a')])
+
+        # Serialized keys are stored in the order of their encoded bytes.
+        self.assertEqual(js.bulk_load({2: 'b', 10: 'j', 1: 'a'}, sort=True), 3)
+        self.assertEqual(list(js), [(1, 'a'), (10, 'j'), (2, 'b')])
+
+    def test_bulk_load_read_view(self):
+        db = self.db
+        txn = self.env.transaction()
+        txn.begin()
+        views = []
+
+        def rows():
+            yield (1, 'a')
+            views.append(self.env.transaction())
+            views[0].begin()
+            yield (2, 'b')
+
+        # A transaction opened during the load would see the rows appear.
+        self.assertRaises(SophiaError, db.bulk_load, rows())
+        self.assertFalse(1 in db)
+        views[0].rollback(False)
+
+        # One opened before the load began does not see them at all.
+        self.assertEqual(db.bulk_load([(1, 'a'), (2, 'b')]), 2)
+        self.assertEqual(list(db), [(1, 'a'), (2, 'b')])
+        self.assertRaises(KeyError, lambda: txn[db][1])
+        txn.rollback(False)
+
+
+class TestUpsert(BaseTestCase):
+    def setUp(self):
+        cleanup()
+        self.env = self.create_env()
+        self.add_databases()
+        assert self.env.open()
+
+    def add_databases(self):
+        counters = self.env.add_database('counters', Schema(
+            [StringIndex('key')], [U64Index('value')]))
+        counters.upsert_operator = 'add'
+        high = self.env.add_database('high', Schema(
+            [StringIndex('key')], [U32Index('value')]))
+        high.upsert_operator = 'max'
+        log = self.env.add_database('log', Schema(
+            [StringIndex('key')], [BytesIndex('value')]))
+        log.upsert_operator = 'append_string'
+        log.upsert_limit = 8
+
+    def test_upsert(self):
+        counters = self.env['counters']
+        for i in range(10):
+            counters.upsert('k%d' % (i % 2), i)
+        self.assertEqual(counters['k0'], 20)
+        self.assertEqual(counters['k1'], 25)
+        self.checkpoint(counters)
+        counters.upsert('k0', 5)
+        self.assertEqual(counters['k0'], 25)
+
+        high = self.env['high']
+        for value in (3, 9, 1, 4):
+            high.upsert('k', value)
+        self.assertEqual(high['k'], 9)
+
+        log = self.env['log']
+        for value in (b'ab', b'cd', b'ef'):
+            log.upsert('k', value)
+        self.assertEqual(log['k'], b'abcdef')
+        log.upsert('k', b'gh')
+        log.upsert('k', b'ij')
+        self.assertEqual(log['k'], b'cdefghij')
+
+        # Reopen the environment without configuring the operators, they
+        # are recovered from the database scheme.
+        self.assertTrue(self.env.close())
+        self.env = self.create_env()
+        counters = self.env.add_database('counters', Schema(
+            [StringIndex('key')], [U64Index('value')]))
+        self.assertTrue(self.env.open())
+        self.assertEqual(counters.upsert_operator, 'add')
+        counters.upsert('k0', 1)
+        self.assertEqual(counters['k0'], 26)
+
+    def test_upsert_transaction(self):
+        counters = self.env['counters']
+        counters['k'] = 1
+        txn1 = self.env.transaction()
+        txn2 = self.env.transaction()
+        txn1[counters].upsert('k', 2)
+        txn2[counters].upsert('k', 3)
+        txn1.commit()
+        txn2.commit()
+        self.assertEqual(counters['k'], 6)
+
+    def test_upsert_errors(self):
+        self.assertTrue(self.env.close())
+        cleanup()
+        self.env = self.create_env()
+        db = self.env.add_database('main', Schema([StringIndex('key')],
+                                                  [StringIndex('value')]))
+        self.assertTrue(self.env.open())
+        self.assertRaises(SophiaError, db.upsert, 'k', 'v')
+        self.assertTrue(self.env.close())
+
+        # Numeric operators cannot be used with string values.
+        cleanup()
+        env = self.create_env()
+        db = env.add_database('main', Schema([StringIndex('key')],
+                                             [StringIndex('value')]))
+        db.upsert_operator = 'add'
+        self.assertRaises(SophiaError, env.open)
+
+        cleanup()
+        self.env = self.create_env()
+        self.add_databases()
+        self.assertTrue(self.env.open())
+
+
 class TestBasicOperations(BaseTestCase):
     def test_crud(self):
         db = self.env['main']
@@ -161,6 +1261,29 @@ class TestBasicOperations(BaseTestCase):
         self.assertEqual(list(db), [('k0', 'v0-e'), ('k1', 'v1'), ('k2', 'v2'),
                                     ('k3', 'v3-e'), ('k99', 'v99-e')])
 
+    def test_multi_get_batch(self):
+        db = self.env['main']
+        for i in range(0, 1000, 2):
+            db['k%03d' % i] = 'v%03d' % i
+        self.checkpoint(db)
+        db['k000'] = 'v000-e'
+
+        # Results follow the order of the keys, including repeats and misses.
+        keys = ['k%03d' % i for i in range(999, -1, -1)] + ['k500', 'k999']
+        expected = [None if i % 2 else 'v%03d' % i
+                    for i in range(999, -1, -1)] + ['v500', None]
+        expected[-3] = 'v000-e'
+        self.assertEqual(db.multi_get(keys), expected)
+        self.assertEqual(db.multi_get([]), [])
+        self.assertEqual(db.multi_get_dict(iter(['k002', 'k003', 'k000'])),
+                         {'k000': 'v000-e', 'k002': 'v002'})
+
+        with self.env.transaction() as txn:
+            tdb = txn[db]
+            tdb['k001'] = 'v001-t'
+            self.assertEqual(tdb.multi_get(['k003', 'k001', 'k002']),
+                             [None, 'v001-t', 'v002'])
+
     def test_get_range(self):
         db = self.env['main']
         for i in range(4):
@@ -503,6 +1626,165 @@ class TestCursorOptions(BaseTestCase):
         assertCursor(db.cursor(prefix='evt:', order='<='), [])
 
 
+class TestCursorReadahead(BaseTestCase):
+    def setUp(self):
+        cleanup()
+        self.env = self.create_env()
+        self.db = self.env.add_database('main', Schema([U64Index('key')],
+                                                       [BytesIndex('value')]))
+        self.db.mmap = 0
+        self.db.compaction_node_size = 512 * 1024
+        self.db.compaction_page_size = 8192
+        assert self.env.open()
+
+    def test_cursor_readahead(self):
+        db = self.db
+        for i in range(20000):
+            db[i] = b'v' * 64
+        self.checkpoint(db)
+        self.assertTrue(db.index_node_count > 1)
+        db[100] = b'memory'
+
+        expected = list(db.cursor())
+        self.assertEqual(len(expected), 20000)
+        self.assertEqual(list(db.cursor(readahead_pages=8)), expected)
+        self.assertEqual(list(db.cursor(readahead_pages=1)), expected)
+        self.assertEqual(list(db.cursor(order='<', readahead_pages=8)),
+                         expected[::-1])
+        self.assertEqual(list(db.cursor(key=15000, keys=False,
+                                        readahead_pages=4))[:2],
+                         [b'v' * 64, b'v' * 64])
+        cursor = db.cursor(readahead_pages=16)
+        self.assertEqual(cursor.readahead_pages, 16)
+        self.assertRaises(ValueError, db.cursor, readahead_pages=-1)
+
+
+class TestCursorFetch(BaseTestCase):
+    databases = (
+        ('main', Schema([StringIndex('key')], [StringIndex('value')])),
+        ('multi', Schema([U64Index('k1'), StringIndex('k2')],
+                         [BytesIndex('v1'), U32Index('v2')])),
+        ('json', Schema(U64Index('key'), JsonIndex('value'))),
+        ('rev', Schema(U32RevIndex('key'), BytesIndex('value'))),
+    )
+
+    def test_fetchmany(self):
+        db = self.env['main']
+        db.update(('k%02d' % i, 'v%02d' % i) for i in range(25))
+        expected = list(db)
+
+        cursor = db.cursor()
+        self.assertEqual(cursor.fetchmany(10), expected[:10])
+        self.assertEqual(next(cursor), expected[10])
+        self.assertEqual(cursor.fetchmany(10), expected[11:21])
+        self.assertEqual(cursor.fetchmany(10), expected[21:])
+        self.assertEqual(cursor.fetchmany(10), [])
+
+        self.assertEqual(db.cursor(values=False).fetchmany(3),
+                         ['k00', 'k01', 'k02'])
+        self.assertEqual(db.cursor(keys=False, order='<').fetchmany(2),
+                         ['v24', 'v23'])
+        self.assertEqual(db.cursor(key='k20').fetchmany(100), expected[20:])
+        self.assertRaises(ValueError, db.cursor(buffers=True).fetchmany, 1)
+
+    def test_fetchmany_types(self):
+        multi = self.env['multi']
+        for i in range(10):
+            multi[i, 'x%s' % i] = (b'v%s' % i, i * 1000)
+        self.assertEqual(multi.cursor().fetchmany(3), [
+            ((0, 'x0'), (b'v0', 0)),
+            ((1, 'x1'), (b'v1', 1000)),
+            ((2, 'x2'), (b'v2', 2000))])
+
+        jdb = self.env['json']
+        jdb[1] = {'k': [1, 2]}
+        jdb[2] = 'two'
+        self.assertEqual(jdb.cursor().fetchmany(5),
+                         [(1, {'k': [1, 2]}), (2, 'two')])
+
+    def test_chunked_cursor(self):
+        db = self.env['main']
+        db.update(('k%03d' % i, 'v%03d' % i) for i in range(250))
+        expected = list(db)
+        for chunk_size in (1, 7, 100, 1000):
+            cursor = db.cursor(chunk_size=chunk_size)
+            self.assertEqual(cursor.chunk_size, chunk_size)
+            self.assertEqual(list(cursor), expected)
+
+        cursor = db.cursor(chunk_size=100)
+        it = iter(cursor)
+        self.assertEqual(next(it), expected[0])
+        self.assertEqual(cursor.fetchmany(150), expected[1:151])
+        self.assertEqual(list(it), expected[151:])
+
+        self.assertEqual(list(db.cursor(order='<', values=False,
+                                        chunk_size=16)),
+                         [k for k, _ in reversed(expected)])
+        self.assertRaises(ValueError, db.cursor, chunk_size=-1)
+        self.assertRaises(ValueError, db.cursor, chunk_size=10, buffers=True)
+
+    def test_count(self):
+        db = self.env['main']
+        self.assertEqual(db.count(), 0)
+        self.assertEqual(len(db), 0)
+        db.update(('k%02d' % i, 'v%02d' % i) for i in range(20))
+        self.assertEqual(db.count(), 20)
+        self.assertEqual(len(db), 20)
+        self.assertEqual(db.count('k05'), 15)
+        self.assertEqual(db.count(stop='k05'), 6)
+        self.assertEqual(db.count('k05', 'k09'), 5)
+        self.assertEqual(db.count('k05', 'k05'), 1)
+        self.assertEqual(db.count('k045', 'k095'), 5)
+        self.assertEqual(db.count('k09', 'k05'), 0)
+        self.assertEqual(db.count(stop='k'), 0)
+        self.assertEqual(db.count('k1'), 10)
+
+        multi = self.env['multi']
+        for i in range(3):
+            for j in range(3):
+                multi[i, 'x%s' % j] = (b'v', 0)
+        self.assertEqual(multi.count(), 9)
+        self.assertEqual(multi.count((1, 'x1'), (2, 'x0')), 3)
+        self.assertEqual(multi.count(stop=(0, 'x2')), 3)
+
+        rev = self.env['rev']
+        for i in range(10):
+            rev[i] = b'v'
+        self.assertEqual(rev.count(), 10)
+        self.assertEqual(rev.count(7, 3), 5)
+        self.assertEqual(rev.count(3, 7), 0)
+
+        del db['k00']
+        self.checkpoint(db)
+        db['k50'] = 'v50'
+        self.assertEqual(db.count(), 20)
+        self.assertEqual(db.count('k10', 'k50'), 11)
+
+    def test_stats(self):
+        db = self.env['main']
+        db.update(('k%02d' % i, 'v%02d' % i) for i in range(20))
+        for i in range(30):
+            db.get('k%02d' % i)
+        del db['k00']
+        list(db.cursor())
+
+        stats = db.stats()
+        self.assertEqual(stats['set']['count'], 20)
+        self.assertEqual(stats['delete']['count'], 1)
+        keys = ['count', 'p50', 'p90', 'p99', 'p999', 'max']
+        for name in ('set', 'delete', 'cursor'):
+            latency = stats[name]['latency']
+            self.assertEqual(sorted(latency), sorted(keys))
+            self.assertTrue(latency['count'] >= 1)
+            self.assertTrue(latency['p50'] <= latency['p99'] <=
+                            latency['max'])
+        self.assertEqual(stats['get']['memory']['count'], 30)
+
+        env_stats = self.env.stats()
+        self.assertEqual(env_stats['databases']['main']['set']['count'], 20)
+        self.assertTrue(env_stats['log']['write']['count'] >= 2)
+
+
 class TestMultipleDatabases(BaseTestCase):
     databases = (
         ('main', Schema([StringIndex('key')], [StringIndex('value')])),
@@ -574,6 +1856,256 @@ class TestMultipleDatabases(BaseTestCase):
         self.assertEqual(db['k1'], 'v1')
 
 
+class TestSnapshot(BaseTestCase):
+    databases = (
+        ('main', Schema([StringIndex('key')], [StringIndex('value')])),
+        ('secondary', Schema([StringIndex('key')], [StringIndex('value')])),
+    )
+
+    def test_snapshot(self):
+        main = self.env['main']
+        scnd = self.env['secondary']
+        main.update(dict(('k%02d' % i, 'v%s' % i) for i in range(20)))
+        scnd.update(k1='s1', k2='s2')
+
+        snap = self.env.snapshot()
+        self.assertEqual(self.env.transaction_online_ro, 1)
+        self.assertEqual(self.env.transaction_vlsn, snap.lsn)
+
+        main['k00'] = 'v0-e'
+        del main['k01']
+        main['k20'] = 'v20'
+        scnd['k3'] = 's3'
+        self.checkpoint(main)
+
+        s_main = snap[main]
+        s_scnd = snap[scnd]
+        self.assertEqual(s_main['k00'], 'v0')
+        self.assertEqual(s_main['k01'], 'v1')
+        self.assertFalse('k20' in s_main)
+        self.assertEqual(s_main.multi_get(['k00', 'k01', 'k20']),
+                         ['v0', 'v1', None])
+        self.assertEqual(list(s_main), [('k%02d' % i, 'v%s' % i)
+                                        for i in range(20)])
+        self.assertEqual(list(s_main.get_range('k05', 'k07')),
+                         [('k05', 'v5'), ('k06', 'v6'), ('k07', 'v7')])
+        self.assertEqual(len(s_main), 20)
+        self.assertEqual(list(s_scnd), [('k1', 's1'), ('k2', 's2')])
+        self.assertRaises(SophiaError, s_main.set, 'k00', 'x')
+        self.assertRaises(SophiaError, s_main.delete, 'k00')
+        self.assertRaises(SophiaError, s_main.update, k00='x')
+
+        # Database handles see the latest data.
+        self.assertEqual(main['k00'], 'v0-e')
+        self.assertEqual(len(main), 20)
+
+        snap.release()
+        self.assertTrue(snap.lsn is None)
+        self.assertEqual(self.env.transaction_online_ro, 0)
+        self.assertTrue(self.env.transaction_vlsn > 0)
+        self.assertRaises(SophiaError, lambda: s_main['k00'])
+
+    def test_context_manager(self):
+        main = self.env['main']
+        main['k1'] = 'v1'
+        with self.env.snapshot() as snap:
+            main['k1'] = 'v1-e'
+            self.assertEqual(snap[main]['k1'], 'v1')
+            with self.env.transaction() as txn:
+                txn[main]['k1'] = 'v1-t'
+            self.assertEqual(snap[main]['k1'], 'v1')
+        self.assertEqual(self.env.transaction_online_ro, 0)
+        self.assertEqual(main['k1'], 'v1-t')
+
+
+class TestShardedDatabase(BaseTestCase):
+    databases = (
+        ('main', Schema([StringIndex('key')], [U64Index('value')])),
+    )
+
+    def setUp(self):
+        cleanup()
+        self.env = self.create_env()
+        self.env.add_database(
+            'sharded', Schema([U64Index('a'), StringIndex('b')],
+                              [StringIndex('value')]), shards=4)
+        self.env.add_database(
+            'kv', Schema([StringIndex('key')], [U64Index('value')]),
+            shards=3)
+        self.env['sharded'].compression = 'lz4'
+        assert self.env.open()
+        self.db = self.env['sharded']
+
+    def test_point_operations(self):
+        db = self.db
+        self.assertEqual(len(db.shards), 4)
+        self.assertEqual(db.compression, 'lz4')
+        self.assertEqual([shard.compression for shard in db.shards],
+                         ['lz4'] * 4)
+
+        for i in range(200):
+            db[(i % 7, 'k%03d' % i)] = 'v%s' % i
+        self.assertEqual(db[(3, 'k010')], 'v10')
+        self.assertTrue((3, 'k010') in db)
+        self.assertFalse((4, 'k010') in db)
+        self.assertEqual(db.get((4, 'k010'), 'missing'), 'missing')
+
+        # Keys are spread over every shard.
+        counts = [shard.count() for shard in db.shards]
+        self.assertEqual(sum(counts), 200)
+        self.assertTrue(all(counts))
+        self.assertEqual(len(db), 200)
+
+        del db[(3, 'k010')]
+        self.assertRaises(KeyError, lambda: db[(3, 'k010')])
+        self.assertEqual(db.multi_get([(0, 'k000'), (3, 'k010'),
+                                       (1, 'k001')]),
+                         ['v0', None, 'v1'])
+
+        kv = self.env['kv']
+        kv.update(dict(('k%02d' % i, i) for i in range(30)))
+        self.assertEqual(kv['k01'], 1)
+        self.assertEqual(kv.multi_get_dict(['k05', 'k06', 'kx']),
+                         {'k05': 5, 'k06': 6})
+
+    def test_ordered_cursor(self):
+        kv = self.env['kv']
+        data = [('k%03d' % i, i) for i in range(300)]
+        random.shuffle(data)
+        for key, value in data:
+            kv[key] = value
+        data.sort()
+
+        self.assertEqual(list(kv), data)
+        self.assertEqual(list(kv.keys()), [k for k, _ in data])
+        self.assertEqual(list(kv.values()), [v for _, v in data])
+        self.assertEqual(list(kv.cursor(order='<=')), data[::-1])
+        self.assertEqual(list(kv.cursor(order='>', key='k100'))[:2],
+                         [('k101', 101), ('k102', 102)])
+        self.assertEqual(list(kv.cursor(order='<', key='k100'))[:2],
+                         [('k099', 99), ('k098', 98)])
+        self.assertEqual(list(kv.cursor(prefix='k01')), data[10:20])
+        self.assertEqual(list(kv['k010':'k013']), data[10:14])
+        self.assertEqual(list(kv.get_range('k013', 'k010', True)),
+                         data[10:14][::-1])
+        self.assertEqual(kv.count('k100', 'k199'), 100)
+
+        cursor = kv.cursor(readahead_pages=4)
+        self.assertEqual(cursor.fetchmany(5), data[:5])
+        self.assertEqual(cursor.fetchmany(1000), data[5:])
+        self.assertEqual(cursor.fetchmany(5), [])
+        self.assertRaises(ValueError, kv.cursor, buffers=True)
+
+        for shard in kv.shards:
+            self.checkpoint(shard)
+        self.assertEqual(list(kv), data)
+
+        del kv['k010':'k019']
+        self.assertEqual(len(kv), 290)
+        kv.delete_range('k200', 'k300')
+        self.assertEqual(list(kv)[-1], ('k199', 199))
+
+    def test_transaction(self):
+        kv = self.env['kv']
+        with self.env.transaction() as txn:
+            tkv = txn[kv]
+            for i in range(20):
+                tkv['k%02d' % i] = i
+            self.assertEqual(tkv['k05'], 5)
+            self.assertFalse('k05' in kv)
+        self.assertEqual(list(kv.values()), list(range(20)))
+
+        txn = self.env.transaction()
+        txn.begin()
+        txn[kv]['k05'] = 50
+        txn[kv]['k06'] = 60
+        del txn[kv]['k07']
+        txn.rollback()
+        self.assertEqual(kv.multi_get(['k05', 'k06', 'k07']), [5, 6, 7])
+
+    def test_snapshot(self):
+        kv = self.env['kv']
+        kv.update(dict(('k%02d' % i, i) for i in range(20)))
+        with self.env.snapshot() as snap:
+            kv['k00'] = 100
+            del kv['k01']
+            skv = snap[kv]
+            self.assertEqual(skv['k00'], 0)
+            self.assertEqual(skv['k01'], 1)
+            self.assertEqual(list(skv.values()), list(range(20)))
+            self.assertRaises(SophiaError, skv.set, 'k00', 1)
+            self.assertRaises(SophiaError, skv.update, k00=1)
+        self.assertEqual(kv['k00'], 100)
+        self.assertEqual(len(kv), 19)
+
+    def test_bulk_load_and_reopen(self):
+        kv = self.env['kv']
+        data = [('k%03d' % i, i) for i in range(500)]
+        self.assertEqual(kv.bulk_load(data), 500)
+        self.assertEqual(list(kv), data)
+
+        self.env.close()
+        self.env.open()
+        kv = self.env['kv']
+        self.assertEqual(list(kv), data)
+        self.assertEqual(kv['k123'], 123)
+        self.assertEqual(len(kv.stats()['shards']), 3)
+
+    def test_bulk_load_rejected(self):
+        # The duplicate is rejected before any shard is committed.
+        kv = self.env['kv']
+        data = [('k%03d' % i, i) for i in range(100)] + [('k099', 0)]
+        self.assertRaises(SophiaError, kv.bulk_load, data)
+        self.assertEqual(len(kv), 0)
+        self.assertEqual(kv.bulk_load(data[:-1]), 100)
+        self.assertEqual(len(kv), 100)
+
+    def test_combined_stats(self):
+        kv = self.env['kv']
+        kv.update(dict(('k%03d' % i, i) for i in range(300)))
+        self.assertEqual(kv.index_count, 300)
+        self.assertEqual(kv.index_count,
+                         sum(shard.index_count for shard in kv.shards))
+        self.assertEqual(kv.index_memory_used,
+                         sum(shard.index_memory_used for shard in kv.shards))
+        self.assertRaises(SophiaError, lambda: kv.database_id)
+        self.assertRaises(SophiaError, lambda: kv.stat_get_latency)
+        self.assertRaises(SophiaError, lambda: kv.compression_dict)
+        self.assertEqual(kv.scheduler_checkpoint, 0)
+
+        for i in range(300):
+            kv['k%03d' % i]
+        for i in range(30):
+            kv['x%02d' % i] = i
+        stats = kv.stats()
+        self.assertEqual(len(stats['shards']), 3)
+        self.assertEqual(stats['set']['count'], 30)
+        self.assertEqual(stats['get']['count'], 300)
+        self.assertEqual(stats['get']['count'],
+                         sum(s['get']['count'] for s in stats['shards']))
+        self.assertEqual(stats['set']['latency']['max'],
+                         max(s['set']['latency']['max']
+                             for s in stats['shards']))
+        self.assertEqual(sorted(k for k in stats if k != 'shards'),
+                         sorted(kv.shards[0].stats()))
+
+    def test_shard_count_persisted(self):
+        kv = self.env['kv']
+        kv['k1'] = 1
+        schema = Schema([StringIndex('key')], [U64Index('value')])
+        self.assertTrue(self.env.close())
+
+        self.env.remove_database('kv')
+        self.env.add_database('kv', schema, shards=5)
+        self.assertRaises(SophiaError, self.env.open)
+
+        self.env.remove_database('kv')
+        kv = self.env.add_database('kv', schema, shards=3)
+        self.assertTrue(self.env.open())
+        self.assertEqual(kv['k1'], 1)
+        self.assertEqual(len(kv), 1)
+
+
 class TestMultiKeyValue(BaseTestCase):
     databases = (
         ('main',
@@ -682,6 +2214,65 @@ class TestMultiKeyValue(BaseTestCase):
         self.assertEqual(nums[1], (0, 0, 0, 0, 255))
 
 
+class TestKeyCompare(BaseTestCase):
+    databases = (
+        ('u64', Schema([U64Index('key')], [U8Index('value')])),
+        ('u32rev', Schema([U32RevIndex('key')], [U8Index('value')])),
+        ('string', Schema([StringIndex('key')], [U8Index('value')])),
+    )
+
+    def test_single_key_order(self):
+        keys = list(range(0, 4000, 2))
+        random.shuffle(keys)
+        u64, u32rev, string = (self.env[name] for name in
+                               ('u64', 'u32rev', 'string'))
+        for key in keys:
+            u64[key] = u32rev[key] = string['%06d' % key] = 1
+
+        # Ordering and seeks must agree in memory and on disk.
+        for do_checkpoint in (False, True):
+            if do_checkpoint:
+                for db in (u64, u32rev, string):
+                    self.checkpoint(db)
+            self.assertEqual(list(u64.keys()), sorted(keys))
+            self.assertEqual(list(u32rev.keys()), sorted(keys, reverse=True))
+            self.assertEqual([k for k, _ in u64[101:106]], [102, 104, 106])
+            self.assertEqual([k for k, _ in u32rev[105:100]],
+                             [104, 102, 100])
+            self.assertEqual([k for k, _ in string['000101':'000104']],
+                             ['000102', '000104'])
+            self.assertEqual([k for k, _ in u64[3999:]], [])
+            self.assertEqual([k for k, _ in u32rev[3999:]][:1], [3998])
+            self.assertFalse(101 in u64)
+            self.assertTrue(3998 in u32rev)
+
+    def test_delete_slice_order(self):
+        u64, u32rev, string = (self.env[name] for name in
+                               ('u64', 'u32rev', 'string'))
+        for key in range(20):
+            u64[key] = u32rev[key] = string['%02d' % key] = 1
+
+        # Bounds follow the order of the index, the stop key is included.
+        del u32rev[15:10]
+        self.assertEqual(list(u32rev.keys()),
+                         [19, 18, 17, 16] + list(range(9, -1, -1)))
+        del u32rev[3:8]
+        self.assertEqual(list(u32rev.keys()),
+                         [19, 18, 17, 16, 9, 2, 1, 0])
+        del u64[15:10]
+        self.assertEqual(list(u64.keys()),
+                         list(range(10)) + list(range(16, 20)))
+        del string['05':'07']
+        self.assertEqual(list(string.keys())[4:6], ['04', '08'])
+
+        # The largest possible key has no successor.
+        u64[2 ** 64 - 1] = 1
+        del u64[17:]
+        self.assertEqual(list(u64.keys()), list(range(10)) + [16])
+        del u32rev[:0]
+        self.assertEqual(list(u32rev.keys()), [])
+
+
 class TestEventSchema(BaseTestCase):
     databases = (
         ('main',
@@ -834,6 +2425,57 @@ class TestStringVsBytes(BaseTestCase):
         self.assertEqual(self.bdb[b'\xff'], b'\xff')
 
 
+class LowerStringIndex(StringIndex):
+    pass
+
+
+class TestSchemaCodec(BaseTestCase):
+    databases = (
+        ('main',
+         Schema([U64Index('a'), U32RevIndex('b'), StringIndex('c')],
+                [BytesIndex('d'), U8Index('e'), JsonIndex('f'),
+                 LowerStringIndex('g')])),
+    )
+
+    def setUp(self):
+        super(TestSchemaCodec, self).setUp()
+        self.db = self.env['main']
+
+    def test_mixed_fields(self):
+        for i in range(20):
+            self.db[(i % 2, i, 'k%02d' % i)] = (
+                b'\xff%d' % i, i * 3, {'i': i}, u'\u2036%d' % i)
+
+        self.assertEqual(self.db[(1, 3, 'k03')],
+                         (b'\xff3', 9, {'i': 3}, u'\u20363'))
+        self.assertEqual(self.db[(1, 3, b'k03')],
+                         (b'\xff3', 9, {'i': 3}, u'\u20363'))
+        self.assertRaises(KeyError, lambda: self.db[(0, 3, 'k03')])
+        self.assertRaises(ValueError, lambda: self.db[(1, 3)])
+
+        # Second key field sorts in reverse.
+        keys = [k for k, _ in self.db.cursor()]
+        self.assertEqual(keys[:3], [(0, 18, 'k18'), (0, 16, 'k16'),
+                                    (0, 14, 'k14')])
+        self.assertEqual(len(keys), 20)
+
+        expected = list(self.db.cursor())
+        self.assertEqual(list(self.db.cursor(chunk_size=7)), expected)
+        self.assertEqual(self.db.cursor().fetchmany(30), expected)
+        self.assertEqual(list(self.db.cursor(keys=False, chunk_size=3)),
+                         [v for _, v in expected])
+
+        self.assertEqual(self.db.multi_get([(0, 2, 'k02'), (0, 3, 'k03')]),
+                         [(b'\xff2', 6, {'i': 2}, u'\u20362'), None])
+
+    def test_converted_values(self):
+        # Values are converted to the field type, as before compilation.
+        self.db[(1, 1, 10)] = ('x', 1, None, 20)
+        self.assertEqual(self.db[(1, 1, '10')], (b'x', 1, None, u'20'))
+        self.assertRaises(OverflowError, self.db.set, (-1, 0, 'k'),
+                          (b'', 0, None, u''))
+
+
 class TestSerializedIndex(BaseTestCase):
     databases = (
         ('main',
@@ -911,5 +2553,74 @@ class TestSerializedIndexImplementations(BaseTestCase):
         self.assertEqual(set(keys), set((u1, u2)))
 
 
+class TestBuffers(BaseTestCase):
+    databases = (
+        ('main', Schema(U64Index('key'), BytesIndex('value'))),
+        ('json', Schema(U64Index('key'), JsonIndex('value'))),
+    )
+
+    def test_get_buffers(self):
+        db = self.env['main']
+        db[1] = b'x' * 100000
+        db[2] = b'v2'
+
+        buf = db.get(1, buffers=True)
+        self.assertEqual(len(buf), 100000)
+        view = memoryview(buf)
+        self.assertTrue(view.readonly)
+        self.assertEqual(view[:3].tobytes(), b'xxx')
+        self.assertEqual(bytes(db.get(2, buffers=True)), b'v2')
+        self.assertTrue(db.get(3, buffers=True) is None)
+
+        # The document stays alive while the buffer is referenced.
+        db[1] = b'replaced'
+        self.assertEqual(view[-3:].tobytes(), b'xxx')
+        self.assertEqual(db[1], b'replaced')
+
+        jdb = self.env['json']
+        jdb[1] = {'k': [1, 2, 3]}
+        self.assertEqual(jdb.get(1, buffers=True), {'k': [1, 2, 3]})
+
+    def test_cursor_buffers(self):
+        db = self.env['main']
+        for i in range(10):
+            db[i] = b'v%d' % i
+
+        rows = [(k, bytes(v)) for k, v in db.cursor(buffers=True)]
+        self.assertEqual(rows, [(i, b'v%d' % i) for i in range(10)])
+
+        # Buffers are only valid for the current row.
+        held = [v for v in db.cursor(keys=False, buffers=True)]
+        self.assertRaises(ValueError, memoryview, held[0])
+
+        cursor = iter(db.cursor(keys=False, buffers=True))
+        view = memoryview(next(cursor))
+        self.assertRaises(BufferError, next, cursor)
+        view.release()
+        self.assertEqual(bytes(next(cursor)), b'v1')
+
+    def test_buffers_after_reopen(self):
+        db = self.env['main']
+        db[1] = b'v1'
+        db[2] = b'v2'
+        buf = db.get(1, buffers=True)
+        cursor = db.cursor(keys=False, buffers=True)
+        row = next(iter(cursor))
+
+        # Buffers do not outlive the environment they were read from, even
+        # once it is opened again.
+        self.assertTrue(self.env.close())
+        self.assertTrue(self.env.open())
+        self.assertRaises(ValueError, memoryview, buf)
+        self.assertRaises(ValueError, memoryview, row)
+        del buf
+
+        # Restarting a cursor invalidates the buffers of the previous pass.
+        row = next(iter(cursor))
+        self.assertEqual(bytes(row), b'v1')
+        self.assertEqual(bytes(next(iter(cursor))), b'v1')
+        self.assertRaises(ValueError, memoryview, row)
+
+
 if __name__ == '__main__':
     unittest.main(argv=sys.argv)